@@ -17,7 +17,6 @@
 
 #include <gflags/gflags.h>
 #include "libcgt/camera_wrappers/PoseStream.h"
-#include "libcgt/core/io/File.h"
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 #include "libcgt/core/vecmath/SimilarityTransform.h"
 #include "libcgt/core/vecmath/Quat4f.h"
@@ -25,6 +24,8 @@
 #include "third_party/Eigen/Eigen/Eigen"
 #include "third_party/Eigen/Eigen/Geometry"
 
+#include "../nvm_file.h"
+
 using libcgt::core::vecmath::compose;
 using libcgt::core::vecmath::EuclideanTransform;
 using libcgt::core::vecmath::SimilarityTransform;
@@ -77,10 +78,12 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  // Load NVM into memory.
-  std::vector<std::string> nvm =
-    File::readLines(FLAGS_nvm.c_str() );
-  int num_nvm_poses_cfw = atoi(nvm[1].c_str());
+  // Only the cameras take part in the alignment.
+  NVMModel nvm;
+  if (!ReadNVMFile(FLAGS_nvm, &nvm, false /* read_points */)) {
+    printf("Failed to read %s.\n", FLAGS_nvm.c_str());
+    return 1;
+  }
 
   // TODO: read filename to index map
   // extract basename out of nvm file
@@ -97,27 +100,14 @@ int main(int argc, char* argv[]) {
   std::unordered_map<int64_t, EuclideanTransform> nvm_poses_cfw;
 
   std::vector<std::pair<int32_t, int64_t>> nvm_timestamps;
-  for (int i = 0; i < num_nvm_poses_cfw; ++i) {
-    const std::string& line = nvm[2 + i];
-    std::vector< std::string > tokens;
-    pystring::split(line, tokens, " ");
-
+  for (const NVMCamera& camera : nvm.cameras) {
     // Parse filename.
     // TODO: this is a hack and not very robust.
-    auto ft = parseTimestampFromFilename(tokens[0]);
+    auto ft = parseTimestampFromFilename(camera.filename);
     nvm_timestamps.push_back(ft);
 
-    Quat4f q;
-    Vector3f c;
-
-    // Parse orientation.
-    for (int j = 0; j < 4; ++j) {
-        q[j] = static_cast<float>(atof(tokens[2 + j].c_str()));
-    }
-    // Parse camera center.
-    for (int j = 0; j < 3; ++j) {
-        c[j] = static_cast<float>(atof(tokens[6 + j].c_str()));
-    }
+    Quat4f q = camera.rotation;
+    Vector3f c = camera.center;
 
     // Convert translation from SfM convention (R * (x[0:2] - x[3] * c)) to
     // standard convention: [R, t]: R * x[0:2] + t.
@@ -9,6 +9,7 @@
 #include "src/rgbd_camera_parameters.h"
 #include "src/rgbd_input.h"
 #include "src/input_buffer.h"
+#include "src/perf_collector.h"
 
 #include "src/aruco/aruco_pose_estimator.h"
 #include "src/aruco/cube_fiducial.h"
@@ -107,4 +108,6 @@ int main(int argc, char* argv[]) {
     // Read next frame.
     rgbd_input.read(&input_buffer, &rgb_updated, &depth_updated);
   }
+
+  PerfCollector::Get().Report("", "");
 }
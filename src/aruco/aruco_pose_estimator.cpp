@@ -13,18 +13,19 @@
 // limitations under the License.
 #include "aruco_pose_estimator.h"
 
-#include <chrono>
-
-#include <gflags/gflags.h>
+#include <cassert>
+#include <cmath>
 
 #include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
 
 #include "libcgt/core/common/ArrayUtils.h"
-#include "libcgt/core/time/TimeUtils.h"
+#include "libcgt/core/vecmath/Vector4f.h"
 #include "libcgt/opencv_interop/ArrayUtils.h"
 #include "libcgt/opencv_interop/VecmathUtils.h"
 #include "libcgt/opencv_interop/Calib3d.h"
 
+#include "src/perf_collector.h"
 #include "src/rgbd_camera_parameters.h"
 
 using libcgt::core::arrayutils::copy;
@@ -35,8 +36,6 @@ using libcgt::opencv_interop::cvMatAsArray2DView;
 using libcgt::opencv_interop::fromCV3x3;
 using libcgt::opencv_interop::makeCameraMatrix;
 
-DECLARE_bool(collect_perf);
-
 bool ReadDetectorParameters(const std::string& filename,
   cv::aruco::DetectorParameters& params) {
     cv::FileStorage fs(filename, cv::FileStorage::READ);
@@ -99,32 +98,48 @@ ArucoPoseEstimator::Result ArucoPoseEstimator::EstimatePose(
   Array2DReadView<uint8x3> input,
   Array2DWriteView<uint8x3> vis) const {
 
-  std::chrono::high_resolution_clock::time_point t0;
-  std::chrono::high_resolution_clock::time_point t1;
-
-  if (FLAGS_collect_perf) {
-    t0 = std::chrono::high_resolution_clock::now();
+  cv::Mat bgr_mat = array2DViewAsCvMat(input);
+  ArucoPoseEstimator::Detection detection;
+  ArucoPoseEstimator::Result result;
+  {
+    ScopedCPUTimer timer("ArucoPoseEstimator::EstimatePose");
+    detection = Detect(bgr_mat);
+    Refine(bgr_mat, &detection);
+    result = EstimatePose(detection);
   }
 
-  cv::Mat bgr_mat = array2DViewAsCvMat(input);
-  ArucoPoseEstimator::Detection detection = Detect(bgr_mat);
-  Refine(bgr_mat, &detection);
-  ArucoPoseEstimator::Result result = EstimatePose(detection);
+  Visualize(input, detection, result, vis);
+  return result;
+}
 
-  if (FLAGS_collect_perf) {
-    t1 = std::chrono::high_resolution_clock::now();
-    printf("ArUco: pose estimation took %lld ms\n",
-      libcgt::core::time::dtMS(t0, t1));
-  }
+ArucoPoseEstimator::Result ArucoPoseEstimator::TrackPose(
+  Array2DReadView<uint8x3> input,
+  const EuclideanTransform& predicted_world_from_camera,
+  const TrackingOptions& options,
+  Array2DWriteView<uint8x3> vis) const {
+  assert(options.detection_scale > 0.0f && options.detection_scale <= 1.0f);
 
-  if (vis.notNull()) {
-    if (copy(input, vis)) {
-      //VisualizeDetections(detection, true, vis);
-      VisualizeDetections(detection, false, vis);
-      VisualizePoseEstimate(result, vis);
+  cv::Mat bgr_mat = array2DViewAsCvMat(input);
+  ArucoPoseEstimator::Detection detection;
+  ArucoPoseEstimator::Result result;
+  {
+    ScopedCPUTimer timer("ArucoPoseEstimator::TrackPose");
+    cv::Rect roi = ProjectedBoardRect(predicted_world_from_camera,
+      options.roi_margin, bgr_mat.size());
+    if (roi.area() > 0) {
+      detection = DetectInRegion(bgr_mat, roi, options.detection_scale);
+    }
+    if (detection.ids.empty()) {
+      PerfCollector::Get().IncrementCounter("aruco.full_frame_searches");
+      detection = Detect(bgr_mat);
+    } else {
+      PerfCollector::Get().IncrementCounter("aruco.tracked_searches");
     }
+    Refine(bgr_mat, &detection);
+    result = EstimatePose(detection);
   }
 
+  Visualize(input, detection, result, vis);
   return result;
 }
 
@@ -136,6 +151,92 @@ ArucoPoseEstimator::Detect(cv::Mat image) const {
   return result;
 }
 
+ArucoPoseEstimator::Detection ArucoPoseEstimator::DetectInRegion(
+  cv::Mat image, const cv::Rect& roi, float scale) const {
+  cv::Mat region = image(roi);
+  cv::Mat scaled_region = region;
+  if (scale < 1.0f) {
+    cv::resize(region, scaled_region, cv::Size(), scale, scale,
+      cv::INTER_AREA);
+  }
+  ArucoPoseEstimator::Detection result = Detect(scaled_region);
+
+  // Map pixel centers back to the full resolution region.
+  auto unscale = [scale](std::vector<cv::Point2f>& points) {
+    for (cv::Point2f& p : points) {
+      p = (p + cv::Point2f(0.5f, 0.5f)) / scale - cv::Point2f(0.5f, 0.5f);
+    }
+  };
+
+  cv::Mat gray_region;
+  if (scale < 1.0f && !result.corners.empty()) {
+    cv::cvtColor(region, gray_region, cv::COLOR_BGR2GRAY);
+  }
+  const cv::TermCriteria kSubPixCriteria(
+    cv::TermCriteria::COUNT | cv::TermCriteria::EPS, 30, 0.01);
+  const int kSubPixRadius = static_cast<int>(std::ceil(1.0f / scale)) + 1;
+  for (std::vector<cv::Point2f>& marker_corners : result.corners) {
+    unscale(marker_corners);
+    if (!gray_region.empty()) {
+      cv::cornerSubPix(gray_region, marker_corners,
+        cv::Size(kSubPixRadius, kSubPixRadius), cv::Size(-1, -1),
+        kSubPixCriteria);
+    }
+  }
+  for (std::vector<cv::Point2f>& marker_corners : result.rejected) {
+    unscale(marker_corners);
+  }
+
+  // Offset everything to image coordinates.
+  const cv::Point2f offset(static_cast<float>(roi.x),
+    static_cast<float>(roi.y));
+  for (std::vector<cv::Point2f>& marker_corners : result.corners) {
+    for (cv::Point2f& p : marker_corners) {
+      p += offset;
+    }
+  }
+  for (std::vector<cv::Point2f>& marker_corners : result.rejected) {
+    for (cv::Point2f& p : marker_corners) {
+      p += offset;
+    }
+  }
+  return result;
+}
+
+cv::Rect ArucoPoseEstimator::ProjectedBoardRect(
+  const EuclideanTransform& world_from_camera, float margin,
+  const cv::Size& image_size) const {
+  // The inverse of EstimatePose(): board points in the CV camera frame.
+  Matrix4f cv_camera_from_board =
+    rot_x_180_ * inverse(world_from_camera).asMatrix();
+
+  std::vector<cv::Point3f> camera_points;
+  for (const std::vector<cv::Point3f>& marker_points : board_.objPoints) {
+    for (const cv::Point3f& p : marker_points) {
+      Vector4f q = cv_camera_from_board * Vector4f(p.x, p.y, p.z, 1.0f);
+      if (q.z <= 0.0f) {
+        return cv::Rect();
+      }
+      camera_points.emplace_back(q.x, q.y, q.z);
+    }
+  }
+  if (camera_points.empty()) {
+    return cv::Rect();
+  }
+
+  std::vector<cv::Point2f> image_points;
+  cv::Mat zero = cv::Mat::zeros(3, 1, CV_64F);
+  cv::projectPoints(camera_points, zero, zero,
+    camera_intrinsics_, camera_dist_coeffs_, image_points);
+
+  cv::Rect box = cv::boundingRect(image_points);
+  int dx = static_cast<int>(margin * box.width);
+  int dy = static_cast<int>(margin * box.height);
+  box = cv::Rect(box.x - dx, box.y - dy,
+    box.width + 2 * dx, box.height + 2 * dy);
+  return box & cv::Rect(cv::Point(0, 0), image_size);
+}
+
 void ArucoPoseEstimator::Refine(cv::Mat image,
   ArucoPoseEstimator::Detection* result) const {
     cv::aruco::refineDetectedMarkers(image, board_,
@@ -183,6 +284,18 @@ ArucoPoseEstimator::Result ArucoPoseEstimator::EstimatePose(
   return pose;
 }
 
+void ArucoPoseEstimator::Visualize(Array2DReadView<uint8x3> input,
+  const Detection& detection, const Result& pose_estimate,
+  Array2DWriteView<uint8x3> vis) const {
+  if (vis.notNull()) {
+    if (copy(input, vis)) {
+      //VisualizeDetections(detection, true, vis);
+      VisualizeDetections(detection, false, vis);
+      VisualizePoseEstimate(pose_estimate, vis);
+    }
+  }
+}
+
 // static
 void ArucoPoseEstimator::VisualizeDetections(
   const ArucoPoseEstimator::Detection& detection,
@@ -60,6 +60,17 @@ class ArucoPoseEstimator {
     cv::Vec3d camera_from_board_translation;
   };
 
+  // How TrackPose() searches for the board.
+  struct TrackingOptions {
+    // The region of interest is the bounding box of the projected board,
+    // grown on each side by this fraction of its size.
+    float roi_margin = 0.25f;
+
+    // Markers are detected in the region of interest downscaled by this
+    // factor, in (0, 1]. Their corners are then refined at full resolution.
+    float detection_scale = 1.0f;
+  };
+
   // TODO: pass in a cv::aruco::DetectorParameters object instead of a
   // filename.
   ArucoPoseEstimator(const cv::aruco::Board& fiducial,
@@ -76,6 +87,15 @@ class ArucoPoseEstimator {
   Result EstimatePose(Array2DReadView<uint8x3> input,
     Array2DWriteView<uint8x3> vis = Array2DWriteView<uint8x3>()) const;
 
+  // Same as EstimatePose(), but only searches the region of interest where
+  // the board projects from predicted_world_from_camera (typically the
+  // previous frame's pose), optionally downscaled. Falls back to a full
+  // frame search if that finds no marker.
+  Result TrackPose(Array2DReadView<uint8x3> input,
+    const EuclideanTransform& predicted_world_from_camera,
+    const TrackingOptions& options,
+    Array2DWriteView<uint8x3> vis = Array2DWriteView<uint8x3>()) const;
+
 private:
 
   struct Detection {
@@ -86,6 +106,17 @@ private:
 
   Detection Detect(cv::Mat image) const;
 
+  // Same as Detect(), but only searches roi, downscaled by scale. Corners are
+  // returned in the coordinates of image.
+  Detection DetectInRegion(cv::Mat image, const cv::Rect& roi,
+    float scale) const;
+
+  // The bounding box of the board's markers projected from world_from_camera,
+  // grown by margin (see TrackingOptions) and clipped to image_size. Empty if
+  // part of the board is behind the camera.
+  cv::Rect ProjectedBoardRect(const EuclideanTransform& world_from_camera,
+    float margin, const cv::Size& image_size) const;
+
   // Refine the markers returned by Detect().
   // image must be the same as the one used in Detect().
   // detection is modified in place.
@@ -107,6 +138,11 @@ private:
   // For visualization.
   float axis_length_meters_;
 
+  // Copies input to vis and draws detection and pose_estimate over it, unless
+  // vis is null.
+  void Visualize(Array2DReadView<uint8x3> input, const Detection& detection,
+    const Result& pose_estimate, Array2DWriteView<uint8x3> vis) const;
+
   static void VisualizeDetections(const Detection& detection,
       bool show_rejected, Array2DWriteView<uint8x3> output);
 
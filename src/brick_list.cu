@@ -0,0 +1,85 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "brick_list.h"
+
+namespace {
+
+const int kBrickListThreads = 256;
+
+__global__
+void InsertBrickListKernel(BrickList src, int3 num_bricks,
+  bool with_neighbors, BrickList dst) {
+  const unsigned int size = *(src.size);
+  for (unsigned int i = blockIdx.x * blockDim.x + threadIdx.x; i < size;
+    i += gridDim.x * blockDim.x) {
+    int index = src.bricks[i];
+    if (!with_neighbors) {
+      dst.Insert(index);
+      continue;
+    }
+
+    int x = index % num_bricks.x;
+    int y = (index / num_bricks.x) % num_bricks.y;
+    int z = index / (num_bricks.x * num_bricks.y);
+    for (int dz = -1; dz <= 1; ++dz) {
+      for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+          int3 b = { x + dx, y + dy, z + dz };
+          if (b.x >= 0 && b.y >= 0 && b.z >= 0 && b.x < num_bricks.x &&
+            b.y < num_bricks.y && b.z < num_bricks.z) {
+            dst.Insert(b.x + num_bricks.x * (b.y + num_bricks.y * b.z));
+          }
+        }
+      }
+    }
+  }
+}
+
+// Only unsets the bits of the members, so that clearing a short list does
+// not touch the whole mask. Several members share a word: unset atomically.
+__global__
+void ClearBrickListBitsKernel(BrickList list) {
+  const unsigned int size = *(list.size);
+  for (unsigned int i = blockIdx.x * blockDim.x + threadIdx.x; i < size;
+    i += gridDim.x * blockDim.x) {
+    int index = list.bricks[i];
+    atomicAnd(&list.words[index / 32], ~(1u << (index % 32)));
+  }
+}
+
+}  // namespace
+
+BrickListStorage::BrickListStorage(int num_bricks) :
+  words_((num_bricks + 31) / 32),
+  bricks_(num_bricks),
+  size_(1) {
+  words_.fill(0);
+  size_.fill(0);
+}
+
+BrickList BrickListStorage::View() {
+  return{ words_.pointer(), bricks_.pointer(), size_.pointer() };
+}
+
+void BrickListStorage::InsertInto(const int3& num_bricks,
+  bool with_neighbors, BrickListStorage& dst, cudaStream_t stream) {
+  InsertBrickListKernel<<<kBrickListBlocks, kBrickListThreads, 0, stream>>>(
+    View(), num_bricks, with_neighbors, dst.View());
+}
+
+void BrickListStorage::Clear(cudaStream_t stream) {
+  ClearBrickListBitsKernel<<<kBrickListBlocks, kBrickListThreads, 0,
+    stream>>>(View());
+  cudaMemsetAsync(size_.pointer(), 0, sizeof(unsigned int), stream);
+}
@@ -0,0 +1,79 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef BRICK_LIST_H
+#define BRICK_LIST_H
+
+#include <cuda_runtime.h>
+#include <vector_types.h>
+
+#include "libcgt/cuda/DeviceArray1D.h"
+
+// A set of bricks of a regular grid that kernels build and consume without
+// the host knowing its size: a bitmask of the members, and their indices in
+// the order they were inserted. Bricks are numbered like DirtyBrickMask's, x
+// fastest.
+//
+// Kernels that visit the members read the size on the device, so they are
+// launched with a fixed grid of kBrickListBlocks blocks that stride over the
+// members, and cost next to nothing when the list is short.
+struct BrickList {
+  unsigned int* words;
+  int* bricks;
+  unsigned int* size;
+
+#ifdef __CUDACC__
+  __inline__ __device__
+  void Insert(int index) const {
+    unsigned int bit = 1u << (index % 32);
+    // Most inserts are of bricks that are already members: read first so
+    // that they do not contend on the atomic.
+    if ((words[index / 32] & bit) == 0 &&
+      (atomicOr(&words[index / 32], bit) & bit) == 0) {
+      bricks[atomicAdd(size, 1u)] = index;
+    }
+  }
+#endif
+};
+
+// The number of blocks to launch the kernels that visit a BrickList with.
+constexpr int kBrickListBlocks = 256;
+
+// Owns the storage of a BrickList that can hold every brick of a grid.
+class BrickListStorage {
+ public:
+
+  // Empty.
+  explicit BrickListStorage(int num_bricks);
+
+  BrickListStorage(const BrickListStorage& copy) = delete;
+  BrickListStorage& operator = (const BrickListStorage& copy) = delete;
+
+  BrickList View();
+
+  // Inserts the members of this list, and if with_neighbors, the (up to 26)
+  // bricks around each of them, into dst. Enqueued on stream.
+  void InsertInto(const int3& num_bricks, bool with_neighbors,
+    BrickListStorage& dst, cudaStream_t stream);
+
+  // Removes every member. Enqueued on stream.
+  void Clear(cudaStream_t stream);
+
+ private:
+
+  DeviceArray1D<unsigned int> words_;
+  DeviceArray1D<int> bricks_;
+  DeviceArray1D<unsigned int> size_;
+};
+
+#endif  // BRICK_LIST_H
@@ -0,0 +1,145 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "brick_mesh_cache.h"
+
+#include "libcgt/core/common/ArrayUtils.h"
+
+#include "marching_cubes.h"
+
+using libcgt::core::arrayutils::readViewOf;
+using libcgt::core::vecmath::SimilarityTransform;
+using std::vector;
+
+void BrickMeshCache::Reset(int num_bricks) {
+  bricks_.clear();
+  bricks_.resize(num_bricks);
+  positions_.clear();
+  normals_.clear();
+  slot_in_use_.clear();
+  free_slots_.clear();
+  shared_vertices_.clear();
+  mesh_ = TriangleMesh();
+  mesh_valid_ = false;
+}
+
+void BrickMeshCache::UpdateBrick(int brick_index,
+  Array3DReadView<TSDF> padded_brick, const Vector3i& brick_origin,
+  float max_tsdf_value, const SimilarityTransform& world_from_grid) {
+  BrickMesh& brick = bricks_[brick_index];
+  ReleaseBrick(brick);
+  EdgeKeyedMarchingCubes(padded_brick, brick_origin, max_tsdf_value,
+    world_from_grid, brick_positions_, brick_normals_, brick_faces_,
+    brick_shared_vertices_, brick.shared_keys);
+
+  // Vertices on the brick's faces may already be in use by a neighbor.
+  brick_slots_.assign(brick_positions_.size(), -1);
+  for (size_t i = 0; i < brick.shared_keys.size(); ++i) {
+    int v = brick_shared_vertices_[i];
+    auto inserted = shared_vertices_.insert(
+      { brick.shared_keys[i], SharedVertex{ -1, 0 } });
+    SharedVertex& shared = inserted.first->second;
+    if (inserted.second) {
+      shared.slot = AllocateSlot(brick_positions_[v], brick_normals_[v]);
+    }
+    ++shared.num_bricks;
+    brick_slots_[v] = shared.slot;
+  }
+  for (size_t v = 0; v < brick_positions_.size(); ++v) {
+    if (brick_slots_[v] < 0) {
+      brick_slots_[v] = AllocateSlot(brick_positions_[v], brick_normals_[v]);
+      brick.vertex_slots.push_back(brick_slots_[v]);
+    }
+  }
+
+  brick.faces.reserve(brick_faces_.size());
+  for (const Vector3i& face : brick_faces_) {
+    brick.faces.push_back(Vector3i(brick_slots_[face.x],
+      brick_slots_[face.y], brick_slots_[face.z]));
+  }
+  mesh_valid_ = false;
+}
+
+TriangleMesh BrickMeshCache::Mesh() {
+  if (mesh_valid_) {
+    return mesh_;
+  }
+
+  // Number the slots in use in order, skipping free ones.
+  vector<int> ids(positions_.size(), -1);
+  vector<Vector3f> positions;
+  vector<Vector3f> normals;
+  positions.reserve(positions_.size() - free_slots_.size());
+  normals.reserve(positions_.size() - free_slots_.size());
+  for (size_t slot = 0; slot < positions_.size(); ++slot) {
+    if (slot_in_use_[slot]) {
+      ids[slot] = static_cast<int>(positions.size());
+      positions.push_back(positions_[slot]);
+      normals.push_back(normals_[slot]);
+    }
+  }
+
+  size_t num_faces = 0;
+  for (const BrickMesh& brick : bricks_) {
+    num_faces += brick.faces.size();
+  }
+  vector<Vector3i> faces;
+  faces.reserve(num_faces);
+  for (const BrickMesh& brick : bricks_) {
+    for (const Vector3i& face : brick.faces) {
+      faces.push_back(Vector3i(ids[face.x], ids[face.y], ids[face.z]));
+    }
+  }
+
+  mesh_ = TriangleMesh(readViewOf(positions), readViewOf(normals),
+    readViewOf(faces));
+  mesh_valid_ = true;
+  return mesh_;
+}
+
+void BrickMeshCache::ReleaseBrick(BrickMesh& brick) {
+  for (int slot : brick.vertex_slots) {
+    FreeSlot(slot);
+  }
+  for (uint64_t key : brick.shared_keys) {
+    auto itr = shared_vertices_.find(key);
+    if (--itr->second.num_bricks == 0) {
+      FreeSlot(itr->second.slot);
+      shared_vertices_.erase(itr);
+    }
+  }
+  brick.vertex_slots.clear();
+  brick.shared_keys.clear();
+  brick.faces.clear();
+}
+
+int BrickMeshCache::AllocateSlot(const Vector3f& position,
+  const Vector3f& normal) {
+  if (free_slots_.empty()) {
+    positions_.push_back(position);
+    normals_.push_back(normal);
+    slot_in_use_.push_back(true);
+    return static_cast<int>(positions_.size()) - 1;
+  }
+  int slot = free_slots_.back();
+  free_slots_.pop_back();
+  positions_[slot] = position;
+  normals_[slot] = normal;
+  slot_in_use_[slot] = true;
+  return slot;
+}
+
+void BrickMeshCache::FreeSlot(int slot) {
+  slot_in_use_[slot] = false;
+  free_slots_.push_back(slot);
+}
@@ -0,0 +1,98 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef BRICK_MESH_CACHE_H
+#define BRICK_MESH_CACHE_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "libcgt/core/common/Array3D.h"
+#include "libcgt/core/geometry/TriangleMesh.h"
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+#include "libcgt/core/vecmath/Vector3f.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+
+#include "tsdf.h"
+
+// Caches the marching cubes mesh of each brick of a regular grid, so that
+// only bricks whose voxels changed need to be re-meshed.
+//
+// Each brick is welded when it is meshed. Vertices on its faces are matched
+// to those of its neighbors by the grid edge they lie on, and the vertices of
+// every brick share one array, so Mesh() only splices in what changed.
+class BrickMeshCache {
+ public:
+
+  // Drops every cached triangle and sizes the cache for num_bricks bricks.
+  void Reset(int num_bricks);
+
+  // Replaces the triangles of brick brick_index with those of the cells of
+  // padded_brick. padded_brick holds the samples of the grid starting at
+  // brick_origin, including the two extra samples along each axis that the
+  // cells on the brick's far faces read.
+  void UpdateBrick(int brick_index, Array3DReadView<TSDF> padded_brick,
+    const Vector3i& brick_origin, float max_tsdf_value,
+    const libcgt::core::vecmath::SimilarityTransform& world_from_grid);
+
+  // The welded mesh of every brick. Returns the previous mesh if no brick
+  // has been updated since.
+  TriangleMesh Mesh();
+
+ private:
+
+  struct BrickMesh {
+    // Slots of the vertices only this brick uses.
+    std::vector<int> vertex_slots;
+    // Edge keys of the vertices on the brick's faces.
+    std::vector<uint64_t> shared_keys;
+    // Triangles, as slots.
+    std::vector<Vector3i> faces;
+  };
+
+  struct SharedVertex {
+    int slot;
+    // The number of bricks that use it.
+    int num_bricks;
+  };
+
+  // Frees the slots of brick's vertices and empties it.
+  void ReleaseBrick(BrickMesh& brick);
+
+  int AllocateSlot(const Vector3f& position, const Vector3f& normal);
+  void FreeSlot(int slot);
+
+  std::vector<BrickMesh> bricks_;
+
+  // The vertices of every brick, by slot. Free slots are reused.
+  std::vector<Vector3f> positions_;
+  std::vector<Vector3f> normals_;
+  std::vector<bool> slot_in_use_;
+  std::vector<int> free_slots_;
+
+  // Vertices on brick faces, by edge key.
+  std::unordered_map<uint64_t, SharedVertex> shared_vertices_;
+
+  // Scratch space for UpdateBrick().
+  std::vector<Vector3f> brick_positions_;
+  std::vector<Vector3f> brick_normals_;
+  std::vector<Vector3i> brick_faces_;
+  std::vector<int> brick_shared_vertices_;
+  std::vector<int> brick_slots_;
+
+  TriangleMesh mesh_;
+  bool mesh_valid_ = false;
+};
+
+#endif  // BRICK_MESH_CACHE_H
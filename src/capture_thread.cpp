@@ -0,0 +1,260 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "capture_thread.h"
+
+#include <cassert>
+
+#include "libcgt/core/common/ArrayUtils.h"
+
+#include "perf_collector.h"
+#include "rgbd_input.h"
+
+using libcgt::core::arrayutils::copy;
+
+const char* kDropOldestFrameQueuePolicy = "drop_oldest";
+const char* kBlockFrameQueuePolicy = "block";
+
+bool ParseFrameQueuePolicy(const std::string& name,
+  FrameQueuePolicy* policy) {
+  if (name == kDropOldestFrameQueuePolicy) {
+    *policy = FrameQueuePolicy::DROP_OLDEST;
+    return true;
+  } else if (name == kBlockFrameQueuePolicy) {
+    *policy = FrameQueuePolicy::BLOCK;
+    return true;
+  }
+  return false;
+}
+
+namespace {
+
+constexpr const char* kCapturedFramesCounter = "capture_queue.captured";
+constexpr const char* kDroppedFramesCounter = "capture_queue.dropped";
+constexpr const char* kMaxDepthCounter = "capture_queue.max_depth";
+
+}  // namespace
+
+CaptureThread::Frame::Frame(const Vector2i& color_resolution,
+  const Vector2i& depth_resolution) :
+  buffer(color_resolution, depth_resolution) {
+}
+
+CaptureThread::CaptureThread(RgbdInput* input,
+  const Vector2i& color_resolution, const Vector2i& depth_resolution,
+  const Options& options) :
+  input_(input),
+  options_(options),
+  ready_frames_(options.queue_capacity),
+  // One frame more than the queue for the consumer, and one for capture.
+  free_frames_(options.queue_capacity + 2),
+  paused_(options.start_paused) {
+  assert(input != nullptr);
+  assert(options.queue_capacity > 0);
+  for (int i = 0; i < options.queue_capacity + 2; ++i) {
+    frames_.push_back(
+      std::make_unique<Frame>(color_resolution, depth_resolution));
+    free_frames_.TryPush(frames_.back().get());
+  }
+  thread_ = std::thread(&CaptureThread::Run, this);
+}
+
+CaptureThread::~CaptureThread() {
+  Stop();
+}
+
+void CaptureThread::SetPaused(bool paused) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  paused_ = paused;
+  num_pending_steps_ = 0;
+  cv_.notify_all();
+}
+
+bool CaptureThread::IsPaused() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return paused_;
+}
+
+void CaptureThread::Step() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (paused_) {
+    ++num_pending_steps_;
+    cv_.notify_all();
+  }
+}
+
+CaptureThread::Frame* CaptureThread::Acquire() {
+  Frame* frame = nullptr;
+  while (!stopped_ && !ready_frames_.TryPop(&frame)) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Capture pushes its last frame before it sets finished_.
+    if (finished_ && ready_frames_.Size() == 0) {
+      return nullptr;
+    }
+    cv_.wait(lock, [this] {
+      return stopped_ || finished_ || ready_frames_.Size() > 0;
+    });
+  }
+  if (stopped_) {
+    return nullptr;
+  }
+  // A blocked capture thread may now push.
+  if (options_.policy == FrameQueuePolicy::BLOCK) {
+    Notify();
+  }
+  return frame;
+}
+
+void CaptureThread::Release(Frame* frame) {
+  // Never full: it has room for every frame.
+  free_frames_.TryPush(frame);
+  Notify();
+}
+
+void CaptureThread::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    cv_.notify_all();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+int CaptureThread::QueueDepth() const {
+  return ready_frames_.Size();
+}
+
+int64_t CaptureThread::NumDroppedFrames() const {
+  return num_dropped_frames_;
+}
+
+void CaptureThread::Run() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] {
+        return stopped_ || !paused_ || num_pending_steps_ > 0;
+      });
+      if (stopped_) {
+        return;
+      }
+      if (paused_) {
+        --num_pending_steps_;
+      }
+    }
+
+    Frame* frame = AcquireFreeFrame();
+    if (frame == nullptr) {
+      return;
+    }
+    // Can block on the sensor.
+    input_->read(&(frame->buffer),
+      &(frame->color_updated), &(frame->depth_updated), options_.streams);
+
+    if (!frame->color_updated && !frame->depth_updated) {
+      spare_frame_ = frame;
+      if (options_.end_of_input != EndOfInput::CONTINUE) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (options_.end_of_input == EndOfInput::PAUSE) {
+          paused_ = true;
+          num_pending_steps_ = 0;
+        } else {
+          finished_ = true;
+        }
+        cv_.notify_all();
+        if (finished_) {
+          return;
+        }
+      }
+      continue;
+    }
+
+    if (options_.policy == FrameQueuePolicy::DROP_OLDEST) {
+      Frame* dropped = nullptr;
+      if (ready_frames_.PushOverwrite(frame, &dropped)) {
+        spare_frame_ = dropped;
+        ++num_dropped_frames_;
+        if (PerfCollector::Enabled()) {
+          PerfCollector::Get().IncrementCounter(kDroppedFramesCounter);
+        }
+      }
+    } else {
+      while (!ready_frames_.TryPush(frame)) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] {
+          return stopped_ ||
+            ready_frames_.Size() < ready_frames_.Capacity();
+        });
+        if (stopped_) {
+          return;
+        }
+      }
+    }
+    if (PerfCollector::Enabled()) {
+      PerfCollector& collector = PerfCollector::Get();
+      collector.IncrementCounter(kCapturedFramesCounter);
+      collector.UpdateCounterMax(kMaxDepthCounter, ready_frames_.Size());
+    }
+    Notify();
+  }
+}
+
+CaptureThread::Frame* CaptureThread::AcquireFreeFrame() {
+  Frame* frame = spare_frame_;
+  if (frame != nullptr) {
+    spare_frame_ = nullptr;
+    return frame;
+  }
+  while (!free_frames_.TryPop(&frame)) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] {
+      return stopped_ || free_frames_.Size() > 0;
+    });
+    if (stopped_) {
+      return nullptr;
+    }
+  }
+  return frame;
+}
+
+void CaptureThread::Notify() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+  }
+  cv_.notify_all();
+}
+
+void CopyUpdatedStreams(const CaptureThread::Frame& frame,
+  InputBuffer* buffer) {
+  if (frame.color_updated) {
+    buffer->color_frame_index = frame.buffer.color_frame_index;
+    buffer->color_timestamp_ns = frame.buffer.color_timestamp_ns;
+    copy(frame.buffer.color_rgb.readView(), buffer->color_rgb.writeView());
+    copy(frame.buffer.color_bgr_ydown.readView(),
+      buffer->color_bgr_ydown.writeView());
+  }
+  if (frame.depth_updated) {
+    buffer->depth_frame_index = frame.buffer.depth_frame_index;
+    buffer->depth_timestamp_ns = frame.buffer.depth_timestamp_ns;
+    buffer->depth_is_raw = frame.buffer.depth_is_raw;
+    if (frame.buffer.depth_is_raw) {
+      copy(frame.buffer.depth_millimeters_ydown.readView(),
+        buffer->depth_millimeters_ydown.writeView());
+    } else {
+      copy(frame.buffer.depth_meters.readView(),
+        buffer->depth_meters.writeView());
+    }
+  }
+}
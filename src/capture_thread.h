@@ -0,0 +1,169 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef CAPTURE_THREAD_H
+#define CAPTURE_THREAD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libcgt/core/vecmath/Vector2i.h"
+
+#include "input_buffer.h"
+#include "spsc_ring.h"
+
+class RgbdInput;
+
+// What CaptureThread does with a new frame when its queue is full.
+enum class FrameQueuePolicy {
+  // Drop the oldest queued frame. Keeps latency bounded when processing
+  // falls behind a live sensor.
+  DROP_OLDEST,
+  // Wait for the consumer. Every frame is processed, as offline runs need.
+  BLOCK
+};
+
+// Names accepted by ParseFrameQueuePolicy().
+extern const char* kDropOldestFrameQueuePolicy;
+extern const char* kBlockFrameQueuePolicy;
+
+// Returns false, leaving policy untouched, if name is not recognized.
+bool ParseFrameQueuePolicy(const std::string& name, FrameQueuePolicy* policy);
+
+// Reads frames from an RgbdInput on a dedicated thread, so that polling the
+// sensor (or reading a file) runs at its own rate, independently of
+// processing and display.
+//
+// Frames are read into a fixed pool of buffers and handed to one consumer
+// thread through a lock-free SpscRing. The consumer takes the oldest frame
+// with Acquire() and hands its buffer back with Release(). Either side only
+// blocks (on a condition variable) when it has to wait for the other.
+//
+// With --collect_perf, reports to PerfCollector how many frames were
+// captured and dropped, and the largest queue depth seen.
+class CaptureThread {
+ public:
+
+  struct Frame {
+    Frame(const Vector2i& color_resolution,
+      const Vector2i& depth_resolution);
+
+    // Only the streams flagged as updated are valid.
+    InputBuffer buffer;
+    bool color_updated = false;
+    bool depth_updated = false;
+  };
+
+  // What capture does after a read that returns nothing.
+  enum class EndOfInput {
+    // Keep reading (a live sensor that timed out).
+    CONTINUE,
+    // Pause, as at the end of a file viewed interactively.
+    PAUSE,
+    // Stop reading. Acquire() returns nullptr once the queue is drained.
+    FINISH
+  };
+
+  struct Options {
+    FrameQueuePolicy policy = FrameQueuePolicy::BLOCK;
+    // Maximum number of frames waiting to be acquired.
+    int queue_capacity = 2;
+    EndOfInput end_of_input = EndOfInput::CONTINUE;
+    // The streams to read. Frames of the others are skipped.
+    InputStreams streams = InputStreams::ALL;
+    bool start_paused = true;
+  };
+
+  CaptureThread(RgbdInput* input, const Vector2i& color_resolution,
+    const Vector2i& depth_resolution, const Options& options);
+  // Calls Stop().
+  ~CaptureThread();
+
+  CaptureThread(const CaptureThread& copy) = delete;
+  CaptureThread& operator = (const CaptureThread& copy) = delete;
+
+  void SetPaused(bool paused);
+  bool IsPaused() const;
+
+  // While paused, reads a single frame.
+  void Step();
+
+  // Blocks until a frame is ready and returns it. Returns nullptr once Stop()
+  // has been called, or once input is finished (see EndOfInput::FINISH) and
+  // every frame has been acquired.
+  Frame* Acquire();
+
+  // Returns a frame obtained from Acquire() to the pool.
+  void Release(Frame* frame);
+
+  // Stops capture and waits for the thread to exit. Wakes up Acquire().
+  // Frames that have not been acquired are discarded.
+  void Stop();
+
+  // Number of frames waiting to be acquired.
+  int QueueDepth() const;
+
+  // Number of frames dropped so far by FrameQueuePolicy::DROP_OLDEST.
+  int64_t NumDroppedFrames() const;
+
+ private:
+
+  void Run();
+
+  // Capture thread only. Returns a buffer to read into, waiting for one if
+  // needed, or nullptr if stopped.
+  Frame* AcquireFreeFrame();
+
+  // Wakes up every thread waiting on cv_. Avoids missing a waiter that is
+  // between checking a ring and sleeping.
+  void Notify();
+
+  RgbdInput* input_ = nullptr;
+  const Options options_;
+
+  std::vector<std::unique_ptr<Frame>> frames_;
+
+  // Capture --> consumer.
+  SpscRing<Frame*> ready_frames_;
+  // Consumer --> capture.
+  SpscRing<Frame*> free_frames_;
+  // Capture thread only: a buffer to read into next, if any. Reuses failed
+  // reads and dropped frames.
+  Frame* spare_frame_ = nullptr;
+
+  std::atomic<int64_t> num_dropped_frames_{ 0 };
+
+  // Guards the state below. cv_ is notified whenever it or a ring changes.
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  bool paused_ = true;
+  int num_pending_steps_ = 0;
+  bool finished_ = false;
+  // Also read without the lock, to return early from Acquire().
+  std::atomic<bool> stopped_{ false };
+
+  std::thread thread_;
+};
+
+// Copies the streams of frame that were updated, and their metadata, to
+// buffer.
+void CopyUpdatedStreams(const CaptureThread::Frame& frame,
+  InputBuffer* buffer);
+
+#endif  // CAPTURE_THREAD_H
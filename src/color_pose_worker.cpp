@@ -0,0 +1,125 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "color_pose_worker.h"
+
+#include <utility>
+
+#include "libcgt/core/common/ArrayUtils.h"
+
+#include "trace.h"
+
+using libcgt::core::arrayutils::copy;
+
+ColorPoseWorker::ColorPoseWorker(const ArucoPoseEstimator& estimator,
+  const Vector2i& color_resolution,
+  const ArucoPoseEstimator::TrackingOptions& tracking_options) :
+  estimator_(estimator),
+  tracking_options_(tracking_options),
+  pending_bgr_(color_resolution),
+  working_bgr_(color_resolution),
+  working_vis_(color_resolution),
+  latest_vis_(color_resolution) {
+  thread_ = std::thread(&ColorPoseWorker::Run, this);
+}
+
+ColorPoseWorker::~ColorPoseWorker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    cv_.notify_all();
+  }
+  thread_.join();
+}
+
+void ColorPoseWorker::Submit(Array2DReadView<uint8x3> color_bgr_ydown,
+  int32_t frame_index, int64_t timestamp_ns,
+  bool track, const EuclideanTransform& predicted_world_from_camera) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  copy(color_bgr_ydown, pending_bgr_.writeView());
+  pending_ = Pose{};
+  pending_.frame_index = frame_index;
+  pending_.timestamp_ns = timestamp_ns;
+  pending_track_ = track;
+  pending_prediction_ = predicted_world_from_camera;
+  has_pending_ = true;
+  cv_.notify_all();
+}
+
+bool ColorPoseWorker::TakeLatest(Pose* pose, Array2DWriteView<uint8x3> vis) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!has_latest_) {
+    return false;
+  }
+  *pose = latest_;
+  if (vis.notNull()) {
+    copy(latest_vis_.readView(), vis);
+  }
+  has_latest_ = false;
+  return true;
+}
+
+void ColorPoseWorker::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return !has_pending_ && !busy_; });
+}
+
+void ColorPoseWorker::Discard() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  has_pending_ = false;
+  has_latest_ = false;
+  discard_in_progress_ = busy_;
+  cv_.notify_all();
+}
+
+void ColorPoseWorker::Run() {
+  while (true) {
+    Pose pose;
+    bool track;
+    EuclideanTransform prediction;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopped_ || has_pending_; });
+      if (stopped_) {
+        return;
+      }
+      std::swap(pending_bgr_, working_bgr_);
+      pose = pending_;
+      track = pending_track_;
+      prediction = pending_prediction_;
+      has_pending_ = false;
+      busy_ = true;
+      discard_in_progress_ = false;
+    }
+
+    {
+      ScopedTraceRange trace("ColorPoseWorker: estimate pose",
+        TraceCategory::POSE_ESTIMATION);
+      if (track) {
+        pose.result = estimator_.TrackPose(working_bgr_, prediction,
+          tracking_options_, working_vis_);
+      } else {
+        pose.result = estimator_.EstimatePose(working_bgr_, working_vis_);
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!discard_in_progress_) {
+      latest_ = pose;
+      std::swap(latest_vis_, working_vis_);
+      has_latest_ = true;
+    }
+    busy_ = false;
+    cv_.notify_all();
+  }
+}
@@ -0,0 +1,114 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef COLOR_POSE_WORKER_H
+#define COLOR_POSE_WORKER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/common/BasicTypes.h"
+#include "libcgt/core/vecmath/EuclideanTransform.h"
+#include "libcgt/core/vecmath/Vector2i.h"
+
+#include "aruco/aruco_pose_estimator.h"
+
+// Runs ArucoPoseEstimator on a dedicated thread, so that OpenCV does not
+// hold up the thread feeding the GPU.
+//
+// The worker processes one color frame at a time. Submit() copies a frame in,
+// replacing any frame the worker has not started on yet, so it always works
+// on the most recent frame. TakeLatest() returns each estimate, with the
+// timestamp of the frame it came from, at most once.
+//
+// The estimator must not be used by anyone else while the worker exists.
+class ColorPoseWorker {
+ public:
+
+  using EuclideanTransform = libcgt::core::vecmath::EuclideanTransform;
+
+  struct Pose {
+    int32_t frame_index = 0;
+    int64_t timestamp_ns = 0;
+    ArucoPoseEstimator::Result result;
+  };
+
+  ColorPoseWorker(const ArucoPoseEstimator& estimator,
+    const Vector2i& color_resolution,
+    const ArucoPoseEstimator::TrackingOptions& tracking_options);
+  ~ColorPoseWorker();
+
+  ColorPoseWorker(const ColorPoseWorker& copy) = delete;
+  ColorPoseWorker& operator = (const ColorPoseWorker& copy) = delete;
+
+  // Copies color_bgr_ydown (y-down, BGR) for the worker. If track is true,
+  // the worker uses ArucoPoseEstimator::TrackPose() around
+  // predicted_world_from_camera, otherwise EstimatePose().
+  void Submit(Array2DReadView<uint8x3> color_bgr_ydown,
+    int32_t frame_index, int64_t timestamp_ns,
+    bool track, const EuclideanTransform& predicted_world_from_camera);
+
+  // If an estimate finished since the last call, writes it to pose and its
+  // visualization (BGR, y-down) to vis (if not null), and returns true.
+  bool TakeLatest(Pose* pose,
+    Array2DWriteView<uint8x3> vis = Array2DWriteView<uint8x3>());
+
+  // Blocks until every submitted frame has been estimated.
+  void Wait();
+
+  // Drops the submitted frame and the latest estimate, if any. An estimate in
+  // progress is dropped when it finishes.
+  void Discard();
+
+ private:
+
+  void Run();
+
+  const ArucoPoseEstimator& estimator_;
+  const ArucoPoseEstimator::TrackingOptions tracking_options_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopped_ = false;
+
+  // Everything below up to thread_ is guarded by mutex_, except for the
+  // working buffers.
+
+  // The frame waiting for the worker.
+  Array2D<uint8x3> pending_bgr_;
+  Pose pending_;
+  bool pending_track_ = false;
+  EuclideanTransform pending_prediction_;
+  bool has_pending_ = false;
+
+  // Whether the worker is estimating a frame, and whether Discard() was
+  // called since it started.
+  bool busy_ = false;
+  bool discard_in_progress_ = false;
+
+  // Owned by the worker.
+  Array2D<uint8x3> working_bgr_;
+  Array2D<uint8x3> working_vis_;
+
+  // The latest finished estimate.
+  Array2D<uint8x3> latest_vis_;
+  Pose latest_;
+  bool has_latest_ = false;
+
+  std::thread thread_;
+};
+
+#endif  // COLOR_POSE_WORKER_H
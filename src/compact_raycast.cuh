@@ -0,0 +1,89 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef COMPACT_RAYCAST_CUH
+#define COMPACT_RAYCAST_CUH
+
+#include <helper_math.h>
+#include <vector_functions.h>
+
+// A raycast sample packed into 8 bytes for tracking: x holds the bits of the
+// camera-space depth (positive into the screen, 0 if the ray missed) and y an
+// octahedral encoding of the camera-space unit normal as two snorm16s. The
+// point itself is not stored: it is CameraFromPixel() of the pixel center
+// that cast the ray, at that depth.
+//
+// Octahedral normals are accurate to about 0.005 degrees, well below what ICP
+// can resolve.
+
+__inline__ __device__ __host__
+float OctahedralSignNotZero(float v) {
+  return v >= 0.0f ? 1.0f : -1.0f;
+}
+
+__inline__ __device__ __host__
+unsigned int PackSnorm16(float v) {
+  return static_cast<unsigned int>(
+    static_cast<int>(roundf(fminf(fmaxf(v, -1.0f), 1.0f) * 32767.0f)))
+    & 0xffffu;
+}
+
+__inline__ __device__ __host__
+float UnpackSnorm16(unsigned int bits) {
+  return fmaxf(static_cast<short>(bits & 0xffffu) / 32767.0f, -1.0f);
+}
+
+// n must be unit length.
+__inline__ __device__ __host__
+unsigned int PackOctahedralNormal(float3 n) {
+  float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+  float u = n.x / l1;
+  float v = n.y / l1;
+  if (n.z < 0.0f) {
+    float folded_u = (1.0f - fabsf(v)) * OctahedralSignNotZero(u);
+    v = (1.0f - fabsf(u)) * OctahedralSignNotZero(v);
+    u = folded_u;
+  }
+  return PackSnorm16(u) | (PackSnorm16(v) << 16);
+}
+
+__inline__ __device__ __host__
+float3 UnpackOctahedralNormal(unsigned int bits) {
+  float u = UnpackSnorm16(bits);
+  float v = UnpackSnorm16(bits >> 16);
+  float3 n = { u, v, 1.0f - fabsf(u) - fabsf(v) };
+  float t = fmaxf(-n.z, 0.0f);
+  n.x += n.x >= 0.0f ? -t : t;
+  n.y += n.y >= 0.0f ? -t : t;
+  return normalize(n);
+}
+
+// An invalid sample is all zeros.
+__inline__ __device__
+uint2 PackCompactRaycastSample(float depth, float3 camera_normal) {
+  return{ __float_as_uint(depth), PackOctahedralNormal(camera_normal) };
+}
+
+// Returns false if sample is invalid.
+__inline__ __device__
+bool UnpackCompactRaycastSample(uint2 sample, float* depth,
+  float3* camera_normal) {
+  *depth = __uint_as_float(sample.x);
+  if (!(*depth > 0.0f)) {
+    return false;
+  }
+  *camera_normal = UnpackOctahedralNormal(sample.y);
+  return true;
+}
+
+#endif  // COMPACT_RAYCAST_CUH
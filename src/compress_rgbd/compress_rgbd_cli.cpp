@@ -0,0 +1,88 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include "libcgt/camera_wrappers/RGBDStream.h"
+
+#include "../compressed_rgbd_stream.h"
+#include "../frame_codec.h"
+
+using libcgt::camera_wrappers::RGBDInputStream;
+using libcgt::camera_wrappers::StreamMetadata;
+
+DEFINE_string(input, "", "Input RGBD stream file (.rgbd).");
+DEFINE_string(output, "", "Output compressed RGBD stream file (.rgbdz).");
+DEFINE_int32(jpeg_quality, 90, "JPEG quality of color frames, in [0, 100].");
+DEFINE_bool(lossless, false, "If true, stores color frames uncompressed "
+  "instead of as JPEG. Depth is always lossless.");
+
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_input == "") {
+    printf("input is required.\n");
+    return 1;
+  }
+  if (FLAGS_output == "") {
+    printf("output is required.\n");
+    return 1;
+  }
+
+  RGBDInputStream input(FLAGS_input.c_str());
+  const std::vector<StreamMetadata>& metadata = input.metadata();
+  if (metadata.empty()) {
+    printf("Could not read %s.\n", FLAGS_input.c_str());
+    return 1;
+  }
+
+  std::vector<FrameCodec> codecs;
+  for (const StreamMetadata& stream_metadata : metadata) {
+    codecs.push_back(DefaultFrameCodec(stream_metadata, !FLAGS_lossless));
+  }
+
+  CompressedRGBDOutputStream output(metadata, codecs, FLAGS_output,
+    FLAGS_jpeg_quality);
+  if (!output.isValid()) {
+    printf("Could not open %s for writing.\n", FLAGS_output.c_str());
+    return 1;
+  }
+
+  uint64_t raw_bytes = 0;
+  int num_frames = 0;
+  uint32_t stream_id;
+  int32_t frame_index;
+  int64_t timestamp_ns;
+  Array1DReadView<uint8_t> src =
+    input.read(stream_id, frame_index, timestamp_ns);
+  while (src.notNull()) {
+    if (!output.write(stream_id, frame_index, timestamp_ns, src)) {
+      printf("Failed to write frame %d of stream %u.\n",
+        frame_index, stream_id);
+      return 1;
+    }
+    raw_bytes += src.size();
+    ++num_frames;
+    src = input.read(stream_id, frame_index, timestamp_ns);
+  }
+  if (!output.close()) {
+    printf("Failed to close %s.\n", FLAGS_output.c_str());
+    return 1;
+  }
+
+  printf("Compressed %d frames (%llu bytes of raw frames).\n", num_frames,
+    static_cast<unsigned long long>(raw_bytes));
+  return 0;
+}
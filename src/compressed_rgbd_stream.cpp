@@ -0,0 +1,255 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "compressed_rgbd_stream.h"
+
+#include <fstream>
+#include <utility>
+
+#include "libcgt/camera_wrappers/PixelFormat.h"
+#include "libcgt/core/common/ArrayUtils.h"
+
+using libcgt::camera_wrappers::PixelFormat;
+using libcgt::core::arrayutils::readViewOf;
+using libcgt::core::arrayutils::writeViewOf;
+
+namespace {
+
+const char kMagic[] = { 'r', 'g', 'b', 'd', 'z' };
+const int32_t kVersion = 1;
+
+// Guards against absurd allocations when reading corrupt files.
+const int32_t kMaxNumStreams = 64;
+const uint32_t kMaxFrameBytes = 1 << 28;
+
+}  // namespace
+
+bool IsCompressedRGBDFile(const std::string& filename) {
+  std::ifstream file(filename, std::ios::binary);
+  for (char expected : kMagic) {
+    char c = 0;
+    if (!file.get(c) || c != expected) {
+      return false;
+    }
+  }
+  return true;
+}
+
+CompressedRGBDOutputStream::CompressedRGBDOutputStream(
+  const std::vector<StreamMetadata>& metadata,
+  const std::vector<FrameCodec>& codecs, const std::string& filename,
+  int jpeg_quality) :
+  metadata_(metadata),
+  codecs_(codecs),
+  jpeg_quality_(jpeg_quality),
+  stream_(filename) {
+  if (metadata_.size() != codecs_.size()) {
+    return;
+  }
+  bool ok = true;
+  for (char c : kMagic) {
+    ok = ok && stream_.write(c);
+  }
+  ok = ok && stream_.write<int32_t>(kVersion);
+  ok = ok && stream_.write<int32_t>(static_cast<int32_t>(metadata_.size()));
+  for (size_t i = 0; i < metadata_.size(); ++i) {
+    ok = ok && stream_.write<int32_t>(static_cast<int32_t>(metadata_[i].type));
+    ok = ok &&
+      stream_.write<int32_t>(static_cast<int32_t>(metadata_[i].format));
+    ok = ok && stream_.write<int32_t>(static_cast<int32_t>(codecs_[i]));
+    ok = ok && stream_.write(metadata_[i].size);
+  }
+  valid_ = ok;
+}
+
+bool CompressedRGBDOutputStream::isValid() const {
+  return valid_;
+}
+
+bool CompressedRGBDOutputStream::write(uint32_t stream_id,
+  int32_t frame_index, int64_t timestamp_ns, Array1DReadView<uint8_t> data) {
+  if (!valid_ || stream_id >= metadata_.size() ||
+    !EncodeFrame(codecs_[stream_id], metadata_[stream_id], data,
+      jpeg_quality_, &encoded_)) {
+    return false;
+  }
+  return stream_.write(stream_id) &&
+    stream_.write(frame_index) &&
+    stream_.write(timestamp_ns) &&
+    stream_.write(static_cast<uint32_t>(encoded_.size())) &&
+    (encoded_.empty() || stream_.writeArray(readViewOf(encoded_)));
+}
+
+bool CompressedRGBDOutputStream::close() {
+  valid_ = false;
+  return stream_.close();
+}
+
+CompressedRGBDInputStream::CompressedRGBDInputStream(
+  const std::string& filename, int num_decode_threads) :
+  stream_(filename) {
+  for (char expected : kMagic) {
+    uint8_t c = 0;
+    if (!stream_.read(c) || c != static_cast<uint8_t>(expected)) {
+      return;
+    }
+  }
+  int32_t version = 0;
+  int32_t num_streams = -1;
+  if (!stream_.read(version) || version != kVersion ||
+    !stream_.read(num_streams) ||
+    num_streams < 0 || num_streams > kMaxNumStreams) {
+    return;
+  }
+  for (int32_t i = 0; i < num_streams; ++i) {
+    int32_t type;
+    int32_t format;
+    int32_t codec;
+    StreamMetadata metadata;
+    if (!stream_.read(type) || !stream_.read(format) ||
+      !stream_.read(codec) || !stream_.read(metadata.size)) {
+      return;
+    }
+    metadata.type = static_cast<StreamType>(type);
+    metadata.format = static_cast<PixelFormat>(format);
+    metadata_.push_back(metadata);
+    codecs_.push_back(static_cast<FrameCodec>(codec));
+  }
+
+  if (num_decode_threads > 0) {
+    pool_ = std::make_unique<ThreadPool>(num_decode_threads);
+    window_size_ = 2 * num_decode_threads;
+  }
+  valid_ = true;
+}
+
+CompressedRGBDInputStream::~CompressedRGBDInputStream() {
+  for (std::future<void>& decode : decodes_) {
+    decode.wait();
+  }
+}
+
+bool CompressedRGBDInputStream::isValid() const {
+  return valid_;
+}
+
+const std::vector<CompressedRGBDInputStream::StreamMetadata>&
+CompressedRGBDInputStream::metadata() const {
+  return metadata_;
+}
+
+const std::vector<FrameCodec>& CompressedRGBDInputStream::codecs() const {
+  return codecs_;
+}
+
+Array1DReadView<uint8_t> CompressedRGBDInputStream::read(
+  uint32_t& stream_id, int32_t& frame_index, int64_t& timestamp_ns) {
+  if (!valid_) {
+    return Array1DReadView<uint8_t>();
+  }
+
+  fillWindow();
+  if (window_.empty()) {
+    // Decodes synchronously.
+    std::unique_ptr<Frame> frame(new Frame);
+    if (!readFrame(frame.get())) {
+      return Array1DReadView<uint8_t>();
+    }
+    decodeFrame(frame.get());
+    current_ = std::move(frame);
+  } else {
+    decodes_.front().wait();
+    decodes_.pop_front();
+    current_ = std::move(window_.front());
+    window_.pop_front();
+    fillWindow();
+  }
+
+  stream_id = current_->stream_id;
+  frame_index = current_->frame_index;
+  timestamp_ns = current_->timestamp_ns;
+  if (!current_->decoded_ok) {
+    return Array1DReadView<uint8_t>();
+  }
+  return readViewOf(current_->decoded);
+}
+
+bool CompressedRGBDInputStream::skip(uint32_t& stream_id,
+  int32_t& frame_index, int64_t& timestamp_ns) {
+  if (!valid_) {
+    return false;
+  }
+
+  std::unique_ptr<Frame> frame;
+  if (window_.empty()) {
+    frame.reset(new Frame);
+    if (!readFrame(frame.get())) {
+      return false;
+    }
+  } else {
+    decodes_.front().wait();
+    decodes_.pop_front();
+    frame = std::move(window_.front());
+    window_.pop_front();
+  }
+  stream_id = frame->stream_id;
+  frame_index = frame->frame_index;
+  timestamp_ns = frame->timestamp_ns;
+  return true;
+}
+
+bool CompressedRGBDInputStream::readFrame(Frame* frame) {
+  if (end_of_file_) {
+    return false;
+  }
+  uint32_t num_bytes = 0;
+  if (!stream_.read(frame->stream_id) || !stream_.read(frame->frame_index) ||
+    !stream_.read(frame->timestamp_ns) || !stream_.read(num_bytes) ||
+    frame->stream_id >= metadata_.size() || num_bytes > kMaxFrameBytes) {
+    end_of_file_ = true;
+    return false;
+  }
+  frame->encoded.resize(num_bytes);
+  if (num_bytes > 0 && !stream_.readArray(writeViewOf(frame->encoded))) {
+    end_of_file_ = true;
+    return false;
+  }
+  return true;
+}
+
+void CompressedRGBDInputStream::decodeFrame(Frame* frame) const {
+  const StreamMetadata& metadata = metadata_[frame->stream_id];
+  FrameCodec codec = codecs_[frame->stream_id];
+  int num_bytes = RawFrameBytes(metadata);
+  if (codec == FrameCodec::RAW && num_bytes == 0) {
+    num_bytes = static_cast<int>(frame->encoded.size());
+  }
+  frame->decoded.resize(num_bytes);
+  frame->decoded_ok = num_bytes > 0 &&
+    DecodeFrame(codec, metadata, readViewOf(frame->encoded),
+      writeViewOf(frame->decoded));
+}
+
+void CompressedRGBDInputStream::fillWindow() {
+  while (static_cast<int>(window_.size()) < window_size_) {
+    std::unique_ptr<Frame> frame(new Frame);
+    if (!readFrame(frame.get())) {
+      return;
+    }
+    Frame* pending = frame.get();
+    window_.push_back(std::move(frame));
+    decodes_.push_back(pool_->Submit([this, pending] {
+      decodeFrame(pending);
+    }));
+  }
+}
@@ -0,0 +1,153 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef COMPRESSED_RGBD_STREAM_H
+#define COMPRESSED_RGBD_STREAM_H
+
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "libcgt/core/common/Array1D.h"
+#include "libcgt/core/io/BinaryFileInputStream.h"
+#include "libcgt/core/io/BinaryFileOutputStream.h"
+#include "libcgt/camera_wrappers/RGBDStream.h"
+
+#include "frame_codec.h"
+#include "thread_pool.h"
+
+// A .rgbdz file holds the same streams and frames as a .rgbd file, but each
+// frame is stored with the FrameCodec of its stream, so frames vary in size.
+// The format is:
+// 'rgbdz', int32 version, int32 num_streams,
+// num_streams x (int32 StreamType, int32 PixelFormat, int32 FrameCodec,
+//   Vector2i size),
+// then frames: uint32 stream_id, int32 frame_index, int64 timestamp_ns,
+// uint32 num_bytes, num_bytes of encoded frame.
+//
+// RgbdInput and RgbdFrameIndex open either kind of file.
+
+// Returns true if filename starts with the .rgbdz magic number.
+bool IsCompressedRGBDFile(const std::string& filename);
+
+class CompressedRGBDOutputStream {
+ public:
+
+  using StreamMetadata = libcgt::camera_wrappers::StreamMetadata;
+
+  // codecs[i] encodes the frames of metadata[i]. jpeg_quality is in
+  // [0, 100].
+  CompressedRGBDOutputStream(const std::vector<StreamMetadata>& metadata,
+    const std::vector<FrameCodec>& codecs, const std::string& filename,
+    int jpeg_quality = 90);
+
+  CompressedRGBDOutputStream(const CompressedRGBDOutputStream& copy) = delete;
+  CompressedRGBDOutputStream& operator = (
+    const CompressedRGBDOutputStream& copy) = delete;
+
+  // False if the file could not be opened.
+  bool isValid() const;
+
+  // Encodes and appends one raw frame, as RGBDOutputStream::write() takes
+  // it. Returns false if the frame cannot be encoded or written.
+  bool write(uint32_t stream_id, int32_t frame_index, int64_t timestamp_ns,
+    Array1DReadView<uint8_t> data);
+
+  bool close();
+
+ private:
+
+  std::vector<StreamMetadata> metadata_;
+  std::vector<FrameCodec> codecs_;
+  int jpeg_quality_;
+  BinaryFileOutputStream stream_;
+  bool valid_ = false;
+  // Reused across frames.
+  std::vector<uint8_t> encoded_;
+};
+
+// Reads a .rgbdz file frame by frame, like RGBDInputStream, returning
+// decoded raw frames.
+class CompressedRGBDInputStream {
+ public:
+
+  using StreamMetadata = libcgt::camera_wrappers::StreamMetadata;
+
+  // With num_decode_threads > 0, frames are read ahead and decoded on that
+  // many worker threads, up to two frames per thread in flight, so read()
+  // mostly returns frames that are already decoded.
+  explicit CompressedRGBDInputStream(const std::string& filename,
+    int num_decode_threads = 0);
+
+  CompressedRGBDInputStream(const CompressedRGBDInputStream& copy) = delete;
+  CompressedRGBDInputStream& operator = (
+    const CompressedRGBDInputStream& copy) = delete;
+
+  // Finishes the decodes in flight.
+  ~CompressedRGBDInputStream();
+
+  // False if the file could not be opened or has an unknown header.
+  bool isValid() const;
+
+  const std::vector<StreamMetadata>& metadata() const;
+  const std::vector<FrameCodec>& codecs() const;
+
+  // Reads and decodes the next frame. The returned view is valid until the
+  // next call. Returns a null view at the end of the file, or if the frame
+  // is corrupt.
+  Array1DReadView<uint8_t> read(uint32_t& stream_id, int32_t& frame_index,
+    int64_t& timestamp_ns);
+
+  // Same as read(), but does not decode frames that are not yet being
+  // decoded. Returns false at the end of the file.
+  bool skip(uint32_t& stream_id, int32_t& frame_index,
+    int64_t& timestamp_ns);
+
+ private:
+
+  struct Frame {
+    uint32_t stream_id;
+    int32_t frame_index;
+    int64_t timestamp_ns;
+    std::vector<uint8_t> encoded;
+    std::vector<uint8_t> decoded;
+    bool decoded_ok = false;
+  };
+
+  // Reads the header and encoded bytes of the next frame from the file.
+  bool readFrame(Frame* frame);
+  // Decodes frame->encoded into frame->decoded.
+  void decodeFrame(Frame* frame) const;
+  // Reads frames and submits their decodes until the window is full.
+  void fillWindow();
+
+  std::vector<StreamMetadata> metadata_;
+  std::vector<FrameCodec> codecs_;
+  BinaryFileInputStream stream_;
+  bool valid_ = false;
+  bool end_of_file_ = false;
+
+  std::unique_ptr<ThreadPool> pool_;
+  int window_size_ = 0;
+  // Frames read ahead, in file order, and their pending decodes.
+  std::deque<std::unique_ptr<Frame>> window_;
+  std::deque<std::future<void>> decodes_;
+
+  // The frame returned by the last read().
+  std::unique_ptr<Frame> current_;
+};
+
+#endif  // COMPRESSED_RGBD_STREAM_H
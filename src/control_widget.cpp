@@ -53,7 +53,7 @@ void ControlWidget::OnSaveMeshClicked() {
   QString filename = QFileDialog::getSaveFileName(this,
     "Save Mesh",
     QString(),
-    "Alias|Wavefront Meshes (*.obj)"
+    "Binary PLY Meshes (*.ply);;Alias|Wavefront Meshes (*.obj)"
     );
   if (filename != "") {
     emit saveMeshClicked(filename);
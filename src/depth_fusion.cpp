@@ -21,22 +21,144 @@
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 #include "libcgt/core/vecmath/SimilarityTransform.h"
 
+#include "capture_thread.h"
 #include "control_widget.h"
+#include "depth_processor.h"
+#include "device_array_pool.h"
 #include "input_buffer.h"
+#include "launch_tuner.h"
 #include "main_widget.h"
 #include "main_controller.h"
+#include "perf_collector.h"
 #include "pose_utils.h"
+#include "projective_point_plane_icp.h"
 #include "regular_grid_fusion_pipeline.h"
 #include "rgbd_camera_parameters.h"
 #include "rgbd_input.h"
+#include "rgbd_recorder.h"
+#include "trace.h"
+#include "tsdf_volume.h"
 
 using libcgt::core::vecmath::EuclideanTransform;
 using libcgt::core::vecmath::SimilarityTransform;
 
 DEFINE_bool(collect_perf, false, "Collect performance statistics.");
+DEFINE_string(perf_csv, "", "With --collect_perf, write per-stage timing "
+  "percentiles to this .csv file on exit.");
+DEFINE_string(perf_json, "", "With --collect_perf, write per-stage timing "
+  "percentiles to this .json file on exit.");
+DEFINE_string(trace_out, "", "If non-empty, record host-side spans of the "
+  "pipeline stages and write them to this file as Chrome trace_event JSON "
+  "(chrome://tracing or Perfetto) on exit.");
 DEFINE_bool(adaptive_raycast, true, "Use signed distance values themselves "
   " during raycasting rather than one voxel at a time. Much faster, slightly "
   " less accurate.");
+DEFINE_bool(texture_raycast, false, "Raycast regular grid volumes through a "
+  "hardware-filtered 3D texture mirror of the TSDF instead of interpolating "
+  "voxels in software. Faster, slightly less accurate.");
+DEFINE_bool(lod_raycast, false, "Raycast free camera views of regular grid "
+  "volumes from 2x and 4x downsampled copies of the TSDF where a pixel covers "
+  "that many voxels. Tracking raycasts always read every voxel. Cannot be "
+  "combined with texture_raycast.");
+DEFINE_bool(compact_raycast, false, "Also raycast an 8 byte per pixel "
+  "depth and packed normal image for ICP to track against, which reads a "
+  "quarter of the bytes of the world points and normals. Regular grid "
+  "volumes only: others track against the world points and normals.");
+DEFINE_bool(cuda_graphs, false, "Capture each frame's depth "
+  "preprocessing, ICP iterations, and (regular and bricked grid volumes "
+  "only) fusion and raycast as CUDA graphs and replay them, to save kernel "
+  "launch overhead. Ignored with --collect_perf and "
+  "--deterministic_pipeline.");
+DEFINE_bool(ray_band_fusion, false, "Fuse regular grid volumes with one "
+  "thread per depth pixel, marching only through the truncation band around "
+  "its depth, instead of sweeping every voxel of the camera frustum. Cost "
+  "scales with the image rather than the volume, but free space in front of "
+  "the band is not carved. Falls back to the sweep when voxels are smaller "
+  "than a depth pixel at the far end of the depth range.");
+DEFINE_string(tsdf_volume, "regular_grid",
+  "TSDF volume representation. One of \"regular_grid\" (dense), "
+  "\"bricked_grid\" (dense, stored in 8^3 bricks for locality), "
+  "\"voxel_hashed\" (sparse, only allocates blocks near surfaces) or "
+  "\"partitioned\" (dense, split into z slabs across GPUs).");
+DEFINE_int32(tsdf_num_devices, 0,
+  "Number of GPUs a partitioned TSDF volume is split across. 0 uses all "
+  "visible GPUs.");
+DEFINE_int32(voxel_hash_max_blocks, 1 << 18,
+  "Capacity of the voxel_hashed block pool (8^3 voxels per block).");
+DEFINE_bool(deterministic_pipeline, false,
+  "Run every GPU stage of the single moving camera pipeline on the default "
+  "stream, in order, instead of overlapping consecutive frames.");
+DEFINE_string(depth_smoothing, "bilateral",
+  "Bilateral filter used to smooth incoming depth: \"bilateral\" (exact) or "
+  "\"separable_bilateral\" (a faster approximation, linear in the radius).");
+DEFINE_double(depth_smoothing_spatial_sigma, 1.0,
+  "Spatial standard deviation of the depth smoothing filter, in pixels. The "
+  "filter radius is ceil(2 * sigma).");
+DEFINE_double(depth_smoothing_range_sigma, 0.03,
+  "Range standard deviation of the depth smoothing filter, in meters.");
+DEFINE_int32(fusion_batch_size, 1,
+  "With the precomputed pose estimator, fuse this many depth frames at a "
+  "time, in a single sweep over the volume, and skip raycasting. 1 fuses "
+  "each frame as it arrives.");
+DEFINE_bool(fused_depth_preprocessing, false,
+  "Undistort (multiple static cameras only), smooth and estimate normals of "
+  "incoming depth in a single fused kernel. The multiple static camera "
+  "pipeline then fuses smoothed depth instead of raw undistorted depth.");
+DEFINE_string(icp_error_metric, "point_to_plane",
+  "Residual minimized by depth ICP: \"point_to_plane\" or "
+  "\"symmetric_point_to_plane\", which also uses the incoming normal.");
+DEFINE_bool(icp_debug_vis, true,
+  "Write the per-pixel depth ICP association visualization.");
+DEFINE_int32(device_pool_capacity_mb, 1024,
+  "Device buffers given up by pipelines, ICP and volumes are kept, up to "
+  "this many MiB, and reused by the next request of the same type and size "
+  "instead of being freed and reallocated. 0 frees them at once.");
+DEFINE_bool(autotune_launches, false, "Time candidate block shapes (and "
+  "slice chunks) for the fusion, raycast and depth preprocessing kernels "
+  "the first time each runs at a new size on this GPU, use the fastest and "
+  "save it to --launch_config_cache. Skipped for work captured with "
+  "--cuda_graphs.");
+DEFINE_string(launch_config_cache, "launch_configs.txt", "Launch "
+  "configurations tuned with --autotune_launches, per GPU name. Kernels "
+  "without an entry use 16 x 16 blocks. Empty to neither read nor write "
+  "one.");
+DEFINE_bool(gpu_depth_conversion, true,
+  "Upload millimeter depth frames as is and convert them to meters on the "
+  "GPU, instead of converting them on the CPU and uploading twice as many "
+  "bytes.");
+DEFINE_bool(aruco_tracking, true,
+  "Once the ArUco board has been found, only search for it around where the "
+  "latest pose projects it, and search the whole color frame after a miss.");
+DEFINE_double(aruco_detection_scale, 1.0,
+  "With --aruco_tracking, detect markers on the region of interest "
+  "downscaled by this factor, in (0, 1], then refine their corners at full "
+  "resolution.");
+DEFINE_bool(async_color_pose, true,
+  "Estimate ArUco poses on a worker thread. Color frames then never hold up "
+  "depth processing, and the next depth frame consumes the latest estimate "
+  "as its absolute pose. With --deterministic_pipeline, each color frame "
+  "still waits for its estimate.");
+DEFINE_double(raycast_reuse_max_rotation_degrees, 1.0,
+  "Pose estimation reuses the latest raycast, instead of raycasting again, "
+  "when nothing was fused since and the new pose is within this rotation "
+  "(and raycast_reuse_max_translation) of the raycast's pose.");
+DEFINE_double(raycast_reuse_max_translation, 0.01,
+  "See raycast_reuse_max_rotation_degrees. In meters.");
+DEFINE_bool(rolling_volume, false,
+  "Shift the TSDF volume by whole voxels to follow the depth camera, so that "
+  "scans can extend past the initial volume. Only supported by "
+  "\"regular_grid\" and \"bricked_grid\".");
+DEFINE_double(rolling_volume_margin, 0.25,
+  "The rolling volume is re-centered along an axis when the point at the "
+  "middle of the depth range gets closer than this fraction of the volume to "
+  "either side.");
+DEFINE_bool(rolling_volume_mesh, false,
+  "Mesh voxels as they leave the rolling volume, and include them in saved "
+  "meshes.");
+DEFINE_int32(rolling_volume_store_mb, 512,
+  "The most host memory, in MB, kept for voxels that left the rolling "
+  "volume. The oldest are dropped first (their triangles, with "
+  "rolling_volume_mesh, are kept).");
 DEFINE_string(mode, "single_moving",
   "Mode to run the app in. Either \"single_moving\" or \"multi_static\"." );
 
@@ -61,10 +183,46 @@ DEFINE_string(sm_pose_estimator, "color_aruco_and_depth_icp",
   "input_pose is required.");
 DEFINE_string(sm_pose_file, "",
   "Filename for precomputed pose path.");
+DEFINE_bool(threaded_capture, true,
+  "OPTIONAL for single moving mode: "
+  "Read input on a capture thread and run the pipeline on a processing "
+  "thread, so that neither waits for the GUI. If false, both run on the GUI "
+  "thread between paints.");
+DEFINE_string(capture_queue_policy, "",
+  "OPTIONAL for single moving mode, with threaded_capture: "
+  "what capture does when the pipeline falls behind. Either \"drop_oldest\" "
+  "(drop the oldest waiting frame, to keep latency bounded) or \"block\" "
+  "(wait, so that every frame is fused). Defaults to \"drop_oldest\" for "
+  "cameras and \"block\" for files.");
+DEFINE_int32(capture_queue_capacity, 2,
+  "OPTIONAL for single moving mode, with threaded_capture: "
+  "maximum number of frames waiting to be processed.");
+DEFINE_string(sm_record_rgbd, "",
+  "OPTIONAL for single moving mode, with sm_input_type \"openni2\": "
+  "also record the raw camera frames to this file, on a background thread, "
+  "so that the session can be fused again offline with fuse_depth_cli.");
+DEFINE_bool(sm_record_compressed, false,
+  "OPTIONAL for single moving mode, with sm_record_rgbd: write a compressed "
+  ".rgbdz file (lossless depth, JPEG color) instead of a .rgbd file.");
+DEFINE_int32(sm_record_queue_mb, 256,
+  "OPTIONAL for single moving mode, with sm_record_rgbd: memory for frames "
+  "waiting to be written, in megabytes. When the disk falls behind for "
+  "longer than this lasts, frames are dropped from the recording rather "
+  "than stalling capture.");
 
 // Multi static mode flags.
 DEFINE_bool(ms_use_gui, true,
   "Set true to visualize with GUI, false to run in batch mode.");
+DEFINE_bool(ms_cached_projection, false,
+  "Precompute the pixel and depth of every voxel in each camera's view once, "
+  "and fuse by looking them up instead of projecting voxels every frame. "
+  "Unless fused_depth_preprocessing is set, undistortion is folded into the "
+  "lookup too. Costs 8 bytes per voxel per camera over each camera's "
+  "frustum. Ignored by volumes that cannot cache projections.");
+DEFINE_bool(ms_incremental_fusion, true,
+  "Fuse each new depth frame into the volume as it arrives, averaging it with "
+  "earlier frames. If false, the volume is cleared and re-fused from the "
+  "latest frame of every camera whenever one of them changes.");
 
 int SingleMovingCameraMain(int argc, char* argv[]) {
 
@@ -90,6 +248,11 @@ int SingleMovingCameraMain(int argc, char* argv[]) {
     }
   }
 
+  if (FLAGS_sm_record_rgbd != "" && FLAGS_sm_input_type != "openni2") {
+    printf("sm_record_rgbd requires sm_input_type \"openni2\".\n");
+    return 1;
+  }
+
   QApplication app(argc, argv);
 
   RGBDCameraParameters camera_params;
@@ -106,6 +269,24 @@ int SingleMovingCameraMain(int argc, char* argv[]) {
     kRegularGridSideLength / kRegularGridResolution.x;
 
   RgbdInput rgbd_input(input_type, FLAGS_sm_input_args.c_str());
+  rgbd_input.setRawDepth(FLAGS_gpu_depth_conversion);
+
+  std::unique_ptr<RgbdRecorder> recorder;
+  if (FLAGS_sm_record_rgbd != "") {
+    RgbdRecorder::Options record_options;
+    record_options.compress = FLAGS_sm_record_compressed;
+    record_options.max_queued_bytes =
+      static_cast<int64_t>(FLAGS_sm_record_queue_mb) << 20;
+    recorder = std::make_unique<RgbdRecorder>(
+      rgbd_input.recordedStreamMetadata(), FLAGS_sm_record_rgbd,
+      record_options);
+    if (!recorder->IsOpen()) {
+      fprintf(stderr, "Error opening %s for recording.\n",
+        FLAGS_sm_record_rgbd.c_str());
+      return 1;
+    }
+    rgbd_input.setRecorder(recorder.get());
+  }
 
   std::unique_ptr<RegularGridFusionPipeline> pipeline;
 
@@ -168,7 +349,7 @@ int SingleMovingCameraMain(int argc, char* argv[]) {
     }
     pose_options.precomputed_path = LoadPoseHistory(FLAGS_sm_pose_file,
       camera_params.depth_from_color);
-    if (pose_options.precomputed_path.size() == 0) {
+    if (pose_options.precomputed_path.IsEmpty()) {
       fprintf(stderr, "Error: failed to load pose history from %s\n",
         FLAGS_sm_pose_file.c_str());
       return 1;
@@ -193,9 +374,26 @@ int SingleMovingCameraMain(int argc, char* argv[]) {
   main_widget.move(x, y);
   main_widget.resize(window_width, window_height);
 
-  MainController controller(&rgbd_input, pipeline.get(),
-    &control_widget, &main_widget);
-  return app.exec();
+  int exit_code = 0;
+  {
+    MainController controller(&rgbd_input, pipeline.get(),
+      &control_widget, &main_widget);
+    exit_code = app.exec();
+  }
+
+  // The controller has stopped reading: nothing more is recorded.
+  if (recorder != nullptr) {
+    rgbd_input.setRecorder(nullptr);
+    bool recorded = recorder->Close();
+    printf("Recorded %lld frames to %s (%lld dropped).\n",
+      static_cast<long long>(recorder->NumRecordedFrames()),
+      FLAGS_sm_record_rgbd.c_str(),
+      static_cast<long long>(recorder->NumDroppedFrames()));
+    if (!recorded) {
+      fprintf(stderr, "Error writing %s.\n", FLAGS_sm_record_rgbd.c_str());
+    }
+  }
+  return exit_code;
 }
 
 #include "libcgt/core/vecmath/Quat4f.h"
@@ -354,6 +552,7 @@ int MultiStaticCameraMain(int argc, char* argv[]) {
     for(size_t i = 0; i < rgbd_stream_filenames.size(); ++i) {
       controller.inputs_.emplace_back(RgbdInput::InputType::FILE,
                                       rgbd_stream_filenames[i].c_str());
+      controller.inputs_.back().setRawDepth(FLAGS_gpu_depth_conversion);
     }
     controller.msc_pipeline_ = &pipeline;
     return app.exec();
@@ -362,6 +561,7 @@ int MultiStaticCameraMain(int argc, char* argv[]) {
     for(size_t i = 0; i < rgbd_stream_filenames.size(); ++i) {
       inputs.emplace_back(RgbdInput::InputType::FILE,
         rgbd_stream_filenames[i].c_str());
+      inputs.back().setRawDepth(FLAGS_gpu_depth_conversion);
     }
 
     NumberedFilenameBuilder nfb("c:/tmp/multicam/meshes/frame_", ".obj");
@@ -399,15 +599,89 @@ int MultiStaticCameraMain(int argc, char* argv[]) {
 
 int main(int argc, char* argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_tsdf_volume != kRegularGridTSDFVolumeType &&
+    FLAGS_tsdf_volume != kBrickedGridTSDFVolumeType &&
+    FLAGS_tsdf_volume != kVoxelHashedTSDFVolumeType &&
+    FLAGS_tsdf_volume != kPartitionedTSDFVolumeType) {
+    printf("Invalid tsdf_volume: %s.\n", FLAGS_tsdf_volume.c_str());
+    return 1;
+  }
+  DepthProcessor::Options depth_processor_options;
+  if (!ParseDepthProcessorOptions(FLAGS_depth_smoothing,
+    FLAGS_depth_smoothing_spatial_sigma, FLAGS_depth_smoothing_range_sigma,
+    &depth_processor_options)) {
+    printf("Invalid depth_smoothing (%s), or a depth_smoothing sigma is not "
+      "positive.\n", FLAGS_depth_smoothing.c_str());
+    return 1;
+  }
+  ICPErrorMetric icp_error_metric;
+  if (!ParseICPErrorMetric(FLAGS_icp_error_metric, &icp_error_metric)) {
+    printf("Invalid icp_error_metric: %s.\n",
+      FLAGS_icp_error_metric.c_str());
+    return 1;
+  }
+  if (FLAGS_lod_raycast && FLAGS_texture_raycast) {
+    printf("lod_raycast and texture_raycast are exclusive.\n");
+    return 1;
+  }
+  FrameQueuePolicy capture_queue_policy;
+  if (!FLAGS_capture_queue_policy.empty() &&
+    !ParseFrameQueuePolicy(FLAGS_capture_queue_policy,
+      &capture_queue_policy)) {
+    printf("Invalid capture_queue_policy: %s.\n",
+      FLAGS_capture_queue_policy.c_str());
+    return 1;
+  }
+  if (FLAGS_capture_queue_capacity < 1) {
+    printf("capture_queue_capacity must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_fusion_batch_size < 1) {
+    printf("fusion_batch_size must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_raycast_reuse_max_rotation_degrees < 0 ||
+    FLAGS_raycast_reuse_max_translation < 0) {
+    printf("raycast_reuse tolerances must be nonnegative.\n");
+    return 1;
+  }
+  if (FLAGS_aruco_detection_scale <= 0.0 ||
+    FLAGS_aruco_detection_scale > 1.0) {
+    printf("aruco_detection_scale must be in (0, 1].\n");
+    return 1;
+  }
+  if (FLAGS_device_pool_capacity_mb < 0) {
+    printf("device_pool_capacity_mb must be nonnegative.\n");
+    return 1;
+  }
+  DeviceArrayPool::Get().SetCapacity(
+    static_cast<size_t>(FLAGS_device_pool_capacity_mb) << 20);
+  if (!FLAGS_launch_config_cache.empty() &&
+    !LaunchTuner::Get().Load(FLAGS_launch_config_cache)) {
+    fprintf(stderr, "Ignoring the rest of %s: it cannot be parsed.\n",
+      FLAGS_launch_config_cache.c_str());
+  }
+  LaunchTuner::Get().SetTuning(FLAGS_autotune_launches);
+  if (!FLAGS_trace_out.empty()) {
+    TraceRecorder::Get().Start();
+  }
+  int result;
   if (FLAGS_mode == "single_moving") {
-    return SingleMovingCameraMain(argc, argv);
+    result = SingleMovingCameraMain(argc, argv);
   } else if (FLAGS_mode == "multi_static") {
-    return MultiStaticCameraMain(argc, argv);
+    result = MultiStaticCameraMain(argc, argv);
   } else {
     printf("Invalid mode: %s.\n"
       "mode must be \"single_moving\" or \"multi_static\"\n",
       FLAGS_mode.c_str());
     return 1;
   }
+  PerfCollector::Get().Report(FLAGS_perf_csv, FLAGS_perf_json);
+  if (!FLAGS_trace_out.empty() &&
+    !TraceRecorder::Get().Write(FLAGS_trace_out)) {
+    fprintf(stderr, "Failed to write trace to %s.\n",
+      FLAGS_trace_out.c_str());
+  }
+  return result;
 }
 
@@ -0,0 +1,553 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// Benchmarks the GPU stages of the pipeline, to compare GPUs and catch
+// regressions.
+//
+// Synthetic mode (the default) renders an analytic scene, a sphere next to a
+// box, into depth maps from a camera orbiting it, then sweeps over grid
+// resolutions (--resolutions) and image sizes (--image_sizes). For each
+// combination, it times Fuse(), FuseMultiple(), both raycasters, the
+// DepthProcessor kernels, ICP and marching cubes, and reports ms per frame
+// and throughput.
+//
+// With --input_rgbd, it instead tracks and fuses the depth frames of a
+// recording with ICP, as fuse_depth_cli --pose_estimator=depth_icp would,
+// and reports per-stage percentiles from PerfCollector.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <cuda_runtime.h>
+#include <vector_functions.h>
+#include <gflags/gflags.h>
+#include "libcgt/core/cameras/Intrinsics.h"
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/common/Array3D.h"
+#include "libcgt/core/geometry/TriangleMesh.h"
+#include "libcgt/core/vecmath/EuclideanTransform.h"
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Range1f.h"
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+#include "libcgt/core/vecmath/Vector2i.h"
+#include "libcgt/core/vecmath/Vector3f.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+#include "libcgt/cuda/VecmathConversions.h"
+#include <third_party/pystring/pystring.h>
+
+#include "../calibrated_posed_depth_camera.h"
+#include "../depth_processor.h"
+#include "../depth_pyramid.h"
+#include "../input_buffer.h"
+#include "../marching_cubes.h"
+#include "../perf_collector.h"
+#include "../projective_point_plane_icp.h"
+#include "../regular_grid_tsdf.h"
+#include "../rgbd_camera_parameters.h"
+#include "../rgbd_input.h"
+#include "../tsdf.h"
+
+DEFINE_bool(collect_perf, false, "Collect performance statistics. Always on "
+  "with --input_rgbd.");
+
+// Synthetic sweep.
+DEFINE_string(resolutions, "128,256,512",
+  "Comma-separated grid resolutions (voxels per side) to sweep over.");
+DEFINE_string(image_sizes, "320x240,640x480",
+  "Comma-separated depth image sizes (WIDTHxHEIGHT) to sweep over.");
+DEFINE_int32(frames, 30, "Number of orbiting frames per configuration.");
+DEFINE_int32(host_marching_cubes_max_resolution, 256,
+  "Also time marching cubes on the host for grids up to this resolution.");
+
+// Recorded input.
+DEFINE_string(input_rgbd, "",
+  "[Optional] Benchmark on the depth frames of this .rgbd file instead.");
+DEFINE_string(calibration_dir, "",
+  "Calibration directory for --input_rgbd.");
+DEFINE_int32(rgbd_resolution, 512,
+  "Grid resolution for --input_rgbd. The grid is 2 m on a side.");
+
+using libcgt::core::cameras::Intrinsics;
+using libcgt::core::vecmath::EuclideanTransform;
+using libcgt::core::vecmath::SimilarityTransform;
+using libcgt::core::vecmath::inverse;
+
+namespace {
+
+// The synthetic scene lives in the [-0.5, 0.5]^3 m cube covered by the grid.
+const Vector3f kSphereCenter{ -0.12f, 0.0f, 0.0f };
+const float kSphereRadius = 0.22f;
+const Vector3f kBoxCenter{ 0.2f, -0.05f, 0.08f };
+const Vector3f kBoxHalfSize{ 0.12f, 0.17f, 0.12f };
+const float kSceneSideLength = 1.0f;
+
+const float kOrbitRadius = 1.1f;
+// Small enough for ICP to track from one frame to the next.
+const float kOrbitStepRadians = 0.05f;
+const Range1f kDepthRange = Range1f::fromMinMax(0.3f, 3.0f);
+
+const int kNumFuseMultipleCameras = 4;
+
+using Clock = std::chrono::steady_clock;
+
+// Synchronizes the device before and after f and returns the elapsed time.
+double TimeMS(const std::function<void()>& f) {
+  cudaDeviceSynchronize();
+  Clock::time_point t0 = Clock::now();
+  f();
+  cudaDeviceSynchronize();
+  return std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+}
+
+std::vector<int> ParseResolutions(const std::string& s) {
+  std::vector<std::string> tokens;
+  pystring::split(s, tokens, ",");
+  std::vector<int> resolutions;
+  for (const std::string& token : tokens) {
+    int r = atoi(token.c_str());
+    if (r > 0) {
+      resolutions.push_back(r);
+    }
+  }
+  return resolutions;
+}
+
+std::vector<Vector2i> ParseImageSizes(const std::string& s) {
+  std::vector<std::string> tokens;
+  pystring::split(s, tokens, ",");
+  std::vector<Vector2i> sizes;
+  for (const std::string& token : tokens) {
+    int w = 0;
+    int h = 0;
+    if (sscanf(token.c_str(), "%dx%d", &w, &h) == 2 && w > 0 && h > 0) {
+      sizes.push_back({ w, h });
+    }
+  }
+  return sizes;
+}
+
+// A horizontal field of view of about 60 degrees, like a Kinect.
+Intrinsics SyntheticIntrinsics(const Vector2i& image_size) {
+  Intrinsics intrinsics;
+  intrinsics.focalLength = Vector2f(0.85f * image_size.x);
+  intrinsics.principalPoint = 0.5f * Vector2f(image_size);
+  return intrinsics;
+}
+
+Vector4f FLPP(const Intrinsics& intrinsics) {
+  return{ intrinsics.focalLength, intrinsics.principalPoint };
+}
+
+EuclideanTransform OrbitCameraFromWorld(float theta) {
+  Vector3f eye = kOrbitRadius *
+    Vector3f(std::sin(theta), 0.3f, std::cos(theta));
+  return EuclideanTransform::fromMatrix(
+    Matrix4f::lookAt(eye, Vector3f{ 0 }, Vector3f{ 0, 1, 0 }));
+}
+
+// Distance along the ray to the nearest surface of the scene, or 0 if it
+// misses.
+float IntersectScene(const Vector3f& origin, const Vector3f& direction) {
+  float t_hit = INFINITY;
+
+  Vector3f oc = origin - kSphereCenter;
+  float b = Vector3f::dot(oc, direction);
+  float c = Vector3f::dot(oc, oc) - kSphereRadius * kSphereRadius;
+  float discriminant = b * b - c;
+  if (discriminant >= 0) {
+    float t = -b - std::sqrt(discriminant);
+    if (t > 0) {
+      t_hit = t;
+    }
+  }
+
+  // Slab test.
+  float t_near = -INFINITY;
+  float t_far = INFINITY;
+  for (int i = 0; i < 3; ++i) {
+    float lo = kBoxCenter[i] - kBoxHalfSize[i] - origin[i];
+    float hi = kBoxCenter[i] + kBoxHalfSize[i] - origin[i];
+    if (direction[i] == 0) {
+      if (lo > 0 || hi < 0) {
+        t_near = INFINITY;
+      }
+      continue;
+    }
+    float t0 = lo / direction[i];
+    float t1 = hi / direction[i];
+    t_near = std::max(t_near, std::min(t0, t1));
+    t_far = std::min(t_far, std::max(t0, t1));
+  }
+  if (t_near <= t_far && t_near > 0) {
+    t_hit = std::min(t_hit, t_near);
+  }
+
+  return std::isinf(t_hit) ? 0.0f : t_hit;
+}
+
+// Renders the orthogonal depth of the scene (y up, like the pipeline's depth
+// maps).
+Array2D<float> RenderDepth(const EuclideanTransform& camera_from_world,
+  const Intrinsics& intrinsics, const Vector2i& image_size) {
+  EuclideanTransform world_from_camera = inverse(camera_from_world);
+  Vector3f eye = world_from_camera.translation;
+  Array2D<float> depth(image_size);
+  for (int y = 0; y < image_size.y; ++y) {
+    for (int x = 0; x < image_size.x; ++x) {
+      // The camera looks down -z: a unit step along it is a unit of depth.
+      Vector3f camera_direction{
+        (x + 0.5f - intrinsics.principalPoint.x) / intrinsics.focalLength.x,
+        (y + 0.5f - intrinsics.principalPoint.y) / intrinsics.focalLength.y,
+        -1.0f
+      };
+      Vector3f world_direction = world_from_camera.rotation * camera_direction;
+      float norm = world_direction.norm();
+      float t = IntersectScene(eye, world_direction / norm);
+      float z = t / norm;
+      depth[{ x, y }] = (z >= kDepthRange.minimum() &&
+        z <= kDepthRange.maximum()) ? z : 0.0f;
+    }
+  }
+  return depth;
+}
+
+struct SyntheticFrame {
+  EuclideanTransform camera_from_world;
+  DeviceArray2D<float> depth;
+};
+
+void PrintRow(int resolution, const Vector2i& image_size, const char* stage,
+  double ms_per_frame, double throughput, const char* unit) {
+  printf("%6d %5dx%-5d %-26s %10.3f %12.3f %s\n", resolution, image_size.x,
+    image_size.y, stage, ms_per_frame, throughput, unit);
+}
+
+void BenchmarkSynthetic(int resolution, const Vector2i& image_size,
+  std::vector<SyntheticFrame>& frames,
+  const std::vector<CalibratedPosedDepthCamera>& fuse_multiple_cameras,
+  const std::vector<DeviceArray2D<float>>& fuse_multiple_depth_maps) {
+  const Intrinsics intrinsics = SyntheticIntrinsics(image_size);
+  const Vector4f flpp = FLPP(intrinsics);
+  const float voxel_size = kSceneSideLength / resolution;
+  const SimilarityTransform world_from_grid =
+    SimilarityTransform(voxel_size) *
+    SimilarityTransform(Vector3f(-0.5f * resolution));
+  const float max_tsdf_value = 4.0f * voxel_size;
+  const int num_frames = static_cast<int>(frames.size());
+  const double num_voxels = std::pow(static_cast<double>(resolution), 3);
+  const double num_pixels = static_cast<double>(image_size.x) * image_size.y;
+
+  RegularGridTSDF tsdf(Vector3i(resolution), world_from_grid,
+    max_tsdf_value);
+
+  double ms = TimeMS([&]() {
+    for (SyntheticFrame& frame : frames) {
+      tsdf.Fuse(flpp, kDepthRange, frame.camera_from_world.asMatrix(),
+        frame.depth);
+    }
+  }) / num_frames;
+  PrintRow(resolution, image_size, "Fuse", ms, num_voxels / (1e6 * ms),
+    "Gvoxels/s");
+
+  {
+    RegularGridTSDF tsdf_multiple(Vector3i(resolution), world_from_grid,
+      max_tsdf_value);
+    ms = TimeMS([&]() {
+      tsdf_multiple.FuseMultiple(fuse_multiple_cameras,
+        fuse_multiple_depth_maps);
+    });
+    PrintRow(resolution, image_size, "FuseMultiple (4 views)", ms,
+      num_voxels / (1e6 * ms), "Gvoxels/s");
+  }
+
+  DeviceArray2D<float4> world_points(image_size);
+  DeviceArray2D<float4> world_normals(image_size);
+  for (int adaptive = 0; adaptive < 2; ++adaptive) {
+    ms = TimeMS([&]() {
+      for (const SyntheticFrame& frame : frames) {
+        Matrix4f world_from_camera =
+          inverse(frame.camera_from_world).asMatrix();
+        if (adaptive) {
+          tsdf.AdaptiveRaycast(flpp, world_from_camera, world_points,
+            world_normals);
+        } else {
+          tsdf.Raycast(flpp, world_from_camera, world_points,
+            world_normals);
+        }
+      }
+    }) / num_frames;
+    PrintRow(resolution, image_size,
+      adaptive ? "AdaptiveRaycast" : "Raycast", ms, num_pixels / (1e3 * ms),
+      "Mrays/s");
+  }
+
+  DepthProcessor depth_processor(intrinsics, kDepthRange);
+  DeviceArray2D<float> smoothed_depth(image_size);
+  DeviceArray2D<float4> normals(image_size);
+  ms = TimeMS([&]() {
+    for (SyntheticFrame& frame : frames) {
+      depth_processor.Smooth(frame.depth, smoothed_depth);
+    }
+  }) / num_frames;
+  PrintRow(resolution, image_size, "DepthProcessor::Smooth", ms,
+    num_pixels / (1e3 * ms), "Mpixels/s");
+  {
+    DepthProcessor::Options options;
+    options.smoothing_method = DepthSmoothingMethod::SEPARABLE_BILATERAL;
+    DepthProcessor separable_processor(intrinsics, kDepthRange, options);
+    ms = TimeMS([&]() {
+      for (SyntheticFrame& frame : frames) {
+        separable_processor.Smooth(frame.depth, smoothed_depth);
+      }
+    }) / num_frames;
+    PrintRow(resolution, image_size, "Smooth (separable)", ms,
+      num_pixels / (1e3 * ms), "Mpixels/s");
+  }
+  ms = TimeMS([&]() {
+    for (int i = 0; i < num_frames; ++i) {
+      depth_processor.EstimateNormals(smoothed_depth, normals);
+    }
+  }) / num_frames;
+  PrintRow(resolution, image_size, "EstimateNormals", ms,
+    num_pixels / (1e3 * ms), "Mpixels/s");
+  ms = TimeMS([&]() {
+    for (SyntheticFrame& frame : frames) {
+      depth_processor.Preprocess(frame.depth, smoothed_depth, normals);
+    }
+  }) / num_frames;
+  PrintRow(resolution, image_size, "DepthProcessor::Preprocess", ms,
+    num_pixels / (1e3 * ms), "Mpixels/s");
+  {
+    DepthPyramid pyramid(image_size, flpp,
+      ProjectivePointPlaneICP::kNumPyramidLevels);
+    depth_processor.Preprocess(frames[0].depth, pyramid.levels[0].depth,
+      pyramid.levels[0].normals);
+    ms = TimeMS([&]() {
+      for (int i = 0; i < num_frames; ++i) {
+        depth_processor.BuildPyramid(pyramid);
+      }
+    }) / num_frames;
+    PrintRow(resolution, image_size, "BuildPyramid", ms,
+      num_pixels / (1e3 * ms), "Mpixels/s");
+  }
+
+  // Track each frame from a raycast at the previous one, as the pipeline
+  // does. Only EstimatePose() is timed.
+  ProjectivePointPlaneICP icp(image_size, intrinsics, kDepthRange);
+  DeviceArray2D<uchar4> icp_vis(image_size);
+  double icp_ms = 0;
+  int num_tracked = 0;
+  for (int i = 1; i < num_frames; ++i) {
+    EuclideanTransform previous_world_from_camera =
+      inverse(frames[i - 1].camera_from_world);
+    tsdf.AdaptiveRaycast(flpp, previous_world_from_camera.asMatrix(),
+      world_points, world_normals);
+    depth_processor.Smooth(frames[i].depth, smoothed_depth);
+    depth_processor.EstimateNormals(smoothed_depth, normals);
+    ProjectivePointPlaneICP::Result result;
+    icp_ms += TimeMS([&]() {
+      result = icp.EstimatePose(smoothed_depth, normals,
+        previous_world_from_camera, world_points, world_normals, icp_vis);
+    });
+    num_tracked += result.valid ? 1 : 0;
+  }
+  if (num_frames > 1) {
+    ms = icp_ms / (num_frames - 1);
+    PrintRow(resolution, image_size, "ICP::EstimatePose", ms, 1e3 / ms,
+      "frames/s");
+    if (num_tracked < num_frames - 1) {
+      printf("  ICP lost track on %d of %d frames\n",
+        num_frames - 1 - num_tracked, num_frames - 1);
+    }
+  }
+
+  TriangleMesh mesh;
+  ms = TimeMS([&]() {
+    mesh = tsdf.Triangulate();
+  });
+  PrintRow(resolution, image_size, "Triangulate", ms,
+    num_voxels / (1e6 * ms), "Gvoxels/s");
+
+  if (resolution <= FLAGS_host_marching_cubes_max_resolution) {
+    Array3D<TSDF> grid(Vector3i(resolution));
+    tsdf.Download(grid.writeView());
+    ms = TimeMS([&]() {
+      mesh = ParallelMarchingCubes(grid.readView(), max_tsdf_value,
+        world_from_grid);
+    });
+    PrintRow(resolution, image_size, "ParallelMarchingCubes", ms,
+      num_voxels / (1e6 * ms), "Gvoxels/s");
+  }
+}
+
+int RunSynthetic() {
+  std::vector<int> resolutions = ParseResolutions(FLAGS_resolutions);
+  std::vector<Vector2i> image_sizes = ParseImageSizes(FLAGS_image_sizes);
+  if (resolutions.empty() || image_sizes.empty() || FLAGS_frames <= 0) {
+    fprintf(stderr, "Need at least one resolution, image size and frame.\n");
+    return 1;
+  }
+
+  cudaDeviceProp properties;
+  int device = 0;
+  cudaGetDevice(&device);
+  cudaGetDeviceProperties(&properties, device);
+  printf("Device %d: %s\n", device, properties.name);
+  printf("%6s %11s %-26s %10s %12s\n", "grid", "image", "stage", "ms/frame",
+    "throughput");
+
+  for (const Vector2i& image_size : image_sizes) {
+    const Intrinsics intrinsics = SyntheticIntrinsics(image_size);
+    std::vector<SyntheticFrame> frames(FLAGS_frames);
+    for (int i = 0; i < FLAGS_frames; ++i) {
+      frames[i].camera_from_world = OrbitCameraFromWorld(
+        i * kOrbitStepRadians);
+      frames[i].depth.resize(image_size);
+      copy(RenderDepth(frames[i].camera_from_world, intrinsics,
+        image_size).readView(), frames[i].depth);
+    }
+    // Surrounding the scene.
+    std::vector<CalibratedPosedDepthCamera> fuse_multiple_cameras(
+      kNumFuseMultipleCameras);
+    std::vector<DeviceArray2D<float>> fuse_multiple_depth_maps(
+      kNumFuseMultipleCameras);
+    for (int i = 0; i < kNumFuseMultipleCameras; ++i) {
+      EuclideanTransform camera_from_world = OrbitCameraFromWorld(
+        2.0f * static_cast<float>(M_PI) * i / kNumFuseMultipleCameras);
+      CalibratedPosedDepthCamera& camera = fuse_multiple_cameras[i];
+      camera.flpp = make_float4(make_float2(intrinsics.focalLength),
+        make_float2(intrinsics.principalPoint));
+      camera.depth_min_max = make_float2(kDepthRange.leftRight());
+      camera.camera_from_world = make_float4x4(camera_from_world.asMatrix());
+      fuse_multiple_depth_maps[i].resize(image_size);
+      copy(RenderDepth(camera_from_world, intrinsics, image_size).readView(),
+        fuse_multiple_depth_maps[i]);
+    }
+
+    for (int resolution : resolutions) {
+      BenchmarkSynthetic(resolution, image_size, frames,
+        fuse_multiple_cameras, fuse_multiple_depth_maps);
+    }
+  }
+  return 0;
+}
+
+int RunRgbd() {
+  FLAGS_collect_perf = true;
+
+  RGBDCameraParameters camera_params;
+  if (!LoadRGBDCameraParameters(FLAGS_calibration_dir, &camera_params)) {
+    fprintf(stderr, "Error loading RGBD camera parameters from %s.\n",
+      FLAGS_calibration_dir.c_str());
+    return 1;
+  }
+  const CameraParameters& depth_params = camera_params.depth;
+  const Vector2i image_size = depth_params.resolution;
+  const Vector4f flpp = FLPP(depth_params.intrinsics);
+
+  // Like fuse_depth_cli with depth_icp: a 2 m cube whose front face is
+  // centered on the first camera.
+  const int resolution = FLAGS_rgbd_resolution;
+  const float voxel_size = 2.0f / resolution;
+  RegularGridTSDF tsdf(Vector3i(resolution),
+    SimilarityTransform(voxel_size) *
+      SimilarityTransform(Vector3f(-0.5f * resolution, -0.5f * resolution,
+        -static_cast<float>(resolution))),
+    4.0f * voxel_size);
+  EuclideanTransform camera_from_world = EuclideanTransform::fromMatrix(
+    Matrix4f::lookAt({ 0, 0, depth_params.depth_range.minimum() },
+      Vector3f{ 0 }, Vector3f{ 0, 1, 0 }));
+
+  DepthProcessor depth_processor(depth_params.intrinsics,
+    depth_params.depth_range);
+  ProjectivePointPlaneICP icp(image_size, depth_params.intrinsics,
+    depth_params.depth_range);
+
+  DeviceArray2D<float> depth(image_size);
+  DeviceArray2D<float> smoothed_depth(image_size);
+  DeviceArray2D<float4> normals(image_size);
+  DeviceArray2D<float4> world_points(image_size);
+  DeviceArray2D<float4> world_normals(image_size);
+  DeviceArray2D<uchar4> icp_vis(image_size);
+
+  RgbdInput rgbd_input(RgbdInput::InputType::FILE, FLAGS_input_rgbd.c_str());
+  InputBuffer input_buffer(camera_params.color.resolution, image_size);
+
+  int num_frames = 0;
+  int num_lost = 0;
+  bool color_updated;
+  bool depth_updated;
+  // Only depth is benchmarked: skip color.
+  rgbd_input.read(&input_buffer, &color_updated, &depth_updated,
+    InputStreams::DEPTH);
+  while (color_updated || depth_updated) {
+    if (depth_updated) {
+      PerfCollector::Get().BeginFrame();
+      {
+        ScopedGPUTimer timer("upload");
+        copy(input_buffer.depth_meters.readView(), depth);
+      }
+      depth_processor.Smooth(depth, smoothed_depth);
+      depth_processor.EstimateNormals(smoothed_depth, normals);
+      if (num_frames > 0) {
+        ProjectivePointPlaneICP::Result result = icp.EstimatePose(
+          smoothed_depth, normals, inverse(camera_from_world), world_points,
+          world_normals, icp_vis);
+        if (result.valid) {
+          camera_from_world = inverse(result.world_from_camera);
+        } else {
+          ++num_lost;
+        }
+      }
+      tsdf.Fuse(flpp, depth_params.depth_range, camera_from_world.asMatrix(),
+        depth);
+      tsdf.AdaptiveRaycast(flpp, inverse(camera_from_world).asMatrix(),
+        world_points, world_normals);
+      cudaDeviceSynchronize();
+      PerfCollector::Get().EndFrame();
+      ++num_frames;
+    }
+    rgbd_input.read(&input_buffer, &color_updated, &depth_updated,
+      InputStreams::DEPTH);
+  }
+
+  {
+    ScopedCPUTimer timer("Triangulate (total)");
+    tsdf.Triangulate();
+  }
+
+  printf("%d depth frames, ICP lost track on %d\n", num_frames, num_lost);
+  PerfCollector::Get().Print(stdout);
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (!FLAGS_input_rgbd.empty()) {
+    if (FLAGS_calibration_dir.empty()) {
+      fprintf(stderr, "--input_rgbd requires --calibration_dir.\n");
+      return 1;
+    }
+    return RunRgbd();
+  }
+  return RunSynthetic();
+}
@@ -13,77 +13,80 @@
 // limitations under the License.
 #include "depth_processor.h"
 
-#include "libcgt/cuda/Event.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <string>
+
 #include "libcgt/cuda/MathUtils.h"
 #include "libcgt/cuda/Rect2i.h"
 #include "libcgt/cuda/ThreadMath.cuh"
 #include "libcgt/cuda/VecmathConversions.h"
 
 #include "camera_math.cuh"
+#include "launch_tuner.h"
+#include "perf_collector.h"
+#include "trace.h"
 
-using libcgt::cuda::Event;
 using libcgt::cuda::threadmath::threadSubscript2DGlobal;
 using libcgt::cuda::contains;
-using libcgt::cuda::inset;
 using libcgt::cuda::math::numBins2D;
 
-__global__
-void SmoothDepthMapKernel(KernelArray2D<const float> input,
-  float2 depth_min_max,
-  int kernel_radius,
-  float delta_z_squared_threshold,
-  KernelArray2D<float> smoothed) {
-  int2 xy = threadSubscript2DGlobal();
-  libcgt::cuda::Rect2i valid_rect = inset(libcgt::cuda::Rect2i(input.size()),
-    { kernel_radius, kernel_radius });
-  float z = input[xy];
-  float smoothed_z = 0.0f;
-  if (contains(valid_rect, xy) &&
-    z >= depth_min_max.x && z <= depth_min_max.y) {
-
-    float sum = 0.0f;
-    float sum_weights = 0.0f;
-
-    for (int dy = -kernel_radius; dy <= kernel_radius; ++dy) {
-      for (int dx = -kernel_radius; dx <= kernel_radius; ++dx) {
-        float z2 = input[xy + int2{dx, dy}];
-        float delta_z = z2 - z;
-        float delta_z_squared = delta_z * delta_z;
-        if (z2 != 0 && delta_z_squared < delta_z_squared_threshold) {
-          float dr2 = dx * dx + dy * dy;
-          float dr = sqrt(dr2);
-          // TODO(jiawen): Hacky bilateral filter without exp().
-          float spatial_weight = 1.0f / (1.0f + dr);
-          float range_weight = delta_z_squared_threshold - delta_z_squared;
-          float weight = spatial_weight * range_weight;
-          sum += weight * z2;
-          sum_weights += weight;
-        }
-      }
-    }
-
-    if (sum_weights > 0.0f) {
-      smoothed_z = sum / sum_weights;
-    }
-  }
-  smoothed[xy] = smoothed_z;
+namespace {
+
+constexpr int kMaxUndistortBatchSize = 8;
+
+struct UndistortJob {
+  cudaTextureObject_t raw_depth;
+  cudaTextureObject_t undistort_map;
+  KernelArray2D<float> undistorted;
+};
+
+// Passed by value as a kernel parameter, so that launching a batch needs no
+// upload.
+struct UndistortBatch {
+  UndistortJob jobs[kMaxUndistortBatchSize];
+};
+
+// Point-sampled texture descriptors: raw depth is read with normalized
+// coordinates and undistort maps with unnormalized coordinates.
+cudaTextureDesc PointTextureDesc(bool normalized_coords) {
+  cudaTextureDesc tex_desc = {};
+  tex_desc.addressMode[0] = cudaAddressModeClamp;
+  tex_desc.addressMode[1] = cudaAddressModeClamp;
+  tex_desc.filterMode = cudaFilterModePoint;
+  tex_desc.readMode = cudaReadModeElementType;
+  tex_desc.normalizedCoords = normalized_coords;
+  return tex_desc;
 }
 
+}  // namespace
+
 __global__
-void UndistortKernel(cudaTextureObject_t raw_depth,
-  cudaTextureObject_t undistort_map,
-  KernelArray2D<float> undistorted) {
+void UndistortBatchKernel(UndistortBatch batch) {
+  const UndistortJob& job = batch.jobs[blockIdx.z];
   int2 xy = threadSubscript2DGlobal();
-  if (contains(libcgt::cuda::Rect2i(undistorted.size()), xy)) {
+  if (contains(libcgt::cuda::Rect2i(job.undistorted.size()), xy)) {
     // TODO: make a function to go from xy to [0,1]
 
     float u = xy.x + 0.5f;
     float v = xy.y + 0.5f;
 
     // Fetch from undistort_map[uv] to get xy2.
-    float2 xy2 = tex2D<float2>(undistort_map, u, v);
+    float2 xy2 = tex2D<float2>(job.undistort_map, u, v);
+
+    job.undistorted[xy] = tex2D<float>(job.raw_depth, xy2.x, xy2.y);
+  }
+}
 
-    undistorted[xy] = tex2D<float>(raw_depth, xy2.x, xy2.y);
+__global__
+void ConvertRawDepthKernel(KernelArray2D<const uint16_t> raw_depth_mm_ydown,
+  KernelArray2D<float> depth_meters) {
+  int2 xy = threadSubscript2DGlobal();
+  if (contains(libcgt::cuda::Rect2i(depth_meters.size()), xy)) {
+    int2 src_xy{ xy.x, raw_depth_mm_ydown.height() - 1 - xy.y };
+    uint16_t depth_mm = raw_depth_mm_ydown[src_xy];
+    depth_meters[xy] = depth_mm > 0 ? 0.001f * depth_mm : 0.0f;
   }
 }
 
@@ -124,93 +127,590 @@ void EstimateNormalsKernel(KernelArray2D<const float> depth_map,
   normals[xy] = normal;
 }
 
+namespace {
+
+// Halves the resolution of a depth map. Each output pixel is the average of
+// the valid depths in its 2x2 block that are within max_depth_difference of
+// the block's top left depth, so that averages do not straddle edges.
+__global__
+void DownsampleDepthKernel(KernelArray2D<const float> src,
+  float2 depth_min_max,
+  float max_depth_difference,
+  KernelArray2D<float> dst) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(libcgt::cuda::Rect2i(dst.size()), xy)) {
+    return;
+  }
+
+  int2 src_xy = 2 * xy;
+  float z0 = src[src_xy];
+  float sum = 0.0f;
+  int count = 0;
+  if (z0 >= depth_min_max.x && z0 <= depth_min_max.y) {
+    for (int dy = 0; dy < 2; ++dy) {
+      for (int dx = 0; dx < 2; ++dx) {
+        float z = src[src_xy + int2{ dx, dy }];
+        if (z >= depth_min_max.x && z <= depth_min_max.y &&
+          fabsf(z - z0) <= max_depth_difference) {
+          sum += z;
+          ++count;
+        }
+      }
+    }
+  }
+  dst[xy] = count > 0 ? sum / count : 0.0f;
+}
+
+}  // namespace
+
+// Back-projects depth_map into camera-space vertices. With kNormals, also
+// estimates normals like EstimateNormalsKernel.
+template <bool kNormals>
+__global__
+void VerticesAndNormalsKernel(KernelArray2D<const float> depth_map,
+  float4 flpp, float2 depth_min_max,
+  KernelArray2D<float4> vertices,
+  KernelArray2D<float4> normals) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(libcgt::cuda::Rect2i(depth_map.size()), xy)) {
+    return;
+  }
+
+  float depth0 = depth_map[xy];
+  bool valid0 = depth0 >= depth_min_max.x && depth0 <= depth_min_max.y;
+  float3 p0 = CameraFromPixel(xy, depth0, flpp);
+  vertices[xy] = valid0 ? make_float4(p0, 1.0f) : float4{};
+
+  if (!kNormals) {
+    return;
+  }
+
+  float4 normal = {};
+  if (valid0 && xy.x < depth_map.width() - 1 &&
+    xy.y < depth_map.height() - 1) {
+    int2 xy1{ xy.x + 1, xy.y };
+    int2 xy2{ xy.x, xy.y + 1 };
+    float depth1 = depth_map[xy1];
+    float depth2 = depth_map[xy2];
+    if (depth1 >= depth_min_max.x && depth1 <= depth_min_max.y &&
+      depth2 >= depth_min_max.x && depth2 <= depth_min_max.y) {
+      float3 p1 = CameraFromPixel(xy1, depth1, flpp);
+      float3 p2 = CameraFromPixel(xy2, depth2, flpp);
+      float3 n = cross(p1 - p0, p2 - p0);
+      float lenSquared = lengthSquared(n);
+      if (lenSquared > 0.0f) {
+        normal = make_float4(n / sqrt(lenSquared), 1.0f);
+      }
+    }
+  }
+  normals[xy] = normal;
+}
+
+namespace {
+
+struct BilateralParams {
+  int radius;
+  // 1 / (2 sigma^2) for the spatial (in pixels) and range (in meters)
+  // Gaussians.
+  float spatial_falloff;
+  float range_falloff;
+  // Squared depth differences at or beyond this get zero weight.
+  float max_delta_z_squared;
+  float2 depth_min_max;
+};
+
+__inline__ __device__
+bool IsValidDepth(float z, float2 depth_min_max) {
+  return z >= depth_min_max.x && z <= depth_min_max.y;
+}
+
+// Accumulates neighbor z2 of center z at squared pixel distance dr2.
+__inline__ __device__
+void AccumulateBilateral(float z, float z2, float dr2,
+  const BilateralParams& params, float* sum, float* sum_weights) {
+  float delta_z = z2 - z;
+  float delta_z_squared = delta_z * delta_z;
+  if (IsValidDepth(z2, params.depth_min_max) &&
+    delta_z_squared < params.max_delta_z_squared) {
+    float weight = __expf(-dr2 * params.spatial_falloff -
+      delta_z_squared * params.range_falloff);
+    *sum += weight * z2;
+    *sum_weights += weight;
+  }
+}
+
+// Filters the (2 radius + 1) samples at center[-radius * stride] ...
+// center[radius * stride]. Returns 0 if the center is invalid.
+__inline__ __device__
+float Bilateral1D(const float* center, int stride,
+  const BilateralParams& params) {
+  float z = *center;
+  if (!IsValidDepth(z, params.depth_min_max)) {
+    return 0.0f;
+  }
+  float sum = 0.0f;
+  float sum_weights = 0.0f;
+  for (int d = -params.radius; d <= params.radius; ++d) {
+    AccumulateBilateral(z, center[d * stride], static_cast<float>(d * d),
+      params, &sum, &sum_weights);
+  }
+  return sum / sum_weights;
+}
+
+// Filters the (2 radius + 1)^2 window around center, in a tile with the given
+// row stride. Returns 0 if the center is invalid.
+__inline__ __device__
+float Bilateral2D(const float* center, int stride,
+  const BilateralParams& params) {
+  float z = *center;
+  if (!IsValidDepth(z, params.depth_min_max)) {
+    return 0.0f;
+  }
+  float sum = 0.0f;
+  float sum_weights = 0.0f;
+  for (int dy = -params.radius; dy <= params.radius; ++dy) {
+    for (int dx = -params.radius; dx <= params.radius; ++dx) {
+      AccumulateBilateral(z, center[dy * stride + dx],
+        static_cast<float>(dx * dx + dy * dy), params, &sum, &sum_weights);
+    }
+  }
+  return sum / sum_weights;
+}
+
+// The tiles of SmoothDepthTileKernel, in shared memory, for a block of
+// block_size threads:
+// - raw: the block's pixels, plus one extra row and column with kNormals,
+//   plus a radius apron. Pixels outside the image are 0 (and invalid).
+// - horizontal (kSeparable only): raw filtered along x, for every row of raw
+//   but only the columns of smoothed.
+// - smoothed: the block's pixels, plus one extra row and column with
+//   kNormals.
+struct SmoothTileLayout {
+  __host__ __device__
+  SmoothTileLayout(int2 block_size, int radius, bool separable, bool normals) {
+    int extra = normals ? 1 : 0;
+    smoothed_size = { block_size.x + extra, block_size.y + extra };
+    raw_size = { smoothed_size.x + 2 * radius, smoothed_size.y + 2 * radius };
+    horizontal_size = separable ?
+      int2{ smoothed_size.x, raw_size.y } : int2{ 0, 0 };
+  }
+
+  __host__ __device__
+  size_t NumFloats() const {
+    return raw_size.x * raw_size.y + horizontal_size.x * horizontal_size.y +
+      smoothed_size.x * smoothed_size.y;
+  }
+
+  int2 raw_size;
+  int2 horizontal_size;
+  int2 smoothed_size;
+};
+
+}  // namespace
+
+// Loads a tile of raw_depth (through undistort_map if kUndistort) into shared
+// memory and smooths it there. With kNormals, also estimates normals like
+// EstimateNormalsKernel, from the smoothed tile.
+//
+// Dynamic shared memory must hold SmoothTileLayout::NumFloats() floats.
+template <bool kUndistort, bool kSeparable, bool kNormals>
+__global__
+void SmoothDepthTileKernel(KernelArray2D<const float> raw_depth,
+  cudaTextureObject_t raw_depth_tex,
+  cudaTextureObject_t undistort_map,
+  BilateralParams params,
+  float4 flpp,
+  KernelArray2D<float> smoothed,
+  KernelArray2D<float4> normals) {
+  extern __shared__ float shared[];
+
+  const int2 size = smoothed.size();
+  const int2 block_origin{ static_cast<int>(blockIdx.x * blockDim.x),
+    static_cast<int>(blockIdx.y * blockDim.y) };
+  const int thread_index = threadIdx.y * blockDim.x + threadIdx.x;
+  const int num_threads = blockDim.x * blockDim.y;
+  const int radius = params.radius;
+
+  const SmoothTileLayout layout(
+    { static_cast<int>(blockDim.x), static_cast<int>(blockDim.y) },
+    radius, kSeparable, kNormals);
+  const int2 raw_size = layout.raw_size;
+  const int2 smoothed_size = layout.smoothed_size;
+  float* raw_tile = shared;
+  float* horizontal_tile = raw_tile + raw_size.x * raw_size.y;
+  float* smoothed_tile = horizontal_tile +
+    layout.horizontal_size.x * layout.horizontal_size.y;
+
+  const libcgt::cuda::Rect2i image_rect(size);
+  for (int i = thread_index; i < raw_size.x * raw_size.y; i += num_threads) {
+    int2 xy{ block_origin.x - radius + i % raw_size.x,
+      block_origin.y - radius + i / raw_size.x };
+    float z = 0.0f;
+    if (contains(image_rect, xy)) {
+      if (kUndistort) {
+        float2 xy2 = tex2D<float2>(undistort_map, xy.x + 0.5f, xy.y + 0.5f);
+        z = tex2D<float>(raw_depth_tex, xy2.x, xy2.y);
+      } else {
+        z = raw_depth[xy];
+      }
+    }
+    raw_tile[i] = z;
+  }
+  __syncthreads();
+
+  if (kSeparable) {
+    for (int i = thread_index; i < smoothed_size.x * raw_size.y;
+      i += num_threads) {
+      int hx = i % smoothed_size.x;
+      int hy = i / smoothed_size.x;
+      horizontal_tile[i] = Bilateral1D(
+        raw_tile + hy * raw_size.x + hx + radius, 1, params);
+    }
+    __syncthreads();
+  }
+
+  for (int i = thread_index; i < smoothed_size.x * smoothed_size.y;
+    i += num_threads) {
+    int sx = i % smoothed_size.x;
+    int sy = i / smoothed_size.x;
+    if (kSeparable) {
+      smoothed_tile[i] = Bilateral1D(
+        horizontal_tile + (sy + radius) * smoothed_size.x + sx,
+        smoothed_size.x, params);
+    } else {
+      smoothed_tile[i] = Bilateral2D(
+        raw_tile + (sy + radius) * raw_size.x + sx + radius,
+        raw_size.x, params);
+    }
+  }
+  __syncthreads();
+
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(image_rect, xy)) {
+    return;
+  }
+
+  const float* center = smoothed_tile +
+    threadIdx.y * smoothed_size.x + threadIdx.x;
+  float depth0 = center[0];
+  smoothed[xy] = depth0;
+
+  if (!kNormals) {
+    return;
+  }
+
+  float4 normal = {};
+  if (xy.x < size.x - 1 && xy.y < size.y - 1) {
+    int2 xy1{ xy.x + 1, xy.y };
+    int2 xy2{ xy.x, xy.y + 1 };
+    float depth1 = center[1];
+    float depth2 = center[smoothed_size.x];
+
+    if (IsValidDepth(depth0, params.depth_min_max) &&
+      IsValidDepth(depth1, params.depth_min_max) &&
+      IsValidDepth(depth2, params.depth_min_max)) {
+      float3 p0 = CameraFromPixel(xy, depth0, flpp);
+      float3 p1 = CameraFromPixel(xy1, depth1, flpp);
+      float3 p2 = CameraFromPixel(xy2, depth2, flpp);
+
+      float3 n = cross(p1 - p0, p2 - p0);
+      float lenSquared = lengthSquared(n);
+      if (lenSquared > 0.0f) {
+        normal = make_float4(n / sqrt(lenSquared), 1.0f);
+      }
+    }
+  }
+  normals[xy] = normal;
+}
+
+
+const char* kBilateralDepthSmoothing = "bilateral";
+const char* kSeparableBilateralDepthSmoothing = "separable_bilateral";
+
+bool ParseDepthSmoothingMethod(const std::string& name,
+  DepthSmoothingMethod* method) {
+  if (name == kBilateralDepthSmoothing) {
+    *method = DepthSmoothingMethod::BILATERAL;
+    return true;
+  } else if (name == kSeparableBilateralDepthSmoothing) {
+    *method = DepthSmoothingMethod::SEPARABLE_BILATERAL;
+    return true;
+  }
+  return false;
+}
+
+bool ParseDepthProcessorOptions(const std::string& smoothing_method,
+  double spatial_sigma, double range_sigma,
+  DepthProcessor::Options* options) {
+  DepthSmoothingMethod method;
+  // Written so that NaN sigmas are rejected too.
+  if (!ParseDepthSmoothingMethod(smoothing_method, &method) ||
+    !(spatial_sigma > 0) || !(range_sigma > 0)) {
+    return false;
+  }
+  options->smoothing_method = method;
+  options->spatial_sigma = static_cast<float>(spatial_sigma);
+  options->range_sigma = static_cast<float>(range_sigma);
+  return true;
+}
+
 DepthProcessor::DepthProcessor(const Intrinsics& depth_intrinsics,
   const Range1f& depth_range) :
+  DepthProcessor(depth_intrinsics, depth_range, Options()) {
+
+}
+
+DepthProcessor::DepthProcessor(const Intrinsics& depth_intrinsics,
+  const Range1f& depth_range, const Options& options) :
   depth_intrinsics_flpp_{ depth_intrinsics.focalLength,
     depth_intrinsics.principalPoint },
-  depth_range_(depth_range) {
+  depth_range_(depth_range),
+  options_(options),
+  kernel_radius_(std::max(1,
+    static_cast<int>(std::ceil(2.0f * options.spatial_sigma)))) {
 
 }
 
-void DepthProcessor::Undistort(DeviceArray2D<float>& raw_depth,
-  DeviceArray2D<float2>& undistort_map,
-  DeviceArray2D<float>& undistorted_depth) {
-  // Bind raw_depth and undistort_map to texture objects.
+DepthProcessor::~DepthProcessor() {
+  for (const auto& entry : textures_) {
+    cudaDestroyTextureObject(entry.second);
+  }
+}
 
-  cudaResourceDesc raw_depth_res_desc = raw_depth.resourceDesc();
-  cudaResourceDesc undistort_map_res_desc = undistort_map.resourceDesc();
+const DepthProcessor::Options& DepthProcessor::GetOptions() const {
+  return options_;
+}
 
-  cudaTextureDesc point_normalized_tex_desc = {};
-  point_normalized_tex_desc.addressMode[0] = cudaAddressModeClamp;
-  point_normalized_tex_desc.addressMode[1] = cudaAddressModeClamp;
-  point_normalized_tex_desc.filterMode = cudaFilterModePoint;
-  point_normalized_tex_desc.readMode = cudaReadModeElementType;
-  point_normalized_tex_desc.normalizedCoords = true;
+cudaTextureObject_t DepthProcessor::CachedTexture(
+  const cudaResourceDesc& res_desc, bool normalized_coords) {
+  const cudaChannelFormatDesc& format = res_desc.res.pitch2D.desc;
+  TextureKey key{ res_desc.res.pitch2D.devPtr, res_desc.res.pitch2D.width,
+    res_desc.res.pitch2D.height, res_desc.res.pitch2D.pitchInBytes,
+    format.x, format.y, format.z, format.w, static_cast<int>(format.f),
+    normalized_coords };
+  auto itr = textures_.find(key);
+  if (itr != textures_.end()) {
+    return itr->second;
+  }
 
-  cudaTextureDesc point_unnormalized_tex_desc = {};
-  point_unnormalized_tex_desc.addressMode[0] = cudaAddressModeClamp;
-  point_unnormalized_tex_desc.addressMode[1] = cudaAddressModeClamp;
-  point_unnormalized_tex_desc.filterMode = cudaFilterModePoint;
-  point_unnormalized_tex_desc.readMode = cudaReadModeElementType;
-  point_unnormalized_tex_desc.normalizedCoords = false;
+  cudaTextureDesc tex_desc = PointTextureDesc(normalized_coords);
+  cudaTextureObject_t tex_obj = 0;
+  cudaCreateTextureObject(&tex_obj, &res_desc, &tex_desc, nullptr);
+  textures_.emplace(key, tex_obj);
+  return tex_obj;
+}
 
-  cudaError err;
+void DepthProcessor::ConvertRawDepth(
+  DeviceArray2D<uint16_t>& raw_depth_mm_ydown,
+  DeviceArray2D<float>& depth_meters,
+  cudaStream_t stream) {
+  assert(raw_depth_mm_ydown.size() == depth_meters.size());
+  dim3 block(16, 16);
+  dim3 grid = numBins2D(make_int2(depth_meters.size()), block);
 
-  cudaTextureObject_t raw_depth_tex_obj;
-  err = cudaCreateTextureObject(&raw_depth_tex_obj, &raw_depth_res_desc,
-      &point_normalized_tex_desc, nullptr);
+  ScopedTraceRange trace("DepthProcessor::ConvertRawDepth",
+    TraceCategory::DEPTH_PROCESSING);
+  ScopedGPUTimer timer("DepthProcessor::ConvertRawDepth", stream);
+  ConvertRawDepthKernel<<<grid, block, 0, stream>>>(
+    raw_depth_mm_ydown.readView(), depth_meters.writeView());
+}
 
-  cudaTextureObject_t undistort_map_tex_obj;
-  err = cudaCreateTextureObject(&undistort_map_tex_obj, &undistort_map_res_desc,
-      &point_unnormalized_tex_desc, nullptr);
+void DepthProcessor::Undistort(DeviceArray2D<float>& raw_depth,
+  DeviceArray2D<float2>& undistort_map,
+  DeviceArray2D<float>& undistorted_depth,
+  cudaStream_t stream) {
+  UndistortBatch batch;
+  batch.jobs[0] = { CachedTexture(raw_depth.resourceDesc(), true),
+    CachedTexture(undistort_map.resourceDesc(), false),
+    undistorted_depth.writeView() };
 
   dim3 block(16, 16);
   dim3 grid = numBins2D(make_int2(raw_depth.size()), block);
 
-  Event e;
-  e.recordStart();
-  UndistortKernel<<<grid, block>>>(
-    raw_depth_tex_obj,
-    undistort_map_tex_obj,
-    undistorted_depth.writeView());
-  float dtMS = e.recordStopSyncAndGetMillisecondsElapsed();
-  printf("DepthProcessor::Undistort took %f ms\n", dtMS);
+  ScopedTraceRange trace("DepthProcessor::Undistort",
+    TraceCategory::DEPTH_PROCESSING);
+  ScopedGPUTimer timer("DepthProcessor::Undistort", stream);
+  UndistortBatchKernel<<<grid, block, 0, stream>>>(batch);
+}
+
+void DepthProcessor::UndistortMultiple(
+  std::vector<DeviceArray2D<float>>& raw_depths,
+  std::vector<DeviceArray2D<float2>>& undistort_maps,
+  std::vector<DeviceArray2D<float>>& undistorted_depths,
+  cudaStream_t stream) {
+  assert(raw_depths.size() == undistort_maps.size());
+  assert(raw_depths.size() == undistorted_depths.size());
+
+  ScopedTraceRange trace("DepthProcessor::UndistortMultiple",
+    TraceCategory::DEPTH_PROCESSING);
+  ScopedGPUTimer timer("DepthProcessor::UndistortMultiple", stream);
+  const int num_cameras = static_cast<int>(raw_depths.size());
+  for (int begin = 0; begin < num_cameras;
+    begin += kMaxUndistortBatchSize) {
+    int end = std::min(begin + kMaxUndistortBatchSize, num_cameras);
+    UndistortBatch batch;
+    int2 max_size{ 0, 0 };
+    for (int i = begin; i < end; ++i) {
+      batch.jobs[i - begin] = {
+        CachedTexture(raw_depths[i].resourceDesc(), true),
+        CachedTexture(undistort_maps[i].resourceDesc(), false),
+        undistorted_depths[i].writeView() };
+      max_size.x = std::max(max_size.x, undistorted_depths[i].width());
+      max_size.y = std::max(max_size.y, undistorted_depths[i].height());
+    }
 
-  // TODO: don't destroy the texture every time.
-  cudaDestroyTextureObject(undistort_map_tex_obj);
-  cudaDestroyTextureObject(raw_depth_tex_obj);
+    // Blocks past the edge of a smaller camera's image exit immediately.
+    dim3 block(16, 16);
+    dim3 grid = numBins2D(max_size, block);
+    grid.z = end - begin;
+    UndistortBatchKernel<<<grid, block, 0, stream>>>(batch);
+  }
 }
 
 void DepthProcessor::Smooth(DeviceArray2D<float>& raw_depth,
-  DeviceArray2D<float>& smoothed_depth) {
+  DeviceArray2D<float>& smoothed_depth,
+  cudaStream_t stream) {
+  SmoothImpl(raw_depth, nullptr, smoothed_depth, nullptr,
+    "DepthProcessor::Smooth", stream);
+}
 
-  dim3 block(16, 16);
-  dim3 grid = numBins2D(make_int2(raw_depth.size()), block);
+void DepthProcessor::EstimateNormals(DeviceArray2D<float>& smoothed_depth,
+  DeviceArray2D<float4>& normals,
+  cudaStream_t stream) {
+  auto launch = [&](const LaunchConfig& config) {
+    dim3 grid = numBins2D(make_int2(smoothed_depth.size()),
+      config.block_dim);
+    EstimateNormalsKernel<<<grid, config.block_dim, 0, stream>>>(
+      smoothed_depth.readView(),
+      make_float4(depth_intrinsics_flpp_),
+      make_float2(depth_range_.leftRight()),
+      normals.writeView());
+  };
+
+  ScopedTraceRange trace("DepthProcessor::EstimateNormals",
+    TraceCategory::DEPTH_PROCESSING);
+  ScopedGPUTimer timer("DepthProcessor::EstimateNormals", stream);
+  launch(LaunchTuner::Get().Lookup("DepthProcessor::EstimateNormals",
+    { smoothed_depth.width(), smoothed_depth.height(), 1 },
+    LaunchTuner::BlockShapeCandidates(), launch, stream));
+}
 
-  Event e;
-  e.recordStart();
-  SmoothDepthMapKernel<<<grid, block>>>(
-    raw_depth.readView(),
-    make_float2(depth_range_.leftRight()),
-    kernel_radius_,
-    delta_z_squared_threshold_,
-    smoothed_depth.writeView());
-  float dtMS = e.recordStopSyncAndGetMillisecondsElapsed();
-  printf("DepthProcessor::Smooth took %f ms\n", dtMS);
+void DepthProcessor::Preprocess(DeviceArray2D<float>& raw_depth,
+  DeviceArray2D<float>& smoothed_depth,
+  DeviceArray2D<float4>& normals,
+  cudaStream_t stream) {
+  SmoothImpl(raw_depth, nullptr, smoothed_depth, &normals,
+    "DepthProcessor::Preprocess", stream);
 }
 
-void DepthProcessor::EstimateNormals(DeviceArray2D<float>& smoothed_depth,
-  DeviceArray2D<float4>& normals) {
+void DepthProcessor::Preprocess(DeviceArray2D<float>& raw_depth,
+  DeviceArray2D<float2>& undistort_map,
+  DeviceArray2D<float>& smoothed_depth,
+  DeviceArray2D<float4>& normals,
+  cudaStream_t stream) {
+  SmoothImpl(raw_depth, &undistort_map, smoothed_depth, &normals,
+    "DepthProcessor::Preprocess", stream);
+}
+
+void DepthProcessor::SmoothImpl(DeviceArray2D<float>& raw_depth,
+  DeviceArray2D<float2>* undistort_map,
+  DeviceArray2D<float>& smoothed_depth,
+  DeviceArray2D<float4>* normals,
+  const char* stage,
+  cudaStream_t stream) {
+  using KernelFunction = void (*)(KernelArray2D<const float>,
+    cudaTextureObject_t, cudaTextureObject_t, BilateralParams, float4,
+    KernelArray2D<float>, KernelArray2D<float4>);
+  // Indexed by [undistort][separable][normals].
+  static const KernelFunction kKernels[2][2][2] = {
+    { { SmoothDepthTileKernel<false, false, false>,
+        SmoothDepthTileKernel<false, false, true> },
+      { SmoothDepthTileKernel<false, true, false>,
+        SmoothDepthTileKernel<false, true, true> } },
+    { { SmoothDepthTileKernel<true, false, false>,
+        SmoothDepthTileKernel<true, false, true> },
+      { SmoothDepthTileKernel<true, true, false>,
+        SmoothDepthTileKernel<true, true, true> } }
+  };
+
+  const bool undistort = undistort_map != nullptr;
+  const bool separable = options_.smoothing_method ==
+    DepthSmoothingMethod::SEPARABLE_BILATERAL;
+  const bool estimate_normals = normals != nullptr;
+
+  BilateralParams params;
+  params.radius = kernel_radius_;
+  params.spatial_falloff =
+    0.5f / (options_.spatial_sigma * options_.spatial_sigma);
+  params.range_falloff = 0.5f / (options_.range_sigma * options_.range_sigma);
+  params.max_delta_z_squared =
+    9.0f * options_.range_sigma * options_.range_sigma;
+  params.depth_min_max = make_float2(depth_range_.leftRight());
+
+  cudaTextureObject_t raw_depth_tex_obj = 0;
+  cudaTextureObject_t undistort_map_tex_obj = 0;
+  if (undistort) {
+    raw_depth_tex_obj = CachedTexture(raw_depth.resourceDesc(), true);
+    undistort_map_tex_obj = CachedTexture(undistort_map->resourceDesc(),
+      false);
+  }
+
+  // The tile in shared memory grows with the block.
+  auto launch = [&](const LaunchConfig& config) {
+    dim3 block = config.block_dim;
+    dim3 grid = numBins2D(make_int2(smoothed_depth.size()), block);
+    size_t shared_bytes = sizeof(float) * SmoothTileLayout(
+      { static_cast<int>(block.x), static_cast<int>(block.y) },
+      kernel_radius_, separable, estimate_normals).NumFloats();
+    kKernels[undistort][separable][estimate_normals]
+      <<<grid, block, shared_bytes, stream>>>(
+      raw_depth.readView(), raw_depth_tex_obj, undistort_map_tex_obj,
+      params,
+      make_float4(depth_intrinsics_flpp_),
+      smoothed_depth.writeView(),
+      estimate_normals ? normals->writeView() : KernelArray2D<float4>());
+  };
+
+  {
+    ScopedTraceRange trace(stage, TraceCategory::DEPTH_PROCESSING);
+    ScopedGPUTimer timer(stage, stream);
+    std::string kernel = stage;
+    if (undistort) {
+      kernel += "/undistort";
+    }
+    if (separable) {
+      kernel += "/separable";
+    }
+    launch(LaunchTuner::Get().Lookup(kernel,
+      { smoothed_depth.width(), smoothed_depth.height(), 1 },
+      LaunchTuner::BlockShapeCandidates(), launch, stream));
+  }
+}
+
+void DepthProcessor::BuildPyramid(DepthPyramid& pyramid,
+  cudaStream_t stream) {
+  ScopedTraceRange trace("DepthProcessor::BuildPyramid",
+    TraceCategory::DEPTH_PROCESSING);
+  ScopedGPUTimer timer("DepthProcessor::BuildPyramid", stream);
+
+  const float2 depth_min_max = make_float2(depth_range_.leftRight());
   dim3 block(16, 16);
-  dim3 grid = numBins2D(make_int2(smoothed_depth.size()), block);
-
-  Event e;
-  e.recordStart();
-  EstimateNormalsKernel<<<grid, block>>>(
-    smoothed_depth.readView(),
-    make_float4(depth_intrinsics_flpp_),
-    make_float2(depth_range_.leftRight()),
-    normals.writeView());
-  float dtMS = e.recordStopSyncAndGetMillisecondsElapsed();
-  printf("DepthProcessor::EstimateNormals took %f ms\n", dtMS);
+  for (int level = 0; level < pyramid.NumLevels(); ++level) {
+    DepthPyramid::Level& dst = pyramid.levels[level];
+    dim3 grid = numBins2D(make_int2(dst.depth.size()), block);
+    if (level == 0) {
+      // Depth and normals are already there.
+      VerticesAndNormalsKernel<false><<<grid, block, 0, stream>>>(
+        dst.depth.readView(), make_float4(dst.flpp), depth_min_max,
+        dst.vertices.writeView(), dst.normals.writeView());
+      continue;
+    }
+
+    DownsampleDepthKernel<<<grid, block, 0, stream>>>(
+      pyramid.levels[level - 1].depth.readView(), depth_min_max,
+      options_.max_pyramid_depth_difference, dst.depth.writeView());
+    VerticesAndNormalsKernel<true><<<grid, block, 0, stream>>>(
+      dst.depth.readView(), make_float4(dst.flpp), depth_min_max,
+      dst.vertices.writeView(), dst.normals.writeView());
+  }
 }
@@ -14,41 +14,178 @@
 #ifndef DEPTH_PROCESSOR_H
 #define DEPTH_PROCESSOR_H
 
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <cuda_runtime.h>
+
 #include "libcgt/core/cameras/Camera.h"
 #include "libcgt/core/cameras/Intrinsics.h"
 #include "libcgt/core/vecmath/Range1f.h"
 #include "libcgt/core/vecmath/Vector4f.h"
 #include "libcgt/cuda/DeviceArray2D.h"
 
+#include "depth_pyramid.h"
+
+// How DepthProcessor::Smooth() evaluates its bilateral filter.
+enum class DepthSmoothingMethod {
+  // The full (2r + 1)^2 window around each pixel.
+  BILATERAL,
+  // A horizontal then a vertical (2r + 1) tap pass. An approximation: the
+  // second pass weighs samples by their difference to the horizontally
+  // filtered center. Cost grows linearly with the radius instead of
+  // quadratically.
+  SEPARABLE_BILATERAL
+};
+
+// Names accepted by ParseDepthSmoothingMethod().
+extern const char* kBilateralDepthSmoothing;
+extern const char* kSeparableBilateralDepthSmoothing;
+
+// Returns false, leaving method untouched, if name is not recognized.
+bool ParseDepthSmoothingMethod(const std::string& name,
+  DepthSmoothingMethod* method);
+
 class DepthProcessor {
  public:
 
   using Intrinsics = libcgt::core::cameras::Intrinsics;
 
+  struct Options {
+    DepthSmoothingMethod smoothing_method = DepthSmoothingMethod::BILATERAL;
+
+    // Standard deviation of the spatial Gaussian, in pixels. The filter
+    // window has radius ceil(2 * spatial_sigma).
+    float spatial_sigma = 1.0f;
+
+    // Standard deviation of the range Gaussian, in meters. Neighbors further
+    // than 3 * range_sigma in depth from the center are ignored, so that
+    // depth discontinuities stay sharp.
+    float range_sigma = 0.03f;
+
+    // BuildPyramid() does not average depths that differ from the top left
+    // of their 2x2 block by more than this, in meters.
+    float max_pyramid_depth_difference = 0.04f;
+  };
+
+  // Uses the default Options.
   DepthProcessor(const Intrinsics& depth_intrinsics,
     const Range1f& depth_range);
 
+  DepthProcessor(const Intrinsics& depth_intrinsics,
+    const Range1f& depth_range, const Options& options);
+
+  ~DepthProcessor();
+
+  DepthProcessor(const DepthProcessor& copy) = delete;
+  DepthProcessor& operator = (const DepthProcessor& copy) = delete;
+
+  // All methods enqueue their work on stream and do not synchronize. With
+  // --collect_perf, they report to PerfCollector.
+
+  // Converts raw sensor depth in millimeters, y-down (see
+  // InputBuffer::depth_millimeters_ydown), to y-up depth in meters, the
+  // layout every other method expects. Pixels without a measurement (0) map
+  // to 0, which is outside the depth range and therefore invalid.
+  void ConvertRawDepth(DeviceArray2D<uint16_t>& raw_depth_mm_ydown,
+    DeviceArray2D<float>& depth_meters,
+    cudaStream_t stream = 0);
+
   // TODO: document which direction is up.
   // Correct lens distortion in raw_depth using undistort_map.
-  // TODO: switch interface to use textures as inputs.
   // TODO: switch interface to use surfaces as outputs.
+  //
+  // Texture objects bound to raw_depth and undistort_map are created on first
+  // use and cached until this DepthProcessor is destroyed. They are keyed by
+  // each buffer's address, size, pitch and format, so a reallocated buffer
+  // gets a new texture (and the old entry stays until destruction).
   void Undistort(DeviceArray2D<float>& raw_depth,
     DeviceArray2D<float2>& undistort_map,
-    DeviceArray2D<float>& undistorted_depth);
+    DeviceArray2D<float>& undistorted_depth,
+    cudaStream_t stream = 0);
 
-  // Smooth raw_depth with a bilateral filter.
-  // TODO: replace hack with an actual bilateral filter.
+  // Undistorts raw_depths[i] with undistort_maps[i] into
+  // undistorted_depths[i] for all i, in one launch per 8 cameras.
+  void UndistortMultiple(std::vector<DeviceArray2D<float>>& raw_depths,
+    std::vector<DeviceArray2D<float2>>& undistort_maps,
+    std::vector<DeviceArray2D<float>>& undistorted_depths,
+    cudaStream_t stream = 0);
+
+  // Smooth raw_depth with a bilateral filter, configured by Options. Pixels
+  // outside the depth range are invalid: they are neither smoothed (their
+  // output is 0) nor used as neighbors.
   void Smooth(DeviceArray2D<float>& raw_depth,
-    DeviceArray2D<float>& smoothed_depth);
+    DeviceArray2D<float>& smoothed_depth,
+    cudaStream_t stream = 0);
 
   void EstimateNormals(DeviceArray2D<float>& smoothed_depth,
-    DeviceArray2D<float4>& normals);
+    DeviceArray2D<float4>& normals,
+    cudaStream_t stream = 0);
+
+  // Same results as Smooth() followed by EstimateNormals(), in one launch.
+  // Each thread block loads a tile of raw_depth and its apron into shared
+  // memory once, instead of every pixel re-reading its neighborhood from
+  // global memory in both kernels.
+  void Preprocess(DeviceArray2D<float>& raw_depth,
+    DeviceArray2D<float>& smoothed_depth,
+    DeviceArray2D<float4>& normals,
+    cudaStream_t stream = 0);
+
+  // Same as above, but also undistorts raw_depth as it loads the tile, like
+  // Undistort(). Uses the same texture cache.
+  void Preprocess(DeviceArray2D<float>& raw_depth,
+    DeviceArray2D<float2>& undistort_map,
+    DeviceArray2D<float>& smoothed_depth,
+    DeviceArray2D<float4>& normals,
+    cudaStream_t stream = 0);
+
+  // Fills in pyramid from its level 0 depth and normals: the vertices of
+  // level 0, then, for each coarser level, depth downsampled from the level
+  // below (edge-aware) and the vertices and normals of that depth. pyramid
+  // must have been constructed with this processor's depth intrinsics.
+  void BuildPyramid(DepthPyramid& pyramid,
+    cudaStream_t stream = 0);
+
+  const Options& GetOptions() const;
 
   const Vector4f depth_intrinsics_flpp_;
   const Range1f depth_range_;
-  const int kernel_radius_ = 2;
-  const float delta_z_squared_threshold_ = 0.04f;  // 40 mm for Kinect.
 
+ private:
+
+  // Launches the tiled smoothing kernel. undistort_map and normals may be
+  // null.
+  void SmoothImpl(DeviceArray2D<float>& raw_depth,
+    DeviceArray2D<float2>* undistort_map,
+    DeviceArray2D<float>& smoothed_depth,
+    DeviceArray2D<float4>* normals,
+    const char* stage,
+    cudaStream_t stream);
+
+  // Returns the texture object for res_desc, creating it on first use.
+  cudaTextureObject_t CachedTexture(const cudaResourceDesc& res_desc,
+    bool normalized_coords);
+
+  // Device pointer, width, height, pitch in bytes, channel format (x, y, z,
+  // w, kind) and whether coordinates are normalized.
+  using TextureKey = std::tuple<void*, size_t, size_t, size_t,
+    int, int, int, int, int, bool>;
+
+  const Options options_;
+  const int kernel_radius_;
+
+  std::map<TextureKey, cudaTextureObject_t> textures_;
 };
 
+// Sets options' smoothing method (by name, see ParseDepthSmoothingMethod())
+// and sigmas, as given by --depth_smoothing, --depth_smoothing_spatial_sigma
+// and --depth_smoothing_range_sigma. Returns false, leaving options
+// untouched, if the method is not recognized or a sigma is not positive (a
+// zero sigma makes the filter weights NaN).
+bool ParseDepthProcessorOptions(const std::string& smoothing_method,
+  double spatial_sigma, double range_sigma,
+  DepthProcessor::Options* options);
+
 #endif  // DEPTH_PROCESSOR_H
@@ -0,0 +1,36 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "depth_pyramid.h"
+
+DepthPyramid::DepthPyramid(const Vector2i& resolution, const Vector4f& flpp,
+  int num_levels) {
+  Resize(resolution, flpp, num_levels);
+}
+
+void DepthPyramid::Resize(const Vector2i& resolution, const Vector4f& flpp,
+  int num_levels) {
+  levels.resize(num_levels);
+  for (int level = 0; level < num_levels; ++level) {
+    Vector2i size{ resolution.x >> level, resolution.y >> level };
+    Level& l = levels[level];
+    l.flpp = flpp / static_cast<float>(1 << level);
+    l.depth.resize(size);
+    l.vertices.resize(size);
+    l.normals.resize(size);
+  }
+}
+
+int DepthPyramid::NumLevels() const {
+  return static_cast<int>(levels.size());
+}
@@ -0,0 +1,67 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef DEPTH_PYRAMID_H
+#define DEPTH_PYRAMID_H
+
+#include <vector>
+
+#include <cuda_runtime.h>
+
+#include "libcgt/core/vecmath/Vector2i.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+
+#include "device_array_pool.h"
+
+// Coarse-to-fine copies of one preprocessed depth frame, shared by everything
+// that works at reduced resolution (pyramid ICP, LOD fusion, reduced
+// resolution raycasts) so that it is only built once per frame.
+//
+// levels[0] is full resolution and each level halves the resolution of the
+// one before it (rounding down). All buffers are allocated up front.
+//
+// Level 0 depth and normals are the outputs of DepthProcessor::Smooth() and
+// EstimateNormals() (or Preprocess()): write them there directly, then call
+// DepthProcessor::BuildPyramid() to fill in everything else.
+struct DepthPyramid {
+
+  struct Level {
+    // Intrinsics of this level: the full resolution ones scaled by
+    // 2^-level.
+    Vector4f flpp;
+
+    // Depth in meters. 0 where invalid.
+    PooledDeviceArray2D<float> depth;
+    // Camera-space positions of depth. w = 1 where valid and 0 elsewhere.
+    PooledDeviceArray2D<float4> vertices;
+    // Camera-space normals. w = 1 where valid and 0 elsewhere.
+    PooledDeviceArray2D<float4> normals;
+  };
+
+  DepthPyramid() = default;
+
+  // flpp: the full resolution intrinsics.
+  DepthPyramid(const Vector2i& resolution, const Vector4f& flpp,
+    int num_levels);
+
+  // Reallocates all levels, as if constructed with these arguments.
+  void Resize(const Vector2i& resolution, const Vector4f& flpp,
+    int num_levels);
+
+  int NumLevels() const;
+
+  std::vector<Level> levels;
+};
+
+#endif  // DEPTH_PYRAMID_H
@@ -0,0 +1,153 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "device_array_pool.h"
+
+#include <algorithm>
+
+#include <cuda_runtime.h>
+
+#include "perf_collector.h"
+
+DeviceArrayPool& DeviceArrayPool::Get() {
+  static DeviceArrayPool pool;
+  return pool;
+}
+
+bool DeviceArrayPool::Key::operator < (const Key& other) const {
+  if (device != other.device) {
+    return device < other.device;
+  }
+  if (type != other.type) {
+    return type < other.type;
+  }
+  if (size.x != other.size.x) {
+    return size.x < other.size.x;
+  }
+  if (size.y != other.size.y) {
+    return size.y < other.size.y;
+  }
+  return size.z < other.size.z;
+}
+
+DeviceArrayPool::Key DeviceArrayPool::MakeKey(std::type_index type,
+  const Vector3i& size) {
+  int device = 0;
+  cudaGetDevice(&device);
+  return{ device, type, size };
+}
+
+DeviceArrayPool::Entry::~Entry() {
+  if (released != nullptr) {
+    cudaEventDestroy(released);
+  }
+}
+
+std::unique_ptr<DeviceArrayPool::Entry> DeviceArrayPool::TakeIdle(
+  const Key& key) {
+  std::unique_ptr<Entry> entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto itr = idle_.find(key);
+    if (itr != idle_.end()) {
+      entry = std::move(itr->second.second);
+      idle_bytes_ -= itr->second.first;
+      idle_.erase(itr);
+    }
+  }
+  // Outside the lock: only this caller waits for the previous owner.
+  if (entry != nullptr && entry->released != nullptr) {
+    cudaEventSynchronize(entry->released);
+  }
+  return entry;
+}
+
+void DeviceArrayPool::CountInUse(size_t bytes, bool hit) {
+  size_t peak;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bytes_in_use_ += bytes;
+    peak_bytes_in_use_ = std::max(peak_bytes_in_use_, bytes_in_use_);
+    peak = peak_bytes_in_use_;
+  }
+  PerfCollector::Get().IncrementCounter(hit ?
+    "device_pool.hits" : "device_pool.misses");
+  PerfCollector::Get().UpdateCounterMax("device_pool.peak_bytes_in_use",
+    static_cast<int64_t>(peak));
+}
+
+std::unique_ptr<DeviceArrayPool::Entry> DeviceArrayPool::PutIdle(
+  const Key& key, size_t bytes, std::unique_ptr<Entry> entry,
+  cudaStream_t stream) {
+  if (cudaEventCreateWithFlags(&entry->released,
+    cudaEventDisableTiming) == cudaSuccess) {
+    cudaEventRecord(entry->released, stream);
+  } else {
+    // Without an event, wait here instead of in the next Acquire*().
+    entry->released = nullptr;
+    cudaGetLastError();
+    cudaStreamSynchronize(stream);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  bytes_in_use_ -= std::min(bytes, bytes_in_use_);
+  if (idle_bytes_ + bytes > capacity_) {
+    return entry;
+  }
+  idle_bytes_ += bytes;
+  idle_.emplace(key, std::make_pair(bytes, std::move(entry)));
+  return nullptr;
+}
+
+void DeviceArrayPool::EvictIdle(size_t bytes,
+  std::vector<std::unique_ptr<Entry>>* freed) {
+  while (idle_bytes_ > bytes && !idle_.empty()) {
+    auto itr = idle_.begin();
+    idle_bytes_ -= itr->second.first;
+    freed->push_back(std::move(itr->second.second));
+    idle_.erase(itr);
+  }
+}
+
+void DeviceArrayPool::SetCapacity(size_t bytes) {
+  std::vector<std::unique_ptr<Entry>> freed;
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = bytes;
+  EvictIdle(bytes, &freed);
+}
+
+size_t DeviceArrayPool::Capacity() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return capacity_;
+}
+
+void DeviceArrayPool::Trim() {
+  std::vector<std::unique_ptr<Entry>> freed;
+  std::lock_guard<std::mutex> lock(mutex_);
+  EvictIdle(0, &freed);
+}
+
+size_t DeviceArrayPool::BytesInUse() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_in_use_;
+}
+
+size_t DeviceArrayPool::PeakBytesInUse() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return peak_bytes_in_use_;
+}
+
+size_t DeviceArrayPool::IdleBytes() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return idle_bytes_;
+}
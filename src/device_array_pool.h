@@ -0,0 +1,303 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef DEVICE_ARRAY_POOL_H
+#define DEVICE_ARRAY_POOL_H
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <typeindex>
+#include <utility>
+#include <vector>
+
+#include <cuda_runtime.h>
+
+#include "libcgt/core/vecmath/Vector2i.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+#include "libcgt/cuda/DeviceArray3D.h"
+
+// Keeps device arrays that are no longer needed and hands them back to the
+// next request for the same element type, size and device, instead of
+// freeing and reallocating them. Rebuilding a pipeline at the same
+// resolution, e.g. for the next job or after a reset, then allocates
+// nothing.
+//
+// Idle arrays are kept up to Capacity() bytes; past that, released arrays are
+// freed. The default capacity is 0: every array is freed on release.
+//
+// Work queued on an array before it is released may still be running. An
+// event is recorded on the releasing stream, and the next Acquire*() that
+// hands the array out waits for it, so the new owner never sees the previous
+// owner's kernels and copies.
+//
+// All methods are thread safe.
+class DeviceArrayPool {
+ public:
+
+  // The pool the Pooled* arrays draw from.
+  static DeviceArrayPool& Get();
+
+  DeviceArrayPool(const DeviceArrayPool& copy) = delete;
+  DeviceArrayPool& operator = (const DeviceArrayPool& copy) = delete;
+
+  // An idle array of size on the current device, once the work queued on it
+  // before its release is done, or a new one. Its contents are undefined.
+  template <typename T>
+  DeviceArray2D<T> Acquire2D(const Vector2i& size);
+  template <typename T>
+  DeviceArray3D<T> Acquire3D(const Vector3i& size);
+
+  // Hands back an array from Acquire2D() or Acquire3D(), which work queued on
+  // stream may still use. The legacy default stream (0), which waits for
+  // every blocking stream, covers the work of all of them, as cudaFree()
+  // would. Empty arrays are ignored. Non-empty arrays must not be released
+  // while stream is being captured into a CUDA graph.
+  template <typename T>
+  void Release(DeviceArray2D<T>&& array, cudaStream_t stream = 0);
+  template <typename T>
+  void Release(DeviceArray3D<T>&& array, cudaStream_t stream = 0);
+
+  // Frees idle arrays until at most bytes remain idle.
+  void SetCapacity(size_t bytes);
+  size_t Capacity();
+
+  // Frees every idle array.
+  void Trim();
+
+  // Bytes of the arrays acquired and not yet released, the largest that has
+  // been, and the bytes held idle. Pitch padding is not counted.
+  size_t BytesInUse();
+  size_t PeakBytesInUse();
+  size_t IdleBytes();
+
+ private:
+
+  struct Key {
+    int device;
+    std::type_index type;
+    Vector3i size;
+
+    bool operator < (const Key& other) const;
+  };
+
+  struct Entry {
+    virtual ~Entry();
+
+    // Recorded on the releasing stream.
+    cudaEvent_t released = nullptr;
+  };
+
+  template <typename Array>
+  struct ArrayEntry : public Entry {
+    explicit ArrayEntry(Array&& a) : array(std::move(a)) {}
+    Array array;
+  };
+
+  DeviceArrayPool() = default;
+
+  static Key MakeKey(std::type_index type, const Vector3i& size);
+
+  // Removes and returns an idle entry for key, once the work queued on it
+  // before its release is done, or nullptr.
+  std::unique_ptr<Entry> TakeIdle(const Key& key);
+
+  // Counts bytes as in use, for an array that was taken from the idle list if
+  // hit, or else newly allocated.
+  void CountInUse(size_t bytes, bool hit);
+
+  // Records entry's release on stream, counts bytes as no longer in use, and
+  // keeps entry idle if it fits in the capacity. Otherwise returns it, for
+  // the caller to free outside the lock.
+  std::unique_ptr<Entry> PutIdle(const Key& key, size_t bytes,
+    std::unique_ptr<Entry> entry, cudaStream_t stream);
+
+  // Requires mutex_ to be held. Moves idle entries into freed until at most
+  // bytes remain idle.
+  void EvictIdle(size_t bytes, std::vector<std::unique_ptr<Entry>>* freed);
+
+  std::mutex mutex_;
+  std::multimap<Key, std::pair<size_t, std::unique_ptr<Entry>>> idle_;
+  size_t capacity_ = 0;
+  size_t idle_bytes_ = 0;
+  size_t bytes_in_use_ = 0;
+  size_t peak_bytes_in_use_ = 0;
+};
+
+// A DeviceArray2D that comes from, and goes back to, DeviceArrayPool::Get().
+// It is a DeviceArray2D, so it can be passed to anything that takes one.
+template <typename T>
+class PooledDeviceArray2D : public DeviceArray2D<T> {
+ public:
+
+  PooledDeviceArray2D() = default;
+  explicit PooledDeviceArray2D(const Vector2i& size);
+  PooledDeviceArray2D(PooledDeviceArray2D<T>&& move) = default;
+  PooledDeviceArray2D<T>& operator = (PooledDeviceArray2D<T>&& move);
+  ~PooledDeviceArray2D();
+
+  // Same as DeviceArray2D::resize(), through the pool. Does nothing if the
+  // size does not change.
+  void resize(const Vector2i& size);
+};
+
+// A DeviceArray3D that comes from, and goes back to, DeviceArrayPool::Get().
+template <typename T>
+class PooledDeviceArray3D : public DeviceArray3D<T> {
+ public:
+
+  PooledDeviceArray3D() = default;
+  explicit PooledDeviceArray3D(const Vector3i& size);
+  PooledDeviceArray3D(PooledDeviceArray3D<T>&& move) = default;
+  PooledDeviceArray3D<T>& operator = (PooledDeviceArray3D<T>&& move);
+  ~PooledDeviceArray3D();
+
+  void resize(const Vector3i& size);
+};
+
+template <typename T>
+DeviceArray2D<T> DeviceArrayPool::Acquire2D(const Vector2i& size) {
+  const size_t bytes = sizeof(T) * size.x * size.y;
+  std::unique_ptr<Entry> entry = TakeIdle(
+    MakeKey(typeid(DeviceArray2D<T>), { size.x, size.y, 1 }));
+  DeviceArray2D<T> array;
+  if (entry != nullptr) {
+    array = std::move(
+      static_cast<ArrayEntry<DeviceArray2D<T>>*>(entry.get())->array);
+  } else {
+    array = DeviceArray2D<T>(size);
+  }
+  // A failed allocation is not in use.
+  if (array.notNull()) {
+    CountInUse(bytes, entry != nullptr);
+  }
+  return array;
+}
+
+template <typename T>
+DeviceArray3D<T> DeviceArrayPool::Acquire3D(const Vector3i& size) {
+  const size_t bytes = sizeof(T) * size.x * size.y * size.z;
+  std::unique_ptr<Entry> entry = TakeIdle(
+    MakeKey(typeid(DeviceArray3D<T>), size));
+  DeviceArray3D<T> array;
+  if (entry != nullptr) {
+    array = std::move(
+      static_cast<ArrayEntry<DeviceArray3D<T>>*>(entry.get())->array);
+  } else {
+    array = DeviceArray3D<T>(size);
+  }
+  if (array.notNull()) {
+    CountInUse(bytes, entry != nullptr);
+  }
+  return array;
+}
+
+template <typename T>
+void DeviceArrayPool::Release(DeviceArray2D<T>&& array,
+  cudaStream_t stream) {
+  if (array.width() == 0 || array.height() == 0) {
+    return;
+  }
+  const Vector3i size{ array.width(), array.height(), 1 };
+  const size_t bytes = sizeof(T) * size.x * size.y;
+  // Freed, if it does not fit, once out of the lock.
+  std::unique_ptr<Entry> rejected = PutIdle(
+    MakeKey(typeid(DeviceArray2D<T>), size), bytes,
+    std::unique_ptr<Entry>(
+      new ArrayEntry<DeviceArray2D<T>>(std::move(array))), stream);
+}
+
+template <typename T>
+void DeviceArrayPool::Release(DeviceArray3D<T>&& array,
+  cudaStream_t stream) {
+  if (array.width() == 0 || array.height() == 0 || array.depth() == 0) {
+    return;
+  }
+  const Vector3i size{ array.width(), array.height(), array.depth() };
+  const size_t bytes = sizeof(T) * size.x * size.y * size.z;
+  std::unique_ptr<Entry> rejected = PutIdle(
+    MakeKey(typeid(DeviceArray3D<T>), size), bytes,
+    std::unique_ptr<Entry>(
+      new ArrayEntry<DeviceArray3D<T>>(std::move(array))), stream);
+}
+
+template <typename T>
+PooledDeviceArray2D<T>::PooledDeviceArray2D(const Vector2i& size) :
+  DeviceArray2D<T>(DeviceArrayPool::Get().Acquire2D<T>(size)) {
+}
+
+template <typename T>
+PooledDeviceArray2D<T>& PooledDeviceArray2D<T>::operator = (
+  PooledDeviceArray2D<T>&& move) {
+  if (this != &move) {
+    DeviceArrayPool::Get().Release(
+      std::move(static_cast<DeviceArray2D<T>&>(*this)));
+    DeviceArray2D<T>::operator = (
+      std::move(static_cast<DeviceArray2D<T>&>(move)));
+  }
+  return *this;
+}
+
+template <typename T>
+PooledDeviceArray2D<T>::~PooledDeviceArray2D() {
+  DeviceArrayPool::Get().Release(
+    std::move(static_cast<DeviceArray2D<T>&>(*this)));
+}
+
+template <typename T>
+void PooledDeviceArray2D<T>::resize(const Vector2i& size) {
+  if (size.x == this->width() && size.y == this->height()) {
+    return;
+  }
+  DeviceArrayPool::Get().Release(
+    std::move(static_cast<DeviceArray2D<T>&>(*this)));
+  DeviceArray2D<T>::operator = (DeviceArrayPool::Get().Acquire2D<T>(size));
+}
+
+template <typename T>
+PooledDeviceArray3D<T>::PooledDeviceArray3D(const Vector3i& size) :
+  DeviceArray3D<T>(DeviceArrayPool::Get().Acquire3D<T>(size)) {
+}
+
+template <typename T>
+PooledDeviceArray3D<T>& PooledDeviceArray3D<T>::operator = (
+  PooledDeviceArray3D<T>&& move) {
+  if (this != &move) {
+    DeviceArrayPool::Get().Release(
+      std::move(static_cast<DeviceArray3D<T>&>(*this)));
+    DeviceArray3D<T>::operator = (
+      std::move(static_cast<DeviceArray3D<T>&>(move)));
+  }
+  return *this;
+}
+
+template <typename T>
+PooledDeviceArray3D<T>::~PooledDeviceArray3D() {
+  DeviceArrayPool::Get().Release(
+    std::move(static_cast<DeviceArray3D<T>&>(*this)));
+}
+
+template <typename T>
+void PooledDeviceArray3D<T>::resize(const Vector3i& size) {
+  if (size.x == this->width() && size.y == this->height() &&
+    size.z == this->depth()) {
+    return;
+  }
+  DeviceArrayPool::Get().Release(
+    std::move(static_cast<DeviceArray3D<T>&>(*this)));
+  DeviceArray3D<T>::operator = (DeviceArrayPool::Get().Acquire3D<T>(size));
+}
+
+#endif  // DEVICE_ARRAY_POOL_H
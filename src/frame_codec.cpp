@@ -0,0 +1,296 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "frame_codec.h"
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "libcgt/core/common/BasicTypes.h"
+#include "libcgt/camera_wrappers/PixelFormat.h"
+#include "libcgt/opencv_interop/ArrayUtils.h"
+
+using libcgt::camera_wrappers::PixelFormat;
+using libcgt::camera_wrappers::StreamMetadata;
+using libcgt::opencv_interop::array2DViewAsCvMat;
+
+namespace {
+
+// RVL packs variable length integers as nibbles: 3 bits of payload, low
+// bits first, and a continuation bit. Eight nibbles make a 32-bit word,
+// first nibble in the high bits. Words are little endian.
+class NibbleWriter {
+ public:
+
+  explicit NibbleWriter(std::vector<uint8_t>* out) :
+    out_(out) {
+  }
+
+  void WriteVLE(uint32_t value) {
+    do {
+      uint32_t nibble = value & 0x7;
+      value >>= 3;
+      if (value != 0) {
+        nibble |= 0x8;
+      }
+      word_ = (word_ << 4) | nibble;
+      if (++num_nibbles_ == 8) {
+        AppendWord();
+      }
+    } while (value != 0);
+  }
+
+  // Pads and appends the last, partial word.
+  void Finish() {
+    if (num_nibbles_ > 0) {
+      word_ <<= 4 * (8 - num_nibbles_);
+      AppendWord();
+    }
+  }
+
+ private:
+
+  void AppendWord() {
+    for (int i = 0; i < 4; ++i) {
+      out_->push_back(static_cast<uint8_t>(word_ >> (8 * i)));
+    }
+    word_ = 0;
+    num_nibbles_ = 0;
+  }
+
+  std::vector<uint8_t>* out_;
+  uint32_t word_ = 0;
+  int num_nibbles_ = 0;
+};
+
+class NibbleReader {
+ public:
+
+  NibbleReader(const uint8_t* begin, const uint8_t* end) :
+    next_(begin),
+    end_(end) {
+  }
+
+  // Returns false past the end of the input.
+  bool ReadVLE(uint32_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 32; shift += 3) {
+      if (num_nibbles_ == 0) {
+        if (end_ - next_ < 4) {
+          return false;
+        }
+        word_ = next_[0] | (next_[1] << 8) | (next_[2] << 16) |
+          (static_cast<uint32_t>(next_[3]) << 24);
+        next_ += 4;
+        num_nibbles_ = 8;
+      }
+      uint32_t nibble = word_ >> 28;
+      word_ <<= 4;
+      --num_nibbles_;
+      *value |= (nibble & 0x7) << shift;
+      if ((nibble & 0x8) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+
+  const uint8_t* next_;
+  const uint8_t* end_;
+  uint32_t word_ = 0;
+  int num_nibbles_ = 0;
+};
+
+// The header of an RVL frame: its width and height, as uint32.
+const int kRVLHeaderBytes = 8;
+
+void AppendUInt32(uint32_t value, std::vector<uint8_t>* out) {
+  for (int i = 0; i < 4; ++i) {
+    out->push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+}
+
+uint32_t ReadUInt32(const uint8_t* src) {
+  return src[0] | (src[1] << 8) | (src[2] << 16) |
+    (static_cast<uint32_t>(src[3]) << 24);
+}
+
+}  // namespace
+
+FrameCodec DefaultFrameCodec(const StreamMetadata& metadata,
+  bool allow_lossy) {
+  if (metadata.format == PixelFormat::DEPTH_MM_U16) {
+    return FrameCodec::RVL;
+  }
+  if (allow_lossy && metadata.format == PixelFormat::RGB_U888) {
+    return FrameCodec::JPEG;
+  }
+  return FrameCodec::RAW;
+}
+
+int RawFrameBytes(const StreamMetadata& metadata) {
+  int num_pixels = metadata.size.x * metadata.size.y;
+  switch (metadata.format) {
+  case PixelFormat::RGB_U888:
+    return 3 * num_pixels;
+  case PixelFormat::DEPTH_MM_U16:
+    return 2 * num_pixels;
+  case PixelFormat::DEPTH_M_F32:
+    return 4 * num_pixels;
+  default:
+    return 0;
+  }
+}
+
+void CompressRVL(Array2DReadView<uint16_t> depth,
+  std::vector<uint8_t>* out) {
+  AppendUInt32(depth.width(), out);
+  AppendUInt32(depth.height(), out);
+
+  // Alternating runs of zeros (holes) and of valid pixels, in scanline
+  // order. Each valid pixel stores the zigzag coded difference from the
+  // previous valid pixel.
+  NibbleWriter writer(out);
+  const int num_pixels = depth.width() * depth.height();
+  int i = 0;
+  int previous = 0;
+  while (i < num_pixels) {
+    int zeros_begin = i;
+    while (i < num_pixels && depth[{ i % depth.width(), i / depth.width() }]
+      == 0) {
+      ++i;
+    }
+    int nonzeros_begin = i;
+    while (i < num_pixels && depth[{ i % depth.width(), i / depth.width() }]
+      != 0) {
+      ++i;
+    }
+    writer.WriteVLE(nonzeros_begin - zeros_begin);
+    writer.WriteVLE(i - nonzeros_begin);
+    for (int j = nonzeros_begin; j < i; ++j) {
+      int value = depth[{ j % depth.width(), j / depth.width() }];
+      int delta = value - previous;
+      writer.WriteVLE(static_cast<uint32_t>((delta << 1) ^ (delta >> 31)));
+      previous = value;
+    }
+  }
+  writer.Finish();
+}
+
+bool DecompressRVL(Array1DReadView<uint8_t> src,
+  Array2DWriteView<uint16_t> depth) {
+  if (src.size() < kRVLHeaderBytes ||
+    ReadUInt32(src.pointer()) != static_cast<uint32_t>(depth.width()) ||
+    ReadUInt32(src.pointer() + 4) != static_cast<uint32_t>(depth.height())) {
+    return false;
+  }
+
+  NibbleReader reader(src.pointer() + kRVLHeaderBytes,
+    src.pointer() + src.size());
+  const int num_pixels = depth.width() * depth.height();
+  int i = 0;
+  int previous = 0;
+  while (i < num_pixels) {
+    uint32_t num_zeros;
+    uint32_t num_nonzeros;
+    if (!reader.ReadVLE(&num_zeros) || !reader.ReadVLE(&num_nonzeros)) {
+      return false;
+    }
+    // Compared separately: a corrupt run can make the sum wrap.
+    const uint32_t remaining = static_cast<uint32_t>(num_pixels - i);
+    if (num_zeros > remaining || num_nonzeros > remaining - num_zeros) {
+      return false;
+    }
+    for (uint32_t j = 0; j < num_zeros; ++j, ++i) {
+      depth[{ i % depth.width(), i / depth.width() }] = 0;
+    }
+    for (uint32_t j = 0; j < num_nonzeros; ++j, ++i) {
+      uint32_t zigzag;
+      if (!reader.ReadVLE(&zigzag)) {
+        return false;
+      }
+      int delta = static_cast<int>(zigzag >> 1) ^ -static_cast<int>(zigzag & 1);
+      previous += delta;
+      depth[{ i % depth.width(), i / depth.width() }] =
+        static_cast<uint16_t>(previous);
+    }
+  }
+  return true;
+}
+
+bool EncodeFrame(FrameCodec codec, const StreamMetadata& metadata,
+  Array1DReadView<uint8_t> raw, int jpeg_quality,
+  std::vector<uint8_t>* out) {
+  out->clear();
+  if (codec == FrameCodec::RAW) {
+    out->assign(raw.pointer(), raw.pointer() + raw.size());
+    return true;
+  }
+  if (raw.size() != RawFrameBytes(metadata)) {
+    return false;
+  }
+  if (codec == FrameCodec::RVL &&
+    metadata.format == PixelFormat::DEPTH_MM_U16) {
+    CompressRVL(Array2DReadView<uint16_t>(raw.pointer(), metadata.size),
+      out);
+    return true;
+  }
+  if (codec == FrameCodec::JPEG && metadata.format == PixelFormat::RGB_U888) {
+    // OpenCV encodes BGR.
+    cv::Mat rgb = array2DViewAsCvMat(
+      Array2DReadView<uint8x3>(raw.pointer(), metadata.size));
+    cv::Mat bgr;
+    cv::cvtColor(rgb, bgr, cv::COLOR_RGB2BGR);
+    return cv::imencode(".jpg", bgr, *out,
+      { cv::IMWRITE_JPEG_QUALITY, jpeg_quality });
+  }
+  return false;
+}
+
+bool DecodeFrame(FrameCodec codec, const StreamMetadata& metadata,
+  Array1DReadView<uint8_t> src, Array1DWriteView<uint8_t> raw) {
+  if (codec == FrameCodec::RAW) {
+    if (src.size() != raw.size()) {
+      return false;
+    }
+    std::copy(src.pointer(), src.pointer() + src.size(), raw.pointer());
+    return true;
+  }
+  if (raw.size() != RawFrameBytes(metadata)) {
+    return false;
+  }
+  if (codec == FrameCodec::RVL &&
+    metadata.format == PixelFormat::DEPTH_MM_U16) {
+    return DecompressRVL(src,
+      Array2DWriteView<uint16_t>(raw.pointer(), metadata.size));
+  }
+  if (codec == FrameCodec::JPEG && metadata.format == PixelFormat::RGB_U888) {
+    if (src.size() == 0) {
+      return false;
+    }
+    // imdecode only reads src.
+    cv::Mat encoded(1, src.size(), CV_8U,
+      const_cast<uint8_t*>(src.pointer()));
+    cv::Mat bgr = cv::imdecode(encoded, cv::IMREAD_COLOR);
+    if (bgr.cols != metadata.size.x || bgr.rows != metadata.size.y) {
+      return false;
+    }
+    cv::Mat rgb = array2DViewAsCvMat(
+      Array2DWriteView<uint8x3>(raw.pointer(), metadata.size));
+    cv::cvtColor(bgr, rgb, cv::COLOR_BGR2RGB);
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,69 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <cstdint>
+#include <vector>
+
+#include "libcgt/core/common/Array1D.h"
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/camera_wrappers/RGBDStream.h"
+
+// How the frames of one stream of a .rgbdz file are stored (see
+// compressed_rgbd_stream.h).
+enum class FrameCodec : int32_t {
+  // The frame's bytes, as in a .rgbd file.
+  RAW = 0,
+  // Lossless "RVL" run length and variable length delta coding of
+  // PixelFormat::DEPTH_MM_U16 depth [Wilson, 2017]. Typically 4-8x smaller
+  // than the raw frame.
+  RVL = 1,
+  // PixelFormat::RGB_U888 color, JPEG compressed.
+  JPEG = 2
+};
+
+// The best codec for frames of metadata: RVL for DEPTH_MM_U16, JPEG (if
+// allow_lossy) for RGB_U888, RAW otherwise.
+FrameCodec DefaultFrameCodec(
+  const libcgt::camera_wrappers::StreamMetadata& metadata, bool allow_lossy);
+
+// The size of a raw frame of metadata, in bytes, or 0 if its format is not
+// one that RgbdInput reads.
+int RawFrameBytes(const libcgt::camera_wrappers::StreamMetadata& metadata);
+
+// Appends the RVL encoding of depth to out.
+void CompressRVL(Array2DReadView<uint16_t> depth, std::vector<uint8_t>* out);
+
+// Decodes src, from CompressRVL(), into depth, which must have the size of
+// the original. Returns false if src is corrupt or of another size.
+bool DecompressRVL(Array1DReadView<uint8_t> src,
+  Array2DWriteView<uint16_t> depth);
+
+// Compresses raw, one raw frame of metadata, with codec, into out (replacing
+// its contents). jpeg_quality is in [0, 100]. Returns false if codec cannot
+// encode metadata's format.
+bool EncodeFrame(FrameCodec codec,
+  const libcgt::camera_wrappers::StreamMetadata& metadata,
+  Array1DReadView<uint8_t> raw, int jpeg_quality,
+  std::vector<uint8_t>* out);
+
+// Decodes src, one frame of metadata encoded with codec, into raw, which
+// must be RawFrameBytes(metadata) long (or src's size for RAW with unknown
+// formats). Returns false if src cannot be decoded.
+bool DecodeFrame(FrameCodec codec,
+  const libcgt::camera_wrappers::StreamMetadata& metadata,
+  Array1DReadView<uint8_t> src, Array1DWriteView<uint8_t> raw);
+
+#endif  // FRAME_CODEC_H
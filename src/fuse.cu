@@ -13,16 +13,126 @@
 // limitations under the License.
 #include "fuse.h"
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include <helper_math.h>
+
 #include "libcgt/cuda/float4x4.h"
 #include "libcgt/cuda/MathUtils.h"
 #include "libcgt/cuda/ThreadMath.cuh"
+#include "libcgt/cuda/VecmathConversions.h"
 
 #include "camera_math.cuh"
 
 using libcgt::cuda::threadmath::threadSubscript2DGlobal;
 using libcgt::cuda::contains;
+using libcgt::cuda::math::floorToInt;
 using libcgt::cuda::math::roundToInt;
 
+namespace {
+
+// Slack, in voxels, added to every frustum plane so that rounding never culls
+// a voxel the full sweep would have updated.
+constexpr float kFrustumMargin = 1.0f;
+
+// Returns the plane through a, b and c, oriented so that inside is on its
+// positive side.
+float4 OrientedPlane(float3 a, float3 b, float3 c, float3 inside) {
+  float3 n = normalize(cross(b - a, c - a));
+  if (dot(n, inside - a) < 0) {
+    n = -n;
+  }
+  return make_float4(n, -dot(n, a));
+}
+
+}  // namespace
+
+bool ComputeFusionFrustum(const Vector4f& flpp, const Vector2i& image_size,
+  float max_depth, const Matrix4f& grid_from_camera,
+  const Vector3i& grid_resolution, FusionFrustum* frustum_out) {
+  float4 flpp4 = make_float4(flpp);
+  const float2 pixel_corners[4] = {
+    { 0.0f, 0.0f },
+    { static_cast<float>(image_size.x), 0.0f },
+    { static_cast<float>(image_size.x), static_cast<float>(image_size.y) },
+    { 0.0f, static_cast<float>(image_size.y) }
+  };
+
+  float3 eye = make_float3((grid_from_camera * Vector4f(0, 0, 0, 1)).xyz);
+  float3 far_corners[4];
+  float3 far_center = {};
+  for (int i = 0; i < 4; ++i) {
+    float3 p = CameraFromPixel(pixel_corners[i], max_depth, flpp4);
+    far_corners[i] = make_float3(
+      (grid_from_camera * Vector4f(p.x, p.y, p.z, 1)).xyz);
+    far_center += 0.25f * far_corners[i];
+  }
+
+  // Four side planes through the eye and one far plane.
+  for (int i = 0; i < 4; ++i) {
+    frustum_out->planes[i] = OrientedPlane(eye, far_corners[i],
+      far_corners[(i + 1) % 4], far_center);
+  }
+  frustum_out->planes[4] = OrientedPlane(far_corners[0], far_corners[1],
+    far_corners[2], eye);
+
+  float3 lo = eye;
+  float3 hi = eye;
+  for (int i = 0; i < 4; ++i) {
+    lo = fminf(lo, far_corners[i]);
+    hi = fmaxf(hi, far_corners[i]);
+  }
+
+  frustum_out->box_min = {
+    std::max(0, static_cast<int>(std::floor(lo.x - kFrustumMargin))),
+    std::max(0, static_cast<int>(std::floor(lo.y - kFrustumMargin))),
+    std::max(0, static_cast<int>(std::floor(lo.z - kFrustumMargin)))
+  };
+  frustum_out->box_max = {
+    std::min(grid_resolution.x,
+      static_cast<int>(std::ceil(hi.x + kFrustumMargin))),
+    std::min(grid_resolution.y,
+      static_cast<int>(std::ceil(hi.y + kFrustumMargin))),
+    std::min(grid_resolution.z,
+      static_cast<int>(std::ceil(hi.z + kFrustumMargin)))
+  };
+
+  return frustum_out->box_min.x < frustum_out->box_max.x &&
+    frustum_out->box_min.y < frustum_out->box_max.y &&
+    frustum_out->box_min.z < frustum_out->box_max.z;
+}
+
+// Returns the range of slices [first, last) of the column xy whose voxel
+// centers lie inside frustum.
+__inline__ __device__
+int2 ColumnSliceRange(const FusionFrustum& frustum, int2 xy) {
+  float3 center = { xy.x + 0.5f, xy.y + 0.5f, 0.0f };
+  float z_lo = static_cast<float>(frustum.box_min.z);
+  float z_hi = static_cast<float>(frustum.box_max.z);
+  for (int i = 0; i < FusionFrustum::kNumPlanes; ++i) {
+    float4 plane = frustum.planes[i];
+    float a = plane.z;
+    float c = plane.x * center.x + plane.y * center.y + plane.w +
+      kFrustumMargin;
+    if (a > 0) {
+      z_lo = fmaxf(z_lo, -c / a);
+    } else if (a < 0) {
+      z_hi = fminf(z_hi, -c / a);
+    } else if (c < 0) {
+      return{ 0, 0 };
+    }
+  }
+
+  // Voxel k has its center at k + 0.5.
+  return{
+    max(frustum.box_min.z, static_cast<int>(ceilf(z_lo - 0.5f))),
+    min(frustum.box_max.z, static_cast<int>(floorf(z_hi - 0.5f)) + 1)
+  };
+}
+
+template <typename Voxel>
 __global__
 void FuseKernel(
   float4x4 world_from_grid,
@@ -30,13 +140,29 @@ void FuseKernel(
   float4 flpp,
   float2 depth_min_max,
   float4x4 camera_from_world,
+  FusionFrustum frustum,
+  int slices_per_thread,
   KernelArray2D<const float> depth_map,
-  KernelArray3D<TSDF> regular_grid) {
+  DirtyBrickMask dirty_bricks,
+  RollingGridView<Voxel> regular_grid) {
 
-  int2 ij = threadSubscript2DGlobal();
+  int2 ij = threadSubscript2DGlobal() +
+    int2{ frustum.box_min.x, frustum.box_min.y };
+  if (ij.x >= frustum.box_max.x || ij.y >= frustum.box_max.y) {
+    return;
+  }
 
-  // Sweep over the entire volume.
-  for (int k = 0; k < regular_grid.depth(); ++k) {
+  // Sweep over the part of the column inside the frustum (and this thread's
+  // chunk of it).
+  int2 slices = ColumnSliceRange(frustum, ij);
+  if (slices_per_thread > 0) {
+    int chunk_begin = frustum.box_min.z + blockIdx.z * slices_per_thread;
+    slices.x = max(slices.x, chunk_begin);
+    slices.y = min(slices.y, chunk_begin + slices_per_thread);
+  }
+  // Consecutive slices mostly share a brick: only mark each one once.
+  int last_marked_brick_z = -1;
+  for (int k = slices.x; k < slices.y; ++k) {
     // Find the voxel center.
     // TODO(jiawen): write a helper function that takes in a subscript
     float4 voxel_center_world = make_float4(
@@ -90,43 +216,167 @@ void FuseKernel(
       const float weight = 1.0f;
 
       regular_grid[{ij.x, ij.y, k}].Update(dz, weight, max_tsdf_value);
+
+      int brick_z = k / RegularGridTSDF::kBrickSize;
+      if (brick_z != last_marked_brick_z) {
+        dirty_bricks.MarkVoxel(ij.x, ij.y, k);
+        last_marked_brick_z = brick_z;
+      }
+    }
+  }
+}
+
+template <typename Voxel>
+__global__
+void RayBandFuseKernel(
+  float4x4 grid_from_camera,
+  float4x4 camera_from_grid,
+  float max_tsdf_value,
+  float4 flpp,
+  float2 depth_min_max,
+  KernelArray2D<const float> depth_map,
+  DirtyBrickMask dirty_bricks,
+  RollingGridView<Voxel> regular_grid) {
+
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(depth_map.size(), xy)) {
+    return;
+  }
+
+  float image_depth = depth_map[xy];
+  if (image_depth < depth_min_max.x || image_depth > depth_min_max.y) {
+    return;
+  }
+
+  // The segment of the ray through the truncation band, in grid coordinates.
+  float3 g0 = transformPoint(grid_from_camera, CameraFromPixel(xy,
+    fmaxf(image_depth - max_tsdf_value, 0.0f), flpp));
+  float3 g1 = transformPoint(grid_from_camera, CameraFromPixel(xy,
+    image_depth + max_tsdf_value, flpp));
+  float3 dir = g1 - g0;
+
+  // Amanatides and Woo: step to whichever voxel boundary the segment crosses
+  // next. t is the parameter along [g0, g1].
+  int3 voxel = floorToInt(g0);
+  int3 last = floorToInt(g1);
+  int3 step = { dir.x >= 0 ? 1 : -1, dir.y >= 0 ? 1 : -1,
+    dir.z >= 0 ? 1 : -1 };
+  float3 t_delta = {
+    dir.x != 0 ? fabsf(1.0f / dir.x) : FLT_MAX,
+    dir.y != 0 ? fabsf(1.0f / dir.y) : FLT_MAX,
+    dir.z != 0 ? fabsf(1.0f / dir.z) : FLT_MAX
+  };
+  float3 t_max = {
+    dir.x != 0 ? (voxel.x + (step.x > 0) - g0.x) / dir.x : FLT_MAX,
+    dir.y != 0 ? (voxel.y + (step.y > 0) - g0.y) / dir.y : FLT_MAX,
+    dir.z != 0 ? (voxel.z + (step.z > 0) - g0.z) / dir.z : FLT_MAX
+  };
+  int num_steps = abs(last.x - voxel.x) + abs(last.y - voxel.y) +
+    abs(last.z - voxel.z);
+
+  const int3 resolution = regular_grid.size();
+  for (int i = 0; i <= num_steps; ++i) {
+    if (voxel.x >= 0 && voxel.y >= 0 && voxel.z >= 0 &&
+      voxel.x < resolution.x && voxel.y < resolution.y &&
+      voxel.z < resolution.z) {
+      // Same projection as FuseKernel. Only the pixel the voxel center
+      // projects to updates it.
+      float3 voxel_center_camera = transformPoint(camera_from_grid,
+        float3{ voxel.x + 0.5f, voxel.y + 0.5f, voxel.z + 0.5f });
+      int2 uv_int = roundToInt(
+        make_float2(PixelFromCamera(voxel_center_camera, flpp)) -
+        float2{ 0.5f, 0.5f });
+      if (voxel_center_camera.z <= 0 &&
+        uv_int.x == xy.x && uv_int.y == xy.y) {
+        float dz = image_depth + voxel_center_camera.z;
+        if (dz >= -max_tsdf_value) {
+          dz = min(dz, max_tsdf_value);
+          const float weight = 1.0f;
+
+          regular_grid[voxel].Update(dz, weight, max_tsdf_value);
+          dirty_bricks.MarkVoxel(voxel.x, voxel.y, voxel.z);
+        }
+      }
+    }
+
+    if (t_max.x < t_max.y && t_max.x < t_max.z) {
+      voxel.x += step.x;
+      t_max.x += t_delta.x;
+    } else if (t_max.y < t_max.z) {
+      voxel.y += step.y;
+      t_max.y += t_delta.y;
+    } else {
+      voxel.z += step.z;
+      t_max.z += t_delta.z;
     }
   }
 }
 
 namespace {
-  constexpr int kNumDepthMaps = 3;
+
+// Integrates the observation of voxel_center_world by camera into voxel.
+template <typename Voxel>
+__inline__ __device__
+void FuseCamera(const FuseMultipleCamera& camera, float4 voxel_center_world,
+  float max_tsdf_value, Voxel& voxel) {
+  // Project it into camera coordinates.
+  // camera_from_world uses OpenGL conventions,
+  // so depth is a negative number if it's in front of the camera.
+  float4 voxel_center_camera =
+    camera.camera.camera_from_world * voxel_center_world;
+  float2 uv = make_float2(
+    PixelFromCamera(make_float3(voxel_center_camera), camera.camera.flpp));
+  int2 uv_int = roundToInt(uv - float2{0.5f, 0.5f});
+
+  if (voxel_center_camera.z > 0 ||
+    !contains(camera.depth_map_size, uv_int)) {
+    return;
+  }
+
+  float image_depth = tex2D<float>(camera.depth_map,
+    uv_int.x + 0.5f, uv_int.y + 0.5f);
+  if (image_depth < camera.camera.depth_min_max.x ||
+    image_depth > camera.camera.depth_min_max.y) {
+    return;
+  }
+
+  // Same as FuseKernel: positive in front of the surface, clamped to
+  // max_tsdf_value, and ignored when far behind.
+  float voxel_center_depth = -voxel_center_camera.z;
+  float dz = image_depth - voxel_center_depth;
+  if (dz >= -max_tsdf_value) {
+    dz = min(dz, max_tsdf_value);
+    const float weight = 1.0f;
+
+    voxel.Update(dz, weight, max_tsdf_value);
+  }
 }
 
+}  // namespace
+
+template <int kNumCameras, typename Voxel>
 __global__
 void FuseMultipleKernel(
   float4x4 world_from_grid,
   float max_tsdf_value,
-  CalibratedPosedDepthCamera depth_camera0,
-  CalibratedPosedDepthCamera depth_camera1,
-  CalibratedPosedDepthCamera depth_camera2,
-  KernelArray2D<const float> depth_map0,
-  KernelArray2D<const float> depth_map1,
-  KernelArray2D<const float> depth_map2,
-  KernelArray3D<TSDF> regular_grid) {
-
-  CalibratedPosedDepthCamera depth_camera[] =
-  {
-    depth_camera0,
-    depth_camera1,
-    depth_camera2
-  };
-  KernelArray2D<const float> depth_maps[] =
-  {
-    depth_map0,
-    depth_map1,
-    depth_map2
-  };
+  FuseMultipleCameras cameras,
+  int num_cameras,
+  int3 box_min,
+  int3 box_max,
+  DirtyBrickMask dirty_bricks,
+  RollingGridView<Voxel> regular_grid) {
+
+  int2 ij = threadSubscript2DGlobal() + int2{ box_min.x, box_min.y };
+  if (ij.x >= box_max.x || ij.y >= box_max.y) {
+    return;
+  }
 
-  int2 ij = threadSubscript2DGlobal();
+  if (kNumCameras > 0) {
+    num_cameras = kNumCameras;
+  }
 
-  // Sweep over the entire volume.
-  for (int k = 0; k < regular_grid.depth(); ++k) {
+  int last_marked_brick_z = -1;
+  for (int k = box_min.z; k < box_max.z; ++k) {
     // Find the voxel center.
     // TODO(jiawen): write a helper function that takes in a subscript
     float4 voxel_center_world = make_float4(
@@ -134,55 +384,198 @@ void FuseMultipleKernel(
         world_from_grid, float3{ij.x + 0.5f, ij.y + 0.5f, k + 0.5f}),
       1.0f);
 
-    for (int c = 0; c < kNumDepthMaps; ++c) {
-      // Project it into camera coordinates.
-      // camera_from_world uses OpenGL conventions,
-      // so depth is a negative number if it's in front of the camera.
-      float4 voxel_center_camera =
-        depth_camera[c].camera_from_world * voxel_center_world;
-      float2 uv = make_float2(
-        PixelFromCamera(make_float3(voxel_center_camera), depth_camera[c].flpp));
-      int2 uv_int = roundToInt(uv - float2{0.5f, 0.5f});
-
-      if (voxel_center_camera.z > 0 ||
-        !contains( depth_maps[c].size(), uv_int)) {
-        continue;
+    Voxel voxel = regular_grid[{ij.x, ij.y, k}];
+    const Voxel original = voxel;
+
+    if (kNumCameras > 0) {
+#pragma unroll
+      for (int c = 0; c < kNumCameras; ++c) {
+        FuseCamera(cameras.cameras[c], voxel_center_world,
+          max_tsdf_value, voxel);
+      }
+    } else {
+      for (int c = 0; c < num_cameras; ++c) {
+        FuseCamera(cameras.cameras[c], voxel_center_world,
+          max_tsdf_value, voxel);
       }
+    }
+
+    // Skip the store for voxels no camera observed.
+    if (voxel != original) {
+      regular_grid[{ij.x, ij.y, k}] = voxel;
+
+      int brick_z = k / RegularGridTSDF::kBrickSize;
+      if (brick_z != last_marked_brick_z) {
+        dirty_bricks.MarkVoxel(ij.x, ij.y, k);
+        last_marked_brick_z = brick_z;
+      }
+    }
+  }
+}
+
+__global__
+void BuildProjectionTableKernel(
+  float4x4 world_from_grid,
+  float4 flpp,
+  float4x4 camera_from_world,
+  int2 image_size,
+  KernelArray2D<const float2> undistort_map,
+  int2 raw_size,
+  int3 box_min,
+  int3 box_max,
+  uint2* table) {
+
+  int2 ij = threadSubscript2DGlobal() + int2{ box_min.x, box_min.y };
+  if (ij.x >= box_max.x || ij.y >= box_max.y) {
+    return;
+  }
+
+  const int box_width = box_max.x - box_min.x;
+  const int box_height = box_max.y - box_min.y;
+  for (int k = box_min.z; k < box_max.z; ++k) {
+    float4 voxel_center_world = make_float4(
+      transformPoint(
+        world_from_grid, float3{ij.x + 0.5f, ij.y + 0.5f, k + 0.5f}),
+      1.0f);
+
+    // Same projection as FuseCamera().
+    float4 voxel_center_camera = camera_from_world * voxel_center_world;
+    float2 uv = make_float2(
+      PixelFromCamera(make_float3(voxel_center_camera), flpp));
+    int2 uv_int = roundToInt(uv - float2{0.5f, 0.5f});
 
-      float image_depth = depth_maps[c][uv_int];
-      if (image_depth < depth_camera[c].depth_min_max.x ||
-        image_depth > depth_camera[c].depth_min_max.y) {
-        continue;
+    unsigned int pixel = kNoProjectedPixel;
+    if (voxel_center_camera.z <= 0 && contains(image_size, uv_int)) {
+      if (undistort_map.width() > 0) {
+        // undistort_map holds normalized coordinates into the raw depth map,
+        // which DepthProcessor::Undistort() point samples with clamping.
+        float2 xy2 = undistort_map[uv_int];
+        uv_int = {
+          min(max(static_cast<int>(floorf(xy2.x * raw_size.x)), 0),
+            raw_size.x - 1),
+          min(max(static_cast<int>(floorf(xy2.y * raw_size.y)), 0),
+            raw_size.y - 1)
+        };
       }
+      pixel = (static_cast<unsigned int>(uv_int.y) << 16) |
+        static_cast<unsigned int>(uv_int.x);
+    }
+
+    size_t index = (ij.x - box_min.x) + static_cast<size_t>(box_width) *
+      ((ij.y - box_min.y) + static_cast<size_t>(box_height) *
+        (k - box_min.z));
+    table[index] = make_uint2(pixel,
+      __float_as_uint(-voxel_center_camera.z));
+  }
+}
+
+namespace {
+
+// Same as FuseCamera(), but reads the voxel's pixel and depth from camera's
+// projection table.
+template <typename Voxel>
+__inline__ __device__
+void FuseProjectedCamera(const ProjectedFuseCamera& camera, int3 ijk,
+  float max_tsdf_value, Voxel& voxel) {
+  if (ijk.x < camera.box_min.x || ijk.y < camera.box_min.y ||
+    ijk.z < camera.box_min.z || ijk.x >= camera.box_max.x ||
+    ijk.y >= camera.box_max.y || ijk.z >= camera.box_max.z) {
+    return;
+  }
+
+  size_t index = (ijk.x - camera.box_min.x) +
+    static_cast<size_t>(camera.box_max.x - camera.box_min.x) *
+    ((ijk.y - camera.box_min.y) +
+      static_cast<size_t>(camera.box_max.y - camera.box_min.y) *
+      (ijk.z - camera.box_min.z));
+  uint2 entry = camera.table[index];
+  if (entry.x == kNoProjectedPixel) {
+    return;
+  }
+
+  float image_depth = tex2D<float>(camera.depth_map,
+    (entry.x & 0xffffu) + 0.5f, (entry.x >> 16) + 0.5f);
+  if (image_depth < camera.depth_min_max.x ||
+    image_depth > camera.depth_min_max.y) {
+    return;
+  }
+
+  float voxel_center_depth = __uint_as_float(entry.y);
+  float dz = image_depth - voxel_center_depth;
+  if (dz >= -max_tsdf_value) {
+    dz = min(dz, max_tsdf_value);
+    const float weight = 1.0f;
+
+    voxel.Update(dz, weight, max_tsdf_value);
+  }
+}
+
+}  // namespace
+
+template <typename Voxel>
+__global__
+void FuseProjectedKernel(
+  float max_tsdf_value,
+  ProjectedFuseCameras cameras,
+  int num_cameras,
+  int3 box_min,
+  int3 box_max,
+  DirtyBrickMask dirty_bricks,
+  RollingGridView<Voxel> regular_grid) {
+
+  int2 ij = threadSubscript2DGlobal() + int2{ box_min.x, box_min.y };
+  if (ij.x >= box_max.x || ij.y >= box_max.y) {
+    return;
+  }
+
+  int last_marked_brick_z = -1;
+  for (int k = box_min.z; k < box_max.z; ++k) {
+    Voxel voxel = regular_grid[{ij.x, ij.y, k}];
+    const Voxel original = voxel;
 
-      // Compute dz, the signed distance between the voxel center and the
-      // surface observation.
-      //
-      // Note that we flip the sign on z to get "depth", where positive numbers
-      // are in front of the camera.
-      //
-      // The sign convention of the distance field is so that voxels in front of
-      // the surface is positive (and voxels behind are negative).
-      float voxel_center_depth = -voxel_center_camera.z;
-      float dz = image_depth - voxel_center_depth;
-
-      // Now integrate data in carefully:
-      // Consider 3 cases:
-      // dz < -max_tsdf_value: the voxel is behind the observation and out of the
-      //   truncation region. Therefore, do nothing.
-      // dz \in [-max_tsdf_value, 0]: the voxel is behind the observation and
-      //   within the truncation region. Integrate.
-      // dz > 0: the voxel is in front of the observation. Integrate... but if
-      //   the voxel is really far in front, we don't want to put in a large
-      //   value. Instead, clamp it to max_tsdf_value.
-      if (dz >= -max_tsdf_value) {
-        // Ignore the voxel when it is far behind.
-        // Clamp to the TSDF range.
-        dz = min(dz, max_tsdf_value);
-        const float weight = 1.0f;
-
-        regular_grid[{ij.x, ij.y, k}].Update(dz, weight, max_tsdf_value);
+    for (int c = 0; c < num_cameras; ++c) {
+      FuseProjectedCamera(cameras.cameras[c],
+        int3{ ij.x, ij.y, k }, max_tsdf_value, voxel);
+    }
+
+    if (voxel != original) {
+      regular_grid[{ij.x, ij.y, k}] = voxel;
+
+      int brick_z = k / RegularGridTSDF::kBrickSize;
+      if (brick_z != last_marked_brick_z) {
+        dirty_bricks.MarkVoxel(ij.x, ij.y, k);
+        last_marked_brick_z = brick_z;
       }
     }
   }
 }
+
+#define FUSE_KERNEL_INSTANTIATIONS(Voxel) \
+  template __global__ void FuseKernel<Voxel>(float4x4, float, float4, float2, \
+    float4x4, FusionFrustum, int, KernelArray2D<const float>, \
+    DirtyBrickMask, RollingGridView<Voxel>); \
+  template __global__ void RayBandFuseKernel<Voxel>(float4x4, float4x4, \
+    float, float4, float2, KernelArray2D<const float>, DirtyBrickMask, \
+    RollingGridView<Voxel>); \
+  FUSE_MULTIPLE_KERNEL_INSTANTIATION(0, Voxel) \
+  FUSE_MULTIPLE_KERNEL_INSTANTIATION(1, Voxel) \
+  FUSE_MULTIPLE_KERNEL_INSTANTIATION(2, Voxel) \
+  FUSE_MULTIPLE_KERNEL_INSTANTIATION(3, Voxel) \
+  FUSE_MULTIPLE_KERNEL_INSTANTIATION(4, Voxel) \
+  FUSE_MULTIPLE_KERNEL_INSTANTIATION(5, Voxel) \
+  FUSE_MULTIPLE_KERNEL_INSTANTIATION(6, Voxel) \
+  FUSE_MULTIPLE_KERNEL_INSTANTIATION(7, Voxel) \
+  FUSE_MULTIPLE_KERNEL_INSTANTIATION(8, Voxel) \
+  template __global__ void FuseProjectedKernel<Voxel>(float, \
+    ProjectedFuseCameras, int, int3, int3, DirtyBrickMask, \
+    RollingGridView<Voxel>);
+
+#define FUSE_MULTIPLE_KERNEL_INSTANTIATION(kNumCameras, Voxel) \
+  template __global__ void FuseMultipleKernel<kNumCameras, Voxel>(float4x4, \
+    float, FuseMultipleCameras, int, int3, int3, DirtyBrickMask, \
+    RollingGridView<Voxel>);
+
+TSDF_FOR_EACH_ENCODING(FUSE_KERNEL_INSTANTIATIONS)
+
+#undef FUSE_MULTIPLE_KERNEL_INSTANTIATION
+#undef FUSE_KERNEL_INSTANTIATIONS
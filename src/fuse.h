@@ -14,15 +14,79 @@
 #ifndef FUSE_H
 #define FUSE_H
 
+#include <texture_types.h>
 #include <vector_types.h>
 
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Vector2i.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+#include "libcgt/core/vecmath/Vector4f.h"
 #include "libcgt/cuda/float4x4.h"
 #include "libcgt/cuda/KernelArray2D.h"
 #include "libcgt/cuda/KernelArray3D.h"
 
+#include "brick_list.h"
 #include "calibrated_posed_depth_camera.h"
 #include "regular_grid_tsdf.h"
+#include "rolling_grid_view.h"
+#include "tsdf.h"
 
+// One bit per RegularGridTSDF::kBrickSize^3 brick of a regular grid, set by
+// the fuse kernels when they modify a voxel in the brick. Bricks are numbered
+// x fastest, then y, then z.
+//
+// The bricks are also inserted into fused, the bricks modified by this launch
+// alone, so that what is derived from them can be refreshed without visiting
+// the rest of the grid.
+struct DirtyBrickMask {
+  unsigned int* words;
+  int3 num_bricks;
+  BrickList fused;
+
+#ifdef __CUDACC__
+  __inline__ __device__
+  void MarkVoxel(int x, int y, int z) const {
+    const int kBrickSize = RegularGridTSDF::kBrickSize;
+    int index = x / kBrickSize + num_bricks.x *
+      (y / kBrickSize + num_bricks.y * (z / kBrickSize));
+    atomicOr(&words[index / 32], 1u << (index % 32));
+    fused.Insert(index);
+  }
+#endif
+};
+
+// The region of a regular grid that fusing one depth map can modify: the
+// camera frustum, cut off at the farthest depth that can still be updated.
+// It is the intersection of the half-spaces dot(plane.xyz, p) + plane.w >= 0,
+// in grid coordinates, and is bounded by [box_min, box_max).
+struct FusionFrustum {
+  static constexpr int kNumPlanes = 5;
+  float4 planes[kNumPlanes];
+  int3 box_min;
+  int3 box_max;
+};
+
+// Computes the FusionFrustum of a depth camera with intrinsics flpp and
+// image_size, that observes depths up to max_depth (camera_range.right() plus
+// the truncation distance).
+//
+// There is no near plane: voxels between the camera and the near end of its
+// depth range are still in front of every observation and must be carved.
+//
+// Returns false if the frustum does not overlap the grid.
+bool ComputeFusionFrustum(const Vector4f& flpp, const Vector2i& image_size,
+  float max_depth, const Matrix4f& grid_from_camera,
+  const Vector3i& grid_resolution, FusionFrustum* frustum_out);
+
+// Fuses depth_map into regular_grid. Launch with one thread per (x, y) column
+// of [frustum.box_min, frustum.box_max). Each column only visits the slices
+// that fall inside the frustum, and marks the bricks it updates in
+// dirty_bricks. If slices_per_thread > 0, columns are split into chunks of
+// that many slices from frustum.box_min.z, one per block along grid z;
+// otherwise launch with grid z = 1.
+//
+// Voxel is any of the TSDF encodings in tsdf.h.
+template <typename Voxel>
 __global__
 void FuseKernel(
   float4x4 world_from_grid,
@@ -30,21 +94,137 @@ void FuseKernel(
   float4 flpp,
   float2 depth_min_max,
   float4x4 camera_from_world,
+  FusionFrustum frustum,
+  int slices_per_thread,
   KernelArray2D<const float> depth_map,
-  KernelArray3D<TSDF> regular_grid);
+  DirtyBrickMask dirty_bricks,
+  RollingGridView<Voxel> regular_grid);
+
+// Same as FuseKernel, but pixel-driven: launch with one thread per pixel of
+// depth_map. Each valid pixel marches the ray through its center across the
+// voxels whose depth is within max_tsdf_value of its own, and updates the
+// ones whose centers project to it. Every voxel projects to one pixel, so
+// there are no write conflicts. The cost scales with the number of pixels
+// rather than with the volume of the frustum.
+//
+// Unlike FuseKernel, free space farther than max_tsdf_value in front of the
+// surface is not carved. Within the band, the update matches FuseKernel's
+// only if the voxel side is at least the footprint of a pixel at the far end
+// of the band, (depth_min_max.y + max_tsdf_value) / min(fx, fy): smaller
+// voxels can lie between the center rays of neighboring pixels and are then
+// missed by the ray of the pixel they project to.
+template <typename Voxel>
+__global__
+void RayBandFuseKernel(
+  float4x4 grid_from_camera,
+  float4x4 camera_from_grid,
+  float max_tsdf_value,
+  float4 flpp,
+  float2 depth_min_max,
+  KernelArray2D<const float> depth_map,
+  DirtyBrickMask dirty_bricks,
+  RollingGridView<Voxel> regular_grid);
+
+// The maximum number of cameras FuseMultipleKernel can integrate in one sweep.
+constexpr int kMaxFuseMultipleCameras = 16;
 
-// TODO: replace CalibratedPosedDepthCamera with something in __constant__
-// memory.
+// FuseMultipleKernel has compile-time specializations for 1 through this many
+// cameras.
+constexpr int kMaxUnrolledFuseMultipleCameras = 8;
+
+// A posed depth camera together with its depth map, bound to a texture object
+// (unnormalized coordinates, point sampling).
+struct FuseMultipleCamera {
+  CalibratedPosedDepthCamera camera;
+  cudaTextureObject_t depth_map;
+  int2 depth_map_size;
+};
+
+// The cameras of one FuseMultipleKernel launch. Passed by value, as a kernel
+// parameter, so that volumes fused concurrently (e.g. by fuse_depth_cli's
+// concurrent jobs) never see each other's cameras.
+struct FuseMultipleCameras {
+  FuseMultipleCamera cameras[kMaxFuseMultipleCameras];
+};
+static_assert(sizeof(FuseMultipleCameras) <= 4096,
+  "FuseMultipleCameras exceeds the 4 KB kernel parameter limit");
+
+// Fuses cameras.cameras[0, num_cameras) into regular_grid in a single sweep:
+// each voxel is read once, updated by each camera in order, and written once.
+// Launch with one thread per (x, y) column of [box_min, box_max). Bricks
+// containing a changed voxel are marked in dirty_bricks.
+//
+// kNumCameras > 0 is a compile-time camera count (the camera loop is
+// unrolled) and num_cameras is ignored. kNumCameras == 0 reads the count from
+// num_cameras. Instantiated for 0 through kMaxUnrolledFuseMultipleCameras,
+// and for every TSDF encoding.
+template <int kNumCameras, typename Voxel>
 __global__
 void FuseMultipleKernel(
   float4x4 world_from_grid,
   float max_tsdf_value,
-  CalibratedPosedDepthCamera depth_camera0,
-  CalibratedPosedDepthCamera depth_camera1,
-  CalibratedPosedDepthCamera depth_camera2,
-  KernelArray2D<const float> depth_map0,
-  KernelArray2D<const float> depth_map1,
-  KernelArray2D<const float> depth_map2,
-  KernelArray3D<TSDF> regular_grid);
+  FuseMultipleCameras cameras,
+  int num_cameras,
+  int3 box_min,
+  int3 box_max,
+  DirtyBrickMask dirty_bricks,
+  RollingGridView<Voxel> regular_grid);
+
+// Entry of a projection table (see BuildProjectionTableKernel) for a voxel
+// that no pixel observes.
+constexpr unsigned int kNoProjectedPixel = 0xffffffffu;
+
+// Builds the projection table of a static depth camera: for each voxel of
+// [box_min, box_max), x fastest, the depth map pixel it projects to, packed
+// as (y << 16) | x (or kNoProjectedPixel), and the depth of its center, as
+// the bits of a float. Launch with one thread per (x, y) column of the box.
+//
+// If undistort_map is not empty, pixels are looked up in it the same way
+// DepthProcessor::Undistort() does, and the packed pixel is the one of the
+// raw depth map, of size raw_size. Otherwise, it is the pixel of the
+// image_size depth map itself.
+__global__
+void BuildProjectionTableKernel(
+  float4x4 world_from_grid,
+  float4 flpp,
+  float4x4 camera_from_world,
+  int2 image_size,
+  KernelArray2D<const float2> undistort_map,
+  int2 raw_size,
+  int3 box_min,
+  int3 box_max,
+  uint2* table);
+
+// A static depth camera's projection table and its depth map, bound to a
+// texture object (unnormalized coordinates, point sampling).
+struct ProjectedFuseCamera {
+  const uint2* table;
+  int3 box_min;
+  int3 box_max;
+  float2 depth_min_max;
+  cudaTextureObject_t depth_map;
+};
+
+// The cameras of one FuseProjectedKernel launch, passed by value like
+// FuseMultipleCameras.
+struct ProjectedFuseCameras {
+  ProjectedFuseCamera cameras[kMaxFuseMultipleCameras];
+};
+static_assert(sizeof(ProjectedFuseCameras) <= 4096,
+  "ProjectedFuseCameras exceeds the 4 KB kernel parameter limit");
+
+// Same as FuseMultipleKernel, for cameras.cameras[0, num_cameras), but
+// gathers each voxel's pixel and depth from the cameras' projection tables
+// instead of projecting it.
+template <typename Voxel>
+__global__
+void FuseProjectedKernel(
+  float max_tsdf_value,
+  ProjectedFuseCameras cameras,
+  int num_cameras,
+  int3 box_min,
+  int3 box_max,
+  DirtyBrickMask dirty_bricks,
+  RollingGridView<Voxel> regular_grid);
 
 #endif // FUSE_H
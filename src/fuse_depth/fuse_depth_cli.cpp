@@ -11,18 +11,38 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include <cuda_runtime.h>
 #include <gflags/gflags.h>
 #include "libcgt/camera_wrappers/StreamConfig.h"
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 #include "libcgt/core/vecmath/SimilarityTransform.h"
 
+#include "../capture_thread.h"
+#include "../depth_processor.h"
+#include "../device_array_pool.h"
 #include "../input_buffer.h"
+#include "../launch_tuner.h"
+#include "../perf_collector.h"
+#include "../ply_mesh_writer.h"
 #include "../pose_utils.h"
+#include "../projective_point_plane_icp.h"
 #include "../regular_grid_fusion_pipeline.h"
 #include "../rgbd_camera_parameters.h"
+#include "../rgbd_frame_index.h"
 #include "../rgbd_input.h"
+#include "../trace.h"
 
 using libcgt::core::vecmath::EuclideanTransform;
 using libcgt::core::vecmath::SimilarityTransform;
@@ -40,10 +60,44 @@ DEFINE_string(pose_estimator, "color_aruco_and_depth_icp",
   "--precomputed_pose is required.");
 DEFINE_string(precomputed_pose, "",
   "[Optional] precomputed pose file.");
+DEFINE_int32(first_depth_frame, 0,
+  "[Optional] Start fusing at the first depth frame whose frame index is at "
+  "least this. Frames are located with the input's frame index (see "
+  "--input_rgbd), built and saved next to it on first use.");
+DEFINE_int32(last_depth_frame, -1,
+  "[Optional] If non-negative, stop fusing after the depth frames whose "
+  "frame index is at most this.");
+DEFINE_string(job_list, "",
+  "[Optional] Instead of a single input, fuse every job listed in this text "
+  "file, several at a time on the same GPU. Each line is one job: "
+  "whitespace-separated key=value pairs, where the keys are the names of the "
+  "input and output flags (calibration_dir, input_rgbd, pose_estimator, "
+  "precomputed_pose, first_depth_frame, last_depth_frame, output_mesh, "
+  "output_point_cloud, output_pose and output_tsdf3d). Keys not given take "
+  "the value of the flag. Empty lines and lines starting with # are "
+  "skipped.");
+DEFINE_int32(max_concurrent_jobs, 2,
+  "With --job_list, the maximum number of jobs fused at the same time.");
+DEFINE_int32(job_memory_headroom_mb, 512,
+  "With --job_list, only start another job while running ones are in "
+  "flight if the GPU would keep at least this much memory free, in MiB, "
+  "after allocating it.");
 
 // Outputs.
 DEFINE_string(output_mesh, "",
-  "[Optional] If not-empty, save fused mesh as a .obj file.");
+  "[Optional] If not-empty, save fused mesh as a .obj file, or as a binary "
+  ".ply file, streamed to disk as it is meshed, if it ends in .ply.");
+DEFINE_bool(output_mesh_quantize_normals, false,
+  "[Optional] Store the normals of a .ply output_mesh or "
+  "output_point_cloud as bytes.");
+DEFINE_int32(output_mesh_lod, 0,
+  "[Optional] Mesh a copy of the volume downsampled 2^lod times along each "
+  "axis (at most 2) for a quick preview. 0 meshes every voxel.");
+DEFINE_string(output_point_cloud, "",
+  "[Optional] If not-empty, save the zero crossings of the volume, with "
+  "normals, as a binary .ply point cloud. Extracted on the GPU: much "
+  "cheaper than output_mesh when no mesh is needed. Regular and bricked "
+  "grid volumes only.");
 DEFINE_string(output_pose, "",
   "[Optional] If not-empty, save new pose estimates as a .pose file.");
 DEFINE_string(output_tsdf3d, "",
@@ -51,9 +105,135 @@ DEFINE_string(output_tsdf3d, "",
 
 // Options.
 DEFINE_bool(collect_perf, false, "Collect performance statistics.");
+DEFINE_string(perf_csv, "", "With --collect_perf, write per-stage timing "
+  "percentiles to this .csv file on exit.");
+DEFINE_string(perf_json, "", "With --collect_perf, write per-stage timing "
+  "percentiles to this .json file on exit.");
+DEFINE_string(trace_out, "", "If non-empty, record host-side spans of the "
+  "pipeline stages and write them to this file as Chrome trace_event JSON "
+  "(chrome://tracing or Perfetto) on exit.");
 DEFINE_bool(adaptive_raycast, true, "Use signed distance values themselves "
   "during raycasting rather than one voxel at a time. Much faster, slightly "
   "less accurate.");
+DEFINE_bool(texture_raycast, false, "Raycast regular grid volumes through a "
+  "hardware-filtered 3D texture mirror of the TSDF instead of interpolating "
+  "voxels in software. Faster, slightly less accurate.");
+DEFINE_bool(lod_raycast, false, "Raycast free camera views of regular grid "
+  "volumes from 2x and 4x downsampled copies of the TSDF where a pixel covers "
+  "that many voxels. Tracking raycasts always read every voxel. Cannot be "
+  "combined with texture_raycast.");
+DEFINE_bool(compact_raycast, false, "Also raycast an 8 byte per pixel "
+  "depth and packed normal image for ICP to track against, which reads a "
+  "quarter of the bytes of the world points and normals. Regular grid "
+  "volumes only: others track against the world points and normals.");
+DEFINE_bool(cuda_graphs, false, "Capture each frame's depth "
+  "preprocessing, ICP iterations, and (regular and bricked grid volumes "
+  "only) fusion and raycast as CUDA graphs and replay them, to save kernel "
+  "launch overhead. Ignored with --collect_perf and "
+  "--deterministic_pipeline.");
+DEFINE_bool(ray_band_fusion, false, "Fuse regular grid volumes with one "
+  "thread per depth pixel, marching only through the truncation band around "
+  "its depth, instead of sweeping every voxel of the camera frustum. Cost "
+  "scales with the image rather than the volume, but free space in front of "
+  "the band is not carved. Falls back to the sweep when voxels are smaller "
+  "than a depth pixel at the far end of the depth range.");
+DEFINE_string(tsdf_volume, "regular_grid",
+  "TSDF volume representation. One of \"regular_grid\" (dense), "
+  "\"bricked_grid\" (dense, stored in 8^3 bricks for locality), "
+  "\"voxel_hashed\" (sparse, only allocates blocks near surfaces) or "
+  "\"partitioned\" (dense, split into z slabs across GPUs).");
+DEFINE_int32(tsdf_num_devices, 0,
+  "Number of GPUs a partitioned TSDF volume is split across. 0 uses all "
+  "visible GPUs.");
+DEFINE_int32(voxel_hash_max_blocks, 1 << 18,
+  "Capacity of the voxel_hashed block pool (8^3 voxels per block).");
+DEFINE_bool(deterministic_pipeline, false,
+  "Run every GPU stage of the single moving camera pipeline on the default "
+  "stream, in order, instead of overlapping consecutive frames.");
+DEFINE_string(depth_smoothing, "bilateral",
+  "Bilateral filter used to smooth incoming depth: \"bilateral\" (exact) or "
+  "\"separable_bilateral\" (a faster approximation, linear in the radius).");
+DEFINE_double(depth_smoothing_spatial_sigma, 1.0,
+  "Spatial standard deviation of the depth smoothing filter, in pixels. The "
+  "filter radius is ceil(2 * sigma).");
+DEFINE_double(depth_smoothing_range_sigma, 0.03,
+  "Range standard deviation of the depth smoothing filter, in meters.");
+DEFINE_int32(fusion_batch_size, 1,
+  "With the precomputed pose estimator, fuse this many depth frames at a "
+  "time, in a single sweep over the volume, and skip raycasting. 1 fuses "
+  "each frame as it arrives.");
+DEFINE_bool(fused_depth_preprocessing, false,
+  "Undistort (multiple static cameras only), smooth and estimate normals of "
+  "incoming depth in a single fused kernel. The multiple static camera "
+  "pipeline then fuses smoothed depth instead of raw undistorted depth.");
+DEFINE_string(icp_error_metric, "point_to_plane",
+  "Residual minimized by depth ICP: \"point_to_plane\" or "
+  "\"symmetric_point_to_plane\", which also uses the incoming normal.");
+DEFINE_bool(icp_debug_vis, false,
+  "Write the per-pixel depth ICP association visualization. Nothing here "
+  "displays it.");
+DEFINE_int32(device_pool_capacity_mb, 1024,
+  "Device buffers given up by pipelines, ICP and volumes are kept, up to "
+  "this many MiB, and reused by the next request of the same type and size "
+  "instead of being freed and reallocated. 0 frees them at once.");
+DEFINE_bool(autotune_launches, false, "Time candidate block shapes (and "
+  "slice chunks) for the fusion, raycast and depth preprocessing kernels "
+  "the first time each runs at a new size on this GPU, use the fastest and "
+  "save it to --launch_config_cache. Skipped for work captured with "
+  "--cuda_graphs.");
+DEFINE_string(launch_config_cache, "launch_configs.txt", "Launch "
+  "configurations tuned with --autotune_launches, per GPU name. Kernels "
+  "without an entry use 16 x 16 blocks. Empty to neither read nor write "
+  "one.");
+DEFINE_bool(gpu_depth_conversion, true,
+  "Upload millimeter depth frames as is and convert them to meters on the "
+  "GPU, instead of converting them on the CPU and uploading twice as many "
+  "bytes.");
+DEFINE_bool(aruco_tracking, true,
+  "Once the ArUco board has been found, only search for it around where the "
+  "latest pose projects it, and search the whole color frame after a miss.");
+DEFINE_double(aruco_detection_scale, 1.0,
+  "With --aruco_tracking, detect markers on the region of interest "
+  "downscaled by this factor, in (0, 1], then refine their corners at full "
+  "resolution.");
+DEFINE_bool(async_color_pose, false,
+  "Estimate ArUco poses on a worker thread. Color frames then never hold up "
+  "depth processing, and the next depth frame consumes the latest estimate "
+  "as its absolute pose. With --deterministic_pipeline, each color frame "
+  "still waits for its estimate.");
+DEFINE_double(raycast_reuse_max_rotation_degrees, 1.0,
+  "Pose estimation reuses the latest raycast, instead of raycasting again, "
+  "when nothing was fused since and the new pose is within this rotation "
+  "(and raycast_reuse_max_translation) of the raycast's pose.");
+DEFINE_double(raycast_reuse_max_translation, 0.01,
+  "See raycast_reuse_max_rotation_degrees. In meters.");
+DEFINE_bool(rolling_volume, false,
+  "Shift the TSDF volume by whole voxels to follow the depth camera, so that "
+  "scans can extend past the initial volume. Only supported by "
+  "\"regular_grid\" and \"bricked_grid\".");
+DEFINE_double(rolling_volume_margin, 0.25,
+  "The rolling volume is re-centered along an axis when the point at the "
+  "middle of the depth range gets closer than this fraction of the volume to "
+  "either side.");
+DEFINE_bool(rolling_volume_mesh, false,
+  "Mesh voxels as they leave the rolling volume, and include them in saved "
+  "meshes.");
+DEFINE_int32(rolling_volume_store_mb, 512,
+  "The most host memory, in MB, kept for voxels that left the rolling "
+  "volume. The oldest are dropped first (their triangles, with "
+  "rolling_volume_mesh, are kept).");
+DEFINE_int32(capture_queue_capacity, 2,
+  "Number of frames read ahead, on a separate thread, while the pipeline "
+  "processes the current one. Reading waits for the pipeline: every frame is "
+  "fused.");
+
+// Read by depth_fusion_core's multi static camera pipeline, which this tool
+// does not run. Defined here like the core's other flags, with the same
+// defaults as depth_fusion, so that any object of the core links.
+DEFINE_bool(ms_cached_projection, false,
+  "Unused by fuse_depth_cli (multi static camera pipeline only).");
+DEFINE_bool(ms_incremental_fusion, true,
+  "Unused by fuse_depth_cli (multi static camera pipeline only).");
 
 // TODO: specify these as flags.
 constexpr int kRegularGridResolution = 512;
@@ -61,9 +241,123 @@ constexpr float kRegularGridSideLength = 2.0f;
 constexpr float kRegularGridVoxelSize =
   kRegularGridSideLength / kRegularGridResolution;
 
-SimilarityTransform GetInitialWorldFromGrid() {
+// Everything fusing one recording needs. See --job_list.
+struct FusionJob {
+  std::string calibration_dir;
+  std::string input_rgbd;
+  std::string pose_estimator;
+  std::string precomputed_pose;
+  int first_depth_frame;
+  int last_depth_frame;
+  std::string output_mesh;
+  std::string output_point_cloud;
+  std::string output_pose;
+  std::string output_tsdf3d;
+};
+
+FusionJob FusionJobFromFlags() {
+  FusionJob job;
+  job.calibration_dir = FLAGS_calibration_dir;
+  job.input_rgbd = FLAGS_input_rgbd;
+  job.pose_estimator = FLAGS_pose_estimator;
+  job.precomputed_pose = FLAGS_precomputed_pose;
+  job.first_depth_frame = FLAGS_first_depth_frame;
+  job.last_depth_frame = FLAGS_last_depth_frame;
+  job.output_mesh = FLAGS_output_mesh;
+  job.output_point_cloud = FLAGS_output_point_cloud;
+  job.output_pose = FLAGS_output_pose;
+  job.output_tsdf3d = FLAGS_output_tsdf3d;
+  return job;
+}
+
+// Parses one "key=value" token of a job list line into job.
+bool ParseFusionJobToken(const std::string& token, FusionJob* job) {
+  size_t equals = token.find('=');
+  if (equals == std::string::npos) {
+    return false;
+  }
+  std::string key = token.substr(0, equals);
+  std::string value = token.substr(equals + 1);
+  if (key == "calibration_dir") {
+    job->calibration_dir = value;
+  } else if (key == "input_rgbd") {
+    job->input_rgbd = value;
+  } else if (key == "pose_estimator") {
+    job->pose_estimator = value;
+  } else if (key == "precomputed_pose") {
+    job->precomputed_pose = value;
+  } else if (key == "first_depth_frame") {
+    job->first_depth_frame = std::stoi(value);
+  } else if (key == "last_depth_frame") {
+    job->last_depth_frame = std::stoi(value);
+  } else if (key == "output_mesh") {
+    job->output_mesh = value;
+  } else if (key == "output_point_cloud") {
+    job->output_point_cloud = value;
+  } else if (key == "output_pose") {
+    job->output_pose = value;
+  } else if (key == "output_tsdf3d") {
+    job->output_tsdf3d = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Reads --job_list. Fails if a line does not parse or two jobs write the same
+// output file.
+bool LoadFusionJobList(const std::string& filename,
+  std::vector<FusionJob>* jobs) {
+  std::ifstream stream(filename);
+  if (!stream) {
+    fprintf(stderr, "Error opening job list %s.\n", filename.c_str());
+    return false;
+  }
+
+  std::set<std::string> outputs;
+  std::string line;
+  int line_number = 0;
+  while (std::getline(stream, line)) {
+    ++line_number;
+    std::istringstream tokens(line);
+    std::string token;
+    if (!(tokens >> token) || token[0] == '#') {
+      continue;
+    }
+
+    FusionJob job = FusionJobFromFlags();
+    do {
+      bool ok;
+      try {
+        ok = ParseFusionJobToken(token, &job);
+      } catch (const std::exception&) {
+        ok = false;
+      }
+      if (!ok) {
+        fprintf(stderr, "%s:%d: invalid job argument: %s.\n",
+          filename.c_str(), line_number, token.c_str());
+        return false;
+      }
+    } while (tokens >> token);
+
+    for (const std::string* output :
+      { &job.output_mesh, &job.output_point_cloud, &job.output_pose,
+        &job.output_tsdf3d }) {
+      if (!output->empty() && !outputs.insert(*output).second) {
+        fprintf(stderr, "%s:%d: %s is written by another job.\n",
+          filename.c_str(), line_number, output->c_str());
+        return false;
+      }
+    }
+    jobs->push_back(job);
+  }
+  return true;
+}
+
+SimilarityTransform GetInitialWorldFromGrid(
+  const std::string& pose_estimator) {
   // TODO: consider initializing the camera to be at the origin.
-  if (FLAGS_pose_estimator == "depth_icp") {
+  if (pose_estimator == "depth_icp") {
     // Put the camera at the center of the front face of the cube.
     return SimilarityTransform(kRegularGridVoxelSize) *
            SimilarityTransform(Vector3f(-0.5f * kRegularGridResolution,
@@ -78,17 +372,18 @@ SimilarityTransform GetInitialWorldFromGrid() {
   }
 }
 
-bool GetPoseEstimatorOptions(const RGBDCameraParameters& camera_params,
+bool GetPoseEstimatorOptions(const FusionJob& job,
+  const RGBDCameraParameters& camera_params,
   PoseEstimatorOptions* options) {
-  if (FLAGS_pose_estimator == "color_aruco" ||
-    FLAGS_pose_estimator == "color_aruco_and_depth_icp") {
-    if (FLAGS_pose_estimator == "color_aruco") {
+  if (job.pose_estimator == "color_aruco" ||
+    job.pose_estimator == "color_aruco_and_depth_icp") {
+    if (job.pose_estimator == "color_aruco") {
       options->method = PoseEstimationMethod::COLOR_ARUCO;
     } else {
       options->method = PoseEstimationMethod::COLOR_ARUCO_AND_DEPTH_ICP;
     }
     return true;
-  } else if (FLAGS_pose_estimator == "depth_icp") {
+  } else if (job.pose_estimator == "depth_icp") {
     // y up
     const EuclideanTransform kInitialDepthCameraFromWorld =
       EuclideanTransform::fromMatrix(
@@ -107,113 +402,402 @@ bool GetPoseEstimatorOptions(const RGBDCameraParameters& camera_params,
         kInitialDepthCameraFromWorld);
 
     return true;
-  } else if (FLAGS_pose_estimator == "precomputed" ||
-    FLAGS_pose_estimator == "precomputed_refine_with_depth_icp") {
-    if (FLAGS_pose_estimator == "precomputed") {
+  } else if (job.pose_estimator == "precomputed" ||
+    job.pose_estimator == "precomputed_refine_with_depth_icp") {
+    if (job.pose_estimator == "precomputed") {
       options->method = PoseEstimationMethod::PRECOMPUTED;
     } else {
       options->method =
         PoseEstimationMethod::PRECOMPUTED_REFINE_WITH_DEPTH_ICP;
     }
-    options->precomputed_path = LoadPoseHistory(FLAGS_precomputed_pose,
+    options->precomputed_path = LoadPoseHistory(job.precomputed_pose,
       camera_params.depth_from_color);
-    if (options->precomputed_path.size() == 0) {
+    if (options->precomputed_path.IsEmpty()) {
       fprintf(stderr, "Error: failed to load precomputed poses from %s\n",
-        FLAGS_precomputed_pose.c_str());
+        job.precomputed_pose.c_str());
       return false;
     }
 
     return true;
   } else {
     fprintf(stderr, "Invalid pose estimator: %s.\n",
-      FLAGS_pose_estimator.c_str());
+      job.pose_estimator.c_str());
     return false;
   }
 }
 
-int main(int argc, char* argv[]) {
-  gflags::ParseCommandLineFlags(&argc, &argv, true);
+size_t FreeDeviceMemory() {
+  size_t free_bytes = 0;
+  size_t total_bytes = 0;
+  cudaMemGetInfo(&free_bytes, &total_bytes);
+  return free_bytes;
+}
+
+// Measures how much device memory constructing a pipeline takes, so that
+// RunFusionJobs() can decide whether another job fits.
+class DeviceMemoryBudget {
+ public:
+
+  // Blocks until job may start: either nothing is running, or fewer than
+  // --max_concurrent_jobs are and the GPU can hold another pipeline with
+  // --job_memory_headroom_mb to spare. The caller then runs the job and
+  // calls OnAllocated() once it has constructed its pipeline (or failed)
+  // and OnFinished() at the end.
+  void Admit() {
+    const size_t headroom =
+      static_cast<size_t>(FLAGS_job_memory_headroom_mb) << 20;
+    std::unique_lock<std::mutex> lock(mutex_);
+    condition_.wait(lock, [&] {
+      if (allocating_) {
+        return false;
+      }
+      if (num_running_ == 0) {
+        return true;
+      }
+      if (num_running_ >= FLAGS_max_concurrent_jobs ||
+        bytes_per_job_ == 0) {
+        return false;
+      }
+      // Arrays idle in the pool are free for the next job to reuse.
+      size_t free_bytes = FreeDeviceMemory() +
+        DeviceArrayPool::Get().IdleBytes();
+      return free_bytes >= bytes_per_job_ + headroom;
+    });
+    ++num_running_;
+    allocating_ = true;
+  }
+
+  // bytes is how much free device memory dropped while the pipeline was
+  // constructed. Only one job allocates at a time, so it is not polluted by
+  // other jobs.
+  void OnAllocated(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bytes_per_job_ = std::max(bytes_per_job_, bytes);
+    allocating_ = false;
+    condition_.notify_all();
+  }
+
+  void OnFinished() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --num_running_;
+    condition_.notify_all();
+  }
+
+ private:
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  int num_running_ = 0;
+  // Whether an admitted job has not yet called OnAllocated().
+  bool allocating_ = false;
+  // Largest pipeline allocation seen so far.
+  size_t bytes_per_job_ = 0;
+};
+
+// Calls budget->OnAllocated() exactly once: from Report(), or on destruction
+// if the job returns or throws before it gets there, so that a failed job
+// never stalls Admit() for the others.
+class ScopedAllocationReport {
+ public:
+
+  // budget may be null, in which case nothing is reported.
+  explicit ScopedAllocationReport(DeviceMemoryBudget* budget) :
+    budget_(budget),
+    free_before_(FreeDeviceMemory()) {
+  }
+
+  ScopedAllocationReport(const ScopedAllocationReport& copy) = delete;
+  ScopedAllocationReport& operator=(const ScopedAllocationReport& copy) =
+    delete;
+
+  ~ScopedAllocationReport() {
+    Report();
+  }
+
+  // Starts measuring from the current free device memory.
+  void Restart() {
+    free_before_ = FreeDeviceMemory();
+  }
+
+  void Report() {
+    if (budget_ != nullptr) {
+      size_t free_after = FreeDeviceMemory();
+      budget_->OnAllocated(free_before_ > free_after ?
+        free_before_ - free_after : 0);
+      budget_ = nullptr;
+    }
+  }
+
+ private:
+
+  DeviceMemoryBudget* budget_;
+  size_t free_before_;
+};
+
+// Fuses one recording and writes its outputs. Messages are prefixed with the
+// input filename, since jobs may run concurrently. Calls
+// budget->OnAllocated() (if budget is not null) once the pipeline exists or
+// the job failed (returned or threw) before getting there.
+//
+// Returns the process exit code for this job.
+int RunFusionJob(const FusionJob& job, DeviceMemoryBudget* budget) {
+  const char* name = job.input_rgbd.c_str();
+  ScopedAllocationReport allocation(budget);
 
   // If no outputs, return immediately.
-  if (FLAGS_output_mesh == "" &&
-    FLAGS_output_pose == "" &&
-    FLAGS_output_tsdf3d == "") {
-    fprintf(stderr, "No outputs specified, returning immediately.\n");
+  if (job.output_mesh == "" &&
+    job.output_point_cloud == "" &&
+    job.output_pose == "" &&
+    job.output_tsdf3d == "") {
+    fprintf(stderr, "[%s] No outputs specified, returning immediately.\n",
+      name);
     return 1;
   }
 
   bool ok;
 
   RGBDCameraParameters camera_params;
-  ok = LoadRGBDCameraParameters(FLAGS_calibration_dir, &camera_params);
+  ok = LoadRGBDCameraParameters(job.calibration_dir, &camera_params);
   if (!ok) {
-    fprintf(stderr, "Error loading RGBD camera parameters from %s.\n",
-      FLAGS_calibration_dir.c_str());
+    fprintf(stderr, "[%s] Error loading RGBD camera parameters from %s.\n",
+      name, job.calibration_dir.c_str());
     return 2;
   }
 
   // TODO: validate rgbd input size with camera calibration size.
   // It may not have a color stream.
-  RgbdInput rgbd_input(RgbdInput::InputType::FILE, FLAGS_input_rgbd.c_str());
+  RgbdInput rgbd_input(RgbdInput::InputType::FILE, job.input_rgbd.c_str());
+  rgbd_input.setRawDepth(FLAGS_gpu_depth_conversion);
+  if (job.first_depth_frame > 0 || job.last_depth_frame >= 0) {
+    RgbdFrameIndex frame_index;
+    if (!frame_index.LoadOrBuild(job.input_rgbd)) {
+      fprintf(stderr, "[%s] Error indexing frames.\n", name);
+        return 2;
+    }
+    uint32_t depth_stream_id =
+      static_cast<uint32_t>(rgbd_input.depthStreamId());
+    int first_entry = frame_index.FindFrame(depth_stream_id,
+      job.first_depth_frame);
+    if (job.last_depth_frame >= 0) {
+      rgbd_input.setEndEntry(frame_index.FindFrame(depth_stream_id,
+        job.last_depth_frame + 1));
+    }
+    if (!rgbd_input.seek(first_entry)) {
+      fprintf(stderr, "[%s] Error seeking to depth frame %d.\n",
+        name, job.first_depth_frame);
+        return 2;
+    }
+  }
 
   PoseEstimatorOptions pose_options;
-  ok = GetPoseEstimatorOptions(camera_params, &pose_options);
+  ok = GetPoseEstimatorOptions(job, camera_params, &pose_options);
   if (!ok) {
-    fprintf(stderr, "Failed to parse pose estimator options.");
+    fprintf(stderr, "[%s] Failed to parse pose estimator options.\n", name);
     return 2;
   }
-  fprintf(stderr, "Using pose estimator: %s\n", FLAGS_pose_estimator.c_str());
+  fprintf(stderr, "[%s] Using pose estimator: %s\n", name,
+    job.pose_estimator.c_str());
 
+  // Each pipeline creates its own CUDA streams, so concurrent jobs overlap
+  // on the GPU.
+  allocation.Restart();
   RegularGridFusionPipeline pipeline(camera_params,
     Vector3i(kRegularGridResolution),
-    GetInitialWorldFromGrid(),
+    GetInitialWorldFromGrid(job.pose_estimator),
     pose_options);
+  allocation.Report();
 
-  bool color_updated;
-  bool depth_updated;
-  rgbd_input.read(&(pipeline.GetInputBuffer()),
-                  &color_updated,
-                  &depth_updated);
-  while (color_updated || depth_updated) {
-    if (color_updated) {
+  CaptureThread::Options capture_options;
+  capture_options.policy = FrameQueuePolicy::BLOCK;
+  capture_options.queue_capacity = FLAGS_capture_queue_capacity;
+  capture_options.end_of_input = CaptureThread::EndOfInput::FINISH;
+  capture_options.start_paused = false;
+  // Skip color when the pose estimator does not need it.
+  capture_options.streams = pipeline.UsedInputStreams();
+  CaptureThread capture_thread(&rgbd_input, camera_params.color.resolution,
+    camera_params.depth.resolution, capture_options);
+  while (CaptureThread::Frame* frame = capture_thread.Acquire()) {
+    CopyUpdatedStreams(*frame, &(pipeline.GetInputBuffer()));
+    if (frame->color_updated) {
       pipeline.NotifyColorUpdated();
-    } else if (depth_updated) {
+    } else if (frame->depth_updated) {
       pipeline.NotifyDepthUpdated();
     }
-    rgbd_input.read(&(pipeline.GetInputBuffer()),
-                    &color_updated,
-                    &depth_updated);
+    capture_thread.Release(frame);
   }
+  pipeline.FlushFusionBatch();
 
   // Fusion finished, save outputs.
-  if (FLAGS_output_mesh != "") {
-    TriangleMesh mesh = pipeline.Triangulate();
-    fprintf(stderr, "Saving mesh to %s...", FLAGS_output_mesh.c_str());
-    ok = mesh.saveOBJ(FLAGS_output_mesh);
-    if (ok) {
-      fprintf(stderr, "done.\n");
+  int exit_code = 0;
+  if (job.output_mesh != "") {
+    PLYMeshWriter::Options ply_options;
+    ply_options.quantize_normals = FLAGS_output_mesh_quantize_normals;
+    if (FLAGS_output_mesh_lod > 0) {
+      ok = SaveTriangleMesh(pipeline.TriangulatePreview(FLAGS_output_mesh_lod),
+        job.output_mesh, ply_options);
     } else {
-      fprintf(stderr, "FAILED.\n");
+      ok = pipeline.SaveMesh(job.output_mesh, ply_options);
     }
+    fprintf(stderr, "[%s] %s mesh to %s.\n", name,
+      ok ? "Saved" : "FAILED saving", job.output_mesh.c_str());
+    exit_code = ok ? exit_code : 3;
   }
 
-  if (FLAGS_output_pose != "") {
-    printf("Saving poses to %s...", FLAGS_output_pose.c_str());
-    ok = SavePoseHistory(pipeline.PoseHistory(), FLAGS_output_pose);
-    if (ok) {
-      fprintf(stderr, "done.\n");
-    } else {
-      fprintf(stderr, "FAILED.\n");
-    }
+  if (job.output_point_cloud != "") {
+    PLYMeshWriter::Options ply_options;
+    ply_options.quantize_normals = FLAGS_output_mesh_quantize_normals;
+    ok = pipeline.SavePointCloud(job.output_point_cloud, ply_options);
+    fprintf(stderr, "[%s] %s point cloud to %s.\n", name,
+      ok ? "Saved" : "FAILED saving", job.output_point_cloud.c_str());
+    exit_code = ok ? exit_code : 3;
   }
 
-  if (FLAGS_output_tsdf3d != "") {
-    printf("Saving TSDF volume to %s...", FLAGS_output_tsdf3d.c_str());
-    ok = pipeline.SaveTSDF3D(FLAGS_output_tsdf3d);
-    if (ok) {
-      fprintf(stderr, "done.\n");
-    } else {
-      fprintf(stderr, "FAILED.\n");
+  if (job.output_pose != "") {
+    ok = SavePoseHistory(pipeline.PoseHistory(), job.output_pose);
+    fprintf(stderr, "[%s] %s poses to %s.\n", name,
+      ok ? "Saved" : "FAILED saving", job.output_pose.c_str());
+    exit_code = ok ? exit_code : 3;
+  }
+
+  if (job.output_tsdf3d != "") {
+    ok = pipeline.SaveTSDF3D(job.output_tsdf3d);
+    fprintf(stderr, "[%s] %s TSDF volume to %s.\n", name,
+      ok ? "Saved" : "FAILED saving", job.output_tsdf3d.c_str());
+    exit_code = ok ? exit_code : 3;
+  }
+
+  return exit_code;
+}
+
+// Runs jobs on one GPU, admitting each through a DeviceMemoryBudget. Every
+// job writes its outputs as soon as it finishes. Returns 0 if every job
+// succeeded, else the exit code of the first job that failed.
+int RunFusionJobs(const std::vector<FusionJob>& jobs) {
+  DeviceMemoryBudget budget;
+  std::vector<int> exit_codes(jobs.size(), 0);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    budget.Admit();
+    fprintf(stderr, "Starting job %zu of %zu: %s\n", i + 1, jobs.size(),
+      jobs[i].input_rgbd.c_str());
+    threads.emplace_back([&, i] {
+      try {
+        exit_codes[i] = RunFusionJob(jobs[i], &budget);
+      } catch (const std::exception& e) {
+        fprintf(stderr, "[%s] Error: %s\n", jobs[i].input_rgbd.c_str(),
+          e.what());
+        exit_codes[i] = 4;
+      }
+      budget.OnFinished();
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  int exit_code = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if (exit_codes[i] != 0) {
+      fprintf(stderr, "Job %zu (%s) failed.\n", i + 1,
+        jobs[i].input_rgbd.c_str());
+      if (exit_code == 0) {
+        exit_code = exit_codes[i];
+      }
     }
   }
+  return exit_code;
+}
+
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_tsdf_volume != kRegularGridTSDFVolumeType &&
+    FLAGS_tsdf_volume != kBrickedGridTSDFVolumeType &&
+    FLAGS_tsdf_volume != kVoxelHashedTSDFVolumeType &&
+    FLAGS_tsdf_volume != kPartitionedTSDFVolumeType) {
+    fprintf(stderr, "Invalid tsdf_volume: %s.\n", FLAGS_tsdf_volume.c_str());
+    return 1;
+  }
+  DepthProcessor::Options depth_processor_options;
+  if (!ParseDepthProcessorOptions(FLAGS_depth_smoothing,
+    FLAGS_depth_smoothing_spatial_sigma, FLAGS_depth_smoothing_range_sigma,
+    &depth_processor_options)) {
+    fprintf(stderr, "Invalid depth_smoothing (%s), or a depth_smoothing "
+      "sigma is not positive.\n", FLAGS_depth_smoothing.c_str());
+    return 1;
+  }
+  ICPErrorMetric icp_error_metric;
+  if (!ParseICPErrorMetric(FLAGS_icp_error_metric, &icp_error_metric)) {
+    fprintf(stderr, "Invalid icp_error_metric: %s.\n",
+      FLAGS_icp_error_metric.c_str());
+    return 1;
+  }
+  if (FLAGS_lod_raycast && FLAGS_texture_raycast) {
+    fprintf(stderr, "lod_raycast and texture_raycast are exclusive.\n");
+    return 1;
+  }
+  if (FLAGS_capture_queue_capacity < 1) {
+    fprintf(stderr, "capture_queue_capacity must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_fusion_batch_size < 1) {
+    fprintf(stderr, "fusion_batch_size must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_raycast_reuse_max_rotation_degrees < 0 ||
+    FLAGS_raycast_reuse_max_translation < 0) {
+    fprintf(stderr, "raycast_reuse tolerances must be nonnegative.\n");
+    return 1;
+  }
+  if (FLAGS_aruco_detection_scale <= 0.0 ||
+    FLAGS_aruco_detection_scale > 1.0) {
+    fprintf(stderr, "aruco_detection_scale must be in (0, 1].\n");
+    return 1;
+  }
+  if (FLAGS_output_mesh_lod < 0 || FLAGS_output_mesh_lod > 2) {
+    fprintf(stderr, "output_mesh_lod must be in [0, 2].\n");
+    return 1;
+  }
+  if (FLAGS_max_concurrent_jobs < 1) {
+    fprintf(stderr, "max_concurrent_jobs must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_job_memory_headroom_mb < 0) {
+    fprintf(stderr, "job_memory_headroom_mb must be nonnegative.\n");
+    return 1;
+  }
+  if (FLAGS_device_pool_capacity_mb < 0) {
+    fprintf(stderr, "device_pool_capacity_mb must be nonnegative.\n");
+    return 1;
+  }
+  DeviceArrayPool::Get().SetCapacity(
+    static_cast<size_t>(FLAGS_device_pool_capacity_mb) << 20);
+  if (!FLAGS_launch_config_cache.empty() &&
+    !LaunchTuner::Get().Load(FLAGS_launch_config_cache)) {
+    fprintf(stderr, "Ignoring the rest of %s: it cannot be parsed.\n",
+      FLAGS_launch_config_cache.c_str());
+  }
+  LaunchTuner::Get().SetTuning(FLAGS_autotune_launches);
+
+  std::vector<FusionJob> jobs;
+  if (FLAGS_job_list.empty()) {
+    jobs.push_back(FusionJobFromFlags());
+  } else if (!LoadFusionJobList(FLAGS_job_list, &jobs)) {
+    return 1;
+  }
+
+  if (!FLAGS_trace_out.empty()) {
+    TraceRecorder::Get().Start();
+  }
+
+  int exit_code = (jobs.size() == 1) ?
+    RunFusionJob(jobs[0], nullptr) : RunFusionJobs(jobs);
+
+  PerfCollector::Get().Report(FLAGS_perf_csv, FLAGS_perf_json);
+  if (!FLAGS_trace_out.empty() &&
+    !TraceRecorder::Get().Write(FLAGS_trace_out)) {
+    fprintf(stderr, "Failed to write trace to %s.\n",
+      FLAGS_trace_out.c_str());
+  }
+  return exit_code;
 }
@@ -0,0 +1,32 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FUSION_PIPELINE_OBSERVER_H
+#define FUSION_PIPELINE_OBSERVER_H
+
+#include "pipeline_data_type.h"
+
+// Receives notifications from a RegularGridFusionPipeline, without tying the
+// pipeline to a GUI toolkit. QtPipelineObserver forwards them as a Qt signal.
+class FusionPipelineObserver {
+ public:
+
+  virtual ~FusionPipelineObserver() = default;
+
+  // Data flowing through the pipeline has changed: type is the union of what
+  // changed. Called on the thread that feeds the pipeline, after the frame's
+  // work is enqueued.
+  virtual void OnPipelineDataChanged(PipelineDataType type) = 0;
+};
+
+#endif  // FUSION_PIPELINE_OBSERVER_H
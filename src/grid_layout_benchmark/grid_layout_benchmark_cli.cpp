@@ -0,0 +1,200 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// Compares the throughput of RegularGridTSDF's voxel layouts on a synthetic
+// sphere: every layout is timed on the same Raycast(), Fuse() and
+// Triangulate() workloads.
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include <cuda_runtime.h>
+#include <gflags/gflags.h>
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/common/Array3D.h"
+#include "libcgt/core/geometry/TriangleMesh.h"
+#include "libcgt/core/time/TimeUtils.h"
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Range1f.h"
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+#include "libcgt/core/vecmath/Vector2i.h"
+#include "libcgt/core/vecmath/Vector3f.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+
+#include "../perf_collector.h"
+#include "../regular_grid_tsdf.h"
+#include "../rolling_grid_view.h"
+#include "../tsdf.h"
+
+// With --collect_perf, the per-call stage percentiles are printed after the
+// table.
+DEFINE_bool(collect_perf, false, "Collect performance statistics.");
+
+DEFINE_int32(resolution, 256, "Number of voxels along each axis.");
+DEFINE_double(voxel_size, 0.004, "Side length of one voxel, in meters.");
+DEFINE_int32(iterations, 20, "Number of timed calls per workload.");
+DEFINE_int32(image_width, 640, "Width of the raycast and fused images.");
+DEFINE_int32(image_height, 480, "Height of the raycast and fused images.");
+
+using libcgt::core::time::dtMS;
+using libcgt::core::vecmath::SimilarityTransform;
+
+namespace {
+
+struct LayoutTimings {
+  double raycast_ms = 0;
+  double fuse_ms = 0;
+  double triangulate_ms = 0;
+  int num_triangles = 0;
+};
+
+const char* LayoutName(VoxelLayout layout) {
+  return layout == VoxelLayout::BRICKED ? "bricked" : "linear";
+}
+
+// A sphere of radius 0.35 * side length at the center of the grid, observed
+// everywhere.
+Array3D<TSDF> MakeSphere(const Vector3i& resolution, float max_tsdf_value) {
+  Array3D<TSDF> grid(resolution);
+  const float voxel_size = static_cast<float>(FLAGS_voxel_size);
+  const Vector3f center = 0.5f * voxel_size * Vector3f(resolution);
+  const float radius = 0.35f * voxel_size * resolution.x;
+  for (int z = 0; z < resolution.z; ++z) {
+    for (int y = 0; y < resolution.y; ++y) {
+      for (int x = 0; x < resolution.x; ++x) {
+        Vector3f p = voxel_size * Vector3f(x + 0.5f, y + 0.5f, z + 0.5f);
+        float d = (p - center).norm() - radius;
+        d = std::fmax(-max_tsdf_value, std::fmin(d, max_tsdf_value));
+        grid[{x, y, z}] = TSDF(d, 1.0f, max_tsdf_value);
+      }
+    }
+  }
+  return grid;
+}
+
+// Camera i of n on a circle around the center of the grid, looking at it.
+Matrix4f OrbitCameraFromWorld(const Vector3f& center, float radius, int i,
+  int n) {
+  float theta = 2.0f * static_cast<float>(M_PI) * i / n;
+  Vector3f eye = center +
+    radius * Vector3f(std::cos(theta), 0.25f, std::sin(theta));
+  return Matrix4f::lookAt(eye, center, Vector3f(0, 1, 0));
+}
+
+LayoutTimings Benchmark(VoxelLayout layout, const Array3D<TSDF>& sphere,
+  float max_tsdf_value) {
+  const Vector3i resolution = sphere.size();
+  const float voxel_size = static_cast<float>(FLAGS_voxel_size);
+  const SimilarityTransform world_from_grid(voxel_size);
+  const Vector3f center = 0.5f * voxel_size * Vector3f(resolution);
+  const float orbit_radius = voxel_size * resolution.x;
+
+  const Vector2i image_size{ FLAGS_image_width, FLAGS_image_height };
+  const Vector4f flpp{ 0.8f * image_size.x, 0.8f * image_size.x,
+    0.5f * image_size.x, 0.5f * image_size.y };
+  const Range1f depth_range = Range1f::fromMinMax(0.1f, 2 * orbit_radius);
+
+  RegularGridTSDF tsdf(resolution, world_from_grid, max_tsdf_value, layout);
+  tsdf.Upload(sphere.readView(), world_from_grid, max_tsdf_value);
+
+  DeviceArray2D<float4> world_points(image_size);
+  DeviceArray2D<float4> world_normals(image_size);
+
+  // A fronto-parallel wall at the orbit radius. The cameras are about that
+  // far from the center of the grid, so the wall cuts through the middle of
+  // the grid and the sphere: every pixel is valid and its truncation band
+  // crosses the grid.
+  Array2D<float> wall(image_size);
+  for (int y = 0; y < image_size.y; ++y) {
+    for (int x = 0; x < image_size.x; ++x) {
+      wall[{x, y}] = orbit_radius;
+    }
+  }
+  DeviceArray2D<float> depth(image_size);
+  copy(wall.readView(), depth);
+
+  LayoutTimings timings;
+  const int n = FLAGS_iterations;
+
+  // Warm up.
+  tsdf.Raycast(flpp,
+    Matrix4f::inverseEuclidean(OrbitCameraFromWorld(center, orbit_radius,
+      0, n)),
+    world_points, world_normals);
+  cudaDeviceSynchronize();
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < n; ++i) {
+    tsdf.Raycast(flpp,
+      Matrix4f::inverseEuclidean(OrbitCameraFromWorld(center, orbit_radius,
+        i, n)),
+      world_points, world_normals);
+  }
+  cudaDeviceSynchronize();
+  auto t1 = std::chrono::high_resolution_clock::now();
+  timings.raycast_ms = static_cast<double>(dtMS(t0, t1)) / n;
+
+  t0 = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < n; ++i) {
+    tsdf.Fuse(flpp, depth_range,
+      OrbitCameraFromWorld(center, orbit_radius, i, n), depth);
+  }
+  cudaDeviceSynchronize();
+  t1 = std::chrono::high_resolution_clock::now();
+  timings.fuse_ms = static_cast<double>(dtMS(t0, t1)) / n;
+
+  // Fusing the wall changed the surface: start over from the sphere so that
+  // every layout meshes the same volume.
+  tsdf.Upload(sphere.readView(), world_from_grid, max_tsdf_value);
+  t0 = std::chrono::high_resolution_clock::now();
+  TriangleMesh mesh = tsdf.Triangulate();
+  t1 = std::chrono::high_resolution_clock::now();
+  timings.triangulate_ms = static_cast<double>(dtMS(t0, t1));
+  timings.num_triangles = static_cast<int>(mesh.faces().size());
+
+  return timings;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_resolution <= 0 || FLAGS_iterations <= 0 ||
+    FLAGS_image_width <= 0 || FLAGS_image_height <= 0) {
+    fprintf(stderr, "resolution, iterations and image size must be "
+      "positive.\n");
+    return 1;
+  }
+
+  const Vector3i resolution{ FLAGS_resolution };
+  const float max_tsdf_value = 4.0f * static_cast<float>(FLAGS_voxel_size);
+
+  printf("Building a %d^3 sphere...\n", FLAGS_resolution);
+  Array3D<TSDF> sphere = MakeSphere(resolution, max_tsdf_value);
+
+  printf("%8s %14s %14s %18s %12s\n", "layout", "raycast (ms)", "fuse (ms)",
+    "triangulate (ms)", "triangles");
+  for (VoxelLayout layout : { VoxelLayout::LINEAR, VoxelLayout::BRICKED }) {
+    LayoutTimings t = Benchmark(layout, sphere, max_tsdf_value);
+    printf("%8s %14.3f %14.3f %18.3f %12d\n", LayoutName(layout),
+      t.raycast_ms, t.fuse_ms, t.triangulate_ms, t.num_triangles);
+  }
+
+  PerfCollector::Get().Report("", "");
+
+  return 0;
+}
@@ -14,6 +14,8 @@
 #ifndef ICP_LEAST_SQUARES_DATA_H
 #define ICP_LEAST_SQUARES_DATA_H
 
+#include <vector_types.h>
+
 struct ICPLeastSquaresData {
   // Packed storage for the symmetric covariance matrix.
   float a[21];
@@ -28,6 +30,34 @@ struct ICPLeastSquaresData {
   int num_samples;
 };
 
+// ICP state that stays in device memory across iterations.
+struct ICPSolverState {
+  // The first three rows of the rigid transforms model_from_current and its
+  // inverse, current_from_model.
+  float4 model_from_current[3];
+  float4 current_from_model[3];
+
+  // Statistics from the most recent iteration.
+  int num_samples;
+  float squared_residual;
+
+  // Set when an iteration had too few samples or a singular system. All
+  // later iterations are skipped.
+  int failed;
+
+  // Set when the current pyramid level has converged. The remaining
+  // iterations of the level are skipped. Cleared at the start of each level.
+  int converged;
+
+  // Mean squared residual of the previous iteration at this level, or
+  // negative if there is none.
+  float previous_mean_squared_residual;
+
+  // Number of iterations that ran, over all levels.
+  int num_iterations;
+};
+
+// Host reference solver (QR, via Eigen).
 void Solve(const ICPLeastSquaresData& system, float x[6]);
 
 #endif // ICP_LEAST_SQUARES_DATA_H
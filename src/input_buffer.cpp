@@ -17,6 +17,7 @@ InputBuffer::InputBuffer(const Vector2i& color_resolution,
   const Vector2i& depth_resolution) :
   color_bgr_ydown(color_resolution),
   color_rgb(color_resolution),
-  depth_meters(depth_resolution) {
+  depth_meters(depth_resolution),
+  depth_millimeters_ydown(depth_resolution) {
 
 }
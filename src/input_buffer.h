@@ -14,11 +14,26 @@
 #ifndef INPUT_BUFFER_H
 #define INPUT_BUFFER_H
 
+#include <third_party/bitmask_operators.hpp>
+
 #include "libcgt/core/common/Array2D.h"
 #include "libcgt/core/common/BasicTypes.h"
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 #include "libcgt/core/vecmath/Vector2i.h"
 
+// A set of the streams of an InputBuffer.
+enum class InputStreams {
+  NONE = 0,
+  COLOR = 1,
+  DEPTH = 2,
+  ALL = 3
+};
+
+template<>
+struct enable_bitmask_operators<InputStreams> {
+  static const bool enable = true;
+};
+
 struct InputBuffer {
 
   InputBuffer(const Vector2i& color_resolution,
@@ -36,6 +51,14 @@ struct InputBuffer {
   // These buffers are y-up for processing and GL.
   Array2D<uint8x3> color_rgb;
   Array2D<float> depth_meters; // depth in meters
+
+  // Set when the latest depth frame is in depth_millimeters_ydown instead of
+  // depth_meters (see RgbdInput::setRawDepth()). The pipelines then convert
+  // it to meters on the GPU.
+  bool depth_is_raw = false;
+
+  // Raw sensor depth in millimeters, y-down. 0 means no measurement.
+  Array2D<uint16_t> depth_millimeters_ydown;
 };
 
 #endif  // INPUT_BUFFER_H
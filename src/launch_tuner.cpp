@@ -0,0 +1,238 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "launch_tuner.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
+#include <tuple>
+
+namespace {
+
+// Timed launches per candidate, after one untimed warmup launch.
+const int kNumTimedLaunches = 3;
+
+// Entries are one per line: kernel, problem size, block size, slices per
+// thread and, last because it may contain spaces, the device name.
+const char* kEntryFormat = "%s,%d,%d,%d,%u,%u,%u,%d,%s\n";
+
+}  // namespace
+
+bool LaunchTuner::Key::operator < (const Key& other) const {
+  return std::tie(device, kernel, problem_size.x, problem_size.y,
+    problem_size.z) < std::tie(other.device, other.kernel,
+    other.problem_size.x, other.problem_size.y, other.problem_size.z);
+}
+
+// static
+LaunchTuner& LaunchTuner::Get() {
+  static LaunchTuner tuner;
+  return tuner;
+}
+
+// static
+std::vector<LaunchConfig> LaunchTuner::BlockShapeCandidates() {
+  const int kShapes[][2] = {
+    { 8, 8 }, { 16, 8 }, { 8, 16 }, { 16, 16 }, { 32, 4 }, { 32, 8 },
+    { 64, 4 }, { 32, 16 }
+  };
+  std::vector<LaunchConfig> candidates;
+  for (const auto& shape : kShapes) {
+    LaunchConfig config;
+    config.block_dim = dim3(shape[0], shape[1], 1);
+    candidates.push_back(config);
+  }
+  return candidates;
+}
+
+// static
+std::vector<LaunchConfig> LaunchTuner::ColumnCandidates(int depth) {
+  std::vector<LaunchConfig> candidates;
+  for (int slices_per_thread : { 0, 32, 64, 128 }) {
+    if (slices_per_thread >= depth) {
+      continue;
+    }
+    for (LaunchConfig config : BlockShapeCandidates()) {
+      config.slices_per_thread = slices_per_thread;
+      candidates.push_back(config);
+    }
+  }
+  return candidates;
+}
+
+bool LaunchTuner::Load(const std::string& filename) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  filename_ = filename;
+  FILE* fp = fopen(filename.c_str(), "r");
+  if (fp == nullptr) {
+    return true;
+  }
+
+  bool ok = true;
+  char line[1024];
+  while (fgets(line, sizeof(line), fp) != nullptr) {
+    char kernel[256];
+    char device[256];
+    Key key;
+    LaunchConfig config;
+    if (sscanf(line, "%255[^,],%d,%d,%d,%u,%u,%u,%d,%255[^\n]", kernel,
+      &key.problem_size.x, &key.problem_size.y, &key.problem_size.z,
+      &config.block_dim.x, &config.block_dim.y, &config.block_dim.z,
+      &config.slices_per_thread, device) != 9) {
+      ok = false;
+      break;
+    }
+    key.kernel = kernel;
+    key.device = device;
+    configs_[key] = config;
+  }
+  fclose(fp);
+  return ok;
+}
+
+void LaunchTuner::SetTuning(bool tuning) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  tuning_ = tuning;
+}
+
+bool LaunchTuner::NeedsTuning(const std::string& kernel,
+  const Vector3i& problem_size, cudaStream_t stream) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!tuning_) {
+    return false;
+  }
+  // Tuning synchronizes, which a stream capture does not allow.
+  cudaStreamCaptureStatus status = cudaStreamCaptureStatusNone;
+  cudaStreamIsCapturing(stream, &status);
+  if (status != cudaStreamCaptureStatusNone) {
+    return false;
+  }
+  return configs_.find({ DeviceName(), kernel, problem_size }) ==
+    configs_.end();
+}
+
+LaunchConfig LaunchTuner::Lookup(const std::string& kernel,
+  const Vector3i& problem_size,
+  const std::vector<LaunchConfig>& candidates,
+  const std::function<void(const LaunchConfig&)>& launch,
+  cudaStream_t stream,
+  const std::function<void()>& reset,
+  const LaunchConfig& default_config) {
+  bool tune = NeedsTuning(kernel, problem_size, stream);
+
+  Key key;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    key = { DeviceName(), kernel, problem_size };
+    auto itr = configs_.find(key);
+    if (itr != configs_.end()) {
+      return itr->second;
+    }
+    if (!tune || candidates.empty()) {
+      return default_config;
+    }
+  }
+
+  // Timing waits on the GPU: other threads can look up kernels meanwhile.
+  LaunchConfig best = Tune(candidates, launch, stream, reset);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Another thread may have tuned the same kernel in the meantime.
+  auto inserted = configs_.insert({ key, best });
+  if (!inserted.second) {
+    return inserted.first->second;
+  }
+  SaveLocked(key, best);
+  printf("LaunchTuner: %s at %d x %d x %d on %s: %u x %u x %u blocks, "
+    "%d slices per thread.\n", kernel.c_str(), problem_size.x,
+    problem_size.y, problem_size.z, key.device.c_str(), best.block_dim.x,
+    best.block_dim.y, best.block_dim.z, best.slices_per_thread);
+  return best;
+}
+
+std::string LaunchTuner::DeviceName() {
+  int device = 0;
+  cudaGetDevice(&device);
+  auto itr = device_names_.find(device);
+  if (itr != device_names_.end()) {
+    return itr->second;
+  }
+  cudaDeviceProp properties;
+  cudaGetDeviceProperties(&properties, device);
+  // Commas separate the fields of the cache file.
+  std::string name = properties.name;
+  std::replace(name.begin(), name.end(), ',', ' ');
+  device_names_[device] = name;
+  return name;
+}
+
+LaunchConfig LaunchTuner::Tune(const std::vector<LaunchConfig>& candidates,
+  const std::function<void(const LaunchConfig&)>& launch,
+  cudaStream_t stream, const std::function<void()>& reset) {
+  cudaEvent_t start;
+  cudaEvent_t stop;
+  cudaEventCreate(&start);
+  cudaEventCreate(&stop);
+
+  LaunchConfig best = candidates[0];
+  float best_ms = FLT_MAX;
+  for (const LaunchConfig& config : candidates) {
+    float total_ms = 0.0f;
+    bool ok = true;
+    for (int i = 0; ok && i <= kNumTimedLaunches; ++i) {
+      if (reset) {
+        reset();
+      }
+      cudaEventRecord(start, stream);
+      launch(config);
+      cudaEventRecord(stop, stream);
+      // Shapes the kernel cannot launch with, e.g. for lack of shared
+      // memory, fail here and are skipped.
+      ok = cudaEventSynchronize(stop) == cudaSuccess &&
+        cudaGetLastError() == cudaSuccess;
+      float ms = 0.0f;
+      cudaEventElapsedTime(&ms, start, stop);
+      if (i > 0) {
+        total_ms += ms;
+      }
+    }
+    if (ok && total_ms < best_ms) {
+      best = config;
+      best_ms = total_ms;
+    }
+  }
+  if (reset) {
+    reset();
+  }
+
+  cudaEventDestroy(start);
+  cudaEventDestroy(stop);
+  return best;
+}
+
+void LaunchTuner::SaveLocked(const Key& key, const LaunchConfig& config) {
+  if (filename_.empty()) {
+    return;
+  }
+  FILE* fp = fopen(filename_.c_str(), "a");
+  if (fp == nullptr) {
+    fprintf(stderr, "LaunchTuner: failed to write %s.\n", filename_.c_str());
+    return;
+  }
+  fprintf(fp, kEntryFormat, key.kernel.c_str(), key.problem_size.x,
+    key.problem_size.y, key.problem_size.z, config.block_dim.x,
+    config.block_dim.y, config.block_dim.z, config.slices_per_thread,
+    key.device.c_str());
+  fclose(fp);
+}
@@ -0,0 +1,119 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef LAUNCH_TUNER_H
+#define LAUNCH_TUNER_H
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cuda_runtime.h>
+
+#include "libcgt/core/vecmath/Vector3i.h"
+
+// How a kernel over a 2D grid of threads is launched.
+struct LaunchConfig {
+  dim3 block_dim = dim3(16, 16, 1);
+  // For kernels that sweep voxel columns: the number of slices each thread
+  // visits, with one block per chunk of slices along grid z. 0 means whole
+  // columns.
+  int slices_per_thread = 0;
+};
+
+// Picks launch configurations per kernel, problem size and device.
+//
+// Lookup() returns the configuration that was fastest for a kernel when it
+// was last tuned on a device with the same name, or the kernel's default.
+// When tuning is on (see SetTuning()), a kernel that has never been tuned for
+// its problem size is timed once with each of its candidate configurations,
+// and the winner is kept and appended to the cache file given to Load().
+//
+// All methods are thread safe.
+class LaunchTuner {
+ public:
+
+  // The tuner every launch site consults.
+  static LaunchTuner& Get();
+
+  LaunchTuner(const LaunchTuner& copy) = delete;
+  LaunchTuner& operator = (const LaunchTuner& copy) = delete;
+
+  // Block shapes from 64 to 512 threads, for kernels with one thread per
+  // pixel or voxel column.
+  static std::vector<LaunchConfig> BlockShapeCandidates();
+
+  // BlockShapeCandidates(), each also splitting columns of depth slices into
+  // chunks of several sizes.
+  static std::vector<LaunchConfig> ColumnCandidates(int depth);
+
+  // Reads the configurations cached in filename, if it exists, and saves
+  // newly tuned ones there. Returns false if the file exists but cannot be
+  // parsed.
+  bool Load(const std::string& filename);
+
+  // Whether Lookup() times candidates for kernels that are not cached yet.
+  void SetTuning(bool tuning);
+
+  // Whether Lookup(kernel, problem_size, ...) on stream would time
+  // candidates: tuning is on, nothing is cached for the current device, and
+  // stream is not being captured into a graph.
+  bool NeedsTuning(const std::string& kernel, const Vector3i& problem_size,
+    cudaStream_t stream);
+
+  // Returns the configuration for kernel at problem_size on the current
+  // device. If NeedsTuning(), first enqueues launch(c) on stream a few times
+  // for each of candidates, waits for them and keeps the fastest. reset, if
+  // set, is enqueued before each of those launches and not timed: kernels
+  // that update their output in place use it to restore it.
+  LaunchConfig Lookup(const std::string& kernel, const Vector3i& problem_size,
+    const std::vector<LaunchConfig>& candidates,
+    const std::function<void(const LaunchConfig&)>& launch,
+    cudaStream_t stream,
+    const std::function<void()>& reset = nullptr,
+    const LaunchConfig& default_config = LaunchConfig());
+
+ private:
+
+  struct Key {
+    std::string device;
+    std::string kernel;
+    Vector3i problem_size;
+
+    bool operator < (const Key& other) const;
+  };
+
+  LaunchTuner() = default;
+
+  // The name of the current device.
+  std::string DeviceName();
+
+  // Called without mutex_ held.
+  LaunchConfig Tune(const std::vector<LaunchConfig>& candidates,
+    const std::function<void(const LaunchConfig&)>& launch,
+    cudaStream_t stream, const std::function<void()>& reset);
+
+  // Appends an entry to filename_. Requires mutex_ to be held.
+  void SaveLocked(const Key& key, const LaunchConfig& config);
+
+  std::mutex mutex_;
+  bool tuning_ = false;
+  std::string filename_;
+  std::map<Key, LaunchConfig> configs_;
+  // Per device.
+  std::map<int, std::string> device_names_;
+};
+
+#endif  // LAUNCH_TUNER_H
@@ -13,6 +13,8 @@
 // limitations under the License.
 #include "main_controller.h"
 
+#include <mutex>
+
 #include <gflags/gflags.h>
 #include <QMessageBox>
 #include <QTimer>
@@ -23,11 +25,16 @@
 
 #include "control_widget.h"
 #include "main_widget.h"
+#include "ply_mesh_writer.h"
 #include "pose_utils.h"
+#include "qt_pipeline_observer.h"
 #include "rgbd_input.h"
 
 DECLARE_string(mode);
 DECLARE_string(sm_input_type);
+DECLARE_bool(threaded_capture);
+DECLARE_string(capture_queue_policy);
+DECLARE_int32(capture_queue_capacity);
 
 namespace {
   constexpr int kTimestampFieldWidth = 20;
@@ -47,16 +54,71 @@ MainController::MainController(
   QObject::connect(control_widget, &ControlWidget::pauseClicked,
     this, &MainController::OnPauseClicked);
   QObject::connect(control_widget, &ControlWidget::stepClicked,
-    this, &MainController::OnReadInput);
+    this, &MainController::OnStepClicked);
   QObject::connect(control_widget, &ControlWidget::resetClicked,
     this, &MainController::OnResetClicked);
   QObject::connect(control_widget, &ControlWidget::saveMeshClicked,
     this, &MainController::OnSaveMeshClicked);
   QObject::connect(control_widget, &ControlWidget::savePoseClicked,
     this, &MainController::OnSavePoseClicked);
-  QObject::connect(pipeline, &RegularGridFusionPipeline::dataChanged,
+
+  // The pipeline may notify from the processing thread. Deliver to the GUI
+  // thread in any case, so that the GL state is only touched there.
+  qRegisterMetaType<PipelineDataType>("PipelineDataType");
+  pipeline_observer_ = new QtPipelineObserver(this);
+  QObject::connect(pipeline_observer_, &QtPipelineObserver::dataChanged,
     main_widget_->GetSingleMovingCameraGLState(),
-    &SingleMovingCameraGLState::OnPipelineDataChanged);
+    &SingleMovingCameraGLState::OnPipelineDataChanged,
+    Qt::QueuedConnection);
+  if (pipeline_ != nullptr) {
+    pipeline_->AddObserver(pipeline_observer_);
+  }
+
+  if (FLAGS_threaded_capture && input_ != nullptr && pipeline_ != nullptr) {
+    const RGBDCameraParameters& camera_params =
+      pipeline_->GetCameraParameters();
+    bool is_file = FLAGS_sm_input_type == "file";
+    CaptureThread::Options options;
+    // Live sensors keep latency bounded, files process every frame.
+    options.policy = is_file ?
+      FrameQueuePolicy::BLOCK : FrameQueuePolicy::DROP_OLDEST;
+    if (!FLAGS_capture_queue_policy.empty()) {
+      ParseFrameQueuePolicy(FLAGS_capture_queue_policy, &options.policy);
+    }
+    options.queue_capacity = FLAGS_capture_queue_capacity;
+    options.end_of_input = is_file ?
+      CaptureThread::EndOfInput::PAUSE : CaptureThread::EndOfInput::CONTINUE;
+    capture_thread_ = std::make_unique<CaptureThread>(input_,
+      camera_params.color.resolution, camera_params.depth.resolution,
+      options);
+    processing_thread_ = std::thread(&MainController::ProcessFrames, this);
+  }
+}
+
+MainController::~MainController() {
+  if (capture_thread_ != nullptr) {
+    capture_thread_->Stop();
+    processing_thread_.join();
+  }
+  if (pipeline_ != nullptr) {
+    pipeline_->RemoveObserver(pipeline_observer_);
+  }
+}
+
+void MainController::ProcessFrames() {
+  while (CaptureThread::Frame* frame = capture_thread_->Acquire()) {
+    {
+      std::lock_guard<std::mutex> lock(pipeline_->VisualizationMutex());
+      CopyUpdatedStreams(*frame, &(pipeline_->GetInputBuffer()));
+      // Like OnReadInput(), color takes precedence.
+      if (frame->color_updated) {
+        pipeline_->NotifyColorUpdated();
+      } else if (frame->depth_updated) {
+        pipeline_->NotifyDepthUpdated();
+      }
+    }
+    capture_thread_->Release(frame);
+  }
 }
 
 void MainController::OnReadInput() {
@@ -79,6 +141,9 @@ void MainController::OnReadInput() {
       read_input_timer_->stop();
     }
   } else if (FLAGS_mode == "multi_static") {
+    MultiStaticCameraGLState* gl_state =
+      main_widget_->GetMultiStaticCameraGLState();
+    bool any_updated = false;
     for (int i = 0; i < static_cast<int>(inputs_.size()); ++i) {
       bool color_updated;
       bool depth_updated;
@@ -86,48 +151,64 @@ void MainController::OnReadInput() {
         &color_updated, &depth_updated);
       if (color_updated || depth_updated) {
         msc_pipeline_->NotifyInputUpdated(i, color_updated, depth_updated);
+        any_updated = true;
       } else if (FLAGS_sm_input_type == "file") {
         read_input_timer_->stop();
       }
     }
+    if (any_updated) {
+      gl_state->NotifyInputUpdated();
+    }
 
-    //if(depth_updated) {
-    {
-      // TODO: pipeline should emit that TSDF has changed.
-      msc_pipeline_->Reset();
-      msc_pipeline_->FuseMultiple();
-      main_widget_->GetMultiStaticCameraGLState()->NotifyTSDFUpdated();
+    if (msc_pipeline_->FuseMultiple()) {
+      gl_state->NotifyTSDFUpdated();
     }
 
-    //if(rgb_updated || depth_updated) {
-    {
+    // Camera moves repaint on their own (see MainWidget).
+    if (any_updated) {
       main_widget_->update();
     }
   }
 }
 
 void MainController::OnPauseClicked() {
-  if (read_input_timer_->isActive()) {
+  if (capture_thread_ != nullptr) {
+    capture_thread_->SetPaused(!capture_thread_->IsPaused());
+  } else if (read_input_timer_->isActive()) {
     read_input_timer_->stop();
   } else {
     read_input_timer_->start();
   }
 }
 
+void MainController::OnStepClicked() {
+  if (capture_thread_ != nullptr) {
+    capture_thread_->Step();
+  } else {
+    OnReadInput();
+  }
+}
+
 void MainController::OnResetClicked() {
   // TODO: reset rgbd and pose streams.
   if (pipeline_ != nullptr) {
+    std::lock_guard<std::mutex> lock(pipeline_->VisualizationMutex());
     pipeline_->Reset();
   }
   if (msc_pipeline_ != nullptr) {
     msc_pipeline_->Reset();
+    main_widget_->GetMultiStaticCameraGLState()->NotifyTSDFUpdated();
+    main_widget_->update();
   }
 }
 
 void MainController::OnSaveMeshClicked(QString filename) {
   if (FLAGS_mode == "single_moving") {
-    TriangleMesh mesh = pipeline_->Triangulate();
-    bool succeeded = mesh.saveOBJ(filename.toStdString());
+    // .ply meshes are streamed from the volume, which must not change until
+    // they are written.
+    std::unique_lock<std::mutex> lock(pipeline_->VisualizationMutex());
+    bool succeeded = pipeline_->SaveMesh(filename.toStdString());
+    lock.unlock();
     if (!succeeded) {
       QMessageBox::critical(main_widget_, "Save Mesh Status",
         "Failed to save to: " + filename);
@@ -136,7 +217,7 @@ void MainController::OnSaveMeshClicked(QString filename) {
     // HACK: rot180
     Matrix4f rot180 = Matrix4f::rotateX(static_cast<float>(M_PI));
     TriangleMesh mesh = msc_pipeline_->Triangulate(rot180);
-    bool succeeded = mesh.saveOBJ(filename.toStdString());
+    bool succeeded = SaveTriangleMesh(mesh, filename.toStdString());
     if (!succeeded) {
       QMessageBox::critical(main_widget_, "Save Mesh Status",
         "Failed to save to: " + filename);
@@ -147,8 +228,10 @@ void MainController::OnSaveMeshClicked(QString filename) {
 void MainController::OnSavePoseClicked(QString filename) {
   if (filename != "") {
     printf("Saving pose stream to %s...", filename.toStdString().c_str());
-    bool succeeded = SavePoseHistory(
-      pipeline_->PoseHistory(), filename.toStdString());
+    std::unique_lock<std::mutex> lock(pipeline_->VisualizationMutex());
+    std::vector<PoseFrame> pose_history = pipeline_->PoseHistory();
+    lock.unlock();
+    bool succeeded = SavePoseHistory(pose_history, filename.toStdString());
     if (succeeded) {
       printf("succeeded.\n");
     } else {
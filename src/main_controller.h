@@ -14,14 +14,19 @@
 #ifndef MAIN_CONTROLLER_H
 #define MAIN_CONTROLLER_H
 
+#include <memory>
+#include <thread>
+
 #include <QObject>
 #include <QString>
 
+#include "capture_thread.h"
 #include "regular_grid_fusion_pipeline.h"
 #include "multi_static_camera_pipeline.h"
 
 class ControlWidget;
 class MainWidget;
+class QtPipelineObserver;
 class QTimer;
 class RgbdInput;
 
@@ -33,6 +38,8 @@ class MainController : public QObject {
 
    MainController(RgbdInput* input, RegularGridFusionPipeline* pipeline,
      ControlWidget* control_widget, MainWidget* main_widget);
+   // Stops the capture and processing threads.
+   ~MainController();
 
    // HACK
    std::vector<RgbdInput> inputs_;
@@ -41,6 +48,7 @@ class MainController : public QObject {
  public slots:
 
   void OnPauseClicked();
+  void OnStepClicked();
   void OnResetClicked();
   void OnSaveMeshClicked(QString filename);
   void OnSavePoseClicked(QString filename);
@@ -51,6 +59,10 @@ class MainController : public QObject {
 
  private:
 
+  // With --threaded_capture, runs on processing_thread_: feeds the frames
+  // read by capture_thread_ to the pipeline until capture stops.
+  void ProcessFrames();
+
   // Data.
   RgbdInput* input_ = nullptr;
   RegularGridFusionPipeline* pipeline_ = nullptr;
@@ -60,6 +72,14 @@ class MainController : public QObject {
   MainWidget* main_widget_ = nullptr;
 
   QTimer* read_input_timer_ = nullptr;
+
+  // Forwards the pipeline's notifications to the GL state.
+  QtPipelineObserver* pipeline_observer_ = nullptr;
+
+  // With --threaded_capture (single moving mode only), these replace
+  // read_input_timer_.
+  std::unique_ptr<CaptureThread> capture_thread_;
+  std::thread processing_thread_;
 };
 
 #endif  // MAIN_CONTROLLER_H
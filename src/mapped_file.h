@@ -0,0 +1,56 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A read-only memory mapping of an entire file. Pages are read on demand by
+// the OS, so only the parts being accessed occupy host memory.
+class MappedFile {
+ public:
+
+  MappedFile() = default;
+  ~MappedFile();
+
+  MappedFile(const MappedFile& copy) = delete;
+  MappedFile& operator = (const MappedFile& copy) = delete;
+
+  // Maps filename, unmapping any previous file first. Hints the OS that the
+  // file will be read sequentially. Returns false if the file cannot be
+  // opened or mapped (or is empty).
+  bool Open(const std::string& filename);
+
+  void Close();
+
+  bool IsOpen() const;
+
+  // The file's bytes, or nullptr if not open.
+  const uint8_t* Data() const;
+
+  size_t Size() const;
+
+ private:
+
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  void* file_ = nullptr;
+  void* mapping_ = nullptr;
+#endif
+};
+
+#endif  // MAPPED_FILE_H
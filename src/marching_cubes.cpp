@@ -13,10 +13,17 @@
 // limitations under the License.
 #include "marching_cubes.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <thread>
 #include <unordered_map>
 
 #include "libcgt/core/common/ArrayUtils.h"
 
+#include "ply_mesh_writer.h"
+
 using libcgt::core::arrayutils::readViewOf;
 using libcgt::core::vecmath::SimilarityTransform;
 using std::vector;
@@ -391,13 +398,13 @@ Vector3f VertexInterp(float iso_level,
   return left + t * (right - left);
 }
 
-void PolygonalizeCell(Vector3f grid_positions[8], Vector3f grid_normals[8],
+// Computes the cube index of a cell and interpolates the position and normal
+// on every edge cut by the isosurface. Returns the cube index, or -1 if the
+// cell is entirely in or out of the surface.
+int InterpolateCellEdges(Vector3f grid_positions[8], Vector3f grid_normals[8],
   float grid_vals[8], float iso_level,
-  vector<Vector3f>& triangle_list_positions_out,
-  vector<Vector3f>& triangle_list_normals_out) {
+  Vector3f position_list[12], Vector3f normal_list[12]) {
   int cubeindex = 0;
-  Vector3f position_list[12];
-  Vector3f normal_list[12];
 
   // Determine the index into the edge table which tells us which vertices are
   // inside of the surface.
@@ -428,7 +435,7 @@ void PolygonalizeCell(Vector3f grid_positions[8], Vector3f grid_normals[8],
 
   // Cube is entirely in/out of the surface.
   if (kEdgeTable[cubeindex] == 0) {
-    return;
+    return -1;
   }
 
   // TODO(jiawen): just compute alpha separately
@@ -507,6 +514,21 @@ void PolygonalizeCell(Vector3f grid_positions[8], Vector3f grid_normals[8],
       grid_normals[3], grid_normals[7], grid_vals[3], grid_vals[7]);
   }
 
+  return cubeindex;
+}
+
+void PolygonalizeCell(Vector3f grid_positions[8], Vector3f grid_normals[8],
+  float grid_vals[8], float iso_level,
+  vector<Vector3f>& triangle_list_positions_out,
+  vector<Vector3f>& triangle_list_normals_out) {
+  Vector3f position_list[12];
+  Vector3f normal_list[12];
+  int cubeindex = InterpolateCellEdges(grid_positions, grid_normals,
+    grid_vals, iso_level, position_list, normal_list);
+  if (cubeindex < 0) {
+    return;
+  }
+
   // Create the triangle.
   for (int i = 0; kTriangleTable[cubeindex][i] != -1; i += 3) {
     triangle_list_positions_out.push_back(
@@ -525,14 +547,117 @@ void PolygonalizeCell(Vector3f grid_positions[8], Vector3f grid_normals[8],
   }
 }
 
+namespace {
+
+constexpr float kIsoLevel = 0.0f;
+
+// Gathers the corner positions (in grid coordinates), normals and distances
+// of the cell whose minimum corner is at (x, y, z), in the order used by the
+// lookup tables. Reads samples up to (x + 2, y + 2, z + 2) to estimate
+// normals. Returns false if any of them is unobserved or if a normal is
+// degenerate.
+bool GatherCell(Array3DReadView<TSDF> grid, int x, int y, int z,
+  float max_tsdf_value,
+  Vector3f positions[8], Vector3f normals[8], float distances[8]) {
+  const float min_sdf_diff = 1e-3f;
+
+  Vector3f normals3D[2][2][2];
+  for (int k = 0; k < 2; ++k) {
+    for (int j = 0; j < 2; ++j) {
+      for (int i = 0; i < 2; ++i) {
+        TSDF t_000 = grid[{x + i    , y + j    , z + k    }];
+        TSDF t_100 = grid[{x + i + 1, y + j    , z + k    }];
+        TSDF t_010 = grid[{x + i    , y + j + 1, z + k    }];
+        TSDF t_001 = grid[{x + i    , y + j    , z + k + 1}];
+        if (t_000.Weight() == 0 || t_100.Weight() == 0 ||
+          t_010.Weight() == 0 || t_001.Weight() == 0) {
+          return false;
+        }
+        float d_000 = t_000.Distance(max_tsdf_value);
+        Vector3f normal = {
+          t_100.Distance(max_tsdf_value) - d_000,
+          t_010.Distance(max_tsdf_value) - d_000,
+          t_001.Distance(max_tsdf_value) - d_000
+        };
+        if (normal.norm() < min_sdf_diff) {
+          return false;
+        }
+        normals3D[k][j][i] = normal.normalized();
+      }
+    }
+  }
+
+  // TODO(jiawen): make a lookup table for this indexing scheme.
+  positions[0] = Vector3f(x, y, z);
+  positions[1] = Vector3f(x + 1, y, z);
+  positions[2] = Vector3f(x + 1, y, z + 1);
+  positions[3] = Vector3f(x, y, z + 1);
+  positions[4] = Vector3f(x, y + 1, z);
+  positions[5] = Vector3f(x + 1, y + 1, z);
+  positions[6] = Vector3f(x + 1, y + 1, z + 1);
+  positions[7] = Vector3f(x, y + 1, z + 1);
+
+  normals[0] = normals3D[0][0][0];
+  normals[1] = normals3D[0][0][1];
+  normals[2] = normals3D[1][0][1];
+  normals[3] = normals3D[1][0][0];
+  normals[4] = normals3D[0][1][0];
+  normals[5] = normals3D[0][1][1];
+  normals[6] = normals3D[1][1][1];
+  normals[7] = normals3D[1][1][0];
+
+  distances[0] = grid[{ x, y, z }].Distance(max_tsdf_value);
+  distances[1] = grid[{ x + 1, y, z }].Distance(max_tsdf_value);
+  distances[2] = grid[{ x + 1, y, z + 1 }].Distance(max_tsdf_value);
+  distances[3] = grid[{ x, y, z + 1 }].Distance(max_tsdf_value);
+  distances[4] = grid[{ x, y + 1, z }].Distance(max_tsdf_value);
+  distances[5] = grid[{ x + 1, y + 1, z }].Distance(max_tsdf_value);
+  distances[6] = grid[{ x + 1, y + 1, z + 1 }].Distance(max_tsdf_value);
+  distances[7] = grid[{ x, y + 1, z + 1 }].Distance(max_tsdf_value);
+
+  return true;
+}
+
+// Polygonalizes the cell whose minimum corner is at (x, y, z) and appends its
+// triangles, in world coordinates, to the output lists. grid_origin is added
+// to the cell's corners before interpolation.
+void MarchCell(Array3DReadView<TSDF> grid, int x, int y, int z,
+  const Vector3f& grid_origin,
+  float max_tsdf_value, const SimilarityTransform& world_from_grid,
+  vector<Vector3f>& positions_list_out,
+  vector<Vector3f>& normals_list_out) {
+  Vector3f positions[8];
+  Vector3f normals[8];
+  float distances[8];
+  if (!GatherCell(grid, x, y, z, max_tsdf_value,
+    positions, normals, distances)) {
+    return;
+  }
+  for (int i = 0; i < 8; ++i) {
+    positions[i] = positions[i] + grid_origin;
+  }
+
+  size_t new_positions_start_index = positions_list_out.size();
+  PolygonalizeCell(positions, normals, distances, kIsoLevel,
+    positions_list_out, normals_list_out);
+  size_t new_positions_end_index = positions_list_out.size();
+  for (size_t i = new_positions_start_index;
+    i < new_positions_end_index; ++i) {
+    positions_list_out[i] =
+      transformPoint(world_from_grid, positions_list_out[i]);
+    normals_list_out[i] =
+      transformVector(world_from_grid, normals_list_out[i]).normalized();
+  }
+}
+
+}  // namespace
+
 // TODO(jiawen): do a version without normals
 // TODO(jiawen): cull voxels with weight < eps.
 void MarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
   const SimilarityTransform& world_from_grid,
   vector<Vector3f>& positions_list_out,
   vector<Vector3f>& normals_list_out) {
-  const float iso_level = 0.0f;
-  const float min_sdf_diff = 1e-3f;
   positions_list_out.clear();
   normals_list_out.clear();
 
@@ -543,86 +668,8 @@ void MarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
       positions_list_out.size(), normals_list_out.size());
     for (int y = 0; y < grid.height() - 2; ++y) {
       for (int x = 0; x < grid.width() - 2; ++x) {
-        Vector3f positions[8];
-        Vector3f normals[8];
-        TSDF tsdfs[8];
-        float distances[8];
-
-        Array3D<Vector3f> normals3D({ 2, 2, 2 });
-
-        bool all_valid = true;
-        for (int k = 0; k < 2; ++k) {
-          for (int j = 0; j < 2; ++j) {
-            for (int i = 0; i < 2; ++i) {
-              TSDF t_000 = grid[{x + i    , y + j    , z + k    }];
-              TSDF t_100 = grid[{x + i + 1, y + j    , z + k    }];
-              TSDF t_010 = grid[{x + i    , y + j + 1, z + k    }];
-              TSDF t_001 = grid[{x + i    , y + j    , z + k + 1}];
-              if (t_000.Weight() == 0 || t_100.Weight() == 0 ||
-                t_010.Weight() == 0 || t_001.Weight() == 0) {
-                all_valid = false;
-                break;
-              }
-              float d_000 = t_000.Distance(max_tsdf_value);
-              Vector3f normal = {
-                t_100.Distance(max_tsdf_value) - d_000,
-                t_010.Distance(max_tsdf_value) - d_000,
-                t_001.Distance(max_tsdf_value) - d_000
-              };
-              if (normal.norm() < min_sdf_diff) {
-                all_valid = false;
-                break;
-              }
-              normals3D[{i, j, k}] = normal.normalized();
-            }
-          }
-        }
-
-        // TODO(jiawen): make a lookup table for this indexing scheme.
-        if (all_valid) {
-          positions[0] = Vector3f(x, y, z);
-          positions[1] = Vector3f(x + 1, y, z);
-          positions[2] = Vector3f(x + 1, y, z + 1);
-          positions[3] = Vector3f(x, y, z + 1);
-          positions[4] = Vector3f(x, y + 1, z);
-          positions[5] = Vector3f(x + 1, y + 1, z);
-          positions[6] = Vector3f(x + 1, y + 1, z + 1);
-          positions[7] = Vector3f(x, y + 1, z + 1);
-
-          normals[0] = normals3D[{0, 0, 0}];
-          normals[1] = normals3D[{1, 0, 0}];
-          normals[2] = normals3D[{1, 0, 1}];
-          normals[3] = normals3D[{0, 0, 1}];
-          normals[4] = normals3D[{0, 1, 0}];
-          normals[5] = normals3D[{1, 1, 0}];
-          normals[6] = normals3D[{1, 1, 1}];
-          normals[7] = normals3D[{0, 1, 1}];
-
-          tsdfs[0] = grid[{ x, y, z }];
-          tsdfs[1] = grid[{ x + 1, y, z }];
-          tsdfs[2] = grid[{ x + 1, y, z + 1 }];
-          tsdfs[3] = grid[{ x, y, z + 1 }];
-          tsdfs[4] = grid[{ x, y + 1, z }];
-          tsdfs[5] = grid[{ x + 1, y + 1, z }];
-          tsdfs[6] = grid[{ x + 1, y + 1, z + 1 }];
-          tsdfs[7] = grid[{ x, y + 1, z + 1 }];
-
-          for (int i = 0; i < 8; ++i) {
-            distances[i] = tsdfs[i].Distance(max_tsdf_value);
-          }
-
-          size_t new_positions_start_index = positions_list_out.size();
-          PolygonalizeCell(positions, normals, distances, iso_level,
-            positions_list_out, normals_list_out);
-          size_t new_positions_end_index = positions_list_out.size();
-          for (size_t i = new_positions_start_index;
-            i < new_positions_end_index; ++i) {
-            positions_list_out[i] =
-              transformPoint(world_from_grid, positions_list_out[i]);
-            normals_list_out[i] =
-              transformVector(world_from_grid, normals_list_out[i]).normalized();
-          }
-        }
+        MarchCell(grid, x, y, z, Vector3f(0, 0, 0), max_tsdf_value,
+          world_from_grid, positions_list_out, normals_list_out);
       }
     }
   }
@@ -631,6 +678,37 @@ void MarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
     positions_list_out.size(), normals_list_out.size());
 }
 
+void AppendMarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
+  const SimilarityTransform& world_from_grid,
+  vector<Vector3f>& positions_list_out,
+  vector<Vector3f>& normals_list_out) {
+  for (int z = 0; z < grid.depth() - 2; ++z) {
+    for (int y = 0; y < grid.height() - 2; ++y) {
+      for (int x = 0; x < grid.width() - 2; ++x) {
+        MarchCell(grid, x, y, z, Vector3f(0, 0, 0), max_tsdf_value,
+          world_from_grid, positions_list_out, normals_list_out);
+      }
+    }
+  }
+}
+
+void AppendMarchingCubes(Array3DReadView<TSDF> grid,
+  const Vector3i& grid_origin, float max_tsdf_value,
+  const SimilarityTransform& world_from_grid,
+  vector<Vector3f>& positions_list_out,
+  vector<Vector3f>& normals_list_out) {
+  Vector3f origin(static_cast<float>(grid_origin.x),
+    static_cast<float>(grid_origin.y), static_cast<float>(grid_origin.z));
+  for (int z = 0; z < grid.depth() - 2; ++z) {
+    for (int y = 0; y < grid.height() - 2; ++y) {
+      for (int x = 0; x < grid.width() - 2; ++x) {
+        MarchCell(grid, x, y, z, origin, max_tsdf_value, world_from_grid,
+          positions_list_out, normals_list_out);
+      }
+    }
+  }
+}
+
 struct Vector3fHash {
   std::size_t operator()(const Vector3f& v) const {
     return ((std::hash<float>()(v.x)
@@ -710,3 +788,398 @@ TriangleMesh ConstructMarchingCubesMesh(
   return TriangleMesh(
     readViewOf(positions), readViewOf(normals), readViewOf(faces));
 }
+
+namespace {
+
+// The two corners joined by each cell edge, in the order used by the lookup
+// tables.
+const int kEdgeCorners[12][2] = {
+  { 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 0 },
+  { 4, 5 }, { 5, 6 }, { 6, 7 }, { 7, 4 },
+  { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 }
+};
+
+// Vertices are identified by what they lie on. Slots 0-2 are the +x, +y and
+// +z edges leaving a grid sample, and slot 3 is the sample itself, for when
+// interpolation lands exactly on it. Keys are unique within one z layer.
+constexpr int kNumVertexSlots = 4;
+constexpr int kSampleSlot = 3;
+
+// Returns the slot of the vertex at position, which lies on the edge from grid
+// sample a to grid sample b, and writes the sample that owns it.
+//
+// Positions on a given edge are computed by ConsistentVertexInterp(), so
+// they do not depend on which cell produced them. Two different edges can
+// only share a position at a grid sample. Keying on the sample in that case
+// welds exactly the vertices that ConstructMarchingCubesMesh() welds.
+int VertexSlot(const Vector3f& a, const Vector3f& b,
+  const Vector3f& position, Vector3f* owner) {
+  if (position.x == a.x && position.y == a.y && position.z == a.z) {
+    *owner = a;
+    return kSampleSlot;
+  } else if (position.x == b.x && position.y == b.y && position.z == b.z) {
+    *owner = b;
+    return kSampleSlot;
+  }
+  *owner = LexigraphicLess(a, b) ? a : b;
+  return (a.x != b.x) ? 0 : ((a.y != b.y) ? 1 : 2);
+}
+
+// Returns the z layer of the vertex at position (as in VertexSlot()) and
+// writes its key within that layer.
+int VertexLayerAndKey(const Vector3f& a, const Vector3f& b,
+  const Vector3f& position, int width, int* key) {
+  Vector3f owner;
+  int slot = VertexSlot(a, b, position, &owner);
+  *key = kNumVertexSlots *
+    (static_cast<int>(owner.x) + width * static_cast<int>(owner.y)) + slot;
+  return static_cast<int>(owner.z);
+}
+
+// Bits of each sample coordinate in a key of EdgeKeyedMarchingCubes().
+constexpr int kEdgeKeyBitsPerAxis = 20;
+
+// The mesh of cells with z in [z_begin, z_end), with vertices numbered in
+// order of first use.
+struct MarchingCubesSlab {
+  int z_begin;
+  int z_end;
+
+  vector<Vector3f> positions;
+  vector<Vector3f> normals;
+  // The z layer and in-layer key of each vertex.
+  vector<int> layers;
+  vector<int> keys;
+
+  vector<Vector3i> faces;
+};
+
+// Meshes one slab. grid holds the slices of the whole grid starting at
+// grid_z_origin, and the slab's z_begin and z_end are in the whole grid.
+// layer_ids is scratch space that holds the vertex ids of the two z layers
+// touched by the current slice of cells. It is reused across slabs so that
+// meshing does not allocate per cell or per slice.
+void MeshSlab(Array3DReadView<TSDF> grid, int grid_z_origin,
+  float max_tsdf_value, const SimilarityTransform& world_from_grid,
+  vector<int> layer_ids[2], MarchingCubesSlab& slab) {
+  const int width = grid.width();
+  const size_t layer_size =
+    static_cast<size_t>(kNumVertexSlots) * width * grid.height();
+  layer_ids[0].assign(layer_size, -1);
+  layer_ids[1].assign(layer_size, -1);
+
+  Vector3f positions[8];
+  Vector3f normals[8];
+  float distances[8];
+  Vector3f position_list[12];
+  Vector3f normal_list[12];
+
+  for (int z = slab.z_begin; z < slab.z_end; ++z) {
+    // Cells in slice z use layers z and z + 1: recycle layer z - 1 for z + 1.
+    if (z > slab.z_begin) {
+      std::fill(layer_ids[(z + 1) & 1].begin(), layer_ids[(z + 1) & 1].end(),
+        -1);
+    }
+
+    for (int y = 0; y < grid.height() - 2; ++y) {
+      for (int x = 0; x < width - 2; ++x) {
+        if (!GatherCell(grid, x, y, z - grid_z_origin, max_tsdf_value,
+          positions, normals, distances)) {
+          continue;
+        }
+        for (int i = 0; i < 8; ++i) {
+          positions[i].z += grid_z_origin;
+        }
+        int cubeindex = InterpolateCellEdges(positions, normals, distances,
+          kIsoLevel, position_list, normal_list);
+        if (cubeindex < 0) {
+          continue;
+        }
+
+        for (int i = 0; kTriangleTable[cubeindex][i] != -1; i += 3) {
+          Vector3i face;
+          for (int j = 0; j < 3; ++j) {
+            int edge = kTriangleTable[cubeindex][i + j];
+            int key;
+            int layer = VertexLayerAndKey(positions[kEdgeCorners[edge][0]],
+              positions[kEdgeCorners[edge][1]], position_list[edge], width,
+              &key);
+            int& id = layer_ids[layer & 1][key];
+            if (id < 0) {
+              id = static_cast<int>(slab.positions.size());
+              // Same transformation as MarchCell().
+              slab.positions.push_back(
+                transformPoint(world_from_grid, position_list[edge]));
+              slab.normals.push_back(
+                transformVector(world_from_grid, normal_list[edge])
+                  .normalized());
+              slab.layers.push_back(layer);
+              slab.keys.push_back(key);
+            }
+            face[j] = id;
+          }
+          slab.faces.push_back(face);
+        }
+      }
+    }
+  }
+}
+
+// Splits the cells with z in [z_begin, z_end) into slabs and meshes them
+// with num_threads threads (num_threads > 0). grid is as in MeshSlab().
+vector<MarchingCubesSlab> MeshSlabs(Array3DReadView<TSDF> grid,
+  int grid_z_origin, int z_begin, int z_end, float max_tsdf_value,
+  const SimilarityTransform& world_from_grid, int num_threads) {
+  // Several slabs per thread keep the load balanced when the surface
+  // occupies only part of the volume.
+  const int kSlabsPerThread = 4;
+  const int num_cell_slices = std::max(0, z_end - z_begin);
+  const int num_slabs = std::min(num_cell_slices,
+    num_threads * kSlabsPerThread);
+
+  vector<MarchingCubesSlab> slabs(num_slabs);
+  for (int s = 0; s < num_slabs; ++s) {
+    slabs[s].z_begin = z_begin + s * num_cell_slices / num_slabs;
+    slabs[s].z_end = z_begin + (s + 1) * num_cell_slices / num_slabs;
+  }
+
+  std::atomic<int> next_slab(0);
+  auto worker = [&]() {
+    vector<int> layer_ids[2];
+    for (int s = next_slab++; s < num_slabs; s = next_slab++) {
+      MeshSlab(grid, grid_z_origin, max_tsdf_value, world_from_grid,
+        layer_ids, slabs[s]);
+    }
+  };
+  vector<std::thread> threads;
+  for (int t = 1; t < std::min(num_threads, num_slabs); ++t) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  return slabs;
+}
+
+// Welds slab to the slabs before it, which must have been stitched in order
+// of z. Only vertices on a slab's first layer can have been used by the
+// previous slab, which saw them first. boundary_ids (kNumVertexSlots per
+// sample of a layer) and boundary_keys carry the ids of the previous slab's
+// last layer, and are updated for the next one.
+//
+// Writes the id of each vertex of slab to global_ids. Vertices not shared
+// with the previous slab are numbered in order from *num_vertices, which is
+// incremented.
+void StitchSlab(const MarchingCubesSlab& slab, vector<int>& boundary_ids,
+  vector<int>& boundary_keys, int* num_vertices, vector<int>& global_ids) {
+  global_ids.resize(slab.positions.size());
+  for (size_t v = 0; v < slab.positions.size(); ++v) {
+    int id = -1;
+    if (slab.layers[v] == slab.z_begin) {
+      id = boundary_ids[slab.keys[v]];
+    }
+    if (id < 0) {
+      id = (*num_vertices)++;
+    }
+    global_ids[v] = id;
+  }
+
+  for (int key : boundary_keys) {
+    boundary_ids[key] = -1;
+  }
+  boundary_keys.clear();
+  for (size_t v = 0; v < slab.positions.size(); ++v) {
+    if (slab.layers[v] == slab.z_end) {
+      boundary_ids[slab.keys[v]] = global_ids[v];
+      boundary_keys.push_back(slab.keys[v]);
+    }
+  }
+}
+
+int NumThreadsOrDefault(int num_threads) {
+  if (num_threads <= 0) {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+  return num_threads;
+}
+
+}  // namespace
+
+void EdgeKeyedMarchingCubes(Array3DReadView<TSDF> grid,
+  const Vector3i& grid_origin, float max_tsdf_value,
+  const SimilarityTransform& world_from_grid,
+  vector<Vector3f>& positions_out, vector<Vector3f>& normals_out,
+  vector<Vector3i>& faces_out, vector<int>& shared_vertices_out,
+  vector<uint64_t>& shared_keys_out) {
+  assert(grid_origin.x >= 0 && grid_origin.y >= 0 && grid_origin.z >= 0);
+  assert(grid_origin.x + grid.width() <= (1 << kEdgeKeyBitsPerAxis) &&
+    grid_origin.y + grid.height() <= (1 << kEdgeKeyBitsPerAxis) &&
+    grid_origin.z + grid.depth() <= (1 << kEdgeKeyBitsPerAxis));
+  positions_out.clear();
+  normals_out.clear();
+  faces_out.clear();
+  shared_vertices_out.clear();
+  shared_keys_out.clear();
+
+  const Vector3f origin(static_cast<float>(grid_origin.x),
+    static_cast<float>(grid_origin.y), static_cast<float>(grid_origin.z));
+  // The last sample of the cells along each axis.
+  const Vector3f extent = origin + Vector3f(
+    static_cast<float>(grid.width() - 2), static_cast<float>(grid.height() - 2),
+    static_cast<float>(grid.depth() - 2));
+  unordered_map<uint64_t, int> vertex_ids;
+
+  Vector3f positions[8];
+  Vector3f normals[8];
+  float distances[8];
+  Vector3f position_list[12];
+  Vector3f normal_list[12];
+
+  for (int z = 0; z < grid.depth() - 2; ++z) {
+    for (int y = 0; y < grid.height() - 2; ++y) {
+      for (int x = 0; x < grid.width() - 2; ++x) {
+        if (!GatherCell(grid, x, y, z, max_tsdf_value,
+          positions, normals, distances)) {
+          continue;
+        }
+        for (int i = 0; i < 8; ++i) {
+          positions[i] = positions[i] + origin;
+        }
+        int cubeindex = InterpolateCellEdges(positions, normals, distances,
+          kIsoLevel, position_list, normal_list);
+        if (cubeindex < 0) {
+          continue;
+        }
+
+        for (int i = 0; kTriangleTable[cubeindex][i] != -1; i += 3) {
+          Vector3i face;
+          for (int j = 0; j < 3; ++j) {
+            int edge = kTriangleTable[cubeindex][i + j];
+            Vector3f owner;
+            int slot = VertexSlot(positions[kEdgeCorners[edge][0]],
+              positions[kEdgeCorners[edge][1]], position_list[edge], &owner);
+            uint64_t key = (((static_cast<uint64_t>(owner.z) <<
+              kEdgeKeyBitsPerAxis | static_cast<uint64_t>(owner.y)) <<
+              kEdgeKeyBitsPerAxis | static_cast<uint64_t>(owner.x)) *
+              kNumVertexSlots) + slot;
+
+            auto inserted = vertex_ids.insert(
+              { key, static_cast<int>(positions_out.size()) });
+            if (inserted.second) {
+              // Only a vertex owned by a sample on a face of the cells can be
+              // produced by the cells of another sub-grid.
+              if (owner.x == origin.x || owner.y == origin.y ||
+                owner.z == origin.z || owner.x == extent.x ||
+                owner.y == extent.y || owner.z == extent.z) {
+                shared_vertices_out.push_back(
+                  static_cast<int>(positions_out.size()));
+                shared_keys_out.push_back(key);
+              }
+              // Same transformation as MarchCell().
+              positions_out.push_back(
+                transformPoint(world_from_grid, position_list[edge]));
+              normals_out.push_back(
+                transformVector(world_from_grid, normal_list[edge])
+                  .normalized());
+            }
+            face[j] = inserted.first->second;
+          }
+          faces_out.push_back(face);
+        }
+      }
+    }
+  }
+}
+
+TriangleMesh ParallelMarchingCubes(Array3DReadView<TSDF> grid,
+  float max_tsdf_value, const SimilarityTransform& world_from_grid,
+  int num_threads) {
+  vector<MarchingCubesSlab> slabs = MeshSlabs(grid, 0, 0,
+    std::max(0, grid.depth() - 2), max_tsdf_value, world_from_grid,
+    NumThreadsOrDefault(num_threads));
+
+  // Stitch the slabs together in order.
+  vector<Vector3f> positions;
+  vector<Vector3f> normals;
+  vector<Vector3i> faces;
+
+  vector<int> boundary_ids(
+    static_cast<size_t>(kNumVertexSlots) * grid.width() * grid.height(), -1);
+  vector<int> boundary_keys;
+  vector<int> global_ids;
+  int num_vertices = 0;
+  for (const MarchingCubesSlab& slab : slabs) {
+    StitchSlab(slab, boundary_ids, boundary_keys, &num_vertices, global_ids);
+    for (size_t v = 0; v < slab.positions.size(); ++v) {
+      if (global_ids[v] == static_cast<int>(positions.size())) {
+        positions.push_back(slab.positions[v]);
+        normals.push_back(slab.normals[v]);
+      }
+    }
+    for (const Vector3i& f : slab.faces) {
+      faces.push_back({ global_ids[f.x], global_ids[f.y], global_ids[f.z] });
+    }
+  }
+
+  return TriangleMesh(
+    readViewOf(positions), readViewOf(normals), readViewOf(faces));
+}
+
+StreamingMarchingCubes::StreamingMarchingCubes(const Vector3i& resolution,
+  float max_tsdf_value, const SimilarityTransform& world_from_grid,
+  PLYMeshWriter* writer, int num_threads) :
+  resolution_(resolution),
+  max_tsdf_value_(max_tsdf_value),
+  world_from_grid_(world_from_grid),
+  writer_(writer),
+  num_threads_(NumThreadsOrDefault(num_threads)),
+  boundary_ids_(
+    static_cast<size_t>(kNumVertexSlots) * resolution.x * resolution.y, -1) {
+}
+
+int StreamingMarchingCubes::NextSlice() const {
+  return next_z_;
+}
+
+void StreamingMarchingCubes::Append(Array3DReadView<TSDF> slices,
+  int z_begin) {
+  assert(z_begin == next_z_);
+  assert(slices.width() == resolution_.x);
+  assert(slices.height() == resolution_.y);
+  int z_end = std::min(z_begin + slices.depth(), resolution_.z) - 2;
+  if (z_end <= z_begin) {
+    return;
+  }
+
+  vector<MarchingCubesSlab> slabs = MeshSlabs(slices, z_begin, z_begin,
+    z_end, max_tsdf_value_, world_from_grid_, num_threads_);
+
+  vector<Vector3i> faces;
+  for (const MarchingCubesSlab& slab : slabs) {
+    int first_new_vertex = num_vertices_;
+    StitchSlab(slab, boundary_ids_, boundary_keys_, &num_vertices_,
+      global_ids_);
+
+    // New vertices are numbered in the slab's order, so writing them in that
+    // order keeps the writer's numbering.
+    positions_.clear();
+    normals_.clear();
+    for (size_t v = 0; v < slab.positions.size(); ++v) {
+      if (global_ids_[v] >= first_new_vertex) {
+        positions_.push_back(slab.positions[v]);
+        normals_.push_back(slab.normals[v]);
+      }
+    }
+    writer_->AppendVertices(positions_.data(), normals_.data(),
+      positions_.size());
+
+    faces.clear();
+    for (const Vector3i& f : slab.faces) {
+      faces.push_back(
+        { global_ids_[f.x], global_ids_[f.y], global_ids_[f.z] });
+    }
+    writer_->AppendFaces(faces.data(), faces.size());
+  }
+  next_z_ = z_end;
+}
@@ -14,15 +14,26 @@
 #ifndef MARCHING_CUBES_H
 #define MARCHING_CUBES_H
 
+#include <cstdint>
 #include <vector>
 
 #include "libcgt/core/common/Array3D.h"
 #include "libcgt/core/vecmath/SimilarityTransform.h"
 #include "libcgt/core/vecmath/Vector3f.h"
+#include "libcgt/core/vecmath/Vector3i.h"
 #include "libcgt/core/geometry/TriangleMesh.h"
 
 #include "tsdf.h"
 
+class PLYMeshWriter;
+
+// Standard marching cubes lookup tables, indexed by the 8-bit cube index
+// (bit i is set when corner i is inside the surface). kEdgeTable holds a
+// bitmask of the 12 cell edges cut by the surface and kTriangleTable
+// lists up to 5 triangles as triples of edge indices, terminated by -1.
+extern const int kEdgeTable[256];
+extern const int kTriangleTable[256][16];
+
 // Run the marching cubes algorithm on the regular grid TSDF.
 // Generates a triangle list of positions and normals.
 void MarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
@@ -30,6 +41,41 @@ void MarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
   std::vector<Vector3f>& triangle_list_positions_out,
   std::vector<Vector3f>& triangle_list_normals_out);
 
+// Same as MarchingCubes(), but appends to the output lists instead of
+// clearing them first, and does not print progress. Useful to mesh a volume
+// one small block at a time.
+void AppendMarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
+  const libcgt::core::vecmath::SimilarityTransform& world_from_grid,
+  std::vector<Vector3f>& triangle_list_positions_out,
+  std::vector<Vector3f>& triangle_list_normals_out);
+
+// Same as AppendMarchingCubes(), but grid holds the samples of a larger grid
+// starting at grid_origin. Positions are interpolated in the coordinates of
+// the larger grid, so sub-grids that share a cell face produce bit-identical
+// vertices there and weld cleanly.
+void AppendMarchingCubes(Array3DReadView<TSDF> grid,
+  const Vector3i& grid_origin, float max_tsdf_value,
+  const libcgt::core::vecmath::SimilarityTransform& world_from_grid,
+  std::vector<Vector3f>& triangle_list_positions_out,
+  std::vector<Vector3f>& triangle_list_normals_out);
+
+// Same cells as the AppendMarchingCubes() that takes a grid_origin, but
+// welded by the grid edge each vertex lies on, like ParallelMarchingCubes(),
+// into an indexed mesh that replaces the contents of the output lists.
+//
+// shared_vertices_out lists the vertices on the faces of the box of cells,
+// which the cells of an adjacent sub-grid can also produce. shared_keys_out
+// holds the key of each one's edge within the larger grid: the meshes of
+// sub-grids are welded by matching keys. grid_origin must be non-negative.
+void EdgeKeyedMarchingCubes(Array3DReadView<TSDF> grid,
+  const Vector3i& grid_origin, float max_tsdf_value,
+  const libcgt::core::vecmath::SimilarityTransform& world_from_grid,
+  std::vector<Vector3f>& positions_out,
+  std::vector<Vector3f>& normals_out,
+  std::vector<Vector3i>& faces_out,
+  std::vector<int>& shared_vertices_out,
+  std::vector<uint64_t>& shared_keys_out);
+
 TriangleMesh ConstructMarchingCubesMesh(
   const std::vector<Vector3f>& triangle_list_positions);
 
@@ -37,4 +83,60 @@ TriangleMesh ConstructMarchingCubesMesh(
   const std::vector<Vector3f>& triangle_list_positions,
   const std::vector<Vector3f>& triangle_list_normals);
 
+// Same mesh as ConstructMarchingCubesMesh() applied to the output of
+// MarchingCubes(), computed by num_threads threads over slabs of z slices.
+// Vertices are welded by the grid edge they lie on instead of by hashing
+// their positions. num_threads <= 0 uses one thread per hardware thread.
+TriangleMesh ParallelMarchingCubes(Array3DReadView<TSDF> grid,
+  float max_tsdf_value,
+  const libcgt::core::vecmath::SimilarityTransform& world_from_grid,
+  int num_threads = 0);
+
+// Same mesh as ParallelMarchingCubes(), but built a chunk of z slices at a
+// time, in order, and streamed to a PLYMeshWriter as each chunk is meshed.
+// Only the chunk and the vertex ids of one layer of samples are held in
+// memory, so grids can be meshed straight from the GPU or from disk.
+class StreamingMarchingCubes {
+ public:
+
+  using SimilarityTransform = libcgt::core::vecmath::SimilarityTransform;
+
+  // resolution is the size of the whole grid. writer must be open and
+  // outlive this object. num_threads <= 0 uses one thread per hardware
+  // thread.
+  StreamingMarchingCubes(const Vector3i& resolution, float max_tsdf_value,
+    const SimilarityTransform& world_from_grid, PLYMeshWriter* writer,
+    int num_threads = 0);
+
+  // The first slice of the next chunk: 0 at first, then the first slice of
+  // cells that Append() has not meshed yet.
+  int NextSlice() const;
+
+  // Meshes the cells whose minimum corners are in the first
+  // slices.depth() - 2 slices of slices, which holds slices [z_begin,
+  // z_begin + slices.depth()) of the grid. z_begin must be NextSlice(), so
+  // consecutive chunks overlap by two slices.
+  void Append(Array3DReadView<TSDF> slices, int z_begin);
+
+ private:
+
+  Vector3i resolution_;
+  float max_tsdf_value_;
+  SimilarityTransform world_from_grid_;
+  PLYMeshWriter* writer_;
+  int num_threads_;
+
+  int next_z_ = 0;
+  int num_vertices_ = 0;
+  // The ids of the vertices on layer next_z_ (see StitchSlab() in
+  // marching_cubes.cpp), and which entries are set.
+  std::vector<int> boundary_ids_;
+  std::vector<int> boundary_keys_;
+
+  // Scratch space reused across chunks.
+  std::vector<int> global_ids_;
+  std::vector<Vector3f> positions_;
+  std::vector<Vector3f> normals_;
+};
+
 #endif  // MARCHING_CUBES_H
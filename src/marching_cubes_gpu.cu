@@ -0,0 +1,601 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "marching_cubes_gpu.h"
+
+#include <cassert>
+#include <climits>
+#include <cstdint>
+#include <vector>
+
+#include <helper_math.h>
+#include <thrust/copy.h>
+#include <thrust/count.h>
+#include <thrust/device_ptr.h>
+#include <thrust/execution_policy.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/scan.h>
+
+#include "libcgt/core/common/ArrayUtils.h"
+#include "libcgt/cuda/DeviceArray1D.h"
+#include "libcgt/cuda/float4x4.h"
+#include "libcgt/cuda/MathUtils.h"
+#include "libcgt/cuda/ThreadMath.cuh"
+#include "libcgt/cuda/VecmathConversions.h"
+
+#include "marching_cubes.h"
+
+using libcgt::core::arrayutils::readViewOf;
+using libcgt::core::vecmath::SimilarityTransform;
+using libcgt::cuda::threadmath::threadSubscript2DGlobal;
+
+namespace {
+
+// Same thresholds as MarchCell().
+constexpr float kMinSDFDiff = 1e-3f;
+constexpr float kInterpolationEpsilon = 1e-5f;
+
+// Per-voxel flags. Bits 0-2: the voxel owns a vertex on its +x, +y or +z
+// edge. Bit 3: the cell whose minimum corner is the voxel emits triangles.
+constexpr uint8_t kOwnedEdgesMask = 0x7;
+constexpr uint8_t kHasTrianglesBit = 0x8;
+
+constexpr int kThreadsPerBlock = 256;
+
+__constant__ int c_edge_table[256];
+__constant__ int c_triangle_table[256][16];
+
+// Offset of cell corner i from the cell's minimum corner, in the order used
+// by the lookup tables.
+__constant__ int3 c_corner_offsets[8] = {
+  { 0, 0, 0 }, { 1, 0, 0 }, { 1, 0, 1 }, { 0, 0, 1 },
+  { 0, 1, 0 }, { 1, 1, 0 }, { 1, 1, 1 }, { 0, 1, 1 }
+};
+
+// For cell edge i: (x, y, z) is the offset of the voxel that owns it from the
+// cell's minimum corner, and w is the axis the edge points along.
+__constant__ int4 c_edge_owners[12] = {
+  { 0, 0, 0, 0 }, { 1, 0, 0, 2 }, { 0, 0, 1, 0 }, { 0, 0, 0, 2 },
+  { 0, 1, 0, 0 }, { 1, 1, 0, 2 }, { 0, 1, 1, 0 }, { 0, 1, 0, 2 },
+  { 0, 0, 0, 1 }, { 1, 0, 0, 1 }, { 1, 0, 1, 1 }, { 0, 0, 1, 1 }
+};
+
+struct IsNonZero {
+  __host__ __device__
+  bool operator()(uint8_t x) const {
+    return x != 0;
+  }
+};
+
+__inline__ __device__
+int LinearIndex(int3 xyz, int3 size) {
+  return xyz.x + size.x * (xyz.y + size.y * xyz.z);
+}
+
+__inline__ __device__
+int3 Subscript(int index, int3 size) {
+  int yz = index / size.x;
+  return int3{ index % size.x, yz % size.y, yz / size.y };
+}
+
+__inline__ __device__
+int3 AxisOffset(int axis) {
+  return int3{ axis == 0, axis == 1, axis == 2 };
+}
+
+// Forward-difference normal at xyz, which reads xyz + (1, 1, 1). Returns false
+// if any sample is unobserved or the gradient is too small to normalize.
+__inline__ __device__
+bool CornerNormal(RollingGridView<const TSDF> grid, int3 xyz,
+  float max_tsdf_value, float3& normal_out) {
+  TSDF t_000 = grid[xyz];
+  TSDF t_100 = grid[{ xyz.x + 1, xyz.y    , xyz.z     }];
+  TSDF t_010 = grid[{ xyz.x    , xyz.y + 1, xyz.z     }];
+  TSDF t_001 = grid[{ xyz.x    , xyz.y    , xyz.z + 1 }];
+  if (t_000.Weight() == 0 || t_100.Weight() == 0 ||
+    t_010.Weight() == 0 || t_001.Weight() == 0) {
+    return false;
+  }
+  float d_000 = t_000.Distance(max_tsdf_value);
+  float3 normal = {
+    t_100.Distance(max_tsdf_value) - d_000,
+    t_010.Distance(max_tsdf_value) - d_000,
+    t_001.Distance(max_tsdf_value) - d_000
+  };
+  float norm = length(normal);
+  if (norm < kMinSDFDiff) {
+    return false;
+  }
+  normal_out = normal / norm;
+  return true;
+}
+
+// Returns the cube index of the cell whose minimum corner is cell, or 0 if
+// any of its corners lacks a valid normal.
+__inline__ __device__
+int CubeIndex(RollingGridView<const TSDF> grid, int3 cell,
+  float max_tsdf_value) {
+  int cube_index = 0;
+  for (int i = 0; i < 8; ++i) {
+    int3 corner = cell + c_corner_offsets[i];
+    float3 normal;
+    if (!CornerNormal(grid, corner, max_tsdf_value, normal)) {
+      return 0;
+    }
+    // The iso level is 0.
+    if (grid[corner].Distance(max_tsdf_value) < 0.0f) {
+      cube_index |= 1 << i;
+    }
+  }
+  return cube_index;
+}
+
+// Same as VertexInterp() in marching_cubes.cpp, with an iso level of 0.
+__inline__ __device__
+float3 VertexInterp(float3 left, float3 right, float left_value,
+  float right_value) {
+  if (fabsf(left_value) < kInterpolationEpsilon) {
+    return left;
+  }
+  if (fabsf(right_value) < kInterpolationEpsilon) {
+    return right;
+  }
+  if (fabsf(left_value - right_value) < kInterpolationEpsilon) {
+    return left;
+  }
+  float t = -left_value / (right_value - left_value);
+  return left + t * (right - left);
+}
+
+// Returns the index of value in the sorted array values[0, count), which must
+// contain it.
+__inline__ __device__
+int SortedIndexOf(const int* values, int count, int value) {
+  int lo = 0;
+  int hi = count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (values[mid] < value) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Classifies every cell and writes its cube index. Cells that would read
+// outside the grid, or that have an invalid corner, get 0.
+__global__
+void ClassifyCellsKernel(RollingGridView<const TSDF> grid,
+  float max_tsdf_value,
+  uint8_t* cube_indices) {
+  int3 size = grid.size();
+  int2 xy = threadSubscript2DGlobal();
+  if (xy.x >= size.x || xy.y >= size.y) {
+    return;
+  }
+
+  for (int z = 0; z < size.z; ++z) {
+    int3 cell = { xy.x, xy.y, z };
+    int cube_index = 0;
+    // Like MarchingCubes(), the last cell along each axis is skipped since
+    // its normals would need samples past the end of the grid.
+    if (cell.x < size.x - 2 && cell.y < size.y - 2 && cell.z < size.z - 2) {
+      cube_index = CubeIndex(grid, cell, max_tsdf_value);
+    }
+    cube_indices[LinearIndex(cell, size)] = static_cast<uint8_t>(cube_index);
+  }
+}
+
+// Marks the edges each voxel owns that are cut by the surface in at least one
+// adjacent cell, and whether the voxel's own cell emits triangles.
+__global__
+void MarkEdgesKernel(const uint8_t* cube_indices, int3 size,
+  uint8_t* flags) {
+  int2 xy = threadSubscript2DGlobal();
+  if (xy.x >= size.x || xy.y >= size.y) {
+    return;
+  }
+
+  for (int z = 0; z < size.z; ++z) {
+    int3 voxel = { xy.x, xy.y, z };
+    uint8_t voxel_flags = 0;
+    for (int e = 0; e < 12; ++e) {
+      int4 owner = c_edge_owners[e];
+      int3 cell = { voxel.x - owner.x, voxel.y - owner.y, voxel.z - owner.z };
+      if (cell.x >= 0 && cell.y >= 0 && cell.z >= 0 &&
+        (c_edge_table[cube_indices[LinearIndex(cell, size)]] & (1 << e))) {
+        voxel_flags |= 1 << owner.w;
+      }
+    }
+    int voxel_index = LinearIndex(voxel, size);
+    if (c_edge_table[cube_indices[voxel_index]] != 0) {
+      voxel_flags |= kHasTrianglesBit;
+    }
+    flags[voxel_index] = voxel_flags;
+  }
+}
+
+__global__
+void CountOutputsKernel(const int* active_voxels, int num_active,
+  const uint8_t* flags, const uint8_t* cube_indices,
+  int* num_vertices, int* num_triangles) {
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= num_active) {
+    return;
+  }
+
+  int voxel_index = active_voxels[i];
+  uint8_t voxel_flags = flags[voxel_index];
+  num_vertices[i] = __popc(voxel_flags & kOwnedEdgesMask);
+
+  int n = 0;
+  if (voxel_flags & kHasTrianglesBit) {
+    const int* triangles = c_triangle_table[cube_indices[voxel_index]];
+    while (n < 15 && triangles[n] != -1) {
+      n += 3;
+    }
+  }
+  num_triangles[i] = n / 3;
+}
+
+// Writes the vertices owned by each active voxel, in +x, +y, +z order,
+// starting at vertex_offsets[i].
+__global__
+void GenerateVerticesKernel(RollingGridView<const TSDF> grid,
+  float max_tsdf_value,
+  float4x4 world_from_grid,
+  const int* active_voxels, int num_active,
+  const uint8_t* flags,
+  const int* vertex_offsets,
+  float3* positions,
+  float3* normals) {
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= num_active) {
+    return;
+  }
+
+  int voxel_index = active_voxels[i];
+  uint8_t voxel_flags = flags[voxel_index];
+  if ((voxel_flags & kOwnedEdgesMask) == 0) {
+    return;
+  }
+
+  int3 voxel = Subscript(voxel_index, grid.size());
+  float d0 = grid[voxel].Distance(max_tsdf_value);
+  float3 p0 = make_float3(voxel);
+  // Every owned edge belongs to a valid cell, so both normals exist.
+  float3 n0;
+  CornerNormal(grid, voxel, max_tsdf_value, n0);
+
+  int vertex = vertex_offsets[i];
+  for (int axis = 0; axis < 3; ++axis) {
+    if ((voxel_flags & (1 << axis)) == 0) {
+      continue;
+    }
+    int3 other = voxel + AxisOffset(axis);
+    float d1 = grid[other].Distance(max_tsdf_value);
+    float3 p1 = make_float3(other);
+    float3 n1;
+    CornerNormal(grid, other, max_tsdf_value, n1);
+
+    // Same arithmetic as ConsistentVertexInterp(): voxel is always the
+    // lexicographically smaller endpoint.
+    float3 p = p0;
+    if (fabsf(d0 - d1) > kInterpolationEpsilon) {
+      p = p0 + (p1 - p0) / (d1 - d0) * (0.0f - d0);
+    }
+    float3 n = VertexInterp(n0, n1, d0, d1);
+
+    positions[vertex] = transformPoint(world_from_grid, p);
+    normals[vertex] = normalize(transformVector(world_from_grid, n));
+    ++vertex;
+  }
+}
+
+// Returns the id of the vertex on edge (0-11) of cell.
+__inline__ __device__
+int EdgeVertex(int3 cell, int edge, int3 size,
+  const int* active_voxels, int num_active,
+  const uint8_t* flags, const int* vertex_offsets) {
+  int4 owner = c_edge_owners[edge];
+  int owner_index = LinearIndex(
+    int3{ cell.x + owner.x, cell.y + owner.y, cell.z + owner.z }, size);
+  int i = SortedIndexOf(active_voxels, num_active, owner_index);
+  return vertex_offsets[i] +
+    __popc(flags[owner_index] & ((1 << owner.w) - 1));
+}
+
+__global__
+void GenerateTrianglesKernel(int3 size,
+  const int* active_voxels, int num_active,
+  const uint8_t* flags,
+  const uint8_t* cube_indices,
+  const int* vertex_offsets,
+  const int* triangle_offsets,
+  int3* faces) {
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= num_active) {
+    return;
+  }
+
+  int voxel_index = active_voxels[i];
+  if ((flags[voxel_index] & kHasTrianglesBit) == 0) {
+    return;
+  }
+
+  int3 cell = Subscript(voxel_index, size);
+  const int* triangles = c_triangle_table[cube_indices[voxel_index]];
+  int face = triangle_offsets[i];
+  for (int t = 0; t < 15 && triangles[t] != -1; t += 3) {
+    faces[face] = int3{
+      EdgeVertex(cell, triangles[t], size,
+        active_voxels, num_active, flags, vertex_offsets),
+      EdgeVertex(cell, triangles[t + 1], size,
+        active_voxels, num_active, flags, vertex_offsets),
+      EdgeVertex(cell, triangles[t + 2], size,
+        active_voxels, num_active, flags, vertex_offsets)
+    };
+    ++face;
+  }
+}
+
+// Writes the zero crossings on the +x, +y and +z edges of voxel, in that
+// order, in grid coordinates, and returns how many there are. An edge
+// crosses when its endpoints have opposite signs and both have a valid
+// normal (so both are observed). Edges whose normals would read past the end
+// of the grid are skipped.
+__inline__ __device__
+int EdgeZeroCrossings(RollingGridView<const TSDF> grid, int3 voxel,
+  float max_tsdf_value, float3 points_out[3], float3 normals_out[3]) {
+  int3 size = grid.size();
+  if (voxel.x >= size.x - 1 || voxel.y >= size.y - 1 ||
+    voxel.z >= size.z - 1) {
+    return 0;
+  }
+  float3 n0;
+  if (!CornerNormal(grid, voxel, max_tsdf_value, n0)) {
+    return 0;
+  }
+  float d0 = grid[voxel].Distance(max_tsdf_value);
+  float3 p0 = make_float3(voxel);
+
+  int count = 0;
+  for (int axis = 0; axis < 3; ++axis) {
+    int3 other = voxel + AxisOffset(axis);
+    if (other.x >= size.x - 1 || other.y >= size.y - 1 ||
+      other.z >= size.z - 1) {
+      continue;
+    }
+    float d1 = grid[other].Distance(max_tsdf_value);
+    float3 n1;
+    if ((d0 < 0.0f) == (d1 < 0.0f) ||
+      !CornerNormal(grid, other, max_tsdf_value, n1)) {
+      continue;
+    }
+    // Same interpolation as GenerateVerticesKernel().
+    float3 p1 = make_float3(other);
+    float3 p = p0;
+    if (fabsf(d0 - d1) > kInterpolationEpsilon) {
+      p = p0 + (p1 - p0) / (d1 - d0) * (0.0f - d0);
+    }
+    points_out[count] = p;
+    normals_out[count] = VertexInterp(n0, n1, d0, d1);
+    ++count;
+  }
+  return count;
+}
+
+// Counts the zero crossings owned by each column of voxels.
+__global__
+void CountZeroCrossingsKernel(RollingGridView<const TSDF> grid,
+  float max_tsdf_value,
+  int* column_counts) {
+  int3 size = grid.size();
+  int2 xy = threadSubscript2DGlobal();
+  if (xy.x >= size.x || xy.y >= size.y) {
+    return;
+  }
+
+  int count = 0;
+  float3 points[3];
+  float3 normals[3];
+  for (int z = 0; z < size.z; ++z) {
+    count += EdgeZeroCrossings(grid, { xy.x, xy.y, z }, max_tsdf_value,
+      points, normals);
+  }
+  column_counts[xy.x + size.x * xy.y] = count;
+}
+
+// Writes the zero crossings of each column, in z order, starting at
+// column_offsets of the column.
+__global__
+void WriteZeroCrossingsKernel(RollingGridView<const TSDF> grid,
+  float max_tsdf_value,
+  float4x4 world_from_grid,
+  const int* column_offsets,
+  float4* world_points,
+  float4* world_normals) {
+  int3 size = grid.size();
+  int2 xy = threadSubscript2DGlobal();
+  if (xy.x >= size.x || xy.y >= size.y) {
+    return;
+  }
+
+  int point = column_offsets[xy.x + size.x * xy.y];
+  float3 points[3];
+  float3 normals[3];
+  for (int z = 0; z < size.z; ++z) {
+    int count = EdgeZeroCrossings(grid, { xy.x, xy.y, z }, max_tsdf_value,
+      points, normals);
+    for (int i = 0; i < count; ++i) {
+      world_points[point] =
+        make_float4(transformPoint(world_from_grid, points[i]), 1.0f);
+      world_normals[point] = make_float4(
+        normalize(transformVector(world_from_grid, normals[i])), 0.0f);
+      ++point;
+    }
+  }
+}
+
+}  // namespace
+
+TriangleMesh GPUMarchingCubes(RollingGridView<const TSDF> grid,
+  float max_tsdf_value,
+  const SimilarityTransform& world_from_grid) {
+  cudaMemcpyToSymbol(c_edge_table, kEdgeTable, sizeof(kEdgeTable));
+  cudaMemcpyToSymbol(c_triangle_table, kTriangleTable,
+    sizeof(kTriangleTable));
+
+  int3 size = grid.size();
+  Vector3i resolution(size.x, size.y, size.z);
+  assert(static_cast<long long>(resolution.x) * resolution.y * resolution.z
+    <= INT_MAX);
+  int num_voxels = resolution.x * resolution.y * resolution.z;
+
+  // Classify: one byte per voxel for the cube index and one for the flags.
+  DeviceArray1D<uint8_t> cube_indices(num_voxels);
+  DeviceArray1D<uint8_t> flags(num_voxels);
+
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = libcgt::cuda::math::numBins2D(
+    { resolution.x, resolution.y }, block_dim);
+  ClassifyCellsKernel<<<grid_dim, block_dim>>>(
+    grid, max_tsdf_value, cube_indices.pointer());
+  MarkEdgesKernel<<<grid_dim, block_dim>>>(
+    cube_indices.pointer(), size, flags.pointer());
+
+  // Compact the voxels near the surface. The list is sorted, which lets
+  // cells find the vertices owned by their neighbors by binary search.
+  thrust::device_ptr<const uint8_t> flags_begin(flags.pointer());
+  int num_active = static_cast<int>(thrust::count_if(thrust::device,
+    flags_begin, flags_begin + num_voxels, IsNonZero()));
+  if (num_active == 0) {
+    return TriangleMesh();
+  }
+
+  DeviceArray1D<int> active_voxels(num_active);
+  thrust::copy_if(thrust::device,
+    thrust::counting_iterator<int>(0),
+    thrust::counting_iterator<int>(num_voxels),
+    flags_begin,
+    thrust::device_ptr<int>(active_voxels.pointer()),
+    IsNonZero());
+
+  // Scan: the extra zero at the end of each array becomes the total.
+  DeviceArray1D<int> vertex_offsets(num_active + 1);
+  DeviceArray1D<int> triangle_offsets(num_active + 1);
+  vertex_offsets.fill(0);
+  triangle_offsets.fill(0);
+
+  int num_blocks_1d = (num_active + kThreadsPerBlock - 1) / kThreadsPerBlock;
+  CountOutputsKernel<<<num_blocks_1d, kThreadsPerBlock>>>(
+    active_voxels.pointer(), num_active,
+    flags.pointer(), cube_indices.pointer(),
+    vertex_offsets.pointer(), triangle_offsets.pointer());
+
+  thrust::device_ptr<int> vertex_offsets_begin(vertex_offsets.pointer());
+  thrust::device_ptr<int> triangle_offsets_begin(triangle_offsets.pointer());
+  thrust::exclusive_scan(thrust::device,
+    vertex_offsets_begin, vertex_offsets_begin + num_active + 1,
+    vertex_offsets_begin);
+  thrust::exclusive_scan(thrust::device,
+    triangle_offsets_begin, triangle_offsets_begin + num_active + 1,
+    triangle_offsets_begin);
+
+  int num_vertices;
+  int num_triangles;
+  cudaMemcpy(&num_vertices, vertex_offsets.pointer() + num_active,
+    sizeof(int), cudaMemcpyDeviceToHost);
+  cudaMemcpy(&num_triangles, triangle_offsets.pointer() + num_active,
+    sizeof(int), cudaMemcpyDeviceToHost);
+
+  // Generate.
+  DeviceArray1D<float3> positions(num_vertices);
+  DeviceArray1D<float3> normals(num_vertices);
+  DeviceArray1D<int3> faces(num_triangles);
+
+  GenerateVerticesKernel<<<num_blocks_1d, kThreadsPerBlock>>>(
+    grid, max_tsdf_value,
+    make_float4x4(world_from_grid.asMatrix()),
+    active_voxels.pointer(), num_active,
+    flags.pointer(),
+    vertex_offsets.pointer(),
+    positions.pointer(), normals.pointer());
+  GenerateTrianglesKernel<<<num_blocks_1d, kThreadsPerBlock>>>(
+    size,
+    active_voxels.pointer(), num_active,
+    flags.pointer(), cube_indices.pointer(),
+    vertex_offsets.pointer(), triangle_offsets.pointer(),
+    faces.pointer());
+
+  std::vector<Vector3f> host_positions(num_vertices);
+  std::vector<Vector3f> host_normals(num_vertices);
+  std::vector<Vector3i> host_faces(num_triangles);
+  cudaMemcpy(host_positions.data(), positions.pointer(),
+    num_vertices * sizeof(float3), cudaMemcpyDeviceToHost);
+  cudaMemcpy(host_normals.data(), normals.pointer(),
+    num_vertices * sizeof(float3), cudaMemcpyDeviceToHost);
+  cudaMemcpy(host_faces.data(), faces.pointer(),
+    num_triangles * sizeof(int3), cudaMemcpyDeviceToHost);
+
+  return TriangleMesh(readViewOf(host_positions), readViewOf(host_normals),
+    readViewOf(host_faces));
+}
+
+int GPUZeroCrossings(RollingGridView<const TSDF> grid,
+  float max_tsdf_value,
+  const SimilarityTransform& world_from_grid,
+  DeviceArray1D<float4>& world_points_out,
+  DeviceArray1D<float4>& world_normals_out,
+  cudaStream_t stream) {
+  int3 size = grid.size();
+  int num_columns = size.x * size.y;
+
+  // Count, then scan: the extra zero at the end becomes the total.
+  DeviceArray1D<int> column_offsets(num_columns + 1);
+  cudaMemsetAsync(column_offsets.pointer(), 0,
+    (num_columns + 1) * sizeof(int), stream);
+
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = libcgt::cuda::math::numBins2D({ size.x, size.y },
+    block_dim);
+  CountZeroCrossingsKernel<<<grid_dim, block_dim, 0, stream>>>(
+    grid, max_tsdf_value, column_offsets.pointer());
+
+  thrust::device_ptr<int> offsets_begin(column_offsets.pointer());
+  thrust::exclusive_scan(thrust::cuda::par.on(stream),
+    offsets_begin, offsets_begin + num_columns + 1, offsets_begin);
+
+  int num_points;
+  cudaMemcpyAsync(&num_points, column_offsets.pointer() + num_columns,
+    sizeof(int), cudaMemcpyDeviceToHost, stream);
+  cudaStreamSynchronize(stream);
+  if (num_points == 0) {
+    return 0;
+  }
+
+  if (world_points_out.length() < static_cast<size_t>(num_points)) {
+    world_points_out.resize(num_points);
+  }
+  if (world_normals_out.length() < static_cast<size_t>(num_points)) {
+    world_normals_out.resize(num_points);
+  }
+  WriteZeroCrossingsKernel<<<grid_dim, block_dim, 0, stream>>>(
+    grid, max_tsdf_value,
+    make_float4x4(world_from_grid.asMatrix()),
+    column_offsets.pointer(),
+    world_points_out.pointer(), world_normals_out.pointer());
+  return num_points;
+}
@@ -0,0 +1,61 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef MARCHING_CUBES_GPU_H
+#define MARCHING_CUBES_GPU_H
+
+#include <cuda_runtime.h>
+
+#include "libcgt/core/geometry/TriangleMesh.h"
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+#include "libcgt/cuda/DeviceArray1D.h"
+
+#include "rolling_grid_view.h"
+#include "tsdf.h"
+
+// Runs marching cubes on a regular grid TSDF without leaving the device.
+//
+// Cells are accepted or rejected by the same rules as MarchingCubes(). The
+// mesh is produced in three passes (classify, scan, generate). Every vertex
+// lies on a grid edge, and the voxel at the edge's minimum endpoint owns it.
+// Triangles then index shared vertices directly and need no welding. Only
+// the final positions, normals and faces are copied to the host.
+//
+// grid can have any layout or origin.
+TriangleMesh GPUMarchingCubes(RollingGridView<const TSDF> grid,
+  float max_tsdf_value,
+  const libcgt::core::vecmath::SimilarityTransform& world_from_grid);
+
+// Finds the zero crossings of a regular grid TSDF along grid edges whose
+// endpoints are both observed, as an oriented point cloud of the surface,
+// without leaving the device. Positions are interpolated as for the vertices
+// of GPUMarchingCubes(), and normals from the gradient at both endpoints.
+//
+// Two passes over the grid, one thread per column of voxels: count the
+// crossings, scan the counts, then write each column's crossings at its
+// offset. The output is dense and its order deterministic. Only a few bytes
+// per column of scratch are needed, so this runs at about the speed of
+// reading the grid twice.
+//
+// Writes point i to world_points_out[i] (w = 1) and its unit normal to
+// world_normals_out[i] (w = 0), in world coordinates, and returns the number
+// of points. The arrays are grown if they are too small, never shrunk.
+// Enqueues on stream, and synchronizes with it once to read the count.
+int GPUZeroCrossings(RollingGridView<const TSDF> grid,
+  float max_tsdf_value,
+  const libcgt::core::vecmath::SimilarityTransform& world_from_grid,
+  DeviceArray1D<float4>& world_points_out,
+  DeviceArray1D<float4>& world_normals_out,
+  cudaStream_t stream = 0);
+
+#endif  // MARCHING_CUBES_GPU_H
@@ -149,8 +149,12 @@ MultiStaticCameraGLState::MultiStaticCameraGLState(
 	linear_sampler_.setWrapModes(GLWrapMode::CLAMP_TO_EDGE);
 }
 
+void MultiStaticCameraGLState::NotifyInputUpdated() {
+  inputs_are_dirty_ = true;
+}
+
 void MultiStaticCameraGLState::NotifyTSDFUpdated() {
-  tsdf_is_dirty_ = true;
+  raycast_is_dirty_ = true;
 }
 
 void MultiStaticCameraGLState::Resize(const Vector2i& size) {
@@ -169,23 +173,29 @@ void MultiStaticCameraGLState::Resize(const Vector2i& size) {
       GLTexture2D(downsampled_size, GLImageInternalFormat::RGBA32F),
       libcgt::cuda::gl::Texture2D::MapFlags::WRITE_DISCARD
     );
+  // The new textures are empty.
+  raycast_is_dirty_ = true;
 }
 
 void MultiStaticCameraGLState::Render(const PerspectiveCamera& free_camera) {
   if (free_camera != free_camera_) {
     free_camera_ = free_camera;
-    tsdf_is_dirty_ = true;
+    raycast_is_dirty_ = true;
   }
 
-  // TODO: notify that input has changed
-  for(int i = 0; i < static_cast<int>(raw_depth_textures_.size()); ++i) {
-    raw_depth_textures_[i].texture().set(
-      pipeline_->GetInputBuffer(i).depth_meters);
-
-    {
-      auto mr = undistorted_depth_textures_[i].map();
-      copy(pipeline_->GetUndistortedDepthMap(i), mr.array());
+  if (inputs_are_dirty_) {
+    for(int i = 0; i < static_cast<int>(raw_depth_textures_.size()); ++i) {
+      {
+        auto mr = raw_depth_textures_[i].map();
+        copy(pipeline_->GetDepthMap(i), mr.array());
+      }
+
+      {
+        auto mr = undistorted_depth_textures_[i].map();
+        copy(pipeline_->GetUndistortedDepthMap(i), mr.array());
+      }
     }
+    inputs_are_dirty_ = false;
   }
 
   // TODO: only when positions have changed, which in this case, is never.
@@ -317,7 +327,7 @@ void MultiStaticCameraGLState::DrawUnprojectedPointClouds() {
 
 void MultiStaticCameraGLState::DrawFullscreenRaycast() {
   // Update the buffer.
-  if (tsdf_is_dirty_) {
+  if (raycast_is_dirty_) {
     pipeline_->Raycast(free_camera_,
       free_camera_world_positions_, free_camera_world_normals_ );
     {
@@ -328,7 +338,7 @@ void MultiStaticCameraGLState::DrawFullscreenRaycast() {
       auto mr = free_camera_world_normals_tex_.map();
       copy(free_camera_world_normals_, mr.array());
     }
-    tsdf_is_dirty_ = false;
+    raycast_is_dirty_ = false;
   }
 
   glDisable(GL_DEPTH_TEST);
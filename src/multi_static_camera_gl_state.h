@@ -33,6 +33,8 @@
 #include "libcgt/GL/GL_45/drawables/TexturedRectangle.h"
 #include "libcgt/GL/GL_45/drawables/WireframeBox.h"
 
+#include "device_array_pool.h"
+
 class MultiStaticCameraPipeline;
 
 class MultiStaticCameraGLState : public QObject {
@@ -43,7 +45,10 @@ class MultiStaticCameraGLState : public QObject {
   MultiStaticCameraGLState(MultiStaticCameraPipeline* pipeline,
     QOpenGLWidget* parent);
 
-  //void NotifyInputUpdated();
+  // Render() only re-uploads the depth textures after NotifyInputUpdated(),
+  // and only re-raycasts the free camera after NotifyTSDFUpdated(), a resize
+  // or a camera move.
+  void NotifyInputUpdated();
   void NotifyTSDFUpdated();
 
   void Resize(const Vector2i& size);
@@ -61,7 +66,8 @@ class MultiStaticCameraGLState : public QObject {
   // ----- State -----
   QOpenGLWidget* parent_ = nullptr;
   MultiStaticCameraPipeline* pipeline_ = nullptr;
-  bool tsdf_is_dirty_ = true;
+  bool inputs_are_dirty_ = true;
+  bool raycast_is_dirty_ = true;
   PerspectiveCamera free_camera_;
   Vector2i window_size_;
 
@@ -78,8 +84,8 @@ class MultiStaticCameraGLState : public QObject {
   std::vector<libcgt::cuda::gl::Texture2D> undistorted_depth_textures_;
 
   // Raycasting from the current camera pose, resized as the view changes.
-  DeviceArray2D<float4> free_camera_world_positions_;
-  DeviceArray2D<float4> free_camera_world_normals_;
+  PooledDeviceArray2D<float4> free_camera_world_positions_;
+  PooledDeviceArray2D<float4> free_camera_world_normals_;
   libcgt::cuda::gl::Texture2D free_camera_world_positions_tex_;
   libcgt::cuda::gl::Texture2D free_camera_world_normals_tex_;
 
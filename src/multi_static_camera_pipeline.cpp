@@ -13,6 +13,10 @@
 // limitations under the License.
 #include "multi_static_camera_pipeline.h"
 
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+
 #include <gflags/gflags.h>
 
 #include <vector_functions.h>
@@ -21,11 +25,37 @@
 #include "libcgt/cuda/VecmathConversions.h"
 #include "libcgt/cuda/VectorFunctions.h"
 
+#include "perf_collector.h"
+#include "trace.h"
+
 using libcgt::core::arrayutils::cast;
 using libcgt::core::cameras::Intrinsics;
 using libcgt::core::vecmath::SimilarityTransform;
 
 DECLARE_bool(adaptive_raycast);
+DECLARE_string(depth_smoothing);
+DECLARE_double(depth_smoothing_range_sigma);
+DECLARE_double(depth_smoothing_spatial_sigma);
+DECLARE_bool(fused_depth_preprocessing);
+DECLARE_bool(ms_cached_projection);
+DECLARE_bool(ms_incremental_fusion);
+DECLARE_bool(texture_raycast);
+DECLARE_int32(tsdf_num_devices);
+DECLARE_string(tsdf_volume);
+DECLARE_int32(voxel_hash_max_blocks);
+
+namespace {
+
+// main() rejects invalid flags, see ParseDepthProcessorOptions().
+DepthProcessor::Options DepthProcessorOptionsFromFlags() {
+  DepthProcessor::Options options;
+  ParseDepthProcessorOptions(FLAGS_depth_smoothing,
+    FLAGS_depth_smoothing_spatial_sigma, FLAGS_depth_smoothing_range_sigma,
+    &options);
+  return options;
+}
+
+}  // namespace
 
 MultiStaticCameraPipeline::MultiStaticCameraPipeline(
   const std::vector<RGBDCameraParameters>& camera_params,
@@ -33,25 +63,75 @@ MultiStaticCameraPipeline::MultiStaticCameraPipeline(
   const Vector3i& grid_resolution,
   const SimilarityTransform& world_from_grid,
   float max_tsdf_value) :
-  regular_grid_(grid_resolution, world_from_grid, max_tsdf_value),
+  tsdf_(MakeTSDFVolume(FLAGS_tsdf_volume, grid_resolution, world_from_grid,
+    max_tsdf_value, FLAGS_voxel_hash_max_blocks,
+    FLAGS_tsdf_num_devices)),
 
   camera_params_(camera_params),
   depth_camera_poses_cfw_(depth_camera_poses_cfw),
 
   depth_processor_(camera_params[0].depth.intrinsics,
-                   camera_params[0].depth.depth_range) {
+                   camera_params[0].depth.depth_range,
+                   DepthProcessorOptionsFromFlags()) {
+  if (tsdf_ == nullptr) {
+    fprintf(stderr, "MultiStaticCameraPipeline: could not create a TSDF "
+      "volume of type \"%s\".\n", FLAGS_tsdf_volume.c_str());
+    exit(1);
+  }
 
+  DeviceArrayPool& pool = DeviceArrayPool::Get();
   for (size_t i = 0; i < camera_params.size(); ++i) {
-    depth_meters_.emplace_back(camera_params[i].depth.resolution);
-    depth_camera_undistort_maps_.emplace_back(
-      camera_params[i].depth.resolution);
-    undistorted_depth_meters_.emplace_back(camera_params[i].depth.resolution);
+    const Vector2i& depth_resolution = camera_params[i].depth.resolution;
+    depth_meters_.push_back(pool.Acquire2D<float>(depth_resolution));
+    depth_millimeters_ydown_.push_back(
+      pool.Acquire2D<uint16_t>(depth_resolution));
+    depth_camera_undistort_maps_.push_back(
+      pool.Acquire2D<float2>(depth_resolution));
+    undistorted_depth_meters_.push_back(
+      pool.Acquire2D<float>(depth_resolution));
+    incoming_camera_normals_.push_back(
+      pool.Acquire2D<float4>(depth_resolution));
     input_buffers_.emplace_back(camera_params[i].color.resolution,
                                 camera_params[i].depth.resolution);
 
     copy(cast<float2>(camera_params[i].depth.undistortion_map.readView()),
       depth_camera_undistort_maps_[i]);
   }
+  fusion_pending_.resize(camera_params.size(), false);
+
+  if (FLAGS_ms_cached_projection) {
+    std::vector<StaticDepthCamera> cameras(camera_params.size());
+    for (size_t i = 0; i < camera_params.size(); ++i) {
+      cameras[i].flpp = {
+        camera_params[i].depth.intrinsics.focalLength,
+        camera_params[i].depth.intrinsics.principalPoint
+      };
+      cameras[i].depth_range = camera_params[i].depth.depth_range;
+      cameras[i].camera_from_world = depth_camera_poses_cfw[i].asMatrix();
+      cameras[i].image_size = camera_params[i].depth.resolution;
+    }
+    // With --fused_depth_preprocessing, depth is undistorted and smoothed as
+    // it arrives, so the tables index the undistorted maps. Otherwise, they
+    // fold the undistortion in and fusion reads the raw maps.
+    projected_from_raw_depth_ = !FLAGS_fused_depth_preprocessing;
+    if (projected_from_raw_depth_) {
+      projections_cached_ = tsdf_->CacheProjections(cameras,
+        depth_camera_undistort_maps_);
+    } else {
+      projections_cached_ = tsdf_->CacheProjections(cameras, {});
+    }
+  }
+}
+
+MultiStaticCameraPipeline::~MultiStaticCameraPipeline() {
+  DeviceArrayPool& pool = DeviceArrayPool::Get();
+  for (size_t i = 0; i < depth_meters_.size(); ++i) {
+    pool.Release(std::move(depth_meters_[i]));
+    pool.Release(std::move(depth_millimeters_ydown_[i]));
+    pool.Release(std::move(depth_camera_undistort_maps_[i]));
+    pool.Release(std::move(undistorted_depth_meters_[i]));
+    pool.Release(std::move(incoming_camera_normals_[i]));
+  }
 }
 
 int MultiStaticCameraPipeline::NumCameras() const {
@@ -64,35 +144,65 @@ const RGBDCameraParameters& MultiStaticCameraPipeline::GetCameraParameters(
 }
 
 Box3f MultiStaticCameraPipeline::TSDFGridBoundingBox() const {
-  return regular_grid_.BoundingBox();
+  return tsdf_->BoundingBox();
 }
 
 const SimilarityTransform&
 MultiStaticCameraPipeline::TSDFWorldFromGridTransform() const {
-  return regular_grid_.WorldFromGrid();
+  return tsdf_->WorldFromGrid();
 }
 
 void MultiStaticCameraPipeline::Reset() {
-  regular_grid_.Reset();
+  tsdf_->Reset();
 }
 
 void MultiStaticCameraPipeline::NotifyInputUpdated(int camera_index,
                                                    bool color_updated,
                                                    bool depth_updated) {
-  copy(input_buffers_[camera_index].depth_meters.readView(),
-    depth_meters_[camera_index]);
+  const InputBuffer& input_buffer = input_buffers_[camera_index];
+  if (input_buffer.depth_is_raw) {
+    copy(input_buffer.depth_millimeters_ydown.readView(),
+      depth_millimeters_ydown_[camera_index]);
+    depth_processor_.ConvertRawDepth(depth_millimeters_ydown_[camera_index],
+      depth_meters_[camera_index]);
+  } else {
+    copy(input_buffer.depth_meters.readView(), depth_meters_[camera_index]);
+  }
 
-  depth_processor_.Undistort(
-    depth_meters_[camera_index], depth_camera_undistort_maps_[camera_index],
-    undistorted_depth_meters_[camera_index]);
+  if (FLAGS_fused_depth_preprocessing) {
+    depth_processor_.Preprocess(
+      depth_meters_[camera_index], depth_camera_undistort_maps_[camera_index],
+      undistorted_depth_meters_[camera_index],
+      incoming_camera_normals_[camera_index]);
+  } else {
+    // Undistorted together with the other cameras by UndistortPending().
+    undistort_pending_ = true;
+  }
+  if (depth_updated) {
+    fusion_pending_[camera_index] = true;
+  }
+}
+
+void MultiStaticCameraPipeline::UndistortPending() {
+  if (undistort_pending_) {
+    depth_processor_.UndistortMultiple(depth_meters_,
+      depth_camera_undistort_maps_, undistorted_depth_meters_);
+    undistort_pending_ = false;
+  }
 }
 
 InputBuffer& MultiStaticCameraPipeline::GetInputBuffer(int camera_index) {
   return input_buffers_[camera_index];
 }
 
+const DeviceArray2D<float>& MultiStaticCameraPipeline::GetDepthMap(
+  int camera_index) const {
+  return depth_meters_[camera_index];
+}
+
 const DeviceArray2D<float>& MultiStaticCameraPipeline::GetUndistortedDepthMap(
   int camera_index) {
+  UndistortPending();
   return undistorted_depth_meters_[camera_index];
 }
 
@@ -113,35 +223,116 @@ void MultiStaticCameraPipeline::Fuse() {
 
   // TODO: instead of N sweeps over the volume, for each voxel, can sweep
   // over cameras instead.
+  PerfCollector::Get().BeginFrame();
+  ScopedTraceRange trace("MultiStaticCameraPipeline::Fuse",
+    TraceCategory::VOLUME);
+  if (projections_cached_) {
+    std::vector<int> cameras;
+    for (int i = 0; i < NumCameras(); ++i) {
+      cameras.push_back(i);
+    }
+    if (FuseProjected(cameras)) {
+      PerfCollector::Get().EndFrame();
+      return;
+    }
+  }
+  UndistortPending();
   for (size_t i = 0; i < depth_meters_.size(); ++i) {
     Vector4f flpp = {
       camera_params_[i].depth.intrinsics.focalLength,
       camera_params_[i].depth.intrinsics.principalPoint
     };
-    regular_grid_.Fuse(
+    tsdf_->Fuse(
       flpp, camera_params_[i].depth.depth_range,
       depth_camera_poses_cfw_[i].asMatrix(),
       undistorted_depth_meters_[i]
     );
   }
+  PerfCollector::Get().EndFrame();
 }
 
-void MultiStaticCameraPipeline::FuseMultiple() {
-  std::vector<CalibratedPosedDepthCamera> c(3);
-  for (size_t i = 0; i < depth_meters_.size(); ++i) {
-    c[i].flpp = make_float4(
+bool MultiStaticCameraPipeline::FuseMultiple() {
+  std::vector<int> cameras;
+  for (int i = 0; i < NumCameras(); ++i) {
+    if (fusion_pending_[i]) {
+      cameras.push_back(i);
+    }
+  }
+  if (cameras.empty()) {
+    return false;
+  }
+  if (!FLAGS_ms_incremental_fusion) {
+    // Re-fuse everyone's latest frame into an empty volume.
+    tsdf_->Reset();
+    cameras.clear();
+    for (int i = 0; i < NumCameras(); ++i) {
+      cameras.push_back(i);
+    }
+  }
+
+  if (projections_cached_) {
+    PerfCollector::Get().BeginFrame();
+    ScopedTraceRange trace("MultiStaticCameraPipeline::FuseMultiple",
+      TraceCategory::VOLUME);
+    bool fused = FuseProjected(cameras);
+    PerfCollector::Get().EndFrame();
+    if (fused) {
+      fusion_pending_.assign(fusion_pending_.size(), false);
+      return true;
+    }
+  }
+
+  std::vector<CalibratedPosedDepthCamera> c(cameras.size());
+  for (size_t k = 0; k < cameras.size(); ++k) {
+    int i = cameras[k];
+    c[k].flpp = make_float4(
       make_float2(camera_params_[i].depth.intrinsics.focalLength),
       make_float2(camera_params_[i].depth.intrinsics.principalPoint)
     );
-    c[i].depth_min_max = make_float2(
+    c[k].depth_min_max = make_float2(
       camera_params_[i].depth.depth_range.leftRight()
     );
-    c[i].camera_from_world = make_float4x4(
+    c[k].camera_from_world = make_float4x4(
       depth_camera_poses_cfw_[i].asMatrix()
     );
   }
 
-  regular_grid_.FuseMultiple(c, undistorted_depth_meters_);
+  PerfCollector::Get().BeginFrame();
+  ScopedTraceRange trace("MultiStaticCameraPipeline::FuseMultiple",
+    TraceCategory::VOLUME);
+  UndistortPending();
+  if (cameras.size() == undistorted_depth_meters_.size()) {
+    tsdf_->FuseMultiple(c, undistorted_depth_meters_);
+  } else {
+    // Borrow the updated maps (moving a DeviceArray2D does not copy).
+    std::vector<DeviceArray2D<float>> depth_maps;
+    for (int i : cameras) {
+      depth_maps.push_back(std::move(undistorted_depth_meters_[i]));
+    }
+    tsdf_->FuseMultiple(c, depth_maps);
+    for (size_t k = 0; k < cameras.size(); ++k) {
+      undistorted_depth_meters_[cameras[k]] = std::move(depth_maps[k]);
+    }
+  }
+  PerfCollector::Get().EndFrame();
+
+  fusion_pending_.assign(fusion_pending_.size(), false);
+  return true;
+}
+
+bool MultiStaticCameraPipeline::FuseProjected(
+  const std::vector<int>& cameras) {
+  bool fused;
+  if (projected_from_raw_depth_) {
+    // The tables already account for undistortion: skip it.
+    fused = tsdf_->FuseProjected(cameras, depth_meters_);
+  } else {
+    UndistortPending();
+    fused = tsdf_->FuseProjected(cameras, undistorted_depth_meters_);
+  }
+  // The volume dropped its tables (e.g. it was moved or loaded).
+  projections_cached_ = fused;
+  return fused;
 }
 
 void MultiStaticCameraPipeline::Raycast(const PerspectiveCamera& camera,
@@ -150,26 +341,32 @@ void MultiStaticCameraPipeline::Raycast(const PerspectiveCamera& camera,
   Intrinsics intrinsics = camera.intrinsics(Vector2f(world_points.size()));
   Vector4f flpp{ intrinsics.focalLength, intrinsics.principalPoint };
 
+  RaycastSampling sampling = FLAGS_texture_raycast ?
+    RaycastSampling::TEXTURE : RaycastSampling::VOXEL_ARRAY;
   if (FLAGS_adaptive_raycast) {
-    regular_grid_.AdaptiveRaycast(
+    tsdf_->AdaptiveRaycast(
       flpp,
       camera.worldFromCamera().asMatrix(),
       world_points,
-      world_normals
+      world_normals,
+      0,
+      sampling
     );
   } else {
-    regular_grid_.Raycast(
+    tsdf_->Raycast(
       flpp,
       camera.worldFromCamera().asMatrix(),
       world_points,
-      world_normals
+      world_normals,
+      0,
+      sampling
     );
   }
 }
 
 TriangleMesh MultiStaticCameraPipeline::Triangulate(
-  const Matrix4f& output_from_world) const {
-  TriangleMesh mesh = regular_grid_.Triangulate();
+  const Matrix4f& output_from_world) {
+  TriangleMesh mesh = tsdf_->TriangulateIncremental();
 
   for (Vector3f& v : mesh.positions()) {
     v = output_from_world.transformPoint(v);
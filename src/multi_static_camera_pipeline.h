@@ -14,6 +14,8 @@
 #ifndef MULTI_STATIC_CAMERA_PIPELINE_H
 #define MULTI_STATIC_CAMERA_PIPELINE_H
 
+#include <memory>
+
 #include "libcgt/core/cameras/PerspectiveCamera.h"
 #include "libcgt/core/geometry/TriangleMesh.h"
 #include "libcgt/core/vecmath/Vector2i.h"
@@ -25,11 +27,12 @@
 
 #include "calibrated_posed_depth_camera.h"
 #include "depth_processor.h"
+#include "device_array_pool.h"
 #include "input_buffer.h"
 #include "pose_frame.h"
 #include "projective_point_plane_icp.h"
-#include "regular_grid_tsdf.h"
 #include "rgbd_camera_parameters.h"
+#include "tsdf_volume.h"
 
 class MultiStaticCameraPipeline {
 
@@ -45,6 +48,9 @@ class MultiStaticCameraPipeline {
     const SimilarityTransform& world_from_grid,
     float max_tsdf_value);
 
+  // Hands the per-camera buffers back to DeviceArrayPool::Get().
+  ~MultiStaticCameraPipeline();
+
   int NumCameras() const;
 
   const RGBDCameraParameters& GetCameraParameters(int camera_index) const;
@@ -55,40 +61,88 @@ class MultiStaticCameraPipeline {
 
   void Reset();
 
+  // Uploads the camera's depth. Without --fused_depth_preprocessing, its
+  // undistortion is deferred and batched with that of the other cameras, and
+  // runs on the first call to GetUndistortedDepthMap(), Fuse() or
+  // FuseMultiple().
   void NotifyInputUpdated(int camera_index,
     bool color_updated, bool depth_updated);
 
   InputBuffer& GetInputBuffer(int camera_index);
 
-  // Modified from the input...
+  // The camera's latest depth frame in meters, as uploaded (and converted if
+  // its input buffer held raw depth).
+  const DeviceArray2D<float>& GetDepthMap(int camera_index) const;
+
+  // Modified from the input... Smoothed as well with
+  // --fused_depth_preprocessing.
   const DeviceArray2D<float>& GetUndistortedDepthMap(int camera_index);
 
   PerspectiveCamera GetDepthCamera(int camera_index) const;
 
   // Update the regular grid with the latest image.
+  //
+  // With --ms_cached_projection, Fuse() and FuseMultiple() look up every
+  // voxel's pixel and depth in tables built once from the camera poses
+  // instead of projecting it, and without --fused_depth_preprocessing, they
+  // read the raw depth maps directly instead of undistorting them first.
   void Fuse();
 
-  void FuseMultiple();
+  // Fuses the cameras whose depth changed since the last call, in one sweep
+  // over the volume. With --ms_incremental_fusion, their frames are added to
+  // the running average of the ones already fused. Otherwise, the volume is
+  // cleared and every camera is fused again.
+  //
+  // Returns false, and does nothing, if no depth map changed.
+  bool FuseMultiple();
 
   void Raycast(const PerspectiveCamera& camera,
                DeviceArray2D<float4>& world_points,
                DeviceArray2D<float4>& world_normals);
 
   TriangleMesh Triangulate(
-    const Matrix4f& output_from_world = Matrix4f::identity()) const;
+    const Matrix4f& output_from_world = Matrix4f::identity());
 
  private:
+  // Undistorts all cameras in one batch if any depth map changed since the
+  // last call.
+  void UndistortPending();
+
+  // Fuses cameras through the volume's projection tables. Returns false, and
+  // clears projections_cached_, if the volume no longer has them.
+  bool FuseProjected(const std::vector<int>& cameras);
+
   // ----- Inputs -----
   std::vector<InputBuffer> input_buffers_;
 
   // ----- Intermediate buffers -----
+  // The per-camera buffers are plain DeviceArray2Ds, since they are passed
+  // on as vectors, but they come from DeviceArrayPool::Get().
+  //
   // Incoming raw depth frame in meters.
   std::vector<DeviceArray2D<float>> depth_meters_;
-  // Incoming raw depth, undistorted.
+  // Incoming raw depth frame in millimeters, when the input buffer's
+  // depth_is_raw is set. Converted into depth_meters_.
+  std::vector<DeviceArray2D<uint16_t>> depth_millimeters_ydown_;
+  // Incoming raw depth, undistorted. Also smoothed with
+  // --fused_depth_preprocessing.
   std::vector<DeviceArray2D<float>> undistorted_depth_meters_;
+  // Camera-space normals of undistorted_depth_meters_. Only written with
+  // --fused_depth_preprocessing.
+  std::vector<DeviceArray2D<float4>> incoming_camera_normals_;
+  // Set by NotifyInputUpdated() until UndistortPending() runs.
+  bool undistort_pending_ = false;
+  // Per camera: whether its depth changed since the last FuseMultiple().
+  std::vector<bool> fusion_pending_;
+  // Set when the volume cached the cameras' projections (see
+  // TSDFVolume::CacheProjections()), and whether the tables index the raw
+  // depth maps rather than the undistorted ones.
+  bool projections_cached_ = false;
+  bool projected_from_raw_depth_ = false;
 
   // ----- Data structure to store the TSDF -----
-  RegularGridTSDF regular_grid_;
+  // Selected with --tsdf_volume.
+  std::unique_ptr<TSDFVolume> tsdf_;
 
   // ----- Processors -----
   DepthProcessor depth_processor_;
@@ -0,0 +1,329 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "nvm_file.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "mapped_file.h"
+
+using std::vector;
+
+namespace {
+
+const char kMagic[] = "NVM_V3";
+
+// Lines are parsed in chunks of this many.
+const int kLinesPerChunk = 1024;
+
+// Numeric tokens are copied here to be terminated for strtod(): the mapping
+// is not.
+const int kMaxNumberLength = 63;
+
+// Calls f(i) for i in [0, count) on num_threads threads.
+template <typename F>
+void ParallelFor(int count, int num_threads, F f) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = std::max(1, std::min(num_threads, count));
+
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    for (int i = next++; i < count; i = next++) {
+      f(i);
+    }
+  };
+  vector<std::thread> threads;
+  for (int t = 1; t < num_threads; ++t) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& t : threads) {
+    t.join();
+  }
+}
+
+// A range of the mapped file: a line without its '\n', or a token.
+struct Span {
+  const char* begin;
+  const char* end;
+};
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Finds the next line of [*p, end) that is not blank and advances *p past
+// it. Returns false if there is none.
+bool NextNonblankLine(const char** p, const char* end, Span* line) {
+  while (*p < end) {
+    const char* begin = *p;
+    const char* newline = static_cast<const char*>(
+      memchr(begin, '\n', end - begin));
+    const char* line_end = newline != nullptr ? newline : end;
+    *p = newline != nullptr ? newline + 1 : end;
+
+    const char* c = begin;
+    while (c < line_end && IsSpace(*c)) {
+      ++c;
+    }
+    if (c < line_end) {
+      *line = { begin, line_end };
+      return true;
+    }
+  }
+  return false;
+}
+
+// Splits a line into whitespace-separated tokens, in place.
+class Tokenizer {
+ public:
+
+  explicit Tokenizer(const Span& line) :
+    p_(line.begin),
+    end_(line.end) {
+  }
+
+  bool Next(Span* token) {
+    while (p_ < end_ && IsSpace(*p_)) {
+      ++p_;
+    }
+    if (p_ == end_) {
+      return false;
+    }
+    token->begin = p_;
+    while (p_ < end_ && !IsSpace(*p_)) {
+      ++p_;
+    }
+    token->end = p_;
+    return true;
+  }
+
+  bool NextFloat(float* value) {
+    char buffer[kMaxNumberLength + 1];
+    char* number_end;
+    if (!NextNumber(buffer, &number_end)) {
+      return false;
+    }
+    char* parsed_end;
+    *value = strtof(buffer, &parsed_end);
+    return parsed_end == number_end;
+  }
+
+  bool NextInt(int* value) {
+    char buffer[kMaxNumberLength + 1];
+    char* number_end;
+    if (!NextNumber(buffer, &number_end)) {
+      return false;
+    }
+    char* parsed_end;
+    *value = static_cast<int>(strtol(buffer, &parsed_end, 10));
+    return parsed_end == number_end;
+  }
+
+ private:
+
+  // Copies the next token to buffer, terminated, and points number_end at
+  // its end.
+  bool NextNumber(char* buffer, char** number_end) {
+    Span token;
+    if (!Next(&token) || token.end - token.begin > kMaxNumberLength) {
+      return false;
+    }
+    size_t length = token.end - token.begin;
+    memcpy(buffer, token.begin, length);
+    buffer[length] = '\0';
+    *number_end = buffer + length;
+    return true;
+  }
+
+  const char* p_;
+  const char* end_;
+};
+
+// Reads a line holding only a nonnegative count.
+bool ReadCount(const char** p, const char* end, int* count) {
+  Span line;
+  if (!NextNonblankLine(p, end, &line)) {
+    return false;
+  }
+  Tokenizer tokens(line);
+  Span extra;
+  return tokens.NextInt(count) && *count >= 0 && !tokens.Next(&extra);
+}
+
+// Locates the next count nonblank lines.
+bool LocateLines(const char** p, const char* end, int count,
+  vector<Span>* lines) {
+  lines->resize(count);
+  for (int i = 0; i < count; ++i) {
+    if (!NextNonblankLine(p, end, &(*lines)[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ParseCamera(const Span& line, NVMCamera* camera) {
+  Tokenizer tokens(line);
+  Span filename;
+  if (!tokens.Next(&filename)) {
+    return false;
+  }
+  camera->filename.assign(filename.begin, filename.end);
+  if (!tokens.NextFloat(&camera->focal_length)) {
+    return false;
+  }
+  for (int j = 0; j < 4; ++j) {
+    if (!tokens.NextFloat(&camera->rotation[j])) {
+      return false;
+    }
+  }
+  for (int j = 0; j < 3; ++j) {
+    if (!tokens.NextFloat(&camera->center[j])) {
+      return false;
+    }
+  }
+  return tokens.NextFloat(&camera->radial_distortion);
+}
+
+// Appends the point's measurements to measurements and writes their number
+// to num_measurements.
+bool ParsePoint(const Span& line, Vector3f* position, Vector3i* color,
+  vector<NVMMeasurement>* measurements, int* num_measurements) {
+  Tokenizer tokens(line);
+  for (int j = 0; j < 3; ++j) {
+    if (!tokens.NextFloat(&(*position)[j])) {
+      return false;
+    }
+  }
+  for (int j = 0; j < 3; ++j) {
+    if (!tokens.NextInt(&(*color)[j])) {
+      return false;
+    }
+  }
+  if (!tokens.NextInt(num_measurements) || *num_measurements < 0) {
+    return false;
+  }
+  for (int k = 0; k < *num_measurements; ++k) {
+    NVMMeasurement m;
+    if (!tokens.NextInt(&m.camera) || !tokens.NextInt(&m.feature) ||
+      !tokens.NextFloat(&m.position.x) || !tokens.NextFloat(&m.position.y)) {
+      return false;
+    }
+    measurements->push_back(m);
+  }
+  return true;
+}
+
+int NumChunks(int num_lines) {
+  return (num_lines + kLinesPerChunk - 1) / kLinesPerChunk;
+}
+
+}  // namespace
+
+bool ReadNVMFile(const std::string& filename, NVMModel* model,
+  bool read_points, int num_threads) {
+  MappedFile file;
+  if (!file.Open(filename)) {
+    return false;
+  }
+  const char* p = reinterpret_cast<const char*>(file.Data());
+  const char* end = p + file.Size();
+
+  Span line;
+  const size_t kMagicLength = sizeof(kMagic) - 1;
+  if (!NextNonblankLine(&p, end, &line) ||
+    static_cast<size_t>(line.end - line.begin) < kMagicLength ||
+    memcmp(line.begin, kMagic, kMagicLength) != 0) {
+    return false;
+  }
+
+  // Cameras.
+  int num_cameras;
+  vector<Span> lines;
+  if (!ReadCount(&p, end, &num_cameras) ||
+    !LocateLines(&p, end, num_cameras, &lines)) {
+    return false;
+  }
+  model->cameras.assign(num_cameras, NVMCamera());
+  std::atomic<bool> ok(true);
+  ParallelFor(NumChunks(num_cameras), num_threads, [&](int chunk) {
+    int last = std::min((chunk + 1) * kLinesPerChunk, num_cameras);
+    for (int i = chunk * kLinesPerChunk; i < last && ok; ++i) {
+      if (!ParseCamera(lines[i], &model->cameras[i])) {
+        ok = false;
+      }
+    }
+  });
+  if (!ok) {
+    return false;
+  }
+
+  model->point_positions.clear();
+  model->point_colors.clear();
+  model->measurement_offsets.assign(1, 0);
+  model->measurements.clear();
+  if (!read_points) {
+    return true;
+  }
+
+  // Points. A model without any is allowed to end after its cameras.
+  const char* next_line = p;
+  if (!NextNonblankLine(&next_line, end, &line)) {
+    return true;
+  }
+  int num_points;
+  if (!ReadCount(&p, end, &num_points) ||
+    !LocateLines(&p, end, num_points, &lines)) {
+    return false;
+  }
+
+  // Each chunk collects its measurements separately; they are concatenated
+  // in order afterwards.
+  const int num_chunks = NumChunks(num_points);
+  vector<vector<NVMMeasurement>> chunk_measurements(num_chunks);
+  vector<int> num_measurements(num_points);
+  model->point_positions.resize(num_points);
+  model->point_colors.resize(num_points);
+  ParallelFor(num_chunks, num_threads, [&](int chunk) {
+    int last = std::min((chunk + 1) * kLinesPerChunk, num_points);
+    for (int i = chunk * kLinesPerChunk; i < last && ok; ++i) {
+      if (!ParsePoint(lines[i], &model->point_positions[i],
+        &model->point_colors[i], &chunk_measurements[chunk],
+        &num_measurements[i])) {
+        ok = false;
+      }
+    }
+  });
+  if (!ok) {
+    return false;
+  }
+
+  model->measurement_offsets.resize(num_points + 1);
+  for (int i = 0; i < num_points; ++i) {
+    model->measurement_offsets[i + 1] =
+      model->measurement_offsets[i] + num_measurements[i];
+  }
+  model->measurements.reserve(model->measurement_offsets.back());
+  for (const vector<NVMMeasurement>& measurements : chunk_measurements) {
+    model->measurements.insert(model->measurements.end(),
+      measurements.begin(), measurements.end());
+  }
+  return true;
+}
@@ -0,0 +1,77 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef NVM_FILE_H
+#define NVM_FILE_H
+
+#include <string>
+#include <vector>
+
+#include "libcgt/core/vecmath/Quat4f.h"
+#include "libcgt/core/vecmath/Vector2f.h"
+#include "libcgt/core/vecmath/Vector3f.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+
+// Reads the first model of a VisualSFM 'NVM_V3' (N-View Match) file:
+//
+// NVM_V3 [optional calibration]
+// <num_cameras>
+// <filename> <focal length> <quaternion wxyz> <camera center xyz>
+//   <radial distortion> 0                          (one line per camera)
+// <num_points>
+// <xyz> <rgb> <num_measurements> (<camera index> <feature index> <xy>)...
+//                                                  (one line per point)
+//
+// Blank lines between sections are ignored.
+
+struct NVMCamera {
+  std::string filename;
+  float focal_length;
+  // Rotates world coordinates into camera coordinates (w, x, y, z).
+  Quat4f rotation;
+  // The camera center, in world coordinates.
+  Vector3f center;
+  float radial_distortion;
+};
+
+// An observation of a point in one of the cameras.
+struct NVMMeasurement {
+  int camera;
+  int feature;
+  // Relative to the image center, in pixels.
+  Vector2f position;
+};
+
+struct NVMModel {
+  std::vector<NVMCamera> cameras;
+
+  std::vector<Vector3f> point_positions;
+  std::vector<Vector3i> point_colors;
+  // The measurements of point i are measurements[measurement_offsets[i]]
+  // until measurement_offsets[i + 1]. Has one more entry than
+  // point_positions.
+  std::vector<int> measurement_offsets;
+  std::vector<NVMMeasurement> measurements;
+};
+
+// Reads filename into model from a memory mapping, without copying lines.
+// The lines of each section are located in one pass, then parsed in chunks
+// by num_threads threads (one per hardware thread if num_threads <= 0).
+// Unless read_points, the point section is skipped and the point arrays are
+// left empty.
+//
+// Returns false if the file cannot be mapped or is malformed.
+bool ReadNVMFile(const std::string& filename, NVMModel* model,
+  bool read_points = true, int num_threads = 0);
+
+#endif  // NVM_FILE_H
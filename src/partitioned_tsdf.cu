@@ -0,0 +1,387 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "partitioned_tsdf.h"
+
+#include <algorithm>
+#include <cassert>
+#include <thread>
+
+#include <gflags/gflags.h>
+#include <helper_math.h>
+
+#include "libcgt/core/common/Array3D.h"
+#include "libcgt/cuda/MathUtils.h"
+#include "libcgt/cuda/ThreadMath.cuh"
+#include "libcgt/cuda/VecmathConversions.h"
+
+#include "marching_cubes.h"
+#include "tsdf_file.h"
+
+using libcgt::core::vecmath::SimilarityTransform;
+using libcgt::core::vecmath::inverse;
+using libcgt::cuda::contains;
+using libcgt::cuda::math::numBins2D;
+using libcgt::cuda::threadmath::threadSubscript2DGlobal;
+
+DECLARE_bool(collect_perf);
+
+namespace {
+
+// Keeps, per pixel, the valid point nearest to eye_world. If overwrite is
+// set, world_points_out and world_normals_out are first considered empty.
+__global__
+void CompositeRaycastKernel(float3 eye_world,
+  KernelArray2D<const float4> world_points,
+  KernelArray2D<const float4> world_normals,
+  bool overwrite,
+  KernelArray2D<float4> world_points_out,
+  KernelArray2D<float4> world_normals_out) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(world_points_out.size(), xy)) {
+    return;
+  }
+
+  float4 p = world_points[xy];
+  float4 q = overwrite ? float4{} : world_points_out[xy];
+  bool take = p.w > 0 && (q.w <= 0 ||
+    length(make_float3(p) - eye_world) < length(make_float3(q) - eye_world));
+  if (take || overwrite) {
+    world_points_out[xy] = take ? p : float4{};
+    world_normals_out[xy] = take ? world_normals[xy] : float4{};
+  }
+}
+
+// Copies src to dst, which must have the same size, possibly across devices.
+// Enqueued on stream, which must belong to the device that owns src.
+template <typename T>
+void CopyAcrossDevices(const DeviceArray2D<T>& src, DeviceArray2D<T>& dst,
+  cudaStream_t stream) {
+  assert(src.size() == dst.size());
+  cudaMemcpy2DAsync(dst.pointer(), dst.pitch(), src.pointer(), src.pitch(),
+    src.width() * sizeof(T), src.height(), cudaMemcpyDefault, stream);
+}
+
+// Makes device current for the lifetime of the guard.
+class ScopedDevice {
+ public:
+
+  explicit ScopedDevice(int device) {
+    cudaGetDevice(&previous_);
+    cudaSetDevice(device);
+  }
+
+  ~ScopedDevice() {
+    cudaSetDevice(previous_);
+  }
+
+ private:
+
+  int previous_;
+};
+
+}  // namespace
+
+PartitionedTSDF::PartitionedTSDF(const Vector3i& resolution,
+  const SimilarityTransform& world_from_grid,
+  float max_tsdf_value,
+  const std::vector<int>& devices) :
+  resolution_(resolution),
+  grid_from_world_(inverse(world_from_grid)),
+  world_from_grid_(world_from_grid),
+  max_tsdf_value_(max_tsdf_value) {
+  assert(!devices.empty());
+  assert(static_cast<int>(devices.size()) <= resolution.z);
+
+  cudaGetDevice(&main_device_);
+  cudaEventCreateWithFlags(&inputs_ready_, cudaEventDisableTiming);
+
+  const int num_slabs = static_cast<int>(devices.size());
+  for (int i = 0; i < num_slabs; ++i) {
+    std::unique_ptr<Slab> slab(new Slab);
+    slab->device = devices[i];
+    slab->z_begin = i * resolution.z / num_slabs;
+    slab->z_end = (i + 1) * resolution.z / num_slabs;
+    slab->z_origin = std::max(slab->z_begin - kSlabOverlap, 0);
+    int z_limit = std::min(slab->z_end + kSlabOverlap, resolution.z);
+
+    ScopedDevice scoped_device(slab->device);
+    slab->tsdf.reset(new RegularGridTSDF(
+      { resolution.x, resolution.y, z_limit - slab->z_origin },
+      SlabWorldFromGrid(*slab), max_tsdf_value));
+    cudaStreamCreate(&slab->stream);
+    cudaEventCreateWithFlags(&slab->done, cudaEventDisableTiming);
+    slabs_.push_back(std::move(slab));
+  }
+
+  if (FLAGS_collect_perf) {
+    for (const auto& slab : slabs_) {
+      printf("PartitionedTSDF: slab of slices [%d, %d) on device %d\n",
+        slab->z_begin, slab->z_end, slab->device);
+    }
+  }
+}
+
+PartitionedTSDF::~PartitionedTSDF() {
+  // Waits for each slab's pending work, then releases its event, stream and
+  // volume with its device current, since that device owns them.
+  // inputs_ready_ belongs to the main device.
+  for (auto& slab : slabs_) {
+    ScopedDevice scoped_device(slab->device);
+    cudaStreamSynchronize(slab->stream);
+    cudaEventDestroy(slab->done);
+    cudaStreamDestroy(slab->stream);
+    slab.reset();
+  }
+  ScopedDevice scoped_device(main_device_);
+  cudaEventDestroy(inputs_ready_);
+}
+
+void PartitionedTSDF::Reset() {
+  for (auto& slab : slabs_) {
+    ScopedDevice scoped_device(slab->device);
+    slab->tsdf->Reset();
+  }
+}
+
+void PartitionedTSDF::Fuse(const Vector4f& depth_camera_flpp,
+  const Range1f& depth_camera_range,
+  const Matrix4f& depth_camera_from_world,
+  const DeviceArray2D<float>& depth_data,
+  cudaStream_t stream,
+  FusionMethod method) {
+  cudaEventRecord(inputs_ready_, stream);
+
+  for (auto& slab : slabs_) {
+    ScopedDevice scoped_device(slab->device);
+    cudaStreamWaitEvent(slab->stream, inputs_ready_, 0);
+
+    const DeviceArray2D<float>* slab_depth_data = &depth_data;
+    if (slab->device != main_device_) {
+      slab->depth_data.resize(depth_data.size());
+      CopyAcrossDevices(depth_data, slab->depth_data, slab->stream);
+      slab_depth_data = &slab->depth_data;
+    }
+
+    slab->tsdf->Fuse(depth_camera_flpp, depth_camera_range,
+      depth_camera_from_world, *slab_depth_data, slab->stream, method);
+    cudaEventRecord(slab->done, slab->stream);
+  }
+
+  for (const auto& slab : slabs_) {
+    cudaStreamWaitEvent(stream, slab->done, 0);
+  }
+}
+
+void PartitionedTSDF::FuseMultiple(
+  const std::vector<CalibratedPosedDepthCamera>& depth_cameras,
+  const std::vector<DeviceArray2D<float>>& depth_maps,
+  cudaStream_t stream) {
+  assert(depth_cameras.size() == depth_maps.size());
+  cudaEventRecord(inputs_ready_, stream);
+
+  // RegularGridTSDF::FuseMultiple() synchronizes its stream, so give each
+  // device its own host thread.
+  std::vector<std::thread> threads;
+  for (auto& slab_ptr : slabs_) {
+    Slab* slab = slab_ptr.get();
+    threads.emplace_back([&, slab] {
+      cudaSetDevice(slab->device);
+      cudaStreamWaitEvent(slab->stream, inputs_ready_, 0);
+      if (slab->device == main_device_) {
+        slab->tsdf->FuseMultiple(depth_cameras, depth_maps, slab->stream);
+        return;
+      }
+
+      slab->depth_maps.resize(depth_maps.size());
+      for (size_t i = 0; i < depth_maps.size(); ++i) {
+        slab->depth_maps[i].resize(depth_maps[i].size());
+        CopyAcrossDevices(depth_maps[i], slab->depth_maps[i], slab->stream);
+      }
+      slab->tsdf->FuseMultiple(depth_cameras, slab->depth_maps,
+        slab->stream);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+void PartitionedTSDF::AdaptiveRaycast(const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out,
+  cudaStream_t stream,
+  RaycastSampling sampling) {
+  RaycastImpl(true, camera_flpp, world_from_camera,
+    world_points_out, world_normals_out, stream, sampling);
+}
+
+void PartitionedTSDF::Raycast(const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out,
+  cudaStream_t stream,
+  RaycastSampling sampling) {
+  RaycastImpl(false, camera_flpp, world_from_camera,
+    world_points_out, world_normals_out, stream, sampling);
+}
+
+void PartitionedTSDF::RaycastImpl(bool adaptive,
+  const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out,
+  cudaStream_t stream,
+  RaycastSampling sampling) {
+  cudaEventRecord(inputs_ready_, stream);
+
+  Vector2i size = world_points_out.size();
+  for (auto& slab : slabs_) {
+    if (slab->device != main_device_) {
+      slab->main_world_points.resize(size);
+      slab->main_world_normals.resize(size);
+    }
+
+    ScopedDevice scoped_device(slab->device);
+    cudaStreamWaitEvent(slab->stream, inputs_ready_, 0);
+    slab->world_points.resize(size);
+    slab->world_normals.resize(size);
+
+    if (adaptive) {
+      slab->tsdf->AdaptiveRaycast(camera_flpp, world_from_camera,
+        slab->world_points, slab->world_normals, slab->stream, sampling);
+    } else {
+      slab->tsdf->Raycast(camera_flpp, world_from_camera,
+        slab->world_points, slab->world_normals, slab->stream, sampling);
+    }
+
+    if (slab->device != main_device_) {
+      CopyAcrossDevices(slab->world_points, slab->main_world_points,
+        slab->stream);
+      CopyAcrossDevices(slab->world_normals, slab->main_world_normals,
+        slab->stream);
+    }
+    cudaEventRecord(slab->done, slab->stream);
+  }
+
+  Vector4f eye = world_from_camera * Vector4f(0, 0, 0, 1);
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = numBins2D({ size.x, size.y }, block_dim);
+  for (size_t i = 0; i < slabs_.size(); ++i) {
+    const Slab& slab = *(slabs_[i]);
+    bool on_main_device = slab.device == main_device_;
+    cudaStreamWaitEvent(stream, slab.done, 0);
+    CompositeRaycastKernel<<<grid_dim, block_dim, 0, stream>>>(
+      make_float3(eye.xyz),
+      on_main_device ? slab.world_points.readView() :
+        slab.main_world_points.readView(),
+      on_main_device ? slab.world_normals.readView() :
+        slab.main_world_normals.readView(),
+      i == 0,
+      world_points_out.writeView(),
+      world_normals_out.writeView());
+  }
+}
+
+const SimilarityTransform& PartitionedTSDF::GridFromWorld() const {
+  return grid_from_world_;
+}
+
+const SimilarityTransform& PartitionedTSDF::WorldFromGrid() const {
+  return world_from_grid_;
+}
+
+Box3f PartitionedTSDF::BoundingBox() const {
+  return Box3f(Resolution());
+}
+
+Vector3i PartitionedTSDF::Resolution() const {
+  return resolution_;
+}
+
+float PartitionedTSDF::VoxelSize() const {
+  return world_from_grid_.scale;
+}
+
+Vector3f PartitionedTSDF::SideLengths() const {
+  return VoxelSize() * Resolution();
+}
+
+TriangleMesh PartitionedTSDF::Triangulate() const {
+  Array3D<TSDF> grid(resolution_);
+  Download(grid.writeView());
+  return ParallelMarchingCubes(grid, max_tsdf_value_, world_from_grid_);
+}
+
+bool PartitionedTSDF::Load(const std::string& filename,
+  cudaStream_t stream) {
+  Array3D<TSDF> grid;
+  SimilarityTransform world_from_grid;
+  float max_tsdf_value;
+  if (!ReadTSDFFile(filename, &grid, &world_from_grid, &max_tsdf_value)) {
+    return false;
+  }
+  Vector3i size = grid.size();
+  if (size.x != resolution_.x || size.y != resolution_.y ||
+    size.z != resolution_.z) {
+    fprintf(stderr, "PartitionedTSDF::Load(): %s has resolution "
+      "%d x %d x %d, expected %d x %d x %d.\n", filename.c_str(),
+      size.x, size.y, size.z, resolution_.x, resolution_.y, resolution_.z);
+    return false;
+  }
+
+  world_from_grid_ = world_from_grid;
+  grid_from_world_ = inverse(world_from_grid_);
+  max_tsdf_value_ = max_tsdf_value;
+
+  const size_t slice_size = static_cast<size_t>(resolution_.x) * resolution_.y;
+  for (const auto& slab : slabs_) {
+    ScopedDevice scoped_device(slab->device);
+    Array3D<TSDF> slab_grid(slab->tsdf->Resolution());
+    std::copy(grid.pointer() + slab->z_origin * slice_size,
+      grid.pointer() + (slab->z_origin + slab_grid.size().z) * slice_size,
+      slab_grid.pointer());
+    slab->tsdf->Upload(slab_grid, SlabWorldFromGrid(*slab), max_tsdf_value);
+  }
+  return true;
+}
+
+bool PartitionedTSDF::Save(const std::string& filename) const {
+  Array3D<TSDF> grid(resolution_);
+  Download(grid.writeView());
+  return WriteTSDFFile(filename, grid, world_from_grid_, max_tsdf_value_);
+}
+
+void PartitionedTSDF::Download(Array3DWriteView<TSDF> grid) const {
+  const size_t slice_size = static_cast<size_t>(resolution_.x) * resolution_.y;
+  for (const auto& slab : slabs_) {
+    ScopedDevice scoped_device(slab->device);
+    Array3D<TSDF> slab_grid(slab->tsdf->Resolution());
+    slab->tsdf->Download(slab_grid.writeView());
+    std::copy(
+      slab_grid.pointer() + (slab->z_begin - slab->z_origin) * slice_size,
+      slab_grid.pointer() + (slab->z_end - slab->z_origin) * slice_size,
+      grid.pointer() + slab->z_begin * slice_size);
+  }
+}
+
+int PartitionedTSDF::NumSlabs() const {
+  return static_cast<int>(slabs_.size());
+}
+
+SimilarityTransform PartitionedTSDF::SlabWorldFromGrid(
+  const Slab& slab) const {
+  return world_from_grid_ *
+    SimilarityTransform(Vector3f(0, 0, static_cast<float>(slab.z_origin)));
+}
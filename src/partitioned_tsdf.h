@@ -0,0 +1,168 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef PARTITIONED_TSDF_H
+#define PARTITIONED_TSDF_H
+
+#include <memory>
+#include <vector>
+
+#include <cuda_runtime.h>
+
+#include "libcgt/core/common/Array3D.h"
+#include "libcgt/core/geometry/TriangleMesh.h"
+#include "libcgt/core/vecmath/Box3f.h"
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Range1f.h"
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+
+#include "calibrated_posed_depth_camera.h"
+#include "regular_grid_tsdf.h"
+#include "tsdf_volume.h"
+
+// A dense TSDF split across several GPUs.
+//
+// The grid is cut into one slab of z slices per device, and each slab is a
+// RegularGridTSDF on its device. Neighboring slabs overlap by
+// kSlabOverlap slices so that interpolation, and therefore raycasting, is
+// seamless across the cut.
+//
+// Depth maps are broadcast to every device and fused into all slabs
+// concurrently. Each slab is raycast on its own device and the nearest hit
+// along each ray is kept. Inputs and outputs live on the device that was
+// current at construction.
+class PartitionedTSDF : public TSDFVolume {
+public:
+
+  // Number of z slices each slab shares with each of its neighbors.
+  static constexpr int kSlabOverlap = 4;
+
+  // resolution, world_from_grid and max_tsdf_value are as for
+  // RegularGridTSDF. devices lists the CUDA devices to split the grid across,
+  // one slab each, lowest z first.
+  PartitionedTSDF(const Vector3i& resolution,
+    const SimilarityTransform& world_from_grid,
+    float max_tsdf_value,
+    const std::vector<int>& devices);
+
+  ~PartitionedTSDF() override;
+
+  PartitionedTSDF(const PartitionedTSDF& copy) = delete;
+  PartitionedTSDF& operator = (const PartitionedTSDF& copy) = delete;
+
+  void Reset() override;
+
+  // Returns once the slabs' work is enqueued. stream waits on it.
+  void Fuse(const Vector4f& depth_camera_flpp,
+    const Range1f& depth_camera_range,
+    const Matrix4f& depth_camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    cudaStream_t stream = 0,
+    FusionMethod method = FusionMethod::VOXEL_SWEEP) override;
+
+  // Fuses each slab on its own host thread.
+  void FuseMultiple(
+    const std::vector<CalibratedPosedDepthCamera>& depth_cameras,
+    const std::vector<DeviceArray2D<float>>& depth_maps,
+    cudaStream_t stream = 0) override;
+
+  void AdaptiveRaycast(const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) override;
+
+  void Raycast(const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) override;
+
+  const SimilarityTransform& GridFromWorld() const override;
+  const SimilarityTransform& WorldFromGrid() const override;
+  Box3f BoundingBox() const override;
+  Vector3i Resolution() const override;
+  float VoxelSize() const override;
+  Vector3f SideLengths() const override;
+
+  // Gathers the slabs on the host and meshes the whole grid there.
+  TriangleMesh Triangulate() const override;
+
+  // Same 'tsdf3d' format as RegularGridTSDF. Load() fails if the file's
+  // resolution differs from Resolution(). The slabs are uploaded on their own
+  // devices: stream is ignored.
+  bool Load(const std::string& filename, cudaStream_t stream = 0) override;
+  bool Save(const std::string& filename) const override;
+
+  // Gathers the slabs into grid, which must be Resolution() in size.
+  void Download(Array3DWriteView<TSDF> grid) const;
+
+  int NumSlabs() const;
+
+private:
+
+  struct Slab {
+    int device;
+
+    // The slices of the full grid this slab is responsible for, and the
+    // first slice it stores (z_begin - kSlabOverlap, clamped to the grid).
+    int z_begin;
+    int z_end;
+    int z_origin;
+
+    std::unique_ptr<RegularGridTSDF> tsdf;
+
+    // Owned by device.
+    cudaStream_t stream = 0;
+    cudaEvent_t done = nullptr;
+    DeviceArray2D<float> depth_data;
+    std::vector<DeviceArray2D<float>> depth_maps;
+    DeviceArray2D<float4> world_points;
+    DeviceArray2D<float4> world_normals;
+
+    // Owned by the main device: copies of world_points and world_normals to
+    // composite. Unused when device is the main device.
+    DeviceArray2D<float4> main_world_points;
+    DeviceArray2D<float4> main_world_normals;
+  };
+
+  void RaycastImpl(bool adaptive,
+    const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaStream_t stream,
+    RaycastSampling sampling);
+
+  // The slab's grid in full grid coordinates.
+  SimilarityTransform SlabWorldFromGrid(const Slab& slab) const;
+
+  Vector3i resolution_;
+  SimilarityTransform grid_from_world_;
+  SimilarityTransform world_from_grid_;
+  float max_tsdf_value_;
+
+  // The device current at construction. Holds all inputs and outputs.
+  int main_device_;
+  // Recorded on the caller's stream before the slabs start work.
+  cudaEvent_t inputs_ready_ = nullptr;
+
+  std::vector<std::unique_ptr<Slab>> slabs_;
+};
+
+#endif  // PARTITIONED_TSDF_H
@@ -0,0 +1,325 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "perf_collector.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <gflags/gflags.h>
+
+DECLARE_bool(collect_perf);
+
+namespace {
+
+// Nearest-rank percentile of sorted, which must not be empty.
+float Percentile(const std::vector<float>& sorted, float p) {
+  int rank = static_cast<int>(std::ceil(p * sorted.size())) - 1;
+  rank = std::max(0, std::min(rank, static_cast<int>(sorted.size()) - 1));
+  return sorted[rank];
+}
+
+float MillisecondsSince(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<float, std::milli>(
+    std::chrono::steady_clock::now() - t0).count();
+}
+
+}  // namespace
+
+void PerfCollector::Stage::Add(float milliseconds) {
+  if (window.size() < kWindowSize) {
+    window.push_back(milliseconds);
+  } else {
+    window[next] = milliseconds;
+  }
+  next = (next + 1) % kWindowSize;
+  ++count;
+  total_ms += milliseconds;
+  max_ms = std::max(max_ms, milliseconds);
+}
+
+// static
+PerfCollector& PerfCollector::Get() {
+  // Never destroyed: its events must not outlive the CUDA runtime.
+  static PerfCollector* collector = new PerfCollector;
+  return *collector;
+}
+
+// static
+bool PerfCollector::Enabled() {
+  return FLAGS_collect_perf;
+}
+
+void PerfCollector::BeginFrame() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  in_frame_ = true;
+  frame_start_ = std::chrono::steady_clock::now();
+}
+
+void PerfCollector::EndFrame() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (in_frame_) {
+    stages_[kFrameStage].Add(MillisecondsSince(frame_start_));
+    in_frame_ = false;
+  }
+  ResolveLocked(false);
+}
+
+void PerfCollector::AddSample(const std::string& stage, float milliseconds) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stages_[stage].Add(milliseconds);
+}
+
+void PerfCollector::IncrementCounter(const std::string& counter,
+  int64_t delta) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  counters_[counter] += delta;
+}
+
+void PerfCollector::UpdateCounterMax(const std::string& counter,
+  int64_t value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr = counters_.find(counter);
+  if (itr == counters_.end()) {
+    counters_[counter] = value;
+  } else {
+    itr->second = std::max(itr->second, value);
+  }
+}
+
+std::map<std::string, int64_t> PerfCollector::Counters() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return counters_;
+}
+
+void PerfCollector::AddGPUInterval(const std::string& stage,
+  cudaEvent_t start, cudaEvent_t stop) {
+  int device = 0;
+  cudaGetDevice(&device);
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_.push_back({ stage, device, start, stop });
+  if (pending_.size() > kMaxPendingIntervals) {
+    ResolveLocked(false);
+  }
+}
+
+cudaEvent_t PerfCollector::AcquireEvent() {
+  int device = 0;
+  cudaGetDevice(&device);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<cudaEvent_t>& free_events = free_events_[device];
+    if (!free_events.empty()) {
+      cudaEvent_t event = free_events.back();
+      free_events.pop_back();
+      return event;
+    }
+  }
+  cudaEvent_t event = nullptr;
+  cudaEventCreate(&event);
+  return event;
+}
+
+void PerfCollector::Synchronize() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ResolveLocked(true);
+}
+
+std::vector<PerfCollector::StageSummary> PerfCollector::Summaries() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ResolveLocked(true);
+  return SummariesLocked();
+}
+
+void PerfCollector::Print(FILE* fp) {
+  std::vector<StageSummary> summaries = Summaries();
+  fprintf(fp, "%-40s %8s %10s %10s %10s %10s %10s\n", "stage", "count",
+    "mean (ms)", "p50 (ms)", "p95 (ms)", "p99 (ms)", "max (ms)");
+  for (const StageSummary& s : summaries) {
+    fprintf(fp, "%-40s %8lld %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+      s.stage.c_str(), static_cast<long long>(s.count), s.mean_ms, s.p50_ms,
+      s.p95_ms, s.p99_ms, s.max_ms);
+  }
+
+  std::map<std::string, int64_t> counters = Counters();
+  if (!counters.empty()) {
+    fprintf(fp, "%-40s %8s\n", "counter", "value");
+    for (const auto& kv : counters) {
+      fprintf(fp, "%-40s %8lld\n", kv.first.c_str(),
+        static_cast<long long>(kv.second));
+    }
+  }
+}
+
+bool PerfCollector::WriteCSV(const std::string& filename) {
+  std::vector<StageSummary> summaries = Summaries();
+  FILE* fp = fopen(filename.c_str(), "w");
+  if (fp == nullptr) {
+    return false;
+  }
+  fprintf(fp, "stage,count,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+  for (const StageSummary& s : summaries) {
+    fprintf(fp, "%s,%lld,%f,%f,%f,%f,%f\n", s.stage.c_str(),
+      static_cast<long long>(s.count), s.mean_ms, s.p50_ms, s.p95_ms,
+      s.p99_ms, s.max_ms);
+  }
+  for (const auto& kv : Counters()) {
+    fprintf(fp, "%s,%lld,,,,,\n", kv.first.c_str(),
+      static_cast<long long>(kv.second));
+  }
+  return fclose(fp) == 0;
+}
+
+bool PerfCollector::WriteJSON(const std::string& filename) {
+  std::vector<StageSummary> summaries = Summaries();
+  FILE* fp = fopen(filename.c_str(), "w");
+  if (fp == nullptr) {
+    return false;
+  }
+  // Stage and counter names are C++ identifiers and literals: nothing to
+  // escape.
+  fprintf(fp, "{\n  \"stages\": [");
+  for (size_t i = 0; i < summaries.size(); ++i) {
+    const StageSummary& s = summaries[i];
+    fprintf(fp, "%s\n    { \"stage\": \"%s\", \"count\": %lld, "
+      "\"mean_ms\": %f, \"p50_ms\": %f, \"p95_ms\": %f, \"p99_ms\": %f, "
+      "\"max_ms\": %f }", i == 0 ? "" : ",", s.stage.c_str(),
+      static_cast<long long>(s.count), s.mean_ms, s.p50_ms, s.p95_ms,
+      s.p99_ms, s.max_ms);
+  }
+  fprintf(fp, "\n  ],\n  \"counters\": {");
+  std::map<std::string, int64_t> counters = Counters();
+  for (auto itr = counters.begin(); itr != counters.end(); ++itr) {
+    fprintf(fp, "%s\n    \"%s\": %lld", itr == counters.begin() ? "" : ",",
+      itr->first.c_str(), static_cast<long long>(itr->second));
+  }
+  fprintf(fp, "\n  }\n}\n");
+  return fclose(fp) == 0;
+}
+
+void PerfCollector::Report(const std::string& csv_filename,
+  const std::string& json_filename) {
+  if (!Enabled()) {
+    return;
+  }
+  Print(stdout);
+  if (!csv_filename.empty() && !WriteCSV(csv_filename)) {
+    fprintf(stderr, "Failed to write performance statistics to %s.\n",
+      csv_filename.c_str());
+  }
+  if (!json_filename.empty() && !WriteJSON(json_filename)) {
+    fprintf(stderr, "Failed to write performance statistics to %s.\n",
+      json_filename.c_str());
+  }
+}
+
+void PerfCollector::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ResolveLocked(true);
+  stages_.clear();
+  counters_.clear();
+  in_frame_ = false;
+}
+
+void PerfCollector::ResolveLocked(bool wait) {
+  int previous_device = 0;
+  cudaGetDevice(&previous_device);
+  int current_device = previous_device;
+
+  size_t num_pending = 0;
+  for (PendingInterval& interval : pending_) {
+    if (interval.device != current_device) {
+      cudaSetDevice(interval.device);
+      current_device = interval.device;
+    }
+    cudaError_t status = wait ? cudaEventSynchronize(interval.stop) :
+      cudaEventQuery(interval.stop);
+    if (status == cudaErrorNotReady) {
+      pending_[num_pending++] = interval;
+      continue;
+    }
+    float milliseconds = 0.0f;
+    if (status == cudaSuccess &&
+      cudaEventElapsedTime(&milliseconds, interval.start, interval.stop) ==
+        cudaSuccess) {
+      stages_[interval.stage].Add(milliseconds);
+    }
+    ReleaseEventLocked(interval.device, interval.start);
+    ReleaseEventLocked(interval.device, interval.stop);
+  }
+  pending_.resize(num_pending);
+
+  if (current_device != previous_device) {
+    cudaSetDevice(previous_device);
+  }
+}
+
+void PerfCollector::ReleaseEventLocked(int device, cudaEvent_t event) {
+  free_events_[device].push_back(event);
+}
+
+std::vector<PerfCollector::StageSummary>
+PerfCollector::SummariesLocked() const {
+  std::vector<StageSummary> summaries;
+  for (const auto& kv : stages_) {
+    const Stage& stage = kv.second;
+    if (stage.count == 0) {
+      continue;
+    }
+    std::vector<float> sorted = stage.window;
+    std::sort(sorted.begin(), sorted.end());
+
+    StageSummary s;
+    s.stage = kv.first;
+    s.count = stage.count;
+    s.mean_ms = static_cast<float>(stage.total_ms / stage.count);
+    s.max_ms = stage.max_ms;
+    s.p50_ms = Percentile(sorted, 0.50f);
+    s.p95_ms = Percentile(sorted, 0.95f);
+    s.p99_ms = Percentile(sorted, 0.99f);
+    summaries.push_back(s);
+  }
+  return summaries;
+}
+
+ScopedGPUTimer::ScopedGPUTimer(const char* stage, cudaStream_t stream) :
+  stage_(stage),
+  stream_(stream) {
+  if (PerfCollector::Enabled()) {
+    start_ = PerfCollector::Get().AcquireEvent();
+    cudaEventRecord(start_, stream_);
+  }
+}
+
+ScopedGPUTimer::~ScopedGPUTimer() {
+  if (start_ != nullptr) {
+    PerfCollector& collector = PerfCollector::Get();
+    cudaEvent_t stop = collector.AcquireEvent();
+    cudaEventRecord(stop, stream_);
+    collector.AddGPUInterval(stage_, start_, stop);
+  }
+}
+
+ScopedCPUTimer::ScopedCPUTimer(const char* stage) :
+  stage_(stage),
+  enabled_(PerfCollector::Enabled()) {
+  if (enabled_) {
+    start_ = std::chrono::steady_clock::now();
+  }
+}
+
+ScopedCPUTimer::~ScopedCPUTimer() {
+  if (enabled_) {
+    PerfCollector::Get().AddSample(stage_, MillisecondsSince(start_));
+  }
+}
@@ -0,0 +1,198 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef PERF_COLLECTOR_H
+#define PERF_COLLECTOR_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cuda_runtime.h>
+
+// Collects timings of the pipeline stages when --collect_perf is set.
+//
+// GPU stages are timed with a pair of CUDA events recorded on their stream
+// (see ScopedGPUTimer). Recording never synchronizes: finished intervals are
+// resolved lazily, at the end of each frame and whenever statistics are
+// requested. CPU stages are timed with a steady clock (see ScopedCPUTimer).
+//
+// Each stage keeps its last kWindowSize samples, from which rolling
+// percentiles are computed, plus running totals over its whole life. The time
+// between BeginFrame() and EndFrame() is recorded as the stage kFrameStage.
+//
+// All methods are thread safe.
+class PerfCollector {
+ public:
+
+  // Number of recent samples per stage that percentiles are computed from.
+  static constexpr int kWindowSize = 1024;
+
+  static constexpr const char* kFrameStage = "frame";
+
+  struct StageSummary {
+    std::string stage;
+    // Over the stage's whole life.
+    int64_t count = 0;
+    float mean_ms = 0.0f;
+    float max_ms = 0.0f;
+    // Over the last kWindowSize samples.
+    float p50_ms = 0.0f;
+    float p95_ms = 0.0f;
+    float p99_ms = 0.0f;
+  };
+
+  // The collector every stage reports into.
+  static PerfCollector& Get();
+
+  // Whether --collect_perf is set. When it is not, the scoped timers do
+  // nothing.
+  static bool Enabled();
+
+  PerfCollector(const PerfCollector& copy) = delete;
+  PerfCollector& operator = (const PerfCollector& copy) = delete;
+
+  void BeginFrame();
+
+  // Records the frame time and resolves the GPU intervals that have finished,
+  // without waiting for the others.
+  void EndFrame();
+
+  void AddSample(const std::string& stage, float milliseconds);
+
+  // Adds the interval between two events recorded on the current device. The
+  // collector takes ownership of both events.
+  void AddGPUInterval(const std::string& stage, cudaEvent_t start,
+    cudaEvent_t stop);
+
+  // Counters are integers reported after the stages, such as the statistics
+  // of a queue. IncrementCounter() adds delta. UpdateCounterMax() keeps the
+  // largest value it was given.
+  void IncrementCounter(const std::string& counter, int64_t delta = 1);
+  void UpdateCounterMax(const std::string& counter, int64_t value);
+
+  // Every counter, sorted by name.
+  std::map<std::string, int64_t> Counters();
+
+  // An event with timing enabled, on the current device, from a pool.
+  cudaEvent_t AcquireEvent();
+
+  // Waits for every pending GPU interval and resolves it.
+  void Synchronize();
+
+  // Synchronize()s, then summarizes every stage, sorted by name.
+  std::vector<StageSummary> Summaries();
+
+  // Prints Summaries() as a table.
+  void Print(FILE* fp);
+
+  // Write Summaries() with one stage per row / object, then Counters(). In
+  // the .csv file, a counter is a row with only a name and a count. Return
+  // false if the file cannot be written.
+  bool WriteCSV(const std::string& filename);
+  bool WriteJSON(const std::string& filename);
+
+  // Prints the summaries to stdout and writes them to the non-empty
+  // filenames. Does nothing unless Enabled().
+  void Report(const std::string& csv_filename,
+    const std::string& json_filename);
+
+  // Forgets every sample and counter.
+  void Clear();
+
+ private:
+
+  // Past this many unresolved intervals, AddGPUInterval() resolves the
+  // finished ones itself, so that callers without frames stay bounded.
+  static constexpr size_t kMaxPendingIntervals = 256;
+
+  struct Stage {
+    std::vector<float> window;
+    size_t next = 0;
+    int64_t count = 0;
+    double total_ms = 0.0;
+    float max_ms = 0.0f;
+
+    void Add(float milliseconds);
+  };
+
+  struct PendingInterval {
+    std::string stage;
+    int device;
+    cudaEvent_t start;
+    cudaEvent_t stop;
+  };
+
+  PerfCollector() = default;
+
+  // These require mutex_ to be held.
+  // If wait, blocks until every pending interval has finished.
+  void ResolveLocked(bool wait);
+  void ReleaseEventLocked(int device, cudaEvent_t event);
+  std::vector<StageSummary> SummariesLocked() const;
+
+  std::mutex mutex_;
+  std::map<std::string, Stage> stages_;
+  std::map<std::string, int64_t> counters_;
+  std::vector<PendingInterval> pending_;
+  // Per device.
+  std::map<int, std::vector<cudaEvent_t>> free_events_;
+
+  bool in_frame_ = false;
+  std::chrono::steady_clock::time_point frame_start_;
+};
+
+// Times the GPU work enqueued on stream between construction and destruction,
+// as stage. Does nothing unless PerfCollector::Enabled(). The stream must
+// belong to the current device.
+class ScopedGPUTimer {
+ public:
+
+  // stage must outlive the timer.
+  ScopedGPUTimer(const char* stage, cudaStream_t stream = 0);
+  ~ScopedGPUTimer();
+
+  ScopedGPUTimer(const ScopedGPUTimer& copy) = delete;
+  ScopedGPUTimer& operator = (const ScopedGPUTimer& copy) = delete;
+
+ private:
+
+  const char* stage_;
+  cudaStream_t stream_;
+  cudaEvent_t start_ = nullptr;
+};
+
+// Times the host between construction and destruction, as stage. Does nothing
+// unless PerfCollector::Enabled().
+class ScopedCPUTimer {
+ public:
+
+  // stage must outlive the timer.
+  explicit ScopedCPUTimer(const char* stage);
+  ~ScopedCPUTimer();
+
+  ScopedCPUTimer(const ScopedCPUTimer& copy) = delete;
+  ScopedCPUTimer& operator = (const ScopedCPUTimer& copy) = delete;
+
+ private:
+
+  const char* stage_;
+  bool enabled_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif  // PERF_COLLECTOR_H
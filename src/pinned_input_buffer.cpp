@@ -0,0 +1,132 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "pinned_input_buffer.h"
+
+#include <cassert>
+#include <utility>
+
+#include "trace.h"
+
+namespace {
+
+// If array cannot be pinned, copies to and from it are from pageable memory:
+// slower, and synchronous with the host, but still correct. Unpin() then
+// fails harmlessly on it. Either error is cleared.
+template <typename T>
+void Pin(Array2D<T>& array) {
+  if (cudaHostRegister(array.pointer(),
+    array.width() * array.height() * sizeof(T),
+    cudaHostRegisterPortable) != cudaSuccess) {
+    cudaGetLastError();
+  }
+}
+
+template <typename T>
+void Unpin(Array2D<T>& array) {
+  if (array.pointer() != nullptr &&
+    cudaHostUnregister(array.pointer()) != cudaSuccess) {
+    cudaGetLastError();
+  }
+}
+
+template <typename T>
+void UploadAsync(const Array2D<T>& src_array, DeviceArray2D<T>& dst,
+  cudaStream_t stream) {
+  assert(dst.size() == src_array.size());
+  Array2DReadView<T> src = src_array.readView();
+  cudaMemcpy2DAsync(dst.pointer(), dst.pitch(),
+    src.pointer(), src.stride().y,
+    src.width() * sizeof(T), src.height(),
+    cudaMemcpyHostToDevice, stream);
+}
+
+}  // namespace
+
+PinnedInputBuffer::PinnedInputBuffer(const Vector2i& color_resolution,
+  const Vector2i& depth_resolution, int num_depth_slots) :
+  InputBuffer(color_resolution, depth_resolution) {
+  assert(num_depth_slots >= 2);
+
+  Pin(depth_meters);
+  Pin(depth_millimeters_ydown);
+  cudaEventCreateWithFlags(&depth_uploaded_, cudaEventDisableTiming);
+
+  for (int i = 0; i < num_depth_slots - 1; ++i) {
+    spare_depth_meters_.emplace_back(depth_resolution);
+    Pin(spare_depth_meters_.back());
+    spare_depth_millimeters_ydown_.emplace_back(depth_resolution);
+    Pin(spare_depth_millimeters_ydown_.back());
+
+    cudaEvent_t e;
+    cudaEventCreateWithFlags(&e, cudaEventDisableTiming);
+    spare_depth_uploaded_.push_back(e);
+  }
+}
+
+PinnedInputBuffer::~PinnedInputBuffer() {
+  // Don't unpin memory that a copy may still be reading.
+  cudaEventSynchronize(depth_uploaded_);
+  cudaEventDestroy(depth_uploaded_);
+  Unpin(depth_meters);
+  Unpin(depth_millimeters_ydown);
+  for (size_t i = 0; i < spare_depth_meters_.size(); ++i) {
+    cudaEventSynchronize(spare_depth_uploaded_[i]);
+    cudaEventDestroy(spare_depth_uploaded_[i]);
+    Unpin(spare_depth_meters_[i]);
+    Unpin(spare_depth_millimeters_ydown_[i]);
+  }
+}
+
+void PinnedInputBuffer::UploadDepth(DeviceArray2D<float>& dst,
+  cudaStream_t stream) {
+  ScopedTraceRange trace("PinnedInputBuffer::UploadDepth",
+    TraceCategory::UPLOAD);
+  UploadAsync(depth_meters, dst, stream);
+  Rotate(stream);
+}
+
+void PinnedInputBuffer::UploadRawDepth(DeviceArray2D<uint16_t>& dst,
+  cudaStream_t stream) {
+  ScopedTraceRange trace("PinnedInputBuffer::UploadRawDepth",
+    TraceCategory::UPLOAD);
+  UploadAsync(depth_millimeters_ydown, dst, stream);
+  Rotate(stream);
+}
+
+void PinnedInputBuffer::Rotate(cudaStream_t stream) {
+  cudaEventRecord(depth_uploaded_, stream);
+
+  // Swapping only exchanges pointers, so every slot stays pinned.
+  std::swap(depth_meters, spare_depth_meters_[next_spare_]);
+  std::swap(depth_millimeters_ydown,
+    spare_depth_millimeters_ydown_[next_spare_]);
+  std::swap(depth_uploaded_, spare_depth_uploaded_[next_spare_]);
+  latest_spare_ = next_spare_;
+  next_spare_ = (next_spare_ + 1) %
+    static_cast<int>(spare_depth_meters_.size());
+
+  // The caller is about to overwrite the new slot.
+  cudaEventSynchronize(depth_uploaded_);
+}
+
+Array2DReadView<float> PinnedInputBuffer::LatestDepthMeters() const {
+  if (latest_spare_ < 0) {
+    return depth_meters;
+  }
+  return spare_depth_meters_[latest_spare_];
+}
+
+int PinnedInputBuffer::NumDepthSlots() const {
+  return static_cast<int>(spare_depth_meters_.size()) + 1;
+}
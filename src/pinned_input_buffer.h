@@ -0,0 +1,87 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef PINNED_INPUT_BUFFER_H
+#define PINNED_INPUT_BUFFER_H
+
+#include <cstdint>
+#include <vector>
+
+#include <cuda_runtime.h>
+
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/vecmath/Vector2i.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+
+#include "input_buffer.h"
+
+// An InputBuffer whose depth images are page-locked and rotate through
+// several slots, so that RgbdInput::read() can fill depth_meters (or
+// depth_millimeters_ydown) while the previous frame is still being copied to
+// the GPU.
+//
+// Color images and metadata are not rotated. They keep their values
+// until the next read, just like a plain InputBuffer.
+class PinnedInputBuffer : public InputBuffer {
+ public:
+
+  static constexpr int kDefaultNumDepthSlots = 2;
+
+  // num_depth_slots must be at least 2.
+  PinnedInputBuffer(const Vector2i& color_resolution,
+    const Vector2i& depth_resolution,
+    int num_depth_slots = kDefaultNumDepthSlots);
+  ~PinnedInputBuffer();
+
+  PinnedInputBuffer(const PinnedInputBuffer& copy) = delete;
+  PinnedInputBuffer& operator = (const PinnedInputBuffer& copy) = delete;
+
+  // Enqueues an asynchronous copy of depth_meters to dst on stream.
+  // depth_meters then moves to the next slot. If that slot's previous upload
+  // is still in flight, this blocks until it finishes.
+  //
+  // After this returns, the contents of depth_meters are stale. Use
+  // LatestDepthMeters() to see the frame that was just uploaded.
+  void UploadDepth(DeviceArray2D<float>& dst, cudaStream_t stream = 0);
+
+  // Same as UploadDepth(), but copies depth_millimeters_ydown. Use when
+  // depth_is_raw is set.
+  void UploadRawDepth(DeviceArray2D<uint16_t>& dst, cudaStream_t stream = 0);
+
+  // The depth frame that was uploaded most recently, or depth_meters if
+  // nothing has been uploaded yet.
+  Array2DReadView<float> LatestDepthMeters() const;
+
+  int NumDepthSlots() const;
+
+ private:
+
+  // Records the upload's event and moves to the next slot.
+  void Rotate(cudaStream_t stream);
+
+  // The slots not currently in depth_meters and depth_millimeters_ydown, and
+  // the event recorded after each one's last upload.
+  std::vector<Array2D<float>> spare_depth_meters_;
+  std::vector<Array2D<uint16_t>> spare_depth_millimeters_ydown_;
+  std::vector<cudaEvent_t> spare_depth_uploaded_;
+
+  // Recorded after the last upload from depth_meters.
+  cudaEvent_t depth_uploaded_ = nullptr;
+
+  // Index into spare_depth_meters_ of the next slot to swap in.
+  int next_spare_ = 0;
+  // Index into spare_depth_meters_ of the slot uploaded last, or -1.
+  int latest_spare_ = -1;
+};
+
+#endif  // PINNED_INPUT_BUFFER_H
@@ -0,0 +1,201 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "ply_mesh_writer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+// Wide enough for any count: the header is written before the counts are
+// known and patched in place by Close().
+const int kCountDigits = 20;
+
+// Faces are copied from the temporary file in chunks of this size.
+const size_t kCopyChunkBytes = 1 << 20;
+
+template <typename T>
+uint8_t* Put(uint8_t* dst, T value) {
+  memcpy(dst, &value, sizeof(T));
+  return dst + sizeof(T);
+}
+
+int8_t QuantizeNormalComponent(float n) {
+  float q = std::round(127.0f * n);
+  return static_cast<int8_t>(std::max(-127.0f, std::min(q, 127.0f)));
+}
+
+// Writes "element <name> " followed by a zero-padded count and returns the
+// offset of the count.
+long WriteElement(FILE* fp, const char* name, size_t count) {
+  fprintf(fp, "element %s ", name);
+  long offset = ftell(fp);
+  fprintf(fp, "%0*zu\n", kCountDigits, count);
+  return offset;
+}
+
+}  // namespace
+
+PLYMeshWriter::~PLYMeshWriter() {
+  if (file_ != nullptr) {
+    fclose(file_);
+  }
+  if (faces_ != nullptr) {
+    fclose(faces_);
+  }
+}
+
+bool PLYMeshWriter::Open(const std::string& filename,
+  const Options& options) {
+  if (file_ != nullptr || faces_ != nullptr) {
+    return false;
+  }
+  file_ = fopen(filename.c_str(), "wb");
+  if (file_ == nullptr) {
+    return false;
+  }
+  faces_ = tmpfile();
+  if (faces_ == nullptr) {
+    fclose(file_);
+    file_ = nullptr;
+    return false;
+  }
+
+  options_ = options;
+  num_vertices_ = 0;
+  num_faces_ = 0;
+
+  const char* normal_type = options.quantize_normals ? "char" : "float";
+  fprintf(file_, "ply\nformat binary_little_endian 1.0\n");
+  vertex_count_offset_ = WriteElement(file_, "vertex", 0);
+  fprintf(file_, "property float x\nproperty float y\nproperty float z\n");
+  fprintf(file_, "property %s nx\nproperty %s ny\nproperty %s nz\n",
+    normal_type, normal_type, normal_type);
+  face_count_offset_ = WriteElement(file_, "face", 0);
+  fprintf(file_, "property list uchar int vertex_indices\nend_header\n");
+  ok_ = ferror(file_) == 0;
+  return ok_;
+}
+
+void PLYMeshWriter::AppendVertices(const Vector3f* positions,
+  const Vector3f* normals, size_t count) {
+  const size_t stride = 3 * sizeof(float) +
+    3 * (options_.quantize_normals ? sizeof(int8_t) : sizeof(float));
+  buffer_.resize(stride * count);
+  uint8_t* dst = buffer_.data();
+  for (size_t i = 0; i < count; ++i) {
+    dst = Put(dst, positions[i].x);
+    dst = Put(dst, positions[i].y);
+    dst = Put(dst, positions[i].z);
+    if (options_.quantize_normals) {
+      dst = Put(dst, QuantizeNormalComponent(normals[i].x));
+      dst = Put(dst, QuantizeNormalComponent(normals[i].y));
+      dst = Put(dst, QuantizeNormalComponent(normals[i].z));
+    } else {
+      dst = Put(dst, normals[i].x);
+      dst = Put(dst, normals[i].y);
+      dst = Put(dst, normals[i].z);
+    }
+  }
+  ok_ = ok_ && fwrite(buffer_.data(), 1, buffer_.size(), file_) ==
+    buffer_.size();
+  num_vertices_ += count;
+}
+
+void PLYMeshWriter::AppendFaces(const Vector3i* faces, size_t count) {
+  const size_t stride = sizeof(uint8_t) + 3 * sizeof(int32_t);
+  buffer_.resize(stride * count);
+  uint8_t* dst = buffer_.data();
+  for (size_t i = 0; i < count; ++i) {
+    dst = Put<uint8_t>(dst, 3);
+    dst = Put<int32_t>(dst, faces[i].x);
+    dst = Put<int32_t>(dst, faces[i].y);
+    dst = Put<int32_t>(dst, faces[i].z);
+  }
+  ok_ = ok_ && fwrite(buffer_.data(), 1, buffer_.size(), faces_) ==
+    buffer_.size();
+  num_faces_ += count;
+}
+
+size_t PLYMeshWriter::NumVertices() const {
+  return num_vertices_;
+}
+
+size_t PLYMeshWriter::NumFaces() const {
+  return num_faces_;
+}
+
+bool PLYMeshWriter::Close() {
+  if (file_ == nullptr) {
+    return false;
+  }
+
+  rewind(faces_);
+  buffer_.resize(kCopyChunkBytes);
+  while (ok_) {
+    size_t num_read = fread(buffer_.data(), 1, buffer_.size(), faces_);
+    if (num_read == 0) {
+      ok_ = ferror(faces_) == 0;
+      break;
+    }
+    ok_ = fwrite(buffer_.data(), 1, num_read, file_) == num_read;
+  }
+  fclose(faces_);
+  faces_ = nullptr;
+  buffer_.clear();
+  buffer_.shrink_to_fit();
+
+  if (ok_) {
+    ok_ = fseek(file_, vertex_count_offset_, SEEK_SET) == 0 &&
+      fprintf(file_, "%0*zu", kCountDigits, num_vertices_) > 0 &&
+      fseek(file_, face_count_offset_, SEEK_SET) == 0 &&
+      fprintf(file_, "%0*zu", kCountDigits, num_faces_) > 0;
+  }
+  ok_ = (fclose(file_) == 0) && ok_;
+  file_ = nullptr;
+  return ok_;
+}
+
+bool WritePLYMesh(const TriangleMesh& mesh, const std::string& filename,
+  const PLYMeshWriter::Options& options) {
+  PLYMeshWriter writer;
+  if (!writer.Open(filename, options)) {
+    return false;
+  }
+  writer.AppendVertices(mesh.positions().data(), mesh.normals().data(),
+    mesh.positions().size());
+  writer.AppendFaces(mesh.faces().data(), mesh.faces().size());
+  return writer.Close();
+}
+
+bool IsPLYFilename(const std::string& filename) {
+  const std::string kExtension = ".ply";
+  if (filename.size() < kExtension.size()) {
+    return false;
+  }
+  std::string extension = filename.substr(filename.size() - kExtension.size());
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+    [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  return extension == kExtension;
+}
+
+bool SaveTriangleMesh(const TriangleMesh& mesh, const std::string& filename,
+  const PLYMeshWriter::Options& options) {
+  if (IsPLYFilename(filename)) {
+    return WritePLYMesh(mesh, filename, options);
+  }
+  return mesh.saveOBJ(filename);
+}
@@ -0,0 +1,99 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef PLY_MESH_WRITER_H
+#define PLY_MESH_WRITER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "libcgt/core/geometry/TriangleMesh.h"
+#include "libcgt/core/vecmath/Vector3f.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+
+// Writes a triangle mesh as binary (little endian) PLY a batch of vertices
+// and faces at a time, so that a mesher can stream its output to disk
+// instead of building a TriangleMesh first.
+//
+// PLY stores every vertex before the first face. Vertices go straight to the
+// file while faces are spooled to an anonymous temporary file and appended by
+// Close(), which also fills in the element counts of the header. Memory use
+// is bounded by the largest batch.
+class PLYMeshWriter {
+ public:
+
+  struct Options {
+    // Store normals as three signed bytes (round(127 * n)) instead of three
+    // floats: 15 instead of 24 bytes per vertex.
+    bool quantize_normals = false;
+  };
+
+  PLYMeshWriter() = default;
+  // Closes the files without completing the header if Close() was not
+  // called.
+  ~PLYMeshWriter();
+
+  PLYMeshWriter(const PLYMeshWriter& copy) = delete;
+  PLYMeshWriter& operator = (const PLYMeshWriter& copy) = delete;
+
+  // Creates filename and writes the header. Returns false if filename or the
+  // temporary file cannot be created.
+  bool Open(const std::string& filename,
+    const Options& options = Options());
+
+  // Appends count vertices, numbered in order from 0 across calls.
+  void AppendVertices(const Vector3f* positions, const Vector3f* normals,
+    size_t count);
+
+  // Appends count triangles. They may index any vertex, including ones
+  // appended later.
+  void AppendFaces(const Vector3i* faces, size_t count);
+
+  size_t NumVertices() const;
+  size_t NumFaces() const;
+
+  // Appends the faces to the vertices and writes the final counts into the
+  // header. Returns false if any write since Open() failed.
+  bool Close();
+
+ private:
+
+  FILE* file_ = nullptr;
+  FILE* faces_ = nullptr;
+  Options options_;
+  bool ok_ = false;
+
+  size_t num_vertices_ = 0;
+  size_t num_faces_ = 0;
+  // Where the zero-padded counts start in the header.
+  long vertex_count_offset_ = 0;
+  long face_count_offset_ = 0;
+
+  // Batches are encoded here and written with one call.
+  std::vector<uint8_t> buffer_;
+};
+
+// Writes mesh as binary PLY with a PLYMeshWriter.
+bool WritePLYMesh(const TriangleMesh& mesh, const std::string& filename,
+  const PLYMeshWriter::Options& options = PLYMeshWriter::Options());
+
+// True if filename ends in ".ply" (in any case).
+bool IsPLYFilename(const std::string& filename);
+
+// Saves mesh as binary PLY if filename ends in ".ply" and as OBJ otherwise.
+bool SaveTriangleMesh(const TriangleMesh& mesh, const std::string& filename,
+  const PLYMeshWriter::Options& options = PLYMeshWriter::Options());
+
+#endif  // PLY_MESH_WRITER_H
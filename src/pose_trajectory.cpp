@@ -0,0 +1,99 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "pose_trajectory.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "libcgt/core/vecmath/EuclideanTransform.h"
+
+using libcgt::core::vecmath::lerp;
+
+PoseTrajectory::PoseTrajectory(std::vector<PoseFrame> poses) :
+  poses_(std::move(poses)) {
+  std::stable_sort(poses_.begin(), poses_.end(),
+    [](const PoseFrame& x, const PoseFrame& y) {
+      return x.timestamp_ns < y.timestamp_ns;
+    });
+
+  index_from_timestamp_.reserve(poses_.size());
+  index_from_frame_index_.reserve(poses_.size());
+  for (int i = 0; i < static_cast<int>(poses_.size()); ++i) {
+    // emplace() does not overwrite, so the first pose wins.
+    index_from_timestamp_.emplace(poses_[i].timestamp_ns, i);
+    index_from_frame_index_.emplace(poses_[i].frame_index, i);
+  }
+}
+
+bool PoseTrajectory::IsEmpty() const {
+  return poses_.empty();
+}
+
+int PoseTrajectory::Size() const {
+  return static_cast<int>(poses_.size());
+}
+
+const std::vector<PoseFrame>& PoseTrajectory::Poses() const {
+  return poses_;
+}
+
+const PoseFrame* PoseTrajectory::FindByTimestamp(int64_t timestamp_ns) const {
+  auto itr = index_from_timestamp_.find(timestamp_ns);
+  if (itr == index_from_timestamp_.end()) {
+    return nullptr;
+  }
+  return &(poses_[itr->second]);
+}
+
+const PoseFrame* PoseTrajectory::FindByFrameIndex(int32_t frame_index) const {
+  auto itr = index_from_frame_index_.find(frame_index);
+  if (itr == index_from_frame_index_.end()) {
+    return nullptr;
+  }
+  return &(poses_[itr->second]);
+}
+
+bool PoseTrajectory::Interpolate(int64_t timestamp_ns,
+  PoseFrame* pose) const {
+  auto itr = std::lower_bound(poses_.begin(), poses_.end(), timestamp_ns,
+    [](const PoseFrame& p, int64_t t) {
+      return p.timestamp_ns < t;
+    });
+
+  // Past the end.
+  if (itr == poses_.end()) {
+    return false;
+  }
+  if (itr->timestamp_ns == timestamp_ns) {
+    *pose = *itr;
+    return true;
+  }
+  // Before the beginning: there is no earlier pose to interpolate from.
+  if (itr == poses_.begin()) {
+    return false;
+  }
+
+  const PoseFrame& p0 = *(itr - 1);
+  const PoseFrame& p1 = *itr;
+  float f = static_cast<float>(timestamp_ns - p0.timestamp_ns) /
+    (p1.timestamp_ns - p0.timestamp_ns);
+
+  pose->frame_index = p0.frame_index;
+  pose->timestamp_ns = timestamp_ns;
+  pose->color_camera_from_world = lerp(p0.color_camera_from_world,
+    p1.color_camera_from_world, f);
+  pose->depth_camera_from_world = lerp(p0.depth_camera_from_world,
+    p1.depth_camera_from_world, f);
+  return true;
+}
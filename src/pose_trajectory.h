@@ -0,0 +1,61 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef POSE_TRAJECTORY_H
+#define POSE_TRAJECTORY_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "pose_frame.h"
+
+// An immutable camera path, sorted by timestamp, with constant time lookups
+// by exact timestamp or frame index and logarithmic time interpolation at
+// arbitrary timestamps.
+class PoseTrajectory {
+ public:
+
+  PoseTrajectory() = default;
+
+  // poses does not need to be sorted. Poses with equal timestamps keep their
+  // relative order. Lookups return the first of several poses with the same
+  // timestamp or frame index.
+  explicit PoseTrajectory(std::vector<PoseFrame> poses);
+
+  bool IsEmpty() const;
+  int Size() const;
+
+  // Sorted by timestamp.
+  const std::vector<PoseFrame>& Poses() const;
+
+  // Returns nullptr if no pose has this timestamp.
+  const PoseFrame* FindByTimestamp(int64_t timestamp_ns) const;
+
+  // Returns nullptr if no pose has this frame index.
+  const PoseFrame* FindByFrameIndex(int32_t frame_index) const;
+
+  // Interpolates between the two poses bracketing timestamp_ns (rotations
+  // spherically, translations linearly) and writes the result, with the
+  // frame index of the earlier pose, to pose. An exact match is returned as
+  // is. Returns false if timestamp_ns is outside the trajectory.
+  bool Interpolate(int64_t timestamp_ns, PoseFrame* pose) const;
+
+ private:
+
+  std::vector<PoseFrame> poses_;
+  std::unordered_map<int64_t, int> index_from_timestamp_;
+  std::unordered_map<int32_t, int> index_from_frame_index_;
+};
+
+#endif  // POSE_TRAJECTORY_H
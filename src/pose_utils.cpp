@@ -13,6 +13,10 @@
 // limitations under the License.
 #include "pose_utils.h"
 
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
 #include "libcgt/camera_wrappers/PoseStream.h"
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 
@@ -23,9 +27,10 @@ using libcgt::camera_wrappers::PoseStreamMetadata;
 using libcgt::camera_wrappers::PoseStreamTransformDirection;
 using libcgt::camera_wrappers::PoseStreamUnits;
 using libcgt::core::vecmath::EuclideanTransform;
+using libcgt::core::vecmath::inverse;
 using libcgt::core::vecmath::transformPoint;
 
-std::vector<PoseFrame> LoadPoseHistory(const std::string& filename,
+PoseTrajectory LoadPoseHistory(const std::string& filename,
   const EuclideanTransform& depth_from_color) {
   std::vector<PoseFrame> output;
 
@@ -41,7 +46,7 @@ std::vector<PoseFrame> LoadPoseHistory(const std::string& filename,
     }
   }
 
-  return output;
+  return PoseTrajectory(std::move(output));
 }
 
 bool SavePoseHistory(const std::vector<PoseFrame>& poses,
@@ -66,3 +71,18 @@ bool SavePoseHistory(const std::vector<PoseFrame>& poses,
   }
   return true;
 }
+
+float RotationAngleBetween(const EuclideanTransform& a,
+  const EuclideanTransform& b) {
+  Matrix3f delta = a.rotation.transposed() * b.rotation;
+  float cos_angle =
+    0.5f * (delta(0, 0) + delta(1, 1) + delta(2, 2) - 1.0f);
+  return std::acos(std::max(-1.0f, std::min(cos_angle, 1.0f)));
+}
+
+float CameraCenterDistance(const EuclideanTransform& a_camera_from_world,
+  const EuclideanTransform& b_camera_from_world) {
+  Vector3f a_eye = inverse(a_camera_from_world).translation;
+  Vector3f b_eye = inverse(b_camera_from_world).translation;
+  return (a_eye - b_eye).norm();
+}
@@ -20,11 +20,24 @@
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 
 #include "pose_frame.h"
+#include "pose_trajectory.h"
 
-std::vector<PoseFrame> LoadPoseHistory(const std::string& filename,
+// The trajectory is empty if the file cannot be read.
+PoseTrajectory LoadPoseHistory(const std::string& filename,
   const libcgt::core::vecmath::EuclideanTransform& depth_from_color);
 
 bool SavePoseHistory(const std::vector<PoseFrame>& pose_history,
   const std::string& filename);
 
+// The angle, in radians, of the rotation that takes a's rotation to b's.
+float RotationAngleBetween(
+  const libcgt::core::vecmath::EuclideanTransform& a,
+  const libcgt::core::vecmath::EuclideanTransform& b);
+
+// The distance between the camera centers of two camera_from_world
+// transformations.
+float CameraCenterDistance(
+  const libcgt::core::vecmath::EuclideanTransform& a_camera_from_world,
+  const libcgt::core::vecmath::EuclideanTransform& b_camera_from_world);
+
 #endif  // POSE_UTILS_H
@@ -0,0 +1,209 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "progressive_raycast.h"
+
+#include <algorithm>
+
+#include <helper_math.h>
+
+#include "libcgt/cuda/MathUtils.h"
+#include "libcgt/cuda/ThreadMath.cuh"
+#include "libcgt/cuda/VecmathConversions.h"
+
+#include "camera_math.cuh"
+
+using libcgt::cuda::contains;
+using libcgt::cuda::math::numBins2D;
+using libcgt::cuda::threadmath::threadSubscript2DGlobal;
+
+namespace {
+
+constexpr unsigned long long kNoReprojectedPoint = ~0ull;
+
+// Nearest neighbor upsampling of the coarse raycast.
+__global__
+void UpsampleRaycastKernel(KernelArray2D<const float4> coarse_world_points,
+  KernelArray2D<const float4> coarse_world_normals,
+  int downsample_factor,
+  KernelArray2D<float4> world_points,
+  KernelArray2D<float4> world_normals) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(world_points.size(), xy)) {
+    return;
+  }
+
+  int2 coarse_size = coarse_world_points.size();
+  int2 coarse_xy = {
+    min(xy.x / downsample_factor, coarse_size.x - 1),
+    min(xy.y / downsample_factor, coarse_size.y - 1)
+  };
+  world_points[xy] = coarse_world_points[coarse_xy];
+  world_normals[xy] = coarse_world_normals[coarse_xy];
+}
+
+// Projects each valid point of the previous result into the new view and
+// keeps, for every hole it lands on, the nearest one.
+__global__
+void ReprojectRaycastKernel(KernelArray2D<const float4> previous_world_points,
+  float4 flpp,
+  float4x4 camera_from_world,
+  KernelArray2D<const float4> world_points,
+  KernelArray2D<unsigned long long> nearest_reprojected) {
+  int2 xy = threadSubscript2DGlobal();
+  int2 size = previous_world_points.size();
+  if (!contains(size, xy)) {
+    return;
+  }
+
+  float4 world_point = previous_world_points[xy];
+  if (world_point.w <= 0) {
+    return;
+  }
+
+  float3 pixel = PixelFromWorld(make_float3(world_point), camera_from_world,
+    flpp);
+  if (pixel.z <= 0) {
+    return;
+  }
+  int2 target = { static_cast<int>(floorf(pixel.x)),
+    static_cast<int>(floorf(pixel.y)) };
+  if (!contains(world_points.size(), target) || world_points[target].w > 0) {
+    return;
+  }
+
+  // Positive floats order the same as their bit patterns.
+  unsigned long long key =
+    (static_cast<unsigned long long>(__float_as_uint(pixel.z)) << 32) |
+    static_cast<unsigned int>(xy.y * size.x + xy.x);
+  atomicMin(&(nearest_reprojected[target]), key);
+}
+
+__global__
+void ResolveReprojectionKernel(
+  KernelArray2D<const float4> previous_world_points,
+  KernelArray2D<const float4> previous_world_normals,
+  KernelArray2D<const unsigned long long> nearest_reprojected,
+  KernelArray2D<float4> world_points,
+  KernelArray2D<float4> world_normals,
+  cudaSurfaceObject_t world_points_surface,
+  cudaSurfaceObject_t world_normals_surface) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(world_points.size(), xy)) {
+    return;
+  }
+
+  unsigned long long key = nearest_reprojected[xy];
+  if (key != kNoReprojectedPoint) {
+    int index = static_cast<int>(key & 0xffffffffull);
+    int width = previous_world_points.width();
+    int2 source = { index % width, index / width };
+    world_points[xy] = previous_world_points[source];
+    world_normals[xy] = previous_world_normals[source];
+  }
+
+  // Every pixel is final here, so this is the pass that fills the surfaces.
+  if (world_points_surface != 0) {
+    surf2Dwrite(world_points[xy], world_points_surface,
+      xy.x * sizeof(float4), xy.y);
+  }
+  if (world_normals_surface != 0) {
+    surf2Dwrite(world_normals[xy], world_normals_surface,
+      xy.x * sizeof(float4), xy.y);
+  }
+}
+
+}  // namespace
+
+ProgressiveRaycast::ProgressiveRaycast(int downsample_factor) :
+  downsample_factor_(downsample_factor) {
+}
+
+void ProgressiveRaycast::Resize(const Vector2i& size) {
+  Vector2i coarse_size = {
+    std::max(1, size.x / downsample_factor_),
+    std::max(1, size.y / downsample_factor_)
+  };
+  coarse_world_points_.resize(coarse_size);
+  coarse_world_normals_.resize(coarse_size);
+  for (int i = 0; i < 2; ++i) {
+    world_points_[i].resize(size);
+    world_normals_[i].resize(size);
+    world_points_[i].fill(float4{});
+    world_normals_[i].fill(float4{});
+  }
+  nearest_reprojected_.resize(size);
+}
+
+Vector2i ProgressiveRaycast::Size() const {
+  return world_points_[current_].size();
+}
+
+int ProgressiveRaycast::DownsampleFactor() const {
+  return downsample_factor_;
+}
+
+DeviceArray2D<float4>& ProgressiveRaycast::CoarseWorldPoints() {
+  return coarse_world_points_;
+}
+
+DeviceArray2D<float4>& ProgressiveRaycast::CoarseWorldNormals() {
+  return coarse_world_normals_;
+}
+
+DeviceArray2D<float4>& ProgressiveRaycast::WorldPoints() {
+  return world_points_[current_];
+}
+
+DeviceArray2D<float4>& ProgressiveRaycast::WorldNormals() {
+  return world_normals_[current_];
+}
+
+void ProgressiveRaycast::ComposeCoarse(const Vector4f& flpp,
+  const Matrix4f& camera_from_world,
+  cudaSurfaceObject_t world_points_surface,
+  cudaSurfaceObject_t world_normals_surface,
+  cudaStream_t stream) {
+  const int previous = current_;
+  current_ = 1 - current_;
+
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = numBins2D(
+    { world_points_[current_].width(), world_points_[current_].height() },
+    block_dim
+  );
+
+  UpsampleRaycastKernel<<<grid_dim, block_dim, 0, stream>>>(
+    coarse_world_points_.readView(),
+    coarse_world_normals_.readView(),
+    downsample_factor_,
+    world_points_[current_].writeView(),
+    world_normals_[current_].writeView());
+
+  nearest_reprojected_.fill(kNoReprojectedPoint);
+  ReprojectRaycastKernel<<<grid_dim, block_dim, 0, stream>>>(
+    world_points_[previous].readView(),
+    make_float4(flpp),
+    make_float4x4(camera_from_world),
+    world_points_[current_].readView(),
+    nearest_reprojected_.writeView());
+
+  ResolveReprojectionKernel<<<grid_dim, block_dim, 0, stream>>>(
+    world_points_[previous].readView(),
+    world_normals_[previous].readView(),
+    nearest_reprojected_.readView(),
+    world_points_[current_].writeView(),
+    world_normals_[current_].writeView(),
+    world_points_surface,
+    world_normals_surface);
+}
@@ -0,0 +1,84 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef PROGRESSIVE_RAYCAST_H
+#define PROGRESSIVE_RAYCAST_H
+
+#include <cuda_runtime.h>
+
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Vector2i.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+
+// A free camera raycast that can be computed at reduced resolution while the
+// camera moves and refined to full resolution once it stops.
+//
+// A coarse pass raycasts the volume into CoarseWorldPoints() and
+// CoarseWorldNormals(), then ComposeCoarse() upsamples it to full resolution.
+// Pixels the coarse rays missed are filled by reprojecting the previous
+// full resolution result into the new view. A refinement pass raycasts
+// directly into WorldPoints() and WorldNormals().
+class ProgressiveRaycast {
+ public:
+
+  // downsample_factor: ratio between the full and coarse resolutions.
+  explicit ProgressiveRaycast(int downsample_factor);
+
+  // Reallocates all buffers for a full resolution of size. The previous
+  // result is discarded.
+  void Resize(const Vector2i& size);
+
+  // The full resolution.
+  Vector2i Size() const;
+
+  int DownsampleFactor() const;
+
+  DeviceArray2D<float4>& CoarseWorldPoints();
+  DeviceArray2D<float4>& CoarseWorldNormals();
+
+  // The current full resolution result.
+  DeviceArray2D<float4>& WorldPoints();
+  DeviceArray2D<float4>& WorldNormals();
+
+  // Replaces WorldPoints() and WorldNormals() with the coarse raycast,
+  // upsampled to full resolution. Pixels where the coarse raycast missed take
+  // the nearest point of the previous result that projects onto them through
+  // flpp (full resolution intrinsics) and camera_from_world, if any.
+  //
+  // If not zero, the surfaces (of float4 CUDA arrays at full resolution, such
+  // as mapped GL textures) also receive the composed result.
+  void ComposeCoarse(const Vector4f& flpp, const Matrix4f& camera_from_world,
+    cudaSurfaceObject_t world_points_surface = 0,
+    cudaSurfaceObject_t world_normals_surface = 0,
+    cudaStream_t stream = 0);
+
+ private:
+
+  int downsample_factor_;
+
+  DeviceArray2D<float4> coarse_world_points_;
+  DeviceArray2D<float4> coarse_world_normals_;
+
+  // Double buffered so that the previous result can be reprojected while
+  // the next one is composed. current_ indexes the current result.
+  DeviceArray2D<float4> world_points_[2];
+  DeviceArray2D<float4> world_normals_[2];
+  int current_ = 0;
+
+  // Per pixel (depth bits << 32 | source pixel index) of the nearest
+  // reprojected point.
+  DeviceArray2D<unsigned long long> nearest_reprojected_;
+};
+
+#endif  // PROGRESSIVE_RAYCAST_H
@@ -13,22 +13,20 @@
 // limitations under the License.
 #include "projective_point_plane_icp.h"
 
-#include <chrono>
+#include <cassert>
 
 #include <helper_math.h>
 
-#include <thrust/execution_policy.h>
-#include <thrust/reduce.h>
-
 #include "libcgt/core/vecmath/Quat4f.h"
-#include "libcgt/core/time/TimeUtils.h"
-#include "libcgt/cuda/Event.h"
 #include "libcgt/cuda/MathUtils.h"
 #include "libcgt/cuda/Rect2i.h"
 #include "libcgt/cuda/ThreadMath.cuh"
 #include "libcgt/cuda/VecmathConversions.h"
 
 #include "camera_math.cuh"
+#include "compact_raycast.cuh"
+#include "perf_collector.h"
+#include "trace.h"
 
 using libcgt::cuda::contains;
 using libcgt::cuda::math::floorToInt;
@@ -54,48 +52,245 @@ struct Plus {
   }
 };
 
-// TODO(jiawen): make a version without debug output
+// Halves the resolution of a depth map. Each output pixel is the average of
+// the valid depths in its 2x2 block that are within max_depth_difference of
+// the block's top left depth.
 __global__
-void ICPKernel(
-  float4 flpp, // depth camera intrinsics
+void DownsampleDepthKernel(KernelArray2D<const float> src,
   float2 depth_min_max,
-  float4x4 model_from_world,   // known model pose
-  float4x4 model_from_current, // current pose estimate
-  float4x4 current_from_model, // current pose estimate
-  KernelArray2D<const float> depth_map,
-  KernelArray2D<const float4> normal_map,
-  KernelArray2D<const float4> world_points,
-  KernelArray2D<const float4> world_normals,
+  float max_depth_difference,
+  KernelArray2D<float> dst) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(dst.size(), xy)) {
+    return;
+  }
+
+  int2 src_xy = 2 * xy;
+  float z0 = src[src_xy];
+  float sum = 0.0f;
+  int count = 0;
+  if (z0 >= depth_min_max.x && z0 <= depth_min_max.y) {
+    for (int dy = 0; dy < 2; ++dy) {
+      for (int dx = 0; dx < 2; ++dx) {
+        float z = src[src_xy + int2{ dx, dy }];
+        if (z >= depth_min_max.x && z <= depth_min_max.y &&
+          fabsf(z - z0) <= max_depth_difference) {
+          sum += z;
+          ++count;
+        }
+      }
+    }
+  }
+  dst[xy] = count > 0 ? sum / count : 0.0f;
+}
+
+// Halves the resolution of a normal map by averaging the valid (w != 0)
+// normals in each 2x2 block and renormalizing.
+__global__
+void DownsampleNormalsKernel(KernelArray2D<const float4> src,
+  KernelArray2D<float4> dst) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(dst.size(), xy)) {
+    return;
+  }
+
+  int2 src_xy = 2 * xy;
+  float3 sum = {};
+  for (int dy = 0; dy < 2; ++dy) {
+    for (int dx = 0; dx < 2; ++dx) {
+      float4 n = src[src_xy + int2{ dx, dy }];
+      if (n.w != 0) {
+        sum += make_float3(n);
+      }
+    }
+  }
+
+  float len_squared = lengthSquared(sum);
+  dst[xy] = len_squared > 0.0f ?
+    make_float4(sum / sqrt(len_squared), 1.0f) :
+    float4{};
+}
+
+// Halves the resolution of a raycast image by keeping the top left sample of
+// each 2x2 block. Raycast points and normals are only meaningful as a pair,
+// so they are subsampled rather than averaged. T is float4 or, for compact
+// raycasts, uint2.
+template <typename T>
+__global__
+void SubsampleKernel(KernelArray2D<const T> src,
+  KernelArray2D<T> dst) {
+  int2 xy = threadSubscript2DGlobal();
+  if (contains(dst.size(), xy)) {
+    dst[xy] = src[2 * xy];
+  }
+}
+
+// ICPKernel must be launched with kICPBlockWidth x kICPBlockWidth blocks.
+constexpr int kICPBlockWidth = 16;
+constexpr int kICPBlockSize = kICPBlockWidth * kICPBlockWidth;
+
+// Also the number of threads of ICPSolveKernel.
+constexpr int kICPSolveThreads = 256;
+
+// Apply the rigid transform whose first three rows are m.
+__inline__ __device__
+float3 TransformPoint3x4(const float4 m[3], float3 p) {
+  return{
+    dot(make_float3(m[0]), p) + m[0].w,
+    dot(make_float3(m[1]), p) + m[1].w,
+    dot(make_float3(m[2]), p) + m[2].w
+  };
+}
+
+__inline__ __device__
+float3 TransformVector3x4(const float4 m[3], float3 v) {
+  return{
+    dot(make_float3(m[0]), v),
+    dot(make_float3(m[1]), v),
+    dot(make_float3(m[2]), v)
+  };
+}
+
+// Sums the kNumThreads values in shared, one per thread, into shared[0].
+// Always adds in the same order, so results are reproducible.
+template <int kNumThreads>
+__inline__ __device__
+void BlockReduce(ICPLeastSquaresData* shared, int tid) {
+  for (int stride = kNumThreads / 2; stride > 0; stride /= 2) {
+    if (tid < stride) {
+      shared[tid] = Plus()(shared[tid], shared[tid + stride]);
+    }
+    __syncthreads();
+  }
+}
+
+// Weight of a residual r. See ICPRobustWeight.
+template <ICPRobustWeight kWeight>
+__inline__ __device__
+float RobustWeight(float r, float scale);
+
+template <>
+__inline__ __device__
+float RobustWeight<ICPRobustWeight::NONE>(float r, float scale) {
+  return 1.0f;
+}
+
+template <>
+__inline__ __device__
+float RobustWeight<ICPRobustWeight::HUBER>(float r, float scale) {
+  float abs_r = fabsf(r);
+  return abs_r <= scale ? 1.0f : scale / abs_r;
+}
+
+template <>
+__inline__ __device__
+float RobustWeight<ICPRobustWeight::TUKEY>(float r, float scale) {
+  if (fabsf(r) > scale) {
+    return 0.0f;
+  }
+  float u = r / scale;
+  float v = 1.0f - u * u;
+  return v * v;
+}
+
+template <>
+__inline__ __device__
+float RobustWeight<ICPRobustWeight::CAUCHY>(float r, float scale) {
+  float u = r / scale;
+  return 1.0f / (1.0f + u * u);
+}
+
+// The raycast (dst) model as world points and normals, moved into the model
+// camera's coordinates on every read.
+struct WorldRaycastModel {
+  KernelArray2D<const float4> world_points;
+  KernelArray2D<const float4> world_normals;
+  float4x4 model_from_world;
+
+  __inline__ __device__
+  int2 Size() const {
+    return world_points.size();
+  }
+
+  // Returns false if the raycast missed at xy.
+  __inline__ __device__
+  bool Read(int2 xy, float3* point_model, float3* normal_model) const {
+    float4 point_world = world_points[xy];
+    float4 normal_world = world_normals[xy];
+    if (point_world.w == 0 || normal_world.w == 0) {
+      return false;
+    }
+    *point_model = transformPoint(model_from_world,
+      make_float3(point_world));
+    *normal_model = transformVector(model_from_world,
+      make_float3(normal_world));
+    return true;
+  }
+};
+
+// The raycast (dst) model as compact raycast samples taken from the model
+// camera. At pyramid level level, sample xy is full resolution pixel
+// xy << level, so points are reconstructed with the full resolution
+// intrinsics.
+struct CompactRaycastModel {
+  KernelArray2D<const uint2> samples;
+  float4 full_resolution_flpp;
+  int level;
+
+  __inline__ __device__
+  int2 Size() const {
+    return samples.size();
+  }
+
+  // Same contract as WorldRaycastModel::Read().
+  __inline__ __device__
+  bool Read(int2 xy, float3* point_model, float3* normal_model) const {
+    float depth;
+    if (!UnpackCompactRaycastSample(samples[xy], &depth, normal_model)) {
+      return false;
+    }
+    *point_model = CameraFromPixel(int2{ xy.x << level, xy.y << level },
+      depth, full_resolution_flpp);
+    return true;
+  }
+};
+
+// Associate one raycast (dst) sample with the incoming (src) depth map and
+// linearize its kMetric residual. Returns a zero sample if there is no valid
+// association. Model is WorldRaycastModel or CompactRaycastModel. If
+// kDebugVis, the color of the outcome is written to debug_output.
+template <ICPErrorMetric kMetric, bool kDebugVis, typename Model>
+__inline__ __device__
+ICPLeastSquaresData AssociateAndLinearize(
+  int2 dst_xy,
+  float4 flpp,
+  float2 depth_min_max,
+  const Model& model,
+  const ICPSolverState& state,
+  const KernelArray2D<const float>& depth_map,
+  const KernelArray2D<const float4>& normal_map,
   int src_image_guard_band_pixels,
   float max_distance_for_match,
   float min_dot_product_for_match,
-  KernelArray2D<ICPLeastSquaresData> icp_data_out,
-  KernelArray2D<uchar4> debug_vis_out) {
+  uchar4* debug_output) {
   // TODO: weighting function parameters
   // Reject data association if position differs by more than eps1
   // and normal dot product more than eps2?
 
-  int2 dst_xy = threadSubscript2DGlobal();
   ICPLeastSquaresData output = {};
-  uchar4 debug_output = {};
-
-  float4 dst_point_world4 = world_points[dst_xy];
-  float4 dst_normal_world4 = world_normals[dst_xy];
-
-  if (dst_point_world4.w == 0 || dst_normal_world4.w == 0) {
-    icp_data_out[dst_xy] = output;
-    debug_vis_out[dst_xy] = debug_output;
-    return;
+  if (kDebugVis) {
+    *debug_output = {};
   }
 
-  float3 dst_point_world = make_float3(dst_point_world4);
-  float3 dst_normal_world = make_float3(dst_normal_world4);
-
-  float3 dst_point_model = transformPoint(model_from_world, dst_point_world);
-  float3 dst_normal_model = transformVector(model_from_world, dst_normal_world);
+  float3 dst_point_model;
+  float3 dst_normal_model;
+  if (!model.Read(dst_xy, &dst_point_model, &dst_normal_model)) {
+    return output;
+  }
 
   // Project dst_point into current pose estimate to see if it associates.
-  float3 dst_point_current = transformPoint(current_from_model, dst_point_model);
+  float3 dst_point_current = TransformPoint3x4(state.current_from_model,
+    dst_point_model);
   int2 dst_xy_current = floorToInt(make_float2(PixelFromCamera(
     dst_point_current, flpp)));
 
@@ -103,9 +298,10 @@ void ICPKernel(
     src_image_guard_band_pixels);
   // If the point is in front of the camera, then dst_point_current.z < 0.
   if (!contains(valid_rect, dst_xy_current) || dst_point_current.z > 0) {
-    icp_data_out[dst_xy] = output;
-    debug_vis_out[dst_xy] = uchar4{ 255, 0, 0, 255 };
-    return;
+    if (kDebugVis) {
+      *debug_output = uchar4{ 255, 0, 0, 255 };
+    }
+    return output;
   }
 
   float src_depth = depth_map[dst_xy_current];
@@ -113,110 +309,493 @@ void ICPKernel(
 
   if (src_depth < depth_min_max.x || src_depth > depth_min_max.y ||
     src_normal_current4.w == 0) {
-    icp_data_out[dst_xy] = output;
-    debug_vis_out[dst_xy] = uchar4{ 0, 255, 0, 255 };
-    return;
+    if (kDebugVis) {
+      *debug_output = uchar4{ 0, 255, 0, 255 };
+    }
+    return output;
   }
 
   // Unproject src pixel into camera coordinates and then into model camera
   // coordinates.
   float3 src_point_current = CameraFromPixel(dst_xy_current, src_depth, flpp);
-  float3 src_point_model = transformPoint(model_from_current,
+  float3 src_point_model = TransformPoint3x4(state.model_from_current,
     src_point_current);
-  float3 src_normal_model = transformVector(model_from_current,
+  float3 src_normal_model = TransformVector3x4(state.model_from_current,
     make_float3(src_normal_current4));
 
   // TODO(jiawen): write a parameterized weight function which accepts points,
   // including 0.
   float3 delta = dst_point_model - src_point_model;
   if (length(delta) > max_distance_for_match) {
-    icp_data_out[dst_xy] = output;
-    debug_vis_out[dst_xy] = uchar4{ 0, 0, 255, 255 };
-    return;
+    if (kDebugVis) {
+      *debug_output = uchar4{ 0, 0, 255, 255 };
+    }
+    return output;
   }
 
   if (dot(src_normal_model, dst_normal_model) < min_dot_product_for_match) {
-    icp_data_out[dst_xy] = output;
-    debug_vis_out[dst_xy] = uchar4{ 255, 255, 0, 255 };
-    return;
+    if (kDebugVis) {
+      *debug_output = uchar4{ 255, 255, 0, 255 };
+    }
+    return output;
   }
 
   // Declare sample as valid.
   output.num_samples = 1;
 
-  float3 c = cross(src_point_model, dst_normal_model);
-  float r = dot(delta, dst_normal_model);
+  // The residual is measured along n.
+  float3 n = dst_normal_model;
+  if (kMetric == ICPErrorMetric::SYMMETRIC_POINT_TO_PLANE) {
+    n += src_normal_model;
+  }
+
+  float3 c = cross(src_point_model, n);
+  float r = dot(delta, n);
 
   output.a[ 0] = c.x * c.x;
   output.a[ 1] = c.y * c.x;
   output.a[ 2] = c.z * c.x;
-  output.a[ 3] = dst_normal_model.x * c.x;
-  output.a[ 4] = dst_normal_model.y * c.x;
-  output.a[ 5] = dst_normal_model.z * c.x;
+  output.a[ 3] = n.x * c.x;
+  output.a[ 4] = n.y * c.x;
+  output.a[ 5] = n.z * c.x;
 
   output.a[ 6] = c.y * c.y;
   output.a[ 7] = c.z * c.y;
-  output.a[ 8] = dst_normal_model.x * c.y;
-  output.a[ 9] = dst_normal_model.y * c.y;
-  output.a[10] = dst_normal_model.z * c.y;
+  output.a[ 8] = n.x * c.y;
+  output.a[ 9] = n.y * c.y;
+  output.a[10] = n.z * c.y;
 
   output.a[11] = c.z * c.z;
-  output.a[12] = dst_normal_model.x * c.z;
-  output.a[13] = dst_normal_model.y * c.z;
-  output.a[14] = dst_normal_model.z * c.z;
+  output.a[12] = n.x * c.z;
+  output.a[13] = n.y * c.z;
+  output.a[14] = n.z * c.z;
 
-  output.a[15] = dst_normal_model.x * dst_normal_model.x;
-  output.a[16] = dst_normal_model.y * dst_normal_model.x;
-  output.a[17] = dst_normal_model.z * dst_normal_model.x;
+  output.a[15] = n.x * n.x;
+  output.a[16] = n.y * n.x;
+  output.a[17] = n.z * n.x;
 
-  output.a[18] = dst_normal_model.y * dst_normal_model.y;
-  output.a[19] = dst_normal_model.z * dst_normal_model.y;
+  output.a[18] = n.y * n.y;
+  output.a[19] = n.z * n.y;
 
-  output.a[20] = dst_normal_model.z * dst_normal_model.z;
+  output.a[20] = n.z * n.z;
 
   output.b[0] = c.x * r;
   output.b[1] = c.y * r;
   output.b[2] = c.z * r;
-  output.b[3] = dst_normal_model.x * r;
-  output.b[4] = dst_normal_model.y * r;
-  output.b[5] = dst_normal_model.z * r;
+  output.b[3] = n.x * r;
+  output.b[4] = n.y * r;
+  output.b[5] = n.z * r;
 
   output.squared_residual = r * r;
 
-  icp_data_out[dst_xy] = output;
-  debug_vis_out[dst_xy] = uchar4{ 255, 255, 255, 255 };
+  if (kDebugVis) {
+    *debug_output = uchar4{ 255, 255, 255, 255 };
+  }
+  return output;
+}
+
+// Associates and linearizes every raycast sample against the current pose
+// estimate in state, weights it with RobustWeight<kWeight>, then sums the
+// samples of each thread block into block_sums_out[block index]. Does nothing
+// once state->failed or state->converged is set. debug_vis_out is only
+// written if kDebugVis.
+template <ICPRobustWeight kWeight, ICPErrorMetric kMetric, bool kDebugVis,
+  typename Model>
+__global__
+void ICPKernel(
+  float4 flpp, // depth camera intrinsics
+  float2 depth_min_max,
+  Model model, // raycast from the known model pose
+  const ICPSolverState* state, // current pose estimate
+  KernelArray2D<const float> depth_map,
+  KernelArray2D<const float4> normal_map,
+  int src_image_guard_band_pixels,
+  float max_distance_for_match,
+  float min_dot_product_for_match,
+  float robust_weight_scale,
+  ICPLeastSquaresData* block_sums_out,
+  KernelArray2D<uchar4> debug_vis_out) {
+  __shared__ ICPLeastSquaresData shared[kICPBlockSize];
+
+  // Uniform across the grid: safe to return before __syncthreads().
+  if (state->failed || state->converged) {
+    return;
+  }
+
+  int2 dst_xy = threadSubscript2DGlobal();
+  int tid = threadIdx.y * blockDim.x + threadIdx.x;
+
+  ICPLeastSquaresData output = {};
+  if (contains(model.Size(), dst_xy)) {
+    uchar4 debug_output;
+    output = AssociateAndLinearize<kMetric, kDebugVis>(dst_xy, flpp,
+      depth_min_max, model, *state, depth_map, normal_map,
+      src_image_guard_band_pixels, max_distance_for_match,
+      min_dot_product_for_match, &debug_output);
+    if (kDebugVis) {
+      debug_vis_out[dst_xy] = debug_output;
+    }
+
+    if (output.num_samples > 0) {
+      // squared_residual is r^2 for a single sample.
+      float w = RobustWeight<kWeight>(sqrtf(output.squared_residual),
+        robust_weight_scale);
+      for (int i = 0; i < 21; ++i) {
+        output.a[i] *= w;
+      }
+      for (int i = 0; i < 6; ++i) {
+        output.b[i] *= w;
+      }
+      output.squared_residual *= w;
+    }
+  }
+
+  shared[tid] = output;
+  __syncthreads();
+  BlockReduce<kICPBlockSize>(shared, tid);
+
+  if (tid == 0) {
+    block_sums_out[blockIdx.y * gridDim.x + blockIdx.x] = shared[0];
+  }
+}
+
+// Solves the symmetric positive definite system in packed form with a
+// Cholesky decomposition. Returns false if the system is not positive
+// definite.
+__inline__ __device__
+bool CholeskySolve(const ICPLeastSquaresData& system, float x[6]) {
+  float a[6][6];
+  int k = 0;
+  for (int i = 0; i < 6; ++i) {
+    for (int j = i; j < 6; ++j) {
+      a[i][j] = system.a[k];
+      a[j][i] = system.a[k];
+      ++k;
+    }
+  }
+
+  // a = L L^T, with L stored in the lower triangle of a.
+  for (int j = 0; j < 6; ++j) {
+    float d = a[j][j];
+    for (int p = 0; p < j; ++p) {
+      d -= a[j][p] * a[j][p];
+    }
+    if (d <= 0.0f) {
+      return false;
+    }
+    a[j][j] = sqrtf(d);
+    for (int i = j + 1; i < 6; ++i) {
+      float v = a[i][j];
+      for (int p = 0; p < j; ++p) {
+        v -= a[i][p] * a[j][p];
+      }
+      a[i][j] = v / a[j][j];
+    }
+  }
+
+  // Forward substitution: L y = b.
+  float y[6];
+  for (int i = 0; i < 6; ++i) {
+    float v = system.b[i];
+    for (int p = 0; p < i; ++p) {
+      v -= a[i][p] * y[p];
+    }
+    y[i] = v / a[i][i];
+  }
+
+  // Back substitution: L^T x = y.
+  for (int i = 5; i >= 0; --i) {
+    float v = y[i];
+    for (int p = i + 1; p < 6; ++p) {
+      v -= a[p][i] * x[p];
+    }
+    x[i] = v / a[i][i];
+  }
+  return true;
 }
 
-Matrix4f rigidTransformationFromApprox(float x[6]) {
-  float alpha = x[0];
-  float beta  = x[1];
-  float gamma = x[2];
-
-  // TODO(jiawen): investigate using this one instead, it should work too and
-  // is more symmetric.
-#if 0
-  return Matrix4f
-  (
-    1.0f,   -gamma,   beta,   x[3],
-    gamma,    1.0f, -alpha,   x[4],
-    -beta,   alpha,   1.0f,   x[5],
-    0.0f,     0.0f,   0.0f,   1.0f
-  );
-#else
-  return Matrix4f::translation({ x[3], x[4], x[5] }) *
-    Matrix4f::rotateZ(gamma) *
-    Matrix4f::rotateY(beta) *
-    Matrix4f::rotateX(alpha);
-#endif
+// Clears the per-level convergence state.
+__global__
+void ICPBeginLevelKernel(ICPSolverState* state) {
+  state->converged = 0;
+  state->previous_mean_squared_residual = -1.0f;
+}
+
+// Sums num_block_sums partial sums written by ICPKernel, solves for the
+// incremental transformation and composes it onto state->model_from_current.
+// Sets state->failed if there are fewer than min_num_samples samples or the
+// system is singular, and state->converged if the update or the change in
+// residual is below threshold. Launch with one block of kICPSolveThreads
+// threads.
+__global__
+void ICPSolveKernel(const ICPLeastSquaresData* block_sums,
+  int num_block_sums, int min_num_samples,
+  float min_twist_norm, float min_relative_residual_change,
+  ICPSolverState* state) {
+  __shared__ ICPLeastSquaresData shared[kICPSolveThreads];
+
+  if (state->failed || state->converged) {
+    return;
+  }
+
+  int tid = threadIdx.x;
+  ICPLeastSquaresData sum = {};
+  for (int i = tid; i < num_block_sums; i += kICPSolveThreads) {
+    sum = Plus()(sum, block_sums[i]);
+  }
+  shared[tid] = sum;
+  __syncthreads();
+  BlockReduce<kICPSolveThreads>(shared, tid);
+
+  if (tid != 0) {
+    return;
+  }
+
+  sum = shared[0];
+  state->num_samples = sum.num_samples;
+  state->squared_residual = sum.squared_residual;
+
+  float x[6];
+  if (sum.num_samples < min_num_samples || !CholeskySolve(sum, x)) {
+    state->failed = 1;
+    return;
+  }
+  ++state->num_iterations;
+
+  float twist_norm_squared = 0.0f;
+  for (int i = 0; i < 6; ++i) {
+    twist_norm_squared += x[i] * x[i];
+  }
+  float mean_squared_residual = sum.squared_residual / sum.num_samples;
+  float previous = state->previous_mean_squared_residual;
+  if (twist_norm_squared < min_twist_norm * min_twist_norm ||
+    (previous >= 0.0f && fabsf(previous - mean_squared_residual) <=
+      min_relative_residual_change * previous)) {
+    state->converged = 1;
+  }
+  state->previous_mean_squared_residual = mean_squared_residual;
+
+  // incremental = translation(x[3:6]) * rotateZ(x[2]) * rotateY(x[1]) *
+  //   rotateX(x[0]).
+  float ca = cosf(x[0]);
+  float sa = sinf(x[0]);
+  float cb = cosf(x[1]);
+  float sb = sinf(x[1]);
+  float cg = cosf(x[2]);
+  float sg = sinf(x[2]);
+  float3 r[3] = {
+    { cg * cb, cg * sb * sa - sg * ca, cg * sb * ca + sg * sa },
+    { sg * cb, sg * sb * sa + cg * ca, sg * sb * ca - cg * sa },
+    { -sb, cb * sa, cb * ca }
+  };
+  float3 t = { x[3], x[4], x[5] };
+
+  // model_from_current = incremental * model_from_current.
+  float4 old_m[3] = {
+    state->model_from_current[0],
+    state->model_from_current[1],
+    state->model_from_current[2]
+  };
+  float3 old_col[4];
+  old_col[0] = { old_m[0].x, old_m[1].x, old_m[2].x };
+  old_col[1] = { old_m[0].y, old_m[1].y, old_m[2].y };
+  old_col[2] = { old_m[0].z, old_m[1].z, old_m[2].z };
+  old_col[3] = { old_m[0].w, old_m[1].w, old_m[2].w };
+
+  float4 m[3];
+  for (int i = 0; i < 3; ++i) {
+    m[i] = {
+      dot(r[i], old_col[0]),
+      dot(r[i], old_col[1]),
+      dot(r[i], old_col[2]),
+      dot(r[i], old_col[3]) + (i == 0 ? t.x : (i == 1 ? t.y : t.z))
+    };
+    state->model_from_current[i] = m[i];
+  }
+
+  // current_from_model = [R^T, -R^T t].
+  float3 new_t = { m[0].w, m[1].w, m[2].w };
+  float3 rt_col[3] = {
+    { m[0].x, m[1].x, m[2].x },
+    { m[0].y, m[1].y, m[2].y },
+    { m[0].z, m[1].z, m[2].z }
+  };
+  for (int i = 0; i < 3; ++i) {
+    state->current_from_model[i] = make_float4(rt_col[i],
+      -dot(rt_col[i], new_t));
+  }
+}
+
+// Launches the ICPKernel for the robust weight chosen at run time. Args are
+// the kernel's arguments.
+template <ICPErrorMetric kMetric, bool kDebugVis, typename... Args>
+void LaunchICPKernelWithWeight(ICPRobustWeight robust_weight,
+  dim3 grid_dim, dim3 block_dim, cudaStream_t stream, Args... args) {
+  switch (robust_weight) {
+#define ICP_KERNEL_CASE(weight) \
+  case weight: \
+    ICPKernel<weight, kMetric, kDebugVis><<<grid_dim, block_dim, 0, \
+      stream>>>(args...); \
+    break;
+  ICP_KERNEL_CASE(ICPRobustWeight::NONE)
+  ICP_KERNEL_CASE(ICPRobustWeight::HUBER)
+  ICP_KERNEL_CASE(ICPRobustWeight::TUKEY)
+  ICP_KERNEL_CASE(ICPRobustWeight::CAUCHY)
+#undef ICP_KERNEL_CASE
+  }
+}
+
+// Launches the ICPKernel variant for options, so that the kernel carries no
+// branches or stores for the features options turn off.
+template <typename Model>
+void LaunchICPKernel(const ProjectivePointPlaneICP::Options& options,
+  dim3 grid_dim, dim3 block_dim, cudaStream_t stream,
+  float4 flpp, float2 depth_min_max, const Model& model,
+  const ICPSolverState* state,
+  KernelArray2D<const float> depth_map,
+  KernelArray2D<const float4> normal_map,
+  int src_image_guard_band_pixels,
+  ICPLeastSquaresData* block_sums_out,
+  KernelArray2D<uchar4> debug_vis_out) {
+#define LAUNCH_ICP_KERNEL(metric, debug_vis) \
+  LaunchICPKernelWithWeight<metric, debug_vis>(options.robust_weight, \
+    grid_dim, block_dim, stream, flpp, depth_min_max, model, state, \
+    depth_map, normal_map, src_image_guard_band_pixels, \
+    options.max_distance_for_match, options.min_dot_product_for_match, \
+    options.robust_weight_scale, block_sums_out, debug_vis_out)
+  if (options.error_metric == ICPErrorMetric::POINT_TO_PLANE) {
+    if (options.write_debug_vis) {
+      LAUNCH_ICP_KERNEL(ICPErrorMetric::POINT_TO_PLANE, true);
+    } else {
+      LAUNCH_ICP_KERNEL(ICPErrorMetric::POINT_TO_PLANE, false);
+    }
+  } else {
+    if (options.write_debug_vis) {
+      LAUNCH_ICP_KERNEL(ICPErrorMetric::SYMMETRIC_POINT_TO_PLANE, true);
+    } else {
+      LAUNCH_ICP_KERNEL(ICPErrorMetric::SYMMETRIC_POINT_TO_PLANE, false);
+    }
+  }
+#undef LAUNCH_ICP_KERNEL
+}
+
+const char* kPointToPlaneICPErrorMetric = "point_to_plane";
+const char* kSymmetricPointToPlaneICPErrorMetric = "symmetric_point_to_plane";
+
+bool ParseICPErrorMetric(const std::string& name, ICPErrorMetric* metric) {
+  if (name == kPointToPlaneICPErrorMetric) {
+    *metric = ICPErrorMetric::POINT_TO_PLANE;
+    return true;
+  } else if (name == kSymmetricPointToPlaneICPErrorMetric) {
+    *metric = ICPErrorMetric::SYMMETRIC_POINT_TO_PLANE;
+    return true;
+  }
+  return false;
+}
+
+// The number of ICPKernel thread blocks covering a full resolution image.
+int NumICPBlocks(const Vector2i& size) {
+  int blocks_x = (size.x + kICPBlockWidth - 1) / kICPBlockWidth;
+  int blocks_y = (size.y + kICPBlockWidth - 1) / kICPBlockWidth;
+  return blocks_x * blocks_y;
 }
 
 ProjectivePointPlaneICP::ProjectivePointPlaneICP(
   const Vector2i& depth_resolution,
   const Intrinsics& depth_intrinsics, const Range1f& depth_range) :
-  icp_data_(depth_resolution),
+  ProjectivePointPlaneICP(depth_resolution, depth_intrinsics, depth_range,
+    Options()) {
+}
+
+ProjectivePointPlaneICP::ProjectivePointPlaneICP(
+  const Vector2i& depth_resolution,
+  const Intrinsics& depth_intrinsics, const Range1f& depth_range,
+  const Options& options) :
   depth_intrinsics_flpp_{ depth_intrinsics.focalLength,
     depth_intrinsics.principalPoint },
-  depth_range_(depth_range) {
+  depth_range_(depth_range),
+  options_(options),
+  block_sums_(NumICPBlocks(depth_resolution)),
+  state_(1),
+  graph_(options.use_cuda_graph) {
+  for (int level = 1; level < kNumPyramidLevels; ++level) {
+    Vector2i size{ depth_resolution.x >> level, depth_resolution.y >> level };
+    PyramidLevel& p = pyramid_[level];
+    p.incoming_depth.resize(size);
+    p.incoming_normals.resize(size);
+    p.world_points.resize(size);
+    p.world_normals.resize(size);
+    p.compact_model.resize(size);
+    p.debug_vis.resize(size);
+  }
+}
+
+void ProjectivePointPlaneICP::BuildIncomingPyramid(
+  DeviceArray2D<float>& incoming_depth,
+  DeviceArray2D<float4>& incoming_normals,
+  cudaStream_t stream) {
+  dim3 block_dim(16, 16, 1);
+  for (int level = 1; level < kNumPyramidLevels; ++level) {
+    const bool from_input = (level == 1);
+    PyramidLevel& src = pyramid_[level - 1];
+    PyramidLevel& dst = pyramid_[level];
+    dim3 grid_dim = libcgt::cuda::math::numBins2D(
+      { dst.incoming_depth.width(), dst.incoming_depth.height() },
+      block_dim
+    );
+
+    DownsampleDepthKernel<<<grid_dim, block_dim, 0, stream>>>(
+      from_input ? incoming_depth.readView() : src.incoming_depth.readView(),
+      make_float2(depth_range_.leftRight()),
+      options_.max_pyramid_depth_difference,
+      dst.incoming_depth.writeView());
+    DownsampleNormalsKernel<<<grid_dim, block_dim, 0, stream>>>(
+      from_input ? incoming_normals.readView() :
+        src.incoming_normals.readView(),
+      dst.incoming_normals.writeView());
+  }
+}
+
+void ProjectivePointPlaneICP::BuildRaycastPyramid(
+  DeviceArray2D<float4>& world_points,
+  DeviceArray2D<float4>& world_normals,
+  cudaStream_t stream) {
+  dim3 block_dim(16, 16, 1);
+  for (int level = 1; level < kNumPyramidLevels; ++level) {
+    const bool from_input = (level == 1);
+    PyramidLevel& src = pyramid_[level - 1];
+    PyramidLevel& dst = pyramid_[level];
+    dim3 grid_dim = libcgt::cuda::math::numBins2D(
+      { dst.world_points.width(), dst.world_points.height() },
+      block_dim
+    );
+
+    SubsampleKernel<<<grid_dim, block_dim, 0, stream>>>(
+      from_input ? world_points.readView() : src.world_points.readView(),
+      dst.world_points.writeView());
+    SubsampleKernel<<<grid_dim, block_dim, 0, stream>>>(
+      from_input ? world_normals.readView() : src.world_normals.readView(),
+      dst.world_normals.writeView());
+  }
+}
+
+void ProjectivePointPlaneICP::BuildCompactRaycastPyramid(
+  DeviceArray2D<uint2>& compact_model,
+  cudaStream_t stream) {
+  dim3 block_dim(16, 16, 1);
+  for (int level = 1; level < kNumPyramidLevels; ++level) {
+    const bool from_input = (level == 1);
+    PyramidLevel& src = pyramid_[level - 1];
+    PyramidLevel& dst = pyramid_[level];
+    dim3 grid_dim = libcgt::cuda::math::numBins2D(
+      { dst.compact_model.width(), dst.compact_model.height() },
+      block_dim
+    );
+
+    SubsampleKernel<<<grid_dim, block_dim, 0, stream>>>(
+      from_input ? compact_model.readView() : src.compact_model.readView(),
+      dst.compact_model.writeView());
+  }
 }
 
 // TODO(jiawen): can improve conditioning by subtracting off the mean first
@@ -230,72 +809,198 @@ ProjectivePointPlaneICP::Result ProjectivePointPlaneICP::EstimatePose(
   const EuclideanTransform& world_from_camera,
   DeviceArray2D<float4>& world_points,
   DeviceArray2D<float4>& world_normals,
-  DeviceArray2D<uchar4>& debug_vis) {
-  auto t0 = std::chrono::high_resolution_clock::now();
+  DeviceArray2D<uchar4>& debug_vis,
+  cudaStream_t stream) {
+  ScopedCPUTimer timer("ProjectivePointPlaneICP::EstimatePose");
+  ScopedTraceRange trace("ProjectivePointPlaneICP::EstimatePose",
+    TraceCategory::POSE_ESTIMATION);
+
+  BuildIncomingPyramid(incoming_depth, incoming_normals, stream);
+  BuildRaycastPyramid(world_points, world_normals, stream);
+
+  const DeviceArray2D<float>* depths[kNumPyramidLevels];
+  const DeviceArray2D<float4>* normals[kNumPyramidLevels];
+  for (int level = 0; level < kNumPyramidLevels; ++level) {
+    depths[level] = (level == 0) ?
+      &incoming_depth : &pyramid_[level].incoming_depth;
+    normals[level] = (level == 0) ?
+      &incoming_normals : &pyramid_[level].incoming_normals;
+  }
+  return EstimatePoseFromLevels(depths, normals, world_from_camera,
+    &world_points, &world_normals, nullptr, debug_vis, stream);
+}
 
-  dim3 block_dim(16, 16, 1);
-  dim3 grid_dim = libcgt::cuda::math::numBins2D(
-    { incoming_depth.width(), incoming_depth.height() },
-    block_dim
-  );
+__host__
+ProjectivePointPlaneICP::Result ProjectivePointPlaneICP::EstimatePose(
+  const DepthPyramid& incoming,
+  const EuclideanTransform& world_from_camera,
+  DeviceArray2D<float4>& world_points,
+  DeviceArray2D<float4>& world_normals,
+  DeviceArray2D<uchar4>& debug_vis,
+  cudaStream_t stream) {
+  assert(incoming.NumLevels() >= kNumPyramidLevels);
+  ScopedCPUTimer timer("ProjectivePointPlaneICP::EstimatePose");
+  ScopedTraceRange trace("ProjectivePointPlaneICP::EstimatePose",
+    TraceCategory::POSE_ESTIMATION);
+
+  BuildRaycastPyramid(world_points, world_normals, stream);
+
+  const DeviceArray2D<float>* depths[kNumPyramidLevels];
+  const DeviceArray2D<float4>* normals[kNumPyramidLevels];
+  for (int level = 0; level < kNumPyramidLevels; ++level) {
+    depths[level] = &incoming.levels[level].depth;
+    normals[level] = &incoming.levels[level].normals;
+  }
+  return EstimatePoseFromLevels(depths, normals, world_from_camera,
+    &world_points, &world_normals, nullptr, debug_vis, stream);
+}
 
-  const ICPLeastSquaresData zero = {};
+__host__
+ProjectivePointPlaneICP::Result ProjectivePointPlaneICP::EstimatePose(
+  const DepthPyramid& incoming,
+  const EuclideanTransform& world_from_camera,
+  DeviceArray2D<uint2>& compact_model,
+  DeviceArray2D<uchar4>& debug_vis,
+  cudaStream_t stream) {
+  assert(incoming.NumLevels() >= kNumPyramidLevels);
+  ScopedCPUTimer timer("ProjectivePointPlaneICP::EstimatePose");
+  ScopedTraceRange trace("ProjectivePointPlaneICP::EstimatePose",
+    TraceCategory::POSE_ESTIMATION);
+
+  BuildCompactRaycastPyramid(compact_model, stream);
+
+  const DeviceArray2D<float>* depths[kNumPyramidLevels];
+  const DeviceArray2D<float4>* normals[kNumPyramidLevels];
+  for (int level = 0; level < kNumPyramidLevels; ++level) {
+    depths[level] = &incoming.levels[level].depth;
+    normals[level] = &incoming.levels[level].normals;
+  }
+  return EstimatePoseFromLevels(depths, normals, world_from_camera,
+    nullptr, nullptr, &compact_model, debug_vis, stream);
+}
+
+__host__
+ProjectivePointPlaneICP::Result
+ProjectivePointPlaneICP::EstimatePoseFromLevels(
+  const DeviceArray2D<float>* incoming_depth[kNumPyramidLevels],
+  const DeviceArray2D<float4>* incoming_normals[kNumPyramidLevels],
+  const EuclideanTransform& world_from_camera,
+  DeviceArray2D<float4>* world_points,
+  DeviceArray2D<float4>* world_normals,
+  DeviceArray2D<uint2>* compact_model,
+  DeviceArray2D<uchar4>& debug_vis,
+  cudaStream_t stream) {
+  dim3 block_dim(kICPBlockWidth, kICPBlockWidth, 1);
 
   ProjectivePointPlaneICP::Result result;
 
   const float4x4 model_from_world = make_float4x4(
     inverse(world_from_camera).asMatrix());
-  Matrix4f model_from_current = Matrix4f::identity();
-  for (int i = 0; i < kNumIterations; ++i) {
-    Matrix4f current_from_model =
-      Matrix4f::inverseEuclidean(model_from_current);
 
-    ICPKernel<<<grid_dim, block_dim>>>(
-      make_float4(depth_intrinsics_flpp_),
-      make_float2(depth_range_.leftRight()),
-      model_from_world,
-      make_float4x4(model_from_current),
-      make_float4x4(current_from_model),
-      incoming_depth.readView(),
-      incoming_normals.readView(),
-      world_points.readView(),
-      world_normals.readView(),
-      kImageGuardBand,
-      kMaxDistanceForMatch,
-      kMinDotProductForMatch,
-      icp_data_.writeView(),
-      debug_vis.writeView());
-
-    ICPLeastSquaresData* begin = icp_data_.pointer();
-    ICPLeastSquaresData* end = icp_data_.rowPointer(icp_data_.height());
-    // TODO(jiawen): benchmark how long the sum takes. Look into if the sum
-    // can be computed on the GPU as well as the inversion.
-    ICPLeastSquaresData sum =
-      thrust::reduce(thrust::device, begin, end, zero, Plus());
-
-    printf("ICP iteration %d (after assoc, before solve)\n"
-      "num_samples = %d, squared_residual = %f\n",
-      i, sum.num_samples, sum.squared_residual);
-
-    if (sum.num_samples < kMinNumSamples) {
-      result.valid = false;
-      result.num_samples = sum.num_samples;
-      return result;
+  // The pose estimate lives in device memory. Each iteration's ICPKernel
+  // reads it and ICPSolveKernel updates it, so the host only waits once, at
+  // the end.
+  ICPSolverState initial_state = {};
+  initial_state.model_from_current[0] = { 1, 0, 0, 0 };
+  initial_state.model_from_current[1] = { 0, 1, 0, 0 };
+  initial_state.model_from_current[2] = { 0, 0, 1, 0 };
+  initial_state.current_from_model[0] = { 1, 0, 0, 0 };
+  initial_state.current_from_model[1] = { 0, 1, 0, 0 };
+  initial_state.current_from_model[2] = { 0, 0, 1, 0 };
+  cudaMemcpyAsync(state_.pointer(), &initial_state, sizeof(initial_state),
+    cudaMemcpyHostToDevice, stream);
+
+  // Everything from here to the readback is kernels on stream, so it can be
+  // replayed as a graph. The copy above reads host memory and stays out.
+  graph_.Run(stream, [&]() {
+    // Coarse to fine. The estimate from each level initializes the next.
+    for (int level = kNumPyramidLevels - 1; level >= 0; --level) {
+      PyramidLevel& p = pyramid_[level];
+      const DeviceArray2D<float>& depth = *incoming_depth[level];
+      const DeviceArray2D<float4>& normals = *incoming_normals[level];
+      DeviceArray2D<uchar4>& vis = (level == 0) ? debug_vis : p.debug_vis;
+
+      // Image coordinates scale with resolution.
+      const float scale = 1.0f / (1 << level);
+      const float4 flpp = scale * make_float4(depth_intrinsics_flpp_);
+      const int guard_band = options_.image_guard_band >> level;
+      const int min_num_samples = options_.min_num_samples >> (2 * level);
+
+      dim3 grid_dim = libcgt::cuda::math::numBins2D(
+        { vis.width(), vis.height() },
+        block_dim
+      );
+      const int num_block_sums = grid_dim.x * grid_dim.y;
+
+      ICPBeginLevelKernel<<<1, 1, 0, stream>>>(state_.pointer());
+
+      // Kernels after convergence return immediately, so the host does not
+      // need to know when to stop.
+      for (int i = 0; i < options_.num_iterations[level]; ++i) {
+        // Only enqueues: the GPU side shows up under this range in Nsight.
+        ScopedTraceRange trace_iteration("ICP iteration",
+          TraceCategory::POSE_ESTIMATION);
+        if (compact_model != nullptr) {
+          CompactRaycastModel model{
+            (level == 0) ? compact_model->readView() :
+              p.compact_model.readView(),
+            make_float4(depth_intrinsics_flpp_),
+            level
+          };
+          LaunchICPKernel(options_, grid_dim, block_dim, stream,
+            flpp, make_float2(depth_range_.leftRight()), model,
+            state_.pointer(), depth.readView(), normals.readView(), guard_band,
+            block_sums_.pointer(), vis.writeView());
+        } else {
+          WorldRaycastModel model{
+            (level == 0) ? world_points->readView() :
+              p.world_points.readView(),
+            (level == 0) ? world_normals->readView() :
+              p.world_normals.readView(),
+            model_from_world
+          };
+          LaunchICPKernel(options_, grid_dim, block_dim, stream,
+            flpp, make_float2(depth_range_.leftRight()), model,
+            state_.pointer(), depth.readView(), normals.readView(), guard_band,
+            block_sums_.pointer(), vis.writeView());
+        }
+
+        ICPSolveKernel<<<1, kICPSolveThreads, 0, stream>>>(
+          block_sums_.pointer(), num_block_sums, min_num_samples,
+          options_.min_twist_norm, options_.min_relative_residual_change,
+          state_.pointer());
+      }
     }
-
-    // TODO(jiawen): benchmark how long the solve takes.
-    float x[6];
-    Solve(sum, x);
-    Matrix4f incremental = rigidTransformationFromApprox(x);
-    model_from_current = incremental * model_from_current;
+  });
+
+  ScopedTraceRange trace_wait("ICP: wait for result",
+    TraceCategory::POSE_ESTIMATION);
+  ICPSolverState final_state;
+  cudaMemcpyAsync(&final_state, state_.pointer(), sizeof(final_state),
+    cudaMemcpyDeviceToHost, stream);
+  cudaStreamSynchronize(stream);
+
+  result.num_samples = final_state.num_samples;
+  result.num_iterations = final_state.num_iterations;
+  if (final_state.failed) {
+    result.valid = false;
+    return result;
   }
 
+  const float4* m = final_state.model_from_current;
+  Matrix4f model_from_current(
+    m[0].x, m[0].y, m[0].z, m[0].w,
+    m[1].x, m[1].y, m[1].z, m[1].w,
+    m[2].x, m[2].y, m[2].z, m[2].w,
+    0.0f, 0.0f, 0.0f, 1.0f);
+
   Quat4f q = Quat4f::fromRotationMatrix(model_from_current.getSubmatrix3x3());
   Vector3f t = model_from_current.getCol(3).xyz;
   float radians;
   Vector3f axis = q.getAxisAngle(&radians);
 
-  if (t.norm() > kMaxTranslation || radians > kMaxRotationRadians) {
+  if (t.norm() > options_.max_translation ||
+    radians > options_.max_rotation_radians) {
     result.valid = false;
     return result;
   }
@@ -311,8 +1016,5 @@ ProjectivePointPlaneICP::Result ProjectivePointPlaneICP::EstimatePose(
   result.world_from_camera = EuclideanTransform::fromMatrix(
     Matrix4f::inverseEuclidean(camera_from_world));
 
-  auto t1 = std::chrono::high_resolution_clock::now();
-  printf("ICP took %lld ms\n", libcgt::core::time::dtMS(t0, t1));
-
   return result;
 }
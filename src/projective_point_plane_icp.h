@@ -14,22 +14,103 @@
 #ifndef PROJECTIVE_POINT_PLANE_ICP_H
 #define PROJECTIVE_POINT_PLANE_ICP_H
 
+#include <cuda_runtime.h>
+
 #include "libcgt/core/cameras/Intrinsics.h"
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 #include "libcgt/core/vecmath/Range1f.h"
 #include "libcgt/core/vecmath/Vector4f.h"
+#include "libcgt/cuda/DeviceArray1D.h"
 #include "libcgt/cuda/DeviceArray2D.h"
 
+#include "depth_pyramid.h"
+#include "device_array_pool.h"
 #include "icp_least_squares_data.h"
+#include "stream_graph.h"
 
+#include <string>
 #include <vector>
 
+// Robust weight function applied to each point-to-plane residual r. scale
+// is Options::robust_weight_scale.
+enum class ICPRobustWeight {
+  // Plain least squares: w = 1.
+  NONE,
+  // w = 1 if |r| <= scale, else scale / |r|.
+  HUBER,
+  // w = (1 - (r / scale)^2)^2 if |r| <= scale, else 0.
+  TUKEY,
+  // w = 1 / (1 + (r / scale)^2).
+  CAUCHY
+};
+
+// What each ICP residual measures, for a model point q with normal n_q
+// matched to an incoming point p with normal n_p.
+enum class ICPErrorMetric {
+  // (p - q) . n_q.
+  POINT_TO_PLANE,
+  // (p - q) . (n_p + n_q) (Rusinkiewicz 2019). Converges in fewer iterations
+  // and from further away, at the cost of an extra normal per sample.
+  SYMMETRIC_POINT_TO_PLANE
+};
+
+// Names accepted by ParseICPErrorMetric().
+extern const char* kPointToPlaneICPErrorMetric;
+extern const char* kSymmetricPointToPlaneICPErrorMetric;
+
+// Returns false, leaving metric untouched, if name is not recognized.
+bool ParseICPErrorMetric(const std::string& name, ICPErrorMetric* metric);
+
 class ProjectivePointPlaneICP {
  public:
 
   using EuclideanTransform = libcgt::core::vecmath::EuclideanTransform;
   using Intrinsics = libcgt::core::cameras::Intrinsics;
 
+  // Number of pyramid levels. Level 0 is full resolution and each level
+  // halves the resolution of the one before it.
+  static constexpr int kNumPyramidLevels = 3;
+
+  struct Options {
+    // Maximum number of iterations at each level, finest first.
+    int num_iterations[kNumPyramidLevels] = { 15, 8, 4 };
+
+    // A level stops early once the norm of the incremental twist (radians
+    // and meters) falls below min_twist_norm, or once the mean squared
+    // residual changes by less than min_relative_residual_change (relative
+    // to its previous value). Set both to 0 to always run every iteration.
+    float min_twist_norm = 1e-5f;
+    float min_relative_residual_change = 1e-4f;
+
+    ICPRobustWeight robust_weight = ICPRobustWeight::NONE;
+    float robust_weight_scale = 0.01f;  // meters.
+
+    ICPErrorMetric error_metric = ICPErrorMetric::POINT_TO_PLANE;
+
+    // Whether EstimatePose() writes debug_vis. When false, the kernels are
+    // compiled without the visualization and debug_vis is left untouched.
+    bool write_debug_vis = true;
+
+    // At full resolution. Scaled down with the number of pixels per level.
+    int min_num_samples = 300;
+    // At full resolution. Scaled down with the image size per level.
+    int image_guard_band = 16;
+    float max_distance_for_match = 0.1f;
+    float min_dot_product_for_match = 0.7f;
+    // Depths that differ from the top left of a 2x2 block by more than this
+    // are not averaged into the downsampled depth.
+    float max_pyramid_depth_difference = 0.04f;  // 40 mm for Kinect.
+
+    // Reject if translation > max_translation meters.
+    float max_translation = 0.15f;
+    // Reject if rotation > max_rotation_radians.
+    float max_rotation_radians = 0.1745f;  // 10 degrees.
+
+    // Whether to replay the iterations of EstimatePose() as a CUDA graph
+    // (see StreamGraph) instead of launching their kernels one by one.
+    bool use_cuda_graph = false;
+  };
+
   struct Result {
     bool valid = false;
     // The number of samples used to estimate this result.
@@ -38,12 +119,25 @@ class ProjectivePointPlaneICP {
 
     // TODO: reason: not enough matches, failed to translation and rotation tests, etc
 
+    // The number of iterations run, summed over all levels.
+    int num_iterations = 0;
+
     EuclideanTransform world_from_camera;
   };
 
+  // Uses the default Options.
   ProjectivePointPlaneICP(const Vector2i& depth_resolution,
     const Intrinsics& depth_intrinsics, const Range1f& depth_range);
 
+  ProjectivePointPlaneICP(const Vector2i& depth_resolution,
+    const Intrinsics& depth_intrinsics, const Range1f& depth_range,
+    const Options& options);
+
+  // Runs coarse-to-fine over a kNumPyramidLevels image pyramid built from
+  // the inputs, starting with the coarsest level.
+  //
+  // Association, reduction and the 6x6 solve all run on stream, with the
+  // pose estimate kept in device memory. The host waits once, at the end.
   __host__
   Result EstimatePose(
     DeviceArray2D<float>& incoming_depth,
@@ -51,26 +145,94 @@ class ProjectivePointPlaneICP {
     const EuclideanTransform& world_from_camera,
     DeviceArray2D<float4>& world_points,
     DeviceArray2D<float4>& world_normals,
-    DeviceArray2D<uchar4>& debug_vis);
+    DeviceArray2D<uchar4>& debug_vis,
+    cudaStream_t stream = 0);
+
+  // Same as above, but reads the incoming depth and normals of each level
+  // from a pyramid built by DepthProcessor::BuildPyramid() instead of
+  // downsampling them itself. incoming must have at least kNumPyramidLevels
+  // levels, and its level 0 must match the resolution of world_points.
+  __host__
+  Result EstimatePose(
+    const DepthPyramid& incoming,
+    const EuclideanTransform& world_from_camera,
+    DeviceArray2D<float4>& world_points,
+    DeviceArray2D<float4>& world_normals,
+    DeviceArray2D<uchar4>& debug_vis,
+    cudaStream_t stream = 0);
+
+  // Same as above, but reads the model from compact_model, a raycast by
+  // TSDFVolume::RaycastCompact() from world_from_camera, instead of from
+  // world points and normals. Each iteration then reads 8 instead of 32
+  // bytes per model pixel, and needs no transform to move the model into
+  // camera coordinates.
+  __host__
+  Result EstimatePose(
+    const DepthPyramid& incoming,
+    const EuclideanTransform& world_from_camera,
+    DeviceArray2D<uint2>& compact_model,
+    DeviceArray2D<uchar4>& debug_vis,
+    cudaStream_t stream = 0);
 
  private:
 
+   // The downsampled inputs at one pyramid level.
+   struct PyramidLevel {
+     PooledDeviceArray2D<float> incoming_depth;
+     PooledDeviceArray2D<float4> incoming_normals;
+     PooledDeviceArray2D<float4> world_points;
+     PooledDeviceArray2D<float4> world_normals;
+     PooledDeviceArray2D<uint2> compact_model;
+     PooledDeviceArray2D<uchar4> debug_vis;
+   };
+
+   // Fills the incoming depth and normals of levels 1 and up of pyramid_
+   // from the full resolution inputs.
+   void BuildIncomingPyramid(DeviceArray2D<float>& incoming_depth,
+     DeviceArray2D<float4>& incoming_normals,
+     cudaStream_t stream);
+
+   // Fills the world points and normals of levels 1 and up of pyramid_ from
+   // the full resolution raycast.
+   void BuildRaycastPyramid(DeviceArray2D<float4>& world_points,
+     DeviceArray2D<float4>& world_normals,
+     cudaStream_t stream);
+
+   // Fills the compact models of levels 1 and up of pyramid_ from the full
+   // resolution compact raycast.
+   void BuildCompactRaycastPyramid(DeviceArray2D<uint2>& compact_model,
+     cudaStream_t stream);
+
+   // Runs ICP coarse-to-fine given the incoming depth and normals of each
+   // level. The model is either world_points and world_normals, after
+   // BuildRaycastPyramid(), or compact_model, after
+   // BuildCompactRaycastPyramid(). The others are nullptr.
+   Result EstimatePoseFromLevels(
+     const DeviceArray2D<float>* incoming_depth[kNumPyramidLevels],
+     const DeviceArray2D<float4>* incoming_normals[kNumPyramidLevels],
+     const EuclideanTransform& world_from_camera,
+     DeviceArray2D<float4>* world_points,
+     DeviceArray2D<float4>* world_normals,
+     DeviceArray2D<uint2>* compact_model,
+     DeviceArray2D<uchar4>& debug_vis,
+     cudaStream_t stream);
+
    const Vector4f depth_intrinsics_flpp_;
    const Range1f depth_range_;
 
-   //const int kMinNumSamples = 30000;
-   const int kMinNumSamples = 300;
-   const int kNumIterations = 15;
-   const int kImageGuardBand = 16;
-   const float kMaxDistanceForMatch = 0.1f;
-   const float kMinDotProductForMatch = 0.7f;
+   const Options options_;
+
+   // pyramid_[0] is unused: the level 0 images are the inputs to
+   // EstimatePose().
+   PyramidLevel pyramid_[kNumPyramidLevels];
 
-   // Reject if translation > kMaxTranslation meters;
-   const float kMaxTranslation = 0.15f;
-   // Reject if rotation > kMaxRotationRadians;
-   const float kMaxRotationRadians = 0.1745f; // 10 degrees
+   // One partial sum per ICPKernel thread block, sized for level 0.
+   DeviceArray1D<ICPLeastSquaresData> block_sums_;
+   DeviceArray1D<ICPSolverState> state_;
 
-   DeviceArray2D<ICPLeastSquaresData> icp_data_;
+   // Captures the iterations of EstimatePoseFromLevels(). Only the pose
+   // changes from one frame to the next, so the graph is updated in place.
+   StreamGraph graph_;
 };
 
 #endif
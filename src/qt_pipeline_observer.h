@@ -0,0 +1,39 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef QT_PIPELINE_OBSERVER_H
+#define QT_PIPELINE_OBSERVER_H
+
+#include <QObject>
+
+#include "fusion_pipeline_observer.h"
+#include "pipeline_data_type.h"
+
+// Re-emits the notifications of a RegularGridFusionPipeline as a Qt signal,
+// for the GUI. Connect with Qt::QueuedConnection to receive them on the GUI
+// thread when the pipeline is fed from another thread.
+class QtPipelineObserver : public QObject, public FusionPipelineObserver {
+  Q_OBJECT
+
+ public:
+
+  explicit QtPipelineObserver(QObject* parent = nullptr);
+
+  void OnPipelineDataChanged(PipelineDataType type) override;
+
+ signals:
+
+  void dataChanged(PipelineDataType type);
+};
+
+#endif  // QT_PIPELINE_OBSERVER_H
@@ -13,12 +13,15 @@
 // limitations under the License.
 #include "raycast.h"
 
+#include <cfloat>
+
 #include "libcgt/cuda/Box3f.h"
 #include "libcgt/cuda/Event.h"
 #include "libcgt/cuda/MathUtils.h"
 #include "libcgt/cuda/ThreadMath.cuh"
 
 #include "camera_math.cuh"
+#include "compact_raycast.cuh"
 #include "tsdf.h"
 
 using libcgt::cuda::contains;
@@ -70,8 +73,9 @@ float3 one3()
 // and z.
 //
 // Returns (0, 0) if any samples are invalid.
+template <typename Voxel>
 __inline__ __device__
-float2 TrilinearSample(KernelArray3D<const TSDF> regular_grid,
+float2 TrilinearSample(RollingGridView<const Voxel> regular_grid,
   float3 grid_coords, float max_tsdf_value) {
   // For trilinear interpolation, the valid range is between [0.5, size - 0.5].
   libcgt::cuda::Box3f valid_box(half3(),
@@ -92,14 +96,14 @@ float2 TrilinearSample(KernelArray3D<const TSDF> regular_grid,
   int3 p_011 = { p_000.x    , p_000.y + 1, p_000.z + 1 };
   int3 p_111 = { p_000.x + 1, p_000.y + 1, p_000.z + 1 };
 
-  TSDF v_000 = regular_grid[p_000];
-  TSDF v_100 = regular_grid[p_100];
-  TSDF v_010 = regular_grid[p_010];
-  TSDF v_110 = regular_grid[p_110];
-  TSDF v_001 = regular_grid[p_001];
-  TSDF v_101 = regular_grid[p_101];
-  TSDF v_011 = regular_grid[p_011];
-  TSDF v_111 = regular_grid[p_111];
+  Voxel v_000 = regular_grid[p_000];
+  Voxel v_100 = regular_grid[p_100];
+  Voxel v_010 = regular_grid[p_010];
+  Voxel v_110 = regular_grid[p_110];
+  Voxel v_001 = regular_grid[p_001];
+  Voxel v_101 = regular_grid[p_101];
+  Voxel v_011 = regular_grid[p_011];
+  Voxel v_111 = regular_grid[p_111];
 
   // TODO(jiawen): can save a branch by multiplying by weight, or maybe storing
   // pre-multiplied.
@@ -141,9 +145,9 @@ float2 TrilinearSample(KernelArray3D<const TSDF> regular_grid,
 // Returns (0, 0, 0, 0) if any samples are invalid.
 //
 // TODO(jiawen): optimized version without checks?
+template <typename Sampler>
 __inline__ __device__
-float4 TrilinearSampleNormal(KernelArray3D<const TSDF> regular_grid,
-  float3 grid_coords, float max_tsdf_value) {
+float4 TrilinearSampleNormal(const Sampler& sampler, float3 grid_coords) {
   float3 dx3 = { 1, 0, 0 };
   float3 dy3 = { 0, 1, 0 };
   float3 dz3 = { 0, 0, 1 };
@@ -152,13 +156,10 @@ float4 TrilinearSampleNormal(KernelArray3D<const TSDF> regular_grid,
   // (0, 0).
   // TODO(jiawen): can optimize this by realizing that a lot of samples are
   // redundant between the trilinear samples.
-  float2 d_000 = TrilinearSample(regular_grid, grid_coords, max_tsdf_value);
-  float2 d_100 = TrilinearSample(regular_grid, grid_coords + dx3,
-    max_tsdf_value);
-  float2 d_010 = TrilinearSample(regular_grid, grid_coords + dy3,
-    max_tsdf_value);
-  float2 d_001 = TrilinearSample(regular_grid, grid_coords + dz3,
-    max_tsdf_value);
+  float2 d_000 = sampler.Sample(grid_coords);
+  float2 d_100 = sampler.Sample(grid_coords + dx3);
+  float2 d_010 = sampler.Sample(grid_coords + dy3);
+  float2 d_001 = sampler.Sample(grid_coords + dz3);
 
   float4 normal_out = {};
 
@@ -178,28 +179,465 @@ float4 TrilinearSampleNormal(KernelArray3D<const TSDF> regular_grid,
   return normal_out;
 }
 
+template <typename Voxel>
+__inline__ __device__
+int3 VoxelArraySampler<Voxel>::Size() const {
+  return regular_grid.size();
+}
+
+template <typename Voxel>
+__inline__ __device__
+float2 VoxelArraySampler<Voxel>::Sample(float3 grid_coords) const {
+  return TrilinearSample(regular_grid, grid_coords, max_tsdf_value);
+}
+
+template <typename Voxel>
+__inline__ __device__
+int3 LODSampler<Voxel>::Size() const {
+  return levels[0].Size();
+}
+
+template <typename Voxel>
+__inline__ __device__
+float2 LODSampler<Voxel>::Sample(float3 grid_coords) const {
+  // The voxels of level i are 2^i voxels of levels[0] wide.
+  float footprint = length(grid_coords - eye_grid) * footprint_per_voxel;
+  int level = 0;
+  while (level + 1 < num_levels && footprint >= (2 << level)) {
+    ++level;
+  }
+
+  // Coarse voxel centers are at half-integers too, so voxel j of level i
+  // covers voxels [2^i j, 2^i (j + 1)) of levels[0].
+  if (level > 0) {
+    float2 sample = levels[level].Sample(
+      grid_coords / static_cast<float>(1 << level));
+    if (sample.y > 0) {
+      return sample;
+    }
+  }
+  return levels[0].Sample(grid_coords);
+}
+
+__inline__ __device__
+int3 TextureSampler::Size() const {
+  return size;
+}
+
+__inline__ __device__
+float2 TextureSampler::Sample(float3 grid_coords) const {
+  // Same valid range as TrilinearSample().
+  libcgt::cuda::Box3f valid_box(half3(), make_float3(size) - one3());
+  if (!valid_box.contains(grid_coords)) {
+    return{ 0.0f, 0.0f };
+  }
+
+  // Texel centers are at half-integer coordinates, like voxel centers, so the
+  // hardware filters the same 8 voxels as TrilinearSample(). The validity
+  // channel is 1 only if all of them are observed; with 8-bit filter weights,
+  // any unobserved voxel that contributes pulls it to at most 255/256.
+  float2 texel = tex3D<float2>(texture,
+    grid_coords.x, grid_coords.y, grid_coords.z);
+  if (texel.y < 0.998f) {
+    return{ 0.0f, 0.0f };
+  }
+  return{ 2 * max_tsdf_value * texel.x - max_tsdf_value, 1.0f };
+}
+
+__inline__ __device__
+int2 RaycastOutput::Size() const {
+  return world_points.size();
+}
+
+__inline__ __device__
+void RaycastOutput::Write(int2 xy, float4 world_point, float4 world_normal) {
+  world_points[xy] = world_point;
+  world_normals[xy] = world_normal;
+  if (world_points_surface != 0) {
+    surf2Dwrite(world_point, world_points_surface, xy.x * sizeof(float4),
+      xy.y);
+  }
+  if (world_normals_surface != 0) {
+    surf2Dwrite(world_normal, world_normals_surface, xy.x * sizeof(float4),
+      xy.y);
+  }
+  if (compact.size().x > 0) {
+    uint2 sample = {};
+    if (world_point.w != 0 && world_normal.w != 0) {
+      float3 camera_point = transformPoint(camera_from_world,
+        make_float3(world_point));
+      float3 camera_normal = normalize(transformVector(camera_from_world,
+        make_float3(world_normal)));
+      sample = PackCompactRaycastSample(-camera_point.z, camera_normal);
+    }
+    compact[xy] = sample;
+  }
+}
+
+template <typename Voxel>
+__inline__ __device__
+void MirrorVoxel(const RollingGridView<const Voxel>& regular_grid,
+  float max_tsdf_value, int3 p, cudaSurfaceObject_t mirror) {
+  Voxel voxel = regular_grid[p];
+  ushort2 texel = {
+    static_cast<unsigned short>(
+      voxel.NormalizedDistance(max_tsdf_value) * 65535 + 0.5f),
+    static_cast<unsigned short>(voxel.Weight() > 0 ? 65535 : 0) };
+  surf3Dwrite(texel, mirror, p.x * sizeof(ushort2), p.y, p.z);
+}
+
+template <typename Voxel>
+__global__
+void MirrorTSDFKernel(RollingGridView<const Voxel> regular_grid,
+  float max_tsdf_value,
+  int3 box_min,
+  int3 box_max,
+  cudaSurfaceObject_t mirror) {
+  int2 xy = threadSubscript2DGlobal() + int2{ box_min.x, box_min.y };
+  if (xy.x >= box_max.x || xy.y >= box_max.y) {
+    return;
+  }
+
+  for (int z = box_min.z; z < box_max.z; ++z) {
+    MirrorVoxel(regular_grid, max_tsdf_value, { xy.x, xy.y, z }, mirror);
+  }
+}
+
+// The brick of a grid with num_bricks bricks numbered index.
+__inline__ __device__
+int3 BrickSubscript(int index, int3 num_bricks) {
+  return{ index % num_bricks.x, (index / num_bricks.x) % num_bricks.y,
+    index / (num_bricks.x * num_bricks.y) };
+}
+
+template <typename Voxel>
+__global__
+void MirrorBrickListKernel(RollingGridView<const Voxel> regular_grid,
+  float max_tsdf_value,
+  BrickList bricks,
+  int3 num_bricks,
+  cudaSurfaceObject_t mirror) {
+  const int kBrickSize = RegularGridTSDF::kBrickSize;
+  const unsigned int num_members = *(bricks.size);
+  int3 size = regular_grid.size();
+  for (unsigned int i = blockIdx.x; i < num_members; i += gridDim.x) {
+    int3 origin = kBrickSize * BrickSubscript(bricks.bricks[i], num_bricks);
+    int x = origin.x + threadIdx.x;
+    int y = origin.y + threadIdx.y;
+    if (x >= size.x || y >= size.y) {
+      continue;
+    }
+    for (int z = origin.z; z < min(origin.z + kBrickSize, size.z); ++z) {
+      MirrorVoxel(regular_grid, max_tsdf_value, { x, y, z }, mirror);
+    }
+  }
+}
+
+// Sets voxel p of coarse from the (up to) 8 voxels of fine it covers.
+template <typename Voxel>
+__inline__ __device__
+void DownsampleVoxel(const RollingGridView<const Voxel>& fine,
+  float max_tsdf_value, int3 p, RollingGridView<Voxel>& coarse) {
+  int3 fine_size = fine.size();
+  float sum_wd = 0.0f;
+  float sum_w = 0.0f;
+  int num_observed = 0;
+  for (int dz = 0; dz < 2; ++dz) {
+    for (int dy = 0; dy < 2; ++dy) {
+      for (int dx = 0; dx < 2; ++dx) {
+        int3 q = { 2 * p.x + dx, 2 * p.y + dy, 2 * p.z + dz };
+        // Grids with an odd size have a partial last coarse voxel.
+        if (q.x >= fine_size.x || q.y >= fine_size.y ||
+          q.z >= fine_size.z) {
+          continue;
+        }
+        float2 dw = fine[q].Get(max_tsdf_value);
+        if (dw.y > 0) {
+          sum_wd += dw.y * dw.x;
+          sum_w += dw.y;
+          ++num_observed;
+        }
+      }
+    }
+  }
+
+  // The mean weight fits every encoding, unlike the sum.
+  Voxel& voxel = coarse[p];
+  if (num_observed > 0) {
+    voxel.Set(sum_wd / sum_w, sum_w / num_observed, max_tsdf_value);
+  } else {
+    voxel.Set(0.0f, 0.0f, max_tsdf_value);
+  }
+}
+
+template <typename Voxel>
+__global__
+void DownsampleTSDFKernel(RollingGridView<const Voxel> fine,
+  float max_tsdf_value,
+  int3 box_min,
+  int3 box_max,
+  RollingGridView<Voxel> coarse) {
+  int2 xy = threadSubscript2DGlobal() + int2{ box_min.x, box_min.y };
+  if (xy.x >= box_max.x || xy.y >= box_max.y) {
+    return;
+  }
+
+  for (int z = box_min.z; z < box_max.z; ++z) {
+    DownsampleVoxel(fine, max_tsdf_value, { xy.x, xy.y, z }, coarse);
+  }
+}
+
+template <typename Voxel>
+__global__
+void DownsampleBrickListKernel(RollingGridView<const Voxel> fine,
+  float max_tsdf_value,
+  BrickList bricks,
+  int3 num_bricks,
+  int lod,
+  RollingGridView<Voxel> coarse) {
+  const int kBrickSize = RegularGridTSDF::kBrickSize;
+  const unsigned int num_members = *(bricks.size);
+  int3 size = coarse.size();
+  // Coarse voxel j of level lod covers voxels [j, j + 1) * 2^lod of the grid.
+  const int round_up = (1 << lod) - 1;
+  for (unsigned int i = blockIdx.x; i < num_members; i += gridDim.x) {
+    int3 brick = BrickSubscript(bricks.bricks[i], num_bricks);
+    int3 box_min = {
+      (kBrickSize * brick.x) >> lod,
+      (kBrickSize * brick.y) >> lod,
+      (kBrickSize * brick.z) >> lod
+    };
+    int3 box_max = {
+      min((kBrickSize * (brick.x + 1) + round_up) >> lod, size.x),
+      min((kBrickSize * (brick.y + 1) + round_up) >> lod, size.y),
+      min((kBrickSize * (brick.z + 1) + round_up) >> lod, size.z)
+    };
+    for (int y = box_min.y + threadIdx.y; y < box_max.y; y += blockDim.y) {
+      for (int x = box_min.x + threadIdx.x; x < box_max.x;
+        x += blockDim.x) {
+        for (int z = box_min.z; z < box_max.z; ++z) {
+          DownsampleVoxel(fine, max_tsdf_value, { x, y, z }, coarse);
+        }
+      }
+    }
+  }
+}
+
 #define kTEpsilon 2.0f
 #define kTStepSize 1.0f
 
+// Slack, in voxels, used when leaping out of an empty cell so that the next
+// probe lands strictly inside the following cell.
+#define kEmptySpaceExitEpsilon 1e-3f
+
+__inline__ __device__
+bool InBounds(int3 size, int3 p) {
+  return p.x >= 0 && p.y >= 0 && p.z >= 0 &&
+    p.x < size.x && p.y < size.y && p.z < size.z;
+}
+
+// Returns the ray parameter at which origin + t * dir leaves the cube
+// [box_min, box_min + box_size).
+__inline__ __device__
+float ExitT(float3 origin, float3 dir, float3 box_min, float box_size) {
+  float t_exit = FLT_MAX;
+  if (dir.x > 0) {
+    t_exit = fminf(t_exit, (box_min.x + box_size - origin.x) / dir.x);
+  } else if (dir.x < 0) {
+    t_exit = fminf(t_exit, (box_min.x - origin.x) / dir.x);
+  }
+  if (dir.y > 0) {
+    t_exit = fminf(t_exit, (box_min.y + box_size - origin.y) / dir.y);
+  } else if (dir.y < 0) {
+    t_exit = fminf(t_exit, (box_min.y - origin.y) / dir.y);
+  }
+  if (dir.z > 0) {
+    t_exit = fminf(t_exit, (box_min.z + box_size - origin.z) / dir.z);
+  } else if (dir.z < 0) {
+    t_exit = fminf(t_exit, (box_min.z - origin.z) / dir.z);
+  }
+  return t_exit;
+}
+
+// Leaps over the cells of empty_space, starting at t, in which no sample can
+// be negative. Returns a t just before the ray leaves the last such cell, or
+// t itself if the cell it starts in may contain the surface.
+//
+// Every sample the ray would have taken in the skipped cells is either
+// invalid or non-negative. Resampling at the returned t therefore finds the
+// same zero crossings as marching through them.
+__inline__ __device__
+float SkipEmptySpace(const EmptySpaceMap& empty_space, float3 origin,
+  float3 dir, float t, float t_end) {
+  const float kBrickSize = RegularGridTSDF::kBrickSize;
+  const float kCoarseSize = kBrickSize * kEmptySpaceCoarseBricks;
+
+  float t_skip = t;
+  float t_probe = t;
+  while (t_probe < t_end) {
+    float3 p = origin + t_probe * dir;
+
+    float t_exit;
+    int3 coarse = floorToInt(p / kCoarseSize);
+    int3 brick = floorToInt(p / kBrickSize);
+    if (InBounds(empty_space.coarse_min_sdf.size(), coarse) &&
+      empty_space.coarse_min_sdf[coarse] > 0) {
+      t_exit = ExitT(origin, dir, kCoarseSize * make_float3(coarse),
+        kCoarseSize);
+    } else if (InBounds(empty_space.brick_min_sdf.size(), brick) &&
+      empty_space.brick_min_sdf[brick] > 0) {
+      t_exit = ExitT(origin, dir, kBrickSize * make_float3(brick),
+        kBrickSize);
+    } else {
+      break;
+    }
+
+    t_skip = fmaxf(t_skip, t_exit - kEmptySpaceExitEpsilon);
+    t_probe = fmaxf(t_probe, t_exit) + kEmptySpaceExitEpsilon;
+  }
+  return fminf(t_skip, t_end);
+}
+
+// Recomputes brick_min_sdf[brick] with a block of (kBrickSize + 2)^2 threads.
+// Every thread of the block must call it.
+template <typename Voxel>
+__inline__ __device__
+void UpdateBrickMinSDF(const RollingGridView<const Voxel>& regular_grid,
+  float max_tsdf_value, int3 brick, KernelArray3D<float>& brick_min_sdf) {
+  const int kApronSize = RegularGridTSDF::kBrickSize + 2;
+  __shared__ float s_min_sdf[kApronSize * kApronSize];
+
+  int3 origin = RegularGridTSDF::kBrickSize * brick - make_int3(1);
+  int3 size = regular_grid.size();
+
+  // Each thread reduces one column of the brick and its apron.
+  int x = origin.x + threadIdx.x;
+  int y = origin.y + threadIdx.y;
+  float min_sdf = FLT_MAX;
+  if (x >= 0 && y >= 0 && x < size.x && y < size.y) {
+    for (int dz = 0; dz < kApronSize; ++dz) {
+      int z = origin.z + dz;
+      if (z < 0 || z >= size.z) {
+        continue;
+      }
+      float2 sdf = regular_grid[{ x, y, z }].Get(max_tsdf_value);
+      if (sdf.y > 0) {
+        min_sdf = fminf(min_sdf, sdf.x);
+      }
+    }
+  }
+
+  int thread_index = threadIdx.x + kApronSize * threadIdx.y;
+  s_min_sdf[thread_index] = min_sdf;
+  __syncthreads();
+
+  if (thread_index == 0) {
+    for (int i = 1; i < kApronSize * kApronSize; ++i) {
+      min_sdf = fminf(min_sdf, s_min_sdf[i]);
+    }
+    brick_min_sdf[brick] = min_sdf;
+  }
+  // s_min_sdf is reused if the block moves on to another brick.
+  __syncthreads();
+}
+
+template <typename Voxel>
+__global__
+void UpdateBrickMinSDFKernel(RollingGridView<const Voxel> regular_grid,
+  float max_tsdf_value,
+  int3 brick_min,
+  KernelArray3D<float> brick_min_sdf) {
+  int3 brick = brick_min + int3{ static_cast<int>(blockIdx.x),
+    static_cast<int>(blockIdx.y), static_cast<int>(blockIdx.z) };
+  UpdateBrickMinSDF(regular_grid, max_tsdf_value, brick, brick_min_sdf);
+}
+
+template <typename Voxel>
+__global__
+void UpdateBrickListMinSDFKernel(RollingGridView<const Voxel> regular_grid,
+  float max_tsdf_value,
+  BrickList bricks,
+  KernelArray3D<float> brick_min_sdf) {
+  const unsigned int num_members = *(bricks.size);
+  int3 num_bricks = brick_min_sdf.size();
+  for (unsigned int i = blockIdx.x; i < num_members; i += gridDim.x) {
+    UpdateBrickMinSDF(regular_grid, max_tsdf_value,
+      BrickSubscript(bricks.bricks[i], num_bricks), brick_min_sdf);
+  }
+}
+
+__inline__ __device__
+float CoarseMinSDF(const KernelArray3D<const float>& brick_min_sdf,
+  int3 coarse) {
+  int3 num_bricks = brick_min_sdf.size();
+  int3 first_brick = kEmptySpaceCoarseBricks * coarse;
+  float min_sdf = FLT_MAX;
+  for (int k = 0; k < kEmptySpaceCoarseBricks; ++k) {
+    for (int j = 0; j < kEmptySpaceCoarseBricks; ++j) {
+      for (int i = 0; i < kEmptySpaceCoarseBricks; ++i) {
+        int3 brick = first_brick + int3{ i, j, k };
+        if (InBounds(num_bricks, brick)) {
+          min_sdf = fminf(min_sdf, brick_min_sdf[brick]);
+        }
+      }
+    }
+  }
+  return min_sdf;
+}
+
 __global__
-void RaycastKernel(KernelArray3D<const TSDF> regular_grid,
+void UpdateCoarseMinSDFKernel(KernelArray3D<const float> brick_min_sdf,
+  int3 coarse_min,
+  int3 coarse_max,
+  KernelArray3D<float> coarse_min_sdf) {
+  int2 xy = threadSubscript2DGlobal() + int2{ coarse_min.x, coarse_min.y };
+  if (xy.x >= coarse_max.x || xy.y >= coarse_max.y) {
+    return;
+  }
+
+  for (int z = coarse_min.z; z < coarse_max.z; ++z) {
+    int3 coarse = { xy.x, xy.y, z };
+    coarse_min_sdf[coarse] = CoarseMinSDF(brick_min_sdf, coarse);
+  }
+}
+
+__global__
+void UpdateBrickListCoarseMinSDFKernel(
+  KernelArray3D<const float> brick_min_sdf,
+  BrickList bricks,
+  KernelArray3D<float> coarse_min_sdf) {
+  const unsigned int num_members = *(bricks.size);
+  int3 num_bricks = brick_min_sdf.size();
+  for (unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+    i < num_members; i += gridDim.x * blockDim.x) {
+    int3 brick = BrickSubscript(bricks.bricks[i], num_bricks);
+    int3 coarse = {
+      brick.x / kEmptySpaceCoarseBricks,
+      brick.y / kEmptySpaceCoarseBricks,
+      brick.z / kEmptySpaceCoarseBricks
+    };
+    coarse_min_sdf[coarse] = CoarseMinSDF(brick_min_sdf, coarse);
+  }
+}
+
+template <typename Sampler>
+__global__
+void RaycastKernel(Sampler sampler,
+  EmptySpaceMap empty_space,
   float4x4 grid_from_world,
   float4x4 world_from_grid,
   float max_tsdf_value,
   float4 flpp,
   float4x4 world_from_camera,
   float3 eye_world,
-  KernelArray2D<float4> world_points_out,
-  KernelArray2D<float4> world_normals_out) {
+  RaycastOutput out) {
   // TODO(jiawen): simplify this logic with a "bool valid" flag.
   float4 world_point = {};
   float4 world_normal = {};
 
   // Cast a ray for each pixel.
   int2 xy = threadSubscript2DGlobal();
-  if (!contains(world_points_out.size(), xy)) {
-    world_points_out[xy] = world_point;
-    world_normals_out[xy] = world_normal;
+  if (!contains(out.Size(), xy)) {
     return;
   }
 
@@ -213,13 +651,12 @@ void RaycastKernel(KernelArray3D<const TSDF> regular_grid,
   float t_near;
   float t_far;
   // TODO(jiawen): intersect with a grid that's 1 voxel smaller.
-  libcgt::cuda::Box3f bbox_grid(regular_grid.size());
+  libcgt::cuda::Box3f bbox_grid(sampler.Size());
   bool intersected = libcgt::cuda::intersectLine(eye_grid, dir_grid,
     bbox_grid, t_near, t_far);
 
   if (!intersected) {
-    world_points_out[xy] = world_point;
-    world_normals_out[xy] = world_normal;
+    out.Write(xy, world_point, world_normal);
     return;
   }
 
@@ -242,17 +679,31 @@ void RaycastKernel(KernelArray3D<const TSDF> regular_grid,
 
   float curr_t = t_start;
   float3 curr_coords_grid = eye_grid + curr_t * dir_grid;
-  float2 curr_sdf =
-    TrilinearSample(regular_grid, curr_coords_grid, max_tsdf_value);
+  float2 curr_sdf = sampler.Sample(curr_coords_grid);
+
+  // The last sample is at t_start + (num_iterations - 1) * kTStepSize.
+  float t_last = t_start + (num_iterations - 1) * kTStepSize;
+
+  while (true) {
+    float t_skip =
+      SkipEmptySpace(empty_space, eye_grid, dir_grid, curr_t, t_last);
+    if (t_skip > curr_t) {
+      curr_t = t_skip;
+      curr_coords_grid = eye_grid + curr_t * dir_grid;
+      curr_sdf = sampler.Sample(curr_coords_grid);
+    }
 
-  for (int i = 1; i < num_iterations; ++i) {
     prev_t = curr_t;
     prev_coords_grid = curr_coords_grid;
     prev_sdf = curr_sdf;
 
     curr_t = prev_t + kTStepSize;
+    // Allow for rounding in the accumulated t.
+    if (curr_t > t_last + 0.5f * kTStepSize) {
+      break;
+    }
     curr_coords_grid = eye_grid + curr_t * dir_grid;
-    curr_sdf = TrilinearSample(regular_grid, curr_coords_grid, max_tsdf_value);
+    curr_sdf = sampler.Sample(curr_coords_grid);
 
     // Both samples are valid, and it's a positive to negative zero crossing.
     if (prev_sdf.y > 0 && curr_sdf.y > 0 &&
@@ -275,8 +726,7 @@ void RaycastKernel(KernelArray3D<const TSDF> regular_grid,
     // TODO(jiawen): make this a method
     world_point = make_float4(
       transformPoint(world_from_grid, surface_point_grid), 1.0f);
-    float4 grid_normal = TrilinearSampleNormal(regular_grid,
-      surface_point_grid, max_tsdf_value);
+    float4 grid_normal = TrilinearSampleNormal(sampler, surface_point_grid);
     if (grid_normal.w > 0) {
       // TODO(jiawen): We store *world* distances in the grid (the fact that
       // it's fixed-point is beside the point). Therefore, when we take its
@@ -290,12 +740,13 @@ void RaycastKernel(KernelArray3D<const TSDF> regular_grid,
     }
   }
 
-  world_points_out[xy] = world_point;
-  world_normals_out[xy] = world_normal;
+  out.Write(xy, world_point, world_normal);
 }
 
+template <typename Sampler>
 __global__
-void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
+void AdaptiveRaycastKernel(Sampler sampler,
+  EmptySpaceMap empty_space,
   float4x4 grid_from_world,
   float4x4 world_from_grid,
   float max_tsdf_value,
@@ -303,17 +754,14 @@ void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
   float4 flpp,
   float4x4 world_from_camera,
   float3 eye_world,
-  KernelArray2D<float4> world_points_out,
-  KernelArray2D<float4> world_normals_out) {
+  RaycastOutput out) {
   // TODO(jiawen): simplify this logic with a "bool valid" flag.
   float4 world_point = {};
   float4 world_normal = {};
 
   // Cast a ray for each pixel.
   int2 xy = threadSubscript2DGlobal();
-  if (!contains(world_points_out.size(), xy)) {
-    world_points_out[xy] = world_point;
-    world_normals_out[xy] = world_normal;
+  if (!contains(out.Size(), xy)) {
     return;
   }
 
@@ -327,13 +775,12 @@ void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
   float t_near;
   float t_far;
   // TODO(jiawen): intersect with a grid that's 1 voxel smaller.
-  libcgt::cuda::Box3f bbox_grid(regular_grid.size());
+  libcgt::cuda::Box3f bbox_grid(sampler.Size());
   bool intersected = libcgt::cuda::intersectLine(eye_grid, dir_grid,
     bbox_grid, t_near, t_far);
 
   if (!intersected) {
-    world_points_out[xy] = world_point;
-    world_normals_out[xy] = world_normal;
+    out.Write(xy, world_point, world_normal);
     return;
   }
 
@@ -354,10 +801,17 @@ void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
 
   float curr_t = t_start;
   float3 curr_coords_grid = eye_grid + curr_t * dir_grid;
-  float2 curr_sdf =
-    TrilinearSample(regular_grid, curr_coords_grid, max_tsdf_value);
+  float2 curr_sdf = sampler.Sample(curr_coords_grid);
 
   while (!found_surface && curr_t < t_end) {
+    float t_skip =
+      SkipEmptySpace(empty_space, eye_grid, dir_grid, curr_t, t_end);
+    if (t_skip > curr_t) {
+      curr_t = t_skip;
+      curr_coords_grid = eye_grid + curr_t * dir_grid;
+      curr_sdf = sampler.Sample(curr_coords_grid);
+    }
+
     prev_t = curr_t;
     prev_coords_grid = curr_coords_grid;
     prev_sdf = curr_sdf;
@@ -373,7 +827,7 @@ void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
 
     curr_t = prev_t + step_size;
     curr_coords_grid = eye_grid + curr_t * dir_grid;
-    curr_sdf = TrilinearSample(regular_grid, curr_coords_grid, max_tsdf_value);
+    curr_sdf = sampler.Sample(curr_coords_grid);
 
     // Both samples are valid, and it's a positive to negative zero crossing.
     if (prev_sdf.y > 0 && curr_sdf.y > 0 &&
@@ -396,8 +850,7 @@ void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
     // TODO(jiawen): make this a method
     world_point = make_float4(
       transformPoint(world_from_grid, surface_point_grid), 1.0f);
-    float4 grid_normal = TrilinearSampleNormal(regular_grid,
-      surface_point_grid, max_tsdf_value);
+    float4 grid_normal = TrilinearSampleNormal(sampler, surface_point_grid);
     if (grid_normal.w > 0) {
       // TODO(jiawen): We store *world* distances in the grid (the fact that
       // it's fixed-point is beside the point). Therefore, when we take its
@@ -411,6 +864,36 @@ void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
     }
   }
 
-  world_points_out[xy] = world_point;
-  world_normals_out[xy] = world_normal;
+  out.Write(xy, world_point, world_normal);
 }
+
+#define RAYCAST_KERNEL_INSTANTIATIONS(Sampler) \
+  template __global__ void RaycastKernel<Sampler>(Sampler, EmptySpaceMap, \
+    float4x4, float4x4, float, float4, float4x4, float3, RaycastOutput); \
+  template __global__ void AdaptiveRaycastKernel<Sampler>(Sampler, \
+    EmptySpaceMap, float4x4, float4x4, float, float, float4, float4x4, \
+    float3, RaycastOutput);
+
+#define VOXEL_KERNEL_INSTANTIATIONS(Voxel) \
+  RAYCAST_KERNEL_INSTANTIATIONS(VoxelArraySampler<Voxel>) \
+  RAYCAST_KERNEL_INSTANTIATIONS(LODSampler<Voxel>) \
+  template __global__ void MirrorTSDFKernel<Voxel>( \
+    RollingGridView<const Voxel>, float, int3, int3, cudaSurfaceObject_t); \
+  template __global__ void DownsampleTSDFKernel<Voxel>( \
+    RollingGridView<const Voxel>, float, int3, int3, RollingGridView<Voxel>); \
+  template __global__ void MirrorBrickListKernel<Voxel>( \
+    RollingGridView<const Voxel>, float, BrickList, int3, \
+    cudaSurfaceObject_t); \
+  template __global__ void DownsampleBrickListKernel<Voxel>( \
+    RollingGridView<const Voxel>, float, BrickList, int3, int, \
+    RollingGridView<Voxel>); \
+  template __global__ void UpdateBrickMinSDFKernel<Voxel>( \
+    RollingGridView<const Voxel>, float, int3, KernelArray3D<float>); \
+  template __global__ void UpdateBrickListMinSDFKernel<Voxel>( \
+    RollingGridView<const Voxel>, float, BrickList, KernelArray3D<float>);
+
+TSDF_FOR_EACH_ENCODING(VOXEL_KERNEL_INSTANTIATIONS)
+RAYCAST_KERNEL_INSTANTIATIONS(TextureSampler)
+
+#undef VOXEL_KERNEL_INSTANTIATIONS
+#undef RAYCAST_KERNEL_INSTANTIATIONS
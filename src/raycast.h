@@ -14,6 +14,8 @@
 #ifndef RAYCAST_H
 #define RAYCAST_H
 
+#include <texture_types.h>
+#include <surface_types.h>
 #include <vector_types.h>
 
 #include "libcgt/cuda/KernelArray2D.h"
@@ -21,22 +23,208 @@
 #include "libcgt/cuda/float3x3.h"
 #include "libcgt/cuda/float4x4.h"
 
+#include "brick_list.h"
 #include "regular_grid_tsdf.h"
+#include "rolling_grid_view.h"
+#include "tsdf.h"
 
+// Side length, in bricks, of one coarse cell of an EmptySpaceMap.
+constexpr int kEmptySpaceCoarseBricks = 4;
+
+// A two-level min-SDF pyramid over the bricks of a RegularGridTSDF. The
+// raycast kernels use it to leap over space that cannot produce a positive to
+// negative zero crossing.
+//
+// brick_min_sdf holds, for each RegularGridTSDF::kBrickSize^3 brick, the
+// minimum distance over the observed voxels of the brick and its one voxel
+// apron, or FLT_MAX if none are observed. Every trilinear sample taken inside
+// the brick reads only those voxels, so when the value is positive no sample
+// in the brick can be negative. coarse_min_sdf is the minimum over each
+// kEmptySpaceCoarseBricks^3 group of bricks.
+struct EmptySpaceMap {
+  KernelArray3D<const float> brick_min_sdf;
+  KernelArray3D<const float> coarse_min_sdf;
+};
+
+// Reads a RegularGridTSDF for the raycast kernels with 8 loads from the voxel
+// array per trilinear sample. Voxel is any of the TSDF encodings in tsdf.h.
+template <typename Voxel>
+struct VoxelArraySampler {
+  RollingGridView<const Voxel> regular_grid;
+  float max_tsdf_value;
+
+  __device__ int3 Size() const;
+
+  // Returns (distance, 1), or (0, 0) if any of the samples is unobserved.
+  __device__ float2 Sample(float3 grid_coords) const;
+};
+
+// Reads a mirror of a RegularGridTSDF held in a 3D texture: one unorm16 pair
+// per voxel, the encoded distance and whether the voxel is observed (0 or 1).
+// Each trilinear sample is a single hardware-filtered fetch.
+//
+// The filter weights have 8 fractional bits. Samples can therefore differ
+// slightly from VoxelArraySampler, and a sample whose only unobserved
+// neighbor has a filter weight below 1/256 counts as observed.
+struct TextureSampler {
+  cudaTextureObject_t texture;
+  int3 size;
+  float max_tsdf_value;
+
+  __device__ int3 Size() const;
+
+  // Same contract as VoxelArraySampler::Sample().
+  __device__ float2 Sample(float3 grid_coords) const;
+};
+
+// Reads a RegularGridTSDF and its downsampled copies (see
+// RegularGridTSDF::LODReadView()). Each sample comes from the coarsest level
+// whose voxels are no larger than the footprint of a pixel at the sample's
+// distance from the eye, or from levels[0] when that level is unobserved
+// there. Distant samples then read a fraction of the bytes, mostly from
+// cache.
+template <typename Voxel>
+struct LODSampler {
+  // levels[i] is downsampled 2^i times along each axis and addressed in its
+  // own grid coordinates; levels[0] is the volume itself.
+  VoxelArraySampler<Voxel> levels[RegularGridTSDF::kNumLODs];
+  int num_levels;
+  // The camera eye, in the grid coordinates of levels[0].
+  float3 eye_grid;
+  // The footprint of a pixel one voxel from the eye, in voxels: the inverse
+  // of the smaller focal length.
+  float footprint_per_voxel;
+
+  __device__ int3 Size() const;
+
+  // Same contract as VoxelArraySampler::Sample(), with grid_coords in the
+  // grid coordinates of levels[0].
+  __device__ float2 Sample(float3 grid_coords) const;
+};
+
+// Copies [box_min, box_max) of regular_grid into the TextureSampler mirror
+// bound to the surface mirror. Launch with one thread per (x, y) column.
+template <typename Voxel>
+__global__
+void MirrorTSDFKernel(RollingGridView<const Voxel> regular_grid,
+  float max_tsdf_value,
+  int3 box_min,
+  int3 box_max,
+  cudaSurfaceObject_t mirror);
+
+// Same as MirrorTSDFKernel, for the voxels of the members of bricks, in a
+// grid of num_bricks bricks. Launch with kBrickListBlocks blocks of
+// kBrickSize^2 threads.
+template <typename Voxel>
+__global__
+void MirrorBrickListKernel(RollingGridView<const Voxel> regular_grid,
+  float max_tsdf_value,
+  BrickList bricks,
+  int3 num_bricks,
+  cudaSurfaceObject_t mirror);
+
+// Sets the voxels [box_min, box_max) of coarse, a grid downsampled 2x from
+// fine, to the weighted average distance of the (up to) 8 fine voxels they
+// cover, and to their mean weight. Unobserved fine voxels do not contribute;
+// a coarse voxel is unobserved only if all of them are. Launch with one
+// thread per (x, y) column of the box.
+template <typename Voxel>
+__global__
+void DownsampleTSDFKernel(RollingGridView<const Voxel> fine,
+  float max_tsdf_value,
+  int3 box_min,
+  int3 box_max,
+  RollingGridView<Voxel> coarse);
+
+// Same as DownsampleTSDFKernel, for the voxels of coarse, level lod > 0, that
+// cover the members of bricks, bricks of level 0 in a grid of num_bricks
+// bricks. fine is level lod - 1. Launch with kBrickListBlocks blocks of
+// kBrickSize^2 threads, once per level from 1 up.
+template <typename Voxel>
+__global__
+void DownsampleBrickListKernel(RollingGridView<const Voxel> fine,
+  float max_tsdf_value,
+  BrickList bricks,
+  int3 num_bricks,
+  int lod,
+  RollingGridView<Voxel> coarse);
+
+// Recomputes brick_min_sdf for the bricks starting at brick_min. Launch with
+// one block of (kBrickSize + 2)^2 threads per brick.
+template <typename Voxel>
+__global__
+void UpdateBrickMinSDFKernel(RollingGridView<const Voxel> regular_grid,
+  float max_tsdf_value,
+  int3 brick_min,
+  KernelArray3D<float> brick_min_sdf);
+
+// Same as UpdateBrickMinSDFKernel, for the members of bricks. Launch with
+// kBrickListBlocks blocks of (kBrickSize + 2)^2 threads.
+template <typename Voxel>
+__global__
+void UpdateBrickListMinSDFKernel(RollingGridView<const Voxel> regular_grid,
+  float max_tsdf_value,
+  BrickList bricks,
+  KernelArray3D<float> brick_min_sdf);
+
+// Recomputes coarse_min_sdf for the coarse cells [coarse_min, coarse_max).
+// Launch with one thread per (x, y) column.
+__global__
+void UpdateCoarseMinSDFKernel(KernelArray3D<const float> brick_min_sdf,
+  int3 coarse_min,
+  int3 coarse_max,
+  KernelArray3D<float> coarse_min_sdf);
+
+// Recomputes coarse_min_sdf for the coarse cells that contain the members of
+// bricks. Launch with kBrickListBlocks blocks of any size.
+__global__
+void UpdateBrickListCoarseMinSDFKernel(
+  KernelArray3D<const float> brick_min_sdf,
+  BrickList bricks,
+  KernelArray3D<float> coarse_min_sdf);
+
+// Where the raycast kernels write the world point and normal of each pixel.
+// The surfaces are optional. When not zero, every pixel is also written to
+// them, so that a caller can fill surfaces of CUDA arrays the same size as
+// world_points (e.g. mapped RGBA32F GL textures) without another pass.
+//
+// compact is optional too. When not empty, every pixel is also written to it
+// as a compact raycast sample (see compact_raycast.cuh) in the coordinates of
+// camera_from_world, the inverse of the raycast pose.
+struct RaycastOutput {
+  KernelArray2D<float4> world_points;
+  KernelArray2D<float4> world_normals;
+  cudaSurfaceObject_t world_points_surface;
+  cudaSurfaceObject_t world_normals_surface;
+  KernelArray2D<uint2> compact;
+  float4x4 camera_from_world;
+
+  __device__ int2 Size() const;
+
+  __device__ void Write(int2 xy, float4 world_point, float4 world_normal);
+};
+
+// Sampler is VoxelArraySampler or LODSampler (of any encoding) or
+// TextureSampler.
+template <typename Sampler>
 __global__
-void RaycastKernel(KernelArray3D<const TSDF> regular_grid,
+void RaycastKernel(Sampler sampler,
+  EmptySpaceMap empty_space,
   float4x4 grid_from_world, // in meters
   float4x4 world_from_grid, // in meters
   float max_tsdf_value,
   float4 flpp, // camera intrinsics
   float4x4 world_from_camera, // camera pose
   float3 eye_world, // camera eye in world coords
-  KernelArray2D<float4> world_depth_out,
-  KernelArray2D<float4> world_normal_out
+  RaycastOutput out
 );
 
+// Sampler is VoxelArraySampler or LODSampler (of any encoding) or
+// TextureSampler.
+template <typename Sampler>
 __global__
-void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
+void AdaptiveRaycastKernel(Sampler sampler,
+  EmptySpaceMap empty_space,
   float4x4 grid_from_world, // in meters
   float4x4 world_from_grid, // in meters
   float max_tsdf_value,
@@ -44,8 +232,7 @@ void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
   float4 flpp, // camera intrinsics
   float4x4 world_from_camera, // camera pose
   float3 eye_world, // camera eye in world coords
-  KernelArray2D<float4> world_depth_out,
-  KernelArray2D<float4> world_normal_out
+  RaycastOutput out
 );
 
 #endif // RAYCAST_H
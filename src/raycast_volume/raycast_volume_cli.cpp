@@ -11,8 +11,14 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include <algorithm>
+#include <cassert>
+#include <future>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include <cuda_runtime.h>
 #include <gflags/gflags.h>
 #include "libcgt/camera_wrappers/PoseStream.h"
 #include "libcgt/core/common/ArrayUtils.h"
@@ -21,13 +27,24 @@
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 #include "third_party/pystring/pystring.h"
 
+#include "../perf_collector.h"
 #include "../pose_frame.h"
 #include "../pose_utils.h"
 #include "../regular_grid_tsdf.h"
 #include "../rgbd_camera_parameters.h"
+#include "../thread_pool.h"
+#include "../tsdf_file.h"
 
 // Options.
 DEFINE_bool(collect_perf, false, "Collect performance statistics.");
+DEFINE_bool(texture_raycast, false, "Sample the TSDF through a "
+  "hardware-filtered 3D texture mirror instead of interpolating voxels in "
+  "software. Faster, slightly less accurate.");
+DEFINE_int32(batch_size, 4, "Number of poses raycast back to back before "
+  "their outputs are downloaded together. Two batches are in flight: one "
+  "is raycast while the other is downloaded and written.");
+DEFINE_int32(num_write_threads, 4, "Number of threads writing output files "
+  "(<= 0 for one per hardware thread).");
 
 // Inputs.
 DEFINE_string(tsdf3d, "", "Input TSDF");
@@ -50,11 +67,9 @@ using libcgt::camera_wrappers::PoseStreamMetadata;
 using libcgt::camera_wrappers::PoseStreamTransformDirection;
 using libcgt::camera_wrappers::PoseStreamUnits;
 using libcgt::core::cameras::Intrinsics;
-using libcgt::core::arrayutils::cast;
 using libcgt::core::arrayutils::flipY;
 using libcgt::core::stringPrintf;
 using libcgt::core::vecmath::EuclideanTransform;
-using libcgt::core::vecmath::SimilarityTransform;
 using pystring::os::path::join;
 
 struct TimestampedPose {
@@ -63,6 +78,94 @@ struct TimestampedPose {
   EuclideanTransform camera_from_world;
 };
 
+namespace {
+
+// If array cannot be pinned, copies to and from it are from pageable memory:
+// slower, and synchronous with the host, but still correct. Unpin() then
+// fails harmlessly on it. Either error is cleared.
+template <typename T>
+void Pin(Array2D<T>& array) {
+  if (cudaHostRegister(array.pointer(),
+    array.width() * array.height() * sizeof(T),
+    cudaHostRegisterPortable) != cudaSuccess) {
+    cudaGetLastError();
+  }
+}
+
+template <typename T>
+void Unpin(Array2D<T>& array) {
+  if (array.pointer() != nullptr &&
+    cudaHostUnregister(array.pointer()) != cudaSuccess) {
+    cudaGetLastError();
+  }
+}
+
+void DownloadAsync(const DeviceArray2D<float4>& src,
+  Array2D<Vector4f>& dst_array, cudaStream_t stream) {
+  static_assert(sizeof(float4) == sizeof(Vector4f), "Mismatched sizes.");
+  assert(src.size() == dst_array.size());
+  Array2DWriteView<Vector4f> dst = dst_array.writeView();
+  cudaMemcpy2DAsync(dst.pointer(), dst.stride().y,
+    src.pointer(), src.pitch(),
+    src.width() * sizeof(float4), src.height(),
+    cudaMemcpyDeviceToHost, stream);
+}
+
+// The buffers of up to --batch_size poses, from raycast to written file.
+struct RaycastBatch {
+  RaycastBatch(const Vector2i& resolution, int batch_size) {
+    for (int i = 0; i < batch_size; ++i) {
+      world_points.emplace_back(resolution);
+      world_normals.emplace_back(resolution);
+      host_world_points.emplace_back(resolution);
+      Pin(host_world_points.back());
+      host_world_normals.emplace_back(resolution);
+      Pin(host_world_normals.back());
+    }
+    cudaEventCreateWithFlags(&raycast_done, cudaEventDisableTiming);
+    cudaEventCreateWithFlags(&downloaded, cudaEventDisableTiming);
+  }
+
+  ~RaycastBatch() {
+    WaitForWrites();
+    cudaEventSynchronize(downloaded);
+    cudaEventDestroy(raycast_done);
+    cudaEventDestroy(downloaded);
+    for (size_t i = 0; i < host_world_points.size(); ++i) {
+      Unpin(host_world_points[i]);
+      Unpin(host_world_normals[i]);
+    }
+  }
+
+  RaycastBatch(const RaycastBatch& copy) = delete;
+  RaycastBatch& operator = (const RaycastBatch& copy) = delete;
+
+  void WaitForWrites() {
+    for (std::future<void>& write : writes) {
+      write.wait();
+    }
+    writes.clear();
+  }
+
+  std::vector<DeviceArray2D<float4>> world_points;
+  std::vector<DeviceArray2D<float4>> world_normals;
+  std::vector<Array2D<Vector4f>> host_world_points;
+  std::vector<Array2D<Vector4f>> host_world_normals;
+
+  // Indices into the camera path of the poses in this batch.
+  std::vector<size_t> poses;
+
+  // Recorded on the raycast stream after the last raycast, and on the
+  // download stream after the last download.
+  cudaEvent_t raycast_done = nullptr;
+  cudaEvent_t downloaded = nullptr;
+
+  // Writes from the host buffers.
+  std::vector<std::future<void>> writes;
+};
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
@@ -90,10 +193,15 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  // TODO: implement load as a free function without a dummy constructor.
-  // currently, we're stuck at 512^3!.
-  Vector3i resolution{512};
-  RegularGridTSDF tsdf(resolution, SimilarityTransform{});
+  // Only the header is read here: Load() streams the voxels.
+  TSDFFileReader tsdf_header;
+  if (!tsdf_header.Open(FLAGS_tsdf3d)) {
+    fprintf(stderr, "Error loading TSDF3D from %s\n.",
+      FLAGS_tsdf3d.c_str());
+    return 1;
+  }
+  RegularGridTSDF tsdf(tsdf_header.Resolution(),
+    tsdf_header.WorldFromGrid(), tsdf_header.MaxTSDFValue());
 
   if (!tsdf.Load(FLAGS_tsdf3d)) {
     fprintf(stderr, "Error loading TSDF3D from %s\n.",
@@ -127,40 +235,110 @@ int main(int argc, char* argv[]) {
       FLAGS_pose.c_str());
   }
 
-  DeviceArray2D<float4> world_points(camera_params.resolution);
-  DeviceArray2D<float4> world_normals(camera_params.resolution);
-  Array2D<Vector4f> host_world_points(camera_params.resolution);
-  Array2D<Vector4f> host_world_normals(camera_params.resolution);
-
   const Vector4f flpp{camera_params.undistorted_intrinsics.focalLength,
     camera_params.undistorted_intrinsics.principalPoint};
+  const RaycastSampling sampling = FLAGS_texture_raycast ?
+    RaycastSampling::TEXTURE : RaycastSampling::VOXEL_ARRAY;
+  const int batch_size = std::max(1, FLAGS_batch_size);
 
-  for (size_t i = 0; i < camera_path.size(); ++i) {
-    printf("Raycasting frame %zu of %zu\n", i, camera_path.size());
+  // Raycasts go on one stream and downloads on another, so that batch b + 1
+  // is raycast while batch b is copied over PCIe, and written to disk by the
+  // pool after that. The streams are blocking so that they wait for the
+  // default stream work done while loading the volume (e.g. the empty space
+  // map).
+  cudaStream_t raycast_stream;
+  cudaStream_t download_stream;
+  cudaStreamCreate(&raycast_stream);
+  cudaStreamCreate(&download_stream);
+  ThreadPool write_pool(FLAGS_num_write_threads);
 
-    const auto& pose = camera_path[i];
-    tsdf.Raycast(flpp, inverse(pose.camera_from_world).asMatrix(),
-      world_points, world_normals);
+  std::unique_ptr<RaycastBatch> batches[2];
+  for (auto& batch : batches) {
+    batch.reset(new RaycastBatch(camera_params.resolution, batch_size));
+  }
+
+  // Waits for batch's downloads, then hands its outputs to the pool.
+  auto write_batch = [&](RaycastBatch& batch) {
+    cudaEventSynchronize(batch.downloaded);
+    for (size_t k = 0; k < batch.poses.size(); ++k) {
+      const TimestampedPose& pose = camera_path[batch.poses[k]];
+      if (FLAGS_output_world_points || FLAGS_output_depth) {
+        std::string filename = join(FLAGS_output_dir,
+          stringPrintf("world_points_%05d_%020lld.pfm4",
+            pose.frame_index, pose.timestamp));
+        Array2DReadView<Vector4f> src = batch.host_world_points[k];
+        batch.writes.push_back(write_pool.Submit([src, filename] {
+          PortableFloatMapIO::write(flipY(src), filename);
+        }));
+      }
+      if (FLAGS_output_world_normals) {
+        std::string filename = join(FLAGS_output_dir,
+          stringPrintf("world_normals_%05d_%020lld.pfm4",
+            pose.frame_index, pose.timestamp));
+        Array2DReadView<Vector4f> src = batch.host_world_normals[k];
+        batch.writes.push_back(write_pool.Submit([src, filename] {
+          PortableFloatMapIO::write(flipY(src), filename);
+        }));
+      }
+    }
+  };
+
+  RaycastBatch* previous = nullptr;
+  for (size_t first = 0, b = 0; first < camera_path.size();
+    first += batch_size, ++b) {
+    RaycastBatch& batch = *(batches[b % 2]);
+
+    // The device buffers are free once the last downloads from them finish.
+    cudaStreamWaitEvent(raycast_stream, batch.downloaded, 0);
 
-    if (FLAGS_output_world_points || FLAGS_output_depth) {
-      copy(world_points, cast<float4>(host_world_points.writeView()));
+    batch.poses.clear();
+    for (size_t i = first;
+      i < std::min(first + batch_size, camera_path.size()); ++i) {
+      printf("Raycasting frame %zu of %zu\n", i, camera_path.size());
+      size_t k = batch.poses.size();
+      tsdf.Raycast(flpp,
+        inverse(camera_path[i].camera_from_world).asMatrix(),
+        batch.world_points[k], batch.world_normals[k],
+        raycast_stream, sampling);
+      batch.poses.push_back(i);
+    }
+    cudaEventRecord(batch.raycast_done, raycast_stream);
 
-      std::string world_points_filename =
-        stringPrintf("world_points_%05d_%020lld.pfm4",
-          pose.frame_index, pose.timestamp);
-      PortableFloatMapIO::write(flipY(host_world_points.readView()),
-        join(FLAGS_output_dir, world_points_filename));
+    // The host buffers are free once their files are written. Wait after
+    // queueing the raycasts, so the GPU keeps working meanwhile.
+    batch.WaitForWrites();
+    cudaStreamWaitEvent(download_stream, batch.raycast_done, 0);
+    for (size_t k = 0; k < batch.poses.size(); ++k) {
+      if (FLAGS_output_world_points || FLAGS_output_depth) {
+        DownloadAsync(batch.world_points[k], batch.host_world_points[k],
+          download_stream);
+      }
+      if (FLAGS_output_world_normals) {
+        DownloadAsync(batch.world_normals[k], batch.host_world_normals[k],
+          download_stream);
+      }
     }
-    if (FLAGS_output_world_normals) {
-      copy(world_normals, cast<float4>(host_world_normals.writeView()));
-
-      std::string world_normals_filename =
-        stringPrintf("world_normals_%05d_%020lld.pfm4",
-          pose.frame_index, pose.timestamp);
-      PortableFloatMapIO::write(flipY(host_world_normals.readView()),
-        join(FLAGS_output_dir, world_normals_filename));
+    cudaEventRecord(batch.downloaded, download_stream);
+
+    // Only block on the previous batch, now that this one is queued.
+    if (previous != nullptr) {
+      write_batch(*previous);
     }
+    previous = &batch;
+  }
+  if (previous != nullptr) {
+    write_batch(*previous);
+  }
+  for (auto& batch : batches) {
+    batch->WaitForWrites();
+  }
+  // Release the batches before their streams.
+  for (auto& batch : batches) {
+    batch.reset();
   }
+  cudaStreamDestroy(raycast_stream);
+  cudaStreamDestroy(download_stream);
 
+  PerfCollector::Get().Report("", "");
   return 0;
 }
@@ -13,20 +13,58 @@
 // limitations under the License.
 #include "regular_grid_fusion_pipeline.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
 
 #include <gflags/gflags.h>
+#include <vector_functions.h>
 
 #include "libcgt/core/common/ArrayUtils.h"
 #include "libcgt/core/imageproc/ColorMap.h"
+#include "libcgt/core/math/Arithmetic.h"
+#include "libcgt/cuda/VecmathConversions.h"
+
+#include "marching_cubes.h"
+#include "perf_collector.h"
+#include "pose_utils.h"
+#include "trace.h"
 
 using libcgt::core::arrayutils::flipYInPlace;
+using libcgt::core::math::floorToInt;
 using libcgt::core::cameras::Intrinsics;
 using libcgt::core::vecmath::inverse;
 using libcgt::core::vecmath::EuclideanTransform;
 using libcgt::core::vecmath::SimilarityTransform;
 
 DECLARE_bool(adaptive_raycast);
+DECLARE_double(aruco_detection_scale);
+DECLARE_bool(aruco_tracking);
+DECLARE_bool(async_color_pose);
+DECLARE_bool(collect_perf);
+DECLARE_bool(compact_raycast);
+DECLARE_bool(cuda_graphs);
+DECLARE_bool(deterministic_pipeline);
+DECLARE_string(depth_smoothing);
+DECLARE_double(depth_smoothing_range_sigma);
+DECLARE_double(depth_smoothing_spatial_sigma);
+DECLARE_int32(fusion_batch_size);
+DECLARE_bool(fused_depth_preprocessing);
+DECLARE_bool(icp_debug_vis);
+DECLARE_string(icp_error_metric);
+DECLARE_bool(lod_raycast);
+DECLARE_bool(ray_band_fusion);
+DECLARE_double(raycast_reuse_max_rotation_degrees);
+DECLARE_double(raycast_reuse_max_translation);
+DECLARE_bool(rolling_volume);
+DECLARE_double(rolling_volume_margin);
+DECLARE_bool(rolling_volume_mesh);
+DECLARE_int32(rolling_volume_store_mb);
+DECLARE_bool(texture_raycast);
+DECLARE_int32(tsdf_num_devices);
+DECLARE_string(tsdf_volume);
+DECLARE_int32(voxel_hash_max_blocks);
 
 namespace {
 
@@ -34,22 +72,37 @@ namespace {
 const char* kArucoDetectorParamsFilename = "../res/detector_params.yaml";
 constexpr int kSingleMarkerFiducialId = 3;
 
-std::vector<PoseFrame>::const_iterator FindPoseFrameByFrameIndex(
-  const std::vector<PoseFrame>& pose_history,
-  int32_t frame_index) {
-  return std::find_if(std::begin(pose_history), std::end(pose_history),
-    [&](const PoseFrame& f) {
-    return f.frame_index == frame_index;
-  });
+// main() rejects invalid flags, see ParseDepthProcessorOptions().
+DepthProcessor::Options DepthProcessorOptionsFromFlags() {
+  DepthProcessor::Options options;
+  ParseDepthProcessorOptions(FLAGS_depth_smoothing,
+    FLAGS_depth_smoothing_spatial_sigma, FLAGS_depth_smoothing_range_sigma,
+    &options);
+  return options;
 }
 
-std::vector<PoseFrame>::const_iterator FindPoseFrame(
-  const std::vector<PoseFrame>& pose_history,
-  int64_t timestamp_ns) {
-  return std::find_if(std::begin(pose_history), std::end(pose_history),
-    [&](const PoseFrame& f) {
-    return f.timestamp_ns == timestamp_ns;
-  });
+ProjectivePointPlaneICP::Options ICPOptionsFromFlags() {
+  ProjectivePointPlaneICP::Options options;
+  ParseICPErrorMetric(FLAGS_icp_error_metric, &options.error_metric);
+  options.write_debug_vis = FLAGS_icp_debug_vis;
+  options.use_cuda_graph = FLAGS_cuda_graphs;
+  return options;
+}
+
+ArucoPoseEstimator::TrackingOptions ArucoTrackingOptionsFromFlags() {
+  ArucoPoseEstimator::TrackingOptions options;
+  options.detection_scale = static_cast<float>(FLAGS_aruco_detection_scale);
+  return options;
+}
+
+// Tracking raycasts need every voxel of detail; views from a free camera
+// only need as much as their pixels can show.
+RaycastSampling FreeCameraRaycastSampling() {
+  if (FLAGS_lod_raycast) {
+    return RaycastSampling::LOD;
+  }
+  return FLAGS_texture_raycast ?
+    RaycastSampling::TEXTURE : RaycastSampling::VOXEL_ARRAY;
 }
 
 }
@@ -59,17 +112,18 @@ RegularGridFusionPipeline::RegularGridFusionPipeline(
   const Vector3i& grid_resolution,
   const SimilarityTransform& world_from_grid,
   const PoseEstimatorOptions& pose_estimator_options) :
-  depth_meters_(camera_params.depth.resolution),
-  smoothed_depth_meters_(camera_params.depth.resolution),
-  incoming_camera_normals_(camera_params.depth.resolution),
   world_points_(camera_params.depth.resolution),
   world_normals_(camera_params.depth.resolution),
+  compact_model_(FLAGS_compact_raycast ?
+    camera_params.depth.resolution : Vector2i{ 0, 0 }),
   pose_estimation_vis_(camera_params.depth.resolution),
 
   input_buffer_(camera_params.color.resolution,
                 camera_params.depth.resolution),
 
-  regular_grid_(grid_resolution, world_from_grid),
+  tsdf_(MakeTSDFVolume(FLAGS_tsdf_volume, grid_resolution, world_from_grid,
+    4 * world_from_grid.scale, FLAGS_voxel_hash_max_blocks,
+    FLAGS_tsdf_num_devices)),
 
   camera_params_(camera_params),
   depth_intrinsics_flpp_{
@@ -79,35 +133,122 @@ RegularGridFusionPipeline::RegularGridFusionPipeline(
   depth_range_(camera_params.depth.depth_range),
 
   depth_processor_(camera_params.depth.intrinsics,
-    camera_params.depth.depth_range),
+    camera_params.depth.depth_range, DepthProcessorOptionsFromFlags()),
 
   pose_estimator_options_(pose_estimator_options),
 
   icp_(camera_params.depth.resolution, camera_params.depth.intrinsics,
-       camera_params.depth.depth_range),
+       camera_params.depth.depth_range, ICPOptionsFromFlags()),
 
   aruco_single_marker_fiducial_(SingleMarkerFiducial::kDefaultSideLength,
     kSingleMarkerFiducialId),
   aruco_pose_estimator_(aruco_single_marker_fiducial_, camera_params.color,
     kArucoDetectorParamsFilename),
-  aruco_vis_(camera_params.color.resolution) {
+  aruco_vis_(camera_params.color.resolution),
+  aruco_tracking_options_(ArucoTrackingOptionsFromFlags()),
+
+  preprocess_graph_(FLAGS_cuda_graphs),
+  // Only dense grids fuse and raycast without waiting on the host.
+  volume_graph_(FLAGS_cuda_graphs &&
+    (FLAGS_tsdf_volume == kRegularGridTSDFVolumeType ||
+     FLAGS_tsdf_volume == kBrickedGridTSDFVolumeType)) {
   // TODO: CheckPoseEstimatorOptions().
+  if (tsdf_ == nullptr) {
+    fprintf(stderr, "RegularGridFusionPipeline: could not create a TSDF "
+      "volume of type \"%s\".\n", FLAGS_tsdf_volume.c_str());
+    exit(1);
+  }
+
+  for (DepthSlot& slot : depth_slots_) {
+    slot.depth_meters.resize(camera_params.depth.resolution);
+    slot.depth_millimeters_ydown.resize(camera_params.depth.resolution);
+    slot.pyramid.Resize(camera_params.depth.resolution,
+      depth_intrinsics_flpp_, ProjectivePointPlaneICP::kNumPyramidLevels);
+    cudaEventCreateWithFlags(&slot.preprocessed, cudaEventDisableTiming);
+    cudaEventCreateWithFlags(&slot.consumed, cudaEventDisableTiming);
+  }
+  cudaEventCreateWithFlags(&raycast_done_, cudaEventDisableTiming);
+  cudaEventCreateWithFlags(&batch_uploaded_, cudaEventDisableTiming);
+  cudaEventCreateWithFlags(&batch_fused_, cudaEventDisableTiming);
+
+  if (!FLAGS_deterministic_pipeline) {
+    cudaStreamCreate(&preprocess_stream_);
+    cudaStreamCreate(&volume_stream_);
+  }
+
+  if (FLAGS_async_color_pose &&
+    (pose_estimator_options_.method == PoseEstimationMethod::COLOR_ARUCO ||
+     pose_estimator_options_.method ==
+       PoseEstimationMethod::COLOR_ARUCO_AND_DEPTH_ICP)) {
+    color_pose_worker_ = std::make_unique<ColorPoseWorker>(
+      aruco_pose_estimator_, camera_params.color.resolution,
+      aruco_tracking_options_);
+  }
+}
+
+RegularGridFusionPipeline::~RegularGridFusionPipeline() {
+  cudaDeviceSynchronize();
+  if (volume_stream_ != 0) {
+    cudaStreamDestroy(volume_stream_);
+  }
+  if (preprocess_stream_ != 0) {
+    cudaStreamDestroy(preprocess_stream_);
+  }
+  cudaEventDestroy(raycast_done_);
+  cudaEventDestroy(batch_uploaded_);
+  cudaEventDestroy(batch_fused_);
+  for (DepthSlot& slot : depth_slots_) {
+    cudaEventDestroy(slot.consumed);
+    cudaEventDestroy(slot.preprocessed);
+  }
+}
+
+void RegularGridFusionPipeline::AddObserver(
+  FusionPipelineObserver* observer) {
+  std::lock_guard<std::mutex> lock(observers_mutex_);
+  observers_.push_back(observer);
+}
+
+void RegularGridFusionPipeline::RemoveObserver(
+  FusionPipelineObserver* observer) {
+  std::lock_guard<std::mutex> lock(observers_mutex_);
+  observers_.erase(std::remove(observers_.begin(), observers_.end(),
+    observer), observers_.end());
+}
+
+void RegularGridFusionPipeline::NotifyDataChanged(PipelineDataType type) {
+  // Held during the calls, so that RemoveObserver() returns only once the
+  // observer is no longer being called.
+  std::lock_guard<std::mutex> lock(observers_mutex_);
+  for (FusionPipelineObserver* observer : observers_) {
+    observer->OnPipelineDataChanged(type);
+  }
 }
 
 bool RegularGridFusionPipeline::LoadTSDF3D(const std::string& filename) {
-  return regular_grid_.Load(filename);
+  return tsdf_->Load(filename);
 }
 
 bool RegularGridFusionPipeline::SaveTSDF3D(const std::string& filename) const {
-  return regular_grid_.Save(filename);
+  return tsdf_->Save(filename);
 }
 
 void RegularGridFusionPipeline::Reset() {
+  // Reset() runs on the default stream, after all in-flight work.
   num_successive_failures_ = 0;
   last_raycast_pose_ = {};
+  raycast_is_stale_ = true;
   pose_history_.clear();
+  aruco_board_visible_ = false;
+  if (color_pose_worker_ != nullptr) {
+    color_pose_worker_->Discard();
+  }
+  evicted_slabs_.clear();
+  evicted_slab_bytes_ = 0;
+  evicted_triangle_positions_.clear();
+  evicted_triangle_normals_.clear();
   is_first_depth_frame_ = true;
-  regular_grid_.Reset();
+  tsdf_->Reset();
 }
 
 const RGBDCameraParameters&
@@ -151,6 +292,8 @@ PerspectiveCamera RegularGridFusionPipeline::DepthCamera() const {
 }
 
 void RegularGridFusionPipeline::NotifyColorUpdated() {
+  SetTraceFrame(input_buffer_.color_frame_index,
+    input_buffer_.color_timestamp_ns);
   PipelineDataType data_changed = PipelineDataType::INPUT_COLOR;
 
   bool pose_updated = false;
@@ -158,71 +301,132 @@ void RegularGridFusionPipeline::NotifyColorUpdated() {
   if (pose_estimator_options_.method == PoseEstimationMethod::PRECOMPUTED ||
     pose_estimator_options_.method ==
     PoseEstimationMethod::PRECOMPUTED_REFINE_WITH_DEPTH_ICP) {
-    auto itr = FindPoseFrame(pose_estimator_options_.precomputed_path,
-      input_buffer_.color_timestamp_ns);
-    if (itr != pose_estimator_options_.precomputed_path.end()) {
+    const PoseFrame* precomputed =
+      pose_estimator_options_.precomputed_path.FindByTimestamp(
+        input_buffer_.color_timestamp_ns);
+    if (precomputed != nullptr) {
       data_changed |= PipelineDataType::CAMERA_POSE;
-      pose_history_.push_back(*itr);
+      pose_history_.push_back(*precomputed);
       pose_updated = true;
     }
   } else if (pose_estimator_options_.method ==
     PoseEstimationMethod::COLOR_ARUCO ||
     pose_estimator_options_.method ==
       PoseEstimationMethod::COLOR_ARUCO_AND_DEPTH_ICP) {
-    if (UpdatePoseWithColorCamera()) {
-      data_changed |= PipelineDataType::CAMERA_POSE;
-      pose_updated = true;
+    if (color_pose_worker_ != nullptr) {
+      EuclideanTransform predicted_world_from_camera;
+      bool track = PredictColorPose(&predicted_world_from_camera);
+      color_pose_worker_->Submit(input_buffer_.color_bgr_ydown,
+        input_buffer_.color_frame_index, input_buffer_.color_timestamp_ns,
+        track, predicted_world_from_camera);
+      if (FLAGS_deterministic_pipeline) {
+        color_pose_worker_->Wait();
+      }
+      // With depth, the depth path consumes the estimates.
+      if (pose_estimator_options_.method ==
+        PoseEstimationMethod::COLOR_ARUCO) {
+        pose_updated = ConsumeColorPose(&data_changed);
+      }
+    } else {
+      if (UpdatePoseWithColorCamera()) {
+        data_changed |= PipelineDataType::CAMERA_POSE;
+        pose_updated = true;
+      }
+      data_changed |= PipelineDataType::POSE_ESTIMATION_VIS;
     }
-    data_changed |= PipelineDataType::POSE_ESTIMATION_VIS;
   }
 
   if (pose_updated) {
-    Raycast();
+    RaycastUnlessCached(pose_history_.back());
   }
 
   if (data_changed != PipelineDataType::NONE) {
-    emit dataChanged(data_changed);
+    NotifyDataChanged(data_changed);
   }
 }
 
 void RegularGridFusionPipeline::NotifyDepthUpdated() {
-  // TODO: protect visualization buffers with a mutex
+  PerfCollector::Get().BeginFrame();
+  SetTraceFrame(input_buffer_.depth_frame_index,
+    input_buffer_.depth_timestamp_ns);
+
+  if (IsBatchingFusion()) {
+    AddToFusionBatch();
+    PerfCollector::Get().EndFrame();
+    return;
+  }
+
   PipelineDataType data_changed = PipelineDataType::INPUT_DEPTH;
 
-  copy(input_buffer_.depth_meters.readView(), depth_meters_);
-  depth_processor_.Smooth(depth_meters_, smoothed_depth_meters_);
-  depth_processor_.EstimateNormals(smoothed_depth_meters_,
-                                    incoming_camera_normals_);
+  current_depth_slot_ = (current_depth_slot_ + 1) % kNumDepthSlots;
+  DepthSlot& slot = CurrentDepthSlot();
+
+  // Wait until the last frame that used this slot has been fused, then
+  // upload and preprocess. This overlaps the previous frame's Fuse() and
+  // Raycast() on volume_stream_. The upload is from pinned memory and does not
+  // block the host. Raw depth is half the size of depth in meters, and is
+  // converted here instead of on the CPU.
+  cudaStreamWaitEvent(preprocess_stream_, slot.consumed, 0);
+  if (input_buffer_.depth_is_raw) {
+    input_buffer_.UploadRawDepth(slot.depth_millimeters_ydown,
+      preprocess_stream_);
+  } else {
+    input_buffer_.UploadDepth(slot.depth_meters, preprocess_stream_);
+  }
+  // The upload waits on the host for the previous one, so only the kernels
+  // are replayed as a graph.
+  preprocess_graph_.Run(preprocess_stream_, [&]() {
+    if (input_buffer_.depth_is_raw) {
+      depth_processor_.ConvertRawDepth(slot.depth_millimeters_ydown,
+        slot.depth_meters, preprocess_stream_);
+    }
+    DepthPyramid::Level& full_resolution = slot.pyramid.levels[0];
+    if (FLAGS_fused_depth_preprocessing) {
+      depth_processor_.Preprocess(slot.depth_meters, full_resolution.depth,
+                                  full_resolution.normals,
+                                  preprocess_stream_);
+    } else {
+      depth_processor_.Smooth(slot.depth_meters, full_resolution.depth,
+                              preprocess_stream_);
+      depth_processor_.EstimateNormals(full_resolution.depth,
+                                       full_resolution.normals,
+                                       preprocess_stream_);
+    }
+    depth_processor_.BuildPyramid(slot.pyramid, preprocess_stream_);
+  });
+  cudaEventRecord(slot.preprocessed, preprocess_stream_);
   data_changed |= PipelineDataType::SMOOTHED_DEPTH;
 
   bool pose_updated = false;
   PoseEstimationMethod method = pose_estimator_options_.method;
 
   if (method == PoseEstimationMethod::PRECOMPUTED) {
-    auto itr = FindPoseFrame(pose_estimator_options_.precomputed_path,
-      input_buffer_.depth_timestamp_ns);
-    if (itr != pose_estimator_options_.precomputed_path.end()) {
+    const PoseFrame* precomputed =
+      pose_estimator_options_.precomputed_path.FindByTimestamp(
+        input_buffer_.depth_timestamp_ns);
+    if (precomputed != nullptr) {
       data_changed |= PipelineDataType::CAMERA_POSE;
-      pose_history_.push_back(*itr);
+      pose_history_.push_back(*precomputed);
       pose_updated = true;
     }
   } else if (pose_estimator_options_.method ==
     PoseEstimationMethod::PRECOMPUTED_REFINE_WITH_DEPTH_ICP) {
-    auto itr = FindPoseFrame(pose_estimator_options_.precomputed_path,
-      input_buffer_.color_timestamp_ns);
-    if (itr != pose_estimator_options_.precomputed_path.end()) {
+    const PoseFrame* precomputed =
+      pose_estimator_options_.precomputed_path.FindByTimestamp(
+        input_buffer_.color_timestamp_ns);
+    if (precomputed != nullptr) {
       if (is_first_depth_frame_) {
         // If it's the first depth frame, there's no mesh to raycast. Just
         // report that the pose has been updated. We will Fuse() then Raycast()
         // below.
-        pose_history_.push_back(*itr);
+        pose_history_.push_back(*precomputed);
         data_changed |= PipelineDataType::CAMERA_POSE;
         is_first_depth_frame_ = false;
         pose_updated = true;
       } else {
         // Otherwise, this is a new frame. First, raycast the mesh from the
         // new precomputed pose.
-        Raycast();
+        RaycastUnlessCached(*precomputed);
 
         // Then use ICP to refine the pose.
         PoseFrame pose_frame;
@@ -256,6 +460,12 @@ void RegularGridFusionPipeline::NotifyDepthUpdated() {
     // estimate from color tracking, UpdatePoseWithDepthCamera() will fail
     // since nothing will have been raycast. This has the effect of waiting for
     // a color frame to lock on.
+    //
+    // With --async_color_pose, the latest color estimate, if any, resets the
+    // pose here: raycast from it, then refine it with ICP.
+    if (color_pose_worker_ != nullptr && ConsumeColorPose(&data_changed)) {
+      RaycastUnlessCached(pose_history_.back());
+    }
     PoseFrame pose_frame;
     if (UpdatePoseWithDepthCamera(&pose_frame)) {
       pose_history_.push_back(pose_frame);
@@ -266,33 +476,50 @@ void RegularGridFusionPipeline::NotifyDepthUpdated() {
   }
 
   if (pose_updated) {
-    Fuse();
-    Raycast();
+    if (FLAGS_rolling_volume) {
+      RollVolume();
+    }
+    FuseAndRaycast();
     data_changed |= PipelineDataType::TSDF;
     data_changed |= PipelineDataType::RAYCAST_NORMALS;
   }
 
+  PerfCollector::Get().EndFrame();
+
   if (data_changed != PipelineDataType::NONE) {
-    emit dataChanged(data_changed);
+    NotifyDataChanged(data_changed);
   }
 }
 
-InputBuffer& RegularGridFusionPipeline::GetInputBuffer() {
+PinnedInputBuffer& RegularGridFusionPipeline::GetInputBuffer() {
   return input_buffer_;
 }
 
+InputStreams RegularGridFusionPipeline::UsedInputStreams() const {
+  // PRECOMPUTED_REFINE_WITH_DEPTH_ICP looks poses up by color timestamp.
+  if (pose_estimator_options_.method == PoseEstimationMethod::DEPTH_ICP ||
+    pose_estimator_options_.method == PoseEstimationMethod::PRECOMPUTED) {
+    return InputStreams::DEPTH;
+  }
+  return InputStreams::ALL;
+}
+
 Array2DReadView<uint8x3 >
 RegularGridFusionPipeline::GetColorPoseEstimatorVisualization() const {
   return aruco_vis_;
 }
 
+std::mutex& RegularGridFusionPipeline::VisualizationMutex() const {
+  return visualization_mutex_;
+}
+
 Box3f RegularGridFusionPipeline::TSDFGridBoundingBox() const {
-  return regular_grid_.BoundingBox();
+  return tsdf_->BoundingBox();
 }
 
 const SimilarityTransform&
 RegularGridFusionPipeline::TSDFWorldFromGridTransform() const {
-  return regular_grid_.WorldFromGrid();
+  return tsdf_->WorldFromGrid();
 }
 
 // TODO: make this a pure function and have it take as parameters the last
@@ -304,14 +531,47 @@ bool RegularGridFusionPipeline::UpdatePoseWithColorCamera()
     PoseEstimationMethod::COLOR_ARUCO ||
     pose_estimator_options_.method ==
     PoseEstimationMethod::COLOR_ARUCO_AND_DEPTH_ICP);
-  ArucoPoseEstimator::Result result =
-    aruco_pose_estimator_.EstimatePose(input_buffer_.color_bgr_ydown,
+  ScopedTraceRange trace(
+    "RegularGridFusionPipeline::UpdatePoseWithColorCamera",
+    TraceCategory::POSE_ESTIMATION);
+  EuclideanTransform predicted_world_from_camera;
+  ArucoPoseEstimator::Result result;
+  if (PredictColorPose(&predicted_world_from_camera)) {
+    result = aruco_pose_estimator_.TrackPose(input_buffer_.color_bgr_ydown,
+      predicted_world_from_camera, aruco_tracking_options_, aruco_vis_);
+  } else {
+    result = aruco_pose_estimator_.EstimatePose(input_buffer_.color_bgr_ydown,
       aruco_vis_);
+  }
+  AddColorPose(input_buffer_.color_frame_index,
+    input_buffer_.color_timestamp_ns, result);
+
+  // Flip visualization upside down.
+  flipYInPlace(aruco_vis_.writeView());
 
+  return result.valid;
+}
+
+bool RegularGridFusionPipeline::PredictColorPose(
+  EuclideanTransform* world_from_camera) const {
+  // While the board stays visible, only search around where the latest pose
+  // projects it. Search the whole frame after a miss.
+  if (FLAGS_aruco_tracking && aruco_board_visible_ &&
+    !pose_history_.empty()) {
+    *world_from_camera =
+      inverse(pose_history_.back().color_camera_from_world);
+    return true;
+  }
+  return false;
+}
+
+void RegularGridFusionPipeline::AddColorPose(int32_t frame_index,
+  int64_t timestamp_ns, const ArucoPoseEstimator::Result& result) {
+  aruco_board_visible_ = result.valid;
   if (result.valid) {
     PoseFrame pose_frame;
-    pose_frame.frame_index = input_buffer_.color_frame_index;
-    pose_frame.timestamp_ns = input_buffer_.color_timestamp_ns;
+    pose_frame.frame_index = frame_index;
+    pose_frame.timestamp_ns = timestamp_ns;
     pose_frame.color_camera_from_world = inverse(result.world_from_camera);
     pose_frame.depth_camera_from_world =
       camera_params_.ConvertToDepthCameraFromWorld(
@@ -319,11 +579,24 @@ bool RegularGridFusionPipeline::UpdatePoseWithColorCamera()
 
     pose_history_.push_back(pose_frame);
   }
+}
+
+bool RegularGridFusionPipeline::ConsumeColorPose(
+  PipelineDataType* data_changed) {
+  ColorPoseWorker::Pose pose;
+  if (!color_pose_worker_->TakeLatest(&pose, aruco_vis_.writeView())) {
+    return false;
+  }
+  AddColorPose(pose.frame_index, pose.timestamp_ns, pose.result);
 
   // Flip visualization upside down.
   flipYInPlace(aruco_vis_.writeView());
 
-  return result.valid;
+  *data_changed |= PipelineDataType::POSE_ESTIMATION_VIS;
+  if (pose.result.valid) {
+    *data_changed |= PipelineDataType::CAMERA_POSE;
+  }
+  return pose.result.valid;
 }
 
 // TODO: make this a pure function and have it take as parameters the last
@@ -338,12 +611,25 @@ bool RegularGridFusionPipeline::UpdatePoseWithDepthCamera(
     return false;
   }
 
+  // ICP reads the latest raycast, which may still be running.
+  cudaStreamWaitEvent(preprocess_stream_, raycast_done_, 0);
+
   // TODO: Have icp_result write itself into a DeviceArray2D<T>.
-  ProjectivePointPlaneICP::Result icp_result = icp_.EstimatePose(
-      smoothed_depth_meters_, incoming_camera_normals_,
+  DepthSlot& slot = CurrentDepthSlot();
+  ProjectivePointPlaneICP::Result icp_result = compact_model_is_valid_ ?
+    icp_.EstimatePose(
+      slot.pyramid,
+      inverse(last_raycast_pose_.depth_camera_from_world),
+      compact_model_,
+      pose_estimation_vis_,
+      preprocess_stream_
+    ) :
+    icp_.EstimatePose(
+      slot.pyramid,
       inverse(last_raycast_pose_.depth_camera_from_world),
       world_points_, world_normals_,
-      pose_estimation_vis_
+      pose_estimation_vis_,
+      preprocess_stream_
     );
 
   if (icp_result.valid) {
@@ -359,56 +645,308 @@ bool RegularGridFusionPipeline::UpdatePoseWithDepthCamera(
   return icp_result.valid;
 }
 
-// TODO: use distortion model.
+void RegularGridFusionPipeline::RollVolume() {
+  // Keep the middle of the depth range, where most of the fusion happens,
+  // away from the sides of the volume.
+  float mid_depth = 0.5f * (camera_params_.depth.depth_range.left() +
+    camera_params_.depth.depth_range.right());
+  Matrix4f grid_from_camera = tsdf_->GridFromWorld().asMatrix() *
+    inverse(pose_history_.back().depth_camera_from_world).asMatrix();
+  Vector4f target = grid_from_camera * Vector4f(0, 0, -mid_depth, 1);
+
+  Vector3i resolution = tsdf_->Resolution();
+  Vector3i delta(0, 0, 0);
+  bool shift = false;
+  for (int axis = 0; axis < 3; ++axis) {
+    float margin =
+      static_cast<float>(FLAGS_rolling_volume_margin) * resolution[axis];
+    if (target[axis] < margin || target[axis] > resolution[axis] - margin) {
+      delta[axis] = floorToInt(target[axis] - 0.5f * resolution[axis]);
+      shift = shift || delta[axis] != 0;
+    }
+  }
+  if (!shift) {
+    return;
+  }
+
+  // Pending frames can see voxels that are about to leave.
+  FlushFusionBatch();
+
+  std::vector<EvictedTSDFSlab> evicted;
+  if (!tsdf_->Shift(delta, &evicted)) {
+    return;
+  }
+  raycast_is_stale_ = true;
+  if (FLAGS_collect_perf) {
+    printf("Rolled the volume by [%d, %d, %d], evicting %zu slabs\n",
+      delta.x, delta.y, delta.z, evicted.size());
+  }
+
+  for (EvictedTSDFSlab& slab : evicted) {
+    if (FLAGS_rolling_volume_mesh) {
+      AppendMarchingCubes(slab.voxels, slab.max_tsdf_value,
+        slab.world_from_grid, evicted_triangle_positions_,
+        evicted_triangle_normals_);
+    }
+    evicted_slab_bytes_ += slab.voxels.numElements() * sizeof(TSDF);
+    evicted_slabs_.push_back(std::move(slab));
+  }
+
+  // Keep the store bounded so that scans run in fixed host memory too.
+  const size_t max_bytes =
+    static_cast<size_t>(std::max(FLAGS_rolling_volume_store_mb, 0)) << 20;
+  while (!evicted_slabs_.empty() && evicted_slab_bytes_ > max_bytes) {
+    evicted_slab_bytes_ -=
+      evicted_slabs_.front().voxels.numElements() * sizeof(TSDF);
+    evicted_slabs_.pop_front();
+  }
+}
+
+const std::deque<EvictedTSDFSlab>&
+RegularGridFusionPipeline::EvictedSlabs() const {
+  return evicted_slabs_;
+}
+
 void RegularGridFusionPipeline::Fuse() {
-  regular_grid_.Fuse(
+  DepthSlot& slot = CurrentDepthSlot();
+  cudaStreamWaitEvent(volume_stream_, slot.preprocessed, 0);
+  EnqueueFuse();
+  cudaEventRecord(slot.consumed, volume_stream_);
+}
+
+void RegularGridFusionPipeline::FuseAndRaycast() {
+  DepthSlot& slot = CurrentDepthSlot();
+  cudaStreamWaitEvent(volume_stream_, slot.preprocessed, 0);
+  // The events are recorded outside the graph so that the other stream can
+  // wait on them. The slot is released after the raycast rather than right
+  // after fusion: the next frame preprocesses into the other slot anyway.
+  // A discarded capture has already marked the texture mirror and the
+  // downsampled levels up to date, so they are refreshed in full instead.
+  volume_graph_.Run(volume_stream_, [&]() {
+    EnqueueFuse();
+    EnqueueRaycastFrom(pose_history_.back());
+  }, [&]() {
+    tsdf_->InvalidateAllCopies();
+  });
+  cudaEventRecord(slot.consumed, volume_stream_);
+  cudaEventRecord(raycast_done_, volume_stream_);
+}
+
+// TODO: use distortion model.
+void RegularGridFusionPipeline::EnqueueFuse() {
+  ScopedTraceRange trace("RegularGridFusionPipeline::Fuse",
+    TraceCategory::VOLUME);
+  DepthSlot& slot = CurrentDepthSlot();
+  tsdf_->Fuse(
     depth_intrinsics_flpp_, camera_params_.depth.depth_range,
     pose_history_.back().depth_camera_from_world.asMatrix(),
-    depth_meters_
+    slot.depth_meters,
+    volume_stream_,
+    FLAGS_ray_band_fusion ? FusionMethod::RAY_BAND :
+      FusionMethod::VOXEL_SWEEP
   );
+  raycast_is_stale_ = true;
 }
 
-void RegularGridFusionPipeline::Raycast() {
-  last_raycast_pose_ = pose_history_.back();
+bool RegularGridFusionPipeline::IsBatchingFusion() const {
+  return FLAGS_fusion_batch_size > 1 &&
+    pose_estimator_options_.method == PoseEstimationMethod::PRECOMPUTED;
+}
 
-  if (FLAGS_adaptive_raycast) {
-    regular_grid_.AdaptiveRaycast(
-      depth_intrinsics_flpp_,
-      inverse(last_raycast_pose_.depth_camera_from_world).asMatrix(),
-      world_points_, world_normals_
-    );
+void RegularGridFusionPipeline::AddToFusionBatch() {
+  const PoseFrame* precomputed =
+    pose_estimator_options_.precomputed_path.FindByTimestamp(
+      input_buffer_.depth_timestamp_ns);
+  if (precomputed == nullptr) {
+    return;
+  }
+  pose_history_.push_back(*precomputed);
+  if (FLAGS_rolling_volume) {
+    RollVolume();
+  }
+
+  ScopedTraceRange trace("RegularGridFusionPipeline::AddToFusionBatch",
+    TraceCategory::UPLOAD);
+  size_t n = batch_cameras_.size();
+  if (n == 0) {
+    // The previous batch may still be fusing from these buffers.
+    cudaStreamWaitEvent(preprocess_stream_, batch_fused_, 0);
+  }
+  if (batch_depth_meters_.size() <= n) {
+    batch_depth_meters_.emplace_back(camera_params_.depth.resolution);
+  }
+  DeviceArray2D<float>& depth_meters = batch_depth_meters_[n];
+  if (input_buffer_.depth_is_raw) {
+    DeviceArray2D<uint16_t>& staging =
+      CurrentDepthSlot().depth_millimeters_ydown;
+    input_buffer_.UploadRawDepth(staging, preprocess_stream_);
+    depth_processor_.ConvertRawDepth(staging, depth_meters,
+      preprocess_stream_);
   } else {
-    regular_grid_.Raycast(
-      depth_intrinsics_flpp_,
-      inverse(last_raycast_pose_.depth_camera_from_world).asMatrix(),
-      world_points_, world_normals_
-    );
+    input_buffer_.UploadDepth(depth_meters, preprocess_stream_);
+  }
+
+  CalibratedPosedDepthCamera camera;
+  camera.flpp = make_float4(depth_intrinsics_flpp_);
+  camera.depth_min_max = make_float2(depth_range_.leftRight());
+  camera.camera_from_world =
+    make_float4x4(precomputed->depth_camera_from_world.asMatrix());
+  batch_cameras_.push_back(camera);
+
+  if (static_cast<int>(batch_cameras_.size()) >= FLAGS_fusion_batch_size) {
+    FlushFusionBatch();
   }
 }
 
+void RegularGridFusionPipeline::FlushFusionBatch() {
+  if (batch_cameras_.empty()) {
+    return;
+  }
+  ScopedTraceRange trace("RegularGridFusionPipeline::FlushFusionBatch",
+    TraceCategory::VOLUME);
+  // Only a final, partial batch has spare buffers.
+  if (batch_depth_meters_.size() > batch_cameras_.size()) {
+    batch_depth_meters_.resize(batch_cameras_.size());
+  }
+  // FuseMultiple() runs on volume_stream_, after the uploads and conversions
+  // on preprocess_stream_, and may return before the sweep is done: the next
+  // batch's uploads wait for batch_fused_ instead. Nothing waits on the whole
+  // device, so concurrent pipelines (fuse_depth_cli --jobs) keep overlapping.
+  cudaEventRecord(batch_uploaded_, preprocess_stream_);
+  cudaStreamWaitEvent(volume_stream_, batch_uploaded_, 0);
+  tsdf_->FuseMultiple(batch_cameras_, batch_depth_meters_, volume_stream_);
+  cudaEventRecord(batch_fused_, volume_stream_);
+  batch_cameras_.clear();
+}
+
+void RegularGridFusionPipeline::Raycast() {
+  RaycastFrom(pose_history_.back());
+}
+
+void RegularGridFusionPipeline::RaycastFrom(const PoseFrame& pose) {
+  EnqueueRaycastFrom(pose);
+  cudaEventRecord(raycast_done_, volume_stream_);
+}
+
+void RegularGridFusionPipeline::EnqueueRaycastFrom(const PoseFrame& pose) {
+  ScopedTraceRange trace("RegularGridFusionPipeline::Raycast",
+    TraceCategory::VOLUME);
+  last_raycast_pose_ = pose;
+
+  RaycastSampling sampling = FLAGS_texture_raycast ?
+    RaycastSampling::TEXTURE : RaycastSampling::VOXEL_ARRAY;
+  const Matrix4f world_from_camera =
+    inverse(last_raycast_pose_.depth_camera_from_world).asMatrix();
+  // Volumes that cannot write compact samples leave ICP on world_points_ and
+  // world_normals_.
+  compact_model_is_valid_ = FLAGS_compact_raycast &&
+    tsdf_->RaycastCompact(FLAGS_adaptive_raycast,
+      depth_intrinsics_flpp_, world_from_camera,
+      world_points_, world_normals_, compact_model_,
+      volume_stream_, sampling);
+  if (!compact_model_is_valid_) {
+    if (FLAGS_adaptive_raycast) {
+      tsdf_->AdaptiveRaycast(depth_intrinsics_flpp_, world_from_camera,
+        world_points_, world_normals_, volume_stream_, sampling);
+    } else {
+      tsdf_->Raycast(depth_intrinsics_flpp_, world_from_camera,
+        world_points_, world_normals_, volume_stream_, sampling);
+    }
+  }
+  raycast_is_stale_ = false;
+}
+
+void RegularGridFusionPipeline::RaycastUnlessCached(const PoseFrame& pose) {
+  if (!raycast_is_stale_ && last_raycast_pose_.timestamp_ns != 0) {
+    const EuclideanTransform& current = pose.depth_camera_from_world;
+    const EuclideanTransform& cached =
+      last_raycast_pose_.depth_camera_from_world;
+    float max_rotation = static_cast<float>(
+      FLAGS_raycast_reuse_max_rotation_degrees * M_PI / 180.0);
+    if (RotationAngleBetween(cached, current) <= max_rotation &&
+      CameraCenterDistance(cached, current) <=
+        FLAGS_raycast_reuse_max_translation) {
+      PerfCollector::Get().IncrementCounter("raycast.reused");
+      return;
+    }
+  }
+  RaycastFrom(pose);
+}
+
 void RegularGridFusionPipeline::Raycast(const PerspectiveCamera& camera,
                                         DeviceArray2D<float4>& world_points,
                                         DeviceArray2D<float4>& world_normals) {
   Intrinsics intrinsics = camera.intrinsics(Vector2f(world_points.size()));
   Vector4f flpp{intrinsics.focalLength, intrinsics.principalPoint};
 
+  RaycastSampling sampling = FreeCameraRaycastSampling();
   if (FLAGS_adaptive_raycast) {
-    regular_grid_.AdaptiveRaycast(
+    tsdf_->AdaptiveRaycast(
       flpp,
       camera.worldFromCamera().asMatrix(),
-      world_points, world_normals
+      world_points, world_normals, 0, sampling
     );
   } else {
-    regular_grid_.Raycast(
+    tsdf_->Raycast(
       flpp,
       camera.worldFromCamera().asMatrix(),
-      world_points, world_normals
+      world_points, world_normals, 0, sampling
     );
   }
 }
 
-TriangleMesh RegularGridFusionPipeline::Triangulate() const {
-  return regular_grid_.Triangulate();
+bool RegularGridFusionPipeline::RaycastToSurfaces(
+  const PerspectiveCamera& camera,
+  DeviceArray2D<float4>& world_points,
+  DeviceArray2D<float4>& world_normals,
+  cudaSurfaceObject_t world_points_surface,
+  cudaSurfaceObject_t world_normals_surface) {
+  Intrinsics intrinsics = camera.intrinsics(Vector2f(world_points.size()));
+  Vector4f flpp{intrinsics.focalLength, intrinsics.principalPoint};
+
+  RaycastSampling sampling = FreeCameraRaycastSampling();
+  if (tsdf_->RaycastToSurfaces(FLAGS_adaptive_raycast, flpp,
+    camera.worldFromCamera().asMatrix(), world_points, world_normals,
+    world_points_surface, world_normals_surface, 0, sampling)) {
+    return true;
+  }
+  Raycast(camera, world_points, world_normals);
+  return false;
+}
+
+TriangleMesh RegularGridFusionPipeline::TriangulatePreview(int lod) {
+  return tsdf_->TriangulateAtLOD(lod);
+}
+
+bool RegularGridFusionPipeline::SaveMesh(const std::string& filename,
+  const PLYMeshWriter::Options& options) {
+  if (IsPLYFilename(filename) && evicted_triangle_positions_.empty()) {
+    return tsdf_->TriangulateToPLY(filename, options);
+  }
+  return SaveTriangleMesh(Triangulate(), filename, options);
+}
+
+bool RegularGridFusionPipeline::SavePointCloud(const std::string& filename,
+  const PLYMeshWriter::Options& options) const {
+  return SaveSurfacePointsPLY(*tsdf_, filename, options);
+}
+
+TriangleMesh RegularGridFusionPipeline::Triangulate() {
+  TriangleMesh mesh = tsdf_->TriangulateIncremental();
+  if (evicted_triangle_positions_.empty()) {
+    return mesh;
+  }
+
+  // Unweld the volume's mesh and weld it again with the evicted triangles.
+  std::vector<Vector3f> positions(evicted_triangle_positions_);
+  std::vector<Vector3f> normals(evicted_triangle_normals_);
+  for (const Vector3i& face : mesh.faces()) {
+    for (int i = 0; i < 3; ++i) {
+      positions.push_back(mesh.positions()[face[i]]);
+      normals.push_back(mesh.normals()[face[i]]);
+    }
+  }
+  return ConstructMarchingCubesMesh(positions, normals);
 }
 
 const std::vector<PoseFrame>&
@@ -416,16 +954,34 @@ RegularGridFusionPipeline::PoseHistory() const {
   return pose_history_;
 }
 
+const DeviceArray2D<float>& RegularGridFusionPipeline::DepthMeters() const {
+  return CurrentDepthSlot().depth_meters;
+}
+
 const DeviceArray2D<float>&
 RegularGridFusionPipeline::SmoothedDepthMeters() const
 {
-  return smoothed_depth_meters_;
+  return CurrentDepthSlot().pyramid.levels[0].depth;
 }
 
 const DeviceArray2D<float4>&
 RegularGridFusionPipeline::SmoothedIncomingNormals() const
 {
-  return incoming_camera_normals_;
+  return CurrentDepthSlot().pyramid.levels[0].normals;
+}
+
+const DepthPyramid& RegularGridFusionPipeline::IncomingDepthPyramid() const {
+  return CurrentDepthSlot().pyramid;
+}
+
+RegularGridFusionPipeline::DepthSlot&
+RegularGridFusionPipeline::CurrentDepthSlot() {
+  return depth_slots_[current_depth_slot_];
+}
+
+const RegularGridFusionPipeline::DepthSlot&
+RegularGridFusionPipeline::CurrentDepthSlot() const {
+  return depth_slots_[current_depth_slot_];
 }
 
 const DeviceArray2D<uchar4>&
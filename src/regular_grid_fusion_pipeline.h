@@ -14,7 +14,13 @@
 #ifndef REGULAR_GRID_FUSION_PIPELINE_H
 #define REGULAR_GRID_FUSION_PIPELINE_H
 
-#include <QObject>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cuda_runtime.h>
 
 #include "libcgt/core/cameras/PerspectiveCamera.h"
 #include "libcgt/core/geometry/TriangleMesh.h"
@@ -26,14 +32,22 @@
 #include "aruco/aruco_pose_estimator.h"
 #include "aruco/cube_fiducial.h"
 #include "aruco/single_marker_fiducial.h"
-#include "regular_grid_tsdf.h"
+#include "calibrated_posed_depth_camera.h"
 #include "rgbd_camera_parameters.h"
+#include "color_pose_worker.h"
 #include "depth_processor.h"
-#include "input_buffer.h"
+#include "depth_pyramid.h"
+#include "device_array_pool.h"
+#include "fusion_pipeline_observer.h"
+#include "pinned_input_buffer.h"
 #include "pipeline_data_type.h"
+#include "ply_mesh_writer.h"
 #include "pose_estimation_method.h"
 #include "pose_frame.h"
+#include "pose_trajectory.h"
 #include "projective_point_plane_icp.h"
+#include "stream_graph.h"
+#include "tsdf_volume.h"
 
 struct PoseEstimatorOptions {
   PoseEstimationMethod method =
@@ -45,11 +59,11 @@ struct PoseEstimatorOptions {
   PoseFrame initial_pose = PoseFrame{};
 
   // Required if method is PRECOMPUTED or PRECOMPUTED_REFINE_WITH_DEPTH_ICP.
-  std::vector<PoseFrame> precomputed_path;
+  PoseTrajectory precomputed_path;
 };
 
-class RegularGridFusionPipeline : public QObject {
- Q_OBJECT
+// Has no GUI dependencies: notifications go to FusionPipelineObservers.
+class RegularGridFusionPipeline {
 
   using EuclideanTransform = libcgt::core::vecmath::EuclideanTransform;
   using SimilarityTransform = libcgt::core::vecmath::SimilarityTransform;
@@ -62,6 +76,18 @@ class RegularGridFusionPipeline : public QObject {
     const SimilarityTransform& world_from_grid,
     const PoseEstimatorOptions& pose_estimator_options);
 
+  ~RegularGridFusionPipeline();
+
+  RegularGridFusionPipeline(const RegularGridFusionPipeline& copy) = delete;
+  RegularGridFusionPipeline& operator = (
+    const RegularGridFusionPipeline& copy) = delete;
+
+  // Observers are notified, in the order they were added, whenever a frame
+  // changes data flowing through the pipeline. observer must stay alive
+  // until it is removed or the pipeline is destroyed.
+  void AddObserver(FusionPipelineObserver* observer);
+  void RemoveObserver(FusionPipelineObserver* observer);
+
   // TODO: refactor this.
   bool LoadTSDF3D(const std::string& filename);
   bool SaveTSDF3D(const std::string& filename) const;
@@ -75,7 +101,15 @@ class RegularGridFusionPipeline : public QObject {
   // Get a mutable reference to the input buffer. Clients should update
   // fields of the input buffer then call NotifyColorUpdated() or
   // NotifyDepthUpdated() to trigger a computation.
-  InputBuffer& GetInputBuffer();
+  //
+  // NotifyDepthUpdated() rotates the buffer's depth image. Visualize
+  // DepthMeters() (or GetInputBuffer().LatestDepthMeters() unless
+  // depth_is_raw is set) instead of depth_meters.
+  PinnedInputBuffer& GetInputBuffer();
+
+  // The input streams the pose estimator uses. The pipeline works without
+  // the others (except for visualization), so readers can skip them.
+  InputStreams UsedInputStreams() const;
 
   // Get a read-only view of the latest color pose estimator's visualization.
   // TODO: this buffer is y-up but BGR format.
@@ -83,8 +117,33 @@ class RegularGridFusionPipeline : public QObject {
 
   void NotifyColorUpdated();
 
+  // Unless --deterministic_pipeline is set, work on the GPU is only partially
+  // complete when this returns: fusion and raycasting of this frame continue
+  // on a separate stream and overlap the upload and preprocessing of the next
+  // frame. Accessors below are safe to use from the default stream, which
+  // waits for both pipeline streams.
   void NotifyDepthUpdated();
 
+  // With --fusion_batch_size K > 1 and PoseEstimationMethod::PRECOMPUTED,
+  // NotifyDepthUpdated() only uploads each frame with a precomputed pose.
+  // Every K of them are fused in a single sweep over the volume (see
+  // TSDFVolume::FuseMultiple()). There is no preprocessing, raycasting or
+  // visualization, since nothing consumes them.
+  //
+  // Fuses the frames that are still pending. Call it after the last frame and
+  // before reading the volume.
+  void FlushFusionBatch();
+
+  // The pipeline is not thread safe. When one thread (e.g. a processing
+  // thread) feeds it frames while another (e.g. the GUI) reads it, both must
+  // hold this mutex around every call, including writes to GetInputBuffer()
+  // and reads of the visualization buffers below.
+  //
+  // While it is held, device buffers can be copied on the default stream:
+  // the copy waits for the pipeline work enqueued before it, and the next
+  // frame's work, enqueued after the mutex is released, waits for the copy.
+  std::mutex& VisualizationMutex() const;
+
   // Returns the TSDF grid's axis aligned bounding box.
   // (0, 0, 0) --> Resolution().
   // TODO: implement a simple oriented box class.
@@ -109,28 +168,69 @@ class RegularGridFusionPipeline : public QObject {
                DeviceArray2D<float4>& world_points,
                DeviceArray2D<float4>& world_normals);
 
-  TriangleMesh Triangulate() const;
+  // Same as Raycast(camera, ...), but also writes the results to surfaces of
+  // float4 CUDA arrays of the same size (see TSDFVolume::RaycastToSurfaces()).
+  // Returns false, after a plain Raycast(), if the volume cannot write
+  // surfaces.
+  bool RaycastToSurfaces(const PerspectiveCamera& camera,
+    DeviceArray2D<float4>& world_points,
+    DeviceArray2D<float4>& world_normals,
+    cudaSurfaceObject_t world_points_surface,
+    cudaSurfaceObject_t world_normals_surface);
+
+  // Re-meshes only the parts of the volume modified since the previous call
+  // when the volume supports it. With --rolling_volume_mesh, also includes
+  // the triangles of the voxels that left the volume.
+  TriangleMesh Triangulate();
+
+  // A coarse mesh of the volume alone, from a copy downsampled 2^lod times
+  // along each axis (see TSDFVolume::TriangulateAtLOD()). Much cheaper than
+  // Triangulate() for large volumes.
+  TriangleMesh TriangulatePreview(int lod);
+
+  // Saves the mesh of Triangulate() to filename: as binary PLY if it ends in
+  // ".ply", streamed from the volume as it is meshed when there are no
+  // evicted triangles to include, and as OBJ otherwise.
+  bool SaveMesh(const std::string& filename,
+    const PLYMeshWriter::Options& options = PLYMeshWriter::Options());
+
+  // Saves the zero crossings of the volume (see
+  // TSDFVolume::ExtractSurfacePoints()) to filename as a binary PLY point
+  // cloud. With --rolling_volume, evicted voxels are not included. Returns
+  // false if the volume cannot extract points or the file cannot be written.
+  bool SavePointCloud(const std::string& filename,
+    const PLYMeshWriter::Options& options = PLYMeshWriter::Options()) const;
+
+  // With --rolling_volume, the most recent voxels that have left the volume,
+  // oldest first. At most --rolling_volume_store_mb are kept.
+  const std::deque<EvictedTSDFSlab>& EvictedSlabs() const;
 
   // Returns CameraFromworld.
   const std::vector<PoseFrame>& PoseHistory() const;
 
+  // The latest depth frame in meters, as uploaded (and converted if the
+  // input buffer held raw depth).
+  const DeviceArray2D<float>& DepthMeters() const;
+
   const DeviceArray2D<float>& SmoothedDepthMeters() const;
 
   // In camera space.
   const DeviceArray2D<float4>& SmoothedIncomingNormals() const;
 
+  // The latest frame's pyramid. SmoothedDepthMeters() and
+  // SmoothedIncomingNormals() are its level 0.
+  const DepthPyramid& IncomingDepthPyramid() const;
+
   const DeviceArray2D<uchar4>& PoseEstimationVisualization() const;
 
   // In world space.
   const DeviceArray2D<float4>& RaycastNormals() const;
 
- signals:
-
-  // Notify subscribers that data flowing through the pipeline has changed.
-  void dataChanged(PipelineDataType type);
-
  private:
 
+  // Calls every observer's OnPipelineDataChanged().
+  void NotifyDataChanged(PipelineDataType type);
+
    // Try to estimate the rgbd camera pose using the latest color frame of the
    // pipeline's input buffer. If it succeeded, it will be appended to the
    // pose history and returns true. Otherwise, returns false.
@@ -141,31 +241,127 @@ class RegularGridFusionPipeline : public QObject {
    // result in pose_frame_out. Otherwise, returns false.
    bool UpdatePoseWithDepthCamera(PoseFrame* pose_frame_out);
 
-  // CPU input buffers.
-  InputBuffer input_buffer_;
-
-  // ----- Input copied to the GPU -----
-  // Incoming depth frame in meters.
-  DeviceArray2D<float> depth_meters_;
-
-  // ----- Pipeline intermediates -----
-
-  // Incoming depth smoothed using a bilateral filter.
-  DeviceArray2D<float> smoothed_depth_meters_;
-  // Incoming camera-space normals, estimated from smoothed depth.
-  DeviceArray2D<float4> incoming_camera_normals_;
+  // If the next color search should track the board (see --aruco_tracking),
+  // writes the predicted color camera pose and returns true.
+  bool PredictColorPose(EuclideanTransform* world_from_camera) const;
+
+  // Appends a valid color estimate to pose_history_, and remembers whether
+  // the board was found.
+  void AddColorPose(int32_t frame_index, int64_t timestamp_ns,
+    const ArucoPoseEstimator::Result& result);
+
+  // Adds the latest estimate from color_pose_worker_, if there is one, and
+  // updates aruco_vis_. Returns true if it had a pose.
+  bool ConsumeColorPose(PipelineDataType* data_changed);
+
+  // Same as Raycast(), from pose instead of the latest one.
+  void RaycastFrom(const PoseFrame& pose);
+
+  // Fuse() then Raycast(), replayed as one graph with --cuda_graphs.
+  void FuseAndRaycast();
+
+  // Fuse() and RaycastFrom() without their event waits and records: only
+  // work on volume_stream_, so that it can be captured.
+  void EnqueueFuse();
+  void EnqueueRaycastFrom(const PoseFrame& pose);
+
+  // RaycastFrom(pose), unless nothing was fused since the last raycast and
+  // pose is within --raycast_reuse_max_rotation_degrees and
+  // --raycast_reuse_max_translation of last_raycast_pose_. ICP then keeps the
+  // previous raycast, and its pose, as the reference.
+  void RaycastUnlessCached(const PoseFrame& pose);
+
+  // Re-centers the volume on the latest depth camera pose if it got too close
+  // to a side. See --rolling_volume.
+  void RollVolume();
+
+  // See FlushFusionBatch().
+  bool IsBatchingFusion() const;
+  void AddToFusionBatch();
+
+  // Number of depth frames that can be in flight on the GPU at once.
+  static constexpr int kNumDepthSlots = 2;
+
+  // Per-frame GPU buffers. Frame N+1 is uploaded and preprocessed into one
+  // slot while frame N, in the other slot, is still being fused.
+  struct DepthSlot {
+    // ----- Input copied to the GPU -----
+    // Incoming depth frame in meters.
+    PooledDeviceArray2D<float> depth_meters;
+    // Incoming raw depth frame, when InputBuffer::depth_is_raw is set.
+    // Converted into depth_meters on preprocess_stream_.
+    PooledDeviceArray2D<uint16_t> depth_millimeters_ydown;
+
+    // ----- Pipeline intermediates -----
+
+    // Level 0 holds the incoming depth smoothed using a bilateral filter and
+    // the camera-space normals estimated from it. Coarser levels are built
+    // once per frame and shared by every consumer (ICP, for now).
+    DepthPyramid pyramid;
+
+    // Recorded on preprocess_stream_ once the buffers above are written.
+    cudaEvent_t preprocessed = nullptr;
+    // Recorded on volume_stream_ once depth_meters has been fused. The slot
+    // can be overwritten after that.
+    cudaEvent_t consumed = nullptr;
+  };
+
+  DepthSlot& CurrentDepthSlot();
+  const DepthSlot& CurrentDepthSlot() const;
+
+  // See VisualizationMutex().
+  mutable std::mutex visualization_mutex_;
+
+  // Guards observers_, which may be changed while another thread feeds the
+  // pipeline.
+  std::mutex observers_mutex_;
+  std::vector<FusionPipelineObserver*> observers_;
+
+  // CPU input buffers. Depth is page-locked and double buffered.
+  PinnedInputBuffer input_buffer_;
+
+  DepthSlot depth_slots_[kNumDepthSlots];
+  int current_depth_slot_ = 0;
+
+  // Frames waiting for FlushFusionBatch(), and their cameras. The buffers
+  // are reused across batches.
+  std::vector<DeviceArray2D<float>> batch_depth_meters_;
+  std::vector<CalibratedPosedDepthCamera> batch_cameras_;
+
+  // Upload, preprocessing and ICP run on preprocess_stream_. Fusion and
+  // raycasting run on volume_stream_. Both are the default stream when
+  // --deterministic_pipeline is set. The streams are created blocking so that
+  // the default stream (used by visualization and I/O) waits for them.
+  cudaStream_t preprocess_stream_ = 0;
+  cudaStream_t volume_stream_ = 0;
+  // Recorded on volume_stream_ after each Raycast(). ICP waits on it.
+  cudaEvent_t raycast_done_ = nullptr;
+  // Recorded on preprocess_stream_ by FlushFusionBatch() once the batch is
+  // uploaded. The batch is fused on volume_stream_ after it.
+  cudaEvent_t batch_uploaded_ = nullptr;
+  // Recorded on volume_stream_ once the batch is fused. The next batch is
+  // uploaded into the same buffers after it.
+  cudaEvent_t batch_fused_ = nullptr;
 
   // Pose estimation visualization.
-  DeviceArray2D<uchar4> pose_estimation_vis_;
+  PooledDeviceArray2D<uchar4> pose_estimation_vis_;
 
   // Raycasted world-space points and normals.
   PoseFrame last_raycast_pose_ = {};
-  DeviceArray2D<float4> world_points_;
-  DeviceArray2D<float4> world_normals_;
+  // Whether the volume changed since the last raycast.
+  bool raycast_is_stale_ = true;
+  PooledDeviceArray2D<float4> world_points_;
+  PooledDeviceArray2D<float4> world_normals_;
+  // With --compact_raycast, the same raycast for ICP. See
+  // TSDFVolume::RaycastCompact().
+  PooledDeviceArray2D<uint2> compact_model_;
+  // Whether the last raycast also filled compact_model_.
+  bool compact_model_is_valid_ = false;
 
   DepthProcessor depth_processor_;
 
-  RegularGridTSDF regular_grid_;
+  // Selected with --tsdf_volume.
+  std::unique_ptr<TSDFVolume> tsdf_;
 
   // TODO: consider removing this.
   const int kMaxSuccessiveFailuresBeforeReset = 1000;
@@ -177,11 +373,33 @@ class RegularGridFusionPipeline : public QObject {
   ArucoPoseEstimator aruco_pose_estimator_;
   // Visualization of the last pose estimate, y up.
   Array2D<uint8x3> aruco_vis_;
+  // See --aruco_tracking.
+  const ArucoPoseEstimator::TrackingOptions aruco_tracking_options_;
+  // Whether the last color frame's ArUco search found the board.
+  bool aruco_board_visible_ = false;
+  // Runs ArUco off the calling thread with --async_color_pose. Destroyed
+  // before the estimator it uses.
+  std::unique_ptr<ColorPoseWorker> color_pose_worker_;
+
+  // With --cuda_graphs, replay each frame's depth preprocessing, and its
+  // fusion and raycast, as one graph each (ICP has its own). Only buffers
+  // and poses change between frames, so the graphs are updated in place.
+  StreamGraph preprocess_graph_;
+  StreamGraph volume_graph_;
 
   PoseEstimatorOptions pose_estimator_options_;
   bool is_first_depth_frame_ = true;
   std::vector<PoseFrame> pose_history_;
 
+  // Host-side store of the voxels that left the rolling volume, and their
+  // triangles (as a triangle list) with --rolling_volume_mesh. The oldest
+  // slabs are dropped once they take more than --rolling_volume_store_mb;
+  // their triangles are kept.
+  std::deque<EvictedTSDFSlab> evicted_slabs_;
+  size_t evicted_slab_bytes_ = 0;
+  std::vector<Vector3f> evicted_triangle_positions_;
+  std::vector<Vector3f> evicted_triangle_normals_;
+
   const RGBDCameraParameters camera_params_;
   // camera_params_.depth_intrinsics_, stored as a Vector4f.
   const Vector4f depth_intrinsics_flpp_;
@@ -13,28 +13,237 @@
 // limitations under the License.
 #include "regular_grid_tsdf.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
 
 #include <gflags/gflags.h>
 
-#include "libcgt/core/common/ArrayUtils.h"
-#include "libcgt/core/io/BinaryFileInputStream.h"
-#include "libcgt/core/io/BinaryFileOutputStream.h"
-#include "libcgt/cuda/Event.h"
 #include "libcgt/cuda/MathUtils.h"
+#include "libcgt/cuda/ThreadMath.cuh"
 #include "libcgt/cuda/VecmathConversions.h"
 
 #include "fuse.h"
+#include "launch_tuner.h"
 #include "marching_cubes.h"
+#include "marching_cubes_gpu.h"
+#include "perf_collector.h"
+#include "ply_mesh_writer.h"
 #include "raycast.h"
+#include "rolling_grid_view.h"
+#include "tsdf_file.h"
 
-using libcgt::core::arrayutils::flatten;
 using libcgt::core::vecmath::SimilarityTransform;
 using libcgt::core::vecmath::inverse;
-using libcgt::cuda::Event;
+using libcgt::cuda::threadmath::threadSubscript2DGlobal;
 
 DECLARE_bool(collect_perf);
 
+namespace {
+
+// Load() streams the file through two staging buffers of about this size.
+const size_t kLoadChunkBytes = 32 << 20;
+
+// Fuse() tunes its kernels on a part of the frustum whose voxels fit in a
+// backup of at most this size.
+const size_t kFuseTuningBackupBytes = 64 << 20;
+
+// GPUMarchingCubes() needs two bytes of scratch per voxel (its cube index and
+// active flag), plus buffers proportional to the surface area, which the
+// other two bytes leave room for.
+const size_t kGPUMeshingBytesPerVoxel = 4;
+
+// Whether GPUMarchingCubes() on a grid of the given resolution should fit in
+// free device memory. Otherwise, mesh on the host.
+bool FitsGPUMeshing(const Vector3i& resolution) {
+  size_t num_voxels = static_cast<size_t>(resolution.x) * resolution.y *
+    resolution.z;
+  size_t free_bytes;
+  size_t total_bytes;
+  cudaMemGetInfo(&free_bytes, &total_bytes);
+  return free_bytes >= kGPUMeshingBytesPerVoxel * num_voxels;
+}
+
+Vector3i NumBricks(const Vector3i& resolution) {
+  const int kBrickSize = RegularGridTSDF::kBrickSize;
+  return{
+    (resolution.x + kBrickSize - 1) / kBrickSize,
+    (resolution.y + kBrickSize - 1) / kBrickSize,
+    (resolution.z + kBrickSize - 1) / kBrickSize
+  };
+}
+
+Vector3i NumCoarseCells(const Vector3i& num_bricks) {
+  return{
+    (num_bricks.x + kEmptySpaceCoarseBricks - 1) / kEmptySpaceCoarseBricks,
+    (num_bricks.y + kEmptySpaceCoarseBricks - 1) / kEmptySpaceCoarseBricks,
+    (num_bricks.z + kEmptySpaceCoarseBricks - 1) / kEmptySpaceCoarseBricks
+  };
+}
+
+int NumBrickIndices(const Vector3i& resolution) {
+  Vector3i num_bricks = NumBricks(resolution);
+  return num_bricks.x * num_bricks.y * num_bricks.z;
+}
+
+int NumBrickWords(const Vector3i& resolution) {
+  return (NumBrickIndices(resolution) + 31) / 32;
+}
+
+Vector3i StorageSize(const Vector3i& resolution, VoxelLayout layout) {
+  int3 size = StorageSize(make_int3(resolution), layout);
+  return{ size.x, size.y, size.z };
+}
+
+// Grows the box [stale_min, stale_max), which is empty unless it is positive
+// along every axis, to also cover [box_min, box_max).
+void GrowStaleBox(const Vector3i& box_min, const Vector3i& box_max,
+  Vector3i* stale_min, Vector3i* stale_max) {
+  bool stale = stale_min->x < stale_max->x && stale_min->y < stale_max->y &&
+    stale_min->z < stale_max->z;
+  if (!stale) {
+    *stale_min = box_min;
+    *stale_max = box_max;
+    return;
+  }
+  *stale_min = {
+    std::min(stale_min->x, box_min.x),
+    std::min(stale_min->y, box_min.y),
+    std::min(stale_min->z, box_min.z)
+  };
+  *stale_max = {
+    std::max(stale_max->x, box_max.x),
+    std::max(stale_max->y, box_max.y),
+    std::max(stale_max->z, box_max.z)
+  };
+}
+
+// Enqueues the raycast kernel for sampler on stream, with the launch
+// configuration LaunchTuner picks for kernel.
+template <typename Sampler>
+void LaunchRaycastKernel(const std::string& kernel, bool adaptive,
+  const Sampler& sampler,
+  const EmptySpaceMap& empty_space,
+  const SimilarityTransform& grid_from_world,
+  const SimilarityTransform& world_from_grid,
+  float max_tsdf_value,
+  const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  const Vector3f& eye,
+  const RaycastOutput& out,
+  cudaStream_t stream) {
+  const int2 size = out.world_points.size();
+  auto launch = [&](const LaunchConfig& config) {
+    dim3 grid_dim = libcgt::cuda::math::numBins2D(
+      { size.x, size.y },
+      config.block_dim
+    );
+    if (adaptive) {
+      AdaptiveRaycastKernel<<<grid_dim, config.block_dim, 0, stream>>>(
+        sampler, empty_space,
+        make_float4x4(grid_from_world.asMatrix()),
+        make_float4x4(world_from_grid.asMatrix()),
+        max_tsdf_value,
+        1.0f / world_from_grid.scale,
+        make_float4(camera_flpp),
+        make_float4x4(world_from_camera),
+        make_float3(eye),
+        out
+      );
+    } else {
+      RaycastKernel<<<grid_dim, config.block_dim, 0, stream>>>(
+        sampler, empty_space,
+        make_float4x4(grid_from_world.asMatrix()),
+        make_float4x4(world_from_grid.asMatrix()),
+        max_tsdf_value,
+        make_float4(camera_flpp),
+        make_float4x4(world_from_camera),
+        make_float3(eye),
+        out
+      );
+    }
+  };
+  // Raycasts only write their outputs: candidates need no reset.
+  launch(LaunchTuner::Get().Lookup(kernel, { size.x, size.y, 1 },
+    LaunchTuner::BlockShapeCandidates(), launch, stream));
+}
+
+// Copies the (kBrickSize + 2)^3 samples starting at the minimum corner of
+// each brick in bricks (in brick coordinates) to consecutive slots of
+// padded_bricks, x fastest. Samples outside the grid are set to empty.
+// Launch with one block of (kBrickSize + 2)^2 threads per brick.
+__global__
+void GatherPaddedBricksKernel(RollingGridView<const TSDF> regular_grid,
+  const int3* bricks, TSDF empty, TSDF* padded_bricks) {
+  const int kPaddedSize = RegularGridTSDF::kBrickSize + 2;
+  int3 origin = RegularGridTSDF::kBrickSize * bricks[blockIdx.x];
+  int3 size = regular_grid.size();
+  TSDF* padded = padded_bricks +
+    blockIdx.x * kPaddedSize * kPaddedSize * kPaddedSize;
+
+  for (int z = 0; z < kPaddedSize; ++z) {
+    int3 voxel = origin + int3{ static_cast<int>(threadIdx.x),
+      static_cast<int>(threadIdx.y), z };
+    TSDF value = empty;
+    if (voxel.x < size.x && voxel.y < size.y && voxel.z < size.z) {
+      value = regular_grid[voxel];
+    }
+    padded[threadIdx.x + kPaddedSize * (threadIdx.y + kPaddedSize * z)] =
+      value;
+  }
+}
+
+// Copies the box starting at box_min to output, x fastest. Launch with one
+// thread per (x, y) column of the box.
+__global__
+void GatherBoxKernel(RollingGridView<const TSDF> regular_grid,
+  int3 box_min, int3 box_size, TSDF* output) {
+  int2 xy = threadSubscript2DGlobal();
+  if (xy.x >= box_size.x || xy.y >= box_size.y) {
+    return;
+  }
+  for (int z = 0; z < box_size.z; ++z) {
+    output[xy.x + box_size.x * (xy.y + box_size.y * z)] =
+      regular_grid[box_min + int3{ xy.x, xy.y, z }];
+  }
+}
+
+// Copies input, the box starting at box_min x fastest, to the grid. Launch
+// with one thread per (x, y) column of the box.
+__global__
+void ScatterBoxKernel(RollingGridView<TSDF> regular_grid,
+  int3 box_min, int3 box_size, const TSDF* input) {
+  int2 xy = threadSubscript2DGlobal();
+  if (xy.x >= box_size.x || xy.y >= box_size.y) {
+    return;
+  }
+  for (int z = 0; z < box_size.z; ++z) {
+    regular_grid[box_min + int3{ xy.x, xy.y, z }] =
+      input[xy.x + box_size.x * (xy.y + box_size.y * z)];
+  }
+}
+
+// Sets [box_min, box_max) to value. Launch with one thread per (x, y) column
+// of the box.
+__global__
+void FillBoxKernel(RollingGridView<TSDF> regular_grid,
+  int3 box_min, int3 box_max, TSDF value) {
+  int2 xy = threadSubscript2DGlobal() + int2{ box_min.x, box_min.y };
+  if (xy.x >= box_max.x || xy.y >= box_max.y) {
+    return;
+  }
+  for (int z = box_min.z; z < box_max.z; ++z) {
+    regular_grid[{ xy.x, xy.y, z }] = value;
+  }
+}
+
+}  // namespace
+
 // VoxelSize() = world_from_grid_.scale.
 RegularGridTSDF::RegularGridTSDF(const Vector3i& resolution,
   const SimilarityTransform& world_from_grid) :
@@ -42,20 +251,56 @@ RegularGridTSDF::RegularGridTSDF(const Vector3i& resolution,
 }
 
 RegularGridTSDF::RegularGridTSDF(const Vector3i& resolution,
-  const SimilarityTransform& world_from_grid, float max_tsdf_value) :
-  device_grid_(resolution),
+  const SimilarityTransform& world_from_grid, float max_tsdf_value,
+  VoxelLayout layout) :
+  resolution_(resolution),
+  layout_(layout),
+  device_grid_(StorageSize(resolution, layout)),
   world_from_grid_(world_from_grid),
   grid_from_world_(inverse(world_from_grid)),
-  max_tsdf_value_(max_tsdf_value) {
+  max_tsdf_value_(max_tsdf_value),
+  grid_origin_(0, 0, 0),
+  dirty_bricks_(NumBrickWords(resolution)),
+  brick_min_sdf_(NumBricks(resolution)),
+  coarse_min_sdf_(NumCoarseCells(NumBricks(resolution))),
+  fused_bricks_(NumBrickIndices(resolution)),
+  apron_bricks_(NumBrickIndices(resolution)),
+  mirror_size_(0, 0, 0),
+  stale_min_(0, 0, 0),
+  stale_max_(0, 0, 0),
+  mirror_bricks_(NumBrickIndices(resolution)),
+  lod_stale_min_(0, 0, 0),
+  lod_stale_max_(0, 0, 0),
+  lod_bricks_(NumBrickIndices(resolution)) {
   assert(VoxelSize() > 0);
   assert(max_tsdf_value > 0);
 
   Reset();
 }
 
+RegularGridTSDF::~RegularGridTSDF() {
+  DestroyTextureMirror();
+  if (!depth_textures_.empty()) {
+    // Textures may still be in use by queued kernels.
+    cudaDeviceSynchronize();
+    for (const auto& entry : depth_textures_) {
+      cudaDestroyTextureObject(entry.second);
+    }
+  }
+}
+
 void RegularGridTSDF::Reset() {
   TSDF empty(0, 0, max_tsdf_value_);
   device_grid_.fill(empty);
+
+  // Empty bricks have no triangles, so nothing needs re-meshing, and every
+  // brick can be skipped by the raycasts.
+  dirty_bricks_.fill(0);
+  brick_min_sdf_.fill(FLT_MAX);
+  coarse_min_sdf_.fill(FLT_MAX);
+  InvalidateCopies({ 0, 0, 0 }, Resolution());
+  Vector3i num_bricks = ResolutionInBricks();
+  mesh_cache_.Reset(num_bricks.x * num_bricks.y * num_bricks.z);
 }
 
 const SimilarityTransform& RegularGridTSDF::GridFromWorld() const {
@@ -67,11 +312,24 @@ const SimilarityTransform& RegularGridTSDF::WorldFromGrid() const {
 }
 
 Box3f RegularGridTSDF::BoundingBox() const {
-  return Box3f(device_grid_.size());
+  return Box3f(resolution_);
 }
 
 Vector3i RegularGridTSDF::Resolution() const {
-  return device_grid_.size();
+  return resolution_;
+}
+
+Vector3i RegularGridTSDF::ResolutionInBricks() const {
+  return NumBricks(Resolution());
+}
+
+Vector3i RegularGridTSDF::LODResolution(int lod) const {
+  int round_up = (1 << lod) - 1;
+  return{
+    (resolution_.x + round_up) >> lod,
+    (resolution_.y + round_up) >> lod,
+    (resolution_.z + round_up) >> lod
+  };
 }
 
 float RegularGridTSDF::VoxelSize() const {
@@ -85,260 +343,1184 @@ Vector3f RegularGridTSDF::SideLengths() const {
 void RegularGridTSDF::Fuse(const Vector4f& depth_camera_flpp,
   const Range1f& depth_range,
   const Matrix4f& camera_from_world,
-  const DeviceArray2D<float>& depth_data) {
-
-  dim3 block_dim(16, 16, 1);
-  dim3 grid_dim = libcgt::cuda::math::numBins2D(
-    { device_grid_.width(), device_grid_.height() },
-    block_dim
-  );
-
-  // TODO: move these into class or use Performance Collector class.
-  static float msTotal = 0.0f;
-  static int nIterationsTotal = 0;
-  Event e;
-
-  if (FLAGS_collect_perf) {
-    e.recordStart();
+  const DeviceArray2D<float>& depth_data,
+  cudaStream_t stream,
+  FusionMethod method) {
+
+  // Only visit the part of the grid the camera can see.
+  Matrix4f grid_from_camera =
+    grid_from_world_.asMatrix() * camera_from_world.inverse();
+  FusionFrustum frustum;
+  if (!ComputeFusionFrustum(depth_camera_flpp, depth_data.size(),
+    depth_range.right() + max_tsdf_value_, grid_from_camera,
+    Resolution(), &frustum)) {
+    return;
   }
 
-  FuseKernel<<<grid_dim, block_dim>>>(
-    make_float4x4(world_from_grid_.asMatrix()),
-    max_tsdf_value_,
-    make_float4(depth_camera_flpp),
-    make_float2(depth_range.left(), depth_range.right()),
-    make_float4x4(camera_from_world),
-    depth_data.readView(),
-    device_grid_.writeView());
+  DirtyBrickMask dirty_bricks = FuseDirtyBricks();
+  std::string kernel;
+  Vector3i problem_size;
+  std::vector<LaunchConfig> candidates;
+  std::function<void(const LaunchConfig&)> launch;
+  // What launch() covers: all of it, except while tuning (see below).
+  Vector2i launch_image_size = depth_data.size();
+  FusionFrustum launch_frustum = frustum;
+  if (method == FusionMethod::RAY_BAND) {
+    // Each pixel marches one ray, which only passes through every voxel
+    // projecting to the pixel if voxels are at least as wide as the pixel.
+    float max_pixel_footprint = (depth_range.right() + max_tsdf_value_) /
+      std::min(depth_camera_flpp.x, depth_camera_flpp.y);
+    if (VoxelSize() < max_pixel_footprint) {
+      if (!warned_ray_band_fallback_) {
+        fprintf(stderr, "RegularGridTSDF::Fuse(): voxels (%f m) are smaller "
+          "than a depth pixel at %f m (%f m): using VOXEL_SWEEP instead of "
+          "RAY_BAND.\n", VoxelSize(), depth_range.right() + max_tsdf_value_,
+          max_pixel_footprint);
+        warned_ray_band_fallback_ = true;
+      }
+      method = FusionMethod::VOXEL_SWEEP;
+    }
+  }
+  if (method == FusionMethod::RAY_BAND) {
+    kernel = "RegularGridTSDF::RayBandFuse";
+    problem_size = { depth_data.width(), depth_data.height(), 1 };
+    candidates = LaunchTuner::BlockShapeCandidates();
+    launch = [&](const LaunchConfig& config) {
+      dim3 grid_dim = libcgt::cuda::math::numBins2D(
+        make_int2(launch_image_size), config.block_dim);
+      RayBandFuseKernel<<<grid_dim, config.block_dim, 0, stream>>>(
+        make_float4x4(grid_from_camera),
+        make_float4x4(grid_from_camera.inverse()),
+        max_tsdf_value_,
+        make_float4(depth_camera_flpp),
+        make_float2(depth_range.left(), depth_range.right()),
+        depth_data.readView(),
+        dirty_bricks,
+        WriteView());
+    };
+  } else {
+    kernel = "RegularGridTSDF::Fuse";
+    problem_size = Resolution();
+    candidates = LaunchTuner::ColumnCandidates(Resolution().z);
+    launch = [&](const LaunchConfig& config) {
+      dim3 grid_dim = libcgt::cuda::math::numBins2D(
+        { launch_frustum.box_max.x - launch_frustum.box_min.x,
+          launch_frustum.box_max.y - launch_frustum.box_min.y },
+        config.block_dim
+      );
+      if (config.slices_per_thread > 0) {
+        grid_dim.z = (launch_frustum.box_max.z - launch_frustum.box_min.z +
+          config.slices_per_thread - 1) / config.slices_per_thread;
+      }
+      FuseKernel<<<grid_dim, config.block_dim, 0, stream>>>(
+        make_float4x4(world_from_grid_.asMatrix()),
+        max_tsdf_value_,
+        make_float4(depth_camera_flpp),
+        make_float2(depth_range.left(), depth_range.right()),
+        make_float4x4(camera_from_world),
+        launch_frustum,
+        config.slices_per_thread,
+        depth_data.readView(),
+        dirty_bricks,
+        WriteView());
+    };
+  }
+  if (layout_ == VoxelLayout::BRICKED) {
+    kernel += "/bricked";
+  }
 
-  if (FLAGS_collect_perf) {
-    float msElapsed = e.recordStopSyncAndGetMillisecondsElapsed();
+  // Fusing the same frame again would count it several times: the candidates
+  // are timed against a copy of the voxels they touch, which is put back
+  // after each. To bound the copy, they only cover part of the frustum: the
+  // first rows of the depth map for RAY_BAND and the first rows of the
+  // frustum's box for VOXEL_SWEEP.
+  LaunchTuner& tuner = LaunchTuner::Get();
+  DeviceArray1D<TSDF> backup;
+  std::function<void()> reset;
+  Vector3i backup_min;
+  Vector3i backup_max;
+  if (tuner.NeedsTuning(kernel, problem_size, stream)) {
+    const size_t max_voxels = kFuseTuningBackupBytes / sizeof(TSDF);
+    auto num_voxels = [](const Vector3i& box_min, const Vector3i& box_max) {
+      return static_cast<size_t>(box_max.x - box_min.x) *
+        (box_max.y - box_min.y) * (box_max.z - box_min.z);
+    };
+    bool fits = false;
+    if (method == FusionMethod::RAY_BAND) {
+      // Partial blocks read rows past launch_image_size.y.
+      int max_block_height = 1;
+      for (const LaunchConfig& c : candidates) {
+        max_block_height = std::max(max_block_height,
+          static_cast<int>(c.block_dim.y));
+      }
+      FusionFrustum band;
+      for (int rows = depth_data.height(); !fits && rows >= max_block_height;
+        rows /= 2) {
+        int touched_rows = std::min(depth_data.height(),
+          rows + max_block_height - 1);
+        if (!ComputeFusionFrustum(depth_camera_flpp,
+          { depth_data.width(), touched_rows },
+          depth_range.right() + max_tsdf_value_, grid_from_camera,
+          Resolution(), &band)) {
+          break;
+        }
+        backup_min = Vector3i(band.box_min.x, band.box_min.y,
+          band.box_min.z);
+        backup_max = Vector3i(band.box_max.x, band.box_max.y,
+          band.box_max.z);
+        launch_image_size = { depth_data.width(), rows };
+        fits = num_voxels(backup_min, backup_max) <= max_voxels;
+      }
+    } else {
+      size_t row_voxels =
+        static_cast<size_t>(frustum.box_max.x - frustum.box_min.x) *
+        (frustum.box_max.z - frustum.box_min.z);
+      int rows = static_cast<int>(std::min<size_t>(
+        frustum.box_max.y - frustum.box_min.y,
+        std::max<size_t>(1, max_voxels / row_voxels)));
+      launch_frustum.box_max.y = frustum.box_min.y + rows;
+      backup_min = Vector3i(launch_frustum.box_min.x,
+        launch_frustum.box_min.y, launch_frustum.box_min.z);
+      backup_max = Vector3i(launch_frustum.box_max.x,
+        launch_frustum.box_max.y, launch_frustum.box_max.z);
+      fits = num_voxels(backup_min, backup_max) <= max_voxels;
+    }
+
+    if (fits) {
+      backup.resize(num_voxels(backup_min, backup_max));
+    }
+    if (backup.pointer() != nullptr) {
+      Vector3i backup_size = backup_max - backup_min;
+      dim3 block_dim(16, 16, 1);
+      dim3 grid_dim = libcgt::cuda::math::numBins2D(
+        { backup_size.x, backup_size.y }, block_dim);
+      GatherBoxKernel<<<grid_dim, block_dim, 0, stream>>>(ReadView(),
+        make_int3(backup_min), make_int3(backup_size), backup.pointer());
+      reset = [&]() {
+        ScatterBox(backup_min, backup_max, backup.pointer(), stream);
+      };
+    } else {
+      candidates.clear();
+    }
+  }
+  LaunchConfig config = tuner.Lookup(kernel, problem_size, candidates,
+    launch, stream, reset);
+  launch_image_size = depth_data.size();
+  launch_frustum = frustum;
+  // The last candidate's restore may still be running.
+  if (backup.pointer() != nullptr) {
+    cudaStreamSynchronize(stream);
+  }
 
-    msTotal += msElapsed;
-    ++nIterationsTotal;
+  {
+    ScopedGPUTimer timer("RegularGridTSDF::Fuse", stream);
+    launch(config);
+  }
 
-    printf("Fuse() took: %f ms\n", msElapsed);
+  RefreshFusedBricks(stream);
+}
 
-    printf("%d average: %f\n", nIterationsTotal, msTotal / nIterationsTotal);
-    printf("3x average: %f\n", 3.0f * msTotal / nIterationsTotal);
+namespace {
+
+// Launches the FuseMultipleKernel specialization for num_cameras, falling back
+// to the runtime camera count past kMaxUnrolledFuseMultipleCameras.
+void LaunchFuseMultipleKernel(dim3 grid_dim, dim3 block_dim,
+  float4x4 world_from_grid, float max_tsdf_value,
+  const FuseMultipleCameras& cameras, int num_cameras,
+  int3 box_min, int3 box_max, DirtyBrickMask dirty_bricks,
+  RollingGridView<TSDF> regular_grid, cudaStream_t stream) {
+  switch (num_cameras) {
+#define FUSE_MULTIPLE_CASE(n) \
+  case n: \
+    FuseMultipleKernel<n><<<grid_dim, block_dim, 0, stream>>>( \
+      world_from_grid, max_tsdf_value, cameras, num_cameras, box_min, \
+      box_max, dirty_bricks, regular_grid); \
+    break;
+  FUSE_MULTIPLE_CASE(1)
+  FUSE_MULTIPLE_CASE(2)
+  FUSE_MULTIPLE_CASE(3)
+  FUSE_MULTIPLE_CASE(4)
+  FUSE_MULTIPLE_CASE(5)
+  FUSE_MULTIPLE_CASE(6)
+  FUSE_MULTIPLE_CASE(7)
+  FUSE_MULTIPLE_CASE(8)
+#undef FUSE_MULTIPLE_CASE
+  default:
+    FuseMultipleKernel<0><<<grid_dim, block_dim, 0, stream>>>(
+      world_from_grid, max_tsdf_value, cameras, num_cameras, box_min,
+      box_max, dirty_bricks, regular_grid);
+    break;
   }
 }
 
+}  // namespace
+
 void RegularGridTSDF::FuseMultiple(
   const std::vector<CalibratedPosedDepthCamera>& depth_cameras,
-  const std::vector<DeviceArray2D<float>>& depth_maps) {
+  const std::vector<DeviceArray2D<float>>& depth_maps,
+  cudaStream_t stream) {
+  assert(depth_cameras.size() == depth_maps.size());
+  if (depth_cameras.empty()) {
+    return;
+  }
+
   dim3 block_dim(16, 16, 1);
   dim3 grid_dim = libcgt::cuda::math::numBins2D(
-    { device_grid_.width(), device_grid_.height() },
+    { resolution_.x, resolution_.y },
     block_dim
   );
+  int3 box_min = { 0, 0, 0 };
+  int3 box_max = make_int3(Resolution());
+
+  ScopedGPUTimer timer("RegularGridTSDF::FuseMultiple", stream);
+
+  // Cameras past kMaxFuseMultipleCameras are fused in additional sweeps.
+  // The cameras are kernel parameters and the textures are cached, so
+  // nothing has to outlive a launch and the sweeps are only ordered by
+  // stream.
+  for (size_t first = 0; first < depth_cameras.size();
+    first += kMaxFuseMultipleCameras) {
+    int num_cameras = static_cast<int>(std::min(
+      depth_cameras.size() - first,
+      static_cast<size_t>(kMaxFuseMultipleCameras)));
+
+    FuseMultipleCameras cameras = {};
+    for (int c = 0; c < num_cameras; ++c) {
+      const DeviceArray2D<float>& depth_map = depth_maps[first + c];
+      FuseMultipleCamera& camera = cameras.cameras[c];
+      camera.camera = depth_cameras[first + c];
+      camera.depth_map_size = make_int2(depth_map.size());
+      camera.depth_map = CachedDepthTexture(depth_map);
+    }
+
+    LaunchFuseMultipleKernel(grid_dim, block_dim,
+      make_float4x4(world_from_grid_.asMatrix()),
+      max_tsdf_value_,
+      cameras, num_cameras,
+      box_min, box_max,
+      FuseDirtyBricks(), WriteView(), stream);
+  }
 
-  // TODO: move these into class or use Performance Collector class.
-  static float msTotal = 0.0f;
-  static int nIterationsTotal = 0;
-  Event e;
+  RefreshFusedBricks(stream);
+}
 
-  if (FLAGS_collect_perf) {
-    e.recordStart();
+bool RegularGridTSDF::CacheProjections(
+  const std::vector<StaticDepthCamera>& depth_cameras,
+  const std::vector<DeviceArray2D<float2>>& undistort_maps,
+  cudaStream_t stream) {
+  assert(undistort_maps.empty() ||
+    undistort_maps.size() == depth_cameras.size());
+  ReleaseProjections();
+
+  ScopedGPUTimer timer("RegularGridTSDF::CacheProjections", stream);
+  for (size_t i = 0; i < depth_cameras.size(); ++i) {
+    const StaticDepthCamera& camera = depth_cameras[i];
+    ProjectionTable table;
+    table.depth_min_max = make_float2(camera.depth_range.leftRight());
+
+    // Voxels outside the frustum are never updated: leave them out.
+    FusionFrustum frustum;
+    if (!ComputeFusionFrustum(camera.flpp, camera.image_size,
+      camera.depth_range.right() + max_tsdf_value_,
+      grid_from_world_.asMatrix() * camera.camera_from_world.inverse(),
+      Resolution(), &frustum)) {
+      table.box_min = { 0, 0, 0 };
+      table.box_max = { 0, 0, 0 };
+      projection_tables_.push_back(std::move(table));
+      continue;
+    }
+    table.box_min = { frustum.box_min.x, frustum.box_min.y,
+      frustum.box_min.z };
+    table.box_max = { frustum.box_max.x, frustum.box_max.y,
+      frustum.box_max.z };
+
+    Vector3i box_size = table.box_max - table.box_min;
+    table.entries.resize(
+      static_cast<size_t>(box_size.x) * box_size.y * box_size.z);
+
+    dim3 block_dim(16, 16, 1);
+    dim3 grid_dim = libcgt::cuda::math::numBins2D(
+      { box_size.x, box_size.y }, block_dim);
+    // The undistortion maps are the size of the undistorted depth maps, and
+    // the raw depth maps they index are the same size (see
+    // TSDFVolume::CacheProjections()).
+    bool undistort = !undistort_maps.empty();
+    const int2 image_size = make_int2(camera.image_size);
+    const int2 raw_size = image_size;
+    BuildProjectionTableKernel<<<grid_dim, block_dim, 0, stream>>>(
+      make_float4x4(world_from_grid_.asMatrix()),
+      make_float4(camera.flpp),
+      make_float4x4(camera.camera_from_world),
+      image_size,
+      undistort ? undistort_maps[i].readView() :
+        KernelArray2D<const float2>(),
+      raw_size,
+      frustum.box_min, frustum.box_max,
+      table.entries.pointer());
+    projection_tables_.push_back(std::move(table));
   }
+  return true;
+}
 
-  FuseMultipleKernel<<<grid_dim, block_dim>>>(
-    make_float4x4(world_from_grid_.asMatrix()),
-    max_tsdf_value_,
-    depth_cameras[0],
-    depth_cameras[1],
-    depth_cameras[2],
-    depth_maps[0].readView(),
-    depth_maps[1].readView(),
-    depth_maps[2].readView(),
-    device_grid_.writeView());
+bool RegularGridTSDF::FuseProjected(const std::vector<int>& cameras,
+  const std::vector<DeviceArray2D<float>>& depth_maps,
+  cudaStream_t stream) {
+  if (projection_tables_.empty()) {
+    return false;
+  }
 
-  if (FLAGS_collect_perf) {
-    float msElapsed = e.recordStopSyncAndGetMillisecondsElapsed();
+  ScopedGPUTimer timer("RegularGridTSDF::FuseProjected", stream);
+
+  // Like FuseMultiple(), in sweeps of kMaxFuseMultipleCameras, but each
+  // sweep only visits the boxes of its cameras.
+  for (size_t first = 0; first < cameras.size();
+    first += kMaxFuseMultipleCameras) {
+    ProjectedFuseCameras projected = {};
+    int num_cameras = 0;
+    Vector3i box_min(0, 0, 0);
+    Vector3i box_max(0, 0, 0);
+    for (size_t k = first; k < std::min(cameras.size(),
+      first + kMaxFuseMultipleCameras); ++k) {
+      const ProjectionTable& table = projection_tables_[cameras[k]];
+      if (table.entries.length() == 0) {
+        continue;
+      }
+      ProjectedFuseCamera& camera = projected.cameras[num_cameras];
+      camera.table = table.entries.pointer();
+      camera.box_min = make_int3(table.box_min);
+      camera.box_max = make_int3(table.box_max);
+      camera.depth_min_max = table.depth_min_max;
+      camera.depth_map = CachedDepthTexture(depth_maps[cameras[k]]);
+      GrowStaleBox(table.box_min, table.box_max, &box_min, &box_max);
+      ++num_cameras;
+    }
+    if (num_cameras == 0) {
+      continue;
+    }
+
+    dim3 block_dim(16, 16, 1);
+    dim3 grid_dim = libcgt::cuda::math::numBins2D(
+      { box_max.x - box_min.x, box_max.y - box_min.y }, block_dim);
+    FuseProjectedKernel<<<grid_dim, block_dim, 0, stream>>>(
+      max_tsdf_value_,
+      projected, num_cameras,
+      make_int3(box_min), make_int3(box_max),
+      FuseDirtyBricks(),
+      WriteView());
+  }
 
-    msTotal += msElapsed;
-    ++nIterationsTotal;
+  RefreshFusedBricks(stream);
+  return true;
+}
+
+void RegularGridTSDF::ReleaseProjections() {
+  projection_tables_.clear();
+}
 
-    printf("FuseMultiple() took: %f ms, %d-run average: %f\n",
-      msElapsed, nIterationsTotal, msTotal / nIterationsTotal);
+cudaTextureObject_t RegularGridTSDF::CachedDepthTexture(
+  const DeviceArray2D<float>& depth_map) {
+  cudaResourceDesc res_desc = depth_map.resourceDesc();
+  DepthTextureKey key{ res_desc.res.pitch2D.devPtr,
+    res_desc.res.pitch2D.width, res_desc.res.pitch2D.height,
+    res_desc.res.pitch2D.pitchInBytes };
+  auto itr = depth_textures_.find(key);
+  if (itr != depth_textures_.end()) {
+    return itr->second;
   }
+
+  cudaTextureDesc tex_desc = {};
+  tex_desc.addressMode[0] = cudaAddressModeClamp;
+  tex_desc.addressMode[1] = cudaAddressModeClamp;
+  tex_desc.filterMode = cudaFilterModePoint;
+  tex_desc.readMode = cudaReadModeElementType;
+  tex_desc.normalizedCoords = false;
+  cudaTextureObject_t tex_obj = 0;
+  cudaCreateTextureObject(&tex_obj, &res_desc, &tex_desc, nullptr);
+  depth_textures_.emplace(key, tex_obj);
+  return tex_obj;
 }
 
 void RegularGridTSDF::AdaptiveRaycast(const Vector4f& depth_camera_flpp,
   const Matrix4f& world_from_camera,
   DeviceArray2D<float4>& world_points_out,
-  DeviceArray2D<float4>& world_normals_out) {
-  dim3 block_dim(16, 16, 1);
-  dim3 grid_dim = libcgt::cuda::math::numBins2D(
-    { world_points_out.width(), world_points_out.height() },
-    block_dim
-  );
+  DeviceArray2D<float4>& world_normals_out,
+  cudaStream_t stream,
+  RaycastSampling sampling) {
+  RaycastImpl(true, depth_camera_flpp, world_from_camera,
+    world_points_out, world_normals_out, 0, 0, nullptr, stream, sampling);
+}
 
-  Vector4f eye = world_from_camera * Vector4f(0, 0, 0, 1);
-  float voxels_per_meter = 1.0f / VoxelSize();
+void RegularGridTSDF::Raycast(const Vector4f& depth_camera_flpp,
+  const Matrix4f& world_from_camera,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out,
+  cudaStream_t stream,
+  RaycastSampling sampling) {
+  RaycastImpl(false, depth_camera_flpp, world_from_camera,
+    world_points_out, world_normals_out, 0, 0, nullptr, stream, sampling);
+}
 
-  static float msTotal = 0.0f;
-  static int nIterationsTotal = 0;
-  Event e;
+bool RegularGridTSDF::RaycastToSurfaces(bool adaptive,
+  const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out,
+  cudaSurfaceObject_t world_points_surface,
+  cudaSurfaceObject_t world_normals_surface,
+  cudaStream_t stream,
+  RaycastSampling sampling) {
+  RaycastImpl(adaptive, camera_flpp, world_from_camera,
+    world_points_out, world_normals_out,
+    world_points_surface, world_normals_surface, nullptr, stream, sampling);
+  return true;
+}
 
-  if (FLAGS_collect_perf) {
-    e.recordStart();
+bool RegularGridTSDF::RaycastCompact(bool adaptive,
+  const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out,
+  DeviceArray2D<uint2>& compact_out,
+  cudaStream_t stream,
+  RaycastSampling sampling) {
+  RaycastImpl(adaptive, camera_flpp, world_from_camera,
+    world_points_out, world_normals_out, 0, 0, &compact_out, stream,
+    sampling);
+  return true;
+}
+
+void RegularGridTSDF::RaycastImpl(bool adaptive,
+  const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out,
+  cudaSurfaceObject_t world_points_surface,
+  cudaSurfaceObject_t world_normals_surface,
+  DeviceArray2D<uint2>* compact_out,
+  cudaStream_t stream,
+  RaycastSampling sampling) {
+  Vector3f eye = (world_from_camera * Vector4f(0, 0, 0, 1)).xyz;
+  RaycastOutput out = {
+    world_points_out.writeView(),
+    world_normals_out.writeView(),
+    world_points_surface,
+    world_normals_surface
+  };
+  if (compact_out != nullptr) {
+    out.compact = compact_out->writeView();
+    out.camera_from_world = make_float4x4(world_from_camera.inverse());
+  }
+
+  if (sampling == RaycastSampling::TEXTURE) {
+    UpdateTextureMirror(stream);
+  } else if (sampling == RaycastSampling::LOD) {
+    UpdateLODs(stream);
+  }
+
+  ScopedGPUTimer timer(adaptive ?
+    "RegularGridTSDF::AdaptiveRaycast" : "RegularGridTSDF::Raycast", stream);
+
+  EmptySpaceMap empty_space{ brick_min_sdf_.readView(),
+    coarse_min_sdf_.readView() };
+  // Launch configurations are tuned per sampler, and per layout for those
+  // that read the voxels.
+  std::string kernel = adaptive ?
+    "RegularGridTSDF::AdaptiveRaycast" : "RegularGridTSDF::Raycast";
+  const char* layout = layout_ == VoxelLayout::BRICKED ? "/bricked" : "";
+  if (sampling == RaycastSampling::TEXTURE) {
+    TextureSampler sampler{ mirror_texture_, make_int3(Resolution()),
+      max_tsdf_value_ };
+    LaunchRaycastKernel(kernel + "/texture", adaptive, sampler,
+      empty_space, grid_from_world_, world_from_grid_, max_tsdf_value_,
+      camera_flpp, world_from_camera, eye, out, stream);
+  } else if (sampling == RaycastSampling::LOD) {
+    LODSampler<TSDF> sampler;
+    for (int lod = 0; lod < kNumLODs; ++lod) {
+      sampler.levels[lod] = { LODReadView(lod), max_tsdf_value_ };
+    }
+    sampler.num_levels = kNumLODs;
+    sampler.eye_grid = make_float3(transformPoint(grid_from_world_, eye));
+    sampler.footprint_per_voxel =
+      1.0f / std::min(camera_flpp.x, camera_flpp.y);
+    LaunchRaycastKernel(kernel + "/lod" + layout, adaptive, sampler,
+      empty_space, grid_from_world_, world_from_grid_, max_tsdf_value_,
+      camera_flpp, world_from_camera, eye, out, stream);
+  } else {
+    VoxelArraySampler<TSDF> sampler{ ReadView(), max_tsdf_value_ };
+    LaunchRaycastKernel(kernel + "/voxel_array" + layout, adaptive, sampler,
+      empty_space, grid_from_world_, world_from_grid_, max_tsdf_value_,
+      camera_flpp, world_from_camera, eye, out, stream);
+  }
+}
+
+void RegularGridTSDF::InvalidateCopies(const Vector3i& voxel_min,
+  const Vector3i& voxel_max) {
+  GrowStaleBox(voxel_min, voxel_max, &stale_min_, &stale_max_);
+  GrowStaleBox(voxel_min, voxel_max, &lod_stale_min_, &lod_stale_max_);
+}
+
+void RegularGridTSDF::UpdateTextureMirror(cudaStream_t stream) {
+  Vector3i resolution = Resolution();
+  if (mirror_array_ == nullptr || mirror_size_.x != resolution.x ||
+    mirror_size_.y != resolution.y || mirror_size_.z != resolution.z) {
+    DestroyTextureMirror();
+
+    cudaChannelFormatDesc channel_desc = cudaCreateChannelDesc<ushort2>();
+    cudaMalloc3DArray(&mirror_array_, &channel_desc,
+      make_cudaExtent(resolution.x, resolution.y, resolution.z),
+      cudaArraySurfaceLoadStore);
+
+    cudaResourceDesc res_desc = {};
+    res_desc.resType = cudaResourceTypeArray;
+    res_desc.res.array.array = mirror_array_;
+    cudaCreateSurfaceObject(&mirror_surface_, &res_desc);
+
+    // Unnormalized coordinates put texel centers at half-integers, matching
+    // the grid coordinate system.
+    cudaTextureDesc tex_desc = {};
+    tex_desc.addressMode[0] = cudaAddressModeClamp;
+    tex_desc.addressMode[1] = cudaAddressModeClamp;
+    tex_desc.addressMode[2] = cudaAddressModeClamp;
+    tex_desc.filterMode = cudaFilterModeLinear;
+    tex_desc.readMode = cudaReadModeNormalizedFloat;
+    tex_desc.normalizedCoords = false;
+    cudaCreateTextureObject(&mirror_texture_, &res_desc, &tex_desc, nullptr);
+
+    mirror_size_ = resolution;
+    stale_min_ = { 0, 0, 0 };
+    stale_max_ = resolution;
   }
 
-  AdaptiveRaycastKernel<<<grid_dim, block_dim>>>(
-    device_grid_.readView(),
-    make_float4x4(grid_from_world_.asMatrix()),
-    make_float4x4(world_from_grid_.asMatrix()),
+  if (stale_min_.x < stale_max_.x && stale_min_.y < stale_max_.y &&
+    stale_min_.z < stale_max_.z) {
+    dim3 block_dim(16, 16, 1);
+    dim3 grid_dim = libcgt::cuda::math::numBins2D(
+      { stale_max_.x - stale_min_.x, stale_max_.y - stale_min_.y },
+      block_dim
+    );
+    MirrorTSDFKernel<<<grid_dim, block_dim, 0, stream>>>(
+      ReadView(),
+      max_tsdf_value_,
+      make_int3(stale_min_),
+      make_int3(stale_max_),
+      mirror_surface_);
+    stale_min_ = { 0, 0, 0 };
+    stale_max_ = { 0, 0, 0 };
+  }
+
+  MirrorBrickListKernel<<<kBrickListBlocks, dim3(kBrickSize, kBrickSize, 1),
+    0, stream>>>(
+    ReadView(),
     max_tsdf_value_,
-    voxels_per_meter,
-    make_float4(depth_camera_flpp),
-    make_float4x4(world_from_camera),
-    make_float3(eye.xyz),
-    world_points_out.writeView(),
-    world_normals_out.writeView()
-  );
+    mirror_bricks_.View(),
+    make_int3(ResolutionInBricks()),
+    mirror_surface_);
+  mirror_bricks_.Clear(stream);
+}
 
-  if (FLAGS_collect_perf) {
-    float msElapsed = e.recordStopSyncAndGetMillisecondsElapsed();
+void RegularGridTSDF::DestroyTextureMirror() {
+  if (mirror_array_ == nullptr) {
+    return;
+  }
+  // Resources may still be in use by queued kernels.
+  cudaDeviceSynchronize();
+  cudaDestroyTextureObject(mirror_texture_);
+  cudaDestroySurfaceObject(mirror_surface_);
+  cudaFreeArray(mirror_array_);
+  mirror_texture_ = 0;
+  mirror_surface_ = 0;
+  mirror_array_ = nullptr;
+}
+
+void RegularGridTSDF::UpdateLODs(cudaStream_t stream) {
+  if (lod_grids_[0].width() == 0) {
+    for (int lod = 1; lod < kNumLODs; ++lod) {
+      lod_grids_[lod - 1].resize(LODResolution(lod));
+    }
+    lod_stale_min_ = { 0, 0, 0 };
+    lod_stale_max_ = Resolution();
+  }
 
-    msTotal += msElapsed;
-    ++nIterationsTotal;
+  ScopedGPUTimer timer("RegularGridTSDF::UpdateLODs", stream);
+
+  // Coarse voxel j covers fine voxels 2j and 2j + 1. Each level is
+  // downsampled from the one before, so they are updated in order.
+  bool stale = lod_stale_min_.x < lod_stale_max_.x &&
+    lod_stale_min_.y < lod_stale_max_.y &&
+    lod_stale_min_.z < lod_stale_max_.z;
+  Vector3i box_min = lod_stale_min_;
+  Vector3i box_max = lod_stale_max_;
+  for (int lod = 1; lod < kNumLODs; ++lod) {
+    RollingGridView<TSDF> coarse{ lod_grids_[lod - 1].writeView(),
+      int3{ 0, 0, 0 }, make_int3(LODResolution(lod)), VoxelLayout::LINEAR };
+    if (stale) {
+      box_min = { box_min.x / 2, box_min.y / 2, box_min.z / 2 };
+      box_max = {
+        (box_max.x + 1) / 2, (box_max.y + 1) / 2, (box_max.z + 1) / 2
+      };
+      dim3 block_dim(16, 16, 1);
+      dim3 grid_dim = libcgt::cuda::math::numBins2D(
+        { box_max.x - box_min.x, box_max.y - box_min.y },
+        block_dim
+      );
+      DownsampleTSDFKernel<<<grid_dim, block_dim, 0, stream>>>(
+        LODReadView(lod - 1),
+        max_tsdf_value_,
+        make_int3(box_min),
+        make_int3(box_max),
+        coarse);
+    }
+    DownsampleBrickListKernel<<<kBrickListBlocks,
+      dim3(kBrickSize, kBrickSize, 1), 0, stream>>>(
+      LODReadView(lod - 1),
+      max_tsdf_value_,
+      lod_bricks_.View(),
+      make_int3(ResolutionInBricks()),
+      lod,
+      coarse);
+  }
 
-    printf("AdaptiveRaycastKernel took: %f ms\n", msElapsed);
+  lod_stale_min_ = { 0, 0, 0 };
+  lod_stale_max_ = { 0, 0, 0 };
+  lod_bricks_.Clear(stream);
+}
 
-    printf("%d run average: %f ms\n",
-      nIterationsTotal, msTotal / nIterationsTotal);
-    printf("resolution: %d x %d\n", world_points_out.width(),
-      world_points_out.height());
+RollingGridView<const TSDF> RegularGridTSDF::LODReadView(int lod) const {
+  if (lod == 0) {
+    return ReadView();
   }
+  return{ lod_grids_[lod - 1].readView(), int3{ 0, 0, 0 },
+    make_int3(LODResolution(lod)), VoxelLayout::LINEAR };
 }
 
-void RegularGridTSDF::Raycast(const Vector4f& depth_camera_flpp,
-  const Matrix4f& world_from_camera,
-  DeviceArray2D<float4>& world_points_out,
-  DeviceArray2D<float4>& world_normals_out) {
+void RegularGridTSDF::UpdateEmptySpaceMap(const Vector3i& voxel_min,
+  const Vector3i& voxel_max, cudaStream_t stream) {
+  // A voxel is in the apron of the bricks on either side of it.
+  Vector3i num_bricks = ResolutionInBricks();
+  int3 brick_min = {
+    std::max(voxel_min.x - 1, 0) / kBrickSize,
+    std::max(voxel_min.y - 1, 0) / kBrickSize,
+    std::max(voxel_min.z - 1, 0) / kBrickSize
+  };
+  int3 brick_max = {
+    std::min(voxel_max.x / kBrickSize + 1, num_bricks.x),
+    std::min(voxel_max.y / kBrickSize + 1, num_bricks.y),
+    std::min(voxel_max.z / kBrickSize + 1, num_bricks.z)
+  };
+  if (brick_min.x >= brick_max.x || brick_min.y >= brick_max.y ||
+    brick_min.z >= brick_max.z) {
+    return;
+  }
 
+  const int kApronSize = kBrickSize + 2;
+  dim3 brick_grid_dim(brick_max.x - brick_min.x, brick_max.y - brick_min.y,
+    brick_max.z - brick_min.z);
+  UpdateBrickMinSDFKernel<<<brick_grid_dim, dim3(kApronSize, kApronSize, 1),
+    0, stream>>>(
+    ReadView(),
+    max_tsdf_value_,
+    brick_min,
+    brick_min_sdf_.writeView());
+
+  int3 coarse_min = {
+    brick_min.x / kEmptySpaceCoarseBricks,
+    brick_min.y / kEmptySpaceCoarseBricks,
+    brick_min.z / kEmptySpaceCoarseBricks
+  };
+  int3 coarse_max = {
+    (brick_max.x + kEmptySpaceCoarseBricks - 1) / kEmptySpaceCoarseBricks,
+    (brick_max.y + kEmptySpaceCoarseBricks - 1) / kEmptySpaceCoarseBricks,
+    (brick_max.z + kEmptySpaceCoarseBricks - 1) / kEmptySpaceCoarseBricks
+  };
   dim3 block_dim(16, 16, 1);
   dim3 grid_dim = libcgt::cuda::math::numBins2D(
-    { world_points_out.width(), world_points_out.height() },
+    { coarse_max.x - coarse_min.x, coarse_max.y - coarse_min.y },
     block_dim
   );
+  UpdateCoarseMinSDFKernel<<<grid_dim, block_dim, 0, stream>>>(
+    brick_min_sdf_.readView(),
+    coarse_min,
+    coarse_max,
+    coarse_min_sdf_.writeView());
+}
 
-  Vector4f eye = world_from_camera * Vector4f(0, 0, 0, 1);
+void RegularGridTSDF::RefreshFusedBricks(cudaStream_t stream) {
+  // A voxel is in the apron of the bricks on either side of it.
+  const int3 num_bricks = make_int3(ResolutionInBricks());
+  fused_bricks_.InsertInto(num_bricks, true, apron_bricks_, stream);
 
-  static float msTotal = 0.0f;
-  static int nIterationsTotal = 0;
-  Event e;
+  const int kApronSize = kBrickSize + 2;
+  UpdateBrickListMinSDFKernel<<<kBrickListBlocks,
+    dim3(kApronSize, kApronSize, 1), 0, stream>>>(
+    ReadView(),
+    max_tsdf_value_,
+    apron_bricks_.View(),
+    brick_min_sdf_.writeView());
+  UpdateBrickListCoarseMinSDFKernel<<<kBrickListBlocks, 256, 0, stream>>>(
+    brick_min_sdf_.readView(),
+    apron_bricks_.View(),
+    coarse_min_sdf_.writeView());
+  apron_bricks_.Clear(stream);
+
+  fused_bricks_.InsertInto(num_bricks, false, mirror_bricks_, stream);
+  fused_bricks_.InsertInto(num_bricks, false, lod_bricks_, stream);
+  fused_bricks_.Clear(stream);
+}
 
-  if (FLAGS_collect_perf) {
-    e.recordStart();
+DirtyBrickMask RegularGridTSDF::FuseDirtyBricks() {
+  return{ dirty_bricks_.pointer(), make_int3(ResolutionInBricks()),
+    fused_bricks_.View() };
+}
+
+TriangleMesh RegularGridTSDF::Triangulate() const {
+  ScopedCPUTimer timer("RegularGridTSDF::Triangulate");
+
+  // Mesh on the device if its scratch fits, else on the host.
+  Vector3i resolution = Resolution();
+  if (FitsGPUMeshing(resolution)) {
+    return GPUMarchingCubes(ReadView(), max_tsdf_value_, world_from_grid_);
   }
 
-  RaycastKernel<<<grid_dim, block_dim>>>(
-    device_grid_.readView(),
-    make_float4x4(grid_from_world_.asMatrix()),
-    make_float4x4(world_from_grid_.asMatrix()),
-    max_tsdf_value_,
-    make_float4(depth_camera_flpp),
-    make_float4x4(world_from_camera),
-    make_float3(eye.xyz),
-    world_points_out.writeView(),
-    world_normals_out.writeView()
-  );
+  Array3D<TSDF> host_grid(resolution);
+  Download(host_grid.writeView());
+  return ParallelMarchingCubes(host_grid, max_tsdf_value_, world_from_grid_);
+}
 
-  if (FLAGS_collect_perf) {
-    float msElapsed = e.recordStopSyncAndGetMillisecondsElapsed();
+bool RegularGridTSDF::TriangulateToPLY(const std::string& filename,
+  const PLYMeshWriter::Options& options) const {
+  ScopedCPUTimer timer("RegularGridTSDF::TriangulateToPLY");
 
-    msTotal += msElapsed;
-    ++nIterationsTotal;
+  PLYMeshWriter writer;
+  if (!writer.Open(filename, options)) {
+    return false;
+  }
+
+  // Chunks are about as large as the ones Load() streams, and overlap by the
+  // two slices that the last cells of a chunk read.
+  Vector3i resolution = Resolution();
+  size_t slice_bytes = sizeof(TSDF) * resolution.x * resolution.y;
+  int chunk_slices = std::max(3, static_cast<int>(kLoadChunkBytes /
+    std::max<size_t>(slice_bytes, 1)));
+
+  StreamingMarchingCubes mesher(resolution, max_tsdf_value_,
+    world_from_grid_, &writer);
+  Array3D<TSDF> chunk;
+  while (mesher.NextSlice() < resolution.z - 2) {
+    int z_begin = mesher.NextSlice();
+    int z_end = std::min(z_begin + chunk_slices, resolution.z);
+    if (chunk.depth() != z_end - z_begin) {
+      chunk.resize({ resolution.x, resolution.y, z_end - z_begin });
+    }
+    DownloadBox({ 0, 0, z_begin }, { resolution.x, resolution.y, z_end },
+      chunk.writeView().pointer());
+    mesher.Append(chunk, z_begin);
+  }
+  return writer.Close();
+}
 
-    printf("RaycastKernel took: %f ms\n", msElapsed);
+bool RegularGridTSDF::ExtractSurfacePoints(
+  DeviceArray1D<float4>& world_points_out,
+  DeviceArray1D<float4>& world_normals_out, int* num_points_out,
+  cudaStream_t stream) const {
+  ScopedCPUTimer timer("RegularGridTSDF::ExtractSurfacePoints");
+  *num_points_out = GPUZeroCrossings(ReadView(), max_tsdf_value_,
+    world_from_grid_, world_points_out, world_normals_out, stream);
+  return true;
+}
 
-    printf("%d run average: %f ms\n",
-      nIterationsTotal, msTotal / nIterationsTotal);
-    printf("resolution: %d x %d\n", world_points_out.width(),
-      world_points_out.height());
+TriangleMesh RegularGridTSDF::TriangulateAtLOD(int lod) {
+  lod = std::max(0, std::min(lod, kNumLODs - 1));
+  if (lod == 0) {
+    return Triangulate();
   }
+  ScopedCPUTimer timer("RegularGridTSDF::TriangulateAtLOD");
+
+  UpdateLODs(0);
+  // Voxel j of level lod covers voxels [2^lod j, 2^lod (j + 1)) of the grid.
+  SimilarityTransform world_from_lod = world_from_grid_ *
+    SimilarityTransform(static_cast<float>(1 << lod));
+
+  // Same fallback to the host as Triangulate().
+  Vector3i resolution = LODResolution(lod);
+  if (FitsGPUMeshing(resolution)) {
+    return GPUMarchingCubes(LODReadView(lod), max_tsdf_value_,
+      world_from_lod);
+  }
+
+  Array3D<TSDF> host_grid(resolution);
+  copy(lod_grids_[lod - 1], host_grid.writeView());
+  return ParallelMarchingCubes(host_grid, max_tsdf_value_, world_from_lod);
 }
 
-TriangleMesh RegularGridTSDF::Triangulate() const {
-  Array3D<TSDF> host_grid(Resolution());
-  copy(device_grid_, host_grid.writeView());
+TriangleMesh RegularGridTSDF::TriangulateIncremental() {
+  ScopedCPUTimer timer("RegularGridTSDF::TriangulateIncremental");
+
+  Vector3i num_bricks = ResolutionInBricks();
+  int num_bricks_total = num_bricks.x * num_bricks.y * num_bricks.z;
+
+  std::vector<unsigned int> dirty_words(dirty_bricks_.length());
+  cudaMemcpy(dirty_words.data(), dirty_bricks_.pointer(),
+    dirty_words.size() * sizeof(unsigned int), cudaMemcpyDeviceToHost);
+  dirty_bricks_.fill(0);
+
+  // A cell reads samples up to two past its minimum corner, so modifying a
+  // brick also changes the cells of its -x, -y and -z neighbors.
+  std::vector<uint8_t> remesh(num_bricks_total, 0);
+  for (int z = 0; z < num_bricks.z; ++z) {
+    for (int y = 0; y < num_bricks.y; ++y) {
+      for (int x = 0; x < num_bricks.x; ++x) {
+        int index = x + num_bricks.x * (y + num_bricks.y * z);
+        if ((dirty_words[index / 32] & (1u << (index % 32))) == 0) {
+          continue;
+        }
+        for (int dz = 0; dz < 2 && dz <= z; ++dz) {
+          for (int dy = 0; dy < 2 && dy <= y; ++dy) {
+            for (int dx = 0; dx < 2 && dx <= x; ++dx) {
+              remesh[index - dx - num_bricks.x * (dy + num_bricks.y * dz)] =
+                1;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  std::vector<int3> bricks;
+  std::vector<int> brick_indices;
+  for (int z = 0; z < num_bricks.z; ++z) {
+    for (int y = 0; y < num_bricks.y; ++y) {
+      for (int x = 0; x < num_bricks.x; ++x) {
+        int index = x + num_bricks.x * (y + num_bricks.y * z);
+        if (remesh[index]) {
+          bricks.push_back(int3{ x, y, z });
+          brick_indices.push_back(index);
+        }
+      }
+    }
+  }
 
-  std::vector<Vector3f> positions;
-  std::vector<Vector3f> normals;
-  MarchingCubes(host_grid, max_tsdf_value_, world_from_grid_,
-    positions, normals);
+  // Gather the dirty bricks in batches so that scratch memory stays bounded.
+  const int kMaxBricksPerBatch = 4096;
+  const int kPaddedSize = kBrickSize + 2;
+  const int kNumPaddedVoxels = kPaddedSize * kPaddedSize * kPaddedSize;
+  int num_bricks_per_batch = std::min(static_cast<int>(bricks.size()),
+    kMaxBricksPerBatch);
+  if (num_bricks_per_batch > 0) {
+    DeviceArray1D<int3> device_bricks(num_bricks_per_batch);
+    DeviceArray1D<TSDF> device_padded_bricks(
+      num_bricks_per_batch * kNumPaddedVoxels);
+    std::vector<TSDF> padded_bricks(num_bricks_per_batch * kNumPaddedVoxels);
+    Array3D<TSDF> padded({ kPaddedSize, kPaddedSize, kPaddedSize });
+
+    for (size_t first = 0; first < bricks.size();
+      first += num_bricks_per_batch) {
+      int count = static_cast<int>(std::min(bricks.size() - first,
+        static_cast<size_t>(num_bricks_per_batch)));
+      cudaMemcpy(device_bricks.pointer(), bricks.data() + first,
+        count * sizeof(int3), cudaMemcpyHostToDevice);
+      GatherPaddedBricksKernel<<<count, dim3(kPaddedSize, kPaddedSize, 1)>>>(
+        ReadView(),
+        device_bricks.pointer(),
+        TSDF(0, 0, max_tsdf_value_), device_padded_bricks.pointer());
+      cudaMemcpy(padded_bricks.data(), device_padded_bricks.pointer(),
+        count * kNumPaddedVoxels * sizeof(TSDF), cudaMemcpyDeviceToHost);
+
+      for (int i = 0; i < count; ++i) {
+        const TSDF* src = padded_bricks.data() + i * kNumPaddedVoxels;
+        std::copy(src, src + kNumPaddedVoxels, padded.pointer());
+        int3 brick = bricks[first + i];
+        mesh_cache_.UpdateBrick(brick_indices[first + i], padded,
+          Vector3i(kBrickSize * brick.x, kBrickSize * brick.y,
+            kBrickSize * brick.z),
+          max_tsdf_value_, world_from_grid_);
+      }
+    }
+  }
+
+  if (FLAGS_collect_perf) {
+    printf("TriangulateIncremental() re-meshed %zu of %d bricks\n",
+      bricks.size(), num_bricks_total);
+  }
 
-  return ConstructMarchingCubesMesh(positions, normals);
+  return mesh_cache_.Mesh();
 }
 
-bool RegularGridTSDF::Load(const std::string& filename) {
-  // TODO: validate input at each step..
-  BinaryFileInputStream in(filename);
+void RegularGridTSDF::InvalidateAllCopies() {
+  InvalidateCopies({ 0, 0, 0 }, Resolution());
+}
 
-  uint8_t header;
-  in.read(header);
-  in.read(header);
-  in.read(header);
-  in.read(header);
-  in.read(header);
-  in.read(header);
+bool RegularGridTSDF::Load(const std::string& filename,
+  cudaStream_t stream) {
+  TSDFFileReader reader;
+  if (!reader.Open(filename)) {
+    return false;
+  }
+  const Vector3i resolution = Resolution();
+  const Vector3i file_resolution = reader.Resolution();
+  if (file_resolution.x != resolution.x || file_resolution.y != resolution.y ||
+    file_resolution.z != resolution.z) {
+    fprintf(stderr, "RegularGridTSDF::Load(): %s has resolution "
+      "%d x %d x %d, expected %d x %d x %d.\n", filename.c_str(),
+      file_resolution.x, file_resolution.y, file_resolution.z,
+      resolution.x, resolution.y, resolution.z);
+    return false;
+  }
 
-  int32_t version;
-  in.read(version);
+  // Decode chunks of slices into two pinned staging buffers in turn, so that
+  // reading and decoding one chunk overlaps the upload of the previous one.
+  const int alignment = reader.SliceAlignment();
+  const size_t slice_bytes =
+    static_cast<size_t>(resolution.x) * resolution.y * sizeof(TSDF);
+  const int chunk_slices = std::min(resolution.z, alignment * std::max(1,
+    static_cast<int>(kLoadChunkBytes / slice_bytes / alignment)));
+
+  // With a bricked layout, chunks are copied to the device as is and then
+  // scattered into their bricks.
+  const bool bricked = layout_ == VoxelLayout::BRICKED;
+  // If a buffer cannot be pinned, its copies are from pageable memory: they
+  // return once the buffer has been read, so it is still safe to reuse, but
+  // decoding no longer overlaps the upload.
+  Array3D<TSDF> staging[2];
+  bool pinned[2];
+  DeviceArray1D<TSDF> device_staging[2];
+  cudaEvent_t uploaded[2];
+  for (int i = 0; i < 2; ++i) {
+    staging[i].resize({ resolution.x, resolution.y, chunk_slices });
+    if (bricked) {
+      device_staging[i].resize(chunk_slices * slice_bytes / sizeof(TSDF));
+    }
+    pinned[i] = cudaHostRegister(staging[i].pointer(),
+      chunk_slices * slice_bytes, cudaHostRegisterPortable) == cudaSuccess;
+    if (!pinned[i]) {
+      cudaGetLastError();
+    }
+    cudaEventCreateWithFlags(&uploaded[i], cudaEventDisableTiming);
+  }
 
-  Vector3i resolution;
-  in.read(resolution);
+  grid_origin_ = { 0, 0, 0 };
+  bool ok = true;
+  for (int z = 0, chunk = 0; ok && z < resolution.z;
+    z += chunk_slices, ++chunk) {
+    const int b = chunk % 2;
+    const int z_end = std::min(z + chunk_slices, resolution.z);
+
+    // Wait for the upload from this buffer two chunks ago.
+    cudaEventSynchronize(uploaded[b]);
+    ok = reader.ReadSlices(z, z_end, staging[b].pointer());
+    if (ok && bricked) {
+      cudaMemcpyAsync(device_staging[b].pointer(), staging[b].pointer(),
+        (z_end - z) * slice_bytes, cudaMemcpyHostToDevice, stream);
+      ScatterBox({ 0, 0, z }, { resolution.x, resolution.y, z_end },
+        device_staging[b].pointer(), stream);
+      cudaEventRecord(uploaded[b], stream);
+    } else if (ok) {
+      cudaMemcpy3DParms params = {};
+      params.srcPtr = make_cudaPitchedPtr(staging[b].pointer(),
+        resolution.x * sizeof(TSDF), resolution.x, resolution.y);
+      params.dstPtr = device_grid_.pitchedPointer();
+      params.dstPos = make_cudaPos(0, 0, z);
+      params.extent = make_cudaExtent(resolution.x * sizeof(TSDF),
+        resolution.y, z_end - z);
+      params.kind = cudaMemcpyHostToDevice;
+      cudaMemcpy3DAsync(&params, stream);
+      cudaEventRecord(uploaded[b], stream);
+    }
+  }
 
-  Matrix4f world_from_grid_matrix;
-  in.read(world_from_grid_matrix);
+  for (int i = 0; i < 2; ++i) {
+    cudaEventSynchronize(uploaded[i]);
+    cudaEventDestroy(uploaded[i]);
+    if (pinned[i]) {
+      cudaHostUnregister(staging[i].pointer());
+    }
+  }
 
-  float max_tsdf_value;
-  in.read(max_tsdf_value);
+  if (!ok) {
+    fprintf(stderr, "RegularGridTSDF::Load(): %s is corrupt.\n",
+      filename.c_str());
+    Reset();
+    return false;
+  }
+  world_from_grid_ = reader.WorldFromGrid();
+  grid_from_world_ = inverse(world_from_grid_);
+  max_tsdf_value_ = reader.MaxTSDFValue();
+  OnAllVoxelsReplaced();
+  return true;
+}
 
-  Array3D<TSDF> data(resolution);
-  in.readArray(flatten(data.writeView()));
+bool RegularGridTSDF::Save(const std::string& filename) const {
+  Array3D<TSDF> data(resolution_);
+  Download(data.writeView());
+  return WriteTSDFFile(filename, data, world_from_grid_, max_tsdf_value_);
+}
 
-  world_from_grid_ = SimilarityTransform::fromMatrix(world_from_grid_matrix);
+void RegularGridTSDF::Download(Array3DWriteView<TSDF> grid) const {
+  if (IsLinearAndUnrolled()) {
+    copy(device_grid_, grid);
+    return;
+  }
+  assert(grid.packed());
+  DownloadBox({ 0, 0, 0 }, Resolution(), grid.pointer());
+}
+
+void RegularGridTSDF::Upload(Array3DReadView<TSDF> grid,
+  const SimilarityTransform& world_from_grid, float max_tsdf_value) {
+  world_from_grid_ = world_from_grid;
   grid_from_world_ = inverse(world_from_grid_);
 
-  copy(data.readView(), device_grid_);
+  grid_origin_ = { 0, 0, 0 };
+  if (layout_ == VoxelLayout::LINEAR) {
+    copy(grid, device_grid_);
+  } else {
+    DeviceArray1D<TSDF> device_voxels(
+      static_cast<size_t>(resolution_.x) * resolution_.y * resolution_.z);
+    assert(grid.packed());
+    cudaMemcpy(device_voxels.pointer(), grid.pointer(),
+      device_voxels.size() * sizeof(TSDF), cudaMemcpyHostToDevice);
+    ScatterBox({ 0, 0, 0 }, resolution_, device_voxels.pointer());
+  }
 
   max_tsdf_value_ = max_tsdf_value;
+  OnAllVoxelsReplaced();
+}
 
-  return true;
+VoxelLayout RegularGridTSDF::Layout() const {
+  return layout_;
 }
 
-bool RegularGridTSDF::Save(const std::string& filename) const {
-  // TODO: check ok after each write.
-  BinaryFileOutputStream out(filename);
+RollingGridView<TSDF> RegularGridTSDF::WriteView() {
+  return{ device_grid_.writeView(), make_int3(grid_origin_),
+    make_int3(resolution_), layout_ };
+}
 
-  // TODO: check that the stream is valid.
+RollingGridView<const TSDF> RegularGridTSDF::ReadView() const {
+  return{ device_grid_.readView(), make_int3(grid_origin_),
+    make_int3(resolution_), layout_ };
+}
 
-  // Write magic header: 'tsdf3d1'.
-  out.write('t');
-  out.write('s');
-  out.write('d');
-  out.write('f');
-  out.write('3');
-  out.write('d');
-  out.write<int32_t>(1);
+bool RegularGridTSDF::IsLinearAndUnrolled() const {
+  return layout_ == VoxelLayout::LINEAR && grid_origin_.x == 0 &&
+    grid_origin_.y == 0 && grid_origin_.z == 0;
+}
 
-  // Write resolution: x, y, z.
-  out.write(device_grid_.size());
+void RegularGridTSDF::OnAllVoxelsReplaced() {
+  // Every brick may have changed.
+  dirty_bricks_.fill(~0u);
+  UpdateEmptySpaceMap({ 0, 0, 0 }, Resolution(), 0);
+  InvalidateCopies({ 0, 0, 0 }, Resolution());
+  // The transform and range may have changed too.
+  ReleaseProjections();
+}
 
-  // Write world from grid transformation as a 4x4 float32 matrix,
-  // stored column major.
-  out.write(world_from_grid_.asMatrix());
+bool RegularGridTSDF::Shift(const Vector3i& delta_voxels,
+  std::vector<EvictedTSDFSlab>* evicted) {
+  Vector3i resolution = Resolution();
+  bool shifted = false;
+  for (int axis = 0; axis < 3; ++axis) {
+    int delta = delta_voxels[axis];
+    int n = resolution[axis];
+    if (delta == 0) {
+      continue;
+    }
+    shifted = true;
+    int num_leaving = std::min(std::abs(delta), n);
+
+    // The slices that leave, plus the first two that stay: marching cubes
+    // only emits the cells of a grid that are at least two slices from its
+    // far side, so the slab needs both to cover every cell between it and
+    // the remaining volume.
+    if (evicted != nullptr) {
+      Vector3i exit_min(0, 0, 0);
+      Vector3i exit_max = resolution;
+      if (delta > 0) {
+        exit_max[axis] = std::min(num_leaving + 2, n);
+      } else {
+        exit_min[axis] = std::max(n - num_leaving - 2, 0);
+      }
+
+      EvictedTSDFSlab slab;
+      slab.world_from_grid = world_from_grid_ *
+        SimilarityTransform(Vector3f(static_cast<float>(exit_min.x),
+          static_cast<float>(exit_min.y), static_cast<float>(exit_min.z)));
+      slab.max_tsdf_value = max_tsdf_value_;
+      Vector3i slab_size = exit_max - exit_min;
+      slab.voxels.resize(slab_size);
+      DownloadBox(exit_min, exit_max, slab.voxels.pointer());
+
+      const TSDF* begin = slab.voxels.pointer();
+      const TSDF* end = begin +
+        static_cast<size_t>(slab_size.x) * slab_size.y * slab_size.z;
+      if (std::any_of(begin, end,
+        [](const TSDF& voxel) { return voxel.Weight() > 0; })) {
+        evicted->push_back(std::move(slab));
+      }
+    }
+
+    // Physical voxels that held the leaving slices now hold the entering
+    // ones.
+    Vector3f translation(0, 0, 0);
+    translation[axis] = static_cast<float>(delta);
+    world_from_grid_ = world_from_grid_ * SimilarityTransform(translation);
+    grid_from_world_ = inverse(world_from_grid_);
+    grid_origin_[axis] = ((grid_origin_[axis] + delta) % n + n) % n;
+
+    Vector3i enter_min(0, 0, 0);
+    Vector3i enter_max = resolution;
+    if (delta > 0) {
+      enter_min[axis] = n - num_leaving;
+    } else {
+      enter_max[axis] = num_leaving;
+    }
+    ClearBox(enter_min, enter_max);
+  }
 
-  // Write max tsdf value.
-  out.write(max_tsdf_value_);
+  if (shifted) {
+    // Bricks, the empty space map and the copies of the grid are indexed by
+    // logical voxel, so all of them moved.
+    dirty_bricks_.fill(~0u);
+    Vector3i num_bricks = ResolutionInBricks();
+    mesh_cache_.Reset(num_bricks.x * num_bricks.y * num_bricks.z);
+    UpdateEmptySpaceMap({ 0, 0, 0 }, resolution, 0);
+    InvalidateCopies({ 0, 0, 0 }, resolution);
+    // The cameras moved relative to the grid.
+    ReleaseProjections();
+  }
+  return true;
+}
+
+void RegularGridTSDF::DownloadBox(const Vector3i& box_min,
+  const Vector3i& box_max, TSDF* output) const {
+  Vector3i box_size = box_max - box_min;
+  size_t num_voxels =
+    static_cast<size_t>(box_size.x) * box_size.y * box_size.z;
+  DeviceArray1D<TSDF> device_box(num_voxels);
 
-  // Write data.
-  Array3D<TSDF> data(device_grid_.size());
-  copy(device_grid_, data.writeView());
-  out.writeArray(flatten(data.readView()));
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = libcgt::cuda::math::numBins2D(
+    { box_size.x, box_size.y }, block_dim);
+  GatherBoxKernel<<<grid_dim, block_dim>>>(
+    ReadView(),
+    make_int3(box_min), make_int3(box_size), device_box.pointer());
+  cudaMemcpy(output, device_box.pointer(), num_voxels * sizeof(TSDF),
+    cudaMemcpyDeviceToHost);
+}
 
-  return out.close();
+void RegularGridTSDF::ScatterBox(const Vector3i& box_min,
+  const Vector3i& box_max, const TSDF* input, cudaStream_t stream) {
+  Vector3i box_size = box_max - box_min;
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = libcgt::cuda::math::numBins2D(
+    { box_size.x, box_size.y }, block_dim);
+  ScatterBoxKernel<<<grid_dim, block_dim, 0, stream>>>(WriteView(),
+    make_int3(box_min), make_int3(box_size), input);
+}
+
+void RegularGridTSDF::ClearBox(const Vector3i& box_min,
+  const Vector3i& box_max) {
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = libcgt::cuda::math::numBins2D(
+    { box_max.x - box_min.x, box_max.y - box_min.y }, block_dim);
+  FillBoxKernel<<<grid_dim, block_dim>>>(
+    WriteView(),
+    make_int3(box_min), make_int3(box_max), TSDF(0, 0, max_tsdf_value_));
 }
@@ -14,6 +14,10 @@
 #ifndef REGULAR_GRID_TSDF_H
 #define REGULAR_GRID_TSDF_H
 
+#include <map>
+#include <tuple>
+
+#include "libcgt/core/common/Array3D.h"
 #include "libcgt/core/geometry/TriangleMesh.h"
 #include "libcgt/core/vecmath/Box3f.h"
 #include "libcgt/core/vecmath/Matrix4f.h"
@@ -25,16 +29,52 @@
 #include "libcgt/cuda/DeviceArray2D.h"
 #include "libcgt/cuda/DeviceArray3D.h"
 
+#include "brick_list.h"
+#include "brick_mesh_cache.h"
 #include "calibrated_posed_depth_camera.h"
+#include "device_array_pool.h"
 #include <vector>
+#include "rolling_grid_view.h"
 #include "tsdf.h"
+#include "tsdf_volume.h"
 
-class RegularGridTSDF {
-
-  using SimilarityTransform = libcgt::core::vecmath::SimilarityTransform;
+// See fuse.h.
+struct DirtyBrickMask;
 
+// A dense TSDF: every voxel in the grid is allocated on the device.
+//
+// Fusion marks the kBrickSize^3 bricks it modifies in a device bitmask, which
+// lets TriangulateIncremental() re-mesh only those bricks. It also lists the
+// bricks each fuse touched on the device, and refreshes a min-SDF pyramid
+// over them (and their neighbors, whose aprons they are in), which lets the
+// raycasts leap over empty space. Neither visits bricks that were not
+// touched, so a fuse whose kernel is bound by the image stays so.
+//
+// Shift() moves the volume without copying it: voxels are indexed modulo the
+// resolution, starting at a movable origin.
+//
+// The voxels are stored either in x-fastest order or brick by brick (see
+// VoxelLayout). Kernels only access them through RollingGridView, so the
+// layout is invisible outside this class.
+//
+// RaycastSampling::TEXTURE raycasts read a texture mirror of the grid instead.
+// It is allocated on first use and only the bricks fused since the previous
+// TEXTURE raycast are copied into it.
+//
+// RaycastSampling::LOD raycasts and TriangulateAtLOD() read copies of the
+// grid downsampled 2x and 4x, maintained the same way: allocated on first
+// use, and only the bricks fused since they were last read are downsampled
+// again.
+class RegularGridTSDF : public TSDFVolume {
 public:
 
+  // Side length, in voxels, of the bricks tracked for modification.
+  static constexpr int kBrickSize = 8;
+
+  // The number of levels of detail: the grid itself and its copies
+  // downsampled 2x and 4x.
+  static constexpr int kNumLODs = 3;
+
   // Same as RegularGridTSDF(resolution, world_from_grid, 4 * VoxelSize()).
   RegularGridTSDF(const Vector3i& resolution,
     const SimilarityTransform& world_from_grid);
@@ -45,66 +85,299 @@ public:
   //   units.
   // max_tsdf_value: the representable range of the TSDF. Set to
   //   [-max_tsdf_value, max_tsdf_value].
+  // layout: how the voxels are stored on the device.
   RegularGridTSDF(const Vector3i& resolution,
     const SimilarityTransform& world_from_grid,
-    float max_tsdf_value);
+    float max_tsdf_value,
+    VoxelLayout layout = VoxelLayout::LINEAR);
+
+  ~RegularGridTSDF() override;
+
+  RegularGridTSDF(const RegularGridTSDF& copy) = delete;
+  RegularGridTSDF& operator = (const RegularGridTSDF& copy) = delete;
 
-  void Reset();
+  void Reset() override;
 
+  // RAY_BAND falls back to VOXEL_SWEEP when a voxel is narrower than a pixel
+  // at the far end of the truncation band (see RayBandFuseKernel in
+  // fuse.h).
   void Fuse(const Vector4f& depth_camera_flpp,  // Depth camera intrinsics.
     const Range1f& depth_camera_range,          // Depth camera range.
     const Matrix4f& depth_camera_from_world,    // Depth camera pose.
-    const DeviceArray2D<float>& depth_data);    // Depth frame, in meters.
+    const DeviceArray2D<float>& depth_data,     // In meters.
+    cudaStream_t stream = 0,
+    FusionMethod method = FusionMethod::VOXEL_SWEEP) override;
 
   void FuseMultiple(
     const std::vector<CalibratedPosedDepthCamera>& depth_cameras,
-    const std::vector<DeviceArray2D<float>>& depth_maps);
+    const std::vector<DeviceArray2D<float>>& depth_maps,
+    cudaStream_t stream = 0) override;
+
+  // Each camera's table covers the box of its FusionFrustum (see fuse.h), at
+  // 8 bytes per voxel.
+  bool CacheProjections(
+    const std::vector<StaticDepthCamera>& depth_cameras,
+    const std::vector<DeviceArray2D<float2>>& undistort_maps,
+    cudaStream_t stream = 0) override;
+
+  // Only sweeps the union of the listed cameras' boxes.
+  bool FuseProjected(const std::vector<int>& cameras,
+    const std::vector<DeviceArray2D<float>>& depth_maps,
+    cudaStream_t stream = 0) override;
 
   void AdaptiveRaycast( const Vector4f& camera_flpp,  // Camera intrinsics
     const Matrix4f& world_from_camera,                // Camera pose.
     DeviceArray2D<float4>& world_points_out,
-    DeviceArray2D<float4>& world_normals_out );
+    DeviceArray2D<float4>& world_normals_out,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) override;
 
   void Raycast(const Vector4f& camera_flpp,  // Camera intrinsics
     const Matrix4f& world_from_camera,       // Camera pose.
     DeviceArray2D<float4>& world_points_out,
-    DeviceArray2D<float4>& world_normals_out);
+    DeviceArray2D<float4>& world_normals_out,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) override;
+
+  bool RaycastToSurfaces(bool adaptive,
+    const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaSurfaceObject_t world_points_surface,
+    cudaSurfaceObject_t world_normals_surface,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) override;
+
+  bool RaycastCompact(bool adaptive,
+    const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    DeviceArray2D<uint2>& compact_out,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) override;
 
   // The transformation that yields grid coordinates [0, resolution]^3 (in
   // samples), from world coordinates (in meters).
-  const SimilarityTransform& GridFromWorld() const;
+  const SimilarityTransform& GridFromWorld() const override;
 
   // The transformation that yields world coordinates (in meters) from
   // grid coordinates [0, resolution]^3 (in samples).
-  const SimilarityTransform& WorldFromGrid() const;
+  const SimilarityTransform& WorldFromGrid() const override;
 
   // (0, 0, 0) --> Resolution().
-  Box3f BoundingBox() const;
+  Box3f BoundingBox() const override;
 
   // The number of samples of the grid along each axis.
-  Vector3i Resolution() const;
+  Vector3i Resolution() const override;
 
   // The side length of one (cubical) voxel, in meters.
-  float VoxelSize() const;
+  float VoxelSize() const override;
 
   // The side lengths of the entire grid, in meters.
   // Equivalent to VoxelSize() * Resolution().
-  Vector3f SideLengths() const;
+  Vector3f SideLengths() const override;
+
+  TriangleMesh Triangulate() const override;
+
+  // Re-meshes the bricks modified since the previous call (and the bricks
+  // whose cells read their voxels) and splices them into a cached mesh.
+  TriangleMesh TriangulateIncremental() override;
+
+  // Meshes the grid with StreamingMarchingCubes a chunk of slices at a time
+  // as it downloads them, so neither the voxels nor the mesh are ever whole
+  // in host memory.
+  bool TriangulateToPLY(const std::string& filename,
+    const PLYMeshWriter::Options& options = PLYMeshWriter::Options()) const
+    override;
+
+  // lod is clamped to [0, kNumLODs).
+  TriangleMesh TriangulateAtLOD(int lod) override;
+
+  // With GPUZeroCrossings(), in any layout.
+  bool ExtractSurfacePoints(DeviceArray1D<float4>& world_points_out,
+    DeviceArray1D<float4>& world_normals_out, int* num_points_out,
+    cudaStream_t stream = 0) const override;
+
+  // The resolution of level lod: Resolution() / 2^lod, rounded up.
+  Vector3i LODResolution(int lod) const;
+
+  // The number of bricks along each axis: Resolution() / kBrickSize, rounded
+  // up.
+  Vector3i ResolutionInBricks() const;
+
+  VoxelLayout Layout() const;
+
+  // The texture mirror and the downsampled levels.
+  void InvalidateAllCopies() override;
+
+  // Reads and writes the 'tsdf3d' format (see tsdf_file.h). Load() accepts
+  // every version, but the file's resolution must match Resolution(). It
+  // streams the memory-mapped file to the GPU a few slices at a time, so host
+  // memory use stays bounded. Save() writes the latest version.
+  bool Load(const std::string& filename, cudaStream_t stream = 0) override;
+  bool Save(const std::string& filename) const override;
+
+  // Only the voxels that leave or enter are touched.
+  bool Shift(const Vector3i& delta_voxels,
+    std::vector<EvictedTSDFSlab>* evicted) override;
 
-  TriangleMesh Triangulate() const;
+  // Copies the voxels to host memory. grid must be Resolution() in size.
+  void Download(Array3DWriteView<TSDF> grid) const;
 
-  bool Load(const std::string& filename);
-  bool Save(const std::string& filename) const;
+  // Replaces the voxels, transform and range of the volume. grid must be
+  // Resolution() in size.
+  void Upload(Array3DReadView<TSDF> grid,
+    const SimilarityTransform& world_from_grid, float max_tsdf_value);
 
 private:
 
+  // Views of device_grid_ in its layout, with the current origin.
+  RollingGridView<TSDF> WriteView();
+  RollingGridView<const TSDF> ReadView() const;
+
+  // True when device_grid_ holds the voxels x fastest from (0, 0, 0), so that
+  // it can be copied or read directly.
+  bool IsLinearAndUnrolled() const;
+
+  // Invalidates every structure derived from the voxels.
+  void OnAllVoxelsReplaced();
+
+  // Drops the tables of CacheProjections().
+  void ReleaseProjections();
+
+  // Returns a texture object bound to depth_map (unnormalized coordinates,
+  // point sampling), creating it on first use. Textures are cached until
+  // destruction, keyed by the buffer's address, size and pitch, so a
+  // reallocated buffer gets a new one.
+  cudaTextureObject_t CachedDepthTexture(const DeviceArray2D<float>& depth_map);
+
+  // Implements AdaptiveRaycast(), Raycast(), RaycastToSurfaces() and
+  // RaycastCompact(). The surfaces (0) and compact_out (nullptr) are
+  // optional.
+  void RaycastImpl(bool adaptive,
+    const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaSurfaceObject_t world_points_surface,
+    cudaSurfaceObject_t world_normals_surface,
+    DeviceArray2D<uint2>* compact_out,
+    cudaStream_t stream,
+    RaycastSampling sampling);
+
+  // Copies the voxels in [box_min, box_max) to output, x fastest.
+  void DownloadBox(const Vector3i& box_min, const Vector3i& box_max,
+    TSDF* output) const;
+
+  // Copies input, the voxels of [box_min, box_max) x fastest, to the grid.
+  // input is a device pointer. Enqueued on stream.
+  void ScatterBox(const Vector3i& box_min, const Vector3i& box_max,
+    const TSDF* input, cudaStream_t stream = 0);
+
+  // Empties the voxels in [box_min, box_max).
+  void ClearBox(const Vector3i& box_min, const Vector3i& box_max);
+
+  // Recomputes the empty space pyramid for the bricks whose voxels (or
+  // aprons) overlap [voxel_min, voxel_max).
+  void UpdateEmptySpaceMap(const Vector3i& voxel_min,
+    const Vector3i& voxel_max, cudaStream_t stream);
+
+  // After a fuse kernel: recomputes the empty space pyramid for the bricks
+  // in fused_bricks_ and their neighbors, queues the bricks for the texture
+  // mirror and the downsampled copies, and empties fused_bricks_. Enqueued
+  // on stream.
+  void RefreshFusedBricks(cudaStream_t stream);
+
+  // The mask that the fuse kernels mark.
+  DirtyBrickMask FuseDirtyBricks();
+
+  // Marks [voxel_min, voxel_max) as modified since the texture mirror and
+  // the downsampled copies were last refreshed.
+  void InvalidateCopies(const Vector3i& voxel_min,
+    const Vector3i& voxel_max);
+
+  // Allocates the texture mirror if needed and copies the stale region of the
+  // grid into it.
+  void UpdateTextureMirror(cudaStream_t stream);
+
+  void DestroyTextureMirror();
+
+  // Allocates the downsampled copies if needed and downsamples the stale
+  // region of the grid into them, level by level.
+  void UpdateLODs(cudaStream_t stream);
+
+  // A view of level lod in [0, kNumLODs). UpdateLODs() must have been called
+  // for lod > 0.
+  RollingGridView<const TSDF> LODReadView(int lod) const;
+
   SimilarityTransform grid_from_world_;
   SimilarityTransform world_from_grid_;
 
-  DeviceArray3D<TSDF> device_grid_;
+  Vector3i resolution_;
+  VoxelLayout layout_;
+  // StorageSize(resolution_, layout_) voxels.
+  PooledDeviceArray3D<TSDF> device_grid_;
+  // Physical index of logical voxel (0, 0, 0); see RollingGridView.
+  Vector3i grid_origin_;
 
   // TODO: this should be dynamic, and is a function of the noise model.
   float max_tsdf_value_;
+
+  // Whether Fuse() has warned that RAY_BAND fell back to VOXEL_SWEEP.
+  bool warned_ray_band_fallback_ = false;
+
+  // One bit per brick, set by Fuse() and FuseMultiple() and cleared by
+  // TriangulateIncremental().
+  DeviceArray1D<unsigned int> dirty_bricks_;
+
+  BrickMeshCache mesh_cache_;
+
+  // See EmptySpaceMap in raycast.h.
+  DeviceArray3D<float> brick_min_sdf_;
+  DeviceArray3D<float> coarse_min_sdf_;
+
+  // The bricks modified by the current fuse, and the bricks around them,
+  // whose empty space map is recomputed. See RefreshFusedBricks().
+  BrickListStorage fused_bricks_;
+  BrickListStorage apron_bricks_;
+
+  // Texture mirror of device_grid_ for TextureSampler, and the box of voxels
+  // that changed since it was refreshed (empty when stale_min_ >= stale_max_)
+  // besides the bricks fused since then, which are in mirror_bricks_.
+  cudaArray_t mirror_array_ = nullptr;
+  cudaSurfaceObject_t mirror_surface_ = 0;
+  cudaTextureObject_t mirror_texture_ = 0;
+  Vector3i mirror_size_;
+  Vector3i stale_min_;
+  Vector3i stale_max_;
+  BrickListStorage mirror_bricks_;
+
+  // lod_grids_[i] is level i + 1, LODResolution(i + 1) voxels stored x
+  // fastest from (0, 0, 0). Empty until first used. lod_stale_min_ and
+  // lod_stale_max_ are the box of voxels of the grid that changed since they
+  // were refreshed, besides the bricks fused since then, in lod_bricks_.
+  PooledDeviceArray3D<TSDF> lod_grids_[kNumLODs - 1];
+  Vector3i lod_stale_min_;
+  Vector3i lod_stale_max_;
+  BrickListStorage lod_bricks_;
+
+  // Set by CacheProjections(): one table per camera, covering
+  // [box_min, box_max) (see BuildProjectionTableKernel in fuse.h). Cameras
+  // that see none of the grid have an empty box.
+  struct ProjectionTable {
+    DeviceArray1D<uint2> entries;
+    Vector3i box_min;
+    Vector3i box_max;
+    float2 depth_min_max;
+  };
+  std::vector<ProjectionTable> projection_tables_;
+
+  // See CachedDepthTexture(). Device pointer, width, height and pitch in
+  // bytes.
+  using DepthTextureKey = std::tuple<const void*, size_t, size_t, size_t>;
+  std::map<DepthTextureKey, cudaTextureObject_t> depth_textures_;
 };
 
 #endif // REGULAR_GRID_TSDF_H
@@ -0,0 +1,183 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "rgbd_frame_index.h"
+
+#include <fstream>
+#include <utility>
+
+#include "libcgt/camera_wrappers/RGBDStream.h"
+#include "libcgt/core/common/ArrayUtils.h"
+#include "libcgt/core/io/BinaryFileInputStream.h"
+#include "libcgt/core/io/BinaryFileOutputStream.h"
+
+#include "compressed_rgbd_stream.h"
+
+using libcgt::camera_wrappers::RGBDInputStream;
+using libcgt::core::arrayutils::readViewOf;
+using libcgt::core::arrayutils::writeViewOf;
+
+namespace {
+
+const char kMagic[] = { 'r', 'g', 'b', 'd', 'i', 'x' };
+const int32_t kVersion = 1;
+
+// Returns 0 if the file cannot be opened.
+uint64_t FileSize(const std::string& filename) {
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  if (!file) {
+    return 0;
+  }
+  return static_cast<uint64_t>(file.tellg());
+}
+
+}  // namespace
+
+// static
+std::string RgbdFrameIndex::SidecarFilename(
+  const std::string& rgbd_filename) {
+  return rgbd_filename + ".idx";
+}
+
+bool RgbdFrameIndex::LoadOrBuild(const std::string& rgbd_filename) {
+  uint64_t rgbd_file_size = FileSize(rgbd_filename);
+  if (rgbd_file_size == 0) {
+    return false;
+  }
+  std::string index_filename = SidecarFilename(rgbd_filename);
+  if (Load(index_filename, rgbd_file_size)) {
+    return true;
+  }
+  if (!Build(rgbd_filename)) {
+    return false;
+  }
+  Save(index_filename);
+  return true;
+}
+
+bool RgbdFrameIndex::Build(const std::string& rgbd_filename) {
+  uint64_t rgbd_file_size = FileSize(rgbd_filename);
+  if (rgbd_file_size == 0) {
+    return false;
+  }
+
+  std::vector<Entry> entries;
+  Entry entry;
+  if (IsCompressedRGBDFile(rgbd_filename)) {
+    // Only the frame headers are needed: nothing is decoded.
+    CompressedRGBDInputStream stream(rgbd_filename);
+    if (!stream.isValid()) {
+      return false;
+    }
+    while (stream.skip(entry.stream_id, entry.frame_index,
+      entry.timestamp_ns)) {
+      entries.push_back(entry);
+    }
+  } else {
+    RGBDInputStream stream(rgbd_filename.c_str());
+    while (stream.read(entry.stream_id, entry.frame_index,
+      entry.timestamp_ns).notNull()) {
+      entries.push_back(entry);
+    }
+  }
+
+  rgbd_file_size_ = rgbd_file_size;
+  entries_ = std::move(entries);
+  return true;
+}
+
+bool RgbdFrameIndex::Load(const std::string& index_filename,
+  uint64_t rgbd_file_size) {
+  if (FileSize(index_filename) == 0) {
+    return false;
+  }
+  BinaryFileInputStream in(index_filename);
+
+  for (char expected : kMagic) {
+    uint8_t c = 0;
+    in.read(c);
+    if (c != static_cast<uint8_t>(expected)) {
+      return false;
+    }
+  }
+
+  int32_t version = 0;
+  in.read(version);
+  if (version != kVersion) {
+    return false;
+  }
+
+  uint64_t indexed_file_size = 0;
+  in.read(indexed_file_size);
+  if (indexed_file_size != rgbd_file_size) {
+    return false;
+  }
+
+  int32_t num_entries = -1;
+  in.read(num_entries);
+  // Guards against absurd allocations when reading corrupt headers.
+  if (num_entries < 0 ||
+    static_cast<uint64_t>(num_entries) * sizeof(Entry) >
+      FileSize(index_filename)) {
+    return false;
+  }
+
+  std::vector<Entry> entries(num_entries);
+  if (num_entries > 0) {
+    in.readArray(writeViewOf(entries));
+  }
+
+  rgbd_file_size_ = rgbd_file_size;
+  entries_ = std::move(entries);
+  return true;
+}
+
+bool RgbdFrameIndex::Save(const std::string& index_filename) const {
+  BinaryFileOutputStream out(index_filename);
+  for (char c : kMagic) {
+    out.write(c);
+  }
+  out.write<int32_t>(kVersion);
+  out.write<uint64_t>(rgbd_file_size_);
+  out.write<int32_t>(static_cast<int32_t>(entries_.size()));
+  if (!entries_.empty()) {
+    out.writeArray(readViewOf(entries_));
+  }
+  return out.close();
+}
+
+const std::vector<RgbdFrameIndex::Entry>& RgbdFrameIndex::Entries() const {
+  return entries_;
+}
+
+std::vector<RgbdFrameIndex::Entry> RgbdFrameIndex::StreamEntries(
+  uint32_t stream_id) const {
+  std::vector<Entry> stream_entries;
+  for (const Entry& entry : entries_) {
+    if (entry.stream_id == stream_id) {
+      stream_entries.push_back(entry);
+    }
+  }
+  return stream_entries;
+}
+
+int RgbdFrameIndex::FindFrame(uint32_t stream_id,
+  int32_t frame_index) const {
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (entries_[i].stream_id == stream_id &&
+      entries_[i].frame_index >= frame_index) {
+      return static_cast<int>(i);
+    }
+  }
+  return static_cast<int>(entries_.size());
+}
@@ -0,0 +1,67 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef RGBD_FRAME_INDEX_H
+#define RGBD_FRAME_INDEX_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The order, streams and timestamps of every frame in a .rgbd (or .rgbdz)
+// file, so that tools can find frames without reading (and converting or
+// decoding) the whole file.
+//
+// The index is stored next to the file it describes, as a sidecar
+// "<filename>.idx": magic 'rgbdix', int32 version, uint64 size of the .rgbd
+// file, int32 num_entries, then num_entries x Entry. A sidecar whose size
+// does not match the .rgbd file is stale and rebuilt.
+class RgbdFrameIndex {
+ public:
+
+  // One frame of one stream, in file order.
+  struct Entry {
+    uint32_t stream_id;
+    int32_t frame_index;
+    int64_t timestamp_ns;
+  };
+
+  static std::string SidecarFilename(const std::string& rgbd_filename);
+
+  // Loads the sidecar of rgbd_filename if it is up to date. Otherwise, scans
+  // the file and tries to save a new sidecar (failing to save is not an
+  // error). Returns false if the file cannot be read.
+  bool LoadOrBuild(const std::string& rgbd_filename);
+
+  // Scans every frame of rgbd_filename.
+  bool Build(const std::string& rgbd_filename);
+
+  bool Load(const std::string& index_filename, uint64_t rgbd_file_size);
+  bool Save(const std::string& index_filename) const;
+
+  const std::vector<Entry>& Entries() const;
+
+  // The entries of one stream, in order.
+  std::vector<Entry> StreamEntries(uint32_t stream_id) const;
+
+  // The position in Entries() of the first frame of stream_id whose
+  // frame_index is at least frame_index, or Entries().size() if none.
+  int FindFrame(uint32_t stream_id, int32_t frame_index) const;
+
+ private:
+
+  uint64_t rgbd_file_size_ = 0;
+  std::vector<Entry> entries_;
+};
+
+#endif  // RGBD_FRAME_INDEX_H
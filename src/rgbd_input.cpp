@@ -22,6 +22,8 @@
 #include "libcgt/core/imageproc/Swizzle.h"
 
 #include "input_buffer.h"
+#include "rgbd_recorder.h"
+#include "trace.h"
 
 using libcgt::camera_wrappers::PixelFormat;
 using libcgt::camera_wrappers::RGBDInputStream;
@@ -31,6 +33,17 @@ using libcgt::core::arrayutils::flipY;
 using libcgt::core::imageproc::linearRemapToLuminance;
 using libcgt::core::imageproc::RGBToBGR;
 
+namespace {
+
+// Compressed frames are decoded ahead of read() on this many threads.
+const int kNumDecodeThreads = 2;
+
+// Stream ids of recordedStreamMetadata().
+const uint32_t kRecordedColorStreamId = 0;
+const uint32_t kRecordedDepthStreamId = 1;
+
+}  // namespace
+
 RgbdInput::RgbdInput(InputType input_type, const char* filename) :
   input_type_(input_type) {
   if (input_type == InputType::OPENNI2) {
@@ -52,12 +65,13 @@ RgbdInput::RgbdInput(InputType input_type, const char* filename) :
     openni2_frame_.depth = openni2_buffer_depth_.writeView();
     openni2_camera_->start();
   } else if (input_type == InputType::FILE) {
-    file_input_stream_ = std::make_unique<RGBDInputStream>(filename);
+    filename_ = filename;
+    openFile();
 
     // Find the rgb stream.
     // TODO: take a dependency on cpp11-range
-    for(int i = 0; i < file_input_stream_->metadata().size(); ++i) {
-      const auto& metadata = file_input_stream_->metadata()[i];
+    for(int i = 0; i < fileMetadata().size(); ++i) {
+      const auto& metadata = fileMetadata()[i];
       if(metadata.type == StreamType::COLOR &&
         metadata.format ==  PixelFormat::RGB_U888) {
         color_stream_id_ = i;
@@ -68,8 +82,8 @@ RgbdInput::RgbdInput(InputType input_type, const char* filename) :
 
     // Find the depth stream.
     // TODO: take a dependency on cpp11-range
-    for (int i = 0; i < file_input_stream_->metadata().size(); ++i) {
-      const auto& metadata = file_input_stream_->metadata()[i];
+    for (int i = 0; i < fileMetadata().size(); ++i) {
+      const auto& metadata = fileMetadata()[i];
       if (metadata.type == StreamType::DEPTH) {
         raw_depth_stream_id_ = i;
         depth_metadata_ = metadata;
@@ -87,11 +101,9 @@ Vector2i RgbdInput::depthSize() const {
   return depth_metadata_.size;
 }
 
-// TODO: simplify: read only rgb, etc
-// TODO: by default, read all
-
 void RgbdInput::read(InputBuffer* buffer,
-  bool* rgb_updated, bool* depth_updated) {
+  bool* rgb_updated, bool* depth_updated, InputStreams streams) {
+  ScopedTraceRange trace("RgbdInput::read", TraceCategory::INPUT);
   assert(rgb_updated != nullptr);
   assert(depth_updated != nullptr);
 
@@ -99,12 +111,33 @@ void RgbdInput::read(InputBuffer* buffer,
 
   *rgb_updated = false;
   *depth_updated = false;
+  bool read_color = notZero(streams & InputStreams::COLOR);
+  bool read_depth = notZero(streams & InputStreams::DEPTH);
 
   if (input_type_ == InputType::OPENNI2) {
     // TODO: if closed, return false
 
     bool succeeded = openni2_camera_->pollOne(openni2_frame_);
-    if (openni2_frame_.colorUpdated) {
+    if (recorder_ != nullptr) {
+      ScopedTraceRange trace_record("RgbdInput: record",
+        TraceCategory::INPUT);
+      // Only copies: the recorder writes on its own thread.
+      if (openni2_frame_.colorUpdated) {
+        recorder_->Record(kRecordedColorStreamId,
+          openni2_frame_.colorFrameNumber, openni2_frame_.colorTimestampNS,
+          Array1DReadView<uint8_t>(openni2_buffer_rgb_.pointer(),
+            openni2_buffer_rgb_.numElements() * sizeof(uint8x3)));
+      }
+      if (openni2_frame_.depthUpdated) {
+        recorder_->Record(kRecordedDepthStreamId,
+          openni2_frame_.depthFrameNumber, openni2_frame_.depthTimestampNS,
+          Array1DReadView<uint8_t>(openni2_buffer_depth_.pointer(),
+            openni2_buffer_depth_.numElements() * sizeof(uint16_t)));
+      }
+    }
+    if (openni2_frame_.colorUpdated && read_color) {
+      ScopedTraceRange trace_convert("RgbdInput: convert color",
+        TraceCategory::INPUT);
       // Copy the buffer, flipping it upside down for OpenGL.
       copy<uint8x3>(openni2_frame_.color, flipY(buffer->color_rgb.writeView()));
       // Convert RGB to BGR for OpenCV.
@@ -114,9 +147,17 @@ void RgbdInput::read(InputBuffer* buffer,
       *rgb_updated = openni2_frame_.colorUpdated;
     }
 
-    if (openni2_frame_.depthUpdated) {
-      rawDepthMapToMeters(openni2_frame_.depth, buffer->depth_meters,
-        false, true);
+    if (openni2_frame_.depthUpdated && read_depth) {
+      ScopedTraceRange trace_convert("RgbdInput: convert depth",
+        TraceCategory::INPUT);
+      if (raw_depth_) {
+        copy<uint16_t>(openni2_frame_.depth,
+          buffer->depth_millimeters_ydown.writeView());
+      } else {
+        rawDepthMapToMeters(openni2_frame_.depth, buffer->depth_meters,
+          false, true);
+      }
+      buffer->depth_is_raw = raw_depth_;
       buffer->depth_timestamp_ns = openni2_frame_.depthTimestampNS;
       buffer->depth_frame_index = openni2_frame_.depthFrameNumber;
       *depth_updated = openni2_frame_.depthUpdated;
@@ -126,11 +167,19 @@ void RgbdInput::read(InputBuffer* buffer,
     uint32_t stream_id;
     int64_t timestamp_ns;
     int32_t frame_index;
-    Array1DReadView<uint8_t> src = file_input_stream_->read(
-      stream_id, frame_index, timestamp_ns);
+    Array1DReadView<uint8_t> src =
+      readEntry(&stream_id, &frame_index, &timestamp_ns);
+    // Skip the frames of unused streams without converting them.
+    while (src.notNull() &&
+      ((stream_id == color_stream_id_ && !read_color) ||
+       (stream_id == raw_depth_stream_id_ && !read_depth))) {
+      src = readEntry(&stream_id, &frame_index, &timestamp_ns);
+    }
 
     if (src.notNull()) {
       if (stream_id == color_stream_id_) {
+        ScopedTraceRange trace_convert("RgbdInput: convert color",
+          TraceCategory::INPUT);
         Array2DReadView<uint8x3> src_rgb(
           src.pointer(), color_metadata_.size);
         // Copy the buffer, flipping it upside down for OpenGL.
@@ -145,22 +194,132 @@ void RgbdInput::read(InputBuffer* buffer,
         *rgb_updated = true;
         // *rgb_updated = succeeded;
       } else if (stream_id == raw_depth_stream_id_ ) {
+        ScopedTraceRange trace_convert("RgbdInput: convert depth",
+          TraceCategory::INPUT);
         buffer->depth_timestamp_ns = timestamp_ns;
         buffer->depth_frame_index = frame_index;
 
         if (depth_metadata_.format == PixelFormat::DEPTH_MM_U16) {
           Array2DReadView<uint16_t> src_depth(src.pointer(),
             depth_metadata_.size);
-          rawDepthMapToMeters(src_depth, buffer->depth_meters,
-            false);
-          *depth_updated = true;
+          if (raw_depth_) {
+            *depth_updated = copy(src_depth,
+              buffer->depth_millimeters_ydown.writeView());
+          } else {
+            rawDepthMapToMeters(src_depth, buffer->depth_meters,
+              false);
+            *depth_updated = true;
+          }
+          buffer->depth_is_raw = raw_depth_;
         } else if(depth_metadata_.format == PixelFormat::DEPTH_M_F32) {
           Array2DReadView<float> src_depth(src.pointer(),
             depth_metadata_.size);
           bool succeeded = copy(src_depth, buffer->depth_meters.writeView());
+          buffer->depth_is_raw = false;
           *depth_updated = succeeded;
         }
       }
     }
   }
 }
+
+void RgbdInput::setRawDepth(bool raw) {
+  raw_depth_ = raw;
+}
+
+std::vector<RgbdInput::StreamMetadata>
+RgbdInput::recordedStreamMetadata() const {
+  std::vector<StreamMetadata> metadata;
+  if (openni2_camera_ == nullptr) {
+    return metadata;
+  }
+  StreamMetadata color_metadata;
+  color_metadata.type = StreamType::COLOR;
+  color_metadata.format = PixelFormat::RGB_U888;
+  color_metadata.size = openni2_buffer_rgb_.size();
+  metadata.push_back(color_metadata);
+
+  StreamMetadata depth_metadata;
+  depth_metadata.type = StreamType::DEPTH;
+  depth_metadata.format = PixelFormat::DEPTH_MM_U16;
+  depth_metadata.size = openni2_buffer_depth_.size();
+  metadata.push_back(depth_metadata);
+  return metadata;
+}
+
+void RgbdInput::setRecorder(RgbdRecorder* recorder) {
+  recorder_ = recorder;
+}
+
+int RgbdInput::colorStreamId() const {
+  return color_stream_id_;
+}
+
+int RgbdInput::depthStreamId() const {
+  return raw_depth_stream_id_;
+}
+
+bool RgbdInput::seek(int entry) {
+  if (file_input_stream_ == nullptr && compressed_input_stream_ == nullptr) {
+    return false;
+  }
+  // The streams only read forward.
+  if (entry < next_entry_) {
+    openFile();
+    next_entry_ = 0;
+  }
+
+  ScopedTraceRange trace("RgbdInput::seek", TraceCategory::INPUT);
+  uint32_t stream_id;
+  int32_t frame_index;
+  int64_t timestamp_ns;
+  while (next_entry_ < entry) {
+    // Skipped compressed frames are not decoded.
+    bool read = compressed_input_stream_ != nullptr ?
+      compressed_input_stream_->skip(stream_id, frame_index, timestamp_ns) :
+      file_input_stream_->read(
+        stream_id, frame_index, timestamp_ns).notNull();
+    if (!read) {
+      return false;
+    }
+    ++next_entry_;
+  }
+  return true;
+}
+
+void RgbdInput::setEndEntry(int entry) {
+  end_entry_ = entry;
+}
+
+void RgbdInput::openFile() {
+  if (IsCompressedRGBDFile(filename_)) {
+    file_input_stream_.reset();
+    compressed_input_stream_ = std::make_unique<CompressedRGBDInputStream>(
+      filename_, kNumDecodeThreads);
+  } else {
+    compressed_input_stream_.reset();
+    file_input_stream_ = std::make_unique<RGBDInputStream>(filename_.c_str());
+  }
+}
+
+const std::vector<RgbdInput::StreamMetadata>&
+RgbdInput::fileMetadata() const {
+  if (compressed_input_stream_ != nullptr) {
+    return compressed_input_stream_->metadata();
+  }
+  return file_input_stream_->metadata();
+}
+
+Array1DReadView<uint8_t> RgbdInput::readEntry(uint32_t* stream_id,
+  int32_t* frame_index, int64_t* timestamp_ns) {
+  if (end_entry_ >= 0 && next_entry_ >= end_entry_) {
+    return Array1DReadView<uint8_t>();
+  }
+  Array1DReadView<uint8_t> src = compressed_input_stream_ != nullptr ?
+    compressed_input_stream_->read(*stream_id, *frame_index, *timestamp_ns) :
+    file_input_stream_->read(*stream_id, *frame_index, *timestamp_ns);
+  if (src.notNull()) {
+    ++next_entry_;
+  }
+  return src;
+}
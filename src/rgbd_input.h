@@ -16,15 +16,20 @@
 
 #include <cstdint>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "libcgt/core/common/Array2D.h"
 #include "libcgt/core/common/BasicTypes.h"
 #include "libcgt/camera_wrappers/RGBDStream.h"
 #include "libcgt/camera_wrappers/OpenNI2/OpenNI2Camera.h"
 
-// TODO(jiawen): Figure out a way to forward declare RGBDInputStream.
+#include "compressed_rgbd_stream.h"
+#include "input_buffer.h"
+
+class RgbdRecorder;
 
-struct InputBuffer;
+// TODO(jiawen): Figure out a way to forward declare RGBDInputStream.
 
 // TODO(jiawen): When accepting a camera, take in:
 // - an array of StreamConfigs, which is generic.
@@ -50,8 +55,46 @@ public:
   // buffer->depth_meters will be updated. Both might be set to false, in which
   // case the read failed.
   //
+  // Only the streams in streams are converted into buffer. From a file,
+  // frames of the other streams are skipped: a failed read still means the
+  // end of the file.
+  //
   // TODO: return a status struct, indicating if end of file is reached.
-  void read(InputBuffer* buffer, bool* rgb_updated, bool* depth_updated);
+  void read(InputBuffer* buffer, bool* rgb_updated, bool* depth_updated,
+    InputStreams streams = InputStreams::ALL);
+
+  // When raw is true, read() copies millimeter depth frames unconverted into
+  // buffer->depth_millimeters_ydown and sets buffer->depth_is_raw, leaving
+  // depth_meters alone. Depth stored in meters is still read into
+  // depth_meters. Off by default.
+  void setRawDepth(bool raw);
+
+  // The following are for InputType::OPENNI2 only.
+
+  // The streams that read() passes to setRecorder()'s recorder: color
+  // (stream id 0) and depth (stream id 1), as the camera delivers them.
+  std::vector<libcgt::camera_wrappers::StreamMetadata>
+  recordedStreamMetadata() const;
+
+  // If recorder is not null, read() also hands it every frame it polls, of
+  // all streams, before any conversion. recorder must outlive reads.
+  void setRecorder(RgbdRecorder* recorder);
+
+  // The following are for InputType::FILE only. Entries are the frames of
+  // all streams, in file order, as in RgbdFrameIndex::Entries().
+
+  // Stream ids of the color and depth streams read(), or -1 if none.
+  int colorStreamId() const;
+  int depthStreamId() const;
+
+  // Makes the next read() start at entry. Skipped frames are read but not
+  // converted. Seeking backwards reopens the file. Returns false if the file
+  // ends before entry.
+  bool seek(int entry);
+
+  // Makes read() fail, as at the end of the file, once entry is reached.
+  // -1 reads until the end of the file.
+  void setEndEntry(int entry);
 
 private:
 
@@ -59,14 +102,32 @@ private:
   using RGBDInputStream = libcgt::camera_wrappers::RGBDInputStream;
   using StreamMetadata = libcgt::camera_wrappers::StreamMetadata;
 
+  // Opens filename_ as a .rgbd or .rgbdz file, from the start.
+  void openFile();
+
+  // The streams of the open file.
+  const std::vector<StreamMetadata>& fileMetadata() const;
+
+  // Reads the next entry of the file, or returns null at the end entry.
+  Array1DReadView<uint8_t> readEntry(uint32_t* stream_id,
+    int32_t* frame_index, int64_t* timestamp_ns);
+
   InputType input_type_;
+  bool raw_depth_ = false;
 
   std::unique_ptr<OpenNI2Camera> openni2_camera_;
   Array2D<uint8x3> openni2_buffer_rgb_;
   Array2D<uint16_t> openni2_buffer_depth_;
   OpenNI2Camera::FrameView openni2_frame_;
+  RgbdRecorder* recorder_ = nullptr;
 
+  std::string filename_;
+  // Exactly one of these is open for InputType::FILE.
   std::unique_ptr<RGBDInputStream> file_input_stream_;
+  std::unique_ptr<CompressedRGBDInputStream> compressed_input_stream_;
+  // The entry the next readEntry() returns.
+  int next_entry_ = 0;
+  int end_entry_ = -1;
 
   int color_stream_id_ = -1;
   StreamMetadata color_metadata_;
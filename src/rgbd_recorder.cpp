@@ -0,0 +1,206 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "rgbd_recorder.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "frame_codec.h"
+#include "perf_collector.h"
+#include "trace.h"
+
+using libcgt::camera_wrappers::RGBDOutputStream;
+
+namespace {
+
+constexpr const char* kRecordedFramesCounter = "recorder.recorded";
+constexpr const char* kDroppedFramesCounter = "recorder.dropped";
+constexpr const char* kMaxQueuedCounter = "recorder.max_queued";
+
+// The writer waits for this many frames before writing a batch, unless
+// kMaxBatchDelay passes first.
+constexpr int kMinBatchFrames = 8;
+constexpr std::chrono::milliseconds kMaxBatchDelay(100);
+
+int MaxFrameBytes(
+  const std::vector<RgbdRecorder::StreamMetadata>& metadata) {
+  int max_frame_bytes = 0;
+  for (const auto& stream_metadata : metadata) {
+    max_frame_bytes =
+      std::max(max_frame_bytes, RawFrameBytes(stream_metadata));
+  }
+  return max_frame_bytes;
+}
+
+int NumPooledFrames(
+  const std::vector<RgbdRecorder::StreamMetadata>& metadata,
+  int64_t max_queued_bytes) {
+  int64_t num_frames =
+    max_queued_bytes / std::max(1, MaxFrameBytes(metadata));
+  return static_cast<int>(std::min<int64_t>(std::max<int64_t>(2, num_frames),
+    1 << 16));
+}
+
+}  // namespace
+
+RgbdRecorder::RgbdRecorder(const std::vector<StreamMetadata>& metadata,
+  const std::string& filename, const Options& options) :
+  queued_frames_(NumPooledFrames(metadata, options.max_queued_bytes)),
+  free_frames_(queued_frames_.Capacity()) {
+  const int max_frame_bytes = MaxFrameBytes(metadata);
+  for (int i = 0; i < queued_frames_.Capacity(); ++i) {
+    frames_.push_back(std::make_unique<Frame>());
+    frames_.back()->data.reserve(max_frame_bytes);
+    free_frames_.TryPush(frames_.back().get());
+  }
+
+  if (options.compress) {
+    std::vector<FrameCodec> codecs;
+    for (const StreamMetadata& stream_metadata : metadata) {
+      codecs.push_back(DefaultFrameCodec(stream_metadata, true));
+    }
+    compressed_stream_ = std::make_unique<CompressedRGBDOutputStream>(
+      metadata, codecs, filename, options.jpeg_quality);
+    if (!compressed_stream_->isValid()) {
+      compressed_stream_.reset();
+    }
+  } else {
+    stream_ = std::make_unique<RGBDOutputStream>(metadata, filename.c_str());
+    if (!stream_->isValid()) {
+      stream_.reset();
+    }
+  }
+
+  if (IsOpen()) {
+    thread_ = std::thread(&RgbdRecorder::Run, this);
+  } else {
+    closing_ = true;
+  }
+}
+
+RgbdRecorder::~RgbdRecorder() {
+  Close();
+}
+
+bool RgbdRecorder::IsOpen() const {
+  return stream_ != nullptr || compressed_stream_ != nullptr;
+}
+
+bool RgbdRecorder::Record(uint32_t stream_id, int32_t frame_index,
+  int64_t timestamp_ns, Array1DReadView<uint8_t> data) {
+  if (closing_) {
+    return false;
+  }
+  Frame* frame = nullptr;
+  if (!free_frames_.TryPop(&frame)) {
+    ++num_dropped_frames_;
+    if (PerfCollector::Enabled()) {
+      PerfCollector::Get().IncrementCounter(kDroppedFramesCounter);
+    }
+    return false;
+  }
+
+  frame->stream_id = stream_id;
+  frame->frame_index = frame_index;
+  frame->timestamp_ns = timestamp_ns;
+  // Within the reserved capacity: does not allocate.
+  frame->data.assign(data.pointer(), data.pointer() + data.size());
+
+  // Never full: it has room for every frame.
+  queued_frames_.TryPush(frame);
+  ++num_recorded_frames_;
+  if (PerfCollector::Enabled()) {
+    PerfCollector& collector = PerfCollector::Get();
+    collector.IncrementCounter(kRecordedFramesCounter);
+    collector.UpdateCounterMax(kMaxQueuedCounter, queued_frames_.Size());
+  }
+  if (queued_frames_.Size() >= kMinBatchFrames) {
+    Notify();
+  }
+  return true;
+}
+
+bool RgbdRecorder::Close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closing_ = true;
+    cv_.notify_all();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+
+  bool succeeded = !write_failed_;
+  if (stream_ != nullptr) {
+    succeeded = stream_->close() && succeeded;
+    stream_.reset();
+  } else if (compressed_stream_ != nullptr) {
+    succeeded = compressed_stream_->close() && succeeded;
+    compressed_stream_.reset();
+  }
+  write_failed_ = !succeeded;
+  return succeeded;
+}
+
+int64_t RgbdRecorder::NumRecordedFrames() const {
+  return num_recorded_frames_;
+}
+
+int64_t RgbdRecorder::NumDroppedFrames() const {
+  return num_dropped_frames_;
+}
+
+void RgbdRecorder::Run() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait_for(lock, kMaxBatchDelay, [this] {
+        return closing_ || queued_frames_.Size() >= kMinBatchFrames;
+      });
+    }
+    // Checked before draining, so the frames queued before Close() are
+    // all written.
+    bool closing = closing_;
+
+    ScopedTraceRange trace("RgbdRecorder: write batch", TraceCategory::INPUT);
+    Frame* frame = nullptr;
+    while (queued_frames_.TryPop(&frame)) {
+      if (!Write(*frame)) {
+        write_failed_ = true;
+      }
+      // Never full: it has room for every frame.
+      free_frames_.TryPush(frame);
+    }
+    if (closing) {
+      return;
+    }
+  }
+}
+
+bool RgbdRecorder::Write(const Frame& frame) {
+  Array1DReadView<uint8_t> data(frame.data.data(), frame.data.size());
+  if (compressed_stream_ != nullptr) {
+    return compressed_stream_->write(frame.stream_id, frame.frame_index,
+      frame.timestamp_ns, data);
+  }
+  return stream_->write(frame.stream_id, frame.frame_index,
+    frame.timestamp_ns, data);
+}
+
+void RgbdRecorder::Notify() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+  }
+  cv_.notify_all();
+}
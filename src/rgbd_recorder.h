@@ -0,0 +1,127 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef RGBD_RECORDER_H
+#define RGBD_RECORDER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libcgt/core/common/Array1D.h"
+#include "libcgt/camera_wrappers/RGBDStream.h"
+
+#include "compressed_rgbd_stream.h"
+#include "spsc_ring.h"
+
+// Records raw frames to a .rgbd (or .rgbdz) file on a background writer
+// thread, so that a live session can be fused again offline with
+// fuse_depth_cli while capture never waits for the disk.
+//
+// Record() copies each frame into a buffer from a fixed pool and hands it
+// to the writer through a lock-free SpscRing. The pool bounds the memory
+// held by frames waiting to be written: when the disk falls behind for
+// longer than the pool lasts, Record() drops frames instead of blocking.
+// The writer wakes up once per batch of frames and writes them in order.
+//
+// With --collect_perf, reports to PerfCollector how many frames were
+// recorded and dropped, and the largest number of frames waiting.
+class RgbdRecorder {
+ public:
+
+  using StreamMetadata = libcgt::camera_wrappers::StreamMetadata;
+
+  struct Options {
+    // Write a .rgbdz file, with CompressedRGBDOutputStream's default codecs
+    // (lossless depth, JPEG color), instead of a .rgbd file.
+    bool compress = false;
+    int jpeg_quality = 90;
+    // Bound on the memory held by frames waiting to be written. At least
+    // two frames of the largest stream are always pooled.
+    int64_t max_queued_bytes = 256 << 20;
+  };
+
+  // metadata describes the streams that Record() takes, as for
+  // RGBDOutputStream.
+  RgbdRecorder(const std::vector<StreamMetadata>& metadata,
+    const std::string& filename, const Options& options);
+  // Calls Close().
+  ~RgbdRecorder();
+
+  RgbdRecorder(const RgbdRecorder& copy) = delete;
+  RgbdRecorder& operator = (const RgbdRecorder& copy) = delete;
+
+  // False if the file could not be opened.
+  bool IsOpen() const;
+
+  // Producer thread only: copies data, one raw frame of stream stream_id,
+  // and queues it to be written. Never blocks on the disk. Returns false if
+  // the frame was dropped because every pooled buffer is waiting to be
+  // written, or if the recorder is closed.
+  bool Record(uint32_t stream_id, int32_t frame_index, int64_t timestamp_ns,
+    Array1DReadView<uint8_t> data);
+
+  // Writes the frames still queued, then stops the writer and closes the
+  // file. Returns false if any frame failed to be written.
+  bool Close();
+
+  int64_t NumRecordedFrames() const;
+  int64_t NumDroppedFrames() const;
+
+ private:
+
+  struct Frame {
+    uint32_t stream_id;
+    int32_t frame_index;
+    int64_t timestamp_ns;
+    std::vector<uint8_t> data;
+  };
+
+  void Run();
+
+  bool Write(const Frame& frame);
+
+  // Wakes up the writer. Avoids missing it between checking the ring and
+  // sleeping.
+  void Notify();
+
+  std::vector<std::unique_ptr<Frame>> frames_;
+
+  // Producer --> writer.
+  SpscRing<Frame*> queued_frames_;
+  // Writer --> producer.
+  SpscRing<Frame*> free_frames_;
+
+  // Exactly one of these is open.
+  std::unique_ptr<libcgt::camera_wrappers::RGBDOutputStream> stream_;
+  std::unique_ptr<CompressedRGBDOutputStream> compressed_stream_;
+  // Written by the writer thread, read by Close() once it has exited.
+  bool write_failed_ = false;
+
+  std::atomic<int64_t> num_recorded_frames_{ 0 };
+  std::atomic<int64_t> num_dropped_frames_{ 0 };
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Guarded by mutex_. Also read without the lock by Record().
+  std::atomic<bool> closing_{ false };
+
+  std::thread thread_;
+};
+
+#endif  // RGBD_RECORDER_H
@@ -0,0 +1,109 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef ROLLING_GRID_VIEW_H
+#define ROLLING_GRID_VIEW_H
+
+#include <vector_types.h>
+
+#include "libcgt/cuda/KernelArray3D.h"
+
+// Side length, in voxels, of the bricks of VoxelLayout::BRICKED storage.
+constexpr int kStorageBrickSize = 8;
+
+// How the voxels of a regular grid are laid out in its KernelArray3D.
+enum class VoxelLayout {
+  // The array has the size of the grid, x fastest.
+  LINEAR,
+  // Each kStorageBrickSize^3 brick of the grid is contiguous, x fastest
+  // within it. Trilinear samples and short rays in any direction then touch
+  // one or a few bricks instead of rows and slices far apart. The array is
+  // StorageSize() in size: one row per brick, with brick (bx, by, bz) at row
+  // bx + num_bricks.x * by of slice bz. Grids are padded to whole bricks.
+  BRICKED
+};
+
+// The size of the array that stores a grid of the given resolution.
+__inline__ __host__ __device__
+int3 StorageSize(int3 resolution, VoxelLayout layout) {
+  if (layout == VoxelLayout::LINEAR) {
+    return resolution;
+  }
+  int3 num_bricks = {
+    (resolution.x + kStorageBrickSize - 1) / kStorageBrickSize,
+    (resolution.y + kStorageBrickSize - 1) / kStorageBrickSize,
+    (resolution.z + kStorageBrickSize - 1) / kStorageBrickSize
+  };
+  return{ kStorageBrickSize * kStorageBrickSize * kStorageBrickSize,
+    num_bricks.x * num_bricks.y, num_bricks.z };
+}
+
+// The accessor through which kernels read and write a regular grid. It hides
+// both the layout of the stored voxels (see VoxelLayout) and the rolling
+// origin of the grid: it is indexed modulo resolution, so logical voxel
+// (0, 0, 0) is stored at physical voxel origin and indices wrap around.
+// Shifting a volume by whole voxels then only changes origin, not the stored
+// samples.
+//
+// Logical indices must be in [0, size()). With origin (0, 0, 0) and a linear
+// layout the view reads and writes the array directly.
+template <typename T>
+struct RollingGridView {
+  KernelArray3D<T> array;
+  int3 origin;
+  int3 resolution;
+  VoxelLayout layout;
+
+  __inline__ __host__ __device__
+  int3 size() const {
+    return resolution;
+  }
+
+#ifdef __CUDACC__
+  // The wrapped voxel, in grid coordinates.
+  __inline__ __device__
+  int3 PhysicalVoxel(int3 logical) const {
+    int3 physical = {
+      logical.x + origin.x, logical.y + origin.y, logical.z + origin.z
+    };
+    if (physical.x >= resolution.x) physical.x -= resolution.x;
+    if (physical.y >= resolution.y) physical.y -= resolution.y;
+    if (physical.z >= resolution.z) physical.z -= resolution.z;
+    return physical;
+  }
+
+  // Where PhysicalVoxel(logical) is stored in array.
+  __inline__ __device__
+  int3 StorageIndex(int3 logical) const {
+    int3 p = PhysicalVoxel(logical);
+    if (layout == VoxelLayout::LINEAR) {
+      return p;
+    }
+    const int kSize = kStorageBrickSize;
+    int num_bricks_x = (resolution.x + kSize - 1) / kSize;
+    return{
+      p.x % kSize + kSize * (p.y % kSize + kSize * (p.z % kSize)),
+      p.x / kSize + num_bricks_x * (p.y / kSize),
+      p.z / kSize
+    };
+  }
+
+  __inline__ __device__
+  T& operator [] (int3 logical) const {
+    KernelArray3D<T> a = array;
+    return a[StorageIndex(logical)];
+  }
+#endif
+};
+
+#endif  // ROLLING_GRID_VIEW_H
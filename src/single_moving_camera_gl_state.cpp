@@ -13,11 +13,20 @@
 // limitations under the License.
 #include "single_moving_camera_gl_state.h"
 
+#include <mutex>
+
+#include <cuda_runtime.h>
+#include <QTimer>
+
 #include "libcgt/core/common/ArrayUtils.h"
+#include "libcgt/core/vecmath/EuclideanTransform.h"
 
 #include "regular_grid_fusion_pipeline.h"
+#include "trace.h"
 
 using libcgt::core::arrayutils::copy;
+using libcgt::core::cameras::Intrinsics;
+using libcgt::core::vecmath::inverse;
 using libcgt::cuda::gl::Texture2D;
 
 namespace {
@@ -53,7 +62,35 @@ const std::string kVisualizeTexcoordsFSSrc =
 
 const bool kDrawUnprojectedPointCloud = true;
 const bool kDrawFullscreenRaycast = true;
+// Resolution divisor of the fullscreen raycast while the free camera moves.
 const int kFullscreenRaycastDownsampleFactor = 4;
+// The fullscreen raycast is refined to full resolution once the free camera
+// has been still this long.
+const int kFullscreenRaycastRefineDelayMs = 200;
+// When the pipeline is busy with a frame on the processing thread, Render()
+// draws what it already has and tries again after this long.
+const int kPipelineBusyRetryDelayMs = 5;
+
+// A surface object for the (mapped) array, or 0 if it cannot have one, for
+// example when its texture was not registered for surface load/store.
+cudaSurfaceObject_t CreateSurface(cudaArray_t array) {
+  cudaResourceDesc res_desc = {};
+  res_desc.resType = cudaResourceTypeArray;
+  res_desc.res.array.array = array;
+  cudaSurfaceObject_t surface = 0;
+  if (cudaCreateSurfaceObject(&surface, &res_desc) != cudaSuccess) {
+    // Clear the error so that it is not reported by a later call.
+    cudaGetLastError();
+    return 0;
+  }
+  return surface;
+}
+
+void DestroySurface(cudaSurfaceObject_t surface) {
+  if (surface != 0) {
+    cudaDestroySurfaceObject(surface);
+  }
+}
 }  // namespace
 
 SingleMovingCameraGLState::SingleMovingCameraGLState(
@@ -65,8 +102,10 @@ SingleMovingCameraGLState::SingleMovingCameraGLState(
     GLImageInternalFormat::RGB8),
   color_tracking_vis_texture_(pipeline->GetCameraParameters().color.resolution,
     GLImageInternalFormat::RGB8),
-  depth_texture_(pipeline->GetCameraParameters().depth.resolution,
-    GLImageInternalFormat::R32F),
+  depth_texture_(
+    GLTexture2D(pipeline->GetCameraParameters().depth.resolution,
+      GLImageInternalFormat::R32F),
+    libcgt::cuda::gl::Texture2D::MapFlags::WRITE_DISCARD),
   smoothed_depth_tex_(
     GLTexture2D(pipeline->GetCameraParameters().depth.resolution,
       GLImageInternalFormat::R32F),
@@ -94,6 +133,7 @@ SingleMovingCameraGLState::SingleMovingCameraGLState(
     GLTexture2D(pipeline->GetCameraParameters().depth.resolution,
       GLImageInternalFormat::RGBA32F),
     Texture2D::MapFlags::WRITE_DISCARD),
+  free_camera_raycast_(kFullscreenRaycastDownsampleFactor),
   cube_fiducial_(pipeline_->GetArucoCubeFiducial()) {
   LoadShaders();
 
@@ -117,7 +157,7 @@ SingleMovingCameraGLState::SingleMovingCameraGLState(
   	}
   }
 
-  depth_texture_.setSwizzleRGBAlpha(GLTexture::SwizzleTarget::RED);
+  depth_texture_.texture().setSwizzleRGBAlpha(GLTexture::SwizzleTarget::RED);
   smoothed_depth_tex_.texture().setSwizzleRGBAlpha(
     GLTexture::SwizzleTarget::RED);
 
@@ -129,10 +169,9 @@ SingleMovingCameraGLState::SingleMovingCameraGLState(
 }
 
 void SingleMovingCameraGLState::OnPipelineDataChanged(PipelineDataType type) {
-  // HACK: we use |= instead of = here.
-  // The app is stupidly threaded and there may be multiple signals arriving
-  // before a single paint. As a hack, we OR them together to bundle the
-  // update.
+  // Several frames may be processed between two paints, and Render() may
+  // have to postpone copying data while the pipeline is busy. OR the changes
+  // together so that none are lost.
   changed_pipeline_data_type_ |= type;
   if (changed_pipeline_data_type_ != PipelineDataType::NONE) {
     parent_->update();
@@ -140,23 +179,17 @@ void SingleMovingCameraGLState::OnPipelineDataChanged(PipelineDataType type) {
 }
 
 void SingleMovingCameraGLState::Resize(const Vector2i& size) {
-  free_camera_world_positions_.resize(
-    size / kFullscreenRaycastDownsampleFactor);
-  free_camera_world_normals_.resize(
-    size / kFullscreenRaycastDownsampleFactor);
-
-  Vector2i downsampled_size = size / kFullscreenRaycastDownsampleFactor;
-  free_camera_world_positions_.resize(downsampled_size);
-  free_camera_world_normals_.resize(downsampled_size);
+  free_camera_raycast_.Resize(size);
+  free_camera_raycast_refined_ = false;
 
   free_camera_world_positions_tex_ =
     libcgt::cuda::gl::Texture2D(
-      GLTexture2D(downsampled_size, GLImageInternalFormat::RGBA32F),
+      GLTexture2D(size, GLImageInternalFormat::RGBA32F),
       libcgt::cuda::gl::Texture2D::MapFlags::WRITE_DISCARD
     );
   free_camera_world_normals_tex_ =
     libcgt::cuda::gl::Texture2D(
-      GLTexture2D(downsampled_size, GLImageInternalFormat::RGBA32F),
+      GLTexture2D(size, GLImageInternalFormat::RGBA32F),
       libcgt::cuda::gl::Texture2D::MapFlags::WRITE_DISCARD
     );
 }
@@ -166,58 +199,86 @@ void SingleMovingCameraGLState::Render(const PerspectiveCamera& free_camera) {
     return;
   }
 
-  bool camera_moved = false;
+  auto now = std::chrono::steady_clock::now();
   if (free_camera != free_camera_) {
     free_camera_ = free_camera;
-    camera_moved = true;
+    free_camera_moved_ = true;
+    last_free_camera_motion_ = now;
   }
 
-  // Update buffers.
-  InputBuffer& input_buffer = pipeline_->GetInputBuffer();
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::INPUT_COLOR)) {
-    printf("Updating color input vis\n");
-    color_texture_.set(input_buffer.color_rgb);
+  // The pipeline may be processing a frame on another thread. Rather than
+  // stalling the GUI until it is done, draw what we already have and try
+  // again shortly. Changes stay pending in changed_pipeline_data_type_.
+  std::unique_lock<std::mutex> pipeline_lock(
+    pipeline_->VisualizationMutex(), std::try_to_lock);
+  if (!pipeline_lock.owns_lock() &&
+    (changed_pipeline_data_type_ != PipelineDataType::NONE ||
+     free_camera_moved_)) {
+    QTimer::singleShot(kPipelineBusyRetryDelayMs, parent_, SLOT(update()));
   }
 
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::POSE_ESTIMATION_VIS)) {
-    printf("Updating color pose estimation vis\n");
-    color_tracking_vis_texture_.set(
-      pipeline_->GetColorPoseEstimatorVisualization(),
-      GLImageFormat::BGR);
-  }
+  // Update buffers with the pipeline data that changed since the last
+  // Render() (see OnPipelineDataChanged()).
+  if (pipeline_lock.owns_lock()) {
+    ScopedTraceRange trace("SingleMovingCameraGLState: copy pipeline data",
+      TraceCategory::DISPLAY);
+    PinnedInputBuffer& input_buffer = pipeline_->GetInputBuffer();
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::INPUT_COLOR)) {
+      printf("Updating color input vis\n");
+      color_texture_.set(input_buffer.color_rgb);
+    }
 
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::INPUT_DEPTH)) {
-    depth_texture_.set(input_buffer.depth_meters);
-  }
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::POSE_ESTIMATION_VIS)) {
+      printf("Updating color pose estimation vis\n");
+      color_tracking_vis_texture_.set(
+        pipeline_->GetColorPoseEstimatorVisualization(),
+        GLImageFormat::BGR);
+    }
 
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::SMOOTHED_DEPTH)) {
-    auto mr0 = smoothed_depth_tex_.map();
-    copy(pipeline_->SmoothedDepthMeters(), mr0.array());
-    auto mr1 = smoothed_incoming_normals_tex_.map();
-    copy(pipeline_->SmoothedIncomingNormals(), mr1.array());
-  }
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::INPUT_DEPTH)) {
+      auto mr = depth_texture_.map();
+      copy(pipeline_->DepthMeters(), mr.array());
+    }
 
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::CAMERA_POSE)) {
-    {
-      auto mr = pose_estimation_vis_tex_.map();
-      copy(pipeline_->PoseEstimationVisualization(), mr.array());
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::SMOOTHED_DEPTH)) {
+      auto mr0 = smoothed_depth_tex_.map();
+      copy(pipeline_->SmoothedDepthMeters(), mr0.array());
+      auto mr1 = smoothed_incoming_normals_tex_.map();
+      copy(pipeline_->SmoothedIncomingNormals(), mr1.array());
     }
 
-    tracked_rgb_camera_.updatePositions(
-      pipeline_->ColorCamera());
-    tracked_depth_camera_.updatePositions(
-      pipeline_->DepthCamera());
-  }
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::CAMERA_POSE)) {
+      {
+        auto mr = pose_estimation_vis_tex_.map();
+        copy(pipeline_->PoseEstimationVisualization(), mr.array());
+      }
+
+      tracked_rgb_camera_.updatePositions(
+        pipeline_->ColorCamera());
+      tracked_depth_camera_.updatePositions(
+        pipeline_->DepthCamera());
+      depth_world_from_camera_ =
+        pipeline_->DepthCamera().worldFromCamera().asMatrix();
+    }
 
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::RAYCAST_NORMALS)) {
-    auto mr = raycasted_normals_tex_.map();
-    copy(pipeline_->RaycastNormals(), mr.array());
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::RAYCAST_NORMALS)) {
+      auto mr = raycasted_normals_tex_.map();
+      copy(pipeline_->RaycastNormals(), mr.array());
+    }
+
+    // The volume moves with the camera when it rolls.
+    if (notZero(changed_pipeline_data_type_ & PipelineDataType::TSDF)) {
+      tsdf_bbox_.updatePositions(
+        pipeline_->TSDFGridBoundingBox(),
+        pipeline_->TSDFWorldFromGridTransform().asMatrix()
+      );
+    }
   }
 
   DrawInputsAndIntermediates();
@@ -228,14 +289,40 @@ void SingleMovingCameraGLState::Render(const PerspectiveCamera& free_camera) {
   }
   DrawCameraFrustaAndTSDFGrid();
 
-  if (kDrawFullscreenRaycast) {
-    if (camera_moved ||
-      notZero(changed_pipeline_data_type_ & PipelineDataType::TSDF)) {
-      DrawFullscreenRaycast();
+  // Raycasting reads the volume, so it also waits for the pipeline.
+  if (kDrawFullscreenRaycast && pipeline_lock.owns_lock()) {
+    bool tsdf_changed =
+      notZero(changed_pipeline_data_type_ & PipelineDataType::TSDF);
+    if (tsdf_changed) {
+      last_volume_change_ = now;
+      free_camera_raycast_refined_ = false;
+    }
+    // While fusing, the volume changes every frame: only refine once both
+    // the camera and the volume have settled.
+    const auto refine_delay =
+      std::chrono::milliseconds(kFullscreenRaycastRefineDelayMs);
+    bool idle = now - last_free_camera_motion_ >= refine_delay &&
+      now - last_volume_change_ >= refine_delay;
+
+    if (idle) {
+      if (!free_camera_raycast_refined_) {
+        RaycastFreeCamera(true);
+      }
+    } else if (free_camera_moved_ || tsdf_changed) {
+      RaycastFreeCamera(false);
+      // Repaint once the camera and volume have settled to refine.
+      QTimer::singleShot(kFullscreenRaycastRefineDelayMs, parent_,
+        SLOT(update()));
     }
+    free_camera_moved_ = false;
+  }
+  if (kDrawFullscreenRaycast) {
+    DrawFullscreenRaycast();
   }
 
-  changed_pipeline_data_type_ = PipelineDataType::NONE;
+  if (pipeline_lock.owns_lock()) {
+    changed_pipeline_data_type_ = PipelineDataType::NONE;
+  }
 }
 
 void SingleMovingCameraGLState::LoadShaders() {
@@ -336,15 +423,15 @@ void SingleMovingCameraGLState::DrawUnprojectedPointCloud() {
   vs->setUniformVector2f(kDepthCameraRangeMinMaxLocation,
     pipeline_->GetCameraParameters().depth.depth_range.leftRight());
   vs->setUniformMatrix4f(kDepthWorldFromCameraLocation,
-    pipeline_->DepthCamera().worldFromCamera().asMatrix());
+    depth_world_from_camera_);
 
-  depth_texture_.bind(kDepthTextureUnit);
+  depth_texture_.texture().bind(kDepthTextureUnit);
   nearest_sampler_.bind(kDepthTextureUnit);
   vs->setUniformInt(kDepthTextureLocation, kDepthTextureUnit);
 
   xy_coords_.draw();
 
-  depth_texture_.unbind(kDepthTextureUnit);
+  depth_texture_.texture().unbind(kDepthTextureUnit);
   GLSamplerObject::unbind(kDepthTextureUnit);
   color_texture_.unbind(kColorTextureUnit);
   GLSamplerObject::unbind(kColorTextureUnit);
@@ -365,19 +452,47 @@ Matrix4f normalsToRGBA() {
 
 }
 
-void SingleMovingCameraGLState::DrawFullscreenRaycast() {
-  // Update the buffer.
-  pipeline_->Raycast(free_camera_,
-    free_camera_world_positions_, free_camera_world_normals_);
-  {
-    auto mr = free_camera_world_positions_tex_.map();
-    copy(free_camera_world_positions_, mr.array());
+void SingleMovingCameraGLState::RaycastFreeCamera(bool full_resolution) {
+  // Map the textures first so that the raycast can write straight into them.
+  auto positions_mr = free_camera_world_positions_tex_.map();
+  auto normals_mr = free_camera_world_normals_tex_.map();
+  cudaSurfaceObject_t positions_surface = CreateSurface(positions_mr.array());
+  cudaSurfaceObject_t normals_surface = CreateSurface(normals_mr.array());
+  bool wrote_textures = positions_surface != 0 && normals_surface != 0;
+  if (!wrote_textures) {
+    DestroySurface(positions_surface);
+    DestroySurface(normals_surface);
+    positions_surface = 0;
+    normals_surface = 0;
   }
-  {
-    auto mr = free_camera_world_normals_tex_.map();
-    copy(free_camera_world_normals_, mr.array());
+
+  if (full_resolution) {
+    wrote_textures = pipeline_->RaycastToSurfaces(free_camera_,
+      free_camera_raycast_.WorldPoints(), free_camera_raycast_.WorldNormals(),
+      positions_surface, normals_surface) && wrote_textures;
+  } else {
+    pipeline_->Raycast(free_camera_, free_camera_raycast_.CoarseWorldPoints(),
+      free_camera_raycast_.CoarseWorldNormals());
+    Intrinsics intrinsics =
+      free_camera_.intrinsics(Vector2f(free_camera_raycast_.Size()));
+    free_camera_raycast_.ComposeCoarse(
+      { intrinsics.focalLength, intrinsics.principalPoint },
+      inverse(free_camera_.worldFromCamera()).asMatrix(),
+      positions_surface, normals_surface);
   }
+  free_camera_raycast_refined_ = full_resolution;
 
+  if (!wrote_textures) {
+    copy(free_camera_raycast_.WorldPoints(), positions_mr.array());
+    copy(free_camera_raycast_.WorldNormals(), normals_mr.array());
+  }
+  // The kernels must finish with the surfaces before they are destroyed.
+  cudaStreamSynchronize(0);
+  DestroySurface(positions_surface);
+  DestroySurface(normals_surface);
+}
+
+void SingleMovingCameraGLState::DrawFullscreenRaycast() {
   glDisable(GL_DEPTH_TEST);
   glEnable(GL_BLEND);
 
@@ -464,7 +579,7 @@ void SingleMovingCameraGLState::DrawInputsAndIntermediates() {
 
   textures.push_back(
     RemappedTexture{
-      &depth_texture_,
+      &depth_texture_.texture(),
       Vector2f{ 0.5f, 0.5f },
       depth_rescale_matrix
     }
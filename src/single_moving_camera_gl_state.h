@@ -14,6 +14,7 @@
 #pragma once
 // TODO: use include guard
 
+#include <chrono>
 #include <memory>
 #include <unordered_map>
 
@@ -37,6 +38,7 @@
 #include "libcgt/GL/GL_45/drawables/WireframeBox.h"
 
 #include "pipeline_data_type.h"
+#include "progressive_raycast.h"
 #include "aruco/cube_fiducial.h"
 
 class RegularGridFusionPipeline;
@@ -71,6 +73,9 @@ class SingleMovingCameraGLState : public QObject {
   void DrawWorldAxes();
   void DrawCubeFiducial();
   void DrawUnprojectedPointCloud();
+  // Raycasts the free camera at full resolution if full_resolution is true,
+  // else at reduced resolution composited with the previous result.
+  void RaycastFreeCamera(bool full_resolution);
   void DrawFullscreenRaycast();
   void DrawCameraFrustaAndTSDFGrid();
   void DrawInputsAndIntermediates();
@@ -80,7 +85,18 @@ class SingleMovingCameraGLState : public QObject {
   QOpenGLWidget* parent_ = nullptr;
   RegularGridFusionPipeline* pipeline_ = nullptr;
   PipelineDataType changed_pipeline_data_type_ = PipelineDataType::NONE;
+  // Copy of the pipeline's latest depth camera pose, taken with the other
+  // pipeline data so that drawing does not need to lock the pipeline.
+  Matrix4f depth_world_from_camera_ = Matrix4f::identity();
   PerspectiveCamera free_camera_;
+  std::chrono::steady_clock::time_point last_free_camera_motion_;
+  // When a Render() last saw the volume change.
+  std::chrono::steady_clock::time_point last_volume_change_;
+  // Whether the free camera moved since it was last raycast.
+  bool free_camera_moved_ = false;
+  // Whether the free camera raycast is at full resolution for the current
+  // free camera and volume.
+  bool free_camera_raycast_refined_ = false;
 
   // ----- Drawables -----
   Axes world_axes_;
@@ -94,8 +110,10 @@ class SingleMovingCameraGLState : public QObject {
   GLTexture2D color_texture_;
   GLTexture2D color_tracking_vis_texture_;
 
-  // TODO: can interop depth_texture. Then, can use undistorted version.
-  GLTexture2D depth_texture_;  // Float depth in meters.
+  // Float depth in meters, copied from the pipeline's device buffer, so that
+  // raw input depth is only ever converted on the GPU.
+  // TODO: can use undistorted version.
+  libcgt::cuda::gl::Texture2D depth_texture_;
   libcgt::cuda::gl::Texture2D smoothed_depth_tex_;
   libcgt::cuda::gl::Texture2D smoothed_incoming_normals_tex_;
   libcgt::cuda::gl::Texture2D pose_estimation_vis_tex_;
@@ -103,9 +121,10 @@ class SingleMovingCameraGLState : public QObject {
   // Raycasting from the current viewpoint.
   libcgt::cuda::gl::Texture2D raycasted_normals_tex_;
 
-  // Raycasting from the current camera pose, resized as the view changes.
-  DeviceArray2D<float4> free_camera_world_positions_;
-  DeviceArray2D<float4> free_camera_world_normals_;
+  // Raycasting from the free camera, resized as the view changes. Reduced
+  // resolution while the camera moves or the volume changes, full
+  // resolution once both have been idle for a while.
+  ProgressiveRaycast free_camera_raycast_;
   libcgt::cuda::gl::Texture2D free_camera_world_positions_tex_;
   libcgt::cuda::gl::Texture2D free_camera_world_normals_tex_;
 
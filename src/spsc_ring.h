@@ -0,0 +1,115 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+
+// A bounded, lock-free queue between one producer thread and one consumer
+// thread. T must be trivially copyable (e.g. a pointer).
+//
+// Besides the usual TryPush() and TryPop(), the producer can PushOverwrite():
+// when the ring is full, it removes the oldest element itself to make room.
+// To allow that, the consumer claims elements with a compare-and-swap on the
+// read index instead of a plain store.
+template <typename T>
+class SpscRing {
+ public:
+
+  explicit SpscRing(int capacity) :
+    capacity_(capacity),
+    slots_(new std::atomic<T>[capacity]) {
+    assert(capacity > 0);
+  }
+
+  SpscRing(const SpscRing& copy) = delete;
+  SpscRing& operator = (const SpscRing& copy) = delete;
+
+  int Capacity() const {
+    return static_cast<int>(capacity_);
+  }
+
+  // Exact from either thread when the other one is idle, approximate
+  // otherwise.
+  int Size() const {
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    uint64_t head = head_.load(std::memory_order_acquire);
+    return static_cast<int>(head - tail);
+  }
+
+  // Producer only. Returns false, and does nothing, if the ring is full.
+  bool TryPush(const T& value) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= capacity_) {
+      return false;
+    }
+    slots_[head % capacity_].store(value, std::memory_order_relaxed);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Producer only. Always pushes value. If the ring was full, the oldest
+  // element is removed first and written to dropped, and this returns true.
+  bool PushOverwrite(const T& value, T* dropped) {
+    bool did_drop = false;
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    while (head - tail >= capacity_) {
+      T oldest = slots_[tail % capacity_].load(std::memory_order_relaxed);
+      // On failure, the consumer popped (or the exchange failed spuriously)
+      // and tail is reloaded.
+      if (tail_.compare_exchange_weak(tail, tail + 1,
+        std::memory_order_acq_rel, std::memory_order_acquire)) {
+        *dropped = oldest;
+        did_drop = true;
+        break;
+      }
+    }
+    slots_[head % capacity_].store(value, std::memory_order_relaxed);
+    head_.store(head + 1, std::memory_order_release);
+    return did_drop;
+  }
+
+  // Consumer only. Returns false, and leaves value untouched, if the ring is
+  // empty.
+  bool TryPop(T* value) {
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    while (tail != head_.load(std::memory_order_acquire)) {
+      T oldest = slots_[tail % capacity_].load(std::memory_order_relaxed);
+      // On failure, the producer dropped this element (or the exchange failed
+      // spuriously) and tail is reloaded.
+      if (tail_.compare_exchange_weak(tail, tail + 1,
+        std::memory_order_acq_rel, std::memory_order_acquire)) {
+        *value = oldest;
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+
+  const uint64_t capacity_;
+  std::unique_ptr<std::atomic<T>[]> slots_;
+
+  // Monotonically increasing: the element at index i lives in
+  // slots_[i % capacity_]. Only the producer writes head_.
+  std::atomic<uint64_t> head_{ 0 };
+  std::atomic<uint64_t> tail_{ 0 };
+};
+
+#endif  // SPSC_RING_H
@@ -0,0 +1,114 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "stream_graph.h"
+
+#include <cstdio>
+
+#include "perf_collector.h"
+
+StreamGraph::StreamGraph(bool enabled) :
+  enabled_(enabled) {
+}
+
+StreamGraph::~StreamGraph() {
+  if (exec_ != nullptr) {
+    cudaGraphExecDestroy(exec_);
+  }
+}
+
+bool StreamGraph::IsCapturing(cudaStream_t stream) const {
+  return enabled_ && stream != 0 && !PerfCollector::Enabled();
+}
+
+void StreamGraph::Run(cudaStream_t stream,
+  const std::function<void()>& enqueue,
+  const std::function<void()>& discard) {
+  if (!IsCapturing(stream)) {
+    enqueue();
+    return;
+  }
+
+  // Relaxed, so that buffers allocated on first use (e.g. from
+  // DeviceArrayPool) do not break the capture.
+  cudaGraph_t graph = nullptr;
+  cudaStreamBeginCapture(stream, cudaStreamCaptureModeRelaxed);
+  enqueue();
+  cudaError_t status = cudaStreamEndCapture(stream, &graph);
+
+  const char* failed_call = "cudaStreamEndCapture";
+  if (status == cudaSuccess && graph == nullptr) {
+    status = cudaErrorStreamCaptureInvalidated;
+  }
+  if (status == cudaSuccess) {
+    failed_call = "cudaGraphInstantiate";
+    status = Update(graph);
+  }
+  if (status == cudaSuccess) {
+    failed_call = "cudaGraphLaunch";
+    status = cudaGraphLaunch(exec_, stream);
+  }
+  if (graph != nullptr) {
+    cudaGraphDestroy(graph);
+  }
+
+  if (status != cudaSuccess) {
+    // Nothing was enqueued: clear the error, let the caller undo what the
+    // discarded callback did on the host, and do the work directly.
+    fprintf(stderr, "StreamGraph: %s failed (%s), running the work "
+      "without CUDA graphs from now on.\n", failed_call,
+      cudaGetErrorString(status));
+    cudaGetLastError();
+    enabled_ = false;
+    if (discard) {
+      discard();
+    }
+    enqueue();
+    return;
+  }
+  PerfCollector::Get().IncrementCounter("stream_graph.launched");
+}
+
+cudaError_t StreamGraph::Update(cudaGraph_t graph) {
+  if (exec_ != nullptr) {
+#if CUDART_VERSION >= 12000
+    cudaGraphExecUpdateResultInfo info;
+    cudaError_t status = cudaGraphExecUpdate(exec_, graph, &info);
+#else
+    cudaGraphNode_t error_node = nullptr;
+    cudaGraphExecUpdateResult result;
+    cudaError_t status = cudaGraphExecUpdate(exec_, graph, &error_node,
+      &result);
+#endif
+    if (status == cudaSuccess) {
+      return cudaSuccess;
+    }
+    // The topology changed, e.g. a raycast that became adaptive or a volume
+    // that moved. Clear the error and instantiate again.
+    cudaGetLastError();
+    PerfCollector::Get().IncrementCounter("stream_graph.reinstantiated");
+    cudaGraphExecDestroy(exec_);
+    exec_ = nullptr;
+  }
+
+#if CUDART_VERSION >= 12000
+  cudaError_t status = cudaGraphInstantiate(&exec_, graph, 0);
+#else
+  cudaError_t status = cudaGraphInstantiate(&exec_, graph, nullptr, nullptr,
+    0);
+#endif
+  if (status != cudaSuccess) {
+    exec_ = nullptr;
+  }
+  return status;
+}
@@ -0,0 +1,68 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef STREAM_GRAPH_H
+#define STREAM_GRAPH_H
+
+#include <functional>
+
+#include <cuda_runtime.h>
+
+// Replays the work that a callback enqueues on a stream as one CUDA graph.
+//
+// Run() captures the callback's work every time, then updates the executable
+// graph instantiated from an earlier capture in place (cudaGraphExecUpdate).
+// That succeeds as long as the same kernels are launched in the same order,
+// with only their parameters (poses, intrinsics, buffers) changed, and is much
+// cheaper than launching each kernel from the host. When the sequence
+// changes, the graph is instantiated again.
+//
+// The callback must only enqueue work on stream: no synchronization, no
+// readback to the host and no work on the legacy default stream. Waits for
+// and records of events used by other streams belong outside of it. If the
+// capture, instantiation or launch fails anyway, the captured work is
+// discarded, discard (if set) is called to undo whatever the callback changed
+// on the host, the callback is run again without capture, and the
+// StreamGraph stops capturing from then on.
+//
+// Per-stage GPU timers cannot be captured: with --collect_perf, Run() calls
+// the callback directly.
+class StreamGraph {
+ public:
+
+  // When enabled is false, Run() just calls the callback.
+  explicit StreamGraph(bool enabled = false);
+  ~StreamGraph();
+
+  StreamGraph(const StreamGraph& copy) = delete;
+  StreamGraph& operator = (const StreamGraph& copy) = delete;
+
+  // Whether Run() currently captures. Always false on the legacy default
+  // stream, which cannot be captured.
+  bool IsCapturing(cudaStream_t stream) const;
+
+  void Run(cudaStream_t stream, const std::function<void()>& enqueue,
+    const std::function<void()>& discard = nullptr);
+
+ private:
+
+  // Updates exec_ with graph, or replaces it with a new instantiation.
+  // Returns the error from cudaGraphInstantiate if graph cannot be
+  // instantiated.
+  cudaError_t Update(cudaGraph_t graph);
+
+  bool enabled_;
+  cudaGraphExec_t exec_ = nullptr;
+};
+
+#endif  // STREAM_GRAPH_H
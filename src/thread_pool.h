@@ -0,0 +1,56 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that run submitted tasks in FIFO order. Useful to
+// take blocking work, such as writing files, off a thread that feeds the GPU.
+class ThreadPool {
+ public:
+
+  // num_threads <= 0 uses one thread per hardware thread.
+  explicit ThreadPool(int num_threads);
+  // Finishes the tasks already submitted, then joins the threads.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool& copy) = delete;
+  ThreadPool& operator = (const ThreadPool& copy) = delete;
+
+  // Queues task. The returned future becomes ready once it has run.
+  std::future<void> Submit(std::function<void()> task);
+
+  int NumThreads() const;
+
+ private:
+
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Guarded by mutex_.
+  std::deque<std::packaged_task<void()>> tasks_;
+  bool stopped_ = false;
+
+  std::vector<std::thread> threads_;
+};
+
+#endif  // THREAD_POOL_H
@@ -0,0 +1,178 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#ifdef DEPTH_FUSION_NVTX
+#include <nvToolsExt.h>
+#endif
+
+namespace {
+
+struct TraceFrame {
+  int frame_index = -1;
+  int64_t timestamp_ns = 0;
+};
+
+thread_local TraceFrame current_frame;
+
+#ifdef DEPTH_FUSION_NVTX
+// ARGB, one per TraceCategory.
+const uint32_t kCategoryColors[] = {
+  0xff4e79a7,  // INPUT: blue.
+  0xfff28e2b,  // UPLOAD: orange.
+  0xff59a14f,  // DEPTH_PROCESSING: green.
+  0xffe15759,  // POSE_ESTIMATION: red.
+  0xffb07aa1,  // VOLUME: purple.
+  0xff9c755f   // DISPLAY: brown.
+};
+#endif
+
+}  // namespace
+
+const char* TraceCategoryName(TraceCategory category) {
+  switch (category) {
+    case TraceCategory::INPUT:
+      return "input";
+    case TraceCategory::UPLOAD:
+      return "upload";
+    case TraceCategory::DEPTH_PROCESSING:
+      return "depth_processing";
+    case TraceCategory::POSE_ESTIMATION:
+      return "pose_estimation";
+    case TraceCategory::VOLUME:
+      return "volume";
+    case TraceCategory::DISPLAY:
+      return "display";
+  }
+  return "unknown";
+}
+
+void SetTraceFrame(int frame_index, int64_t timestamp_ns) {
+  current_frame.frame_index = frame_index;
+  current_frame.timestamp_ns = timestamp_ns;
+}
+
+ScopedTraceRange::ScopedTraceRange(const char* name,
+  TraceCategory category) :
+  name_(name),
+  category_(category),
+  frame_index_(current_frame.frame_index),
+  timestamp_ns_(current_frame.timestamp_ns),
+  recording_(TraceRecorder::Get().IsRecording()) {
+#ifdef DEPTH_FUSION_NVTX
+  char message[128];
+  nvtxEventAttributes_t attributes = {};
+  attributes.version = NVTX_VERSION;
+  attributes.size = NVTX_EVENT_ATTRIB_STRUCT_SIZE;
+  attributes.category = static_cast<uint32_t>(category);
+  attributes.colorType = NVTX_COLOR_ARGB;
+  attributes.color = kCategoryColors[static_cast<int>(category)];
+  attributes.messageType = NVTX_MESSAGE_TYPE_ASCII;
+  if (frame_index_ >= 0) {
+    snprintf(message, sizeof(message), "%s #%d", name, frame_index_);
+    attributes.message.ascii = message;
+    attributes.payloadType = NVTX_PAYLOAD_TYPE_INT64;
+    attributes.payload.llValue = timestamp_ns_;
+  } else {
+    attributes.message.ascii = name;
+  }
+  nvtxRangePushEx(&attributes);
+#endif
+  if (recording_) {
+    start_ = std::chrono::steady_clock::now();
+  }
+}
+
+ScopedTraceRange::~ScopedTraceRange() {
+  if (recording_) {
+    TraceRecorder::Get().AddSpan(name_, category_, frame_index_,
+      timestamp_ns_, start_, std::chrono::steady_clock::now());
+  }
+#ifdef DEPTH_FUSION_NVTX
+  nvtxRangePop();
+#endif
+}
+
+// static
+TraceRecorder& TraceRecorder::Get() {
+  static TraceRecorder recorder;
+  return recorder;
+}
+
+void TraceRecorder::Start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (spans_.empty() && threads_.empty()) {
+    epoch_ = std::chrono::steady_clock::now();
+  }
+  recording_ = true;
+}
+
+bool TraceRecorder::IsRecording() const {
+  return recording_;
+}
+
+bool TraceRecorder::Write(const std::string& filename) {
+  std::vector<Span> spans;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    spans = spans_;
+  }
+  // Viewers want spans on a thread sorted by start time.
+  std::sort(spans.begin(), spans.end(),
+    [](const Span& a, const Span& b) { return a.start_us < b.start_us; });
+
+  FILE* fp = fopen(filename.c_str(), "w");
+  if (fp == nullptr) {
+    return false;
+  }
+  // Names are literals: nothing to escape.
+  fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for (size_t i = 0; i < spans.size(); ++i) {
+    const Span& s = spans[i];
+    fprintf(fp, "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+      "\"pid\": 0, \"tid\": %u, \"ts\": %lld, \"dur\": %lld",
+      i == 0 ? "" : ",", s.name, TraceCategoryName(s.category), s.thread,
+      static_cast<long long>(s.start_us),
+      static_cast<long long>(s.duration_us));
+    if (s.frame_index >= 0) {
+      fprintf(fp, ", \"args\": {\"frame_index\": %d, \"timestamp_ns\": %lld}",
+        s.frame_index, static_cast<long long>(s.timestamp_ns));
+    }
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n]}\n");
+  return fclose(fp) == 0;
+}
+
+void TraceRecorder::AddSpan(const char* name, TraceCategory category,
+  int frame_index, int64_t timestamp_ns,
+  std::chrono::steady_clock::time_point start,
+  std::chrono::steady_clock::time_point end) {
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+
+  std::thread::id id = std::this_thread::get_id();
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr = std::find(threads_.begin(), threads_.end(), id);
+  uint32_t thread = static_cast<uint32_t>(itr - threads_.begin());
+  if (itr == threads_.end()) {
+    threads_.push_back(id);
+  }
+  spans_.push_back({ name, category, frame_index, timestamp_ns, thread,
+    duration_cast<microseconds>(start - epoch_).count(),
+    duration_cast<microseconds>(end - start).count() });
+}
@@ -0,0 +1,122 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The subsystems that trace ranges are grouped and colored by.
+enum class TraceCategory {
+  // Reading frames and converting them on the host.
+  INPUT,
+  // Host to device copies.
+  UPLOAD,
+  // DepthProcessor.
+  DEPTH_PROCESSING,
+  // ICP and color pose estimation.
+  POSE_ESTIMATION,
+  // Fusion, raycasting and meshing.
+  VOLUME,
+  // Copies to and drawing with OpenGL.
+  DISPLAY
+};
+
+const char* TraceCategoryName(TraceCategory category);
+
+// Sets the frame that trace ranges subsequently opened on the calling thread
+// are attributed to. frame_index < 0 means none.
+void SetTraceFrame(int frame_index, int64_t timestamp_ns);
+
+// Marks the lifetime of a scope on a timeline, as:
+// - An NVTX range, when built with DEPTH_FUSION_NVTX, so that Nsight shows it
+//   next to the kernels it launches. Ranges are colored by category. The
+//   message carries the frame index and the payload the frame timestamp (in
+//   ns), when a frame is set (see SetTraceFrame()).
+// - A Chrome trace_event span, when TraceRecorder is recording.
+class ScopedTraceRange {
+ public:
+
+  // name must outlive the range.
+  ScopedTraceRange(const char* name, TraceCategory category);
+  ~ScopedTraceRange();
+
+  ScopedTraceRange(const ScopedTraceRange& copy) = delete;
+  ScopedTraceRange& operator = (const ScopedTraceRange& copy) = delete;
+
+ private:
+
+  const char* name_;
+  TraceCategory category_;
+  int frame_index_;
+  int64_t timestamp_ns_;
+  bool recording_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Collects the host-side spans of ScopedTraceRange in memory and writes them
+// in the Chrome trace_event JSON format (chrome://tracing, Perfetto), for
+// machines without Nsight. Thread safe.
+class TraceRecorder {
+ public:
+
+  static TraceRecorder& Get();
+
+  TraceRecorder(const TraceRecorder& copy) = delete;
+  TraceRecorder& operator = (const TraceRecorder& copy) = delete;
+
+  // Starts recording. Timestamps are relative to the first call.
+  void Start();
+
+  bool IsRecording() const;
+
+  // Writes every span recorded so far. Returns false if the file cannot be
+  // written.
+  bool Write(const std::string& filename);
+
+ private:
+
+  friend class ScopedTraceRange;
+
+  struct Span {
+    const char* name;
+    TraceCategory category;
+    int frame_index;
+    int64_t timestamp_ns;
+    uint32_t thread;
+    int64_t start_us;
+    int64_t duration_us;
+  };
+
+  TraceRecorder() = default;
+
+  void AddSpan(const char* name, TraceCategory category, int frame_index,
+    int64_t timestamp_ns, std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end);
+
+  std::atomic<bool> recording_{ false };
+  std::chrono::steady_clock::time_point epoch_;
+
+  std::mutex mutex_;
+  std::vector<Span> spans_;
+  // Small, stable ids for the threads seen so far.
+  std::vector<std::thread::id> threads_;
+};
+
+#endif  // TRACE_H
@@ -16,22 +16,141 @@
 
 #include <vector_types.h>
 
-class TSDF {
+// Voxel encodings of a truncated signed distance and its weight. They share
+// one interface, so the fuse and raycast kernels are templates over the
+// encoding and instantiated for each of them (see TSDF_FOR_EACH_ENCODING).
+//
+// Distances are in [-max_tsdf_value, max_tsdf_value]. A voxel with zero
+// weight is unobserved.
+//
+// TSDF, the encoding used by the volumes, is selected at compile time by
+// defining one of TSDF_ENCODING_D16_W16 (the default), TSDF_ENCODING_D16_W8_C8,
+// TSDF_ENCODING_D8_W8 or TSDF_ENCODING_FLOAT (see TSDF_ENCODING in
+// CMakeLists.txt).
+
+// Identifies an encoding in files.
+enum class TSDFEncoding : int {
+  D16_W16 = 0,
+  D16_W8_C8 = 1,
+  D8_W8 = 2,
+  FLOAT = 3
+};
+
+// Implements Update() in terms of Get() and Set().
+template <typename Voxel>
+__inline__ __device__ __host__
+void UpdateVoxel(Voxel& voxel, float incoming_d, float incoming_w,
+  float max_tsdf_value);
+
+// 16-bit fixed point distance and 16-bit integer weight (4 bytes).
+class TSDF16 {
 public:
 
+  static constexpr TSDFEncoding kEncoding = TSDFEncoding::D16_W16;
+
   ushort2 encoded_ = ushort2{ 0, 0 };
 
   __inline__ __device__ __host__
-  TSDF() = default;
+  TSDF16() = default;
+
+  __inline__ __device__ __host__
+  TSDF16(float d, float w, float max_tsdf_value);
+
+  __inline__ __device__ __host__
+  TSDF16(const TSDF16& copy) = default;
+
+  __inline__ __device__ __host__
+  TSDF16& operator = (const TSDF16& copy) = default;
+
+  __inline__ __device__ __host__
+  float2 Get(float max_tsdf_value) const;
+
+  __inline__ __device__ __host__
+  float Distance(float max_tsdf_value) const;
+
+  // Distance() remapped from [-max_tsdf_value, max_tsdf_value] to [0, 1].
+  __inline__ __device__ __host__
+  float NormalizedDistance(float max_tsdf_value) const;
+
+  __inline__ __device__ __host__
+  float Weight() const;
+
+  __inline__ __device__ __host__
+  void Set(float d, float w, float max_tsdf_value);
+
+  __inline__ __device__ __host__
+  void Update(float incoming_d, float incoming_w, float max_tsdf_value);
+};
+
+// 16-bit fixed point distance, 8-bit integer weight (saturating at 255) and
+// an 8-bit color or label channel that fusion leaves untouched (4 bytes).
+class TSDF16Color {
+public:
+
+  static constexpr TSDFEncoding kEncoding = TSDFEncoding::D16_W8_C8;
+
+  // x: distance, y: weight in the low byte, color in the high byte.
+  ushort2 encoded_ = ushort2{ 0, 0 };
+
+  __inline__ __device__ __host__
+  TSDF16Color() = default;
+
+  __inline__ __device__ __host__
+  TSDF16Color(float d, float w, float max_tsdf_value);
+
+  __inline__ __device__ __host__
+  TSDF16Color(const TSDF16Color& copy) = default;
+
+  __inline__ __device__ __host__
+  TSDF16Color& operator = (const TSDF16Color& copy) = default;
+
+  __inline__ __device__ __host__
+  float2 Get(float max_tsdf_value) const;
+
+  __inline__ __device__ __host__
+  float Distance(float max_tsdf_value) const;
+
+  __inline__ __device__ __host__
+  float NormalizedDistance(float max_tsdf_value) const;
+
+  __inline__ __device__ __host__
+  float Weight() const;
+
+  __inline__ __device__ __host__
+  unsigned char Color() const;
+
+  __inline__ __device__ __host__
+  void SetColor(unsigned char color);
 
+  // Keeps the color.
   __inline__ __device__ __host__
-  TSDF(float d, float w, float max_tsdf_value);
+  void Set(float d, float w, float max_tsdf_value);
 
   __inline__ __device__ __host__
-  TSDF(const TSDF& copy) = default;
+  void Update(float incoming_d, float incoming_w, float max_tsdf_value);
+};
+
+// 8-bit fixed point distance and 8-bit integer weight, saturating at 255
+// (2 bytes). Halves the memory and bandwidth of TSDF16, at 1/128 of
+// max_tsdf_value of distance resolution.
+class TSDF8 {
+public:
+
+  static constexpr TSDFEncoding kEncoding = TSDFEncoding::D8_W8;
+
+  uchar2 encoded_ = uchar2{ 0, 0 };
 
   __inline__ __device__ __host__
-  TSDF& operator = (const TSDF& copy) = default;
+  TSDF8() = default;
+
+  __inline__ __device__ __host__
+  TSDF8(float d, float w, float max_tsdf_value);
+
+  __inline__ __device__ __host__
+  TSDF8(const TSDF8& copy) = default;
+
+  __inline__ __device__ __host__
+  TSDF8& operator = (const TSDF8& copy) = default;
 
   __inline__ __device__ __host__
   float2 Get(float max_tsdf_value) const;
@@ -39,6 +158,9 @@ public:
   __inline__ __device__ __host__
   float Distance(float max_tsdf_value) const;
 
+  __inline__ __device__ __host__
+  float NormalizedDistance(float max_tsdf_value) const;
+
   __inline__ __device__ __host__
   float Weight() const;
 
@@ -49,28 +171,123 @@ public:
   void Update(float incoming_d, float incoming_w, float max_tsdf_value);
 };
 
+// Unquantized float distance and weight (8 bytes), for reference runs.
+class TSDFFloat {
+public:
+
+  static constexpr TSDFEncoding kEncoding = TSDFEncoding::FLOAT;
+
+  // x: distance, y: weight.
+  float2 encoded_ = float2{ 0, 0 };
+
+  __inline__ __device__ __host__
+  TSDFFloat() = default;
+
+  __inline__ __device__ __host__
+  TSDFFloat(float d, float w, float max_tsdf_value);
+
+  __inline__ __device__ __host__
+  TSDFFloat(const TSDFFloat& copy) = default;
+
+  __inline__ __device__ __host__
+  TSDFFloat& operator = (const TSDFFloat& copy) = default;
+
+  __inline__ __device__ __host__
+  float2 Get(float max_tsdf_value) const;
+
+  __inline__ __device__ __host__
+  float Distance(float max_tsdf_value) const;
+
+  __inline__ __device__ __host__
+  float NormalizedDistance(float max_tsdf_value) const;
+
+  __inline__ __device__ __host__
+  float Weight() const;
+
+  __inline__ __device__ __host__
+  void Set(float d, float w, float max_tsdf_value);
+
+  __inline__ __device__ __host__
+  void Update(float incoming_d, float incoming_w, float max_tsdf_value);
+};
+
+// Calls X(Voxel) for every encoding, e.g. to explicitly instantiate kernels.
+#define TSDF_FOR_EACH_ENCODING(X) \
+  X(TSDF16) \
+  X(TSDF16Color) \
+  X(TSDF8) \
+  X(TSDFFloat)
+
+#if defined(TSDF_ENCODING_D16_W8_C8)
+using TSDF = TSDF16Color;
+#elif defined(TSDF_ENCODING_D8_W8)
+using TSDF = TSDF8;
+#elif defined(TSDF_ENCODING_FLOAT)
+using TSDF = TSDFFloat;
+#else
+using TSDF = TSDF16;
+#endif
+
+template <typename Voxel>
+__inline__ __device__ __host__
+void UpdateVoxel(Voxel& voxel, float incoming_d, float incoming_w,
+  float max_tsdf_value) {
+  float2 old_tsdf = voxel.Get(max_tsdf_value);
+  float old_d = old_tsdf.x;
+  float old_w = old_tsdf.y;
+
+  float new_w = old_w + incoming_w;
+  float new_d = (old_w * old_d + incoming_w * incoming_d) / new_w;
+
+  voxel.Set(new_d, new_w, max_tsdf_value);
+}
+
+// Quantizes d in [-max_tsdf_value, max_tsdf_value] to [0, max_code], rounding
+// to nearest.
 __inline__ __device__ __host__
-TSDF::TSDF(float d, float w, float max_tsdf_value) {
+unsigned int QuantizeDistance(float d, float max_tsdf_value,
+  unsigned int max_code) {
+  float t = (d + max_tsdf_value) / (2 * max_tsdf_value) * max_code + 0.5f;
+  t = t < 0 ? 0 : t;
+  return t > max_code ? max_code : static_cast<unsigned int>(t);
+}
+
+// Saturates w to [0, max_weight].
+__inline__ __device__ __host__
+unsigned int SaturateWeight(float w, unsigned int max_weight) {
+  return w >= max_weight ? max_weight :
+    w <= 0 ? 0 : static_cast<unsigned int>(w);
+}
+
+// --- TSDF16 ---
+
+__inline__ __device__ __host__
+TSDF16::TSDF16(float d, float w, float max_tsdf_value) {
   Set(d, w, max_tsdf_value);
 }
 
 __inline__ __device__ __host__
-float2 TSDF::Get(float max_tsdf_value) const {
+float2 TSDF16::Get(float max_tsdf_value) const {
   return{ Distance(max_tsdf_value), Weight() };
 }
 
 __inline__ __device__ __host__
-float TSDF::Distance(float max_tsdf_value) const {
+float TSDF16::Distance(float max_tsdf_value) const {
   return (2 * max_tsdf_value * (encoded_.x / 65535.f)) - max_tsdf_value;
 }
 
 __inline__ __device__ __host__
-float TSDF::Weight() const {
+float TSDF16::NormalizedDistance(float max_tsdf_value) const {
+  return encoded_.x / 65535.f;
+}
+
+__inline__ __device__ __host__
+float TSDF16::Weight() const {
   return static_cast<float>(encoded_.y);
 }
 
 __inline__ __device__ __host__
-void TSDF::Set(float d, float w, float max_tsdf_value) {
+void TSDF16::Set(float d, float w, float max_tsdf_value) {
   encoded_ = {
     static_cast<unsigned short>((d + max_tsdf_value) / (2 * max_tsdf_value) * 65535),
     static_cast<unsigned short>(w)
@@ -78,15 +295,177 @@ void TSDF::Set(float d, float w, float max_tsdf_value) {
 }
 
 __inline__ __device__ __host__
-void TSDF::Update(float incoming_d, float incoming_w, float max_tsdf_value) {
-  float2 old_tsdf = Get(max_tsdf_value);
-  float old_d = old_tsdf.x;
-  float old_w = old_tsdf.y;
+void TSDF16::Update(float incoming_d, float incoming_w, float max_tsdf_value) {
+  UpdateVoxel(*this, incoming_d, incoming_w, max_tsdf_value);
+}
 
-  float new_w = old_w + incoming_w;
-  float new_d = (old_w * old_d + incoming_w * incoming_d) / new_w;
+__inline__ __device__ __host__
+bool operator == (const TSDF16& a, const TSDF16& b) {
+  return a.encoded_.x == b.encoded_.x && a.encoded_.y == b.encoded_.y;
+}
 
-  Set(new_d, new_w, max_tsdf_value);
+__inline__ __device__ __host__
+bool operator != (const TSDF16& a, const TSDF16& b) {
+  return !(a == b);
+}
+
+// --- TSDF16Color ---
+
+__inline__ __device__ __host__
+TSDF16Color::TSDF16Color(float d, float w, float max_tsdf_value) {
+  Set(d, w, max_tsdf_value);
+}
+
+__inline__ __device__ __host__
+float2 TSDF16Color::Get(float max_tsdf_value) const {
+  return{ Distance(max_tsdf_value), Weight() };
+}
+
+__inline__ __device__ __host__
+float TSDF16Color::Distance(float max_tsdf_value) const {
+  return (2 * max_tsdf_value * (encoded_.x / 65535.f)) - max_tsdf_value;
+}
+
+__inline__ __device__ __host__
+float TSDF16Color::NormalizedDistance(float max_tsdf_value) const {
+  return encoded_.x / 65535.f;
+}
+
+__inline__ __device__ __host__
+float TSDF16Color::Weight() const {
+  return static_cast<float>(encoded_.y & 0xff);
+}
+
+__inline__ __device__ __host__
+unsigned char TSDF16Color::Color() const {
+  return static_cast<unsigned char>(encoded_.y >> 8);
+}
+
+__inline__ __device__ __host__
+void TSDF16Color::SetColor(unsigned char color) {
+  encoded_.y = static_cast<unsigned short>((encoded_.y & 0xff) | (color << 8));
+}
+
+__inline__ __device__ __host__
+void TSDF16Color::Set(float d, float w, float max_tsdf_value) {
+  encoded_ = {
+    static_cast<unsigned short>(QuantizeDistance(d, max_tsdf_value, 65535)),
+    static_cast<unsigned short>((encoded_.y & 0xff00) | SaturateWeight(w, 255))
+  };
+}
+
+__inline__ __device__ __host__
+void TSDF16Color::Update(float incoming_d, float incoming_w,
+  float max_tsdf_value) {
+  UpdateVoxel(*this, incoming_d, incoming_w, max_tsdf_value);
+}
+
+__inline__ __device__ __host__
+bool operator == (const TSDF16Color& a, const TSDF16Color& b) {
+  return a.encoded_.x == b.encoded_.x && a.encoded_.y == b.encoded_.y;
+}
+
+__inline__ __device__ __host__
+bool operator != (const TSDF16Color& a, const TSDF16Color& b) {
+  return !(a == b);
+}
+
+// --- TSDF8 ---
+
+__inline__ __device__ __host__
+TSDF8::TSDF8(float d, float w, float max_tsdf_value) {
+  Set(d, w, max_tsdf_value);
+}
+
+__inline__ __device__ __host__
+float2 TSDF8::Get(float max_tsdf_value) const {
+  return{ Distance(max_tsdf_value), Weight() };
+}
+
+__inline__ __device__ __host__
+float TSDF8::Distance(float max_tsdf_value) const {
+  return (2 * max_tsdf_value * (encoded_.x / 255.f)) - max_tsdf_value;
+}
+
+__inline__ __device__ __host__
+float TSDF8::NormalizedDistance(float max_tsdf_value) const {
+  return encoded_.x / 255.f;
+}
+
+__inline__ __device__ __host__
+float TSDF8::Weight() const {
+  return static_cast<float>(encoded_.y);
+}
+
+__inline__ __device__ __host__
+void TSDF8::Set(float d, float w, float max_tsdf_value) {
+  encoded_ = {
+    static_cast<unsigned char>(QuantizeDistance(d, max_tsdf_value, 255)),
+    static_cast<unsigned char>(SaturateWeight(w, 255))
+  };
+}
+
+__inline__ __device__ __host__
+void TSDF8::Update(float incoming_d, float incoming_w, float max_tsdf_value) {
+  UpdateVoxel(*this, incoming_d, incoming_w, max_tsdf_value);
+}
+
+__inline__ __device__ __host__
+bool operator == (const TSDF8& a, const TSDF8& b) {
+  return a.encoded_.x == b.encoded_.x && a.encoded_.y == b.encoded_.y;
+}
+
+__inline__ __device__ __host__
+bool operator != (const TSDF8& a, const TSDF8& b) {
+  return !(a == b);
+}
+
+// --- TSDFFloat ---
+
+__inline__ __device__ __host__
+TSDFFloat::TSDFFloat(float d, float w, float max_tsdf_value) {
+  Set(d, w, max_tsdf_value);
+}
+
+__inline__ __device__ __host__
+float2 TSDFFloat::Get(float max_tsdf_value) const {
+  return encoded_;
+}
+
+__inline__ __device__ __host__
+float TSDFFloat::Distance(float max_tsdf_value) const {
+  return encoded_.x;
+}
+
+__inline__ __device__ __host__
+float TSDFFloat::NormalizedDistance(float max_tsdf_value) const {
+  return (encoded_.x + max_tsdf_value) / (2 * max_tsdf_value);
+}
+
+__inline__ __device__ __host__
+float TSDFFloat::Weight() const {
+  return encoded_.y;
+}
+
+__inline__ __device__ __host__
+void TSDFFloat::Set(float d, float w, float max_tsdf_value) {
+  encoded_ = { d, w };
+}
+
+__inline__ __device__ __host__
+void TSDFFloat::Update(float incoming_d, float incoming_w,
+  float max_tsdf_value) {
+  UpdateVoxel(*this, incoming_d, incoming_w, max_tsdf_value);
+}
+
+__inline__ __device__ __host__
+bool operator == (const TSDFFloat& a, const TSDFFloat& b) {
+  return a.encoded_.x == b.encoded_.x && a.encoded_.y == b.encoded_.y;
+}
+
+__inline__ __device__ __host__
+bool operator != (const TSDFFloat& a, const TSDFFloat& b) {
+  return !(a == b);
 }
 
 #endif  // TSDF_H
@@ -0,0 +1,476 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tsdf_file.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "libcgt/core/common/ArrayUtils.h"
+#include "libcgt/core/io/BinaryFileOutputStream.h"
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+
+using libcgt::core::arrayutils::flatten;
+using libcgt::core::arrayutils::readViewOf;
+using libcgt::core::vecmath::SimilarityTransform;
+using std::vector;
+
+namespace {
+
+const char kMagic[] = { 't', 's', 'd', 'f', '3', 'd' };
+
+// Guards against absurd allocations when reading corrupt headers.
+const int kMaxResolution = 1 << 14;
+const int kMaxBrickSize = 64;
+
+// Calls f(i) for i in [0, count) on num_threads threads.
+template <typename F>
+void ParallelFor(int count, int num_threads, F f) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = std::max(1, std::min(num_threads, count));
+
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    for (int i = next++; i < count; i = next++) {
+      f(i);
+    }
+  };
+  vector<std::thread> threads;
+  for (int t = 1; t < num_threads; ++t) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& t : threads) {
+    t.join();
+  }
+}
+
+// The voxels of brick b, clipped to the grid.
+struct BrickExtent {
+  Vector3i min;
+  Vector3i size;
+
+  BrickExtent(int b, const Vector3i& num_bricks, int brick_size,
+    const Vector3i& resolution) {
+    Vector3i brick(b % num_bricks.x, (b / num_bricks.x) % num_bricks.y,
+      b / (num_bricks.x * num_bricks.y));
+    min = brick * brick_size;
+    size = Vector3i(std::min(brick_size, resolution.x - min.x),
+      std::min(brick_size, resolution.y - min.y),
+      std::min(brick_size, resolution.z - min.z));
+  }
+
+  int NumVoxels() const {
+    return size.x * size.y * size.z;
+  }
+
+  Vector3i Voxel(int i) const {
+    return min + Vector3i(i % size.x, (i / size.x) % size.y,
+      i / (size.x * size.y));
+  }
+};
+
+template <typename T>
+void Append(const T& value, vector<uint8_t>* bytes) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(&value);
+  bytes->insert(bytes->end(), p, p + sizeof(T));
+}
+
+// Encodes a brick with the smallest codec. Returns false, leaving bytes empty,
+// if no voxel is observed.
+bool EncodeBrick(Array3DReadView<TSDF> grid, const BrickExtent& extent,
+  TSDFFileBrickCodec* codec, vector<uint8_t>* bytes) {
+  const int n = extent.NumVoxels();
+  vector<uint8_t> mask((n + 7) / 8, 0);
+  vector<uint8_t> runs;
+  TSDF run_voxel;
+  uint16_t run_length = 0;
+  for (int i = 0; i < n; ++i) {
+    TSDF voxel = grid[extent.Voxel(i)];
+    if (voxel.Weight() == 0) {
+      continue;
+    }
+    mask[i / 8] |= static_cast<uint8_t>(1 << (i % 8));
+    if (run_length > 0 && voxel == run_voxel &&
+      run_length < UINT16_MAX) {
+      ++run_length;
+    } else {
+      if (run_length > 0) {
+        Append(run_length, &runs);
+        Append(run_voxel, &runs);
+      }
+      run_voxel = voxel;
+      run_length = 1;
+    }
+  }
+  if (run_length == 0) {
+    bytes->clear();
+    return false;
+  }
+  Append(run_length, &runs);
+  Append(run_voxel, &runs);
+
+  if (mask.size() + runs.size() < n * sizeof(TSDF)) {
+    *codec = TSDFFileBrickCodec::MASKED_RUN_LENGTH;
+    *bytes = mask;
+    bytes->insert(bytes->end(), runs.begin(), runs.end());
+  } else {
+    *codec = TSDFFileBrickCodec::RAW;
+    bytes->clear();
+    for (int i = 0; i < n; ++i) {
+      Append(grid[extent.Voxel(i)], bytes);
+    }
+  }
+  return true;
+}
+
+// Decodes n voxels into packed voxels. Returns false if the encoded brick is
+// malformed.
+bool DecodeBrickBytes(TSDFFileBrickCodec codec, const uint8_t* bytes,
+  size_t num_bytes, int n, const TSDF& cleared, TSDF* voxels) {
+  if (codec == TSDFFileBrickCodec::RAW) {
+    if (num_bytes != n * sizeof(TSDF)) {
+      return false;
+    }
+    memcpy(voxels, bytes, num_bytes);
+    return true;
+  }
+  if (codec != TSDFFileBrickCodec::MASKED_RUN_LENGTH) {
+    return false;
+  }
+
+  const size_t mask_size = (n + 7) / 8;
+  if (num_bytes < mask_size) {
+    return false;
+  }
+  const uint8_t* mask = bytes;
+  size_t run_offset = mask_size;
+  TSDF run_voxel;
+  uint16_t run_length = 0;
+  for (int i = 0; i < n; ++i) {
+    if ((mask[i / 8] & (1 << (i % 8))) == 0) {
+      voxels[i] = cleared;
+      continue;
+    }
+    if (run_length == 0) {
+      if (run_offset + sizeof(uint16_t) + sizeof(TSDF) > num_bytes) {
+        return false;
+      }
+      memcpy(&run_length, bytes + run_offset, sizeof(uint16_t));
+      memcpy(&run_voxel, bytes + run_offset + sizeof(uint16_t),
+        sizeof(TSDF));
+      run_offset += sizeof(uint16_t) + sizeof(TSDF);
+      if (run_length == 0) {
+        return false;
+      }
+    }
+    voxels[i] = run_voxel;
+    --run_length;
+  }
+  return run_length == 0 && run_offset == num_bytes;
+}
+
+// Reads a T at offset, if it fits in size bytes, and advances offset.
+template <typename T>
+bool ReadAt(const uint8_t* data, size_t size, size_t* offset, T* value) {
+  if (*offset > size || size - *offset < sizeof(T)) {
+    return false;
+  }
+  memcpy(value, data + *offset, sizeof(T));
+  *offset += sizeof(T);
+  return true;
+}
+
+// Writes the bricked part of versions 2 and 3.
+bool WriteBricks(BinaryFileOutputStream& out, Array3DReadView<TSDF> grid,
+  int version, int num_threads) {
+  const int brick_size = kTSDFFileBrickSize;
+  const Vector3i resolution = grid.size();
+  const Vector3i num_bricks(
+    (resolution.x + brick_size - 1) / brick_size,
+    (resolution.y + brick_size - 1) / brick_size,
+    (resolution.z + brick_size - 1) / brick_size);
+  const int num_total_bricks = num_bricks.x * num_bricks.y * num_bricks.z;
+
+  vector<TSDFFileBrickCodec> codecs(num_total_bricks);
+  vector<vector<uint8_t>> encoded(num_total_bricks);
+  ParallelFor(num_total_bricks, num_threads, [&](int b) {
+    EncodeBrick(grid, BrickExtent(b, num_bricks, brick_size, resolution),
+      &codecs[b], &encoded[b]);
+  });
+
+  vector<TSDFFileBrick> index;
+  uint64_t payload_size = 0;
+  for (int b = 0; b < num_total_bricks; ++b) {
+    if (!encoded[b].empty()) {
+      index.push_back({ b, codecs[b], payload_size, encoded[b].size() });
+      payload_size += encoded[b].size();
+    }
+  }
+
+  bool ok = out.write<int32_t>(brick_size);
+  if (version >= 3) {
+    ok = ok && out.write<int32_t>(static_cast<int32_t>(TSDF::kEncoding));
+  }
+  ok = ok && out.write<int32_t>(static_cast<int32_t>(index.size()));
+  ok = ok && out.write<uint64_t>(payload_size);
+  ok = ok && out.writeArray(readViewOf(index));
+  for (const TSDFFileBrick& entry : index) {
+    ok = ok && out.writeArray(readViewOf(encoded[entry.brick]));
+  }
+  return ok;
+}
+
+}  // namespace
+
+bool TSDFFileReader::Open(const std::string& filename) {
+  version_ = 0;
+  if (!file_.Open(filename)) {
+    return false;
+  }
+  const uint8_t* data = file_.Data();
+  const size_t size = file_.Size();
+  size_t offset = 0;
+
+  for (char expected : kMagic) {
+    uint8_t c = 0;
+    if (!ReadAt(data, size, &offset, &c) ||
+      c != static_cast<uint8_t>(expected)) {
+      return false;
+    }
+  }
+
+  int32_t version;
+  Vector3i resolution;
+  Matrix4f world_from_grid_matrix;
+  float max_tsdf_value;
+  if (!ReadAt(data, size, &offset, &version) ||
+    !ReadAt(data, size, &offset, &resolution) ||
+    !ReadAt(data, size, &offset, &world_from_grid_matrix) ||
+    !ReadAt(data, size, &offset, &max_tsdf_value)) {
+    return false;
+  }
+  if (resolution.x <= 0 || resolution.y <= 0 || resolution.z <= 0 ||
+    resolution.x > kMaxResolution || resolution.y > kMaxResolution ||
+    resolution.z > kMaxResolution || !(max_tsdf_value > 0)) {
+    return false;
+  }
+  const uint64_t num_voxels =
+    static_cast<uint64_t>(resolution.x) * resolution.y * resolution.z;
+
+  if (version < 1 || version > 3) {
+    return false;
+  }
+
+  int32_t encoding = static_cast<int32_t>(TSDFEncoding::D16_W16);
+  if (version == 1) {
+    if (encoding != static_cast<int32_t>(TSDF::kEncoding) ||
+      size - offset < num_voxels * sizeof(TSDF)) {
+      return false;
+    }
+    voxels_ = data + offset;
+  } else {
+    int32_t brick_size;
+    int32_t num_stored_bricks;
+    uint64_t payload_size;
+    if (!ReadAt(data, size, &offset, &brick_size) ||
+      (version >= 3 && !ReadAt(data, size, &offset, &encoding)) ||
+      !ReadAt(data, size, &offset, &num_stored_bricks) ||
+      !ReadAt(data, size, &offset, &payload_size)) {
+      return false;
+    }
+    if (encoding != static_cast<int32_t>(TSDF::kEncoding) ||
+      brick_size <= 0 || brick_size > kMaxBrickSize) {
+      return false;
+    }
+    brick_size_ = brick_size;
+    num_bricks_ = Vector3i(
+      (resolution.x + brick_size - 1) / brick_size,
+      (resolution.y + brick_size - 1) / brick_size,
+      (resolution.z + brick_size - 1) / brick_size);
+    const int num_total_bricks =
+      num_bricks_.x * num_bricks_.y * num_bricks_.z;
+    if (num_stored_bricks < 0 || num_stored_bricks > num_total_bricks ||
+      (size - offset) / sizeof(TSDFFileBrick) <
+        static_cast<size_t>(num_stored_bricks)) {
+      return false;
+    }
+
+    index_.resize(num_stored_bricks);
+    if (num_stored_bricks > 0) {
+      memcpy(index_.data(), data + offset,
+        num_stored_bricks * sizeof(TSDFFileBrick));
+    }
+    offset += num_stored_bricks * sizeof(TSDFFileBrick);
+    if (size - offset < payload_size) {
+      return false;
+    }
+    payload_ = data + offset;
+
+    entry_of_brick_.assign(num_total_bricks, -1);
+    for (int e = 0; e < num_stored_bricks; ++e) {
+      const TSDFFileBrick& entry = index_[e];
+      if (entry.brick < 0 || entry.brick >= num_total_bricks ||
+        entry_of_brick_[entry.brick] != -1 ||
+        entry.offset > payload_size ||
+        entry.num_bytes > payload_size - entry.offset) {
+        return false;
+      }
+      entry_of_brick_[entry.brick] = e;
+    }
+  }
+
+  version_ = version;
+  resolution_ = resolution;
+  world_from_grid_ = SimilarityTransform::fromMatrix(world_from_grid_matrix);
+  max_tsdf_value_ = max_tsdf_value;
+  return true;
+}
+
+int TSDFFileReader::Version() const {
+  return version_;
+}
+
+Vector3i TSDFFileReader::Resolution() const {
+  return resolution_;
+}
+
+const SimilarityTransform& TSDFFileReader::WorldFromGrid() const {
+  return world_from_grid_;
+}
+
+float TSDFFileReader::MaxTSDFValue() const {
+  return max_tsdf_value_;
+}
+
+int TSDFFileReader::SliceAlignment() const {
+  return version_ >= 2 ? brick_size_ : 1;
+}
+
+bool TSDFFileReader::DecodeBrick(int e, TSDF* voxels) const {
+  const TSDFFileBrick& entry = index_[e];
+  BrickExtent extent(entry.brick, num_bricks_, brick_size_, resolution_);
+  return DecodeBrickBytes(entry.codec, payload_ + entry.offset,
+    entry.num_bytes, extent.NumVoxels(), TSDF(0, 0, max_tsdf_value_),
+    voxels);
+}
+
+bool TSDFFileReader::ReadSlices(int z_begin, int z_end, TSDF* slices,
+  int num_threads) const {
+  assert(version_ != 0);
+  assert(0 <= z_begin && z_begin <= z_end && z_end <= resolution_.z);
+  const size_t slice_size =
+    static_cast<size_t>(resolution_.x) * resolution_.y;
+
+  if (version_ == 1) {
+    memcpy(slices, voxels_ + z_begin * slice_size * sizeof(TSDF),
+      (z_end - z_begin) * slice_size * sizeof(TSDF));
+    return true;
+  }
+
+  // Each brick that overlaps [z_begin, z_end) is decoded into a scratch brick
+  // and its voxels in range are scattered into slices.
+  const int bz_begin = z_begin / brick_size_;
+  const int bz_end = (z_end + brick_size_ - 1) / brick_size_;
+  const int bricks_per_layer = num_bricks_.x * num_bricks_.y;
+  const TSDF cleared(0, 0, max_tsdf_value_);
+  std::atomic<bool> ok(true);
+  ParallelFor((bz_end - bz_begin) * bricks_per_layer, num_threads,
+    [&](int i) {
+    const int b = bz_begin * bricks_per_layer + i;
+    BrickExtent extent(b, num_bricks_, brick_size_, resolution_);
+    vector<TSDF> brick;
+    const int e = entry_of_brick_[b];
+    if (e != -1) {
+      brick.resize(extent.NumVoxels());
+      if (!DecodeBrick(e, brick.data())) {
+        ok = false;
+        return;
+      }
+    }
+    for (int j = 0; j < extent.NumVoxels(); ++j) {
+      Vector3i v = extent.Voxel(j);
+      if (v.z < z_begin || v.z >= z_end) {
+        continue;
+      }
+      slices[(v.z - z_begin) * slice_size +
+        static_cast<size_t>(v.y) * resolution_.x + v.x] =
+        e == -1 ? cleared : brick[j];
+    }
+  });
+  return ok;
+}
+
+bool ReadTSDFFile(const std::string& filename, Array3D<TSDF>* grid,
+  SimilarityTransform* world_from_grid, float* max_tsdf_value,
+  int num_threads) {
+  TSDFFileReader reader;
+  if (!reader.Open(filename)) {
+    return false;
+  }
+  Array3D<TSDF> data(reader.Resolution());
+  if (!reader.ReadSlices(0, reader.Resolution().z, data.pointer(),
+    num_threads)) {
+    return false;
+  }
+  *grid = std::move(data);
+  *world_from_grid = reader.WorldFromGrid();
+  *max_tsdf_value = reader.MaxTSDFValue();
+  return true;
+}
+
+bool WriteTSDFFile(const std::string& filename, Array3DReadView<TSDF> grid,
+  const SimilarityTransform& world_from_grid, float max_tsdf_value,
+  int version, int num_threads) {
+  if (version < 1 || version > kTSDFFileLatestVersion ||
+    (version < 3 && TSDF::kEncoding != TSDFEncoding::D16_W16)) {
+    return false;
+  }
+
+  // Every write is checked, so that a full disk fails the call.
+  BinaryFileOutputStream out(filename);
+  bool ok = true;
+
+  // Write magic header: 'tsdf3d'.
+  for (char c : kMagic) {
+    ok = ok && out.write(c);
+  }
+  ok = ok && out.write<int32_t>(version);
+
+  // Write resolution: x, y, z.
+  ok = ok && out.write(grid.size());
+
+  // Write world from grid transformation as a 4x4 float32 matrix,
+  // stored column major.
+  ok = ok && out.write(world_from_grid.asMatrix());
+
+  // Write max tsdf value.
+  ok = ok && out.write(max_tsdf_value);
+
+  // Write data.
+  if (version == 1) {
+    ok = ok && out.writeArray(flatten(grid));
+  } else {
+    ok = ok && WriteBricks(out, grid, version, num_threads);
+  }
+
+  // Close even after a failed write, and fail if flushing fails.
+  return out.close() && ok;
+}
@@ -0,0 +1,138 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TSDF_FILE_H
+#define TSDF_FILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "libcgt/core/common/Array3D.h"
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+
+#include "mapped_file.h"
+#include "tsdf.h"
+
+// The 'tsdf3d' file format used to store dense TSDF volumes.
+//
+// All versions start with: magic 'tsdf3d', int32 version, Vector3i
+// resolution, Matrix4f world_from_grid (column major), float max_tsdf_value.
+//
+// Version 1 follows with all the voxels, x fastest.
+//
+// Version 2 splits the volume into bricks of int32 brick_size^3 voxels and
+// only stores bricks with at least one observed (non-zero weight) voxel. It
+// follows with int32 brick_size, int32 num_stored_bricks, uint64
+// payload_size, num_stored_bricks x TSDFFileBrick, then the payload. Each
+// stored brick is compressed independently (see TSDFFileBrickCodec), so
+// bricks are encoded and decoded in parallel.
+//
+// Version 3 is version 2 with an int32 TSDFEncoding after brick_size.
+// Versions 1 and 2 always hold TSDFEncoding::D16_W16 voxels. Files are only
+// read and written in the encoding TSDF was compiled with.
+//
+// Zero-weight voxels carry no information: versions 2 and 3 store them as
+// cleared voxels (zero distance).
+
+const int kTSDFFileLatestVersion = 3;
+const int kTSDFFileBrickSize = 8;
+
+enum class TSDFFileBrickCodec : int32_t {
+  // The brick's voxels, x fastest.
+  RAW = 0,
+  // A bitmask of the observed voxels (bit i of byte i / 8 for voxel i, x
+  // fastest), then the observed voxels in order, run-length encoded as
+  // (uint16 count, TSDF voxel) pairs.
+  MASKED_RUN_LENGTH = 1
+};
+
+// An entry of the version 2 brick index.
+struct TSDFFileBrick {
+  // Linear brick index, x fastest.
+  int32_t brick;
+  TSDFFileBrickCodec codec;
+  // Byte range of the encoded brick, relative to the start of the payload.
+  uint64_t offset;
+  uint64_t num_bytes;
+};
+
+// Reads a 'tsdf3d' file of either version a range of z slices at a time,
+// from a memory mapping. Host memory use is bounded by the slices being
+// decoded instead of by the size of the volume.
+class TSDFFileReader {
+ public:
+
+  using SimilarityTransform = libcgt::core::vecmath::SimilarityTransform;
+
+  // Maps filename and validates its header and brick index. Returns false if
+  // the file cannot be mapped or is malformed.
+  bool Open(const std::string& filename);
+
+  int Version() const;
+  Vector3i Resolution() const;
+  const SimilarityTransform& WorldFromGrid() const;
+  float MaxTSDFValue() const;
+
+  // The number of slices stored together. Ranges aligned to it decode each
+  // stored brick only once.
+  int SliceAlignment() const;
+
+  // Decodes z slices [z_begin, z_end) into slices, which must hold
+  // Resolution().x * Resolution().y * (z_end - z_begin) voxels, x fastest.
+  // Uses num_threads threads (one per hardware thread if num_threads <= 0).
+  // Returns false if the data is malformed.
+  bool ReadSlices(int z_begin, int z_end, TSDF* slices,
+    int num_threads = 0) const;
+
+ private:
+
+  // Decodes the stored brick index[e] into a packed extent.NumVoxels() array.
+  bool DecodeBrick(int e, TSDF* voxels) const;
+
+  MappedFile file_;
+
+  int version_ = 0;
+  Vector3i resolution_;
+  SimilarityTransform world_from_grid_;
+  float max_tsdf_value_ = 0;
+
+  // Version 1: the voxels.
+  const uint8_t* voxels_ = nullptr;
+
+  // Versions 2 and 3.
+  int brick_size_ = 0;
+  Vector3i num_bricks_;
+  std::vector<TSDFFileBrick> index_;
+  // Which index entry, if any, stores each brick.
+  std::vector<int> entry_of_brick_;
+  const uint8_t* payload_ = nullptr;
+};
+
+// Reads either version into a new grid. Returns false if the file cannot be
+// read or is malformed. Uses num_threads threads to decode (one per hardware
+// thread if num_threads <= 0).
+bool ReadTSDFFile(const std::string& filename, Array3D<TSDF>* grid,
+  libcgt::core::vecmath::SimilarityTransform* world_from_grid,
+  float* max_tsdf_value, int num_threads = 0);
+
+// Writes grid in the given version of the format. Versions 1 and 2 fail
+// unless TSDF is TSDFEncoding::D16_W16. Uses num_threads threads to
+// encode (one per hardware thread if num_threads <= 0).
+bool WriteTSDFFile(const std::string& filename, Array3DReadView<TSDF> grid,
+  const libcgt::core::vecmath::SimilarityTransform& world_from_grid,
+  float max_tsdf_value, int version = kTSDFFileLatestVersion,
+  int num_threads = 0);
+
+#endif  // TSDF_FILE_H
@@ -0,0 +1,118 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tsdf_volume.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "partitioned_tsdf.h"
+#include "regular_grid_tsdf.h"
+#include "voxel_hashed_tsdf.h"
+
+using libcgt::core::vecmath::SimilarityTransform;
+
+namespace {
+
+// Points are converted and appended to the PLY file this many at a time.
+const size_t kSurfacePointsBatchSize = 1 << 20;
+
+}  // namespace
+
+bool SaveSurfacePointsPLY(const TSDFVolume& volume,
+  const std::string& filename, const PLYMeshWriter::Options& options) {
+  DeviceArray1D<float4> world_points;
+  DeviceArray1D<float4> world_normals;
+  int num_points = 0;
+  if (!volume.ExtractSurfacePoints(world_points, world_normals,
+    &num_points)) {
+    return false;
+  }
+
+  std::vector<float4> host_points(num_points);
+  std::vector<float4> host_normals(num_points);
+  if (num_points > 0) {
+    cudaMemcpy(host_points.data(), world_points.pointer(),
+      num_points * sizeof(float4), cudaMemcpyDeviceToHost);
+    cudaMemcpy(host_normals.data(), world_normals.pointer(),
+      num_points * sizeof(float4), cudaMemcpyDeviceToHost);
+  }
+
+  PLYMeshWriter writer;
+  if (!writer.Open(filename, options)) {
+    return false;
+  }
+  std::vector<Vector3f> positions;
+  std::vector<Vector3f> normals;
+  for (size_t begin = 0; begin < host_points.size();
+    begin += kSurfacePointsBatchSize) {
+    size_t end = std::min(begin + kSurfacePointsBatchSize,
+      host_points.size());
+    positions.clear();
+    normals.clear();
+    for (size_t i = begin; i < end; ++i) {
+      const float4& p = host_points[i];
+      const float4& n = host_normals[i];
+      positions.push_back({ p.x, p.y, p.z });
+      normals.push_back({ n.x, n.y, n.z });
+    }
+    writer.AppendVertices(positions.data(), normals.data(), positions.size());
+  }
+  return writer.Close();
+}
+
+const char* kRegularGridTSDFVolumeType = "regular_grid";
+const char* kBrickedGridTSDFVolumeType = "bricked_grid";
+const char* kVoxelHashedTSDFVolumeType = "voxel_hashed";
+const char* kPartitionedTSDFVolumeType = "partitioned";
+
+std::unique_ptr<TSDFVolume> MakeTSDFVolume(const std::string& type,
+  const Vector3i& resolution,
+  const SimilarityTransform& world_from_grid,
+  float max_tsdf_value,
+  int max_num_blocks,
+  int num_devices) {
+  if (type == kRegularGridTSDFVolumeType) {
+    return std::unique_ptr<TSDFVolume>(
+      new RegularGridTSDF(resolution, world_from_grid, max_tsdf_value));
+  } else if (type == kBrickedGridTSDFVolumeType) {
+    return std::unique_ptr<TSDFVolume>(
+      new RegularGridTSDF(resolution, world_from_grid, max_tsdf_value,
+        VoxelLayout::BRICKED));
+  } else if (type == kVoxelHashedTSDFVolumeType) {
+    return std::unique_ptr<TSDFVolume>(
+      new VoxelHashedTSDF(resolution, world_from_grid, max_tsdf_value,
+        max_num_blocks));
+  } else if (type == kPartitionedTSDFVolumeType) {
+    int device_count = 0;
+    int current_device = 0;
+    if (cudaGetDeviceCount(&device_count) != cudaSuccess ||
+      device_count == 0) {
+      return nullptr;
+    }
+    cudaGetDevice(&current_device);
+    if (num_devices <= 0) {
+      num_devices = device_count;
+    }
+    num_devices = std::max(1, std::min(num_devices, device_count));
+
+    std::vector<int> devices;
+    for (int i = 0; i < num_devices; ++i) {
+      devices.push_back((current_device + i) % device_count);
+    }
+    return std::unique_ptr<TSDFVolume>(
+      new PartitionedTSDF(resolution, world_from_grid, max_tsdf_value,
+        devices));
+  }
+  return nullptr;
+}
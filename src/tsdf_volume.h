@@ -0,0 +1,312 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TSDF_VOLUME_H
+#define TSDF_VOLUME_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cuda_runtime.h>
+
+#include "libcgt/core/common/Array3D.h"
+#include "libcgt/core/geometry/TriangleMesh.h"
+#include "libcgt/core/vecmath/Box3f.h"
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Range1f.h"
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+#include "libcgt/core/vecmath/Vector2i.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+#include "libcgt/cuda/DeviceArray1D.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+
+#include "calibrated_posed_depth_camera.h"
+#include "ply_mesh_writer.h"
+#include "tsdf.h"
+
+// Voxels that left a volume through TSDFVolume::Shift().
+struct EvictedTSDFSlab {
+  // Maps voxel indices of the slab to world coordinates.
+  libcgt::core::vecmath::SimilarityTransform world_from_grid;
+  float max_tsdf_value;
+  Array3D<TSDF> voxels;
+};
+
+// How Fuse() visits the volume.
+enum class FusionMethod {
+  // One thread per voxel column of the camera's frustum: every voxel the
+  // camera sees is updated, and free space in front of the surface is
+  // carved all the way to the camera.
+  VOXEL_SWEEP,
+  // One thread per pixel, marching only through the truncation band around
+  // its depth. Cheaper for large volumes, but free space farther than the
+  // truncation distance in front of the surface is not carved, and voxels
+  // smaller than a pixel's footprint can be skipped. Volumes that cannot
+  // march rays, or whose voxels are too small, fall back to VOXEL_SWEEP.
+  RAY_BAND
+};
+
+// A depth camera that never moves, for TSDFVolume::CacheProjections().
+struct StaticDepthCamera {
+  Vector4f flpp;
+  Range1f depth_range;
+  Matrix4f camera_from_world;
+  Vector2i image_size;
+};
+
+// How the raycasts read the volume.
+enum class RaycastSampling {
+  // Trilinear interpolation in software, from the voxels themselves.
+  VOXEL_ARRAY,
+  // Hardware trilinear filtering from a 16-bit texture mirror of the
+  // distances. Faster, but weights only have 8 fractional bits. Volumes
+  // without a texture mirror fall back to VOXEL_ARRAY.
+  TEXTURE,
+  // Trilinear interpolation in software, from the coarsest downsampled copy
+  // of the volume whose voxels are no larger than a pixel at the sample's
+  // distance. Cheaper for distant surfaces, at their footprint's resolution.
+  // Volumes without downsampled copies fall back to VOXEL_ARRAY.
+  LOD
+};
+
+// Interface shared by all TSDF volume representations so that the fusion
+// pipelines do not depend on how voxels are stored.
+//
+// All volumes share the same "grid" coordinate system: voxel (i, j, k) has its
+// center at (i + 0.5, j + 0.5, k + 0.5), and WorldFromGrid() maps grid
+// coordinates to world coordinates (in meters).
+class TSDFVolume {
+ public:
+
+  using SimilarityTransform = libcgt::core::vecmath::SimilarityTransform;
+
+  virtual ~TSDFVolume() = default;
+
+  // Clears the volume to empty (zero weight everywhere).
+  virtual void Reset() = 0;
+
+  // Fuse(), AdaptiveRaycast() and Raycast() enqueue their kernels on stream.
+  // They only synchronize when an implementation needs a result on the host.
+  // With --collect_perf, they report their GPU time to PerfCollector.
+  virtual void Fuse(const Vector4f& depth_camera_flpp,
+    const Range1f& depth_camera_range,
+    const Matrix4f& depth_camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    cudaStream_t stream = 0,
+    FusionMethod method = FusionMethod::VOXEL_SWEEP) = 0;
+
+  virtual void FuseMultiple(
+    const std::vector<CalibratedPosedDepthCamera>& depth_cameras,
+    const std::vector<DeviceArray2D<float>>& depth_maps,
+    cudaStream_t stream = 0) = 0;
+
+  // Precomputes, for each of depth_cameras, the pixel of its depth map that
+  // every voxel in its view projects to, and the voxel's depth, so that
+  // FuseProjected() can fuse cameras that never move without projecting any
+  // voxel again. If undistort_maps is not empty, the pixels are looked up in
+  // undistort_maps[i] (see DepthProcessor::Undistort()), so that
+  // FuseProjected() reads raw depth maps of the same size directly. The
+  // tables are dropped when WorldFromGrid() changes. Enqueued on stream.
+  //
+  // Returns false, and does nothing, if the representation cannot cache
+  // projections.
+  virtual bool CacheProjections(
+    const std::vector<StaticDepthCamera>& depth_cameras,
+    const std::vector<DeviceArray2D<float2>>& undistort_maps,
+    cudaStream_t stream = 0) {
+    return false;
+  }
+
+  // Same as FuseMultiple() for the cameras given to CacheProjections() whose
+  // indices are listed in cameras: depth_maps[i] is the depth map of camera
+  // i, raw if CacheProjections() was given undistortion maps. Enqueued on
+  // stream.
+  //
+  // Returns false, and does nothing, if no projections are cached.
+  virtual bool FuseProjected(const std::vector<int>& cameras,
+    const std::vector<DeviceArray2D<float>>& depth_maps,
+    cudaStream_t stream = 0) {
+    return false;
+  }
+
+  virtual void AdaptiveRaycast(const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) = 0;
+
+  virtual void Raycast(const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) = 0;
+
+  // Same as AdaptiveRaycast() (if adaptive) or Raycast(), but the raycast
+  // also writes each pixel to world_points_surface and world_normals_surface:
+  // surfaces of float4 CUDA arrays the size of world_points_out, such as
+  // mapped GL textures. Displaying the result then needs no extra copy.
+  //
+  // Returns false, and does nothing, if the representation cannot write to
+  // surfaces.
+  virtual bool RaycastToSurfaces(bool adaptive,
+    const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaSurfaceObject_t world_points_surface,
+    cudaSurfaceObject_t world_normals_surface,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) {
+    return false;
+  }
+
+  // Same as AdaptiveRaycast() (if adaptive) or Raycast(), but the raycast
+  // also writes each pixel to compact_out, the size of world_points_out, as a
+  // compact raycast sample (see compact_raycast.cuh) in camera coordinates.
+  // ProjectivePointPlaneICP reads a quarter as many bytes from it.
+  //
+  // Returns false, and does nothing, if the representation cannot write
+  // compact samples.
+  virtual bool RaycastCompact(bool adaptive,
+    const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    DeviceArray2D<uint2>& compact_out,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) {
+    return false;
+  }
+
+  // The transformation that yields grid coordinates [0, resolution]^3 (in
+  // samples), from world coordinates (in meters).
+  virtual const SimilarityTransform& GridFromWorld() const = 0;
+
+  // The transformation that yields world coordinates (in meters) from
+  // grid coordinates [0, resolution]^3 (in samples).
+  virtual const SimilarityTransform& WorldFromGrid() const = 0;
+
+  // (0, 0, 0) --> Resolution().
+  virtual Box3f BoundingBox() const = 0;
+
+  // The number of (possibly unallocated) samples along each axis.
+  virtual Vector3i Resolution() const = 0;
+
+  // The side length of one (cubical) voxel, in meters.
+  virtual float VoxelSize() const = 0;
+
+  // The side lengths of the entire grid, in meters.
+  virtual Vector3f SideLengths() const = 0;
+
+  virtual TriangleMesh Triangulate() const = 0;
+
+  // Same mesh as Triangulate(), but implementations may re-mesh only the
+  // parts of the volume modified since the previous call and reuse the rest.
+  // The default re-meshes everything.
+  virtual TriangleMesh TriangulateIncremental() {
+    return Triangulate();
+  }
+
+  // Same as Triangulate(), but from a copy of the volume downsampled 2^lod
+  // times along each axis, for quick previews: lod 1 has an eighth as many
+  // cells. Implementations clamp lod to the levels they keep. The default
+  // ignores lod.
+  virtual TriangleMesh TriangulateAtLOD(int lod) {
+    return Triangulate();
+  }
+
+  // Writes the mesh of Triangulate() to filename as binary PLY.
+  // Implementations may stream it to disk as it is meshed rather than build
+  // the whole TriangleMesh first. The default does not. Returns false if the
+  // file cannot be written.
+  virtual bool TriangulateToPLY(const std::string& filename,
+    const PLYMeshWriter::Options& options = PLYMeshWriter::Options()) const {
+    return WritePLYMesh(Triangulate(), filename, options);
+  }
+
+  // Finds the zero crossings of the TSDF along grid edges whose endpoints
+  // are both observed, with normals from the gradient: an oriented point
+  // cloud of the surface, for when no mesh is needed. Point i is written to
+  // world_points_out[i] (w = 1) and its unit normal to world_normals_out[i]
+  // (w = 0), in world coordinates, for i < *num_points_out. The arrays are
+  // grown if they are too small. Nothing is welded, and nothing but the
+  // point count is copied to the host.
+  //
+  // Returns false, and does nothing, if the representation cannot extract
+  // points on the device.
+  virtual bool ExtractSurfacePoints(DeviceArray1D<float4>& world_points_out,
+    DeviceArray1D<float4>& world_normals_out, int* num_points_out,
+    cudaStream_t stream = 0) const {
+    return false;
+  }
+
+  // Marks every copy the representation keeps of its voxels (e.g. a texture
+  // mirror or downsampled levels) as out of date, so that the next call that
+  // reads one refreshes all of it. For callers that discarded work which
+  // would have refreshed them. The default does nothing.
+  virtual void InvalidateAllCopies() {}
+
+  // Load() is complete when it returns. Its uploads are enqueued on stream.
+  virtual bool Load(const std::string& filename, cudaStream_t stream = 0) = 0;
+  virtual bool Save(const std::string& filename) const = 0;
+
+  // Moves the volume by delta_voxels (in grid coordinates) so that it covers
+  // a new region of the world, keeping the voxels the old and new regions
+  // share. Voxels that leave are appended to evicted (if not null) as slabs
+  // that overlap the remaining volume by two slices, so that meshing a slab
+  // and the remaining volume with marching cubes (which leaves out the last
+  // two slices of cells) covers every cell without a crack. Slabs without
+  // observations are dropped. Voxels that enter are empty.
+  //
+  // Returns false, and does nothing, if the representation cannot move.
+  virtual bool Shift(const Vector3i& delta_voxels,
+    std::vector<EvictedTSDFSlab>* evicted) {
+    return false;
+  }
+};
+
+// Writes the points of volume.ExtractSurfacePoints() to filename as a binary
+// PLY point cloud (vertices with normals, no faces). Only the points are
+// downloaded. Returns false if volume cannot extract points or the file
+// cannot be written.
+bool SaveSurfacePointsPLY(const TSDFVolume& volume,
+  const std::string& filename,
+  const PLYMeshWriter::Options& options = PLYMeshWriter::Options());
+
+// Names accepted by MakeTSDFVolume().
+extern const char* kRegularGridTSDFVolumeType;
+extern const char* kBrickedGridTSDFVolumeType;
+extern const char* kVoxelHashedTSDFVolumeType;
+extern const char* kPartitionedTSDFVolumeType;
+
+// Constructs a TSDF volume of the given type ("regular_grid", "bricked_grid",
+// "voxel_hashed" or "partitioned"). "bricked_grid" is a RegularGridTSDF with
+// VoxelLayout::BRICKED. For sparse volumes, resolution only bounds the
+// addressable region and max_num_blocks caps the number of allocated blocks.
+// Partitioned volumes are split across num_devices GPUs, starting with the
+// current one (all visible GPUs if num_devices <= 0).
+//
+// Returns nullptr if type is not recognized, or if it is "partitioned" and
+// there is no CUDA device.
+std::unique_ptr<TSDFVolume> MakeTSDFVolume(const std::string& type,
+  const Vector3i& resolution,
+  const libcgt::core::vecmath::SimilarityTransform& world_from_grid,
+  float max_tsdf_value,
+  int max_num_blocks,
+  int num_devices);
+
+#endif  // TSDF_VOLUME_H
@@ -0,0 +1,1061 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "voxel_hashed_tsdf.h"
+
+#include <cassert>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <helper_math.h>
+
+#include "libcgt/core/common/ArrayUtils.h"
+#include "libcgt/core/io/BinaryFileInputStream.h"
+#include "libcgt/core/io/BinaryFileOutputStream.h"
+#include "libcgt/cuda/Box3f.h"
+#include "libcgt/cuda/MathUtils.h"
+#include "libcgt/cuda/ThreadMath.cuh"
+#include "libcgt/cuda/VecmathConversions.h"
+
+#include "camera_math.cuh"
+#include "marching_cubes.h"
+#include "perf_collector.h"
+
+using libcgt::core::arrayutils::readViewOf;
+using libcgt::core::arrayutils::writeViewOf;
+using libcgt::core::vecmath::SimilarityTransform;
+using libcgt::core::vecmath::inverse;
+using libcgt::cuda::contains;
+using libcgt::cuda::math::floorToInt;
+using libcgt::cuda::math::roundToInt;
+using libcgt::cuda::threadmath::threadSubscript2DGlobal;
+
+namespace {
+
+constexpr int kBlockSize = VoxelHashedTSDF::kBlockSize;
+constexpr int kNumVoxelsPerBlock = VoxelHashedTSDF::kNumVoxelsPerBlock;
+
+constexpr unsigned long long kEmptyKey = 0xffffffffffffffffull;
+
+// Give up after this many linear probes. Failed insertions are counted and
+// reported.
+constexpr int kMaxProbes = 128;
+
+// Bits used to store each block coordinate in a packed key.
+constexpr int kKeyBitsPerAxis = 21;
+
+constexpr float kTEpsilon = 2.0f;
+constexpr float kTStepSize = 1.0f;
+
+// Packs non-negative block coordinates into a 64-bit key.
+__inline__ __device__ __host__
+unsigned long long PackBlockKey(int3 block) {
+  return static_cast<unsigned long long>(block.x) |
+    (static_cast<unsigned long long>(block.y) << kKeyBitsPerAxis) |
+    (static_cast<unsigned long long>(block.z) << (2 * kKeyBitsPerAxis));
+}
+
+__inline__ __device__ __host__
+int3 UnpackBlockKey(unsigned long long key) {
+  const unsigned long long mask = (1ull << kKeyBitsPerAxis) - 1;
+  return {
+    static_cast<int>(key & mask),
+    static_cast<int>((key >> kKeyBitsPerAxis) & mask),
+    static_cast<int>((key >> (2 * kKeyBitsPerAxis)) & mask)
+  };
+}
+
+__inline__ __device__ __host__
+unsigned int HashBlock(int3 block) {
+  return (static_cast<unsigned int>(block.x) * 73856093u) ^
+    (static_cast<unsigned int>(block.y) * 19349669u) ^
+    (static_cast<unsigned int>(block.z) * 83492791u);
+}
+
+__inline__ __device__ __host__
+bool ContainsBlock(int3 resolution_in_blocks, int3 block) {
+  return block.x >= 0 && block.y >= 0 && block.z >= 0 &&
+    block.x < resolution_in_blocks.x &&
+    block.y < resolution_in_blocks.y &&
+    block.z < resolution_in_blocks.z;
+}
+
+__inline__ __device__
+int3 BlockFromVoxel(int3 voxel) {
+  // Voxels outside the grid may be negative: round towards -infinity.
+  return {
+    voxel.x >= 0 ? voxel.x / kBlockSize : (voxel.x + 1) / kBlockSize - 1,
+    voxel.y >= 0 ? voxel.y / kBlockSize : (voxel.y + 1) / kBlockSize - 1,
+    voxel.z >= 0 ? voxel.z / kBlockSize : (voxel.z + 1) / kBlockSize - 1
+  };
+}
+
+// Read-only view of the hash table and block pool.
+struct VoxelHashView {
+  const unsigned long long* keys;
+  const int* values;
+  const TSDF* voxels;
+  unsigned int capacity_mask;
+  int3 resolution_in_blocks;
+
+  // Returns the pool index of block, or -1 if it is not allocated.
+  __inline__ __device__
+  int FindBlock(int3 block) const {
+    if (!ContainsBlock(resolution_in_blocks, block)) {
+      return -1;
+    }
+    unsigned long long key = PackBlockKey(block);
+    unsigned int slot = HashBlock(block) & capacity_mask;
+    for (int i = 0; i < kMaxProbes; ++i) {
+      unsigned long long k = keys[slot];
+      if (k == key) {
+        return values[slot];
+      }
+      if (k == kEmptyKey) {
+        return -1;
+      }
+      slot = (slot + 1) & capacity_mask;
+    }
+    return -1;
+  }
+};
+
+// Remembers the last block looked up by a thread. Consecutive samples along a
+// ray almost always land in the same block.
+struct BlockCache {
+  int3 block = { -1, -1, -1 };
+  int index = -1;
+};
+
+// Fetches a voxel. Returns false if its block is not allocated.
+__inline__ __device__
+bool FetchVoxel(const VoxelHashView& view, int3 voxel, BlockCache& cache,
+  TSDF& out) {
+  int3 block = BlockFromVoxel(voxel);
+  if (block.x != cache.block.x || block.y != cache.block.y ||
+    block.z != cache.block.z) {
+    cache.block = block;
+    cache.index = view.FindBlock(block);
+  }
+  if (cache.index < 0) {
+    return false;
+  }
+  int3 local = voxel - kBlockSize * block;
+  out = view.voxels[cache.index * kNumVoxelsPerBlock +
+    local.x + kBlockSize * (local.y + kBlockSize * local.z)];
+  return true;
+}
+
+// Same conventions as TrilinearSample() in raycast.cu: returns (d, 1) on
+// success, or (0, 0) if any of the 8 samples is unallocated or unobserved.
+__inline__ __device__
+float2 HashedTrilinearSample(const VoxelHashView& view, int3 resolution,
+  float3 grid_coords, float max_tsdf_value, BlockCache& cache) {
+  libcgt::cuda::Box3f valid_box(make_float3(0.5f),
+    make_float3(resolution) - make_float3(1.0f));
+  if (!valid_box.contains(grid_coords)) {
+    return{ 0.0f, 0.0f };
+  }
+
+  float3 integer_grid_coords = grid_coords - make_float3(0.5f);
+  int3 p = floorToInt(integer_grid_coords);
+  float3 t = fracf(integer_grid_coords);
+
+  float d[8];
+  for (int i = 0; i < 8; ++i) {
+    int3 tap = { p.x + (i & 1), p.y + ((i >> 1) & 1), p.z + ((i >> 2) & 1) };
+    TSDF v;
+    if (!FetchVoxel(view, tap, cache, v) || v.Weight() == 0) {
+      return{ 0.0f, 0.0f };
+    }
+    d[i] = v.Distance(max_tsdf_value);
+  }
+
+  float d_l00 = lerp(d[0], d[1], t.x);
+  float d_l10 = lerp(d[2], d[3], t.x);
+  float d_l01 = lerp(d[4], d[5], t.x);
+  float d_l11 = lerp(d[6], d[7], t.x);
+  float d_ll0 = lerp(d_l00, d_l10, t.y);
+  float d_ll1 = lerp(d_l01, d_l11, t.y);
+  return{ lerp(d_ll0, d_ll1, t.z), 1.0f };
+}
+
+__inline__ __device__
+float4 HashedTrilinearSampleNormal(const VoxelHashView& view, int3 resolution,
+  float3 grid_coords, float max_tsdf_value, BlockCache& cache) {
+  float2 d_000 = HashedTrilinearSample(view, resolution, grid_coords,
+    max_tsdf_value, cache);
+  float2 d_100 = HashedTrilinearSample(view, resolution,
+    grid_coords + float3{ 1, 0, 0 }, max_tsdf_value, cache);
+  float2 d_010 = HashedTrilinearSample(view, resolution,
+    grid_coords + float3{ 0, 1, 0 }, max_tsdf_value, cache);
+  float2 d_001 = HashedTrilinearSample(view, resolution,
+    grid_coords + float3{ 0, 0, 1 }, max_tsdf_value, cache);
+
+  float3 normal = {
+    d_100.x - d_000.x,
+    d_010.x - d_000.x,
+    d_001.x - d_000.x,
+  };
+
+  float4 normal_out = {};
+  float len = length(normal);
+  if (len > 0 && d_000.y > 0 && d_100.y > 0 && d_010.y > 0 && d_001.y > 0) {
+    normal_out = make_float4(normal / len, 1.0f);
+  }
+  return normal_out;
+}
+
+// Applies the inverse of a rigid transformation m to point p, without
+// explicitly inverting m: with m = [R, t], R^{-1} (p - t) = R^T (p - t).
+__inline__ __device__
+float3 InverseRigidTransformPoint(float4x4 m, float3 p) {
+  float3 t = make_float3(m * float4{ 0, 0, 0, 1 });
+  float3 c0 = make_float3(m * float4{ 1, 0, 0, 0 });
+  float3 c1 = make_float3(m * float4{ 0, 1, 0, 0 });
+  float3 c2 = make_float3(m * float4{ 0, 0, 1, 0 });
+  float3 q = p - t;
+  return{ dot(c0, q), dot(c1, q), dot(c2, q) };
+}
+
+// For each valid depth pixel, walks the ray segment within max_tsdf_value of
+// the observed surface and inserts every block it passes through.
+__global__
+void AllocateBlocksKernel(float4 flpp,
+  float2 depth_min_max,
+  float4x4 camera_from_world,
+  float4x4 grid_from_world,
+  float max_tsdf_value,
+  int3 resolution_in_blocks,
+  KernelArray2D<const float> depth_map,
+  unsigned long long* keys,
+  unsigned int capacity_mask,
+  int* counters) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(depth_map.size(), xy)) {
+    return;
+  }
+
+  float depth = depth_map[xy];
+  if (depth < depth_min_max.x || depth > depth_min_max.y) {
+    return;
+  }
+
+  float near_depth = fmaxf(depth - max_tsdf_value, depth_min_max.x);
+  float far_depth = depth + max_tsdf_value;
+  float3 near_grid = transformPoint(grid_from_world,
+    InverseRigidTransformPoint(camera_from_world,
+      CameraFromPixel(xy, near_depth, flpp)));
+  float3 far_grid = transformPoint(grid_from_world,
+    InverseRigidTransformPoint(camera_from_world,
+      CameraFromPixel(xy, far_depth, flpp)));
+
+  // Step at most half a block at a time so we cannot skip over one.
+  float segment_length = length(far_grid - near_grid);
+  int num_steps = static_cast<int>(
+    ceilf(segment_length / (0.5f * kBlockSize))) + 1;
+
+  int3 last_block = { -1, -1, -1 };
+  for (int i = 0; i <= num_steps; ++i) {
+    float3 p = lerp(near_grid, far_grid, static_cast<float>(i) / num_steps);
+    int3 block = floorToInt(p / static_cast<float>(kBlockSize));
+    if (!ContainsBlock(resolution_in_blocks, block) ||
+      (block.x == last_block.x && block.y == last_block.y &&
+        block.z == last_block.z)) {
+      continue;
+    }
+    last_block = block;
+
+    unsigned long long key = PackBlockKey(block);
+    unsigned int slot = HashBlock(block) & capacity_mask;
+    bool inserted = false;
+    for (int j = 0; j < kMaxProbes; ++j) {
+      unsigned long long old = atomicCAS(&keys[slot], kEmptyKey, key);
+      if (old == kEmptyKey || old == key) {
+        inserted = true;
+        break;
+      }
+      slot = (slot + 1) & capacity_mask;
+    }
+    if (!inserted) {
+      atomicAdd(&counters[1], 1);
+    }
+  }
+}
+
+// Hands out pool storage to hash entries that have a key but no block yet.
+// Run as a separate pass after insertion so that readers never observe a key
+// whose value is still being written.
+__global__
+void AssignBlocksKernel(const unsigned long long* keys,
+  int* values,
+  int capacity,
+  int max_num_blocks,
+  int3* block_coords,
+  TSDF empty,
+  TSDF* voxels,
+  int* counters) {
+  int slot = blockIdx.x * blockDim.x + threadIdx.x;
+  if (slot >= capacity) {
+    return;
+  }
+  unsigned long long key = keys[slot];
+  if (key == kEmptyKey || values[slot] >= 0) {
+    return;
+  }
+
+  int index = atomicAdd(&counters[0], 1);
+  if (index >= max_num_blocks) {
+    atomicSub(&counters[0], 1);
+    atomicAdd(&counters[1], 1);
+    return;
+  }
+
+  values[slot] = index;
+  block_coords[index] = UnpackBlockKey(key);
+  TSDF* block_voxels = voxels + index * kNumVoxelsPerBlock;
+  for (int i = 0; i < kNumVoxelsPerBlock; ++i) {
+    block_voxels[i] = empty;
+  }
+}
+
+// Rebuilds the hash table from a list of block coordinates, where block i is
+// stored at pool index i.
+__global__
+void InsertBlocksKernel(const int3* block_coords,
+  int num_blocks,
+  unsigned long long* keys,
+  int* values,
+  unsigned int capacity_mask,
+  int* counters) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= num_blocks) {
+    return;
+  }
+  int3 block = block_coords[index];
+  unsigned long long key = PackBlockKey(block);
+  unsigned int slot = HashBlock(block) & capacity_mask;
+  for (int j = 0; j < kMaxProbes; ++j) {
+    unsigned long long old = atomicCAS(&keys[slot], kEmptyKey, key);
+    if (old == kEmptyKey) {
+      values[slot] = index;
+      return;
+    }
+    slot = (slot + 1) & capacity_mask;
+  }
+  atomicAdd(&counters[1], 1);
+}
+
+// Appends to visible_blocks the pool index of every allocated block that
+// FuseBlocksKernel could update: those that project into the depth map and are
+// not entirely behind the camera or beyond the far end of the truncation band.
+// The test uses the corners of each block and is conservative.
+__global__
+void CullBlocksKernel(float4x4 world_from_grid,
+  float max_tsdf_value,
+  float4 flpp,
+  float2 depth_min_max,
+  float4x4 camera_from_world,
+  int2 image_size,
+  const int3* block_coords,
+  int num_blocks,
+  int* visible_blocks,
+  int* num_visible_blocks) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= num_blocks) {
+    return;
+  }
+
+  int3 origin = kBlockSize * block_coords[index];
+  float2 uv_min = { 1e30f, 1e30f };
+  float2 uv_max = { -1e30f, -1e30f };
+  float min_depth = 1e30f;
+  int num_behind = 0;
+  for (int i = 0; i < 8; ++i) {
+    int3 corner = origin + kBlockSize *
+      int3{ i & 1, (i >> 1) & 1, (i >> 2) & 1 };
+    float3 corner_camera = make_float3(camera_from_world * make_float4(
+      transformPoint(world_from_grid, make_float3(corner)), 1.0f));
+    // OpenGL conventions: depth is negative in front of the camera.
+    if (corner_camera.z >= 0) {
+      ++num_behind;
+      continue;
+    }
+    float3 uvd = PixelFromCamera(corner_camera, flpp);
+    uv_min = fminf(uv_min, make_float2(uvd));
+    uv_max = fmaxf(uv_max, make_float2(uvd));
+    min_depth = fminf(min_depth, uvd.z);
+  }
+
+  if (num_behind == 8) {
+    return;
+  }
+  // A block that straddles the camera plane can project anywhere.
+  if (num_behind == 0) {
+    // Allow a pixel for rounding.
+    if (uv_max.x < -1 || uv_max.y < -1 ||
+      uv_min.x > image_size.x + 1 || uv_min.y > image_size.y + 1 ||
+      min_depth > depth_min_max.y + max_tsdf_value) {
+      return;
+    }
+  }
+  visible_blocks[atomicAdd(num_visible_blocks, 1)] = index;
+}
+
+// One thread block per entry of visible_blocks, one thread per voxel. Launched
+// with an upper bound on their number: the rest exit immediately.
+__global__
+void FuseBlocksKernel(float4x4 world_from_grid,
+  float max_tsdf_value,
+  float4 flpp,
+  float2 depth_min_max,
+  float4x4 camera_from_world,
+  KernelArray2D<const float> depth_map,
+  const int3* block_coords,
+  const int* visible_blocks,
+  const int* num_visible_blocks,
+  TSDF* voxels) {
+  if (static_cast<int>(blockIdx.x) >= *num_visible_blocks) {
+    return;
+  }
+  const int index = visible_blocks[blockIdx.x];
+  int3 local = { static_cast<int>(threadIdx.x),
+    static_cast<int>(threadIdx.y), static_cast<int>(threadIdx.z) };
+  int3 voxel = kBlockSize * block_coords[index] + local;
+
+  float4 voxel_center_world = make_float4(
+    transformPoint(world_from_grid,
+      float3{ voxel.x + 0.5f, voxel.y + 0.5f, voxel.z + 0.5f }),
+    1.0f);
+
+  // OpenGL conventions: depth is negative in front of the camera.
+  float4 voxel_center_camera = camera_from_world * voxel_center_world;
+  float2 uv = make_float2(PixelFromCamera(make_float3(voxel_center_camera),
+    flpp));
+  int2 uv_int = roundToInt(uv - float2{ 0.5f, 0.5f });
+
+  if (voxel_center_camera.z > 0 || !contains(depth_map.size(), uv_int)) {
+    return;
+  }
+
+  float image_depth = depth_map[uv_int];
+  if (image_depth < depth_min_max.x || image_depth > depth_min_max.y) {
+    return;
+  }
+
+  // Same sign convention and truncation as FuseKernel.
+  float dz = image_depth - (-voxel_center_camera.z);
+  if (dz >= -max_tsdf_value) {
+    dz = min(dz, max_tsdf_value);
+    const float weight = 1.0f;
+    voxels[index * kNumVoxelsPerBlock +
+      local.x + kBlockSize * (local.y + kBlockSize * local.z)].Update(
+        dz, weight, max_tsdf_value);
+  }
+}
+
+// Returns the ray parameter t at which the ray leaves block.
+__inline__ __device__
+float BlockExitT(float3 origin, float3 dir, int3 block) {
+  float3 box_min = make_float3(kBlockSize * block);
+  float3 box_max = box_min + make_float3(static_cast<float>(kBlockSize));
+  float t_exit = 1e30f;
+  if (dir.x > 0) t_exit = fminf(t_exit, (box_max.x - origin.x) / dir.x);
+  if (dir.x < 0) t_exit = fminf(t_exit, (box_min.x - origin.x) / dir.x);
+  if (dir.y > 0) t_exit = fminf(t_exit, (box_max.y - origin.y) / dir.y);
+  if (dir.y < 0) t_exit = fminf(t_exit, (box_min.y - origin.y) / dir.y);
+  if (dir.z > 0) t_exit = fminf(t_exit, (box_max.z - origin.z) / dir.z);
+  if (dir.z < 0) t_exit = fminf(t_exit, (box_min.z - origin.z) / dir.z);
+  return t_exit;
+}
+
+// Same as RaycastKernel / AdaptiveRaycastKernel except that unallocated blocks
+// are skipped in a single step. A sample inside an unallocated block always
+// has at least one unallocated tap, so no zero crossing is missed.
+template <bool kAdaptive>
+__global__
+void HashedRaycastKernel(VoxelHashView view,
+  int3 resolution,
+  float4x4 grid_from_world,
+  float4x4 world_from_grid,
+  float max_tsdf_value,
+  float voxels_per_meter,
+  float4 flpp,
+  float4x4 world_from_camera,
+  float3 eye_world,
+  KernelArray2D<float4> world_points_out,
+  KernelArray2D<float4> world_normals_out) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(world_points_out.size(), xy)) {
+    return;
+  }
+
+  float4 world_point = {};
+  float4 world_normal = {};
+
+  float3 dir_grid = normalize(transformVector(grid_from_world,
+    transformVector(world_from_camera, CameraDirectionFromPixel(xy, flpp))));
+  float3 eye_grid = transformPoint(grid_from_world, eye_world);
+
+  float t_near;
+  float t_far;
+  libcgt::cuda::Box3f bbox_grid(resolution);
+  bool intersected = libcgt::cuda::intersectLine(eye_grid, dir_grid,
+    bbox_grid, t_near, t_far);
+
+  if (intersected) {
+    float t_start = fmaxf(0, t_near) + kTEpsilon;
+    float t_end = fmaxf(0, t_far) - kTEpsilon;
+
+    BlockCache cache;
+    bool found_surface = false;
+
+    float prev_t = t_start;
+    float2 prev_sdf = {};
+    float curr_t = t_start;
+    float2 curr_sdf = HashedTrilinearSample(view, resolution,
+      eye_grid + curr_t * dir_grid, max_tsdf_value, cache);
+
+    while (curr_t < t_end) {
+      prev_t = curr_t;
+      prev_sdf = curr_sdf;
+
+      float step_size = kTStepSize;
+      if (kAdaptive) {
+        step_size = fmaxf(kTStepSize, (prev_sdf.y > 0) ?
+          prev_sdf.x * voxels_per_meter :
+          max_tsdf_value * voxels_per_meter);
+      }
+      if (prev_sdf.y == 0 && cache.index < 0) {
+        // The last sample's own block is empty: jump past it.
+        float3 p = eye_grid + prev_t * dir_grid;
+        int3 block = floorToInt(p / static_cast<float>(kBlockSize));
+        if (view.FindBlock(block) < 0) {
+          step_size = fmaxf(step_size,
+            BlockExitT(eye_grid, dir_grid, block) - prev_t + 1e-3f);
+        }
+      }
+
+      curr_t = prev_t + step_size;
+      curr_sdf = HashedTrilinearSample(view, resolution,
+        eye_grid + curr_t * dir_grid, max_tsdf_value, cache);
+
+      if (prev_sdf.y > 0 && curr_sdf.y > 0 &&
+        prev_sdf.x > 0 && curr_sdf.x < 0) {
+        found_surface = true;
+        break;
+      }
+    }
+
+    if (found_surface) {
+      float alpha = prev_sdf.x / (prev_sdf.x - curr_sdf.x);
+      float t_at_surface = lerp(prev_t, curr_t, alpha);
+      float3 surface_point_grid = eye_grid + t_at_surface * dir_grid;
+
+      world_point = make_float4(
+        transformPoint(world_from_grid, surface_point_grid), 1.0f);
+      float4 grid_normal = HashedTrilinearSampleNormal(view, resolution,
+        surface_point_grid, max_tsdf_value, cache);
+      if (grid_normal.w > 0) {
+        world_normal = make_float4(
+          normalize(transformVector(world_from_grid,
+            make_float3(grid_normal))),
+          1.0f);
+      }
+    }
+  }
+
+  world_points_out[xy] = world_point;
+  world_normals_out[xy] = world_normal;
+}
+
+int NextPowerOfTwo(int x) {
+  int p = 1;
+  while (p < x) {
+    p <<= 1;
+  }
+  return p;
+}
+
+}  // namespace
+
+VoxelHashedTSDF::VoxelHashedTSDF(const Vector3i& resolution,
+  const SimilarityTransform& world_from_grid, float max_tsdf_value,
+  int max_num_blocks) :
+  resolution_(resolution),
+  resolution_in_blocks_(
+    (resolution.x + kBlockSize - 1) / kBlockSize,
+    (resolution.y + kBlockSize - 1) / kBlockSize,
+    (resolution.z + kBlockSize - 1) / kBlockSize),
+  world_from_grid_(world_from_grid),
+  grid_from_world_(inverse(world_from_grid)),
+  max_tsdf_value_(max_tsdf_value),
+  max_num_blocks_(max_num_blocks),
+  // Keep the load factor at or below 0.5.
+  hash_keys_(NextPowerOfTwo(2 * max_num_blocks)),
+  hash_values_(NextPowerOfTwo(2 * max_num_blocks)),
+  block_coords_(max_num_blocks),
+  voxels_(static_cast<size_t>(max_num_blocks) * kNumVoxelsPerBlock),
+  visible_blocks_(max_num_blocks),
+  counters_(3) {
+  assert(VoxelSize() > 0);
+  assert(max_tsdf_value > 0);
+  assert(max_num_blocks > 0);
+  assert(resolution_in_blocks_.x <= (1 << kKeyBitsPerAxis) &&
+    resolution_in_blocks_.y <= (1 << kKeyBitsPerAxis) &&
+    resolution_in_blocks_.z <= (1 << kKeyBitsPerAxis));
+
+  Reset();
+}
+
+void VoxelHashedTSDF::Reset() {
+  // Blocks are cleared when they are (re)assigned, so only the table needs to
+  // be reset.
+  hash_keys_.fill(kEmptyKey);
+  hash_values_.fill(-1);
+  counters_.fill(0);
+  num_blocks_ = 0;
+}
+
+const SimilarityTransform& VoxelHashedTSDF::GridFromWorld() const {
+  return grid_from_world_;
+}
+
+const SimilarityTransform& VoxelHashedTSDF::WorldFromGrid() const {
+  return world_from_grid_;
+}
+
+Box3f VoxelHashedTSDF::BoundingBox() const {
+  return Box3f(resolution_);
+}
+
+Vector3i VoxelHashedTSDF::Resolution() const {
+  return resolution_;
+}
+
+float VoxelHashedTSDF::VoxelSize() const {
+  return world_from_grid_.scale;
+}
+
+Vector3f VoxelHashedTSDF::SideLengths() const {
+  return VoxelSize() * Resolution();
+}
+
+int VoxelHashedTSDF::NumAllocatedBlocks() const {
+  return num_blocks_;
+}
+
+int VoxelHashedTSDF::MaxNumBlocks() const {
+  return max_num_blocks_;
+}
+
+void VoxelHashedTSDF::AllocateBlocks(float4 flpp,
+  float2 depth_min_max,
+  float4x4 camera_from_world,
+  const DeviceArray2D<float>& depth_data,
+  cudaStream_t stream) {
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = libcgt::cuda::math::numBins2D(
+    { depth_data.width(), depth_data.height() },
+    block_dim
+  );
+
+  AllocateBlocksKernel<<<grid_dim, block_dim, 0, stream>>>(
+    flpp,
+    depth_min_max,
+    camera_from_world,
+    make_float4x4(grid_from_world_.asMatrix()),
+    max_tsdf_value_,
+    make_int3(resolution_in_blocks_),
+    depth_data.readView(),
+    hash_keys_.pointer(),
+    static_cast<unsigned int>(hash_keys_.length() - 1),
+    counters_.pointer());
+
+  AssignBlocks(stream);
+}
+
+void VoxelHashedTSDF::AssignBlocks(cudaStream_t stream) {
+  const int kThreadsPerBlock = 256;
+  int capacity = static_cast<int>(hash_keys_.length());
+  AssignBlocksKernel<<<
+    (capacity + kThreadsPerBlock - 1) / kThreadsPerBlock, kThreadsPerBlock,
+    0, stream>>>(
+    hash_keys_.pointer(),
+    hash_values_.pointer(),
+    capacity,
+    max_num_blocks_,
+    block_coords_.pointer(),
+    TSDF(0, 0, max_tsdf_value_),
+    voxels_.pointer(),
+    counters_.pointer());
+
+  // The number of allocated blocks sizes the fusion launch, so this is a
+  // synchronization point.
+  int counters[2];
+  cudaMemcpyAsync(counters, counters_.pointer(), sizeof(counters),
+    cudaMemcpyDeviceToHost, stream);
+  cudaStreamSynchronize(stream);
+  num_blocks_ = counters[0];
+  if (counters[1] > 0) {
+    fprintf(stderr, "VoxelHashedTSDF: %d block allocations failed "
+      "(%d of %d blocks in use).\n", counters[1], num_blocks_,
+      max_num_blocks_);
+    int zero = 0;
+    cudaMemcpyAsync(counters_.pointer() + 1, &zero, sizeof(int),
+      cudaMemcpyHostToDevice, stream);
+    cudaStreamSynchronize(stream);
+  }
+}
+
+void VoxelHashedTSDF::Fuse(const Vector4f& depth_camera_flpp,
+  const Range1f& depth_range,
+  const Matrix4f& camera_from_world,
+  const DeviceArray2D<float>& depth_data,
+  cudaStream_t stream,
+  FusionMethod method) {
+  FuseImpl(make_float4(depth_camera_flpp),
+    make_float2(depth_range.left(), depth_range.right()),
+    make_float4x4(camera_from_world),
+    depth_data, stream);
+}
+
+void VoxelHashedTSDF::FuseMultiple(
+  const std::vector<CalibratedPosedDepthCamera>& depth_cameras,
+  const std::vector<DeviceArray2D<float>>& depth_maps,
+  cudaStream_t stream) {
+  assert(depth_cameras.size() == depth_maps.size());
+  for (size_t i = 0; i < depth_cameras.size(); ++i) {
+    FuseImpl(depth_cameras[i].flpp, depth_cameras[i].depth_min_max,
+      depth_cameras[i].camera_from_world, depth_maps[i], stream);
+  }
+}
+
+void VoxelHashedTSDF::FuseImpl(float4 flpp,
+  float2 depth_min_max,
+  float4x4 camera_from_world,
+  const DeviceArray2D<float>& depth_data,
+  cudaStream_t stream) {
+  ScopedGPUTimer timer("VoxelHashedTSDF::Fuse", stream);
+  AllocateBlocks(flpp, depth_min_max, camera_from_world, depth_data, stream);
+  if (num_blocks_ == 0) {
+    return;
+  }
+
+  // Only blocks inside the camera frustum are swept. Their number stays on
+  // the device: the fusion launch is sized for all allocated blocks.
+  int* num_visible_blocks = counters_.pointer() + 2;
+  cudaMemsetAsync(num_visible_blocks, 0, sizeof(int), stream);
+  const int kThreadsPerBlock = 256;
+  CullBlocksKernel<<<
+    (num_blocks_ + kThreadsPerBlock - 1) / kThreadsPerBlock, kThreadsPerBlock,
+    0, stream>>>(
+    make_float4x4(world_from_grid_.asMatrix()),
+    max_tsdf_value_,
+    flpp,
+    depth_min_max,
+    camera_from_world,
+    make_int2(depth_data.width(), depth_data.height()),
+    block_coords_.pointer(),
+    num_blocks_,
+    visible_blocks_.pointer(),
+    num_visible_blocks);
+
+  dim3 block_dim(kBlockSize, kBlockSize, kBlockSize);
+  FuseBlocksKernel<<<num_blocks_, block_dim, 0, stream>>>(
+    make_float4x4(world_from_grid_.asMatrix()),
+    max_tsdf_value_,
+    flpp,
+    depth_min_max,
+    camera_from_world,
+    depth_data.readView(),
+    block_coords_.pointer(),
+    visible_blocks_.pointer(),
+    num_visible_blocks,
+    voxels_.pointer());
+}
+
+template <bool kAdaptive>
+void VoxelHashedTSDF::RaycastImpl(const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out,
+  cudaStream_t stream) {
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = libcgt::cuda::math::numBins2D(
+    { world_points_out.width(), world_points_out.height() },
+    block_dim
+  );
+
+  VoxelHashView view;
+  view.keys = hash_keys_.pointer();
+  view.values = hash_values_.pointer();
+  view.voxels = voxels_.pointer();
+  view.capacity_mask = static_cast<unsigned int>(hash_keys_.length() - 1);
+  view.resolution_in_blocks = make_int3(resolution_in_blocks_);
+
+  Vector4f eye = world_from_camera * Vector4f(0, 0, 0, 1);
+
+  ScopedGPUTimer timer(kAdaptive ? "VoxelHashedTSDF::AdaptiveRaycast" :
+    "VoxelHashedTSDF::Raycast", stream);
+  HashedRaycastKernel<kAdaptive><<<grid_dim, block_dim, 0, stream>>>(
+    view,
+    make_int3(resolution_),
+    make_float4x4(grid_from_world_.asMatrix()),
+    make_float4x4(world_from_grid_.asMatrix()),
+    max_tsdf_value_,
+    1.0f / VoxelSize(),
+    make_float4(camera_flpp),
+    make_float4x4(world_from_camera),
+    make_float3(eye.xyz),
+    world_points_out.writeView(),
+    world_normals_out.writeView());
+}
+
+void VoxelHashedTSDF::AdaptiveRaycast(const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out,
+  cudaStream_t stream,
+  RaycastSampling sampling) {
+  RaycastImpl<true>(camera_flpp, world_from_camera,
+    world_points_out, world_normals_out, stream);
+}
+
+void VoxelHashedTSDF::Raycast(const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out,
+  cudaStream_t stream,
+  RaycastSampling sampling) {
+  RaycastImpl<false>(camera_flpp, world_from_camera,
+    world_points_out, world_normals_out, stream);
+}
+
+TriangleMesh VoxelHashedTSDF::Triangulate() const {
+  ScopedCPUTimer timer("VoxelHashedTSDF::Triangulate");
+
+  std::vector<int3> block_coords(num_blocks_);
+  std::vector<TSDF> voxels(
+    static_cast<size_t>(num_blocks_) * kNumVoxelsPerBlock);
+  if (num_blocks_ > 0) {
+    cudaMemcpy(block_coords.data(), block_coords_.pointer(),
+      block_coords.size() * sizeof(int3), cudaMemcpyDeviceToHost);
+    cudaMemcpy(voxels.data(), voxels_.pointer(),
+      voxels.size() * sizeof(TSDF), cudaMemcpyDeviceToHost);
+  }
+
+  std::unordered_map<unsigned long long, int> block_indices;
+  for (int i = 0; i < num_blocks_; ++i) {
+    block_indices[PackBlockKey(block_coords[i])] = i;
+  }
+
+  const TSDF empty(0, 0, max_tsdf_value_);
+  std::vector<Vector3f> positions;
+  std::vector<Vector3f> normals;
+
+  // Marching cubes needs two extra samples along each axis: one for the far
+  // corner of the last cell and one for its forward-difference normal.
+  const int kPaddedSize = kBlockSize + 2;
+  Array3D<TSDF> padded({ kPaddedSize, kPaddedSize, kPaddedSize });
+  for (int b = 0; b < num_blocks_; ++b) {
+    int3 origin = kBlockSize * block_coords[b];
+    for (int z = 0; z < kPaddedSize; ++z) {
+      for (int y = 0; y < kPaddedSize; ++y) {
+        for (int x = 0; x < kPaddedSize; ++x) {
+          int3 voxel = origin + int3{ x, y, z };
+          int3 block = { voxel.x / kBlockSize, voxel.y / kBlockSize,
+            voxel.z / kBlockSize };
+          TSDF value = empty;
+          auto itr = block_indices.find(PackBlockKey(block));
+          if (itr != block_indices.end()) {
+            int3 local = voxel - kBlockSize * block;
+            value = voxels[itr->second * kNumVoxelsPerBlock +
+              local.x + kBlockSize * (local.y + kBlockSize * local.z)];
+          }
+          padded[{ x, y, z }] = value;
+        }
+      }
+    }
+
+    AppendMarchingCubes(padded, max_tsdf_value_,
+      world_from_grid_ *
+        SimilarityTransform(Vector3f(static_cast<float>(origin.x),
+          static_cast<float>(origin.y), static_cast<float>(origin.z))),
+      positions, normals);
+  }
+
+  return ConstructMarchingCubesMesh(positions, normals);
+}
+
+bool VoxelHashedTSDF::Load(const std::string& filename,
+  cudaStream_t stream) {
+  // The format has no encoding field: voxels are always D16_W16.
+  if (TSDF::kEncoding != TSDFEncoding::D16_W16) {
+    return false;
+  }
+
+  BinaryFileInputStream in(filename);
+
+  const char kMagic[] = { 't', 's', 'd', 'f', 'v', 'h' };
+  for (char expected : kMagic) {
+    uint8_t c = 0;
+    in.read(c);
+    if (c != static_cast<uint8_t>(expected)) {
+      return false;
+    }
+  }
+
+  int32_t version;
+  in.read(version);
+  if (version != 1) {
+    return false;
+  }
+
+  Vector3i resolution;
+  in.read(resolution);
+
+  Matrix4f world_from_grid_matrix;
+  in.read(world_from_grid_matrix);
+
+  float max_tsdf_value;
+  in.read(max_tsdf_value);
+
+  int32_t block_size;
+  in.read(block_size);
+
+  int32_t num_blocks;
+  in.read(num_blocks);
+
+  if (block_size != kBlockSize || num_blocks < 0 ||
+    num_blocks > max_num_blocks_) {
+    return false;
+  }
+
+  // Block coordinates are packed into kKeyBitsPerAxis bits each, so both the
+  // resolution and every block must fit.
+  const int kMaxResolution = kBlockSize << kKeyBitsPerAxis;
+  if (resolution.x <= 0 || resolution.y <= 0 || resolution.z <= 0 ||
+    resolution.x > kMaxResolution || resolution.y > kMaxResolution ||
+    resolution.z > kMaxResolution) {
+    fprintf(stderr, "VoxelHashedTSDF::Load(): %s has unsupported resolution "
+      "%d x %d x %d.\n", filename.c_str(),
+      resolution.x, resolution.y, resolution.z);
+    return false;
+  }
+  const Vector3i resolution_in_blocks(
+    (resolution.x + kBlockSize - 1) / kBlockSize,
+    (resolution.y + kBlockSize - 1) / kBlockSize,
+    (resolution.z + kBlockSize - 1) / kBlockSize);
+
+  std::vector<int3> block_coords(num_blocks);
+  std::vector<TSDF> voxels(
+    static_cast<size_t>(num_blocks) * kNumVoxelsPerBlock);
+  in.readArray(writeViewOf(block_coords));
+  in.readArray(writeViewOf(voxels));
+
+  std::unordered_set<unsigned long long> keys;
+  for (const int3& block : block_coords) {
+    if (!ContainsBlock(make_int3(resolution_in_blocks), block) ||
+      !keys.insert(PackBlockKey(block)).second) {
+      fprintf(stderr, "VoxelHashedTSDF::Load(): %s has an invalid or "
+        "duplicate block (%d, %d, %d).\n", filename.c_str(),
+        block.x, block.y, block.z);
+      return false;
+    }
+  }
+
+  resolution_ = resolution;
+  resolution_in_blocks_ = resolution_in_blocks;
+  world_from_grid_ = SimilarityTransform::fromMatrix(world_from_grid_matrix);
+  grid_from_world_ = inverse(world_from_grid_);
+  max_tsdf_value_ = max_tsdf_value;
+
+  // Same as Reset(), but on stream: kEmptyKey and -1 are all ones.
+  cudaMemsetAsync(hash_keys_.pointer(), 0xff,
+    hash_keys_.length() * sizeof(unsigned long long), stream);
+  cudaMemsetAsync(hash_values_.pointer(), 0xff,
+    hash_values_.length() * sizeof(int), stream);
+  int counters[2] = { num_blocks, 0 };
+  cudaMemcpyAsync(counters_.pointer(), counters, sizeof(counters),
+    cudaMemcpyHostToDevice, stream);
+  num_blocks_ = num_blocks;
+
+  if (num_blocks > 0) {
+    cudaMemcpyAsync(block_coords_.pointer(), block_coords.data(),
+      block_coords.size() * sizeof(int3), cudaMemcpyHostToDevice, stream);
+    cudaMemcpyAsync(voxels_.pointer(), voxels.data(),
+      voxels.size() * sizeof(TSDF), cudaMemcpyHostToDevice, stream);
+
+    const int kThreadsPerBlock = 256;
+    InsertBlocksKernel<<<
+      (num_blocks + kThreadsPerBlock - 1) / kThreadsPerBlock,
+      kThreadsPerBlock, 0, stream>>>(
+      block_coords_.pointer(),
+      num_blocks,
+      hash_keys_.pointer(),
+      hash_values_.pointer(),
+      static_cast<unsigned int>(hash_keys_.length() - 1),
+      counters_.pointer());
+
+    cudaMemcpyAsync(counters, counters_.pointer(), sizeof(counters),
+      cudaMemcpyDeviceToHost, stream);
+  }
+  // counters and the host arrays must outlive the copies.
+  cudaStreamSynchronize(stream);
+
+  if (counters[1] > 0) {
+    fprintf(stderr, "VoxelHashedTSDF::Load(): %d of %d blocks in %s could "
+      "not be inserted.\n", counters[1], num_blocks, filename.c_str());
+    Reset();
+    return false;
+  }
+  return true;
+}
+
+bool VoxelHashedTSDF::Save(const std::string& filename) const {
+  if (TSDF::kEncoding != TSDFEncoding::D16_W16) {
+    return false;
+  }
+
+  BinaryFileOutputStream out(filename);
+
+  // Write magic header: 'tsdfvh'.
+  out.write('t');
+  out.write('s');
+  out.write('d');
+  out.write('f');
+  out.write('v');
+  out.write('h');
+  out.write<int32_t>(1);
+
+  out.write(resolution_);
+  out.write(world_from_grid_.asMatrix());
+  out.write(max_tsdf_value_);
+  out.write<int32_t>(kBlockSize);
+  out.write<int32_t>(num_blocks_);
+
+  std::vector<int3> block_coords(num_blocks_);
+  std::vector<TSDF> voxels(
+    static_cast<size_t>(num_blocks_) * kNumVoxelsPerBlock);
+  if (num_blocks_ > 0) {
+    cudaMemcpy(block_coords.data(), block_coords_.pointer(),
+      block_coords.size() * sizeof(int3), cudaMemcpyDeviceToHost);
+    cudaMemcpy(voxels.data(), voxels_.pointer(),
+      voxels.size() * sizeof(TSDF), cudaMemcpyDeviceToHost);
+  }
+  out.writeArray(readViewOf(block_coords));
+  out.writeArray(readViewOf(voxels));
+
+  return out.close();
+}
@@ -0,0 +1,179 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef VOXEL_HASHED_TSDF_H
+#define VOXEL_HASHED_TSDF_H
+
+#include <vector>
+
+#include "libcgt/core/geometry/TriangleMesh.h"
+#include "libcgt/core/vecmath/Box3f.h"
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Range1f.h"
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+#include "libcgt/cuda/DeviceArray1D.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+#include "libcgt/cuda/float4x4.h"
+
+#include "calibrated_posed_depth_camera.h"
+#include "tsdf.h"
+#include "tsdf_volume.h"
+
+// A sparse TSDF that only allocates voxels near observed surfaces.
+//
+// The volume is partitioned into kBlockSize^3 voxel blocks. Blocks are
+// allocated on demand (the first time a depth observation's truncation band
+// touches them) from a fixed-size pool and located through an open-addressing
+// hash table on the device. Memory therefore scales with surface area rather
+// than with the volume of the bounding box.
+//
+// Resolution() only bounds the addressable region: it can be much larger than
+// would fit in a RegularGridTSDF.
+class VoxelHashedTSDF : public TSDFVolume {
+public:
+
+  // Side length of one block, in voxels.
+  static constexpr int kBlockSize = 8;
+  static constexpr int kNumVoxelsPerBlock =
+    kBlockSize * kBlockSize * kBlockSize;
+
+  // resolution: number of addressable voxels in each direction.
+  // world_from_grid: transform mapping grid indices to world coordinates.
+  // max_tsdf_value: the representable range of the TSDF. Set to
+  //   [-max_tsdf_value, max_tsdf_value]. Also the truncation band used to
+  //   decide which blocks to allocate.
+  // max_num_blocks: capacity of the block pool. Each block costs
+  //   kNumVoxelsPerBlock * sizeof(TSDF) bytes plus hash table overhead.
+  VoxelHashedTSDF(const Vector3i& resolution,
+    const SimilarityTransform& world_from_grid,
+    float max_tsdf_value,
+    int max_num_blocks);
+
+  void Reset() override;
+
+  // Blocks are allocated from the truncation band and then the allocated
+  // blocks inside the camera frustum are swept: method is ignored and always
+  // behaves as FusionMethod::VOXEL_SWEEP.
+  void Fuse(const Vector4f& depth_camera_flpp,
+    const Range1f& depth_camera_range,
+    const Matrix4f& depth_camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    cudaStream_t stream = 0,
+    FusionMethod method = FusionMethod::VOXEL_SWEEP) override;
+
+  // Fuses each camera in turn.
+  void FuseMultiple(
+    const std::vector<CalibratedPosedDepthCamera>& depth_cameras,
+    const std::vector<DeviceArray2D<float>>& depth_maps,
+    cudaStream_t stream = 0) override;
+
+  // Blocks are not mirrored into a texture: sampling is ignored and always
+  // behaves as RaycastSampling::VOXEL_ARRAY.
+  void AdaptiveRaycast(const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) override;
+
+  void Raycast(const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaStream_t stream = 0,
+    RaycastSampling sampling = RaycastSampling::VOXEL_ARRAY) override;
+
+  const SimilarityTransform& GridFromWorld() const override;
+  const SimilarityTransform& WorldFromGrid() const override;
+  Box3f BoundingBox() const override;
+  Vector3i Resolution() const override;
+  float VoxelSize() const override;
+  Vector3f SideLengths() const override;
+
+  // Meshes each allocated block independently (with a one voxel apron read
+  // from its neighbors) and welds the result.
+  TriangleMesh Triangulate() const override;
+
+  // Only allocated blocks are stored. The format is:
+  // 'tsdfvh', int32 version, Vector3i resolution, Matrix4f world_from_grid,
+  // float max_tsdf_value, int32 block_size, int32 num_blocks,
+  // num_blocks x Vector3i block coordinates, then the voxels of each block
+  // (x fastest). Both fail unless TSDF is TSDFEncoding::D16_W16.
+  bool Load(const std::string& filename, cudaStream_t stream = 0) override;
+  bool Save(const std::string& filename) const override;
+
+  // The number of blocks currently allocated.
+  int NumAllocatedBlocks() const;
+
+  // The capacity of the block pool.
+  int MaxNumBlocks() const;
+
+private:
+
+  void FuseImpl(float4 flpp,
+    float2 depth_min_max,
+    float4x4 camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    cudaStream_t stream);
+
+  // Inserts all blocks touched by the truncation band of depth_data into the
+  // hash table and assigns them storage from the pool.
+  void AllocateBlocks(float4 flpp,
+    float2 depth_min_max,
+    float4x4 camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    cudaStream_t stream);
+
+  // Gives every hash table entry without storage a block from the pool, and
+  // updates num_blocks_.
+  void AssignBlocks(cudaStream_t stream);
+
+  template <bool kAdaptive>
+  void RaycastImpl(const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out,
+    cudaStream_t stream);
+
+  Vector3i resolution_;
+  Vector3i resolution_in_blocks_;
+
+  SimilarityTransform grid_from_world_;
+  SimilarityTransform world_from_grid_;
+
+  float max_tsdf_value_;
+
+  int max_num_blocks_;
+  // Host copy of the number of allocated blocks.
+  int num_blocks_ = 0;
+
+  // Hash table: packed block coordinates --> index into the block pool.
+  // Capacity is a power of two.
+  DeviceArray1D<unsigned long long> hash_keys_;
+  DeviceArray1D<int> hash_values_;
+
+  // Block pool.
+  DeviceArray1D<int3> block_coords_;
+  DeviceArray1D<TSDF> voxels_;
+
+  // Pool indices of the blocks inside the frustum of the camera being fused.
+  DeviceArray1D<int> visible_blocks_;
+
+  // [0]: number of blocks handed out, [1]: number of failed allocations,
+  // [2]: number of entries in visible_blocks_.
+  DeviceArray1D<int> counters_;
+};
+
+#endif  // VOXEL_HASHED_TSDF_H